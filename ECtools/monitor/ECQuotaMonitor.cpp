@@ -3,11 +3,18 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
+#include <unistd.h>
 #include <kopano/memory.hpp>
 #include <mapi.h>
 #include <mapix.h>
@@ -27,6 +34,7 @@
 #include <kopano/ECTags.h>
 #include <kopano/IECInterfaces.hpp>
 #include <kopano/CommonUtil.h>
+#include <kopano/fileutil.hpp>
 #include <kopano/stringutil.h>
 #include <kopano/timeutil.hpp>
 #include <kopano/mapiext.h>
@@ -63,15 +71,16 @@ void* ECQuotaMonitor::Create(void* lpVoid)
 	std::unique_ptr<ECQuotaMonitor> lpecQuotaMonitor;
 	object_ptr<IMAPISession> lpMAPIAdminSession;
 	object_ptr<IMsgStore> lpMDBAdmin;
+	auto lpConfig = lpThreadMonitor->lpConfig.get();
 
-	const char *lpPath = lpThreadMonitor->lpConfig->GetSetting("server_socket");
+	const char *lpPath = lpConfig->GetSetting("server_socket");
 	ec_log_info("Quota monitor starting");
 
 	//Open admin session
 	auto hr = HrOpenECAdminSession(&~lpMAPIAdminSession, PROJECT_VERSION,
 	          "monitor:create", lpPath, 0,
-	          lpThreadMonitor->lpConfig->GetSetting("sslkey_file", "", nullptr),
-	          lpThreadMonitor->lpConfig->GetSetting("sslkey_pass", "", nullptr));
+	          lpConfig->GetSetting("sslkey_file", "", nullptr),
+	          lpConfig->GetSetting("sslkey_pass", "", nullptr));
 	if (hr != hrSuccess) {
 		kc_perror("Unable to open an admin session", hr);
 		return NULL;
@@ -86,18 +95,51 @@ void* ECQuotaMonitor::Create(void* lpVoid)
 	}
 
 	lpecQuotaMonitor.reset(new ECQuotaMonitor(lpThreadMonitor, lpMAPIAdminSession, lpMDBAdmin));
+	auto ulThreads = atoui(lpConfig->GetSetting("quota_threads"));
+	if (ulThreads > 1)
+		lpecQuotaMonitor->m_pool.reset(new ECThreadPool(ulThreads));
+	auto lpszStateFile = lpConfig->GetSetting("quota_state_file");
+	if (lpszStateFile != nullptr && *lpszStateFile != '\0')
+		lpecQuotaMonitor->m_state.Load(lpszStateFile);
 
 	// Check the quota of all stores
 	auto tmStart = GetProcessTime();
 	hr = lpecQuotaMonitor->CheckQuota();
 	auto tmEnd = GetProcessTime();
-	if(hr != hrSuccess)
+	lpecQuotaMonitor->m_pool.reset();
+	if(hr != hrSuccess) {
 		kc_perror("Quota monitor failed", hr);
-	else
-		ec_log_info("Quota monitor done in %lu seconds. Processed: %u, Failed: %u", tmEnd - tmStart, lpecQuotaMonitor->m_ulProcessed, lpecQuotaMonitor->m_ulFailed);
+		return NULL;
+	}
+	ec_log_info("Quota monitor done in %lu seconds. Processed: %u, Failed: %u, Not due: %u",
+		tmEnd - tmStart, lpecQuotaMonitor->m_ulProcessed.load(),
+		lpecQuotaMonitor->m_ulFailed.load(), lpecQuotaMonitor->m_ulSkipped.load());
+	if (lpszStateFile != nullptr && *lpszStateFile != '\0')
+		lpecQuotaMonitor->m_state.Save(lpszStateFile);
 	return NULL;
 }
 
+/**
+ * Opens an admin session and the store of the SYSTEM user on the server
+ * at @path.
+ */
+HRESULT ECQuotaMonitor::OpenAdminSession(ECTHREADMONITOR *lpThreadMonitor,
+    const char *path, const char *ident, IMAPISession **lppSession,
+    IMsgStore **lppStore)
+{
+	object_ptr<IMAPISession> lpSession;
+	auto hr = HrOpenECAdminSession(&~lpSession, PROJECT_VERSION, ident, path, 0,
+	          lpThreadMonitor->lpConfig->GetSetting("sslkey_file", "", nullptr),
+	          lpThreadMonitor->lpConfig->GetSetting("sslkey_pass", "", nullptr));
+	if (hr != hrSuccess)
+		return hr;
+	hr = HrOpenDefaultStore(lpSession, lppStore);
+	if (hr != hrSuccess)
+		return hr;
+	*lppSession = lpSession.release();
+	return hrSuccess;
+}
+
 /** Gets a list of companies and checks the quota. Then it calls
  * ECQuotaMonitor::CheckCompanyQuota() to check quota of the users
  * in the company. If the server is not running in hosted mode,
@@ -231,7 +273,7 @@ HRESULT ECQuotaMonitor::CheckCompanyQuota(ECCOMPANY *lpecCompany)
 
 	if (setServers.empty()) {
 		// call server function with current lpMDBAdmin / lpServiceAdmin
-		hr = CheckServerQuota(cUsers, lpsUserList, lpecCompany, m_lpMDBAdmin);
+		hr = CheckServerQuota(cUsers, lpsUserList, lpecCompany, m_lpMDBAdmin, "");
 		if (hr != hrSuccess)
 			return kc_perror("Unable to check server quota", hr);
 		return hrSuccess;
@@ -248,6 +290,16 @@ HRESULT ECQuotaMonitor::CheckCompanyQuota(ECCOMPANY *lpecCompany)
 		if (!setServersConfig.empty() &&
 		    setServersConfig.find(server.c_str()) == setServersConfig.cend())
 			continue;
+		if (m_stats.find(server) != m_stats.cend()) {
+			/* Stats table already read for an earlier company */
+			hr = CheckServerQuota(cUsers, lpsUserList, lpecCompany, nullptr, server);
+			if (hr != hrSuccess) {
+				ec_log_err("Unable to check quota on server \"%s\": %s (%x)",
+					server.c_str(), GetMAPIErrorMessage(hr), hr);
+				++m_ulFailed;
+			}
+			continue;
+		}
 		hr = lpServiceAdmin->ResolvePseudoUrl(std::string("pseudo://" + server).c_str(), &~lpszConnection, &bIsPeer);
 		if (hr != hrSuccess) {
 			ec_log_err("Unable to resolve servername \"%s\": %s (%x)",
@@ -272,26 +324,17 @@ HRESULT ECQuotaMonitor::CheckCompanyQuota(ECCOMPANY *lpecCompany)
 				continue;
 			}
 		} else {
-			hr = HrOpenECAdminSession(&~lpSession, PROJECT_VERSION,
-			     "monitor:check-company", lpszConnection, 0,
-			     m_lpThreadMonitor->lpConfig->GetSetting("sslkey_file", "", nullptr),
-			     m_lpThreadMonitor->lpConfig->GetSetting("sslkey_pass", "", nullptr));
+			hr = OpenAdminSession(m_lpThreadMonitor, lpszConnection,
+			     "monitor:check-company", &~lpSession, &~lpAdminStore);
 			if (hr != hrSuccess) {
 				ec_log_err("Unable to connect to server \"%s\": %s (%x)",
 					lpszConnection.get(), GetMAPIErrorMessage(hr), hr);
 				++m_ulFailed;
 				continue;
 			}
-			hr = HrOpenDefaultStore(lpSession, &~lpAdminStore);
-			if (hr != hrSuccess) {
-				ec_log_err("Unable to open admin store on server \"%s\": %s (%x)",
-					lpszConnection.get(), GetMAPIErrorMessage(hr), hr);
-				++m_ulFailed;
-				continue;
-			}
 		}
 
-		hr = CheckServerQuota(cUsers, lpsUserList, lpecCompany, lpAdminStore);
+		hr = CheckServerQuota(cUsers, lpsUserList, lpecCompany, lpAdminStore, server);
 		if (hr != hrSuccess) {
 			ec_log_err("Unable to check quota on server \"%s\": %s (%x)",
 				lpszConnection.get(), GetMAPIErrorMessage(hr), hr);
@@ -302,26 +345,33 @@ HRESULT ECQuotaMonitor::CheckCompanyQuota(ECCOMPANY *lpecCompany)
 }
 
 /**
- * Checks in the ECStatsTable PR_EC_STATSTABLE_USERS for quota
- * information per connected server given in lpAdminStore.
+ * Reads the ECStatsTable PR_EC_STATSTABLE_USERS of a server: the store
+ * size and quota limits of all its users in one table. The rows are kept
+ * for the rest of the run, so that in hosted mode the table is not read
+ * again for every company.
  *
- * @param[in]	cUsers		number of users in lpsUserList
- * @param[in]	lpsUserList	array of ECUser struct, containing all Kopano from all companies, on any server
- * @param[in]	lpecCompany	same company struct as in ECQuotaMonitor::CheckCompanyQuota()
- * @param[in]	lpAdminStore IMsgStore of SYSTEM user on a specific server instance.
+ * @param[in]	server		key of the server in the cache ("" for the one at server_socket)
+ * @param[in]	lpAdminStore	IMsgStore of SYSTEM user on the server, only used when the table has not been read yet
+ * @param[out]	lppRows		rows of users with a non-empty store
  * @return hrSuccess or any MAPI error code.
  */
-HRESULT ECQuotaMonitor::CheckServerQuota(ULONG cUsers, ECUSER *lpsUserList,
-    ECCOMPANY *lpecCompany, LPMDB lpAdminStore)
+HRESULT ECQuotaMonitor::GetServerStats(const std::string &server,
+    IMsgStore *lpAdminStore, const std::vector<QuotaStatsRow> **lppRows)
 {
-	SPropValue sRestrictProp;
+	auto iter = m_stats.find(server);
+	if (iter != m_stats.cend()) {
+		*lppRows = &iter->second;
+		return hrSuccess;
+	}
+	if (lpAdminStore == nullptr)
+		return MAPI_E_INVALID_PARAMETER;
+
 	object_ptr<IMAPITable> lpTable;
-	ECQUOTASTATUS sQuotaStatus;
-	ULONG i, u;
-	static constexpr const SizedSPropTagArray(5, sCols) =
-		{5, {PR_EC_USERNAME_A, PR_MESSAGE_SIZE_EXTENDED,
+	std::vector<QuotaStatsRow> rows;
+	static constexpr const SizedSPropTagArray(6, sCols) =
+		{6, {PR_EC_USERNAME_A, PR_MESSAGE_SIZE_EXTENDED,
 		PR_QUOTA_WARNING_THRESHOLD, PR_QUOTA_SEND_THRESHOLD,
-		PR_QUOTA_RECEIVE_THRESHOLD}};
+		PR_QUOTA_RECEIVE_THRESHOLD, PR_EC_COMPANY_NAME_A}};
 
 	auto hr = lpAdminStore->OpenProperty(PR_EC_STATSTABLE_USERS, &IID_IMAPITable, 0, 0, &~lpTable);
 	if (hr != hrSuccess)
@@ -330,81 +380,290 @@ HRESULT ECQuotaMonitor::CheckServerQuota(ULONG cUsers, ECUSER *lpsUserList,
 	if (hr != hrSuccess)
 		return kc_perror("Unable to set columns on stats table for quota sizes", hr);
 
-	if (lpecCompany->sCompanyId.cb != 0 && lpecCompany->sCompanyId.lpb != NULL) {
-		sRestrictProp.ulPropTag = PR_EC_COMPANY_NAME_A;
-		sRestrictProp.Value.lpszA = (char*)lpecCompany->lpszCompanyname;
-
-		memory_ptr<SRestriction> lpsRestriction;
-		hr = ECOrRestriction(
-			ECNotRestriction(ECExistRestriction(PR_EC_COMPANY_NAME_A)) +
-			ECPropertyRestriction(RELOP_EQ, PR_EC_COMPANY_NAME_A, &sRestrictProp, ECRestriction::Cheap)
-		).CreateMAPIRestriction(&~lpsRestriction, ECRestriction::Cheap);
-		if (hr != hrSuccess)
-			return hr;
-		hr = lpTable->Restrict(lpsRestriction, MAPI_DEFERRED_ERRORS);
-		if (hr != hrSuccess)
-			return kc_perror("Unable to restrict stats table", hr);
-	}
-
 	while (TRUE) {
 		rowset_ptr lpRowSet;
-		hr = lpTable->QueryRows(50, 0, &~lpRowSet);
+		hr = lpTable->QueryRows(1000, 0, &~lpRowSet);
 		if (hr != hrSuccess)
 			return kc_perror("Unable to receive stats table data", hr);
 		if (lpRowSet->cRows == 0)
 			break;
 
-		for (i = 0; i < lpRowSet->cRows; ++i) {
-			MsgStorePtr ptrStore;
+		for (unsigned int i = 0; i < lpRowSet->cRows; ++i) {
 			auto lpUsername  = lpRowSet[i].cfind(PR_EC_USERNAME_A);
 			auto lpStoreSize = lpRowSet[i].cfind(PR_MESSAGE_SIZE_EXTENDED);
 			auto lpQuotaWarn = lpRowSet[i].cfind(PR_QUOTA_WARNING_THRESHOLD);
 			auto lpQuotaSoft = lpRowSet[i].cfind(PR_QUOTA_SEND_THRESHOLD);
 			auto lpQuotaHard = lpRowSet[i].cfind(PR_QUOTA_RECEIVE_THRESHOLD);
+			auto lpCompany   = lpRowSet[i].cfind(PR_EC_COMPANY_NAME_A);
 			if (!lpUsername || !lpStoreSize)
 				continue;		// don't log error: could be for several valid reasons (contacts, other server, etc)
-
 			if (lpStoreSize->Value.li.QuadPart == 0)
 				continue;
 
-			++m_ulProcessed;
+			QuotaStatsRow row;
+			row.strUserName = lpUsername->Value.lpszA;
+			row.llStoreSize = lpStoreSize->Value.li.QuadPart;
+			row.ulWarn = lpQuotaWarn != nullptr ? lpQuotaWarn->Value.ul : 0;
+			row.ulSoft = lpQuotaSoft != nullptr ? lpQuotaSoft->Value.ul : 0;
+			row.ulHard = lpQuotaHard != nullptr ? lpQuotaHard->Value.ul : 0;
+			row.bHasCompany = lpCompany != nullptr;
+			if (lpCompany != nullptr)
+				row.strCompany = lpCompany->Value.lpszA;
+			rows.emplace_back(std::move(row));
+		}
+	}
+	*lppRows = &m_stats.emplace(server, std::move(rows)).first->second;
+	return hrSuccess;
+}
 
-			memset(&sQuotaStatus, 0, sizeof(ECQUOTASTATUS));
+namespace {
 
-			sQuotaStatus.llStoreSize = lpStoreSize->Value.li.QuadPart;
-			sQuotaStatus.quotaStatus = QUOTA_OK;
-			if (lpQuotaHard && lpQuotaHard->Value.ul > 0 && lpStoreSize->Value.li.QuadPart > ((long long)lpQuotaHard->Value.ul * 1024))
-				sQuotaStatus.quotaStatus = QUOTA_HARDLIMIT;
-			else if (lpQuotaSoft && lpQuotaSoft->Value.ul > 0 && lpStoreSize->Value.li.QuadPart > ((long long)lpQuotaSoft->Value.ul * 1024))
-				sQuotaStatus.quotaStatus = QUOTA_SOFTLIMIT;
-			else if (lpQuotaWarn && lpQuotaWarn->Value.ul > 0 && lpStoreSize->Value.li.QuadPart > ((long long)lpQuotaWarn->Value.ul * 1024))
-				sQuotaStatus.quotaStatus = QUOTA_WARN;
+/* Sends the quota mail for one user on the thread pool */
+class QuotaNotifyTask final : public ECWaitableTask {
+public:
+	QuotaNotifyTask(ECQuotaMonitor *mon, ECUSER *user, ECCOMPANY *company,
+	    const ECQUOTASTATUS &status) :
+		m_user(user), m_mon(mon), m_company(company), m_status(status)
+	{}
 
-			if (sQuotaStatus.quotaStatus == QUOTA_OK)
-				continue;
+	ECUSER *m_user;
+	HRESULT m_result = hrSuccess;
+	time_t m_mail_time = 0;
 
-			ec_log_err("Mailbox of user \"%s\" has exceeded its %s limit", lpUsername->Value.lpszA, sQuotaStatus.quotaStatus == QUOTA_WARN ? "warning" : sQuotaStatus.quotaStatus == QUOTA_SOFTLIMIT ? "soft" : "hard");
-			// find the user in the full users list
-			for (u = 0; u < cUsers; ++u) {
-				if (strcmp((char*)lpsUserList[u].lpszUsername, lpUsername->Value.lpszA) == 0)
-					break;
-			}
-			if (u == cUsers) {
-				ec_log_err("Unable to find user \"%s\" in userlist", lpUsername->Value.lpszA);
-				++m_ulFailed;
-				continue;
-			}
-			hr = OpenUserStore(lpsUserList[u].lpszUsername, ACTIVE_USER, &~ptrStore);
-			if (hr != hrSuccess)
-				continue;
-			hr = Notify(&lpsUserList[u], lpecCompany, &sQuotaStatus, ptrStore);
+protected:
+	void run() override
+	{
+		m_result = m_mon->NotifyUser(m_user, m_company, &m_status, &m_mail_time);
+	}
+
+private:
+	ECQuotaMonitor *m_mon;
+	ECCOMPANY *m_company;
+	ECQUOTASTATUS m_status;
+};
+
+}
+
+/**
+ * Checks the quota of the users of one company on one server, and sends
+ * quota mails to those over a limit. With quota_threads > 1, the mails are
+ * sent in parallel; this function returns when all have been handled.
+ *
+ * @param[in]	cUsers		number of users in lpsUserList
+ * @param[in]	lpsUserList	array of ECUser struct, containing all Kopano from all companies, on any server
+ * @param[in]	lpecCompany	same company struct as in ECQuotaMonitor::CheckCompanyQuota()
+ * @param[in]	lpAdminStore IMsgStore of SYSTEM user on a specific server instance, may be NULL if its stats were read before.
+ * @param[in]	server		name of the server ("" for the one at server_socket)
+ * @return hrSuccess or any MAPI error code.
+ */
+HRESULT ECQuotaMonitor::CheckServerQuota(ULONG cUsers, ECUSER *lpsUserList,
+    ECCOMPANY *lpecCompany, LPMDB lpAdminStore, const std::string &server)
+{
+	const std::vector<QuotaStatsRow> *lpRows = nullptr;
+	ECQUOTASTATUS sQuotaStatus;
+	std::map<std::string, ECUSER *> mapUsers;
+	std::vector<std::unique_ptr<QuotaNotifyTask>> vTasks;
+	bool bHosted = lpecCompany->sCompanyId.cb != 0 && lpecCompany->sCompanyId.lpb != NULL;
+
+	auto hr = GetServerStats(server, lpAdminStore, &lpRows);
+	if (hr != hrSuccess)
+		return hr;
+	for (ULONG u = 0; u < cUsers; ++u)
+		mapUsers.emplace(reinterpret_cast<const char *>(lpsUserList[u].lpszUsername), &lpsUserList[u]);
+
+	auto lpResendInterval = m_lpThreadMonitor->lpConfig->GetSetting("mailquota_resend_interval");
+	ULONG ulResendInterval = (lpResendInterval && atoui(lpResendInterval) > 0) ? atoui(lpResendInterval) : 1;
+	auto now = time(nullptr);
+
+	for (const auto &row : *lpRows) {
+		/* Users of this company, and those without one */
+		if (bHosted && row.bHasCompany &&
+		    row.strCompany != reinterpret_cast<const char *>(lpecCompany->lpszCompanyname))
+			continue;
+		++m_ulProcessed;
+
+		memset(&sQuotaStatus, 0, sizeof(ECQUOTASTATUS));
+		sQuotaStatus.llStoreSize = row.llStoreSize;
+		sQuotaStatus.quotaStatus = QUOTA_OK;
+		if (row.ulHard > 0 && row.llStoreSize > static_cast<long long>(row.ulHard) * 1024)
+			sQuotaStatus.quotaStatus = QUOTA_HARDLIMIT;
+		else if (row.ulSoft > 0 && row.llStoreSize > static_cast<long long>(row.ulSoft) * 1024)
+			sQuotaStatus.quotaStatus = QUOTA_SOFTLIMIT;
+		else if (row.ulWarn > 0 && row.llStoreSize > static_cast<long long>(row.ulWarn) * 1024)
+			sQuotaStatus.quotaStatus = QUOTA_WARN;
+
+		if (sQuotaStatus.quotaStatus == QUOTA_OK)
+			continue;
+
+		ec_log_err("Mailbox of user \"%s\" has exceeded its %s limit", row.strUserName.c_str(), sQuotaStatus.quotaStatus == QUOTA_WARN ? "warning" : sQuotaStatus.quotaStatus == QUOTA_SOFTLIMIT ? "soft" : "hard");
+		// find the user in the full users list
+		auto iter = mapUsers.find(row.strUserName);
+		if (iter == mapUsers.cend()) {
+			ec_log_err("Unable to find user \"%s\" in userlist", row.strUserName.c_str());
+			++m_ulFailed;
+			continue;
+		}
+		if (m_state.NotDue(row.strUserName, now, ulResendInterval)) {
+			ec_log_debug("Not opening store of user \"%s\": quota mail not due yet", row.strUserName.c_str());
+			m_state.Seen(row.strUserName, 0);
+			++m_ulSkipped;
+			continue;
+		}
+		if (m_pool == nullptr) {
+			time_t mail_time = 0;
+			hr = NotifyUser(iter->second, lpecCompany, &sQuotaStatus, &mail_time);
 			if (hr != hrSuccess)
 				++m_ulFailed;
+			else
+				m_state.Seen(row.strUserName, mail_time);
+			continue;
 		}
+		vTasks.emplace_back(new QuotaNotifyTask(this, iter->second, lpecCompany, sQuotaStatus));
+		if (!vTasks.back()->queue_on(m_pool.get()))
+			/* Pool not taking tasks (shutting down); wait() would never return */
+			vTasks.back()->execute();
+	}
+
+	for (const auto &task : vTasks) {
+		task->wait();
+		if (task->m_result != hrSuccess)
+			++m_ulFailed;
+		else
+			m_state.Seen(reinterpret_cast<const char *>(task->m_user->lpszUsername), task->m_mail_time);
 	}
 	return hrSuccess;
 }
 
+/**
+ * Opens the store of an over-quota user and sends the quota mail if one is
+ * due. When running with a thread pool, this uses a worker with its own
+ * admin session, so that the workers do not queue up on one connection.
+ *
+ * @param[out]	mail_time	when the last quota mail was sent (0 if unknown)
+ */
+HRESULT ECQuotaMonitor::NotifyUser(ECUSER *lpecUser, ECCOMPANY *lpecCompany,
+    ECQUOTASTATUS *lpecQuotaStatus, time_t *mail_time)
+{
+	std::unique_ptr<ECQuotaMonitor> lpWorker;
+	auto lpMonitor = this;
+	MsgStorePtr ptrStore;
+
+	if (m_pool != nullptr) {
+		auto hr = GetWorker(lpWorker);
+		if (hr != hrSuccess)
+			return kc_perror("Unable to open an admin session for a quota worker", hr);
+		lpMonitor = lpWorker.get();
+	}
+	auto hr = lpMonitor->OpenUserStore(lpecUser->lpszUsername, ACTIVE_USER, &~ptrStore);
+	if (hr == hrSuccess)
+		hr = lpMonitor->Notify(lpecUser, lpecCompany, lpecQuotaStatus, ptrStore, mail_time);
+	if (lpWorker != nullptr)
+		PutWorker(std::move(lpWorker), hr);
+	return hr;
+}
+
+HRESULT ECQuotaMonitor::GetWorker(std::unique_ptr<ECQuotaMonitor> &lpWorker)
+{
+	{
+		std::lock_guard<std::mutex> lk(m_worker_lock);
+		if (!m_workers.empty()) {
+			lpWorker = std::move(m_workers.back());
+			m_workers.pop_back();
+			return hrSuccess;
+		}
+	}
+	object_ptr<IMAPISession> lpSession;
+	object_ptr<IMsgStore> lpAdminStore;
+	auto hr = OpenAdminSession(m_lpThreadMonitor,
+	          m_lpThreadMonitor->lpConfig->GetSetting("server_socket"),
+	          "monitor:worker", &~lpSession, &~lpAdminStore);
+	if (hr != hrSuccess)
+		return hr;
+	lpWorker.reset(new ECQuotaMonitor(m_lpThreadMonitor, lpSession, lpAdminStore));
+	return hrSuccess;
+}
+
+void ECQuotaMonitor::PutWorker(std::unique_ptr<ECQuotaMonitor> &&lpWorker, HRESULT hr)
+{
+	/* A worker whose session broke is not handed out again */
+	if (hr == MAPI_E_NETWORK_ERROR || hr == MAPI_E_END_OF_SESSION)
+		return;
+	std::lock_guard<std::mutex> lk(m_worker_lock);
+	m_workers.emplace_back(std::move(lpWorker));
+}
+
+void QuotaState::Load(const char *path)
+{
+	std::unique_ptr<FILE, file_deleter> fp(fopen(path, "r"));
+	if (fp == nullptr) {
+		if (errno != ENOENT)
+			ec_log_warn("Unable to read quota state file \"%s\": %s", path, strerror(errno));
+		return;
+	}
+	std::lock_guard<std::mutex> lk(m_lock);
+	m_mail_time.clear();
+	m_seen.clear();
+	char line[1024];
+	while (fgets(line, sizeof(line), fp.get()) != nullptr) {
+		/* "<unix time> <username>" */
+		char *end = nullptr;
+		auto t = strtoll(line, &end, 10);
+		if (end == line || *end != ' ')
+			continue;
+		std::string user = end + 1;
+		while (!user.empty() && (user.back() == '\n' || user.back() == '\r'))
+			user.pop_back();
+		if (!user.empty() && t > 0)
+			m_mail_time[std::move(user)] = t;
+	}
+}
+
+void QuotaState::Save(const char *path)
+{
+	auto tmp = std::string(path) + ".tmp";
+	std::unique_ptr<FILE, file_deleter> fp(fopen(tmp.c_str(), "w"));
+	if (fp == nullptr) {
+		ec_log_warn("Unable to write quota state file \"%s\": %s", tmp.c_str(), strerror(errno));
+		return;
+	}
+	std::lock_guard<std::mutex> lk(m_lock);
+	for (const auto &e : m_seen)
+		if (e.second != 0)
+			fprintf(fp.get(), "%lld %s\n", static_cast<long long>(e.second), e.first.c_str());
+	if (fflush(fp.get()) != 0 || fsync(fileno(fp.get())) != 0) {
+		ec_log_warn("Unable to write quota state file \"%s\": %s", tmp.c_str(), strerror(errno));
+		unlink(tmp.c_str());
+		return;
+	}
+	fp.reset();
+	if (rename(tmp.c_str(), path) != 0) {
+		ec_log_warn("Unable to replace quota state file \"%s\": %s", path, strerror(errno));
+		unlink(tmp.c_str());
+	}
+}
+
+bool QuotaState::NotDue(const std::string &user, time_t now,
+    unsigned int interval) const
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	auto iter = m_mail_time.find(user);
+	if (iter == m_mail_time.cend())
+		return false;
+	/* Same margin as CheckQuotaInterval */
+	return now <= iter->second + static_cast<time_t>(interval) * 60 * 60 * 24 - 2 * 60;
+}
+
+void QuotaState::Seen(const std::string &user, time_t mail_time)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	if (mail_time == 0) {
+		auto iter = m_mail_time.find(user);
+		if (iter != m_mail_time.cend())
+			mail_time = iter->second;
+	}
+	m_seen[user] = mail_time;
+}
+
 /**
  * Returns an email body and subject string with template variables replaced.
  *
@@ -910,11 +1169,14 @@ HRESULT ECQuotaMonitor::OpenUserStore(LPTSTR szStoreName, objectclass_t objclass
  *
  * @param lpStore Store that is over quota
  *
+ * @param[out] last_mail When the last quota mail was sent, 0 if never
+ *
  * @retval hrSuccess User should not receive quota message
  * @retval MAPI_E_TIMEOUT User should receive quota message
  * @return MAPI Error code
  */
-HRESULT ECQuotaMonitor::CheckQuotaInterval(LPMDB lpStore, LPMESSAGE *lppMessage, bool *lpbTimeout)
+HRESULT ECQuotaMonitor::CheckQuotaInterval(LPMDB lpStore, LPMESSAGE *lppMessage,
+    bool *lpbTimeout, time_t *last_mail)
 {
 	MessagePtr ptrMessage;
 	SPropValuePtr ptrProp;
@@ -928,6 +1190,7 @@ HRESULT ECQuotaMonitor::CheckQuotaInterval(LPMDB lpStore, LPMESSAGE *lppMessage,
 	if (hr == MAPI_E_NOT_FOUND) {
 		*lppMessage = ptrMessage.release();
 		*lpbTimeout = true;
+		*last_mail = 0;
 		return hrSuccess;
 	}
 	if (hr != hrSuccess)
@@ -940,6 +1203,7 @@ HRESULT ECQuotaMonitor::CheckQuotaInterval(LPMDB lpStore, LPMESSAGE *lppMessage,
 	ftNextRun = UnixTimeToFileTime(FileTimeToUnixTime(ptrProp->Value.ft) + ulResendInterval * 60 * 60 * 24 - 2 * 60);
 	*lppMessage = ptrMessage.release();
 	*lpbTimeout = (ft > ftNextRun);
+	*last_mail = FileTimeToUnixTime(ptrProp->Value.ft);
 	return hrSuccess;
 }
 
@@ -978,10 +1242,11 @@ HRESULT ECQuotaMonitor::UpdateQuotaTimestamp(LPMESSAGE lpMessage)
  * @param[in]	lpecCompany	The Kopano company of the lpecUser (default company if non-hosted), or the over quota company if lpecUser is NULL
  * @param[in]	lpecQuotaStatus	The quota status values of lpecUser or lpecCompany
  * @param[in]	lpStore The store that is over quota
+ * @param[out]	mail_time	When the last quota mail was sent (optional)
  * @return MAPI error code
  */
 HRESULT ECQuotaMonitor::Notify(ECUSER *lpecUser, ECCOMPANY *lpecCompany,
-    ECQUOTASTATUS *lpecQuotaStatus, LPMDB lpStore)
+    ECQUOTASTATUS *lpecQuotaStatus, LPMDB lpStore, time_t *mail_time)
 {
 	object_ptr<IECServiceAdmin> lpServiceAdmin;
 	MsgStorePtr ptrRecipStore;
@@ -996,11 +1261,14 @@ HRESULT ECQuotaMonitor::Notify(ECUSER *lpecUser, ECCOMPANY *lpecCompany,
 	ULONG cbUserId = 0;
 	LPENTRYID lpUserId = NULL;
 	struct TemplateVariables sVars;
+	time_t last_mail = 0;
 
 	// check if we need to send the actual email
-	auto hr = CheckQuotaInterval(lpStore, &~ptrQuotaTSMessage, &bTimeout);
+	auto hr = CheckQuotaInterval(lpStore, &~ptrQuotaTSMessage, &bTimeout, &last_mail);
 	if (hr != hrSuccess)
 		return kc_perror("Unable to query mail timeout value", hr);
+	if (mail_time != nullptr)
+		*mail_time = last_mail;
 	if (!bTimeout) {
 		ec_log_info("Not sending message since the warning mail has already been sent in the past time interval");
 		return hrSuccess;
@@ -1067,7 +1335,10 @@ HRESULT ECQuotaMonitor::Notify(ECUSER *lpecUser, ECCOMPANY *lpecCompany,
 		CreateQuotaWarningMail(&sVars, ptrRecipStore, &lpToUsers[i], lpecFromUser, lpAddrList);
 	}
 
-	if (UpdateQuotaTimestamp(ptrQuotaTSMessage) != hrSuccess)
+	hr = UpdateQuotaTimestamp(ptrQuotaTSMessage);
+	if (hr != hrSuccess)
 		kc_perror("Unable to update last mail quota timestamp", hr);
+	else if (mail_time != nullptr)
+		*mail_time = time(nullptr);
 	return hrSuccess;
 }
@@ -6,7 +6,15 @@
 #ifndef ECQUOTAMONITOR
 #define ECQUOTAMONITOR
 
+#include <atomic>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <kopano/ECDefs.h>
+#include <kopano/ECThreadPool.h>
 
 #define TEMPLATE_LINE_LENGTH		1024
 
@@ -22,6 +30,32 @@ struct TemplateVariables {
 	std::string strHardSize;
 };
 
+/* One row of the users stats table of a server */
+struct QuotaStatsRow {
+	std::string strUserName, strCompany;
+	long long llStoreSize = 0;
+	unsigned int ulWarn = 0, ulSoft = 0, ulHard = 0;
+	bool bHasCompany = false;
+};
+
+/**
+ * Remembers, between runs, when each over-quota store was last sent a
+ * quota mail, so that stores which are not due for one yet need not be
+ * opened. Stores are dropped when they are no longer seen over quota.
+ */
+class QuotaState final {
+public:
+	void Load(const char *path);
+	void Save(const char *path);
+	/* Whether the mail time of @user is known and no new mail is due yet */
+	bool NotDue(const std::string &user, time_t now, unsigned int interval) const;
+	void Seen(const std::string &user, time_t mail_time);
+
+private:
+	mutable std::mutex m_lock;
+	std::map<std::string, time_t> m_mail_time, m_seen;
+};
+
 class ECQuotaMonitor final {
 private:
 	ECQuotaMonitor(ECTHREADMONITOR *lpThreadMonitor, LPMAPISESSION lpMAPIAdminSession, LPMDB lpMDBAdmin);
@@ -31,7 +65,8 @@ public:
 
 	HRESULT	CheckQuota();
 	HRESULT CheckCompanyQuota(KC::ECCOMPANY *);
-	HRESULT CheckServerQuota(ULONG cUsers, KC::ECUSER *userlist, KC::ECCOMPANY *, LPMDB lpAdminStore);
+	HRESULT CheckServerQuota(ULONG cUsers, KC::ECUSER *userlist, KC::ECCOMPANY *, LPMDB lpAdminStore, const std::string &server);
+	HRESULT NotifyUser(KC::ECUSER *, KC::ECCOMPANY *, KC::ECQUOTASTATUS *, time_t *mail_time);
 
 private:
 	HRESULT CreateMailFromTemplate(TemplateVariables *lpVars, std::string *lpstrSubject, std::string *lpstrBody);
@@ -40,14 +75,26 @@ private:
 	HRESULT SendQuotaWarningMail(IMsgStore* lpMDB, ULONG cPropSize, LPSPropValue lpPropArray, LPADRLIST lpAddrList);
 	HRESULT CreateQuotaWarningMail(TemplateVariables *, IMsgStore *, KC::ECUSER *to, KC::ECUSER *from, ADRLIST *);
 	HRESULT OpenUserStore(TCHAR *name, KC::objectclass_t, IMsgStore **);
-	HRESULT CheckQuotaInterval(LPMDB lpStore, LPMESSAGE *lppMessage, bool *lpbTimeout);
+	HRESULT CheckQuotaInterval(LPMDB lpStore, LPMESSAGE *lppMessage, bool *lpbTimeout, time_t *last_mail);
 	HRESULT UpdateQuotaTimestamp(LPMESSAGE lpMessage);
-	HRESULT Notify(KC::ECUSER *, KC::ECCOMPANY *, KC::ECQUOTASTATUS *, IMsgStore *);
+	HRESULT Notify(KC::ECUSER *, KC::ECCOMPANY *, KC::ECQUOTASTATUS *, IMsgStore *, time_t *mail_time = nullptr);
+	HRESULT GetServerStats(const std::string &server, IMsgStore *admin_store, const std::vector<QuotaStatsRow> **);
+	HRESULT GetWorker(std::unique_ptr<ECQuotaMonitor> &);
+	void PutWorker(std::unique_ptr<ECQuotaMonitor> &&, HRESULT);
+	static HRESULT OpenAdminSession(ECTHREADMONITOR *, const char *path, const char *ident, IMAPISession **, IMsgStore **);
 
 	ECTHREADMONITOR *m_lpThreadMonitor;
 	KC::object_ptr<IMAPISession> m_lpMAPIAdminSession;
 	KC::object_ptr<IMsgStore> m_lpMDBAdmin;
-	ULONG m_ulProcessed = 0, m_ulFailed = 0;
+	std::atomic<unsigned int> m_ulProcessed{0}, m_ulFailed{0}, m_ulSkipped{0};
+
+	/* Users stats tables, read once per server and run */
+	std::map<std::string, std::vector<QuotaStatsRow>> m_stats;
+	QuotaState m_state;
+	/* Notifications run on m_pool, each with a worker's own admin session */
+	std::unique_ptr<KC::ECThreadPool> m_pool;
+	std::mutex m_worker_lock;
+	std::vector<std::unique_ptr<ECQuotaMonitor>> m_workers;
 };
 
 
@@ -145,6 +145,8 @@ static ECRESULT main2(int argc, char **argv)
 		{ "sslkey_pass", "", CONFIGSETTING_EXACT },
 		{ "quota_check_interval", "15" },
 		{ "mailquota_resend_interval", "1", CONFIGSETTING_RELOADABLE },
+		{"quota_threads", "4", CONFIGSETTING_RELOADABLE},
+		{"quota_state_file", "/var/lib/kopano/monitor-quota.state", CONFIGSETTING_RELOADABLE},
 		{ "userquota_warning_template", "/etc/kopano/quotamail/userwarning.mail", CONFIGSETTING_RELOADABLE },
 		{ "userquota_soft_template", "/etc/kopano/quotamail/usersoft.mail", CONFIGSETTING_RELOADABLE },
 		{ "userquota_hard_template", "/etc/kopano/quotamail/userhard.mail", CONFIGSETTING_RELOADABLE },
@@ -0,0 +1,1007 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2005 - 2016 Zarafa and its licensors
+ */
+#include <kopano/platform.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <kopano/ECKeyTable.h>
+
+namespace KC {
+
+/*
+ * B+tree key table
+ *
+ * All rows live in the leaves, which are linked in sort order and hold up
+ * to LEAF_MAX rows in one contiguous array. Inner nodes hold up to
+ * INNER_MAX children, the separator keys between them, and -like the
+ * leaves- the number of visible (non-hidden) rows in their subtree, which
+ * gives O(log n) row positions for SeekRow, bookmarks and GetRowCount.
+ *
+ * Instead of a vector of ECSortCol per row, the sort columns are
+ * normalised into one byte string whose memcmp order is the order
+ * ECTableRow::rowcompare defines:
+ *
+ * - each column starts with a tag byte (null < data < float);
+ * - data bytes are stored with 0x00 escaped as 0x00 0xFF and are
+ *   terminated by 0x00 0x01, so that "AAbb" sorts before "AAbbcc";
+ * - doubles are stored big-endian with the sign bit flipped (and all bits
+ *   inverted for negative numbers);
+ * - all bytes of a descending column are inverted.
+ *
+ * Every column encoding is prefix-free, so a row with fewer sort columns
+ * that equals the start of another row sorts first, and category prefix
+ * matching is a plain string prefix test.
+ *
+ * The cursor and bookmarks refer to rows by id rather than by position,
+ * since positions change on every insert or delete in a leaf.
+ */
+
+#define LEAF_MAX 64
+#define INNER_MAX 64
+
+enum {
+	KT_TAG_NULL = 0x01,
+	KT_TAG_DATA = 0x02,
+	KT_TAG_FLOAT = 0x03,
+};
+
+struct ECBTreeKeyTable::node {
+	explicit node(bool l) : is_leaf(l) {}
+	inner *parent = nullptr;
+	unsigned int visible = 0; /* visible rows in this subtree */
+	bool is_leaf;
+};
+
+struct ECBTreeKeyTable::leaf final : public ECBTreeKeyTable::node {
+	struct entry {
+		std::string key;
+		sObjectTableKey id;
+		unsigned short ncols = 0;
+		bool hidden = false;
+	};
+
+	leaf() : node(true) {}
+	leaf *prev = nullptr, *next = nullptr;
+	unsigned int n = 0;
+	entry e[LEAF_MAX];
+};
+
+struct ECBTreeKeyTable::inner final : public ECBTreeKeyTable::node {
+	inner() : node(false) {}
+	unsigned int n = 0; /* number of children */
+	node *child[INNER_MAX];
+	/* keys(child[i]) <= sep[i] <= keys(child[i+1]) */
+	std::string sep[INNER_MAX-1];
+
+	unsigned int index_of(const node *c) const
+	{
+		unsigned int i = 0;
+		while (child[i] != c)
+			++i;
+		return i;
+	}
+};
+
+static void kt_encode_col(std::string &out, const ECSortCol &col)
+{
+	auto start = out.size();
+
+	if ((col.flags & TABLEROW_FLAG_FLOAT) && col.key.size() == sizeof(double)) {
+		double d;
+		uint64_t u;
+		memcpy(&d, col.key.data(), sizeof(d));
+		if (d == 0)
+			d = 0; /* -0.0 == 0.0 */
+		memcpy(&u, &d, sizeof(u));
+		u = (u & (1ULL << 63)) ? ~u : u | (1ULL << 63);
+		out += static_cast<char>(KT_TAG_FLOAT);
+		for (int shift = 56; shift >= 0; shift -= 8)
+			out += static_cast<char>(u >> shift);
+	} else if (col.isnull && !(col.flags & TABLEROW_FLAG_FLOAT)) {
+		out += static_cast<char>(KT_TAG_NULL);
+	} else {
+		out.reserve(out.size() + col.key.size() + 3);
+		out += static_cast<char>(KT_TAG_DATA);
+		for (auto c : col.key) {
+			out += c;
+			if (c == '\0')
+				out += '\xFF';
+		}
+		out += '\0';
+		out += '\x01';
+	}
+	if (col.flags & TABLEROW_FLAG_DESC)
+		for (auto i = start; i < out.size(); ++i)
+			out[i] = ~out[i];
+}
+
+static std::string kt_encode(const std::vector<ECSortCol> &cols)
+{
+	std::string out;
+	for (const auto &col : cols)
+		kt_encode_col(out, col);
+	return out;
+}
+
+/* Length of the encoded column starting at @off */
+static size_t kt_col_len(const std::string &key, size_t off)
+{
+	unsigned char tag = key[off];
+	bool desc = tag & 0x80;
+
+	if (desc)
+		tag = ~tag;
+	if (tag == KT_TAG_NULL)
+		return 1;
+	if (tag == KT_TAG_FLOAT)
+		return 1 + sizeof(double);
+	char zero = desc ? '\xFF' : '\0', end = desc ? '\xFE' : '\x01';
+	for (size_t i = off + 1; i + 1 < key.size(); ++i) {
+		if (key[i] != zero)
+			continue;
+		if (key[i+1] == end)
+			return i + 2 - off;
+		++i; /* escaped zero */
+	}
+	return key.size() - off;
+}
+
+static inline int kt_compare(const std::string &a, const std::string &b)
+{
+	int cmp = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+	if (cmp != 0)
+		return cmp;
+	return a.size() < b.size() ? -1 : a.size() > b.size();
+}
+
+static inline bool kt_prefix(const std::string &prefix, const std::string &key)
+{
+	return key.size() >= prefix.size() &&
+	       memcmp(key.data(), prefix.data(), prefix.size()) == 0;
+}
+
+ECBTreeKeyTable::ECBTreeKeyTable() :
+	m_root(new leaf)
+{}
+
+ECBTreeKeyTable::~ECBTreeKeyTable()
+{
+	free_node(m_root);
+}
+
+void ECBTreeKeyTable::free_node(node *nd)
+{
+	if (!nd->is_leaf) {
+		auto in = static_cast<inner *>(nd);
+		for (unsigned int i = 0; i < in->n; ++i)
+			free_node(in->child[i]);
+		delete in;
+		return;
+	}
+	delete static_cast<leaf *>(nd);
+}
+
+ECRESULT ECBTreeKeyTable::Clear()
+{
+	scoped_rlock biglock(m_lock);
+	free_node(m_root);
+	m_root = new leaf;
+	m_rows.clear();
+	m_cursor = cursor();
+	m_bookmarks.clear();
+	return erSuccess;
+}
+
+bool ECBTreeKeyTable::locate(const sObjectTableKey &id, pos *p) const
+{
+	auto it = m_rows.find(id);
+	if (it == m_rows.cend())
+		return false;
+	auto lf = it->second;
+	for (unsigned int i = 0; i < lf->n; ++i) {
+		if (lf->e[i].id != id)
+			continue;
+		p->lf = lf;
+		p->i = i;
+		return true;
+	}
+	assert(false);
+	return false;
+}
+
+ECBTreeKeyTable::pos ECBTreeKeyTable::resolve(const cursor &c) const
+{
+	pos p{nullptr, c.state == cursor::BEGIN ? 0U : 1U};
+	if (c.state == cursor::ROW && !locate(c.id, &p))
+		/* cannot happen, deletes move the cursor */
+		p = {nullptr, 1};
+	return p;
+}
+
+ECBTreeKeyTable::cursor ECBTreeKeyTable::to_cursor(const pos &p) const
+{
+	cursor c;
+	if (p.lf == nullptr) {
+		c.state = p.i == 0 ? cursor::BEGIN : cursor::END;
+		return c;
+	}
+	c.state = cursor::ROW;
+	c.id = p.lf->e[p.i].id;
+	return c;
+}
+
+ECBTreeKeyTable::pos ECBTreeKeyTable::first() const
+{
+	auto nd = m_root;
+	while (!nd->is_leaf)
+		nd = static_cast<inner *>(nd)->child[0];
+	auto lf = static_cast<leaf *>(nd);
+	if (lf->n == 0)
+		return {nullptr, 1};
+	return {lf, 0};
+}
+
+ECBTreeKeyTable::pos ECBTreeKeyTable::last() const
+{
+	auto nd = m_root;
+	while (!nd->is_leaf) {
+		auto in = static_cast<inner *>(nd);
+		nd = in->child[in->n-1];
+	}
+	auto lf = static_cast<leaf *>(nd);
+	if (lf->n == 0)
+		return {nullptr, 0};
+	return {lf, lf->n - 1};
+}
+
+ECBTreeKeyTable::pos ECBTreeKeyTable::next(pos p) const
+{
+	if (p.lf == nullptr)
+		return p.i == 0 ? first() : p;
+	if (++p.i < p.lf->n)
+		return p;
+	/* Only the root leaf can be empty, so the next leaf has rows */
+	if (p.lf->next == nullptr)
+		return {nullptr, 1};
+	return {p.lf->next, 0};
+}
+
+ECBTreeKeyTable::pos ECBTreeKeyTable::prev(pos p) const
+{
+	if (p.lf == nullptr)
+		return p.i == 0 ? p : last();
+	if (p.i > 0) {
+		--p.i;
+		return p;
+	}
+	if (p.lf->prev == nullptr)
+		return {nullptr, 0};
+	return {p.lf->prev, p.lf->prev->n - 1};
+}
+
+/* First row with a key >= @key */
+ECBTreeKeyTable::pos ECBTreeKeyTable::lower_bound(const std::string &key) const
+{
+	auto nd = m_root;
+	while (!nd->is_leaf) {
+		auto in = static_cast<inner *>(nd);
+		auto end = in->sep + in->n - 1;
+		auto it = std::lower_bound(in->sep, end, key,
+		          [](const std::string &a, const std::string &b) { return kt_compare(a, b) < 0; });
+		nd = in->child[it-in->sep];
+	}
+	auto lf = static_cast<leaf *>(nd);
+	unsigned int i = 0;
+	while (i < lf->n && kt_compare(lf->e[i].key, key) < 0)
+		++i;
+	if (i < lf->n)
+		return {lf, i};
+	if (lf->next == nullptr)
+		return {nullptr, 1};
+	return {lf->next, 0};
+}
+
+/* Position after the last row with a key <= @key; may be one past the end of a leaf */
+ECBTreeKeyTable::pos ECBTreeKeyTable::upper_bound(const std::string &key) const
+{
+	auto nd = m_root;
+	while (!nd->is_leaf) {
+		auto in = static_cast<inner *>(nd);
+		auto end = in->sep + in->n - 1;
+		auto it = std::upper_bound(in->sep, end, key,
+		          [](const std::string &a, const std::string &b) { return kt_compare(a, b) < 0; });
+		nd = in->child[it-in->sep];
+	}
+	auto lf = static_cast<leaf *>(nd);
+	unsigned int i = 0;
+	while (i < lf->n && kt_compare(lf->e[i].key, key) <= 0)
+		++i;
+	return {lf, i};
+}
+
+/* The visible row with @r visible rows before it, or past-end */
+ECBTreeKeyTable::pos ECBTreeKeyTable::at_rank(unsigned int r) const
+{
+	if (r >= m_root->visible)
+		return {nullptr, 1};
+	auto nd = m_root;
+	while (!nd->is_leaf) {
+		auto in = static_cast<inner *>(nd);
+		unsigned int i = 0;
+		for (; i < in->n - 1 && r >= in->child[i]->visible; ++i)
+			r -= in->child[i]->visible;
+		nd = in->child[i];
+	}
+	auto lf = static_cast<leaf *>(nd);
+	for (unsigned int i = 0; i < lf->n; ++i) {
+		if (lf->e[i].hidden)
+			continue;
+		if (r == 0)
+			return {lf, i};
+		--r;
+	}
+	assert(false);
+	return {nullptr, 1};
+}
+
+/* Number of visible rows before @p */
+unsigned int ECBTreeKeyTable::rank(const pos &p) const
+{
+	if (p.lf == nullptr)
+		return p.i == 0 ? 0 : m_root->visible;
+	unsigned int r = 0;
+	for (unsigned int i = 0; i < p.i; ++i)
+		if (!p.lf->e[i].hidden)
+			++r;
+	for (const node *nd = p.lf; nd->parent != nullptr; nd = nd->parent) {
+		auto in = nd->parent;
+		for (unsigned int i = 0; in->child[i] != nd; ++i)
+			r += in->child[i]->visible;
+	}
+	return r;
+}
+
+unsigned int ECBTreeKeyTable::rank(const cursor &c) const
+{
+	return rank(resolve(c));
+}
+
+void ECBTreeKeyTable::adjust_counts(node *nd, int delta)
+{
+	for (; nd != nullptr; nd = nd->parent)
+		nd->visible += delta;
+}
+
+void ECBTreeKeyTable::set_hidden(const pos &p, bool hidden)
+{
+	auto &e = p.lf->e[p.i];
+	if (e.hidden == hidden)
+		return;
+	e.hidden = hidden;
+	adjust_counts(p.lf, hidden ? -1 : 1);
+}
+
+/*
+ * Hook @child into @parent, right after @after. Splits @parent first
+ * when it is full. Counts are left to the caller.
+ */
+void ECBTreeKeyTable::insert_child(inner *parent, node *after,
+    node *child, const std::string &sep)
+{
+	if (parent->n == INNER_MAX) {
+		split_inner(parent);
+		parent = after->parent;
+	}
+	auto idx = parent->index_of(after);
+	for (auto i = parent->n; i > idx + 1; --i)
+		parent->child[i] = parent->child[i-1];
+	for (auto i = parent->n - 1; i > idx; --i)
+		parent->sep[i] = std::move(parent->sep[i-1]);
+	parent->child[idx+1] = child;
+	parent->sep[idx] = sep;
+	++parent->n;
+	child->parent = parent;
+}
+
+void ECBTreeKeyTable::split_inner(inner *in)
+{
+	auto right = new inner;
+	unsigned int k = in->n / 2;
+	/* sep[k-1] moves up, it separates the two halves */
+	std::string up = std::move(in->sep[k-1]);
+
+	for (unsigned int i = k; i < in->n; ++i) {
+		right->child[i-k] = in->child[i];
+		right->child[i-k]->parent = right;
+		right->visible += in->child[i]->visible;
+		if (i < in->n - 1)
+			right->sep[i-k] = std::move(in->sep[i]);
+	}
+	right->n = in->n - k;
+	in->n = k;
+	/*
+	 * Sum up rather than subtract: during a leaf split, the counts above
+	 * the leaf are only fixed up once the new leaf is hooked in.
+	 */
+	in->visible = 0;
+	for (unsigned int i = 0; i < in->n; ++i)
+		in->visible += in->child[i]->visible;
+	if (in->parent != nullptr) {
+		insert_child(in->parent, in, right, up);
+		return;
+	}
+	auto root = new inner;
+	root->child[0] = in;
+	root->child[1] = right;
+	root->sep[0] = std::move(up);
+	root->n = 2;
+	root->visible = in->visible + right->visible;
+	in->parent = right->parent = root;
+	m_root = root;
+}
+
+void ECBTreeKeyTable::split_leaf(leaf *lf)
+{
+	auto right = new leaf;
+	unsigned int k = lf->n / 2;
+
+	for (unsigned int i = k; i < lf->n; ++i) {
+		auto &e = right->e[i-k];
+		e = std::move(lf->e[i]);
+		lf->e[i].key = std::string();
+		m_rows[e.id] = right;
+		if (!e.hidden)
+			++right->visible;
+	}
+	right->n = lf->n - k;
+	lf->n = k;
+	lf->visible -= right->visible;
+	right->prev = lf;
+	right->next = lf->next;
+	if (lf->next != nullptr)
+		lf->next->prev = right;
+	lf->next = right;
+
+	if (lf->parent == nullptr) {
+		auto root = new inner;
+		root->child[0] = lf;
+		root->child[1] = right;
+		root->sep[0] = right->e[0].key;
+		root->n = 2;
+		root->visible = lf->visible + right->visible;
+		lf->parent = right->parent = root;
+		m_root = root;
+		return;
+	}
+	insert_child(lf->parent, lf, right, right->e[0].key);
+	/* The halves may have ended up under different parents */
+	recount(lf->parent);
+	recount(right->parent);
+}
+
+/* Recompute the visible counts from @in up to the root */
+void ECBTreeKeyTable::recount(inner *in)
+{
+	for (; in != nullptr; in = in->parent) {
+		unsigned int v = 0;
+		for (unsigned int i = 0; i < in->n; ++i)
+			v += in->child[i]->visible;
+		in->visible = v;
+	}
+}
+
+void ECBTreeKeyTable::insert_at(pos p, const sObjectTableKey &id,
+    std::string &&key, unsigned int ncols, bool hidden)
+{
+	if (p.lf->n == LEAF_MAX) {
+		split_leaf(p.lf);
+		if (p.i > p.lf->n) {
+			p.i -= p.lf->n;
+			p.lf = p.lf->next;
+		}
+	}
+	auto lf = p.lf;
+	for (auto i = lf->n; i > p.i; --i)
+		lf->e[i] = std::move(lf->e[i-1]);
+	auto &e = lf->e[p.i];
+	e.key = std::move(key);
+	e.id = id;
+	e.ncols = ncols;
+	e.hidden = hidden;
+	++lf->n;
+	m_rows[id] = lf;
+	if (!hidden)
+		adjust_counts(lf, 1);
+}
+
+void ECBTreeKeyTable::erase_at(pos p)
+{
+	auto lf = p.lf;
+	if (!lf->e[p.i].hidden)
+		adjust_counts(lf, -1);
+	m_rows.erase(lf->e[p.i].id);
+	for (auto i = p.i; i + 1 < lf->n; ++i)
+		lf->e[i] = std::move(lf->e[i+1]);
+	lf->e[--lf->n].key = std::string();
+	if (lf->n == 0 && lf->parent != nullptr)
+		remove_child(lf);
+	else
+		rebalance(lf);
+}
+
+/* Unhook an empty node from the tree and free it */
+void ECBTreeKeyTable::remove_child(node *nd)
+{
+	auto parent = nd->parent;
+	auto idx = parent->index_of(nd);
+
+	if (nd->is_leaf) {
+		auto lf = static_cast<leaf *>(nd);
+		if (lf->prev != nullptr)
+			lf->prev->next = lf->next;
+		if (lf->next != nullptr)
+			lf->next->prev = lf->prev;
+	}
+	for (auto i = idx; i + 1 < parent->n; ++i)
+		parent->child[i] = parent->child[i+1];
+	/* Drop the separator on either side of the child */
+	for (auto i = idx > 0 ? idx - 1 : 0; i + 2 < parent->n; ++i)
+		parent->sep[i] = std::move(parent->sep[i+1]);
+	if (parent->n >= 2)
+		parent->sep[parent->n-2] = std::string();
+	--parent->n;
+	free_node(nd);
+	if (parent->n == 0 && parent->parent != nullptr)
+		remove_child(parent);
+	else
+		rebalance(parent);
+}
+
+/*
+ * Merge an underfull node into a sibling when both fit in one node, and
+ * shrink the tree when the root has a single child.
+ */
+void ECBTreeKeyTable::rebalance(node *nd)
+{
+	if (nd->parent == nullptr) {
+		while (!m_root->is_leaf && static_cast<inner *>(m_root)->n == 1) {
+			auto old = static_cast<inner *>(m_root);
+			m_root = old->child[0];
+			m_root->parent = nullptr;
+			old->n = 0;
+			delete old;
+		}
+		return;
+	}
+	auto parent = nd->parent;
+	if (parent->n < 2)
+		return;
+	auto idx = parent->index_of(nd);
+	auto li = idx + 1 < parent->n ? idx : idx - 1;
+	auto l = parent->child[li], r = parent->child[li+1];
+
+	if (nd->is_leaf) {
+		auto left = static_cast<leaf *>(l), right = static_cast<leaf *>(r);
+		if (static_cast<leaf *>(nd)->n >= LEAF_MAX / 4 ||
+		    left->n + right->n > LEAF_MAX)
+			return;
+		for (unsigned int i = 0; i < right->n; ++i) {
+			auto &e = left->e[left->n+i];
+			e = std::move(right->e[i]);
+			m_rows[e.id] = left;
+		}
+		left->n += right->n;
+		left->visible += right->visible;
+		right->n = right->visible = 0;
+	} else {
+		auto left = static_cast<inner *>(l), right = static_cast<inner *>(r);
+		if (static_cast<inner *>(nd)->n >= INNER_MAX / 4 ||
+		    left->n + right->n > INNER_MAX)
+			return;
+		left->sep[left->n-1] = parent->sep[li];
+		for (unsigned int i = 0; i < right->n; ++i) {
+			left->child[left->n+i] = right->child[i];
+			left->child[left->n+i]->parent = left;
+			if (i + 1 < right->n)
+				left->sep[left->n+i] = std::move(right->sep[i]);
+		}
+		left->n += right->n;
+		left->visible += right->visible;
+		right->n = right->visible = 0;
+	}
+	/* @r is empty now */
+	remove_child(r);
+}
+
+ECRESULT ECBTreeKeyTable::delete_row(const sObjectTableKey &id)
+{
+	pos p;
+	if (!locate(id, &p))
+		return KCERR_NOT_FOUND;
+	if (m_cursor.state == cursor::ROW && m_cursor.id == id) {
+		/* Move the cursor to the row that takes this one's place */
+		auto q = next(p);
+		while (q.lf != nullptr && q.lf->e[q.i].hidden)
+			q = next(q);
+		m_cursor = to_cursor(q);
+	}
+	for (auto it = m_bookmarks.begin(); it != m_bookmarks.end(); ) {
+		if (it->second.where.state == cursor::ROW && it->second.where.id == id)
+			it = m_bookmarks.erase(it);
+		else
+			++it;
+	}
+	erase_at(p);
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::modify_row(const sObjectTableKey &id,
+    std::string &&key, unsigned int ncols, bool hidden,
+    sObjectTableKey *lpsPrevRow, UpdateType *lpulAction)
+{
+	bool relocate = false;
+	pos p;
+
+	if (locate(id, &p)) {
+		if (lpulAction != nullptr)
+			*lpulAction = TABLE_ROW_MODIFY;
+		if (p.lf->e[p.i].key == key) {
+			/* Same row, just look up the predecessor */
+			if (lpsPrevRow != nullptr) {
+				auto q = prev(p);
+				*lpsPrevRow = q.lf != nullptr ? q.lf->e[q.i].id : sObjectTableKey(0, 0);
+			}
+			return erSuccess;
+		}
+		relocate = m_cursor.state == cursor::ROW && m_cursor.id == id;
+		auto er = delete_row(id);
+		if (er != erSuccess)
+			return er;
+	} else if (lpulAction != nullptr) {
+		*lpulAction = TABLE_ROW_ADD;
+	}
+
+	p = upper_bound(key);
+	if (lpsPrevRow != nullptr) {
+		auto q = p.i > 0 ? pos{p.lf, p.i - 1} : prev(p);
+		*lpsPrevRow = q.lf != nullptr ? q.lf->e[q.i].id : sObjectTableKey(0, 0);
+	}
+	insert_at(p, id, std::move(key), ncols, hidden);
+	// Reposition the cursor if it used to be on the old row
+	if (relocate) {
+		m_cursor.state = cursor::ROW;
+		m_cursor.id = id;
+	}
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::UpdateRow(UpdateType ulType,
+    const sObjectTableKey *lpsRowItem, std::vector<ECSortCol> &&dat,
+    sObjectTableKey *lpsPrevRow, bool fHidden, UpdateType *lpulAction)
+{
+	scoped_rlock biglock(m_lock);
+
+	switch (ulType) {
+	case TABLE_ROW_DELETE: {
+		auto er = delete_row(*lpsRowItem);
+		if (er == erSuccess && lpulAction != nullptr)
+			*lpulAction = TABLE_ROW_DELETE;
+		return er;
+	}
+	case TABLE_ROW_MODIFY:
+	case TABLE_ROW_ADD:
+		return modify_row(*lpsRowItem, kt_encode(dat), dat.size(),
+		       fHidden, lpsPrevRow, lpulAction);
+	// no action for: TABLE_CHANGE, TABLE_ERR, TABLE_SORT, TABLE_RESTRICT, TABLE_SETCOL, TABLE_DO_RELOAD
+	default:
+		break;
+	}
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::SeekId(const sObjectTableKey *lpsRowItem)
+{
+	scoped_rlock biglock(m_lock);
+	if (m_rows.find(*lpsRowItem) == m_rows.cend())
+		return KCERR_NOT_FOUND;
+	m_cursor.state = cursor::ROW;
+	m_cursor.id = *lpsRowItem;
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::CreateBookmark(unsigned int *lpulbkPosition)
+{
+	scoped_rlock biglock(m_lock);
+
+	// Limit of bookmarks
+	if (m_bookmarks.size() >= BOOKMARK_LIMIT)
+		return KCERR_UNABLE_TO_COMPLETE;
+	bookmark bm;
+	bm.where = m_cursor;
+	bm.first_pos = rank(m_cursor);
+	*lpulbkPosition = m_bookmark_id++;
+	m_bookmarks.emplace(*lpulbkPosition, bm);
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::FreeBookmark(unsigned int ulbkPosition)
+{
+	scoped_rlock biglock(m_lock);
+	auto it = m_bookmarks.find(ulbkPosition);
+	if (it == m_bookmarks.cend())
+		return KCERR_INVALID_BOOKMARK;
+	m_bookmarks.erase(it);
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::SeekRow(unsigned int lbkOrgin, int lSeekTo,
+    int *lplRowsSought)
+{
+	ECRESULT er = erSuccess;
+	scoped_rlock biglock(m_lock);
+	unsigned int ulRowCount = m_root->visible, ulCurrentRow = rank(m_cursor);
+	int lDestRow = 0;
+
+	switch (lbkOrgin) {
+	case EC_SEEK_SET:
+		lDestRow = lSeekTo;
+		break;
+	case EC_SEEK_CUR:
+		lDestRow = ulCurrentRow + lSeekTo;
+		break;
+	case EC_SEEK_END:
+		lDestRow = ulRowCount + lSeekTo;
+		break;
+	default: {
+		auto it = m_bookmarks.find(lbkOrgin);
+		if (it == m_bookmarks.cend())
+			return KCERR_INVALID_BOOKMARK;
+		lDestRow = rank(it->second.where);
+		if (it->second.first_pos != static_cast<unsigned int>(lDestRow))
+			er = KCWARN_POSITION_CHANGED;
+		lDestRow += lSeekTo;
+		break;
+	}
+	}
+
+	if (lDestRow < 0)
+		lDestRow = 0;
+	if (static_cast<unsigned int>(lDestRow) >= ulRowCount)
+		lDestRow = ulRowCount;
+	if (lplRowsSought != nullptr) {
+		switch (lbkOrgin) {
+		case EC_SEEK_SET:
+			*lplRowsSought = lDestRow;
+			break;
+		case EC_SEEK_END:
+			*lplRowsSought = lDestRow - ulRowCount;
+			break;
+		default:
+			*lplRowsSought = lDestRow - ulCurrentRow;
+			break;
+		}
+	}
+	if (ulRowCount == 0)
+		m_cursor = cursor(); /* before front in empty table */
+	else
+		m_cursor = to_cursor(at_rank(lDestRow));
+	return er;
+}
+
+ECRESULT ECBTreeKeyTable::GetRowCount(unsigned int *lpulRowCount,
+    unsigned int *lpulCurrentRow)
+{
+	if (lpulCurrentRow == nullptr)
+		return KCERR_INVALID_PARAMETER;
+	scoped_rlock biglock(m_lock);
+	*lpulCurrentRow = rank(m_cursor);
+	*lpulRowCount = m_root->visible;
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::QueryRows(unsigned int ulRows,
+    ECObjectTableList *lpRowList, bool bDirBackward, unsigned int ulFlags,
+    bool bShowHidden)
+{
+	scoped_rlock biglock(m_lock);
+	auto count = m_root->visible;
+	auto p = resolve(m_cursor);
+
+	if (bDirBackward && p.lf == nullptr && p.i == 1)
+		p = count == 0 ? pos{nullptr, 0} : at_rank(count - 1);
+	else if (p.lf == nullptr && p.i == 0 && count != 0)
+		// Go to actual first row if still pre-first row
+		p = at_rank(0);
+
+	ulRows = std::min(ulRows, count);
+	while (ulRows > 0 && p.lf != nullptr) {
+		const auto &e = p.lf->e[p.i];
+		if (!e.hidden || bShowHidden) {
+			lpRowList->emplace_back(e.id);
+			--ulRows;
+		}
+		if (!bDirBackward) {
+			p = next(p);
+			continue;
+		}
+		auto q = prev(p);
+		if (q.lf == nullptr)
+			break; /* stay on the first row */
+		p = q;
+	}
+	if (!(ulFlags & EC_TABLE_NOADVANCE))
+		m_cursor = to_cursor(p);
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::GetPreviousRow(const sObjectTableKey *lpsRowItem,
+    sObjectTableKey *lpsPrev)
+{
+	scoped_rlock biglock(m_lock);
+	pos p;
+	if (!locate(*lpsRowItem, &p))
+		return KCERR_NOT_FOUND;
+	do {
+		p = prev(p);
+	} while (p.lf != nullptr && p.lf->e[p.i].hidden);
+	/* Like ECKeyTable, the row before the first one is 0:0 */
+	*lpsPrev = p.lf != nullptr ? p.lf->e[p.i].id : sObjectTableKey(0, 0);
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::GetRowsBySortPrefix(sObjectTableKey *lpsRowItem,
+    ECObjectTableList *lpRowList)
+{
+	scoped_rlock biglock(m_lock);
+	pos p;
+	if (!locate(*lpsRowItem, &p))
+		return KCERR_NOT_FOUND;
+	auto prefix = p.lf->e[p.i].key;
+	for (; p.lf != nullptr && kt_prefix(prefix, p.lf->e[p.i].key); p = next(p))
+		lpRowList->emplace_back(p.lf->e[p.i].id);
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::HideRows(sObjectTableKey *lpsRowItem,
+    ECObjectTableList *lpHiddenList)
+{
+	scoped_rlock biglock(m_lock);
+	bool cursor_hidden = false;
+	pos p;
+
+	if (!locate(*lpsRowItem, &p))
+		return KCERR_NOT_FOUND;
+	auto prefix = p.lf->e[p.i].key;
+	// Go to next row; we never hide the first row, as it is the header
+	for (p = next(p); p.lf != nullptr && kt_prefix(prefix, p.lf->e[p.i].key); p = next(p)) {
+		const auto &e = p.lf->e[p.i];
+		lpHiddenList->emplace_back(e.id);
+		set_hidden(p, true);
+		if (m_cursor.state == cursor::ROW && m_cursor.id == e.id)
+			cursor_hidden = true;
+	}
+	// If the row pointed to by the cursor was hidden, put the cursor on the next unhidden row
+	if (cursor_hidden) {
+		while (p.lf != nullptr && p.lf->e[p.i].hidden)
+			p = next(p);
+		m_cursor = to_cursor(p);
+	}
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::UnhideRows(sObjectTableKey *lpsRowItem,
+    ECObjectTableList *lpUnhiddenList)
+{
+	scoped_rlock biglock(m_lock);
+	pos p;
+
+	if (!locate(*lpsRowItem, &p))
+		return KCERR_NOT_FOUND;
+	if (p.lf->e[p.i].hidden)
+		/* You cannot expand a category whose header is hidden */
+		return KCERR_NOT_FOUND;
+	auto prefix = p.lf->e[p.i].key;
+	// Go to next row; we don't unhide the first row, as it is the header
+	p = next(p);
+	if (p.lf != nullptr) {
+		/* Only unhide the first layer, i.e. rows as deep as the first one */
+		auto ncols = p.lf->e[p.i].ncols;
+		for (; p.lf != nullptr && kt_prefix(prefix, p.lf->e[p.i].key); p = next(p)) {
+			if (p.lf->e[p.i].ncols != ncols)
+				continue;
+			lpUnhiddenList->emplace_back(p.lf->e[p.i].id);
+			set_hidden(p, false);
+		}
+	}
+	/* Leave the cursor after the category, like ECKeyTable */
+	m_cursor = to_cursor(p);
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::LowerBound(const std::vector<ECSortCol> &cols)
+{
+	scoped_rlock biglock(m_lock);
+	m_cursor = to_cursor(lower_bound(kt_encode(cols)));
+	return erSuccess;
+}
+
+ECRESULT ECBTreeKeyTable::Find(const std::vector<ECSortCol> &cols,
+    sObjectTableKey *lpsKey)
+{
+	scoped_rlock biglock(m_lock);
+	auto key = kt_encode(cols);
+	auto p = lower_bound(key);
+	if (p.lf == nullptr || p.lf->e[p.i].key != key)
+		return KCERR_NOT_FOUND;
+	*lpsKey = p.lf->e[p.i].id;
+	return erSuccess;
+}
+
+/**
+ * Update a part of the sort data for a specific row
+ *
+ * Replaces column @ulColumn in the encoded key of the row, which may cause
+ * the row to be relocated. See ECKeyTable::UpdatePartialSortKey.
+ */
+ECRESULT ECBTreeKeyTable::UpdatePartialSortKey(sObjectTableKey *lpsRowItem,
+    size_t ulColumn, const ECSortCol &col, sObjectTableKey *lpsPrevRow,
+    bool *lpfHidden, UpdateType *lpulAction)
+{
+	scoped_rlock biglock(m_lock);
+	pos p;
+
+	if (!locate(*lpsRowItem, &p))
+		return KCERR_NOT_FOUND;
+	const auto &e = p.lf->e[p.i];
+	if (ulColumn >= e.ncols)
+		return KCERR_INVALID_PARAMETER;
+	size_t off = 0;
+	for (size_t i = 0; i < ulColumn; ++i)
+		off += kt_col_len(e.key, off);
+	auto len = kt_col_len(e.key, off);
+	auto key = e.key.substr(0, off);
+	kt_encode_col(key, col);
+	key.append(e.key, off + len, std::string::npos);
+	bool hidden = e.hidden;
+	if (lpfHidden != nullptr)
+		*lpfHidden = hidden;
+	return modify_row(*lpsRowItem, std::move(key), e.ncols, hidden,
+	       lpsPrevRow, lpulAction);
+}
+
+size_t ECBTreeKeyTable::node_size(const node *nd) const
+{
+	if (!nd->is_leaf) {
+		auto in = static_cast<const inner *>(nd);
+		size_t z = sizeof(*in);
+		for (unsigned int i = 0; i < in->n; ++i)
+			z += node_size(in->child[i]);
+		for (unsigned int i = 0; i + 1 < in->n; ++i)
+			if (in->sep[i].capacity() > 15)
+				z += MEMORY_USAGE_STRING(in->sep[i]);
+		return z;
+	}
+	auto lf = static_cast<const leaf *>(nd);
+	size_t z = sizeof(*lf);
+	for (unsigned int i = 0; i < lf->n; ++i)
+		/* short keys are stored inside std::string */
+		if (lf->e[i].key.capacity() > 15)
+			z += MEMORY_USAGE_STRING(lf->e[i].key);
+	return z;
+}
+
+size_t ECBTreeKeyTable::GetObjectSize()
+{
+	scoped_rlock biglock(m_lock);
+	return sizeof(*this) + node_size(m_root) +
+	       MEMORY_USAGE_HASHMAP(m_rows.size(), decltype(m_rows)) +
+	       MEMORY_USAGE_MAP(m_bookmarks.size(), decltype(m_bookmarks));
+}
+
+} /* namespace */
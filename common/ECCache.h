@@ -7,7 +7,10 @@
 #define ECCACHE_INCLUDED
 
 #include <kopano/zcdefs.h>
+#include <functional>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <utility>
@@ -18,25 +21,35 @@
 
 namespace KC {
 
-template<typename Key> class KeyEntry _kc_final {
-public:
-	Key key;
-	time_t ulLastAccess;
-};
-
-template<typename Key>
-bool KeyEntryOrder(const KeyEntry<Key> &a, const KeyEntry<Key> &b) {
-	return a.ulLastAccess < b.ulLastAccess;
-}
-
 template<typename Value> size_t GetCacheAdditionalSize(const Value &val)
 {
 	return 0;
 }
 
+template<typename MapType> class ECCache;
+
 class ECsCacheEntry {
 public:
+	ECsCacheEntry() = default;
+	/* The LRU links belong to the container slot, not to the value. */
+	ECsCacheEntry(const ECsCacheEntry &o) : ulLastAccess(o.ulLastAccess) {}
+	ECsCacheEntry &operator=(const ECsCacheEntry &o)
+	{
+		ulLastAccess = o.ulLastAccess;
+		return *this;
+	}
+
 	time_t ulLastAccess = 0;
+
+private:
+	/*
+	 * Intrusive LRU list maintained by ECCache. Map nodes do not move
+	 * in memory, so the entry can point at its own key and neighbours.
+	 */
+	ECsCacheEntry *m_lru_prev = nullptr, *m_lru_next = nullptr;
+	const void *m_lru_key = nullptr;
+
+	template<typename> friend class ECCache;
 };
 
 struct ECCacheStat {
@@ -86,6 +99,16 @@ private:
 	size_type m_ulCacheHit = 0, m_ulCacheValid = 0;
 };
 
+/*
+ * Size-bounded cache on top of a node-based map. Entries are kept on an
+ * intrusive LRU list (most recently used at the head), so eviction and
+ * expiry take entries off the tail in O(1) each instead of sorting the
+ * whole map.
+ *
+ * For caches with a maximum age, the access time is only updated when
+ * an item is (re)added, which keeps the list ordered by insertion time
+ * and allows expired entries to be reaped from the tail incrementally.
+ */
 template<typename MapType> class ECCache _kc_final : public ECCacheBase {
 public:
 	typedef typename MapType::key_type key_type;
@@ -96,9 +119,13 @@ public:
 		, m_ulSize(0)
 	{ }
 
+	ECCache(const ECCache &) = delete;
+	ECCache &operator=(const ECCache &) = delete;
+
 	ECRESULT ClearCache()
 	{
 		m_map.clear();
+		m_lru_head = m_lru_tail = nullptr;
 		m_ulSize = 0;
 		ClearCounters();
 		return erSuccess;
@@ -120,51 +147,32 @@ public:
 		auto iter = m_map.find(key);
 		if (iter == m_map.end())
 			return KCERR_NOT_FOUND;
-
-		m_ulSize -= GetCacheAdditionalSize(iter->second);
-		m_ulSize -= GetCacheAdditionalSize(key);
-		m_map.erase(iter);
+		EraseItem(iter);
 		return erSuccess;
 	}
 
 	ECRESULT GetCacheItem(const key_type &key, mapped_type **lppValue)
 	{
 		time_t	tNow  = GetProcessTime();
-		auto iter = m_map.find(key);
 
-		if (iter == m_map.end()) {
-			IncrementHitCount();
+		IncrementHitCount();
+		if (MaxAge() != 0)
+			ExpireItems(tNow);
+		auto iter = m_map.find(key);
+		if (iter == m_map.end())
 			return KCERR_NOT_FOUND;
-		}
-		if (MaxAge() == 0 || static_cast<long>(tNow - iter->second.ulLastAccess) < MaxAge()) {
-			*lppValue = &iter->second;
-			// If we have an aging cache, we don't update the timestamp,
-			// so we can't keep a value longer in the cache than the max age.
-			// If we have a non-aging cache, we need to update it,
-			// to see the oldest 5% to purge from the cache.
-			if (MaxAge() == 0)
-				iter->second.ulLastAccess = tNow;
-			IncrementHitCount();
-			IncrementValidCount();
-			return erSuccess;
-		}
-		// Cache age of the cached item, if expired remove the item from the cache
 		/*
-		 * Because of templates, there is no guarantee
-		 * that m_map keeps iterators valid while
-		 * elements are deleted from it. Track them in
-		 * a separate delete list.
+		 * Expired items were reaped above, so whatever is left is
+		 * valid. Non-aging caches track recency so that the least
+		 * recently used items are purged first.
 		 */
-		std::vector<key_type> dl;
-
-		// Loop through all items and check
-		for (iter = m_map.begin(); iter != m_map.end(); ++iter)
-			if ((long)(tNow - iter->second.ulLastAccess) >= MaxAge())
-				dl.emplace_back(iter->first);
-		for (const auto &i : dl)
-			m_map.erase(i);
-		IncrementHitCount();
-		return KCERR_NOT_FOUND;
+		if (MaxAge() == 0) {
+			iter->second.ulLastAccess = tNow;
+			LruTouch(&iter->second);
+		}
+		*lppValue = &iter->second;
+		IncrementValidCount();
+		return erSuccess;
 	}
 
 	ECRESULT GetCacheRange(const key_type &lower, const key_type &upper, std::list<typename MapType::value_type> *values)
@@ -181,19 +189,23 @@ public:
 		if (MaxSize() == 0)
 			return erSuccess;
 		auto result = m_map.emplace(key, value);
+		auto &entry = result.first->second;
 		if (!result.second) {
 			// The key already exists but its value is unmodified. So update it now
 			m_ulSize += GetCacheAdditionalSize(value);
-			m_ulSize -= GetCacheAdditionalSize(result.first->second);
-			result.first->second = value;
-			result.first->second.ulLastAccess = GetProcessTime();
+			m_ulSize -= GetCacheAdditionalSize(entry);
+			entry = value;
+			entry.ulLastAccess = GetProcessTime();
+			LruTouch(&entry);
 			// Since there is a very small chance that we need to purge the cache, we're skipping that here.
 			return erSuccess;
 		}
 		// We just inserted a new entry.
 		m_ulSize += GetCacheAdditionalSize(value);
 		m_ulSize += GetCacheAdditionalSize(key);
-		result.first->second.ulLastAccess = GetProcessTime();
+		entry.ulLastAccess = GetProcessTime();
+		entry.m_lru_key = &result.first->first;
+		LruPushFront(&entry);
 		UpdateCache(0.05F);
 		return erSuccess;
 	}
@@ -206,33 +218,75 @@ public:
 	}
 
 private:
-	ECRESULT PurgeCache(float ratio)
+	void LruUnlink(ECsCacheEntry *e)
 	{
-		std::list<KeyEntry<key_type> > lstEntries;
+		if (e->m_lru_prev != nullptr)
+			e->m_lru_prev->m_lru_next = e->m_lru_next;
+		else
+			m_lru_head = e->m_lru_next;
+		if (e->m_lru_next != nullptr)
+			e->m_lru_next->m_lru_prev = e->m_lru_prev;
+		else
+			m_lru_tail = e->m_lru_prev;
+		e->m_lru_prev = e->m_lru_next = nullptr;
+	}
 
-		for (const auto &im : m_map) {
-			KeyEntry<key_type> k;
-			k.key = im.first;
-			k.ulLastAccess = im.second.ulLastAccess;
-			lstEntries.emplace_back(std::move(k));
-		}
+	void LruPushFront(ECsCacheEntry *e)
+	{
+		e->m_lru_prev = nullptr;
+		e->m_lru_next = m_lru_head;
+		if (m_lru_head != nullptr)
+			m_lru_head->m_lru_prev = e;
+		m_lru_head = e;
+		if (m_lru_tail == nullptr)
+			m_lru_tail = e;
+	}
 
-		lstEntries.sort(KeyEntryOrder<key_type>);
-		// We now have a list of all cache items, sorted by access time, (oldest first)
-		size_t ulDelete = m_map.size() * ratio;
+	void LruTouch(ECsCacheEntry *e)
+	{
+		if (e == m_lru_head)
+			return;
+		LruUnlink(e);
+		LruPushFront(e);
+	}
 
-		// Remove the oldest ulDelete entries from the cache, removing [ratio] % of all
-		// cache entries.
-		for (auto iterEntry = lstEntries.cbegin();
-		     iterEntry != lstEntries.cend() && ulDelete > 0;
-		     ++iterEntry, --ulDelete) {
-			auto iterMap = m_map.find(iterEntry->key);
-			assert(iterMap != m_map.end());
-			m_ulSize -= GetCacheAdditionalSize(iterMap->second);
-			m_ulSize -= GetCacheAdditionalSize(iterMap->first);
-			m_map.erase(iterMap);
-		}
+	void EraseItem(typename MapType::iterator iter)
+	{
+		LruUnlink(&iter->second);
+		m_ulSize -= GetCacheAdditionalSize(iter->second);
+		m_ulSize -= GetCacheAdditionalSize(iter->first);
+		m_map.erase(iter);
+	}
+
+	/* Remove the least recently used item. */
+	void EraseTail()
+	{
+		auto key = static_cast<const key_type *>(m_lru_tail->m_lru_key);
+		auto iter = m_map.find(*key);
+		assert(iter != m_map.end());
+		EraseItem(iter);
+	}
+
+	/*
+	 * The tail of an aging cache holds the oldest entry; reap from
+	 * there until the first unexpired one. Every entry is reaped at most
+	 * once, so this is amortized O(1) per insertion.
+	 */
+	void ExpireItems(time_t tNow)
+	{
+		while (m_lru_tail != nullptr &&
+		       static_cast<long>(tNow - m_lru_tail->ulLastAccess) >= MaxAge())
+			EraseTail();
+	}
 
+	ECRESULT PurgeCache(float ratio)
+	{
+		// Remove the oldest [ratio] % of all cache entries.
+		size_t ulDelete = m_map.size() * ratio;
+		if (ulDelete == 0)
+			ulDelete = 1;
+		while (ulDelete-- > 0 && m_lru_tail != nullptr)
+			EraseTail();
 		return erSuccess;
 	}
 
@@ -245,6 +299,84 @@ private:
 
 	MapType m_map;
 	size_type			m_ulSize;
+	ECsCacheEntry *m_lru_head = nullptr, *m_lru_tail = nullptr;
+};
+
+/*
+ * A set of independent ECCache instances, each with its own lock,
+ * selected by key hash. Lookups on different shards do not contend.
+ * Callers lock the shard returned by get() for as long as they use a
+ * pointer obtained from that shard's cache.
+ */
+template<typename MapType, unsigned int N = 16> class ECShardedCache _kc_final {
+public:
+	typedef typename MapType::key_type key_type;
+	typedef ECCacheBase::size_type size_type;
+
+	struct shard {
+		shard(const std::string &name, size_type maxsize, long maxage) :
+			cache(name, maxsize, maxage)
+		{}
+		std::recursive_mutex mtx;
+		ECCache<MapType> cache;
+	};
+
+	ECShardedCache(const std::string &name, size_type maxsize, long maxage) :
+		m_strCachename(name)
+	{
+		for (auto &s : m_shards)
+			s.reset(new shard(name, maxsize / N, maxage));
+	}
+
+	shard &get(const key_type &key)
+	{
+		return *m_shards[std::hash<key_type>()(key) % N];
+	}
+
+	void ClearCache()
+	{
+		for (auto &s : m_shards) {
+			std::lock_guard<std::recursive_mutex> lock(s->mtx);
+			s->cache.ClearCache();
+		}
+	}
+
+	size_type MaxSize() const
+	{
+		size_type z = 0;
+		for (const auto &s : m_shards)
+			z += s->cache.MaxSize();
+		return z;
+	}
+
+	void SetMaxSize(size_type z)
+	{
+		for (auto &s : m_shards) {
+			std::lock_guard<std::recursive_mutex> lock(s->mtx);
+			s->cache.SetMaxSize(z / N);
+		}
+	}
+
+	ECCacheStat get_stats()
+	{
+		ECCacheStat st;
+		st.name = m_strCachename;
+		st.items = st.size = st.maxsize = st.req = st.hit = 0;
+		for (auto &s : m_shards) {
+			std::lock_guard<std::recursive_mutex> lock(s->mtx);
+			auto x = s->cache.get_stats();
+			st.items += x.items;
+			st.size += x.size;
+			st.maxsize += x.maxsize;
+			st.req += x.req;
+			st.hit += x.hit;
+		}
+		return st;
+	}
+
+private:
+	const std::string m_strCachename;
+	std::unique_ptr<shard> m_shards[N];
 };
 
 } /* namespace */
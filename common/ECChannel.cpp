@@ -272,6 +272,8 @@ HRESULT ECChannel::HrEnableTLS(void)
 		goto exit;
 	}
 
+	/* Plaintext sent before the handshake must not count as encrypted input */
+	m_rbuf.clear();
 	SSL_set_accept_state(lpSSL);
 	if ((rc = SSL_accept(lpSSL)) != 1) {
 		ec_log_err("ECChannel::HrEnableTLS(): SSL_accept failed: %d", SSL_get_error(lpSSL, rc));
@@ -287,6 +289,54 @@ exit:
 	return hr;
 }
 
+/**
+ * Run the server side of the TLS handshake as far as it gets without
+ * waiting for the client, for callers that poll the socket themselves.
+ * Call again when the socket is ready for *events.
+ *
+ * @param[out] events 0 when the handshake is complete, otherwise POLLIN
+ *             or POLLOUT for what the socket must be waited for
+ */
+HRESULT ECChannel::HrAcceptTLS(short *events)
+{
+	if (lpSSL == nullptr) {
+		if (lpCTX == nullptr) {
+			ec_log_err("ECChannel::HrAcceptTLS(): invalid parameters");
+			return MAPI_E_CALL_FAILED;
+		}
+		lpSSL = SSL_new(lpCTX);
+		if (lpSSL == nullptr) {
+			ec_log_err("ECChannel::HrAcceptTLS(): SSL_new failed");
+			return MAPI_E_CALL_FAILED;
+		}
+		if (SSL_set_fd(lpSSL, fd) != 1) {
+			ec_log_err("ECChannel::HrAcceptTLS(): SSL_set_fd failed");
+			SSL_free(lpSSL);
+			lpSSL = nullptr;
+			return MAPI_E_CALL_FAILED;
+		}
+		m_rbuf.clear();
+		SSL_set_accept_state(lpSSL);
+	}
+
+	auto fl = fcntl(fd, F_GETFL);
+	int err = SSL_ERROR_SYSCALL;
+	if (fl >= 0 && fcntl(fd, F_SETFL, fl | O_NONBLOCK) == 0) {
+		ERR_clear_error();
+		auto rc = SSL_accept(lpSSL);
+		err = rc == 1 ? SSL_ERROR_NONE : SSL_get_error(lpSSL, rc);
+		fcntl(fd, F_SETFL, fl);
+	}
+	*events = err == SSL_ERROR_WANT_READ ? POLLIN :
+	          err == SSL_ERROR_WANT_WRITE ? POLLOUT : 0;
+	if (err == SSL_ERROR_NONE || *events != 0)
+		return hrSuccess;
+	ec_log_err("ECChannel::HrAcceptTLS(): SSL_accept failed: %d", err);
+	SSL_free(lpSSL);
+	lpSSL = nullptr;
+	return MAPI_E_CALL_FAILED;
+}
+
 HRESULT ECChannel::HrGets(char *szBuffer, size_t ulBufSize, size_t *lpulRead)
 {
 	char *lpRet = NULL;
@@ -322,6 +372,18 @@ HRESULT ECChannel::HrReadLine(std::string &strBuffer, size_t ulMaxBuffer)
 
 	// clear the buffer before appending
 	strBuffer.clear();
+	auto nl = m_rbuf.find('\n');
+	if (nl != std::string::npos) {
+		auto end = nl > 0 && m_rbuf[nl-1] == '\r' ? nl - 1 : nl;
+		strBuffer.assign(m_rbuf, 0, end);
+		m_rbuf.erase(0, nl + 1);
+		return strBuffer.size() > ulMaxBuffer ? MAPI_E_TOO_BIG : hrSuccess;
+	}
+	if (m_rbuf.size() > ulMaxBuffer)
+		return MAPI_E_TOO_BIG;
+	/* The start of the line was read ahead */
+	strBuffer = std::move(m_rbuf);
+	m_rbuf.clear();
 	do {
 		auto hr = HrGets(buffer, 65536, &ulRead);
 		if (hr != hrSuccess)
@@ -382,9 +444,19 @@ HRESULT ECChannel::HrWriteLine(const std::string & strBuffer) {
  * @retval MAPI_E_NETWORK_ERROR Unable to read bytes.
  * @retval MAPI_E_CALL_FAILED Reading wrong amount of data.
  */
+/* Move up to @len bytes of read-ahead input to @buf */
+size_t ECChannel::take_buffered(char *buf, size_t len)
+{
+	len = std::min(len, m_rbuf.size());
+	if (buf != nullptr)
+		memcpy(buf, m_rbuf.data(), len);
+	m_rbuf.erase(0, len);
+	return len;
+}
+
 HRESULT ECChannel::HrReadAndDiscardBytes(size_t ulByteCount)
 {
-	size_t ulTotRead = 0;
+	size_t ulTotRead = take_buffered(nullptr, ulByteCount);
 	char szBuffer[4096];
 
 	while (ulTotRead < ulByteCount) {
@@ -414,6 +486,7 @@ HRESULT ECChannel::HrReadBytes(char *szBuffer, size_t ulByteCount)
 
 	if(!szBuffer)
 		return MAPI_E_INVALID_PARAMETER;
+	ulTotRead = take_buffered(szBuffer, ulByteCount);
 
 	while(ulTotRead < ulByteCount) {
 		if (lpSSL)
@@ -450,10 +523,81 @@ HRESULT ECChannel::HrReadBytes(std::string * strBuffer, size_t ulByteCount)
 	return hrSuccess;
 }
 
+/**
+ * Whether the socket holds a complete TLS record, which SSL_read can then
+ * decrypt without waiting for the client.
+ */
+bool ECChannel::tls_record_ready() const
+{
+	unsigned char hdr[5];
+	auto n = recv(fd, hdr, sizeof(hdr), MSG_PEEK | MSG_DONTWAIT);
+	if (n == 0)
+		/* Let SSL_read see the end of the stream */
+		return true;
+	if (n < static_cast<ssize_t>(sizeof(hdr)))
+		return false;
+	size_t rec = sizeof(hdr) + (hdr[3] << 8 | hdr[4]);
+	std::unique_ptr<char[]> buf(new(std::nothrow) char[rec]);
+	if (buf == nullptr)
+		return false;
+	return recv(fd, buf.get(), rec, MSG_PEEK | MSG_DONTWAIT) == static_cast<ssize_t>(rec);
+}
+
+/**
+ * Read the input that has arrived, without waiting for more, and keep it
+ * for the next HrReadLine or HrReadBytes. This lets a caller that polls
+ * many sockets collect a line over several reads instead of blocking on
+ * a slow client; read_buffer() shows what has been collected so far.
+ *
+ * @retval MAPI_E_NETWORK_ERROR the client closed the connection or the
+ *         read failed; input collected before that stays available
+ */
+HRESULT ECChannel::HrReadAvailable()
+{
+	char buf[16384];
+	/*
+	 * Do not let one busy client hold the caller forever. Bytes that
+	 * OpenSSL already decrypted are taken regardless of the limit: the
+	 * socket would not become readable for them again.
+	 */
+	for (size_t total = 0; ; ) {
+		ssize_t n;
+		if (lpSSL != nullptr) {
+			if (SSL_pending(lpSSL) == 0 &&
+			    (total >= 16 * sizeof(buf) || !tls_record_ready()))
+				return hrSuccess;
+			/* A record without application data must not make SSL_read wait for the next */
+			auto mode = SSL_get_mode(lpSSL);
+			SSL_clear_mode(lpSSL, SSL_MODE_AUTO_RETRY);
+			n = SSL_read(lpSSL, buf, sizeof(buf));
+			auto err = n > 0 ? SSL_ERROR_NONE : SSL_get_error(lpSSL, n);
+			if (mode & SSL_MODE_AUTO_RETRY)
+				SSL_set_mode(lpSSL, SSL_MODE_AUTO_RETRY);
+			if (err == SSL_ERROR_WANT_READ)
+				return hrSuccess;
+			if (n <= 0)
+				return MAPI_E_NETWORK_ERROR;
+		} else {
+			n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return hrSuccess;
+			if (n <= 0)
+				return MAPI_E_NETWORK_ERROR;
+		}
+		m_rbuf.append(buf, n);
+		total += n;
+		if (lpSSL == nullptr && total >= 16 * sizeof(buf))
+			/* The rest stays in the socket, which epoll reports again */
+			return hrSuccess;
+	}
+}
+
 HRESULT ECChannel::HrSelect(int seconds) {
 	struct pollfd pollfd = {fd, POLLIN, 0};
 
-	if(lpSSL && SSL_pending(lpSSL))
+	if (!m_rbuf.empty() || (lpSSL && SSL_pending(lpSSL)))
 		return hrSuccess;
 	int res = poll(&pollfd, 1, seconds * 1000);
 	if (res == -1) {
@@ -7,39 +7,64 @@
 #define ECFIFOBUFFER_H
 
 #include <kopano/zcdefs.h>
+#include <atomic>
 #include <condition_variable>
-#include <deque>
+#include <memory>
 #include <mutex>
 #include <kopano/kcodes.h>
 
 namespace KC {
 
-// Thread safe buffer for FIFO operations
+/*
+ * Thread safe buffer for FIFO operations between one writer and one reader.
+ *
+ * The data lives in a fixed-size ring. Both ends move their own position
+ * without locking; the mutex is only taken to sleep when the ring is full
+ * or empty. A sleeping side is only woken once the other side has made
+ * enough room or data available for it to make progress in bulk (at most
+ * half the ring), rather than on every byte.
+ *
+ * GetWriteSpan/CommitWrite and GetReadSpan/CommitRead expose contiguous
+ * regions of the ring, so that data can be produced or consumed in place.
+ */
 class _kc_export ECFifoBuffer _kc_final {
 public:
-	typedef std::deque<unsigned char>	storage_type;
-	typedef storage_type::size_type		size_type;
+	typedef size_t size_type;
 	enum close_flags { cfRead = 1, cfWrite = 2 };
 
 	ECFifoBuffer(size_type ulMaxSize = 131072);
 	ECRESULT Write(const void *lpBuf, size_type cbBuf, unsigned int ulTimeoutMs, size_type *lpcbWritten);
 	ECRESULT Read(void *lpBuf, size_type cbBuf, unsigned int ulTimeoutMs, size_type *lpcbRead);
+	ECRESULT GetWriteSpan(unsigned char **, size_type *, unsigned int timeout_ms, size_type want = 1);
+	void CommitWrite(size_type);
+	ECRESULT GetReadSpan(const unsigned char **, size_type *, unsigned int timeout_ms, size_type want = 1);
+	void CommitRead(size_type);
 	ECRESULT Close(close_flags flags);
 	_kc_hidden ECRESULT Flush(void);
 	_kc_hidden bool IsClosed(ULONG flags) const;
-	_kc_hidden bool IsEmpty() const { return m_storage.empty(); }
-	_kc_hidden bool IsFull() const { return m_storage.size() == m_ulMaxSize; }
+	_kc_hidden bool IsEmpty() const { return m_head.load() == m_tail.load(); }
+	_kc_hidden bool IsFull() const { return m_tail.load() - m_head.load() == m_ulMaxSize; }
 
 private:
 	// prohibit copy
 	ECFifoBuffer(const ECFifoBuffer &) = delete;
 	ECFifoBuffer &operator=(const ECFifoBuffer &) = delete;
+	_kc_hidden ECRESULT wait(std::condition_variable &, std::atomic<size_type> &want_var, size_type want, unsigned int timeout_ms, bool (ECFifoBuffer::*ready)(size_type) const);
+	_kc_hidden bool readable(size_type want) const;
+	_kc_hidden bool writable(size_type want) const;
 
-	storage_type	m_storage;
+	std::unique_ptr<unsigned char[]> m_storage;
 	size_type		m_ulMaxSize;
-	bool m_bReaderClosed = false, m_bWriterClosed = false;
+	/*
+	 * Total number of bytes ever read and written. The head is only
+	 * advanced by the reader, the tail only by the writer.
+	 */
+	std::atomic<size_type> m_head{0}, m_tail{0};
+	/* Amount of data/room a sleeping reader/writer waits for, or 0. */
+	std::atomic<size_type> m_read_want{0}, m_write_want{0};
+	std::atomic<bool> m_bReaderClosed{false}, m_bWriterClosed{false};
 	std::mutex m_hMutex;
-	std::condition_variable m_hCondNotEmpty, m_hCondNotFull, m_hCondFlushed;
+	std::condition_variable m_hCondNotEmpty, m_hCondNotFull;
 };
 
 } /* namespace */
@@ -368,9 +368,13 @@ char* ECMemStream::GetBuffer()
 	return lpMemBlock->GetBuffer();
 }
 
-ECFifoBuffer::ECFifoBuffer(size_type ulMaxSize) :
-	m_ulMaxSize(ulMaxSize)
-{}
+ECFifoBuffer::ECFifoBuffer(size_type ulMaxSize)
+{
+	/* Round up to a power of two so positions can be masked */
+	for (m_ulMaxSize = 16; m_ulMaxSize < ulMaxSize; m_ulMaxSize <<= 1)
+		/* loop */;
+	m_storage.reset(new unsigned char[m_ulMaxSize]);
+}
 
 /**
  * Write data into the FIFO.
@@ -382,7 +386,6 @@ ECFifoBuffer::ECFifoBuffer(size_type ulMaxSize) :
  *
  * @retval	erSuccess		The data was successfully written.
  * @retval	KCERR_INVALID_PARAMETER	lpBuf is NULL.
- * @retval	KCERR_NOT_ENOUGH_MEMORY	There was not enough memory available to store the data.
  * @retval	KCERR_TIMEOUT		Not all data was written within the specified time limit.
  *					The amount of data that was written is returned in lpcbWritten.
  * @retval	KCERR_NETWORK_ERROR	The buffer was closed prior to this call.
@@ -398,41 +401,18 @@ ECRESULT ECFifoBuffer::Write(const void *lpBuf, size_type cbBuf,
 		return KCERR_INVALID_PARAMETER;
 	if (IsClosed(cfWrite))
 		return KCERR_NETWORK_ERROR;
-	if (cbBuf == 0) {
-		if (lpcbWritten != nullptr)
-			*lpcbWritten = 0;
-		return erSuccess;
-	}
 
-	ulock_normal locker(m_hMutex);
 	while (cbWritten < cbBuf) {
-		while (IsFull()) {
-			if (IsClosed(cfRead)) {
-				er = KCERR_NETWORK_ERROR;
-				goto exit;
-			}
-			if (ulTimeoutMs == 0) {
-				m_hCondNotFull.wait(locker);
-			} else if (m_hCondNotFull.wait_for(locker,
-			    std::chrono::milliseconds(ulTimeoutMs)) == std::cv_status::timeout) {
-				er = KCERR_TIMEOUT;
-				goto exit;
-			}
-		}
-
-		const size_type cbNow = std::min(cbBuf - cbWritten, m_ulMaxSize - m_storage.size());
-		try {
-			m_storage.insert(m_storage.end(), lpData + cbWritten, lpData + cbWritten + cbNow);
-		} catch (const std::bad_alloc &) {
-			er = KCERR_NOT_ENOUGH_MEMORY;
-			goto exit;
-		}
-		m_hCondNotEmpty.notify_one();
-		cbWritten += cbNow;
+		unsigned char *span;
+		size_type len;
+		er = GetWriteSpan(&span, &len, ulTimeoutMs, cbBuf - cbWritten);
+		if (er != erSuccess)
+			break;
+		len = std::min(len, cbBuf - cbWritten);
+		memcpy(span, lpData + cbWritten, len);
+		CommitWrite(len);
+		cbWritten += len;
 	}
-
-exit:
-	locker.unlock();
 	if (lpcbWritten && (er == erSuccess || er == KCERR_TIMEOUT))
 		*lpcbWritten = cbWritten;
 	return er;
@@ -462,44 +442,156 @@ ECRESULT ECFifoBuffer::Read(void *lpBuf, size_type cbBuf,
 		return KCERR_INVALID_PARAMETER;
 	if (IsClosed(cfRead))
 		return KCERR_NETWORK_ERROR;
-	if (cbBuf == 0) {
-		if (lpcbRead != nullptr)
-			*lpcbRead = 0;
-		return erSuccess;
-	}
 
-	ulock_normal locker(m_hMutex);
 	while (cbRead < cbBuf) {
-		while (IsEmpty()) {
-			if (IsClosed(cfWrite))
-				goto exit;
-
-			if (ulTimeoutMs == 0) {
-				m_hCondNotEmpty.wait(locker);
-			} else if (m_hCondNotEmpty.wait_for(locker,
-			    std::chrono::milliseconds(ulTimeoutMs)) == std::cv_status::timeout) {
-				er = KCERR_TIMEOUT;
-				goto exit;
-			}
-		}
-
-		const size_type cbNow = std::min(cbBuf - cbRead, m_storage.size());
-		auto iEndNow = m_storage.begin() + cbNow;
-		std::copy(m_storage.begin(), iEndNow, lpData + cbRead);
-		m_storage.erase(m_storage.begin(), iEndNow);
-		m_hCondNotFull.notify_one();
-		cbRead += cbNow;
+		const unsigned char *span;
+		size_type len;
+		er = GetReadSpan(&span, &len, ulTimeoutMs, cbBuf - cbRead);
+		if (er != erSuccess || len == 0)
+			break;
+		len = std::min(len, cbBuf - cbRead);
+		memcpy(lpData + cbRead, span, len);
+		CommitRead(len);
+		cbRead += len;
 	}
-
-	if (IsEmpty() && IsClosed(cfWrite))
-		m_hCondFlushed.notify_one();
-exit:
-	locker.unlock();
 	if (lpcbRead != nullptr && (er == erSuccess || er == KCERR_TIMEOUT))
 		*lpcbRead = cbRead;
 	return er;
 }
 
+bool ECFifoBuffer::readable(size_type want) const
+{
+	return m_tail.load() - m_head.load() >= want || m_bWriterClosed;
+}
+
+bool ECFifoBuffer::writable(size_type want) const
+{
+	return m_ulMaxSize - (m_tail.load() - m_head.load()) >= want || m_bReaderClosed;
+}
+
+/**
+ * Sleep until @ready(@want) holds. The other side only wakes us once it
+ * does, as it checks @want_var after moving its position.
+ */
+ECRESULT ECFifoBuffer::wait(std::condition_variable &cond,
+    std::atomic<size_type> &want_var, size_type want, unsigned int timeout_ms,
+    bool (ECFifoBuffer::*ready)(size_type) const)
+{
+	ulock_normal locker(m_hMutex);
+	auto pred = [&]() { return (this->*ready)(want); };
+	bool ok = true;
+
+	want_var = want;
+	if (timeout_ms == 0)
+		cond.wait(locker, pred);
+	else
+		ok = cond.wait_for(locker, std::chrono::milliseconds(timeout_ms), pred);
+	want_var = 0;
+	return ok ? erSuccess : KCERR_TIMEOUT;
+}
+
+/**
+ * Get a contiguous region of free space in the FIFO to write into. Blocks
+ * until at least @want bytes (capped at half the FIFO size) are free;
+ * the region returned may still be shorter when it wraps around.
+ *
+ * @param[out]	ptr		Start of the region.
+ * @param[out]	len		Size of the region.
+ * @param[in]	timeout_ms	The maximum amount that this function may block.
+ * @param[in]	want		Amount of space the caller would like.
+ *
+ * @retval	KCERR_NETWORK_ERROR	The writer or reader side was closed.
+ * @retval	KCERR_TIMEOUT		No space became available in time.
+ */
+ECRESULT ECFifoBuffer::GetWriteSpan(unsigned char **ptr, size_type *len,
+    unsigned int timeout_ms, size_type want)
+{
+	if (ptr == nullptr || len == nullptr)
+		return KCERR_INVALID_PARAMETER;
+	if (IsClosed(cfWrite))
+		return KCERR_NETWORK_ERROR;
+	want = std::max(static_cast<size_type>(1), std::min(want, m_ulMaxSize / 2));
+	if (!writable(want)) {
+		auto er = wait(m_hCondNotFull, m_write_want, want, timeout_ms, &ECFifoBuffer::writable);
+		if (er != erSuccess)
+			return er;
+	}
+	auto tail = m_tail.load(std::memory_order_relaxed);
+	auto room = m_ulMaxSize - (tail - m_head.load());
+	if (room == 0)
+		/* only when the reader is gone */
+		return KCERR_NETWORK_ERROR;
+	auto off = tail & (m_ulMaxSize - 1);
+	*ptr = &m_storage[off];
+	*len = std::min(room, m_ulMaxSize - off);
+	return erSuccess;
+}
+
+/**
+ * Make @n bytes written into the region from GetWriteSpan available to the
+ * reader.
+ */
+void ECFifoBuffer::CommitWrite(size_type n)
+{
+	auto tail = m_tail.load(std::memory_order_relaxed) + n;
+	m_tail.store(tail);
+	auto want = m_read_want.load();
+	if (want != 0 && tail - m_head.load() >= want) {
+		scoped_lock locker(m_hMutex);
+		m_hCondNotEmpty.notify_one();
+	}
+}
+
+/**
+ * Get a contiguous region of data in the FIFO to read from. Blocks until
+ * at least @want bytes (capped at half the FIFO size) are available or the
+ * writer side is closed; the region returned may still be shorter when it
+ * wraps around. A zero-length region means the writer is done and all data
+ * has been read.
+ *
+ * @param[out]	ptr		Start of the region.
+ * @param[out]	len		Size of the region.
+ * @param[in]	timeout_ms	The maximum amount that this function may block.
+ * @param[in]	want		Amount of data the caller would like.
+ *
+ * @retval	KCERR_NETWORK_ERROR	The reader side was closed.
+ * @retval	KCERR_TIMEOUT		No data became available in time.
+ */
+ECRESULT ECFifoBuffer::GetReadSpan(const unsigned char **ptr, size_type *len,
+    unsigned int timeout_ms, size_type want)
+{
+	if (ptr == nullptr || len == nullptr)
+		return KCERR_INVALID_PARAMETER;
+	if (IsClosed(cfRead))
+		return KCERR_NETWORK_ERROR;
+	want = std::max(static_cast<size_type>(1), std::min(want, m_ulMaxSize / 2));
+	if (!readable(want)) {
+		auto er = wait(m_hCondNotEmpty, m_read_want, want, timeout_ms, &ECFifoBuffer::readable);
+		if (er != erSuccess)
+			return er;
+	}
+	auto head = m_head.load(std::memory_order_relaxed);
+	auto avail = m_tail.load() - head;
+	auto off = head & (m_ulMaxSize - 1);
+	*ptr = &m_storage[off];
+	*len = std::min(avail, m_ulMaxSize - off);
+	return erSuccess;
+}
+
+/**
+ * Release @n bytes read from the region from GetReadSpan to the writer.
+ */
+void ECFifoBuffer::CommitRead(size_type n)
+{
+	auto head = m_head.load(std::memory_order_relaxed) + n;
+	m_head.store(head);
+	auto want = m_write_want.load();
+	if (want != 0 && m_ulMaxSize - (m_tail.load() - head) >= want) {
+		scoped_lock locker(m_hMutex);
+		m_hCondNotFull.notify_one();
+	}
+}
+
 /**
  * Close a buffer.
  * This causes new writes to the buffer to fail with KCERR_NETWORK_ERROR and
@@ -510,13 +602,11 @@ ECRESULT ECFifoBuffer::Close(close_flags flags)
 	scoped_lock locker(m_hMutex);
 	if (flags & cfRead) {
 		m_bReaderClosed = true;
-		m_hCondNotFull.notify_one();
-		if(IsEmpty())
-			m_hCondFlushed.notify_one();
+		m_hCondNotFull.notify_all();
 	}
 	if (flags & cfWrite) {
 		m_bWriterClosed = true;
-		m_hCondNotEmpty.notify_one();
+		m_hCondNotEmpty.notify_all();
 	}
 	return erSuccess;
 }
@@ -533,11 +623,8 @@ ECRESULT ECFifoBuffer::Flush()
 {
 	if (!IsClosed(cfWrite))
 		return KCERR_NETWORK_ERROR;
-
-	ulock_normal locker(m_hMutex);
-	m_hCondFlushed.wait(locker,
-		[this](void) { return IsClosed(cfWrite) || IsEmpty(); });
-	return erSuccess;
+	/* The whole ring being writable means it is empty. */
+	return wait(m_hCondNotFull, m_write_want, m_ulMaxSize, 0, &ECFifoBuffer::writable);
 }
 
 bool ECFifoBuffer::IsClosed(unsigned int flags) const
@@ -136,12 +136,22 @@ std::string ECStatsCollector::stats_as_text()
 	Json::Value root;
 	root["version"] = 2;
 
-	for (auto &i : m_StatData) {
-		scoped_lock lk(i.second.lock);
+	for (unsigned int k = 0; k < SCN_MAX; ++k) {
+		auto &i = m_StatData[k];
+		if (i.name == nullptr)
+			continue;
 		Json::Value leaf;
-		leaf["desc"] = i.second.description;
-		setleaf(leaf, i.second);
-		root["stats"][i.second.name] = leaf;
+		leaf["desc"] = i.description;
+		setleaf(leaf, snapshot(static_cast<SCName>(k)));
+		root["stats"][i.name] = leaf;
+		if (i.hist == nullptr)
+			continue;
+		Json::Value hleaf;
+		hleaf["count"] = static_cast<Json::Value::UInt64>(i.hist->count());
+		hleaf["p50"] = static_cast<Json::Value::UInt64>(i.hist->percentile(0.5));
+		hleaf["p99"] = static_cast<Json::Value::UInt64>(i.hist->percentile(0.99));
+		hleaf["p999"] = static_cast<Json::Value::UInt64>(i.hist->percentile(0.999));
+		root["stats"][i.name]["hist"] = std::move(hleaf);
 	}
 	std::unique_lock<std::mutex> lk(m_odm_lock);
 	for (const auto &i : m_ondemand) {
@@ -161,14 +171,13 @@ std::string ECStatsCollector::survey_as_text()
 
 	for (const auto &key : {SCN_MACHINE_ID, SCN_PROGRAM_NAME, SCN_PROGRAM_VERSION,
 	    SCN_SERVER_GUID, SCN_UTSNAME, SCN_OSRELEASE}) {
-		auto i = m_StatData.find(key);
-		if (i == m_StatData.cend())
+		auto &i = m_StatData[key];
+		if (i.name == nullptr)
 			continue;
-		scoped_lock lk(i->second.lock);
 		Json::Value leaf;
-		leaf["desc"] = i->second.description;
-		setleaf(leaf, i->second);
-		root["stats"][i->second.name] = leaf;
+		leaf["desc"] = i.description;
+		setleaf(leaf, snapshot(key));
+		root["stats"][i.name] = leaf;
 	}
 	std::unique_lock<std::mutex> lk(m_odm_lock);
 	for (const auto &key : {"userplugin", "usercnt_active", "usercnt_contact",
@@ -259,9 +268,75 @@ void ECStatsCollector::mainloop()
 #endif
 }
 
+ECLatencyHistogram::ECLatencyHistogram()
+{
+	reset();
+}
+
+unsigned int ECLatencyHistogram::bucket_of(uint64_t v)
+{
+	if (v < LINEAR)
+		return v;
+	unsigned int msb = 63 - __builtin_clzll(v);
+	unsigned int shift = msb - SUB_BITS;
+	if (shift > MAX_SHIFT)
+		return NBUCKETS - 1;
+	return LINEAR + ((shift - 1) << SUB_BITS) + ((v >> shift) & ((1U << SUB_BITS) - 1));
+}
+
+uint64_t ECLatencyHistogram::bucket_top(unsigned int idx)
+{
+	if (idx < LINEAR)
+		return idx;
+	unsigned int shift = ((idx - LINEAR) >> SUB_BITS) + 1;
+	uint64_t sub = (idx - LINEAR) & ((1U << SUB_BITS) - 1);
+	return (((1ULL << SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+void ECLatencyHistogram::record(uint64_t v)
+{
+	m_bucket[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t ECLatencyHistogram::count() const
+{
+	uint64_t n = 0;
+	for (const auto &b : m_bucket)
+		n += b.load(std::memory_order_relaxed);
+	return n;
+}
+
+uint64_t ECLatencyHistogram::percentile(double q) const
+{
+	/* Buckets may move while we scan; a slightly stale answer is fine. */
+	uint64_t snap[NBUCKETS], total = 0;
+	for (unsigned int i = 0; i < NBUCKETS; ++i)
+		total += snap[i] = m_bucket[i].load(std::memory_order_relaxed);
+	if (total == 0)
+		return 0;
+	uint64_t want = q * total, seen = 0;
+	if (want == 0)
+		want = 1;
+	for (unsigned int i = 0; i < NBUCKETS; ++i) {
+		seen += snap[i];
+		if (seen >= want)
+			return bucket_top(i);
+	}
+	return bucket_top(NBUCKETS - 1);
+}
+
+void ECLatencyHistogram::reset()
+{
+	for (auto &b : m_bucket)
+		b.store(0, std::memory_order_relaxed);
+}
+
 ECStatsCollector::ECStatsCollector(std::shared_ptr<ECConfig> config) :
-	m_config(std::move(config))
+	m_shards(new counter_shard[SC_SHARDS]), m_config(std::move(config))
 {
+	for (unsigned int s = 0; s < SC_SHARDS; ++s)
+		for (auto &v : m_shards[s].v)
+			v.store(0, std::memory_order_relaxed);
 	AddStat(SCN_MACHINE_ID, SCT_STRING, "machine_id");
 	AddStat(SCN_UTSNAME, SCT_STRING, "utsname", "Pretty platform name"); /* not for parsing */
 	AddStat(SCN_OSRELEASE, SCT_STRING, "osrelease", "Pretty operating system name"); /* not for parsing either */
@@ -312,14 +387,55 @@ void ECStatsCollector::AddStat(SCName index, SCType type, const char *name,
 	newStat.description = description;
 }
 
+void ECStatsCollector::AddHistogram(SCName index)
+{
+	auto &st = m_StatData[index];
+	assert(st.name != nullptr);
+	if (st.hist == nullptr)
+		st.hist.reset(new ECLatencyHistogram);
+}
+
+/* Slot for the calling thread; threads are spread round-robin. */
+static unsigned int sc_shard_index(unsigned int nshards)
+{
+	static std::atomic<unsigned int> next{0};
+	static thread_local unsigned int idx = next.fetch_add(1, std::memory_order_relaxed);
+	return idx % nshards;
+}
+
+LONGLONG ECStatsCollector::sharded_sum(SCName name) const
+{
+	LONGLONG sum = 0;
+	for (unsigned int s = 0; s < SC_SHARDS; ++s)
+		sum += m_shards[s].v[name].load(std::memory_order_relaxed);
+	return sum;
+}
+
+void ECStatsCollector::sharded_clear(SCName name)
+{
+	for (unsigned int s = 0; s < SC_SHARDS; ++s)
+		m_shards[s].v[name].store(0, std::memory_order_relaxed);
+}
+
+/* Consistent copy of one stat with the per-thread counter slots folded in */
+ECStat2 ECStatsCollector::snapshot(SCName name)
+{
+	auto &i = m_StatData[name];
+	scoped_lock lk(i.lock);
+	ECStat2 r{i.description, i.strdata, i.type, i.data};
+	if (i.type == SCT_INTEGER || i.type == SCT_INTGAUGE)
+		r.data.ll += sharded_sum(name);
+	return r;
+}
+
 void ECStatsCollector::inc(SCName name, double inc)
 {
-	auto iSD = m_StatData.find(name);
-	if (iSD == m_StatData.cend())
+	auto &i = m_StatData[name];
+	if (i.name == nullptr)
 		return;
-	assert(iSD->second.type == SCT_REAL || iSD->second.type == SCT_REALGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.f += inc;
+	assert(i.type == SCT_REAL || i.type == SCT_REALGAUGE);
+	scoped_lock lk(i.lock);
+	i.data.f += inc;
 }
 
 void ECStatsCollector::inc(SCName name, int v)
@@ -329,112 +445,101 @@ void ECStatsCollector::inc(SCName name, int v)
 
 void ECStatsCollector::inc(SCName name, LONGLONG inc)
 {
-	auto iSD = m_StatData.find(name);
-	if (iSD == m_StatData.cend())
+	auto &i = m_StatData[name];
+	if (i.name == nullptr)
 		return;
-	assert(iSD->second.type == SCT_INTEGER || iSD->second.type == SCT_INTGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.ll += inc;
+	assert(i.type == SCT_INTEGER || i.type == SCT_INTGAUGE);
+	/*
+	 * Lock-free on the hot path; readers add up the slots. Gauges go
+	 * through the same slots so that inc/dec pairs need no lock either.
+	 */
+	m_shards[sc_shard_index(SC_SHARDS)].v[name].fetch_add(inc, std::memory_order_relaxed);
 }
 
 void ECStatsCollector::set_dbl(enum SCName name, double set)
 {
-	auto iSD = m_StatData.find(name);
-	if (iSD == m_StatData.cend())
+	auto &i = m_StatData[name];
+	if (i.name == nullptr)
 		return;
-	assert(iSD->second.type == SCT_REAL || iSD->second.type == SCT_REALGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.f = set;
+	assert(i.type == SCT_REAL || i.type == SCT_REALGAUGE);
+	scoped_lock lk(i.lock);
+	i.data.f = set;
 }
 
 void ECStatsCollector::set(enum SCName name, LONGLONG set)
 {
-	auto iSD = m_StatData.find(name);
-	if (iSD == m_StatData.cend())
+	auto &i = m_StatData[name];
+	if (i.name == nullptr)
 		return;
-	assert(iSD->second.type == SCT_INTEGER || iSD->second.type == SCT_INTGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.ll = set;
+	assert(i.type == SCT_INTEGER || i.type == SCT_INTGAUGE);
+	scoped_lock lk(i.lock);
+	sharded_clear(name);
+	i.data.ll = set;
 }
 
 void ECStatsCollector::SetTime(enum SCName name, time_t set)
 {
-	auto iSD = m_StatData.find(name);
-	if (iSD == m_StatData.cend())
+	auto &i = m_StatData[name];
+	if (i.name == nullptr)
 		return;
-	assert(iSD->second.type == SCT_TIME);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.ts = set;
+	assert(i.type == SCT_TIME);
+	scoped_lock lk(i.lock);
+	i.data.ts = set;
 }
 
 void ECStatsCollector::set(SCName name, const std::string &s)
 {
-	auto i = m_StatData.find(name);
-	if (i == m_StatData.cend())
+	auto &i = m_StatData[name];
+	if (i.name == nullptr)
 		return;
-	assert(i->second.type == SCT_STRING);
-	scoped_lock lk(i->second.lock);
-	i->second.strdata = s;
+	assert(i.type == SCT_STRING);
+	scoped_lock lk(i.lock);
+	i.strdata = s;
 }
 
 void ECStatsCollector::Max(SCName name, LONGLONG max)
 {
-	auto iSD = m_StatData.find(name);
-	if (iSD == m_StatData.cend())
+	auto &i = m_StatData[name];
+	if (i.name == nullptr)
 		return;
-	assert(iSD->second.type == SCT_INTEGER || iSD->second.type == SCT_INTGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	if (iSD->second.data.ll < max)
-		iSD->second.data.ll = max;
+	assert(i.type == SCT_INTEGER || i.type == SCT_INTGAUGE);
+	scoped_lock lk(i.lock);
+	auto cur = i.data.ll + sharded_sum(name);
+	if (cur < max)
+		i.data.ll += max - cur;
 }
 
 void ECStatsCollector::avg_dbl(SCName name, double add)
 {
-	auto iSD = m_StatData.find(name);
-	if (iSD == m_StatData.cend())
+	auto &i = m_StatData[name];
+	if (i.name == nullptr)
 		return;
-	assert(iSD->second.type == SCT_REALGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.f = ((add - iSD->second.data.f) / iSD->second.avginc) + iSD->second.data.f;
-	++iSD->second.avginc;
-	if (iSD->second.avginc == 0)
-		iSD->second.avginc = 1;
+	assert(i.type == SCT_REALGAUGE);
+	scoped_lock lk(i.lock);
+	i.data.f = ((add - i.data.f) / i.avginc) + i.data.f;
+	++i.avginc;
+	if (i.avginc == 0)
+		i.avginc = 1;
 }
 
 void ECStatsCollector::avg(SCName name, LONGLONG add)
 {
-	auto iSD = m_StatData.find(name);
-	if (iSD == m_StatData.cend())
+	auto &i = m_StatData[name];
+	if (i.name == nullptr)
 		return;
-	assert(iSD->second.type == SCT_INTGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.ll = ((add - iSD->second.data.ll) / iSD->second.avginc) + iSD->second.data.ll;
-	++iSD->second.avginc;
-	if (iSD->second.avginc == 0)
-		iSD->second.avginc = 1;
+	assert(i.type == SCT_INTGAUGE);
+	scoped_lock lk(i.lock);
+	i.data.ll = ((add - i.data.ll) / i.avginc) + i.data.ll;
+	++i.avginc;
+	if (i.avginc == 0)
+		i.avginc = 1;
 }
 
-std::string ECStatsCollector::GetValue(const SCMap::const_iterator::value_type &iSD)
+void ECStatsCollector::hist(SCName name, LONGLONG v)
 {
-	switch (iSD.second.type) {
-	case SCT_REAL:
-	case SCT_REALGAUGE:
-		return stringify_double(iSD.second.data.f);
-	case SCT_INTEGER:
-	case SCT_INTGAUGE:
-		return stringify_int64(iSD.second.data.ll);
-	case SCT_TIME: {
-		if (iSD.second.data.ts <= 0)
-			break;
-		char timestamp[128] = { 0 };
-		struct tm *tm = localtime(&iSD.second.data.ts);
-		strftime(timestamp, sizeof timestamp, "%a %b %e %T %Y", tm);
-		return timestamp;
-	}
-	case SCT_STRING:
-		return iSD.second.strdata;
-	}
-	return "";
+	auto &i = m_StatData[name];
+	if (i.hist != nullptr)
+		i.hist->record(v < 0 ? 0 : v);
 }
 
 std::string ECStatsCollector::GetValue(const ECStat2 &i)
@@ -462,17 +567,25 @@ std::string ECStatsCollector::GetValue(const ECStat2 &i)
 
 std::string ECStatsCollector::GetValue(const SCName &name)
 {
-	auto iSD = m_StatData.find(name);
-	if (iSD != m_StatData.cend())
-		return GetValue(*iSD);
-	return {};
+	if (m_StatData[name].name == nullptr)
+		return {};
+	return GetValue(snapshot(name));
 }
 
 void ECStatsCollector::ForEachStat(void(callback)(const std::string &, const std::string &, const std::string &, void *), void *obj)
 {
-	for (auto &i : m_StatData) {
-		scoped_lock lk(i.second.lock);
-		callback(i.second.name, i.second.description, GetValue(i), obj);
+	for (unsigned int k = 0; k < SCN_MAX; ++k) {
+		auto &i = m_StatData[k];
+		if (i.name == nullptr)
+			continue;
+		callback(i.name, i.description, GetValue(snapshot(static_cast<SCName>(k))), obj);
+		if (i.hist == nullptr)
+			continue;
+		std::string n = i.name;
+		callback(n + "_count", "Number of samples", stringify_int64(i.hist->count()), obj);
+		callback(n + "_p50", "50th percentile (µs)", stringify_int64(i.hist->percentile(0.5)), obj);
+		callback(n + "_p99", "99th percentile (µs)", stringify_int64(i.hist->percentile(0.99)), obj);
+		callback(n + "_p999", "99.9th percentile (µs)", stringify_int64(i.hist->percentile(0.999)), obj);
 	}
 	std::lock_guard<std::mutex> lk(m_odm_lock);
 	for (const auto &i : m_ondemand)
@@ -481,21 +594,21 @@ void ECStatsCollector::ForEachStat(void(callback)(const std::string &, const std
 
 void ECStatsCollector::Reset()
 {
-	for (auto &i : m_StatData) {
-		// reset largest var in union
-		scoped_lock lk(i.second.lock);
-		i.second.data.ll = 0;
-	}
+	for (unsigned int k = 0; k < SCN_MAX; ++k)
+		Reset(static_cast<SCName>(k));
 }
 
 void ECStatsCollector::Reset(SCName name)
 {
-	auto iSD = m_StatData.find(name);
-	if (iSD == m_StatData.cend())
+	auto &i = m_StatData[name];
+	if (i.name == nullptr)
 		return;
 	/* reset largest var in union */
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.ll = 0;
+	scoped_lock lk(i.lock);
+	i.data.ll = 0;
+	sharded_clear(name);
+	if (i.hist != nullptr)
+		i.hist->reset();
 }
 
 void ECStatsCollector::set(const std::string &name, const std::string &desc, int64_t v)
@@ -27,6 +27,14 @@ enum SCName {
 	SCN_SERVER_CONNECTIONS, SCN_MAX_SOCKET_NUMBER, SCN_REDIRECT_COUNT, SCN_SOAP_REQUESTS, SCN_RESPONSE_TIME, SCN_PROCESSING_TIME,
 	/* search folder stats */
 	SCN_SEARCHFOLDER_COUNT, SCN_SEARCHFOLDER_THREADS, SCN_SEARCHFOLDER_UPDATE_RETRY, SCN_SEARCHFOLDER_UPDATE_FAIL,
+	SCN_SEARCHFOLDER_QUEUE, SCN_SEARCHFOLDER_QUEUE_AGE, SCN_SEARCHFOLDER_EVENTS, SCN_SEARCHFOLDER_THROTTLED,
+	/* notification stats */
+	SCN_NOTIFY_QUEUE, SCN_NOTIFY_SENT, SCN_NOTIFY_LATENCY,
+	/* table update stats */
+	SCN_TABLEUPD_QUEUE, SCN_TABLEUPD_COALESCED, SCN_TABLEUPD_APPLIED, SCN_TABLEUPD_LATENCY,
+	SCN_TABLESNAP_HITS, SCN_TABLESNAP_MISSES, SCN_TABLESNAP_VIEWS, SCN_TABLESNAP_SIZE,
+	/* maintenance stats */
+	SCN_MAINT_CHUNKS, SCN_MAINT_ROWS, SCN_MAINT_CHUNK_TIME, SCN_MAINT_PAUSES,
 	/* database stats */
 	SCN_DATABASE_CONNECTS, SCN_DATABASE_SELECTS, SCN_DATABASE_INSERTS, SCN_DATABASE_UPDATES, SCN_DATABASE_DELETES,
 	SCN_DATABASE_FAILED_CONNECTS, SCN_DATABASE_FAILED_SELECTS, SCN_DATABASE_FAILED_INSERTS, SCN_DATABASE_FAILED_UPDATES, SCN_DATABASE_FAILED_DELETES, SCN_DATABASE_LAST_FAILED,
@@ -41,6 +49,7 @@ enum SCName {
 	SCN_LDAP_CONNECTS, SCN_LDAP_RECONNECTS, SCN_LDAP_CONNECT_FAILED, SCN_LDAP_CONNECT_TIME, SCN_LDAP_CONNECT_TIME_MAX,
 	SCN_LDAP_AUTH_LOGINS, SCN_LDAP_AUTH_DENIED, SCN_LDAP_AUTH_TIME, SCN_LDAP_AUTH_TIME_MAX, SCN_LDAP_AUTH_TIME_AVG,
 	SCN_LDAP_SEARCH, SCN_LDAP_SEARCH_FAILED, SCN_LDAP_SEARCH_TIME, SCN_LDAP_SEARCH_TIME_MAX,
+	SCN_LDAP_CACHE_HITS, SCN_LDAP_CACHE_NEGATIVE_HITS, SCN_LDAP_CACHE_MISSES, SCN_LDAP_CACHE_SHARED, SCN_LDAP_LOOKUP_TIME,
 	/* indexer stats */
 	SCN_INDEXER_SEARCH_ERRORS, SCN_INDEXER_SEARCH_MAX, SCN_INDEXER_SEARCH_AVG, SCN_INDEXED_SEARCHES, SCN_DATABASE_SEARCHES,
 
@@ -60,6 +69,7 @@ enum SCName {
 	SCN_DAGENT_NWITHATTACHMENT,
 	SCN_DAGENT_OUTOFOFFICE,
 	SCN_DAGENT_RECIPS,
+	SCN_DAGENT_SERVER_COPIES,
 	SCN_DAGENT_STDIN_RECEIVED,
 	SCN_DAGENT_STRINGTOMAPI,
 	SCN_DAGENT_TO_COMPANY,
@@ -97,6 +107,7 @@ enum SCName {
 	SCN_SPOOLER_SIGKILLED,
 	SCN_MACHINE_ID, SCN_UTSNAME, SCN_OSRELEASE,
 	SCN_PROGRAM_NAME, SCN_PROGRAM_VERSION, SCN_SERVER_GUID,
+	SCN_MAX, /* number of stats; keep last */
 };
 
 union SCData {
@@ -114,13 +125,38 @@ enum SCType {
 	SCT_STRING,
 };
 
+/**
+ * Log-linear latency histogram in the style of HdrHistogram. Values below
+ * 32 get a bucket each; above that, every power of two is split into 16
+ * buckets, giving a relative error of at most 1/16. Recording is a single
+ * relaxed atomic increment.
+ */
+class _kc_export ECLatencyHistogram _kc_final {
+	public:
+	ECLatencyHistogram();
+	void record(uint64_t);
+	uint64_t count() const;
+	/* Highest value equivalent to the given quantile (0..1) */
+	uint64_t percentile(double) const;
+	void reset();
+
+	private:
+	static constexpr unsigned int SUB_BITS = 4, LINEAR = 2 << SUB_BITS;
+	static constexpr unsigned int MAX_SHIFT = 40, NBUCKETS = LINEAR + MAX_SHIFT * (1 << SUB_BITS);
+	static unsigned int bucket_of(uint64_t);
+	static uint64_t bucket_top(unsigned int);
+
+	std::atomic<uint64_t> m_bucket[NBUCKETS];
+};
+
 struct ECStat {
-	const char *name, *description;
+	const char *name = nullptr, *description = nullptr;
 	SCData data;
 	LONGLONG avginc;
 	SCType type;
 	std::mutex lock;
 	std::string strdata;
+	std::unique_ptr<ECLatencyHistogram> hist;
 };
 
 struct ECStat2 {
@@ -129,8 +165,6 @@ struct ECStat2 {
 	SCData data;
 };
 
-typedef std::map<SCName, ECStat> SCMap;
-
 class _kc_export ECStatsCollector {
 	public:
 	ECStatsCollector(std::shared_ptr<ECConfig>);
@@ -155,8 +189,10 @@ class _kc_export ECStatsCollector {
 	void avg_dbl(enum SCName, double add);
 	void avg(enum SCName, LONGLONG add);
 
+	/* Record a latency sample (usually in µs) into a stat's histogram */
+	void hist(SCName, LONGLONG value);
+
 	/* strings are separate, used by ECSerial */
-	std::string GetValue(const SCMap::const_iterator::value_type &);
 	std::string GetValue(const SCName &name);
 	void ForEachStat(void (*cb)(const std::string &, const std::string &, const std::string &, void *), void *obj);
 	void Reset();
@@ -168,13 +204,30 @@ class _kc_export ECStatsCollector {
 	 * want to use those in RRDtool.
 	 */
 	void AddStat(enum SCName index, SCType type, const char *name, const char *desc = "");
+	/* Attach a latency histogram to a stat previously added with AddStat */
+	void AddHistogram(enum SCName index);
 	std::string GetValue(const ECStat2 &);
 
 	private:
+	/*
+	 * SCT_INTEGER counters are bumped in per-thread slots without any
+	 * lock and only summed up when read. A shard row is padded so that
+	 * neighbouring rows do not share a cache line.
+	 */
+	static constexpr unsigned int SC_SHARDS = 64;
+	struct counter_shard {
+		std::atomic<LONGLONG> v[SCN_MAX];
+		char pad[64];
+	};
+
+	ECStat2 snapshot(SCName);
+	LONGLONG sharded_sum(SCName) const;
+	void sharded_clear(SCName);
 	std::string stats_as_text();
 	std::string survey_as_text();
 
-	SCMap m_StatData;
+	ECStat m_StatData[SCN_MAX];
+	std::unique_ptr<counter_shard[]> m_shards;
 	std::unordered_map<std::string, ECStat2> m_ondemand;
 	bool thread_running = false;
 	std::atomic<bool> terminate{false};
@@ -5,12 +5,17 @@
 #include <kopano/platform.h>
 #include <kopano/charset/convert.h>
 #include <mapicode.h>
+#include <atomic>
+#include <map>
 #include <numeric>
 #include <vector>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <kopano/stringutil.h>
 #include <cerrno>
+#include <cstdint>
+#include <langinfo.h>
 #define BUFSIZE 4096
 
 namespace KC {
@@ -51,6 +56,256 @@ private:
 	const char** m_ptr;
 };
 
+namespace {
+
+struct iconv_codes {
+	const char *to, *from, *codeset;
+};
+
+/*
+ * iconv descriptors not in use by any context, per thread, along with the
+ * options parsed from the tocode they were opened for.
+ */
+class iconv_cache final {
+	public:
+	struct entry {
+		iconv_t cd;
+		bool force, html;
+		unsigned int fast;
+	};
+	typedef std::vector<entry> slot;
+
+	iconv_cache();
+	~iconv_cache();
+	slot *get_slot(const char *tocode, const char *fromcode);
+	bool take(slot *, entry *);
+	bool put(slot *, const entry &);
+
+	/* Tells the caches of threads apart, also once a thread is gone */
+	const uint64_t id;
+
+	private:
+	struct key {
+		std::string to, from, codeset;
+	};
+	struct codes_less {
+		typedef void is_transparent;
+		static bool less(const iconv_codes &a, const iconv_codes &b)
+		{
+			auto r = strcmp(a.to, b.to);
+			if (r == 0)
+				r = strcmp(a.from, b.from);
+			return r != 0 ? r < 0 : strcmp(a.codeset, b.codeset) < 0;
+		}
+		static iconv_codes codes(const key &k) { return {k.to.c_str(), k.from.c_str(), k.codeset.c_str()}; }
+		bool operator()(const key &a, const key &b) const { return less(codes(a), codes(b)); }
+		bool operator()(const key &a, const iconv_codes &b) const { return less(codes(a), b); }
+		bool operator()(const iconv_codes &a, const key &b) const { return less(a, codes(b)); }
+	};
+
+	/* Per charset pair; the total is bounded too, for programs with many charsets */
+	static const size_t max_per_slot = 4, max_total = 64;
+	std::map<key, slot, codes_less> m_slots;
+	size_t m_total = 0;
+};
+
+}
+
+static std::atomic<uint64_t> iconv_cache_ids;
+/* Set once the cache of this thread is gone, for contexts destroyed after it */
+static thread_local bool iconv_cache_gone;
+
+static iconv_cache *get_iconv_cache()
+{
+	if (iconv_cache_gone)
+		return nullptr;
+	static thread_local iconv_cache cache;
+	return &cache;
+}
+
+iconv_cache::iconv_cache() : id(++iconv_cache_ids)
+{}
+
+iconv_cache::~iconv_cache()
+{
+	for (const auto &e : m_slots)
+		for (const auto &i : e.second)
+			iconv_close(i.cd);
+	iconv_cache_gone = true;
+}
+
+/*
+ * A charset name that is empty but for options stands for the charset of
+ * the current locale, which is looked up by iconv_open; descriptors opened
+ * under another locale are not given out then.
+ */
+iconv_cache::slot *iconv_cache::get_slot(const char *tocode, const char *fromcode)
+{
+	const char *codeset = "";
+	if (*tocode == '\0' || strncmp(tocode, "//", 2) == 0 ||
+	    *fromcode == '\0' || strncmp(fromcode, "//", 2) == 0)
+		codeset = nl_langinfo(CODESET);
+	iconv_codes c = {tocode, fromcode, codeset};
+	auto i = m_slots.find(c);
+	if (i == m_slots.end())
+		i = m_slots.emplace(key{tocode, fromcode, codeset}, slot()).first;
+	return &i->second;
+}
+
+bool iconv_cache::take(slot *s, entry *e)
+{
+	if (s->empty())
+		return false;
+	*e = s->back();
+	s->pop_back();
+	--m_total;
+	return true;
+}
+
+bool iconv_cache::put(slot *s, const entry &e)
+{
+	if (m_total >= max_total || s->size() >= max_per_slot)
+		return false;
+	/* Back to the initial shift state */
+	iconv(e.cd, nullptr, nullptr, nullptr, nullptr);
+	s->emplace_back(e);
+	++m_total;
+	return true;
+}
+
+enum {
+	FAST_NONE,
+	FAST_U8_U32, FAST_U32_U8,
+	FAST_U8_U16, FAST_U16_U8,
+};
+
+/**
+ * Returns 8, 16 or 32 if @code names UTF-8 or UTF-16/32 in host byte order
+ * without a byte order mark, 0 otherwise. Options after "//" are ignored,
+ * they only matter for input that the fast path hands to iconv anyway.
+ */
+static unsigned int unicode_form(const char *code)
+{
+	std::string name = code;
+	auto pos = name.find("//");
+	if (pos != std::string::npos)
+		name.erase(pos);
+	if (name.empty()) {
+		/* The charset of the current locale */
+		auto cs = nl_langinfo(CODESET);
+		if (cs == nullptr)
+			return 0;
+		name = cs;
+	}
+	if (strcasecmp(name.c_str(), "UTF-8") == 0 || strcasecmp(name.c_str(), "UTF8") == 0)
+		return 8;
+#ifdef KC_BIGENDIAN
+	if (strcasecmp(name.c_str(), "UTF-16BE") == 0)
+		return 16;
+	if (strcasecmp(name.c_str(), "UTF-32BE") == 0)
+		return 32;
+#else
+	if (strcasecmp(name.c_str(), "UTF-16LE") == 0)
+		return 16;
+	if (strcasecmp(name.c_str(), "UTF-32LE") == 0)
+		return 32;
+#endif
+	if (strcasecmp(name.c_str(), "WCHAR_T") == 0 && sizeof(wchar_t) == 4)
+		return 32;
+	return 0;
+}
+
+/* True if none of the 8 bytes at @p has the high bit set */
+static inline bool ascii_word(const unsigned char *p, uint64_t mask)
+{
+	uint64_t w;
+	memcpy(&w, p, sizeof(w));
+	return (w & mask) == 0;
+}
+
+/**
+ * Decode UTF-8 up to the first sequence that iconv would complain about:
+ * malformed or overlong ones, surrogates and code points past U+10FFFF.
+ * Runs of ASCII are checked a word at a time.
+ *
+ * @return	The number of bytes decoded.
+ */
+template<typename Out> static size_t decode_utf8(const unsigned char *src,
+    size_t n, Out &&out)
+{
+	auto p = src, end = src + n;
+	while (p < end) {
+		if (end - p >= 8 && ascii_word(p, 0x8080808080808080ULL)) {
+			for (unsigned int i = 0; i < 8; ++i)
+				out(p[i]);
+			p += 8;
+			continue;
+		}
+		char32_t c = *p;
+		unsigned int len;
+		if (c < 0x80) {
+			out(c);
+			++p;
+			continue;
+		} else if (c >= 0xC2 && c <= 0xDF) {
+			len = 2;
+			c &= 0x1F;
+		} else if (c >= 0xE0 && c <= 0xEF) {
+			len = 3;
+			c &= 0x0F;
+		} else if (c >= 0xF0 && c <= 0xF4) {
+			len = 4;
+			c &= 0x07;
+		} else {
+			break;
+		}
+		if (static_cast<size_t>(end - p) < len)
+			break;
+		unsigned int i;
+		for (i = 1; i < len && (p[i] & 0xC0) == 0x80; ++i)
+			c = (c << 6) | (p[i] & 0x3F);
+		if (i < len ||
+		    (len == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) ||
+		    (len == 4 && (c < 0x10000 || c > 0x10FFFF)))
+			break;
+		out(c);
+		p += len;
+	}
+	return p - src;
+}
+
+/**
+ * Encode @c as UTF-8 at @out, which has room for 4 bytes.
+ *
+ * @return	The number of bytes written, 0 for surrogates and code points
+ *		past U+10FFFF.
+ */
+static unsigned int encode_utf8(char32_t c, char *out)
+{
+	if (c < 0x80) {
+		out[0] = c;
+		return 1;
+	} else if (c < 0x800) {
+		out[0] = 0xC0 | (c >> 6);
+		out[1] = 0x80 | (c & 0x3F);
+		return 2;
+	} else if (c < 0x10000) {
+		if (c >= 0xD800 && c <= 0xDFFF)
+			return 0;
+		out[0] = 0xE0 | (c >> 12);
+		out[1] = 0x80 | ((c >> 6) & 0x3F);
+		out[2] = 0x80 | (c & 0x3F);
+		return 3;
+	} else if (c <= 0x10FFFF) {
+		out[0] = 0xF0 | (c >> 18);
+		out[1] = 0x80 | ((c >> 12) & 0x3F);
+		out[2] = 0x80 | ((c >> 6) & 0x3F);
+		out[3] = 0x80 | (c & 0x3F);
+		return 4;
+	}
+	return 0;
+}
+
 /**
  * The conversion context for iconv charset conversions takes a fromcode and a tocode,
  * which are the source and destination charsets, respectively. The 'tocode' may take
@@ -82,6 +337,21 @@ private:
  */
 iconv_context_base::iconv_context_base(const char* tocode, const char* fromcode)
 {
+	auto cache = get_iconv_cache();
+	if (cache != nullptr) {
+		auto slot = cache->get_slot(tocode, fromcode);
+		m_cache_slot = slot;
+		m_cache_id = cache->id;
+		iconv_cache::entry e;
+		if (cache->take(slot, &e)) {
+			m_cd = e.cd;
+			m_bForce = e.force;
+			m_bHTML = e.html;
+			m_fast = e.fast;
+			return;
+		}
+	}
+
 	/* Ignore illegal sequences by default. */
 	m_bForce = true;
 	m_bHTML = false;
@@ -118,14 +388,143 @@ iconv_context_base::iconv_context_base(const char* tocode, const char* fromcode)
 	m_cd = iconv_open(strto.c_str(), fromcode);
 	if (m_cd == (iconv_t)(-1))
 		throw unknown_charset_exception(strerror(errno));
+
+	auto to = unicode_form(strto.c_str()), from = unicode_form(fromcode);
+	if (from == 8 && to == 32)
+		m_fast = FAST_U8_U32;
+	else if (from == 32 && to == 8)
+		m_fast = FAST_U32_U8;
+	else if (from == 8 && to == 16)
+		m_fast = FAST_U8_U16;
+	else if (from == 16 && to == 8)
+		m_fast = FAST_U16_U8;
 }
 
 iconv_context_base::~iconv_context_base()
 {
-	if (m_cd != (iconv_t)(-1))
+	if (m_cd == (iconv_t)(-1))
+		return;
+	/* Only the cache of the thread that made the context knows the slot */
+	auto cache = get_iconv_cache();
+	if (cache == nullptr || cache->id != m_cache_id ||
+	    !cache->put(static_cast<iconv_cache::slot *>(m_cache_slot), {m_cd, m_bForce, m_bHTML, m_fast}))
 		iconv_close(m_cd);
 }
 
+/**
+ * Convert between the Unicode forms without iconv, up to the first
+ * invalid or incomplete character. These conversions keep no state, so
+ * iconv can take over from there and deal with the rest under the options
+ * of the context.
+ *
+ * @return	The number of bytes of @lpFrom that were converted.
+ */
+size_t iconv_context_base::fast_convert(const char *lpFrom, size_t cbFrom)
+{
+	auto src = reinterpret_cast<const unsigned char *>(lpFrom);
+
+	switch (m_fast) {
+	case FAST_U8_U32: {
+		char32_t buf[BUFSIZE / sizeof(char32_t)];
+		size_t n = 0;
+		auto done = decode_utf8(src, cbFrom, [&](char32_t c) {
+			if (n == ARRAY_SIZE(buf)) {
+				append(reinterpret_cast<const char *>(buf), sizeof(buf));
+				n = 0;
+			}
+			buf[n++] = c;
+		});
+		append(reinterpret_cast<const char *>(buf), n * sizeof(*buf));
+		return done;
+	}
+	case FAST_U8_U16: {
+		char16_t buf[BUFSIZE / sizeof(char16_t)];
+		size_t n = 0;
+		auto done = decode_utf8(src, cbFrom, [&](char32_t c) {
+			if (n + 2 > ARRAY_SIZE(buf)) {
+				append(reinterpret_cast<const char *>(buf), n * sizeof(*buf));
+				n = 0;
+			}
+			if (c < 0x10000) {
+				buf[n++] = c;
+				return;
+			}
+			c -= 0x10000;
+			buf[n++] = 0xD800 | (c >> 10);
+			buf[n++] = 0xDC00 | (c & 0x3FF);
+		});
+		append(reinterpret_cast<const char *>(buf), n * sizeof(*buf));
+		return done;
+	}
+	case FAST_U32_U8: {
+		char buf[BUFSIZE];
+		size_t n = 0, i = 0, count = cbFrom / sizeof(char32_t);
+		while (i < count) {
+			if (n + 8 > sizeof(buf)) {
+				append(buf, n);
+				n = 0;
+			}
+			if (count - i >= 2 && ascii_word(src + i * 4, 0xFFFFFF80FFFFFF80ULL)) {
+				char32_t c[2];
+				memcpy(c, src + i * 4, sizeof(c));
+				buf[n++] = c[0];
+				buf[n++] = c[1];
+				i += 2;
+				continue;
+			}
+			char32_t c;
+			memcpy(&c, src + i * 4, sizeof(c));
+			auto len = encode_utf8(c, buf + n);
+			if (len == 0)
+				break;
+			n += len;
+			++i;
+		}
+		append(buf, n);
+		return i * sizeof(char32_t);
+	}
+	case FAST_U16_U8: {
+		char buf[BUFSIZE];
+		size_t n = 0, i = 0, count = cbFrom / sizeof(char16_t);
+		while (i < count) {
+			if (n + 8 > sizeof(buf)) {
+				append(buf, n);
+				n = 0;
+			}
+			if (count - i >= 4 && ascii_word(src + i * 2, 0xFF80FF80FF80FF80ULL)) {
+				char16_t c[4];
+				memcpy(c, src + i * 2, sizeof(c));
+				for (unsigned int j = 0; j < 4; ++j)
+					buf[n++] = c[j];
+				i += 4;
+				continue;
+			}
+			char16_t u, lo = 0;
+			memcpy(&u, src + i * 2, sizeof(u));
+			char32_t c = u;
+			unsigned int units = 1;
+			if (u >= 0xD800 && u <= 0xDBFF) {
+				if (i + 1 == count)
+					break;
+				memcpy(&lo, src + (i + 1) * 2, sizeof(lo));
+				if (lo < 0xDC00 || lo > 0xDFFF)
+					break;
+				c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+				units = 2;
+			}
+			auto len = encode_utf8(c, buf + n);
+			if (len == 0)
+				break;
+			n += len;
+			i += units;
+		}
+		append(buf, n);
+		return i * sizeof(char16_t);
+	}
+	}
+	return 0;
+}
+
 void iconv_context_base::doconvert(const char *lpFrom, size_t cbFrom)
 {
 	char buf[BUFSIZE];
@@ -135,6 +534,14 @@ void iconv_context_base::doconvert(const char *lpFrom, size_t cbFrom)
 	size_t cbDst = 0;
 	size_t err;
 
+	if (m_fast != FAST_NONE) {
+		auto done = fast_convert(lpFrom, cbFrom);
+		if (done == cbFrom)
+			return;
+		lpFrom += done;
+		cbFrom -= done;
+	}
+
 	lpSrc = lpFrom;
 	cbSrc = cbFrom;
 
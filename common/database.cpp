@@ -5,6 +5,10 @@
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
 #endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -12,6 +16,7 @@
 #include <cassert>
 #include <cstring>
 #include <mysql.h>
+#include <errmsg.h>
 #include <mysqld_error.h>
 #include <kopano/ECConfig.h>
 #include <kopano/ECLogger.h>
@@ -24,6 +29,13 @@
 
 namespace KC {
 
+struct kd_stmt_stat {
+	std::atomic<uint64_t> calls{0}, usec{0};
+};
+
+static std::mutex kd_stmt_stat_lock;
+static std::map<std::string, kd_stmt_stat> kd_stmt_stats;
+
 DB_RESULT::~DB_RESULT(void)
 {
 	if (m_res == nullptr)
@@ -31,7 +43,7 @@ DB_RESULT::~DB_RESULT(void)
 	assert(m_db != nullptr);
 	if (m_db == nullptr)
 		return;
-	m_db->FreeResult_internal(m_res);
+	m_db->FreeResult_internal(m_res, m_stmt);
 	m_res = nullptr;
 }
 
@@ -39,10 +51,11 @@ DB_RESULT &DB_RESULT::operator=(DB_RESULT &&o)
 {
 	if (m_res != nullptr) {
 		assert(m_db != nullptr);
-		m_db->FreeResult_internal(m_res);
+		m_db->FreeResult_internal(m_res, m_stmt);
 	}
 	m_res = o.m_res;
 	m_db = o.m_db;
+	m_stmt = o.m_stmt;
 	o.m_res = nullptr;
 	o.m_db = nullptr;
 	return *this;
@@ -50,19 +63,221 @@ DB_RESULT &DB_RESULT::operator=(DB_RESULT &&o)
 
 size_t DB_RESULT::get_num_rows(void) const
 {
+	if (m_stmt)
+		return mysql_stmt_num_rows(static_cast<kd_stmt *>(m_res)->m_stmt);
 	return mysql_num_rows(static_cast<MYSQL_RES *>(m_res));
 }
 
 DB_ROW DB_RESULT::fetch_row(void)
 {
+	if (m_stmt)
+		return static_cast<kd_stmt *>(m_res)->fetch_row();
 	return mysql_fetch_row(static_cast<MYSQL_RES *>(m_res));
 }
 
 DB_LENGTHS DB_RESULT::fetch_row_lengths(void)
 {
+	if (m_stmt)
+		return static_cast<kd_stmt *>(m_res)->fetch_row_lengths();
 	return mysql_fetch_lengths(static_cast<MYSQL_RES *>(m_res));
 }
 
+static std::string ec_filter_bmp(const std::string &s)
+{
+	auto w = convert_to<std::wstring>(s);
+	std::transform(w.begin(), w.end(), w.begin(),
+		[](wchar_t c) { return c <= 0xFFFF ? c : 0xFFFD; });
+	return convert_to<std::string>("UTF-8", w.c_str(), rawsize(w), CHARSET_WCHAR);
+}
+
+kd_stmt::kd_stmt(const std::string &name, const std::string &query) :
+	m_name(name), m_query(query)
+{}
+
+kd_stmt::~kd_stmt()
+{
+	if (m_stmt != nullptr)
+		mysql_stmt_close(m_stmt);
+}
+
+/**
+ * Prepare the statement on the connection @m. Parameters bound before are
+ * kept, so a statement can be executed again after a reconnect.
+ */
+ECRESULT kd_stmt::prepare(MYSQL *m)
+{
+	assert(m_stmt == nullptr);
+	m_stmt = mysql_stmt_init(m);
+	if (m_stmt == nullptr) {
+		ec_log_err("KDatabase::Prepare(): mysql_stmt_init failed: %s", mysql_error(m));
+		return KCERR_DATABASE_ERROR;
+	}
+	if (mysql_stmt_prepare(m_stmt, m_query.c_str(), m_query.size()) != 0) {
+		ec_log_err("KDatabase::Prepare(): %s: \"%s\", query: %s",
+			m_name.c_str(), mysql_stmt_error(m_stmt), m_query.c_str());
+		mysql_stmt_close(m_stmt);
+		m_stmt = nullptr;
+		return KCERR_DATABASE_ERROR;
+	}
+	auto n = mysql_stmt_param_count(m_stmt);
+	if (m_pbind.size() != n) {
+		m_pbind.resize(n);
+		m_param.resize(n);
+		memset(m_pbind.data(), 0, sizeof(MYSQL_BIND) * n);
+		for (size_t i = 0; i < n; ++i) {
+			m_pbind[i].buffer_type = MYSQL_TYPE_NULL;
+			m_pbind[i].is_null = &m_param[i].is_null;
+			m_pbind[i].length = &m_param[i].len;
+		}
+	}
+	/* Have mysql_stmt_store_result compute column widths for us */
+	kd_bool upd = true;
+	mysql_stmt_attr_set(m_stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &upd);
+	return erSuccess;
+}
+
+/**
+ * The connection is about to be closed. An open result was stored on the
+ * client and remains readable; the handle is closed once the result is
+ * freed (mysql_close has unlinked it from the connection by then). Either
+ * way, the statement is prepared again on its next use.
+ */
+void kd_stmt::detach()
+{
+	if (m_busy) {
+		m_detached = true;
+		return;
+	}
+	if (m_stmt != nullptr)
+		mysql_stmt_close(m_stmt);
+	m_stmt = nullptr;
+}
+
+MYSQL_BIND &kd_stmt::param(unsigned int idx)
+{
+	assert(idx < m_pbind.size());
+	auto &b = m_pbind[idx];
+	m_param[idx].is_null = false;
+	b.is_unsigned = false;
+	return b;
+}
+
+void kd_stmt::bind(unsigned int idx, unsigned int v)
+{
+	bind(idx, static_cast<unsigned long long>(v));
+}
+
+void kd_stmt::bind(unsigned int idx, unsigned long long v)
+{
+	auto &b = param(idx);
+	m_param[idx].num = v;
+	b.buffer_type = MYSQL_TYPE_LONGLONG;
+	b.buffer = &m_param[idx].num;
+	b.is_unsigned = true;
+}
+
+void kd_stmt::bind(unsigned int idx, const std::string &v)
+{
+	auto &b = param(idx);
+	auto &p = m_param[idx];
+	p.str = m_filter_bmp ? ec_filter_bmp(v) : v;
+	p.len = p.str.size();
+	b.buffer_type = MYSQL_TYPE_STRING;
+	b.buffer = const_cast<char *>(p.str.data());
+	b.buffer_length = p.len;
+}
+
+void kd_stmt::bind_blob(unsigned int idx, const void *data, size_t len)
+{
+	auto &b = param(idx);
+	auto &p = m_param[idx];
+	p.str.assign(static_cast<const char *>(data), len);
+	p.len = len;
+	b.buffer_type = MYSQL_TYPE_BLOB;
+	b.buffer = const_cast<char *>(p.str.data());
+	b.buffer_length = len;
+}
+
+void kd_stmt::bind_null(unsigned int idx)
+{
+	auto &b = param(idx);
+	m_param[idx].is_null = true;
+	b.buffer_type = MYSQL_TYPE_NULL;
+}
+
+/**
+ * Set up the output buffers after mysql_stmt_store_result. All columns
+ * are fetched as strings so that consumers can treat the rows exactly
+ * like those of a text-protocol result.
+ */
+ECRESULT kd_stmt::bind_result()
+{
+	auto meta = mysql_stmt_result_metadata(m_stmt);
+	if (meta == nullptr)
+		return KCERR_DATABASE_ERROR;
+	auto n = mysql_num_fields(meta);
+	auto fields = mysql_fetch_fields(meta);
+	if (m_rbind.size() != n) {
+		m_rbind.resize(n);
+		m_rbuf.resize(n);
+		m_rlen.resize(n);
+		m_rnull.reset(new kd_bool[n]());
+		m_row.resize(n);
+		memset(m_rbind.data(), 0, sizeof(MYSQL_BIND) * n);
+	}
+	for (size_t i = 0; i < n; ++i) {
+		auto &b = m_rbind[i];
+		/* Buffers only ever grow, so they are reused across executions */
+		if (m_rbuf[i] == nullptr || b.buffer_length < fields[i].max_length + 1) {
+			b.buffer_length = std::max(fields[i].max_length + 1, 64UL);
+			m_rbuf[i].reset(new char[b.buffer_length]);
+		}
+		b.buffer_type = MYSQL_TYPE_STRING;
+		b.buffer = m_rbuf[i].get();
+		b.length = &m_rlen[i];
+		b.is_null = &m_rnull[i];
+	}
+	mysql_free_result(meta);
+	return mysql_stmt_bind_result(m_stmt, m_rbind.data()) == 0 ?
+	       erSuccess : KCERR_DATABASE_ERROR;
+}
+
+DB_ROW kd_stmt::fetch_row()
+{
+	auto ret = mysql_stmt_fetch(m_stmt);
+	if (ret != 0 && ret != MYSQL_DATA_TRUNCATED)
+		return nullptr;
+	for (size_t i = 0; i < m_row.size(); ++i) {
+		if (m_rnull[i]) {
+			m_row[i] = nullptr;
+			continue;
+		}
+		auto &b = m_rbind[i];
+		if (m_rlen[i] >= b.buffer_length) {
+			b.buffer_length = m_rlen[i] + 1;
+			m_rbuf[i].reset(new char[b.buffer_length]);
+			b.buffer = m_rbuf[i].get();
+			if (mysql_stmt_fetch_column(m_stmt, &b, i, 0) != 0)
+				return nullptr;
+			mysql_stmt_bind_result(m_stmt, m_rbind.data());
+		}
+		m_rbuf[i][m_rlen[i]] = '\0';
+		m_row[i] = m_rbuf[i].get();
+	}
+	return m_row.data();
+}
+
+void kd_stmt::free_result()
+{
+	mysql_stmt_free_result(m_stmt);
+	m_busy = false;
+	if (!m_detached)
+		return;
+	mysql_stmt_close(m_stmt);
+	m_stmt = nullptr;
+	m_detached = false;
+}
+
 KDatabase::KDatabase(void)
 {
 	memset(&m_lpMySQL, 0, sizeof(m_lpMySQL));
@@ -252,6 +467,9 @@ ECRESULT KDatabase::Close(void)
 {
 	/* No locking here */
 	m_bConnected = false;
+	/* Statements are prepared again on the next connection */
+	for (auto &p : m_stmts)
+		p.second->detach();
 	if (m_bMysqlInitialize)
 		mysql_close(&m_lpMySQL);
 	m_bMysqlInitialize = false;
@@ -394,14 +612,6 @@ ECRESULT KDatabase::DoUpdate(const std::string &q, unsigned int *aff)
 	return I_Update(q, aff);
 }
 
-static std::string ec_filter_bmp(const std::string &s)
-{
-	auto w = convert_to<std::wstring>(s);
-	std::transform(w.begin(), w.end(), w.begin(),
-		[](wchar_t c) { return c <= 0xFFFF ? c : 0xFFFD; });
-	return convert_to<std::string>("UTF-8", w.c_str(), rawsize(w), CHARSET_WCHAR);
-}
-
 std::string KDatabase::Escape(const std::string &sa)
 {
 	const auto &s = m_filter_bmp ? ec_filter_bmp(sa) : sa;
@@ -421,13 +631,154 @@ std::string KDatabase::EscapeBinary(const void *data, size_t len)
 	return "'" + std::string(esc.get()) + "'";
 }
 
-void KDatabase::FreeResult_internal(void *r)
+void KDatabase::FreeResult_internal(void *r, bool stmt)
 {
 	assert(r != nullptr);
-	if (r != nullptr)
+	if (r == nullptr)
+		return;
+	if (stmt)
+		static_cast<kd_stmt *>(r)->free_result();
+	else
 		mysql_free_result(static_cast<MYSQL_RES *>(r));
 }
 
+/**
+ * Obtain a prepared statement
+ * @name:	(in) short identifier, used for the cache and statistics
+ * @query:	(in) SQL text with "?" parameter markers
+ * @sp:		(out) statement; owned by this KDatabase object
+ *
+ * Statements are prepared once per connection and reused afterwards;
+ * after a reconnect, they are prepared again on their next use. The
+ * returned pointer is valid as long as this KDatabase object.
+ */
+ECRESULT KDatabase::Prepare(const char *name, const char *query, kd_stmt **sp)
+{
+	autolock alk(*this);
+	auto range = m_stmts.equal_range(name);
+	for (auto i = range.first; i != range.second; ++i) {
+		if (i->second->m_busy)
+			continue;
+		if (i->second->m_stmt == nullptr) {
+			auto er = i->second->prepare(&m_lpMySQL);
+			if (er != erSuccess)
+				return er;
+		}
+		*sp = i->second.get();
+		return erSuccess;
+	}
+	std::unique_ptr<kd_stmt> st(new kd_stmt(name, query));
+	auto er = st->prepare(&m_lpMySQL);
+	if (er != erSuccess)
+		return er;
+	LOG_SQL_DEBUG("SQL [%08lu]: prepared %s: \"%s;\"", m_lpMySQL.thread_id, name, query);
+	st->m_filter_bmp = m_filter_bmp;
+	*sp = st.get();
+	m_stmts.emplace(name, std::move(st));
+	return erSuccess;
+}
+
+/**
+ * Bind, execute and (for @result) store the result of @st. Like the text
+ * queries of ECDatabase, a lost connection is reconnected once, after which
+ * the statement is prepared and executed again with the same parameters.
+ */
+ECRESULT KDatabase::I_StmtExecute(kd_stmt *st, bool result)
+{
+	assert(!st->m_busy);
+	auto start = std::chrono::steady_clock::now();
+	LOG_SQL_DEBUG("SQL [%08lu]: execute %s", m_lpMySQL.thread_id, st->m_name.c_str());
+	/* Closed since Prepare, e.g. by a reconnect of another query */
+	if (st->m_stmt == nullptr && st->prepare(&m_lpMySQL) != erSuccess)
+		return KCERR_DATABASE_ERROR;
+	auto exec = [&]() {
+		return mysql_stmt_bind_param(st->m_stmt, st->m_pbind.data()) == 0 &&
+		       mysql_stmt_execute(st->m_stmt) == 0 &&
+		       (!result || mysql_stmt_store_result(st->m_stmt) == 0);
+	};
+	auto ok = exec();
+	if (!ok && (mysql_stmt_errno(st->m_stmt) == CR_SERVER_LOST ||
+	    mysql_stmt_errno(st->m_stmt) == CR_SERVER_GONE_ERROR)) {
+		ec_log_warn("SQL [%08lu] info: Try to reconnect", m_lpMySQL.thread_id);
+		if (Reconnect() != erSuccess)
+			return KCERR_DATABASE_ERROR;
+		if (st->m_stmt == nullptr && st->prepare(&m_lpMySQL) != erSuccess)
+			return KCERR_DATABASE_ERROR;
+		ok = exec();
+	}
+	if (!ok) {
+		if (!m_bSuppressLockErrorLogging || GetLastError() == DB_E_UNKNOWN)
+			ec_log_err("SQL [%08lu] statement %s failed: %s",
+				m_lpMySQL.thread_id, st->m_name.c_str(),
+				mysql_stmt_error(st->m_stmt));
+		return KCERR_DATABASE_ERROR;
+	}
+	if (result) {
+		st->m_busy = true;
+		if (st->bind_result() != erSuccess) {
+			st->free_result();
+			return KCERR_DATABASE_ERROR;
+		}
+	}
+	auto usec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	std::unique_lock<std::mutex> lk(kd_stmt_stat_lock);
+	auto &stat = kd_stmt_stats[st->m_name];
+	lk.unlock();
+	++stat.calls;
+	stat.usec += usec;
+	return erSuccess;
+}
+
+ECRESULT KDatabase::DoSelect(kd_stmt *st, DB_RESULT *res_p)
+{
+	autolock alk(*this);
+	auto er = I_StmtExecute(st, true);
+	if (er != erSuccess)
+		return er;
+	DB_RESULT res(this, st);
+	if (res_p != nullptr)
+		*res_p = std::move(res);
+	return erSuccess;
+}
+
+ECRESULT KDatabase::DoDelete(kd_stmt *st, unsigned int *aff)
+{
+	autolock alk(*this);
+	auto er = I_StmtExecute(st, false);
+	if (er == erSuccess && aff != nullptr)
+		*aff = mysql_stmt_affected_rows(st->m_stmt);
+	return er;
+}
+
+ECRESULT KDatabase::DoInsert(kd_stmt *st, unsigned int *idp, unsigned int *aff)
+{
+	autolock alk(*this);
+	auto er = I_StmtExecute(st, false);
+	if (er != erSuccess)
+		return er;
+	if (idp != nullptr)
+		*idp = mysql_stmt_insert_id(st->m_stmt);
+	if (aff != nullptr)
+		*aff = mysql_stmt_affected_rows(st->m_stmt);
+	return erSuccess;
+}
+
+ECRESULT KDatabase::DoUpdate(kd_stmt *st, unsigned int *aff)
+{
+	autolock alk(*this);
+	auto er = I_StmtExecute(st, false);
+	if (er == erSuccess && aff != nullptr)
+		*aff = mysql_stmt_affected_rows(st->m_stmt);
+	return er;
+}
+
+void KDatabase::stmt_stats(const std::function<void(const std::string &, uint64_t, uint64_t)> &f)
+{
+	scoped_lock lk(kd_stmt_stat_lock);
+	for (const auto &p : kd_stmt_stats)
+		f(p.first, p.second.calls, p.second.usec);
+}
+
 unsigned int KDatabase::GetAffectedRows(void)
 {
 	return mysql_affected_rows(&m_lpMySQL);
@@ -35,6 +35,7 @@ public:
 	_kc_hidden ECChannel(int sockfd);
 	~ECChannel();
 	HRESULT HrEnableTLS(void);
+	HRESULT HrAcceptTLS(short *events);
 	_kc_hidden HRESULT HrGets(char *buf, size_t bufsize, size_t *have_read);
 	HRESULT HrReadLine(std::string &buf, size_t maxbuf = 65536);
 	HRESULT HrWriteString(const std::string & strBuffer);
@@ -43,9 +44,13 @@ public:
 	_kc_hidden HRESULT HrReadBytes(char *buf, size_t len);
 	HRESULT HrReadBytes(std::string *buf, size_t len);
 	HRESULT HrReadAndDiscardBytes(size_t);
+	HRESULT HrReadAvailable();
 	HRESULT HrSelect(int seconds);
+	/* Input taken by HrReadAvailable and not consumed yet */
+	const std::string &read_buffer() const { return m_rbuf; }
 	_kc_hidden void SetIPAddress(const struct sockaddr *, size_t);
 	_kc_hidden const char *peer_addr(void) const { return peer_atxt; }
+	int sockfd() const { return fd; }
 	int peer_is_local(void) const;
 	_kc_hidden bool UsingSsl(void) const { return lpSSL != NULL; }
 	_kc_hidden bool sslctx(void) const { return lpCTX != NULL; }
@@ -59,7 +64,10 @@ private:
 	char peer_atxt[256+16];
 	struct sockaddr_storage peer_sockaddr;
 	socklen_t peer_salen = 0;
+	std::string m_rbuf;
 
+	_kc_hidden size_t take_buffered(char *buf, size_t len);
+	_kc_hidden bool tls_record_ready() const;
 	_kc_hidden char *fd_gets(char *buf, int *len);
 	_kc_hidden char *SSL_gets(char *buf, int *len);
 };
@@ -44,6 +44,8 @@
 #include <list>
 #include <map>
 #include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #define BOOKMARK_LIMIT		100
 
@@ -141,7 +143,11 @@ struct sBookmarkPosition {
 
 typedef std::map<unsigned int, sBookmarkPosition> ECBookmarkMap;
 
-class _kc_export ECKeyTable _kc_final {
+/*
+ * Interface of the sorted row/cursor engines. ECKeyTable is the classic
+ * AVL tree; ECBTreeKeyTable keeps rows in B+tree leaf pages.
+ */
+class _kc_export ECKeyTableBase {
 public:
 	/* this MUST be the same definitions as TABLE_NOTIFICATION event types passed in ulTableEvent */
 
@@ -154,29 +160,50 @@ public:
 
 	enum { EC_SEEK_SET=0, EC_SEEK_CUR, EC_SEEK_END };
 
+	virtual ~ECKeyTableBase() = default;
+	virtual ECRESULT UpdateRow(UpdateType ulType, const sObjectTableKey *lpsRowItem, std::vector<ECSortCol> &&, sObjectTableKey *lpsPrevRow, bool fHidden = false, UpdateType *lpulAction = nullptr) = 0;
+	virtual ECRESULT GetPreviousRow(const sObjectTableKey *lpsRowItem, sObjectTableKey *lpsPrevItem) = 0;
+	virtual ECRESULT SeekRow(unsigned int ulBookmark, int lSeekTo, int *lplRowsSought) = 0;
+	virtual ECRESULT SeekId(const sObjectTableKey *lpsRowItem) = 0;
+	virtual ECRESULT GetRowCount(unsigned int *ulRowCount, unsigned int *ulCurrentRow) = 0;
+	virtual ECRESULT QueryRows(unsigned int ulRows, ECObjectTableList *lpRowList, bool bDirBackward, unsigned int ulFlags, bool bShowHidden = false) = 0;
+	virtual ECRESULT Clear() = 0;
+	virtual ECRESULT CreateBookmark(unsigned int *lpulbkPosition) = 0;
+	virtual ECRESULT FreeBookmark(unsigned int ulbkPosition) = 0;
+	virtual ECRESULT GetRowsBySortPrefix(sObjectTableKey *lpsRowItem, ECObjectTableList *lpRowList) = 0;
+	virtual ECRESULT HideRows(sObjectTableKey *lpsRowItem, ECObjectTableList *lpHiddenList) = 0;
+	virtual ECRESULT UnhideRows(sObjectTableKey *lpsRowItem, ECObjectTableList *lpUnhiddenList) = 0;
+	// Returns the first row where the sort columns are not less than the specified sortkey
+	virtual ECRESULT LowerBound(const std::vector<ECSortCol> &) = 0;
+	virtual ECRESULT Find(const std::vector<ECSortCol> &, sObjectTableKey *) = 0;
+	virtual ECRESULT UpdatePartialSortKey(sObjectTableKey *lpsRowItem, size_t ulColumn, const ECSortCol &, sObjectTableKey *lpsPrevRow, bool *lpfHidden, UpdateType *lpulAction) = 0;
+	virtual size_t GetObjectSize() = 0;
+};
+
+class _kc_export ECKeyTable _kc_final : public ECKeyTableBase {
+public:
 	ECKeyTable();
 	~ECKeyTable();
-	ECRESULT UpdateRow(UpdateType ulType, const sObjectTableKey *lpsRowItem, std::vector<ECSortCol> &&, sObjectTableKey *lpsPrevRow, bool fHidden = false, UpdateType *lpulAction = nullptr);
+	ECRESULT UpdateRow(UpdateType ulType, const sObjectTableKey *lpsRowItem, std::vector<ECSortCol> &&, sObjectTableKey *lpsPrevRow, bool fHidden = false, UpdateType *lpulAction = nullptr) _kc_override;
 	ECRESULT UpdateRow_Delete(const sObjectTableKey *row, std::vector<ECSortCol> &&, sObjectTableKey *prev_row, bool hidden = false, UpdateType *action = nullptr);
 	ECRESULT UpdateRow_Modify(const sObjectTableKey *row, std::vector<ECSortCol> &&, sObjectTableKey *prev_row, bool hidden = false, UpdateType *action = nullptr);
-	ECRESULT	GetPreviousRow(const sObjectTableKey *lpsRowItem, sObjectTableKey *lpsPrevItem);
-	ECRESULT	SeekRow(unsigned int ulBookmark, int lSeekTo, int *lplRowsSought);
-	ECRESULT	SeekId(const sObjectTableKey *lpsRowItem);
-	ECRESULT	GetRowCount(unsigned int *ulRowCount, unsigned int *ulCurrentRow);
-	ECRESULT	QueryRows(unsigned int ulRows, ECObjectTableList* lpRowList, bool bDirBackward, unsigned int ulFlags, bool bShowHidden = false);
-	ECRESULT	Clear();
+	ECRESULT GetPreviousRow(const sObjectTableKey *lpsRowItem, sObjectTableKey *lpsPrevItem) _kc_override;
+	ECRESULT SeekRow(unsigned int ulBookmark, int lSeekTo, int *lplRowsSought) _kc_override;
+	ECRESULT SeekId(const sObjectTableKey *lpsRowItem) _kc_override;
+	ECRESULT GetRowCount(unsigned int *ulRowCount, unsigned int *ulCurrentRow) _kc_override;
+	ECRESULT QueryRows(unsigned int ulRows, ECObjectTableList *lpRowList, bool bDirBackward, unsigned int ulFlags, bool bShowHidden = false) _kc_override;
+	ECRESULT Clear() _kc_override;
 	_kc_hidden ECRESULT GetBookmark(unsigned int p1, int *p2);
-	ECRESULT	CreateBookmark(unsigned int* lpulbkPosition);
-	ECRESULT	FreeBookmark(unsigned int ulbkPosition);
-	ECRESULT	GetRowsBySortPrefix(sObjectTableKey *lpsRowItem, ECObjectTableList *lpRowList);
-	ECRESULT	HideRows(sObjectTableKey *lpsRowItem, ECObjectTableList *lpHiddenList);
-	ECRESULT	UnhideRows(sObjectTableKey *lpsRowItem, ECObjectTableList *lpUnhiddenList);
-	// Returns the first row where the sort columns are not less than the specified sortkey
-	ECRESULT LowerBound(const std::vector<ECSortCol> &);
-	ECRESULT Find(const std::vector<ECSortCol> &, sObjectTableKey *);
-	ECRESULT UpdatePartialSortKey(sObjectTableKey *lpsRowItem, size_t ulColumn, const ECSortCol &, sObjectTableKey *lpsPrevRow, bool *lpfHidden, ECKeyTable::UpdateType *lpulAction);
+	ECRESULT CreateBookmark(unsigned int *lpulbkPosition) _kc_override;
+	ECRESULT FreeBookmark(unsigned int ulbkPosition) _kc_override;
+	ECRESULT GetRowsBySortPrefix(sObjectTableKey *lpsRowItem, ECObjectTableList *lpRowList) _kc_override;
+	ECRESULT HideRows(sObjectTableKey *lpsRowItem, ECObjectTableList *lpHiddenList) _kc_override;
+	ECRESULT UnhideRows(sObjectTableKey *lpsRowItem, ECObjectTableList *lpUnhiddenList) _kc_override;
+	ECRESULT LowerBound(const std::vector<ECSortCol> &) _kc_override;
+	ECRESULT Find(const std::vector<ECSortCol> &, sObjectTableKey *) _kc_override;
+	ECRESULT UpdatePartialSortKey(sObjectTableKey *lpsRowItem, size_t ulColumn, const ECSortCol &, sObjectTableKey *lpsPrevRow, bool *lpfHidden, UpdateType *lpulAction) _kc_override;
 	ECRESULT 	GetRow(sObjectTableKey *lpsRowItem, ECTableRow **lpRow);
-	size_t GetObjectSize();
+	size_t GetObjectSize() _kc_override;
 
 private:
 	_kc_hidden ECRESULT UpdateCounts(ECTableRow *);
@@ -205,6 +232,94 @@ private:
 	unsigned int			m_ulBookmarkPosition;
 };
 
+/*
+ * Key table engine that stores rows in the leaf pages of a B+tree. Sort
+ * columns are normalised into a single byte string whose memcmp order is
+ * the rowcompare order. Each inner node tracks the number of visible rows
+ * below it, so row positions are found in O(log n).
+ */
+class _kc_export ECBTreeKeyTable _kc_final : public ECKeyTableBase {
+public:
+	ECBTreeKeyTable();
+	~ECBTreeKeyTable();
+	ECRESULT UpdateRow(UpdateType ulType, const sObjectTableKey *lpsRowItem, std::vector<ECSortCol> &&, sObjectTableKey *lpsPrevRow, bool fHidden = false, UpdateType *lpulAction = nullptr) _kc_override;
+	ECRESULT GetPreviousRow(const sObjectTableKey *lpsRowItem, sObjectTableKey *lpsPrevItem) _kc_override;
+	ECRESULT SeekRow(unsigned int ulBookmark, int lSeekTo, int *lplRowsSought) _kc_override;
+	ECRESULT SeekId(const sObjectTableKey *lpsRowItem) _kc_override;
+	ECRESULT GetRowCount(unsigned int *ulRowCount, unsigned int *ulCurrentRow) _kc_override;
+	ECRESULT QueryRows(unsigned int ulRows, ECObjectTableList *lpRowList, bool bDirBackward, unsigned int ulFlags, bool bShowHidden = false) _kc_override;
+	ECRESULT Clear() _kc_override;
+	ECRESULT CreateBookmark(unsigned int *lpulbkPosition) _kc_override;
+	ECRESULT FreeBookmark(unsigned int ulbkPosition) _kc_override;
+	ECRESULT GetRowsBySortPrefix(sObjectTableKey *lpsRowItem, ECObjectTableList *lpRowList) _kc_override;
+	ECRESULT HideRows(sObjectTableKey *lpsRowItem, ECObjectTableList *lpHiddenList) _kc_override;
+	ECRESULT UnhideRows(sObjectTableKey *lpsRowItem, ECObjectTableList *lpUnhiddenList) _kc_override;
+	ECRESULT LowerBound(const std::vector<ECSortCol> &) _kc_override;
+	ECRESULT Find(const std::vector<ECSortCol> &, sObjectTableKey *) _kc_override;
+	ECRESULT UpdatePartialSortKey(sObjectTableKey *lpsRowItem, size_t ulColumn, const ECSortCol &, sObjectTableKey *lpsPrevRow, bool *lpfHidden, UpdateType *lpulAction) _kc_override;
+	size_t GetObjectSize() _kc_override;
+
+private:
+	struct node;
+	struct inner;
+	struct leaf;
+	/* A row position; lf == nullptr is before-first (i == 0) or past-end (i == 1). */
+	struct pos {
+		leaf *lf;
+		unsigned int i;
+	};
+	/* A cursor survives changes to the tree, as it names the row by id */
+	struct cursor {
+		enum { BEGIN, ROW, END } state = BEGIN;
+		sObjectTableKey id;
+	};
+	struct idhash {
+		size_t operator()(const sObjectTableKey &k) const noexcept
+		{
+			return (static_cast<size_t>(k.ulObjId) << 16) ^ k.ulOrderId;
+		}
+	};
+	struct bookmark {
+		unsigned int first_pos;
+		cursor where;
+	};
+
+	_kc_hidden ECRESULT delete_row(const sObjectTableKey &);
+	_kc_hidden ECRESULT modify_row(const sObjectTableKey &, std::string &&key, unsigned int ncols, bool hidden, sObjectTableKey *prev, UpdateType *action);
+	_kc_hidden bool locate(const sObjectTableKey &, pos *) const;
+	_kc_hidden pos resolve(const cursor &) const;
+	_kc_hidden cursor to_cursor(const pos &) const;
+	_kc_hidden pos first() const;
+	_kc_hidden pos last() const;
+	_kc_hidden pos next(pos) const;
+	_kc_hidden pos prev(pos) const;
+	_kc_hidden pos lower_bound(const std::string &) const;
+	_kc_hidden pos upper_bound(const std::string &) const;
+	_kc_hidden pos at_rank(unsigned int) const;
+	_kc_hidden unsigned int rank(const pos &) const;
+	_kc_hidden unsigned int rank(const cursor &) const;
+	_kc_hidden void set_hidden(const pos &, bool);
+	_kc_hidden void adjust_counts(node *, int delta);
+	_kc_hidden void recount(inner *);
+	_kc_hidden void insert_at(pos, const sObjectTableKey &, std::string &&key, unsigned int ncols, bool hidden);
+	_kc_hidden void erase_at(pos);
+	_kc_hidden void split_leaf(leaf *);
+	_kc_hidden void split_inner(inner *);
+	_kc_hidden void insert_child(inner *parent, node *after, node *child, const std::string &sep);
+	_kc_hidden void remove_child(node *);
+	_kc_hidden void rebalance(node *);
+	_kc_hidden void free_node(node *);
+	_kc_hidden size_t node_size(const node *) const;
+
+	std::recursive_mutex m_lock;
+	node *m_root = nullptr;
+	cursor m_cursor;
+	std::unordered_map<sObjectTableKey, leaf *, idhash> m_rows;
+	std::map<unsigned int, bookmark> m_bookmarks;
+	/* The first 3 (0,1,2) bookmarks are predefined */
+	unsigned int m_bookmark_id = 3;
+};
+
 #define EC_TABLE_NOADVANCE 1
 
 } /* namespace */
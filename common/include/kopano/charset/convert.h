@@ -13,6 +13,7 @@
 #include <string>
 #include <stdexcept>
 #include <typeinfo>
+#include <cstdint>
 #include <iconv.h>
 #include <kopano/charset/traits.h>
 
@@ -57,6 +58,12 @@ class _kc_export_throw illegal_sequence_exception _kc_final :
 
 /**
  * @brief	Performs the generic iconv processing.
+ *
+ * The iconv descriptors are taken from a per-thread cache keyed by tocode
+ * and fromcode, and handed back there on destruction, so that the short
+ * lived contexts of convert_to do not each call iconv_open. Conversions
+ * from UTF-8 to UTF-16 or UTF-32 in host byte order (wchar_t) and back are
+ * done without iconv up to the first invalid character, if any.
  */
 class _kc_export iconv_context_base {
 	public:
@@ -87,8 +94,13 @@ class _kc_export iconv_context_base {
 	 * @param[in] cbBuf		Size of the data to be appended in bytes.
 	 */
 	_kc_hidden virtual void append(const char *buf, size_t bufsize) = 0;
+	_kc_hidden size_t fast_convert(const char *from, size_t fromsize);
 
 	iconv_t	m_cd;
+	/* Where the descriptor goes back to, in the cache of the creating thread */
+	void *m_cache_slot = nullptr;
+	uint64_t m_cache_id = 0;
+	unsigned int m_fast = 0;
 	bool m_bForce;
 	bool m_bHTML;
 
@@ -184,9 +196,9 @@ class _kc_export_dycast iconv_context _kc_final :
  * @param[in] _from			The string that is to be converted to another charset.
  * @return					The converted string.
  *
- * @note	Since this method needs to create an iconv object internally
- *			it is better to use a convert_context when multiple conversions
- *			need to be performed.
+ * @note	The iconv object used internally comes from a per-thread cache,
+ *			but a convert_context is still cheaper when multiple
+ *			conversions need to be performed.
  */
 template<typename To_Type, typename From_Type>
 inline To_Type convert_to(const From_Type &_from)
@@ -1,9 +1,15 @@
 #ifndef KOPANO_DATABASE_HPP
 #define KOPANO_DATABASE_HPP 1
 
+#include <functional>
+#include <cstdint>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include <mapidefs.h>
 #include <mysql.h>
 #include <kopano/zcdefs.h>
@@ -41,11 +47,13 @@ struct sSQLDatabase_t {
 
 class ECConfig;
 class KDatabase;
+class kd_stmt;
 
 class _kc_export DB_RESULT _kc_final {
 	public:
 	DB_RESULT(void) = default;
 	DB_RESULT(KDatabase *d, void *r) : m_res(r), m_db(d) {}
+	DB_RESULT(KDatabase *d, kd_stmt *s) : m_res(s), m_db(d), m_stmt(true) {}
 	DB_RESULT(DB_RESULT &&o) = default;
 	~DB_RESULT(void);
 	DB_RESULT &operator=(DB_RESULT &&o);
@@ -67,6 +75,62 @@ class _kc_export DB_RESULT _kc_final {
 	private:
 	void *m_res = nullptr;
 	KDatabase *m_db = nullptr;
+	bool m_stmt = false;
+};
+
+/**
+ * A server-side prepared statement, executed over the binary protocol.
+ *
+ * Statements are obtained from KDatabase::Prepare, which caches them per
+ * connection, so parameters only need to be bound before each execution.
+ * A statement has at most one open result; a second Prepare call for a
+ * statement whose result is still being read yields another instance.
+ * Result rows are presented as DB_ROW/DB_LENGTHS, like text queries.
+ *
+ * Statements outlive the connection they were prepared on: when it is
+ * closed, they are prepared again on their next use, and a result that is
+ * still open stays readable until it is freed.
+ */
+class _kc_export kd_stmt _kc_final {
+	public:
+	~kd_stmt();
+	void bind(unsigned int idx, unsigned int v);
+	void bind(unsigned int idx, unsigned long long v);
+	void bind(unsigned int idx, const std::string &v);
+	void bind_blob(unsigned int idx, const void *data, size_t len);
+	void bind_null(unsigned int idx);
+	const std::string &name() const { return m_name; }
+
+	private:
+	typedef std::remove_pointer<decltype(MYSQL_BIND::is_null)>::type kd_bool;
+	struct kd_param {
+		unsigned long long num = 0;
+		std::string str;
+		unsigned long len = 0;
+		kd_bool is_null = false;
+	};
+
+	kd_stmt(const std::string &name, const std::string &query);
+	ECRESULT prepare(MYSQL *);
+	void detach();
+	MYSQL_BIND &param(unsigned int idx);
+	ECRESULT bind_result();
+	DB_ROW fetch_row();
+	DB_LENGTHS fetch_row_lengths() { return m_rlen.data(); }
+	void free_result();
+
+	MYSQL_STMT *m_stmt = nullptr;
+	std::string m_name, m_query;
+	std::vector<MYSQL_BIND> m_pbind, m_rbind;
+	std::vector<kd_param> m_param;
+	std::vector<std::unique_ptr<char[]>> m_rbuf;
+	std::vector<unsigned long> m_rlen;
+	std::unique_ptr<kd_bool[]> m_rnull; /* not vector: kd_bool may be bool */
+	std::vector<char *> m_row;
+	bool m_busy = false, m_filter_bmp = false, m_detached = false;
+
+	friend class DB_RESULT;
+	friend class KDatabase;
 };
 
 class kt_completion {
@@ -111,6 +175,14 @@ class _kc_export KDatabase : public kt_completion {
 	/* Sequence generator - Do not call this from within a transaction. */
 	virtual ECRESULT DoSequence(const std::string &seq, unsigned int count, unsigned long long *first_id);
 	virtual ECRESULT DoUpdate(const std::string &query, unsigned int *affect = nullptr);
+	/* Prepared statement variants; see Prepare() */
+	ECRESULT Prepare(const char *name, const char *query, kd_stmt **);
+	virtual ECRESULT DoDelete(kd_stmt *, unsigned int *affect = nullptr);
+	virtual ECRESULT DoInsert(kd_stmt *, unsigned int *insert_id = nullptr, unsigned int *affect = nullptr);
+	virtual ECRESULT DoSelect(kd_stmt *, DB_RESULT *);
+	virtual ECRESULT DoUpdate(kd_stmt *, unsigned int *affect = nullptr);
+	/* Process-wide execution count and total latency per statement name */
+	static void stmt_stats(const std::function<void(const std::string &, uint64_t, uint64_t)> &);
 	std::string Escape(const std::string &);
 	std::string EscapeBinary(const void *, size_t);
 	std::string EscapeBinary(const std::string &s) { return EscapeBinary(s.c_str(), s.size()); }
@@ -150,6 +222,7 @@ class _kc_export KDatabase : public kt_completion {
 	bool isConnected(void) const { return m_bConnected; }
 	ECRESULT IsEngineSupported(const char *);
 	virtual ECRESULT Query(const std::string &q);
+	virtual ECRESULT Reconnect() { return KCERR_DATABASE_ERROR; }
 	ECRESULT I_Update(const std::string &q, unsigned int *affected);
 
 	MYSQL m_lpMySQL;
@@ -158,10 +231,12 @@ class _kc_export KDatabase : public kt_completion {
 	bool m_bSuppressLockErrorLogging = false;
 
 	private:
-	void FreeResult_internal(void *);
+	void FreeResult_internal(void *, bool stmt);
+	ECRESULT I_StmtExecute(kd_stmt *, bool result);
 	HRESULT setup_gcm(size_t, bool);
 
 	std::recursive_mutex m_hMutexMySql;
+	std::unordered_multimap<std::string, std::unique_ptr<kd_stmt>> m_stmts;
 	bool m_bAutoLock = true;
 
 	friend class DB_RESULT;
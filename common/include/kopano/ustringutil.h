@@ -8,6 +8,7 @@
 #include <kopano/zcdefs.h>
 #include <kopano/kcodes.h>
 #include <string>
+#include <vector>
 #include <unicode/coll.h>
 #include <unicode/sortkey.h>
 #include <unicode/unistr.h>
@@ -52,6 +53,7 @@ extern _kc_export ECLocale createLocaleFromName(const char *);
 extern _kc_export ECRESULT LocaleIdToLCID(const char *locale, ULONG *id);
 extern _kc_export ECRESULT LCIDToLocaleId(ULONG id, const char **locale);
 extern _kc_export std::string createSortKeyDataFromUTF8(const char *s, int ncap, const ECLocale &);
+extern _kc_export std::vector<std::string> createSortKeyDataFromUTF8(const std::vector<const char *> &, int ncap, const ECLocale &);
 extern _kc_export int compareSortKeys(const std::string &, const std::string &);
 extern _kc_export std::string createSortKeyData(const char *s, int ncap, const ECLocale &);
 extern _kc_export std::string createSortKeyData(const wchar_t *s, int ncap, const ECLocale &);
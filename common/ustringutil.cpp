@@ -46,6 +46,10 @@ Performance of the current (21-05-2010) implementation is probably pretty bad. T
 performed on the complete strings before the actual comparison is even started.
 
 At some point we need to rewqrite these functions to do all the conversion on the fly to minimize processing.
+
+Collators are created once per thread and locale and kept. The compare functions skip ICU when both strings are plain
+printable ASCII and the collation of the locale orders those characters one by one (no contractions, expansions or
+numeric collation).
 */
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
@@ -55,20 +59,28 @@ At some point we need to rewqrite these functions to do all the conversion on th
 #include <kopano/CommonUtil.h>
 #include "utf8/unchecked.h"
 #include <cassert>
+#include <algorithm>
 #include <clocale>
+#include <map>
 #include <memory>
 #include <string>
+#include <vector>
 #include <unicode/unorm.h>
 #include <unicode/coll.h>
 #include <unicode/tblcoll.h>
 #include <unicode/coleitr.h>
 #include <unicode/normlzr.h>
 #include <unicode/ustring.h>
+#include <unicode/ucol.h>
+#include <unicode/uniset.h>
+#include <unicode/usetiter.h>
 #include <kopano/charset/convert.h>
 
 using U_ICU_NAMESPACE::CollationKey;
 using U_ICU_NAMESPACE::Collator;
 using U_ICU_NAMESPACE::Locale;
+using U_ICU_NAMESPACE::UnicodeSet;
+using U_ICU_NAMESPACE::UnicodeSetIterator;
 using U_ICU_NAMESPACE::UnicodeString;
 typedef std::unique_ptr<Collator> unique_ptr_Collator;
 
@@ -124,6 +136,125 @@ static inline UnicodeString WCHARToUnicode(const wchar_t *sz)
 	return UnicodeString::fromUTF32(reinterpret_cast<const UChar32 *>(sz), -1);
 }
 
+namespace {
+
+/**
+ * A collator with the order of the printable US-ASCII characters, for
+ * comparing case-folded ASCII strings without ICU.
+ */
+struct ECCachedCollator {
+	unique_ptr_Collator coll;
+	bool ascii_ok = false;
+	uint8_t ascii_rank[128];
+};
+
+}
+
+/**
+ * Work out whether two case-folded strings of printable ASCII characters
+ * are ordered by the collator just like by the primary weight of their
+ * characters, one after the other. That holds when none of them takes part
+ * in a contraction or expansion, each has its own primary weight, and
+ * digits are not collated as numbers or punctuation ignored.
+ */
+static void build_ascii_rank(ECCachedCollator &c, const char *name)
+{
+	UErrorCode status = U_ZERO_ERROR;
+	if (c.coll->getAttribute(UCOL_NUMERIC_COLLATION, status) != UCOL_OFF ||
+	    c.coll->getAttribute(UCOL_ALTERNATE_HANDLING, status) != UCOL_NON_IGNORABLE ||
+	    U_FAILURE(status))
+		return;
+	/* Only the C API lists the contractions */
+	auto uc = ucol_open(name, &status);
+	UnicodeSet contr, expan;
+	ucol_getContractionsAndExpansions(uc, contr.toUSet(), expan.toUSet(), true, &status);
+	ucol_close(uc);
+	if (U_FAILURE(status) || expan.containsSome(0x20, 0x7E))
+		return;
+	for (UnicodeSetIterator i(contr); i.next(); ) {
+		auto &str = i.getString();
+		for (int32_t j = 0; j < str.length(); ++j)
+			if (str[j] < 0x80)
+				return;
+	}
+
+	unique_ptr_Collator primary(c.coll->clone());
+	if (primary == nullptr)
+		return;
+	primary->setStrength(Collator::PRIMARY);
+	/* The empty string goes first, so that ignorable characters show up as equal to it */
+	std::vector<UnicodeString> chars = {UnicodeString()};
+	for (UChar ch = 0x20; ch <= 0x7E; ++ch)
+		if (ch < 'A' || ch > 'Z')
+			chars.emplace_back(ch);
+	std::sort(chars.begin() + 1, chars.end(), [&](const UnicodeString &a, const UnicodeString &b) {
+		UErrorCode st = U_ZERO_ERROR;
+		return primary->compare(a, b, st) == UCOL_LESS;
+	});
+	for (size_t i = 1; i < chars.size(); ++i) {
+		if (primary->compare(chars[i-1], chars[i], status) != UCOL_LESS ||
+		    U_FAILURE(status))
+			return;
+		c.ascii_rank[chars[i][0]] = i;
+	}
+	for (UChar ch = 'A'; ch <= 'Z'; ++ch)
+		c.ascii_rank[ch] = c.ascii_rank[ch-'A'+'a'];
+	c.ascii_ok = true;
+}
+
+/**
+ * Get the collator for @locale. Creating a collator costs far more than
+ * using it, so every thread keeps the ones it made; they are not changed
+ * after creation.
+ *
+ * @return	The collator, or NULL if ICU could not create one.
+ */
+static const ECCachedCollator *get_collator(const ECLocale &locale)
+{
+	static thread_local std::map<std::string, ECCachedCollator, std::less<>> cache;
+	auto name = locale.getName();
+	auto i = cache.find(name);
+	if (i == cache.end()) {
+		ECCachedCollator c;
+		UErrorCode status = U_ZERO_ERROR;
+		c.coll.reset(Collator::createInstance(locale, status));
+		if (U_FAILURE(status))
+			c.coll.reset();
+		if (c.coll != nullptr)
+			build_ascii_rank(c, name);
+		i = cache.emplace(name, std::move(c)).first;
+	}
+	return i->second.coll != nullptr ? &i->second : nullptr;
+}
+
+/**
+ * Compare two strings of printable ASCII characters case-insensitively
+ * in the order of @c.
+ *
+ * @return	-1, 0 or 1 like Collator::compare on the case-folded strings,
+ *		or -2 if either string has other characters.
+ */
+template<typename T> static int ascii_icompare(const ECCachedCollator &c,
+    const T *a, const T *b)
+{
+	if (!c.ascii_ok)
+		return -2;
+	int res = 0;
+	for (; *a != 0 && *b != 0; ++a, ++b) {
+		if (*a < 0x20 || *a > 0x7E || *b < 0x20 || *b > 0x7E)
+			return -2;
+		if (res == 0 && c.ascii_rank[*a] != c.ascii_rank[*b])
+			res = c.ascii_rank[*a] < c.ascii_rank[*b] ? -1 : 1;
+	}
+	/* The rest of the longer string still needs to be plain ASCII */
+	for (auto rest = *a != 0 ? a : b; *rest != 0; ++rest)
+		if (*rest < 0x20 || *rest > 0x7E)
+			return -2;
+	if (res != 0)
+		return res;
+	return *a != 0 ? 1 : *b != 0 ? -1 : 0;
+}
+
 /**
  * Check if two strings are canonical equivalent.
  *
@@ -225,14 +356,20 @@ int str_icompare(const char *s1, const char *s2, const ECLocale &locale)
 {
 	assert(s1);
 	assert(s2);
-	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	auto c = get_collator(locale);
+	int res = c != nullptr ? ascii_icompare(*c, reinterpret_cast<const unsigned char *>(s1),
+	    reinterpret_cast<const unsigned char *>(s2)) : -2;
+	if (res != -2)
+		return res;
 
+	UErrorCode status = U_ZERO_ERROR;
 	UnicodeString a = StringToUnicode(s1);
 	UnicodeString b = StringToUnicode(s2);
 	a.foldCase();
 	b.foldCase();
-	return ptrCollator->compare(a,b,status);
+	if (c == nullptr)
+		return a.compare(b);
+	return c->coll->compare(a,b,status);
 }
 
 /**
@@ -385,14 +522,19 @@ int wcs_icompare(const wchar_t *s1, const wchar_t *s2, const ECLocale &locale)
 {
 	assert(s1);
 	assert(s2);
-	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	auto c = get_collator(locale);
+	int res = c != nullptr ? ascii_icompare(*c, s1, s2) : -2;
+	if (res != -2)
+		return res;
 
+	UErrorCode status = U_ZERO_ERROR;
 	UnicodeString a = WCHARToUnicode(s1);
 	UnicodeString b = WCHARToUnicode(s2);
 	a.foldCase();
 	b.foldCase();
-	return ptrCollator->compare(a,b,status);
+	if (c == nullptr)
+		return a.compare(b);
+	return c->coll->compare(a,b,status);
 }
 
 /**
@@ -551,14 +693,20 @@ int u8_icompare(const char *s1, const char *s2, const ECLocale &locale)
 {
 	assert(s1);
 	assert(s2);
-	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	auto c = get_collator(locale);
+	int res = c != nullptr ? ascii_icompare(*c, reinterpret_cast<const unsigned char *>(s1),
+	    reinterpret_cast<const unsigned char *>(s2)) : -2;
+	if (res != -2)
+		return res;
 
+	UErrorCode status = U_ZERO_ERROR;
 	UnicodeString a = UTF8ToUnicode(s1);
 	UnicodeString b = UTF8ToUnicode(s2);
 	a.foldCase();
 	b.foldCase();
-	return ptrCollator->compare(a,b,status);
+	if (c == nullptr)
+		return a.compare(b);
+	return c->coll->compare(a,b,status);
 }
 
 /**
@@ -958,30 +1106,38 @@ ECRESULT LCIDToLocaleId(ULONG ulLcid, const char **lppszLocaleID)
 }
 
 /**
- * Create a locale independent blob that can be used to sort
- * strings fast. This is used when a string would be compared
- * multiple times.
+ * Create the sort key of @s with @coll in @key, reusing its memory; the
+ * callers copy it out, so that the keys kept in tables are not oversized.
+ *
+ * Sort keys of all strings are made by ICU, also those of plain ASCII
+ * ones: the keys of a column are compared with one another, so they have
+ * to come from the same collator.
  *
+ * @param[in]	coll		The collator, or NULL to leave @key empty.
  * @param[in]	s			The string to compare.
  * @param[in]	nCap		Base the key on the first nCap characters of s (if larger than 0).
- * @param[in]	locale		The locale used to create the sort key.
- *
- * @returns		ECUSortKey object containing the blob
+ * @param[out]	key			The key.
  */
-static CollationKey createSortKey(UnicodeString &&s, int nCap,
-    const ECLocale &locale)
+static void createSortKey(const Collator *coll, UnicodeString &s, int nCap,
+    std::string &key)
 {
 	if (nCap > 1)
 		s.truncate(nCap);
 	// Quick workaround for sorting items starting with ' (like From and To) and ( and '(
 	if (s.startsWith("'") || s.startsWith("("))
 		s.remove(0, 1);
-
-	CollationKey key;
-	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
-	ptrCollator->getCollationKey(std::move(s), key, status); // Create a collation key for sorting
-	return key;
+	if (coll == nullptr) {
+		key.clear();
+		return;
+	}
+	if (key.size() < static_cast<size_t>(s.length()) * 3 + 16)
+		key.resize(s.length() * 3 + 16);
+	auto len = coll->getSortKey(s, reinterpret_cast<uint8_t *>(&key[0]), key.size());
+	if (static_cast<size_t>(len) > key.size()) {
+		key.resize(len);
+		len = coll->getSortKey(s, reinterpret_cast<uint8_t *>(&key[0]), key.size());
+	}
+	key.resize(len);
 }
 
 /**
@@ -996,12 +1152,10 @@ static CollationKey createSortKey(UnicodeString &&s, int nCap,
 static std::string createSortKeyData(UnicodeString &&s, int nCap,
     const ECLocale &locale)
 {
-	auto key = createSortKey(std::move(s), nCap, locale);
-	int32_t 		cbKeyData = 0;
-	const uint8_t	*lpKeyData = key.getByteArray(cbKeyData);
-	if (lpKeyData == nullptr)
-		return {};
-	return std::string(reinterpret_cast<const char *>(lpKeyData), cbKeyData);
+	static thread_local std::string buf;
+	auto c = get_collator(locale);
+	createSortKey(c != nullptr ? c->coll.get() : nullptr, s, nCap, buf);
+	return buf;
 }
 
 /**
@@ -1049,6 +1203,32 @@ std::string createSortKeyDataFromUTF8(const char *s, int nCap,
 	return createSortKeyData(UTF8ToUnicode(s), nCap, locale);
 }
 
+/**
+ * Create the sort keys of a column of strings at once, like
+ * createSortKeyDataFromUTF8 does for every one of them.
+ *
+ * @param[in]	s			The UTF-8 strings; a NULL entry gets an empty key.
+ * @param[in]	nCap		Base the keys on the first nCap characters of each string (if larger than 0).
+ * @param[in]	locale		The locale used to create the sort keys.
+ */
+std::vector<std::string> createSortKeyDataFromUTF8(const std::vector<const char *> &s,
+    int nCap, const ECLocale &locale)
+{
+	auto c = get_collator(locale);
+	auto coll = c != nullptr ? c->coll.get() : nullptr;
+	std::vector<std::string> keys(s.size());
+	UnicodeString u;
+	std::string buf;
+	for (size_t i = 0; i < s.size(); ++i) {
+		if (s[i] == nullptr)
+			continue;
+		u = UTF8ToUnicode(s[i]);
+		createSortKey(coll, u, nCap, buf);
+		keys[i].assign(buf);
+	}
+	return keys;
+}
+
 /**
  * Compare two sort keys previously created with createSortKey.
  *
@@ -28,12 +28,18 @@ public:
 	virtual HRESULT HrProcessCommand(const std::string &strInput) = 0;
 	virtual HRESULT HrProcessContinue(const std::string &strInput) { return MAPI_E_NO_SUPPORT; }; // imap only
 	virtual HRESULT HrDone(bool bSendResponse) = 0;
+	/*
+	 * Commands arrive complete with their literals, which the caller has
+	 * already asked the client for (process_model=event).
+	 */
+	void SetReadAhead(bool b) { m_bReadAhead = b; }
 
 protected:
 	std::string	m_strPath;
 	std::shared_ptr<KC::ECChannel> lpChannel;
 	std::shared_ptr<KC::ECConfig> lpConfig;
 	ULONG		m_ulFailedLogins;
+	bool m_bReadAhead = false;
 };
 
 #endif
@@ -6,7 +6,9 @@
 #	include "config.h"
 #endif
 #include <atomic>
+#include <chrono>
 #include <kopano/platform.h>
+#include <map>
 #include <memory>
 #include <new>
 #include <set>
@@ -15,6 +17,7 @@
 #include <csignal>
 #include <netdb.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <sys/resource.h>
 #include <inetmapi/inetmapi.h>
 #include <mapi.h>
@@ -39,6 +42,8 @@
 #include <kopano/ECConfig.h>
 #include <kopano/MAPIErrors.h>
 #include <kopano/ECChannel.h>
+#include <kopano/ECThreadPool.h>
+#include <kopano/timeutil.hpp>
 #include "charset/localeutil.h"
 #include "POP3.h"
 #include "IMAP.h"
@@ -68,7 +73,7 @@ struct socks {
 
 static int daemonize = 1;
 int quit = 0;
-static bool bThreads, g_dump_config;
+static bool bThreads, g_event_model, g_dump_config;
 static const char *szPath;
 static std::shared_ptr<ECLogger> g_lpLogger;
 static std::shared_ptr<ECConfig> g_lpConfig;
@@ -143,6 +148,58 @@ struct HandlerArgs {
 	bool bUseSSL;
 };
 
+static HRESULT gw_read_line(ECChannel &ch, std::string &buf)
+{
+	auto hr = ch.HrReadLine(buf);
+	if (hr == hrSuccess)
+		return hrSuccess;
+	if (errno)
+		ec_log_err("Failed to read line: %s", strerror(errno));
+	else
+		ec_log_err("Client disconnected");
+	return hr;
+}
+
+/**
+ * Hand one line received from the client to the protocol handler.
+ * Returns false when the connection should be closed.
+ */
+static bool gw_dispatch_line(ClientProto *client, const std::string &line)
+{
+	if (quit) {
+		client->HrCloseConnection("BYE server shutting down");
+		return false;
+	}
+	if (client->isContinue()) {
+		// we asked the client for more data, do not parse the buffer, but send it "to the previous command"
+		// that last part is currently only HrCmdAuthenticate(), so no difficulties here.
+		// also, PLAIN is the only supported auth method.
+		try {
+			client->HrProcessContinue(line);
+		} catch (const KMAPIError &e) {
+		}
+		// no matter what happens, we continue handling the connection.
+		return true;
+	}
+
+	HRESULT hr;
+	try {
+		/* Process IMAP command */
+		hr = client->HrProcessCommand(line);
+	} catch (const KC::KMAPIError &e) {
+		hr = e.code();
+	}
+	if (hr == MAPI_E_NETWORK_ERROR) {
+		ec_log_err("Connection error.");
+		return false;
+	}
+	if (hr == MAPI_E_END_OF_SESSION) {
+		ec_log_notice("Disconnecting client.");
+		return false;
+	}
+	return true;
+}
+
 static void *Handler(void *lpArg)
 {
 	std::unique_ptr<HandlerArgs> lpHandlerArgs(static_cast<HandlerArgs *>(lpArg));
@@ -206,47 +263,9 @@ static void *Handler(void *lpArg)
 
 		timeouts = 0;
 		inBuffer.clear();
-		hr = lpChannel->HrReadLine(inBuffer);
-		if (hr != hrSuccess) {
-			if (errno)
-				ec_log_err("Failed to read line: %s", strerror(errno));
-			else
-				ec_log_err("Client disconnected");
+		hr = gw_read_line(*lpChannel, inBuffer);
+		if (hr != hrSuccess || !gw_dispatch_line(client, inBuffer))
 			bQuit = true;
-			break;
-		}
-		if (quit) {
-			client->HrCloseConnection("BYE server shutting down");
-			hr = MAPI_E_CALL_FAILED;
-			bQuit = true;
-			break;
-		}
-		if (client->isContinue()) {
-			// we asked the client for more data, do not parse the buffer, but send it "to the previous command"
-			// that last part is currently only HrCmdAuthenticate(), so no difficulties here.
-			// also, PLAIN is the only supported auth method.
-			try {
-				client->HrProcessContinue(inBuffer);
-			} catch (const KMAPIError &e) {
-			}
-			// no matter what happens, we continue handling the connection.
-			continue;
-		}
-
-		try {
-			/* Process IMAP command */
-			hr = client->HrProcessCommand(inBuffer);
-		} catch (const KC::KMAPIError &e) {
-			hr = e.code();
-		}
-		if (hr == MAPI_E_NETWORK_ERROR) {
-			ec_log_err("Connection error.");
-			bQuit = true;
-		}
-		if (hr == MAPI_E_END_OF_SESSION) {
-			ec_log_notice("Disconnecting client.");
-			bQuit = true;
-		}
 	}
 exit:
 	ec_log_notice("Client %s thread exiting", lpChannel->peer_addr());
@@ -272,6 +291,488 @@ static void *Handler_Threaded(void *a)
 	return Handler(a);
 }
 
+/*
+ * process_model=event
+ *
+ * Connections are not given a thread of their own. A few reactor threads
+ * wait on all client sockets with epoll; when a socket becomes readable,
+ * the reactor reads what has arrived into the session's channel. Once a
+ * whole command is there (for IMAP, with its literals), the session is
+ * handed to a fixed-size worker pool which executes the buffered
+ * command(s) and then re-arms the socket; a client that sends a line in
+ * pieces does not hold a worker. The TLS handshake of a pop3s/imaps
+ * connection is run by the reactor too, without blocking, so a stalled
+ * client cannot hold a worker either. Sockets are registered with
+ * EPOLLONESHOT, and a session is owned either by its reactor (waiting) or
+ * by exactly one worker (running, "busy"). A session in IMAP IDLE
+ * therefore costs no thread; change notifications are written by the MAPI
+ * notification thread as in the other models.
+ */
+struct gw_session {
+	std::shared_ptr<ECChannel> channel;
+	std::unique_ptr<ClientProto> client;
+	KC::time_point last_active;
+	unsigned int reactor = 0;
+	/* Read-ahead offset up to which the client was asked for its literal */
+	size_t lit_acked = 0;
+	bool imap = false, started = false, busy = true;
+	/* TLS handshake not completed yet (driven by the reactor) */
+	bool handshake = false;
+	bool timed_out = false, eof = false;
+};
+
+class gw_reactor _kc_final {
+	public:
+	~gw_reactor();
+	HRESULT start();
+	void stop();
+	HRESULT add(std::shared_ptr<gw_session> &&);
+	void arm(gw_session *, uint32_t events = EPOLLIN);
+	void remove(gw_session *);
+	void close_all();
+
+	private:
+	static void *loop(void *);
+	void dispatch(gw_session *);
+	void handshake(std::shared_ptr<gw_session> &&);
+	void drop(gw_session *);
+	void sweep();
+
+	int m_epfd = -1;
+	pthread_t m_thread{};
+	bool m_running = false;
+	std::atomic<bool> m_stop{false};
+	std::mutex m_lock;
+	std::map<gw_session *, std::shared_ptr<gw_session>> m_sessions;
+};
+
+class gw_session_task _kc_final : public ECTask {
+	public:
+	gw_session_task(std::shared_ptr<gw_session> s) : m_sess(std::move(s)) {}
+
+	protected:
+	void run() _kc_override;
+
+	private:
+	std::shared_ptr<gw_session> m_sess;
+};
+
+static std::unique_ptr<ECThreadPool> g_evpool;
+static std::vector<std::unique_ptr<gw_reactor>> g_reactors;
+static std::atomic<unsigned int> g_next_reactor{0};
+
+/* Max. commands executed per dispatch before yielding the worker */
+static constexpr unsigned int GW_EVENT_BATCH = 16;
+/* Time a client gets to complete the TLS handshake */
+static constexpr auto GW_TLS_TIMEOUT = std::chrono::seconds(30);
+/* Longest line accepted, as for ECChannel::HrReadLine */
+static constexpr size_t GW_MAX_LINE = 65536;
+
+/*
+ * Whether the input read ahead for @s holds a whole command: a line and,
+ * for IMAP, the literals it announces with the lines that follow them.
+ * The client is asked for a synchronizing literal as soon as the line
+ * announcing it is in. Input that cannot become a command (an overlong
+ * line, a literal above imap_max_messagesize) also counts as ready, so
+ * that the worker can refuse it.
+ */
+static bool gw_input_ready(gw_session &s)
+{
+	auto &buf = s.channel->read_buffer();
+	size_t pos = 0;
+
+	while (true) {
+		auto nl = buf.find('\n', pos);
+		if (nl == std::string::npos)
+			return buf.size() - pos > GW_MAX_LINE;
+		if (!s.imap || s.client->isContinue())
+			return true;
+		/* A literal is announced by "{n}" or "{n+}" ending the line */
+		auto end = nl > pos && buf[nl-1] == '\r' ? nl - 1 : nl;
+		if (end < pos + 3 || buf[end-1] != '}')
+			return true;
+		auto open = buf.rfind('{', end - 1);
+		if (open == std::string::npos || open < pos ||
+		    (open > pos && buf[open-1] != ' '))
+			return true;
+		auto digits = buf.c_str() + open + 1;
+		char *e = nullptr;
+		auto n = strtoull(digits, &e, 10);
+		bool plus = *e == '+';
+		if (e == digits || e + plus != buf.c_str() + end - 1)
+			return true;
+		if (n > atoui(g_lpConfig->GetSetting("imap_max_messagesize")))
+			return true;
+		auto data = nl + 1;
+		/* A client that sent nothing after the line waits for us */
+		if (!plus && s.lit_acked < data && buf.size() == data) {
+			ec_log_debug("> + Ready for literal data");
+			s.channel->HrWriteLine("+ Ready for literal data");
+			s.lit_acked = data;
+			return false;
+		}
+		if (buf.size() < data + n)
+			return false;
+		pos = data + n;
+	}
+}
+
+static bool gw_queue(std::shared_ptr<gw_session> &&sess)
+{
+	auto task = new(std::nothrow) gw_session_task(std::move(sess));
+	if (task != nullptr && task->queue_on(g_evpool.get(), true))
+		return true;
+	delete task;
+	return false;
+}
+
+gw_reactor::~gw_reactor()
+{
+	stop();
+	if (m_epfd >= 0)
+		close(m_epfd);
+}
+
+HRESULT gw_reactor::start()
+{
+	m_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epfd < 0) {
+		ec_log_err("epoll_create: %s", strerror(errno));
+		return MAPI_E_CALL_FAILED;
+	}
+	auto ret = pthread_create(&m_thread, nullptr, loop, this);
+	if (ret != 0) {
+		ec_log_err("Could not create reactor thread: %s", strerror(ret));
+		return MAPI_E_CALL_FAILED;
+	}
+	set_thread_name(m_thread, "gw/reactor");
+	m_running = true;
+	return hrSuccess;
+}
+
+void gw_reactor::stop()
+{
+	if (!m_running)
+		return;
+	m_stop = true;
+	pthread_join(m_thread, nullptr);
+	m_running = false;
+}
+
+/* Register a session. It stays disarmed until the first arm(). */
+HRESULT gw_reactor::add(std::shared_ptr<gw_session> &&sess)
+{
+	struct epoll_event ev{};
+	ev.events = EPOLLONESHOT;
+	ev.data.ptr = sess.get();
+	if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, sess->channel->sockfd(), &ev) < 0) {
+		ec_log_err("epoll_ctl: %s", strerror(errno));
+		return MAPI_E_CALL_FAILED;
+	}
+	scoped_lock lk(m_lock);
+	auto raw = sess.get();
+	m_sessions.emplace(raw, std::move(sess));
+	return hrSuccess;
+}
+
+/*
+ * Give the session back to the reactor (called by the owning worker), to
+ * wait until the socket is ready for @events.
+ */
+void gw_reactor::arm(gw_session *sess, uint32_t events)
+{
+	struct epoll_event ev{};
+	ev.events = events | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = sess;
+	scoped_lock lk(m_lock);
+	sess->busy = false;
+	/* The handshake must complete within GW_TLS_TIMEOUT of the accept */
+	if (!sess->handshake)
+		sess->last_active = decltype(sess->last_active)::clock::now();
+	if (epoll_ctl(m_epfd, EPOLL_CTL_MOD, sess->channel->sockfd(), &ev) < 0)
+		ec_log_err("epoll_ctl: %s", strerror(errno));
+}
+
+void gw_reactor::remove(gw_session *sess)
+{
+	epoll_ctl(m_epfd, EPOLL_CTL_DEL, sess->channel->sockfd(), nullptr);
+	std::shared_ptr<gw_session> last;
+	scoped_lock lk(m_lock);
+	auto i = m_sessions.find(sess);
+	if (i == m_sessions.end())
+		return;
+	/* Destroy outside the lock */
+	last = std::move(i->second);
+	m_sessions.erase(i);
+}
+
+/* Say goodbye to all waiting clients; only used when no workers are left. */
+void gw_reactor::close_all()
+{
+	decltype(m_sessions) sessions;
+	{
+		scoped_lock lk(m_lock);
+		std::swap(sessions, m_sessions);
+	}
+	for (auto &p : sessions) {
+		auto client = p.second->client.get();
+		/* Writing during the TLS handshake would wait for the client */
+		if (client == nullptr || p.second->handshake)
+			continue;
+		client->HrCloseConnection("BYE server shutting down");
+		client->HrDone(false);
+	}
+}
+
+void gw_reactor::dispatch(gw_session *sess)
+{
+	std::shared_ptr<gw_session> ref;
+	{
+		scoped_lock lk(m_lock);
+		auto i = m_sessions.find(sess);
+		/*
+		 * EPOLLHUP and EPOLLERR are reported even for a disarmed
+		 * socket; the worker that owns the session sees them itself.
+		 */
+		if (i == m_sessions.end() || i->second->busy)
+			return;
+		ref = i->second;
+		ref->busy = true;
+	}
+	if (ref->handshake) {
+		handshake(std::move(ref));
+		return;
+	}
+	if (ref->channel->HrReadAvailable() != hrSuccess) {
+		ref->eof = true;
+	} else if (!gw_input_ready(*ref)) {
+		/* Wait for the rest of the command */
+		arm(ref.get());
+		return;
+	}
+	if (!gw_queue(std::move(ref)))
+		ec_log_err("Unable to queue work for %s", sess->channel->peer_addr());
+}
+
+/*
+ * Take the TLS handshake of @sess as far as it goes without waiting for the
+ * client. Once it is complete, a worker sends the greeting.
+ */
+void gw_reactor::handshake(std::shared_ptr<gw_session> &&sess)
+{
+	short events = 0;
+	if (sess->channel->HrAcceptTLS(&events) != hrSuccess) {
+		ec_log_err("Unable to negotiate SSL connection");
+		drop(sess.get());
+		return;
+	}
+	if (events != 0) {
+		arm(sess.get(), events == POLLIN ? EPOLLIN : EPOLLOUT);
+		return;
+	}
+	sess->handshake = false;
+	auto raw = sess.get();
+	if (!gw_queue(std::move(sess))) {
+		ec_log_err("Unable to queue work for %s", raw->channel->peer_addr());
+		drop(raw);
+	}
+}
+
+/* Close a session that never got to its greeting */
+void gw_reactor::drop(gw_session *sess)
+{
+	ec_log_notice("Client %s session closing", sess->channel->peer_addr());
+	sess->client->HrDone(false);
+	sess->client.reset();
+	remove(sess);
+}
+
+/*
+ * Expire sessions which have been waiting for longer than the protocol's
+ * idle limit, or GW_TLS_TIMEOUT for the TLS handshake. The session is
+ * disarmed under the lock, so that a worker cannot re-arm it concurrently,
+ * and then handed to a worker to say BYE (or closed, without TLS).
+ */
+void gw_reactor::sweep()
+{
+	auto now = std::chrono::steady_clock::now();
+	std::vector<std::shared_ptr<gw_session>> expired, stalled;
+	{
+		scoped_lock lk(m_lock);
+		for (const auto &p : m_sessions) {
+			auto &s = *p.second;
+			if (s.busy)
+				continue;
+			if (s.handshake ? now - s.last_active < GW_TLS_TIMEOUT :
+			    now - s.last_active < std::chrono::minutes(s.client->getTimeoutMinutes()))
+				continue;
+			struct epoll_event ev{};
+			ev.events = EPOLLONESHOT;
+			ev.data.ptr = &s;
+			epoll_ctl(m_epfd, EPOLL_CTL_MOD, s.channel->sockfd(), &ev);
+			s.busy = s.timed_out = true;
+			(s.handshake ? stalled : expired).push_back(p.second);
+		}
+	}
+	/* Without TLS there is no saying BYE; the reactor closes those */
+	for (auto &s : stalled) {
+		ec_log_err("Client %s did not complete the TLS handshake", s->channel->peer_addr());
+		drop(s.get());
+	}
+	for (auto &s : expired) {
+		auto peer = s->channel->peer_addr();
+		if (!gw_queue(std::move(s)))
+			ec_log_err("Unable to queue work for %s", peer);
+	}
+}
+
+void *gw_reactor::loop(void *arg)
+{
+	auto self = static_cast<gw_reactor *>(arg);
+	struct epoll_event events[64];
+	auto next_sweep = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+
+	kcsrv_blocksigs();
+	while (!self->m_stop) {
+		auto n = epoll_wait(self->m_epfd, events, ARRAY_SIZE(events), 1000);
+		if (n < 0 && errno != EINTR) {
+			ec_log_err("epoll_wait: %s", strerror(errno));
+			break;
+		}
+		for (int i = 0; i < n; ++i)
+			self->dispatch(static_cast<gw_session *>(events[i].data.ptr));
+		auto now = std::chrono::steady_clock::now();
+		if (now >= next_sweep) {
+			self->sweep();
+			next_sweep = now + std::chrono::seconds(10);
+		}
+	}
+	return nullptr;
+}
+
+void gw_session_task::run()
+{
+	auto &sess = *m_sess;
+	auto &reactor = *g_reactors[sess.reactor];
+	auto &ch = *sess.channel;
+	auto client = sess.client.get();
+
+	if (sess.timed_out) {
+		client->HrCloseConnection("BYE Connection closed because of timeout");
+		ec_log_err("Connection closed because of timeout");
+		goto close;
+	}
+	if (!sess.started) {
+		sess.started = true;
+		HRESULT hr;
+		try {
+			hr = client->HrSendGreeting(g_strHostString);
+		} catch (const KMAPIError &e) {
+			hr = e.code();
+		}
+		if (hr != hrSuccess)
+			goto close;
+		reactor.arm(&sess);
+		return;
+	}
+
+	for (unsigned int n = 0; n < GW_EVENT_BATCH; ++n) {
+		/* Only read what is buffered; the reactor waits for the rest. */
+		if (!gw_input_ready(sess)) {
+			if (sess.eof) {
+				ec_log_err("Client disconnected");
+				goto close;
+			}
+			reactor.arm(&sess);
+			return;
+		}
+		std::string line;
+		if (gw_read_line(ch, line) != hrSuccess ||
+		    !gw_dispatch_line(client, line))
+			goto close;
+		sess.lit_acked = 0;
+	}
+	/* More input is pending; go to the back of the queue. */
+	if (!gw_queue(std::shared_ptr<gw_session>(m_sess)))
+		goto close;
+	return;
+ close:
+	ec_log_notice("Client %s session closing", ch.peer_addr());
+	client->HrDone(false);
+	sess.client.reset();
+	reactor.remove(&sess);
+}
+
+static HRESULT gw_event_start(ECConfig *cfg)
+{
+	auto nreact = std::max(1U, atoui(cfg->GetSetting("event_reactor_threads")));
+	auto nwork = std::max(1U, atoui(cfg->GetSetting("event_worker_threads")));
+	/* Threads inherit the mask; signals stay with the main thread. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	g_evpool.reset(new ECThreadPool(nwork));
+	HRESULT hr = hrSuccess;
+	for (unsigned int i = 0; i < nreact && hr == hrSuccess; ++i) {
+		g_reactors.emplace_back(new gw_reactor);
+		hr = g_reactors.back()->start();
+	}
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+	if (hr == hrSuccess)
+		ec_log_info("Event model: %u reactor(s), %u worker(s)", nreact, nwork);
+	return hr;
+}
+
+static void gw_event_stop()
+{
+	/* No reactor may queue work from here on */
+	for (auto &r : g_reactors)
+		r->stop();
+	/*
+	 * Wait for running commands to finish while the pool is still
+	 * there: a worker that is done re-queues its session on it.
+	 */
+	if (g_evpool != nullptr)
+		g_evpool->setThreadCount(0, true);
+	for (auto &r : g_reactors)
+		r->close_all();
+	g_evpool.reset();
+	g_reactors.clear();
+}
+
+static HRESULT gw_event_accept(std::unique_ptr<ECChannel> &&ch, serviceType type, bool ssl)
+{
+	/*
+	 * Workers still read from the socket for a literal that is too big
+	 * to be read ahead; do not let a stalled client hold one forever.
+	 */
+	struct timeval tv = {60, 0};
+	setsockopt(ch->sockfd(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	auto sess = std::make_shared<gw_session>();
+	sess->channel = std::move(ch);
+	sess->handshake = ssl;
+	sess->last_active = decltype(sess->last_active)::clock::now();
+	sess->imap = type == ST_IMAP;
+	if (type == ST_POP3)
+		sess->client.reset(new POP3(szPath, std::shared_ptr<ECChannel>(sess->channel), g_lpConfig));
+	else
+		sess->client.reset(new IMAP(szPath, std::shared_ptr<ECChannel>(sess->channel), g_lpConfig));
+	sess->client->SetReadAhead(true);
+	sess->reactor = g_next_reactor++ % g_reactors.size();
+	auto &reactor = *g_reactors[sess->reactor];
+	auto hr = reactor.add(std::shared_ptr<gw_session>(sess));
+	if (hr != hrSuccess)
+		return hr;
+	if (ssl) {
+		/* The client speaks first; the reactor runs the handshake */
+		reactor.arm(sess.get());
+		return hrSuccess;
+	}
+	/* The greeting runs on a worker */
+	return gw_queue(std::move(sess)) ? hrSuccess : MAPI_E_NOT_ENOUGH_MEMORY;
+}
+
 static std::string GetServerFQDN()
 {
 	std::string retval = "localhost";
@@ -312,6 +813,8 @@ int main(int argc, char *argv[]) {
 		{ "pid_file", "/var/run/kopano/gateway.pid" },
 		{"running_path", "/var/lib/kopano/empty", CONFIGSETTING_OBSOLETE},
 		{ "process_model", "thread" },
+		{"event_reactor_threads", "2"},
+		{"event_worker_threads", "8"},
 		{"coredump_enabled", "systemdefault"},
 		{"pop3_listen", "*:110"},
 		{"pop3s_listen", ""},
@@ -440,6 +943,9 @@ int main(int argc, char *argv[]) {
 	if (strcmp(g_lpConfig->GetSetting("process_model"), "thread") == 0) {
 		bThreads = true;
 		g_lpLogger->SetLogprefix(LP_TID);
+	} else if (strcmp(g_lpConfig->GetSetting("process_model"), "event") == 0) {
+		bThreads = g_event_model = true;
+		g_lpLogger->SetLogprefix(LP_TID);
 	}
 	mainthread = pthread_self();
 	if (!szPath)
@@ -560,6 +1066,13 @@ static HRESULT handler_client(size_t i)
 		ec_log_err("Unable to accept %s socket connection.", method);
 		return hr;
 	}
+	if (g_event_model) {
+		ec_log_notice("Starting %s session", method);
+		hr = gw_event_accept(std::move(lpHandlerArgs->lpChannel), lpHandlerArgs->type, lpHandlerArgs->bUseSSL);
+		if (hr != hrSuccess)
+			ec_log_err("Could not start %s session: %s (%x)", method, GetMAPIErrorMessage(hr), hr);
+		return hr;
+	}
 
 	pthread_t tid;
 	ec_log_notice("Starting worker %s for %s request", model, method);
@@ -665,6 +1178,11 @@ static HRESULT running_service(char **argv)
 			GetMAPIErrorMessage(hr), hr);
 		return hr;
 	}
+	if (g_event_model) {
+		hr = gw_event_start(g_lpConfig.get());
+		if (hr != hrSuccess)
+			return hr;
+	}
 
 	// Mainloop
 	while (!quit) {
@@ -691,6 +1209,8 @@ static HRESULT running_service(char **argv)
 	}
 
 	ec_log_always("POP3/IMAP Gateway will now exit");
+	if (g_event_model)
+		gw_event_stop();
 	// in forked mode, send all children the exit signal
 	if (!bThreads) {
 		signal(SIGTERM, SIG_IGN);
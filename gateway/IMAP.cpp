@@ -309,8 +309,9 @@ HRESULT IMAP::HrProcessCommand(const std::string &strInput)
 		}
 
 		bool bPlus = (*lpcres == '+');
-		// no need to output the
-		if (!bPlus) {
+		// no need to output the continuation for LITERAL+, nor for
+		// a literal that was read ahead (the reactor asked for it)
+		if (!bPlus && (!m_bReadAhead || ulByteCount > ulMaxMessageSize)) {
 			try {
 				HrResponse(RESP_CONTINUE, "Ready for literal data");
 			} catch (const KMAPIError &e) {
@@ -1668,9 +1669,11 @@ HRESULT IMAP::HrCmdAppend(const string &strTag, const string &strFolderParam, co
 		ulMsgUid = lpPropVal->Value.ul;
 	if (ulMsgUid && ulFolderUid)
 		strAppendUid = string("[APPENDUID ") + stringify(ulFolderUid) + " " + stringify(ulMsgUid) + "] ";
-	if (strCurrentFolder == strFolder)
+	if (strCurrentFolder == strFolder) {
 	    // Fixme, add the appended message instead of HrRefreshFolderMails; the message is now seen as Recent
+		m_index_resync = true;
 		HrRefreshFolderMails(false, !bCurrentFolderReadOnly, NULL);
+	}
 	HrResponse(RESP_TAGGED_OK, strTag, strAppendUid + "APPEND completed");
 	return hr;
 }
@@ -1748,6 +1751,7 @@ HRESULT IMAP::HrCmdExpunge(const string &strTag, const std::vector<std::string>
 	if (hr != hrSuccess)
 		return hr;
 	// Let HrRefreshFolderMails output the actual EXPUNGEs
+	m_index_resync = true;
 	HrRefreshFolderMails(false, !bCurrentFolderReadOnly, NULL);
 	HrResponse(RESP_TAGGED_OK, strTag, strCommand + " completed");
 	return hrSuccess;
@@ -1905,6 +1909,7 @@ HRESULT IMAP::HrCmdStore(const string &strTag, const std::vector<std::string> &a
 			// HrExpungeDeleted sent client NO result.
 			return hrSuccess;
 		// Let HrRefreshFolderMails output the actual EXPUNGEs
+		m_index_resync = true;
 		HrRefreshFolderMails(false, !bCurrentFolderReadOnly, NULL);
 	}
 
@@ -2008,6 +2013,7 @@ HRESULT IMAP::HrCmdUidXaolMove(const string &strTag, const std::vector<std::stri
 	}
 
 	// Let HrRefreshFolderMails output the actual EXPUNGEs
+	m_index_resync = true;
 	HrRefreshFolderMails(false, !bCurrentFolderReadOnly, NULL);
 	HrResponse(RESP_TAGGED_OK, strTag, "UID XAOL-MOVE completed");
 	return hr;
@@ -2024,47 +2030,71 @@ HRESULT IMAP::HrCmdUidXaolMove(const string &strTag, const std::vector<std::stri
  *
  * @return string with IMAP Flags
  */
-std::string IMAP::PropsToFlags(LPSPropValue lpProps, unsigned int cValues, bool bRecent, bool bRead) {
-	string strFlags;
+static unsigned int imap_flag_bits(const SPropValue *lpProps, unsigned int cValues)
+{
+	unsigned int bits = 0;
 	auto lpMessageFlags = PCpropFindProp(lpProps, cValues, PR_MESSAGE_FLAGS);
 	auto lpFlagStatus = PCpropFindProp(lpProps, cValues, PR_FLAG_STATUS);
 	auto lpMsgStatus = PCpropFindProp(lpProps, cValues, PR_MSG_STATUS);
 	auto lpLastVerb = PCpropFindProp(lpProps, cValues, PR_LAST_VERB_EXECUTED);
 
-	if ((lpMessageFlags != NULL &&
-	    lpMessageFlags->Value.ul & MSGFLAG_READ) || bRead)
-		strFlags += "\\Seen ";
+	if (lpMessageFlags != nullptr && lpMessageFlags->Value.ul & MSGFLAG_READ)
+		bits |= IMAP_FL_SEEN;
 	if (lpFlagStatus != NULL && lpFlagStatus->Value.ul != 0)
-		strFlags += "\\Flagged ";
+		bits |= IMAP_FL_FLAGGED;
 
 	if (lpLastVerb) {
 		if (lpLastVerb->Value.ul == NOTEIVERB_REPLYTOSENDER ||
 		    lpLastVerb->Value.ul == NOTEIVERB_REPLYTOALL)
-			strFlags += "\\Answered ";
+			bits |= IMAP_FL_ANSWERED;
 		// there is no flag in imap for forwards. thunderbird uses the custom flag $Forwarded,
 		// and this is the only custom flag we support.
 		if (lpLastVerb->Value.ul == NOTEIVERB_FORWARD)
-			strFlags += "$Forwarded ";
+			bits |= IMAP_FL_FORWARDED;
 	}
 
 	if (lpMsgStatus) {
 		if (lpMsgStatus->Value.ul & MSGSTATUS_DRAFT)
-			strFlags += "\\Draft ";
+			bits |= IMAP_FL_DRAFT;
 		if (lpLastVerb == NULL &&
 		    lpMsgStatus->Value.ul & MSGSTATUS_ANSWERED)
-			strFlags += "\\Answered ";
+			bits |= IMAP_FL_ANSWERED;
 		if (lpMsgStatus->Value.ul & MSGSTATUS_DELMARKED)
-			strFlags += "\\Deleted ";
+			bits |= IMAP_FL_DELETED;
 	}
+	return bits;
+}
 
+static std::string imap_flag_string(unsigned int bits, bool bRecent)
+{
+	std::string strFlags;
+	if (bits & IMAP_FL_SEEN)
+		strFlags += "\\Seen ";
+	if (bits & IMAP_FL_FLAGGED)
+		strFlags += "\\Flagged ";
+	if (bits & IMAP_FL_ANSWERED)
+		strFlags += "\\Answered ";
+	if (bits & IMAP_FL_FORWARDED)
+		strFlags += "$Forwarded ";
+	if (bits & IMAP_FL_DRAFT)
+		strFlags += "\\Draft ";
+	if (bits & IMAP_FL_DELETED)
+		strFlags += "\\Deleted ";
 	if (bRecent)
-	    strFlags += "\\Recent ";
+		strFlags += "\\Recent ";
 	// strip final space
 	if (!strFlags.empty())
 		strFlags.resize(strFlags.size() - 1);
 	return strFlags;
 }
 
+std::string IMAP::PropsToFlags(LPSPropValue lpProps, unsigned int cValues, bool bRecent, bool bRead) {
+	auto bits = imap_flag_bits(lpProps, cValues);
+	if (bRead)
+		bits |= IMAP_FL_SEEN;
+	return imap_flag_string(bits, bRecent);
+}
+
 /**
  * The notify callback function. Sends changes to the client on the
  * current selected folder during the IDLE command.
@@ -2116,7 +2146,7 @@ LONG IMAP::IdleAdviseCallback(void *lpContext, ULONG cNotif,
 			if (lpNotif[i].info.tab.row.lpProps[IMAPID].ulPropTag == PR_EC_IMAP_ID)
 				sMail.ulUid = lpNotif[i].info.tab.row.lpProps[IMAPID].Value.ul;
 
-			sMail.strFlags = lpIMAP->PropsToFlags(lpNotif[i].info.tab.row.lpProps, lpNotif[i].info.tab.row.cValues, true, false);
+			sMail.ulFlags = imap_flag_bits(lpNotif[i].info.tab.row.lpProps, lpNotif[i].info.tab.row.cValues);
 			lpIMAP->lstFolderMailEIDs.emplace_back(sMail);
 			lpIMAP->m_ulLastUid = std::max(lpIMAP->m_ulLastUid, sMail.ulUid);
 			++ulRecent;
@@ -2727,6 +2757,225 @@ bool IMAP::IsSpecialFolder(ULONG cbEntryID, ENTRYID *lpEntryID,
 	return true;
 }
 
+static constexpr const SizedSPropTagArray(7, imap_mail_cols) =
+	{7, {PR_ENTRYID, PR_INSTANCE_KEY, PR_EC_IMAP_ID,
+	PR_MESSAGE_FLAGS, PR_FLAG_STATUS, PR_MSG_STATUS,
+	PR_LAST_VERB_EXECUTED}};
+static constexpr const SizedSSortOrderSet(1, imap_sort_uid) =
+	{1, 0, 0, {{PR_EC_IMAP_ID, TABLE_SORT_ASCEND}}};
+/* Number of changes kept for sessions which have not refreshed yet */
+static constexpr size_t IMAP_INDEX_JOURNAL = 8192;
+static std::mutex g_index_lock;
+static std::map<std::wstring, std::weak_ptr<imap_folder_index>> g_index_reg;
+
+imap_folder_index::~imap_folder_index()
+{
+	if (m_conn != 0)
+		m_table->Unadvise(m_conn);
+}
+
+/**
+ * Find or create the index for a folder. Sessions only share an index
+ * when they are logged on as the same user, so they see the same
+ * messages.
+ *
+ * @param[in] user	Logged on user
+ * @param[in] hid	PR_EC_HIERARCHYID of the folder
+ * @param[in] folder	The folder, used when the index has to be loaded
+ */
+HRESULT imap_folder_index::get(const std::wstring &user, ULONG hid,
+    IMAPIFolder *folder, std::shared_ptr<imap_folder_index> *out)
+{
+	auto key = user + L":" + std::to_wstring(hid);
+	{
+		scoped_lock lk(g_index_lock);
+		auto i = g_index_reg.find(key);
+		if (i != g_index_reg.cend()) {
+			auto idx = i->second.lock();
+			if (idx != nullptr && idx->valid()) {
+				*out = std::move(idx);
+				return hrSuccess;
+			}
+		}
+	}
+	/* Load without holding the registry lock */
+	std::shared_ptr<imap_folder_index> idx(new(std::nothrow) imap_folder_index);
+	if (idx == nullptr)
+		return MAPI_E_NOT_ENOUGH_MEMORY;
+	auto hr = idx->load(folder);
+	if (hr != hrSuccess)
+		return hr;
+	scoped_lock lk(g_index_lock);
+	for (auto i = g_index_reg.begin(); i != g_index_reg.end(); )
+		if (i->second.expired())
+			i = g_index_reg.erase(i);
+		else
+			++i;
+	g_index_reg[key] = idx;
+	*out = std::move(idx);
+	return hrSuccess;
+}
+
+HRESULT imap_folder_index::load(IMAPIFolder *folder)
+{
+	auto hr = folder->GetContentsTable(MAPI_DEFERRED_ERRORS, &~m_table);
+	if (hr != hrSuccess)
+		return hr;
+	hr = m_table->SetColumns(imap_mail_cols, TBL_BATCH);
+	if (hr != hrSuccess)
+		return hr;
+	hr = m_table->SortTable(imap_sort_uid, TBL_BATCH);
+	if (hr != hrSuccess)
+		return hr;
+	hr = HrAllocAdviseSink(&imap_folder_index::notify_cb, this, &~m_sink);
+	if (hr != hrSuccess)
+		return hr;
+	/*
+	 * Advise before reading, and hold the lock while reading, so that no
+	 * change is lost; notifications for rows we have already seen are
+	 * applied on top and are harmless.
+	 */
+	scoped_lock lk(m_lock);
+	hr = m_table->Advise(fnevTableModified, m_sink, &m_conn);
+	if (hr != hrSuccess)
+		return hr;
+	enum { EID, IKEY, IMAPID };
+	while (true) {
+		rowset_ptr rows;
+		hr = m_table->QueryRows(ROWS_PER_REQUEST_BIG, 0, &~rows);
+		if (hr != hrSuccess)
+			return hr;
+		if (rows->cRows == 0)
+			break;
+		for (unsigned int i = 0; i < rows->cRows; ++i) {
+			auto &r = rows[i];
+			if (r.lpProps[EID].ulPropTag != PR_ENTRYID ||
+			    r.lpProps[IKEY].ulPropTag != PR_INSTANCE_KEY ||
+			    r.lpProps[IMAPID].ulPropTag != PR_EC_IMAP_ID)
+				continue;
+			auto uid = r.lpProps[IMAPID].Value.ul;
+			auto &m = m_mails[uid];
+			m.eid = r.lpProps[EID].Value.bin;
+			m.ikey = r.lpProps[IKEY].Value.bin;
+			m.uid = uid;
+			m.flags = imap_flag_bits(r.lpProps, r.cValues);
+			m_ikeys[std::string(reinterpret_cast<const char *>(m.ikey.lpb), m.ikey.cb)] = uid;
+		}
+	}
+	m_folder.reset(folder);
+	m_valid = true;
+	return hrSuccess;
+}
+
+bool imap_folder_index::valid() const
+{
+	scoped_lock lk(m_lock);
+	return m_valid;
+}
+
+uint64_t imap_folder_index::position() const
+{
+	scoped_lock lk(m_lock);
+	return m_base + m_journal.size();
+}
+
+void imap_folder_index::snapshot(std::vector<mail> &out, uint64_t *pos) const
+{
+	scoped_lock lk(m_lock);
+	out.clear();
+	out.reserve(m_mails.size());
+	for (const auto &p : m_mails)
+		out.emplace_back(p.second);
+	*pos = m_base + m_journal.size();
+}
+
+/**
+ * Copy the changes made after journal position @pos.
+ *
+ * @return false if the journal does not reach back that far (or the index
+ * went stale), in which case the caller has to rescan the folder.
+ */
+bool imap_folder_index::changes_since(uint64_t pos,
+    std::vector<change> &out, uint64_t *newpos) const
+{
+	scoped_lock lk(m_lock);
+	if (!m_valid || pos < m_base || pos > m_base + m_journal.size())
+		return false;
+	out.clear();
+	for (auto i = m_journal.cbegin() + (pos - m_base); i != m_journal.cend(); ++i)
+		out.emplace_back(*i);
+	*newpos = m_base + m_journal.size();
+	return true;
+}
+
+void imap_folder_index::record(change_type type, const mail &m)
+{
+	m_journal.emplace_back(change{type, m});
+	if (m_journal.size() <= IMAP_INDEX_JOURNAL)
+		return;
+	m_journal.pop_front();
+	++m_base;
+}
+
+void imap_folder_index::update(const SPropValue *row, ULONG nprops, const SBinary &ikey)
+{
+	auto eid = PCpropFindProp(row, nprops, PR_ENTRYID);
+	auto id = PCpropFindProp(row, nprops, PR_EC_IMAP_ID);
+	if (eid == nullptr || id == nullptr)
+		return;
+	auto ins = m_mails.emplace(id->Value.ul, mail());
+	auto &m = ins.first->second;
+	m.eid = eid->Value.bin;
+	m.ikey = ikey;
+	m.uid = id->Value.ul;
+	m.flags = imap_flag_bits(row, nprops);
+	m_ikeys[std::string(reinterpret_cast<const char *>(ikey.lpb), ikey.cb)] = m.uid;
+	record(ins.second ? CH_ADD : CH_MODIFY, m);
+}
+
+void imap_folder_index::remove(const SBinary &ikey)
+{
+	auto i = m_ikeys.find(std::string(reinterpret_cast<const char *>(ikey.lpb), ikey.cb));
+	if (i == m_ikeys.cend())
+		return;
+	auto m = m_mails.find(i->second);
+	if (m != m_mails.cend()) {
+		record(CH_DELETE, m->second);
+		m_mails.erase(m);
+	}
+	m_ikeys.erase(i);
+}
+
+LONG imap_folder_index::notify_cb(void *ctx, ULONG cNotif, NOTIFICATION *lpNotif)
+{
+	auto self = static_cast<imap_folder_index *>(ctx);
+	scoped_lock lk(self->m_lock);
+
+	for (ULONG i = 0; i < cNotif; ++i) {
+		if (lpNotif[i].ulEventType != fnevTableModified)
+			continue;
+		const auto &tab = lpNotif[i].info.tab;
+		switch (tab.ulTableEvent) {
+		case TABLE_ROW_ADDED:
+		case TABLE_ROW_MODIFIED:
+			if (tab.propIndex.ulPropTag == PR_INSTANCE_KEY)
+				self->update(tab.row.lpProps, tab.row.cValues, tab.propIndex.Value.bin);
+			break;
+		case TABLE_ROW_DELETED:
+			if (tab.propIndex.ulPropTag == PR_INSTANCE_KEY)
+				self->remove(tab.propIndex.Value.bin);
+			break;
+		case TABLE_RELOAD:
+		case TABLE_CHANGED:
+		case TABLE_ERROR:
+			/* Sessions rescan; the next get() builds a fresh index. */
+			self->m_valid = false;
+			break;
+		}
+	}
+	return S_OK;
+}
+
 /**
  * Make a list of all mails in the current selected folder.
  *
@@ -2739,13 +2988,9 @@ bool IMAP::IsSpecialFolder(ULONG cbEntryID, ENTRYID *lpEntryID,
  */
 HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, unsigned int *lpulUnseen, ULONG *lpulUIDValidity) {
 	object_ptr<IMAPIFolder> folder;
-	int n = 0;
-	SMail sMail;
 	bool bNewMail = false;
-	enum { EID, IKEY, IMAPID, MFLAGS, FLAGSTATUS, MSGSTATUS, LAST_VERB, NUM_COLS };
-	std::map<unsigned int, unsigned int> mapUIDs; // Map UID -> ID
 	SPropValue sPropMax;
-	unsigned int ulMailnr = 0, ulRecent = 0, ulUnseen = 0;
+	unsigned int ulRecent = 0, ulUnseen = 0;
 	static constexpr const SizedSPropTagArray(2, sPropsFolderIDs) =
 		{2, {PR_EC_IMAP_MAX_ID, PR_EC_HIERARCHYID}};
 	memory_ptr<SPropValue> lpFolderIDs;
@@ -2763,33 +3008,149 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, unsigne
 	if (lpulUIDValidity && lpFolderIDs[1].ulPropTag == PR_EC_HIERARCHYID)
 		*lpulUIDValidity = lpFolderIDs[1].Value.ul;
 
-	static constexpr const SizedSPropTagArray(7, cols) =
-		{7, {PR_ENTRYID, PR_INSTANCE_KEY, PR_EC_IMAP_ID,
-		PR_MESSAGE_FLAGS, PR_FLAG_STATUS, PR_MSG_STATUS,
-		PR_LAST_VERB_EXECUTED}};
-	static constexpr const SizedSSortOrderSet(1, sortuid) =
-		{1, 0, 0, {{PR_EC_IMAP_ID, TABLE_SORT_ASCEND}}};
+    if(bInitialLoad) {
+        lstFolderMailEIDs.clear();
+		m_ulLastUid = 0;
+    }
+
+	/* Use the shared index where possible, else read the whole folder */
+	hr = MAPI_E_NOT_FOUND;
+	if (lpFolderIDs[1].ulPropTag == PR_EC_HIERARCHYID)
+		hr = HrIndexFolderMails(folder, lpFolderIDs[1].Value.ul, bInitialLoad, ulMaxUID, &ulUnseen, &bNewMail);
+	else
+		m_index.reset();
+	if (hr != hrSuccess) {
+		hr = HrScanFolderMails(folder, ulMaxUID, &ulUnseen, &bNewMail);
+		if (hr != hrSuccess)
+			return hr;
+	}
+
+	for (const auto &mail : lstFolderMailEIDs)
+		if (mail.bRecent)
+			++ulRecent;
+    if (bNewMail || bInitialLoad) {
+		HrResponse(RESP_UNTAGGED, stringify(lstFolderMailEIDs.size()) + " EXISTS");
+		HrResponse(RESP_UNTAGGED, stringify(ulRecent) + " RECENT");
+    }
+
+	sort(lstFolderMailEIDs.begin(), lstFolderMailEIDs.end());
+    // Save the max UID so that other session will not see the items as \Recent
+    if(bResetRecent && ulRecent && ulMaxUID != m_ulLastUid) {
+    	sPropMax.ulPropTag = PR_EC_IMAP_MAX_ID;
+    	sPropMax.Value.ul = m_ulLastUid;
+		HrSetOneProp(folder, &sPropMax);
+    }
+	if (lpulUnseen)
+		*lpulUnseen = ulUnseen;
+	return hrSuccess;
+}
+
+/**
+ * Update lstFolderMailEIDs from the shared folder index, looking only at
+ * the changes since this session's previous refresh. EXPUNGE and FETCH
+ * FLAGS responses are sent for deleted and changed messages.
+ *
+ * @return MAPI_E_NOT_FOUND if the index cannot be used and the folder has
+ * to be scanned with HrScanFolderMails instead.
+ */
+HRESULT IMAP::HrIndexFolderMails(IMAPIFolder *folder, ULONG hid,
+    bool bInitialLoad, ULONG ulMaxUID, unsigned int *lpulUnseen,
+    bool *lpbNewMail)
+{
+	if (m_index == nullptr || m_index_hid != hid || !m_index->valid()) {
+		m_index.reset();
+		m_index_resync = true;
+		auto hr = imap_folder_index::get(m_strwUsername, hid, folder, &m_index);
+		if (hr != hrSuccess)
+			return hr;
+		m_index_hid = hid;
+	}
+
+	auto add_mail = [&](imap_folder_index::mail &&m) {
+		SMail sMail;
+		sMail.sEntryID = std::move(m.eid);
+		sMail.sInstanceKey = std::move(m.ikey);
+		sMail.ulUid = m.uid;
+		// Mark as recent if the message has a UID higher than the last highest read UID
+		// in this folder. This means that this session is the only one to see the message
+		// as recent.
+		sMail.bRecent = m.uid > ulMaxUID;
+		sMail.ulFlags = m.flags;
+		lstFolderMailEIDs.emplace_back(std::move(sMail));
+		m_ulLastUid = std::max(m.uid, m_ulLastUid);
+		// Remember the first unseen message
+		if (*lpulUnseen == 0 && !(m.flags & IMAP_FL_SEEN))
+			*lpulUnseen = lstFolderMailEIDs.size();
+		*lpbNewMail = true;
+	};
+
+	if (bInitialLoad) {
+		std::vector<imap_folder_index::mail> mails;
+		m_index->snapshot(mails, &m_index_pos);
+		lstFolderMailEIDs.reserve(mails.size());
+		for (auto &m : mails)
+			add_mail(std::move(m));
+		m_index_resync = false;
+		return hrSuccess;
+	}
+
+	std::vector<imap_folder_index::change> delta;
+	if (m_index_resync || !m_index->changes_since(m_index_pos, delta, &m_index_pos))
+		return MAPI_E_NOT_FOUND;
+	/* Changes may overlap what IDLE already applied; skip those. */
+	for (auto &c : delta) {
+		auto it = std::lower_bound(lstFolderMailEIDs.begin(), lstFolderMailEIDs.end(), c.m.uid);
+		bool have = it != lstFolderMailEIDs.end() && it->ulUid == c.m.uid;
+		ULONG seq = it - lstFolderMailEIDs.begin() + 1;
+
+		if (c.type == imap_folder_index::CH_DELETE) {
+			if (!have)
+				continue;
+			HrResponse(RESP_UNTAGGED, stringify(seq) + " EXPUNGE");
+			lstFolderMailEIDs.erase(it);
+		} else if (!have) {
+			add_mail(std::move(c.m));
+		} else if (it->ulFlags != c.m.flags) {
+			// Flags have changed, notify it
+			it->ulFlags = c.m.flags;
+			HrResponse(RESP_UNTAGGED, stringify(seq) + " FETCH (FLAGS (" + imap_flag_string(it->ulFlags, it->bRecent) + "))");
+		}
+	}
+	return hrSuccess;
+}
+
+/**
+ * Read the complete contents table of the folder and reconcile it with
+ * lstFolderMailEIDs.
+ */
+HRESULT IMAP::HrScanFolderMails(IMAPIFolder *folder, ULONG ulMaxUID,
+    unsigned int *lpulUnseen, bool *lpbNewMail)
+{
+	int n = 0;
+	SMail sMail;
+	enum { EID, IKEY, IMAPID, MFLAGS, FLAGSTATUS, MSGSTATUS, LAST_VERB, NUM_COLS };
+	std::map<unsigned int, unsigned int> mapUIDs; // Map UID -> ID
+	unsigned int ulMailnr = 0;
+
+	/* Changes from here on are picked up from the index next time. */
+	if (m_index != nullptr) {
+		m_index_pos = m_index->position();
+		m_index_resync = false;
+	}
 	object_ptr<IMAPITable> table;
-	hr = folder->GetContentsTable(MAPI_DEFERRED_ERRORS, &~table);
+	auto hr = folder->GetContentsTable(MAPI_DEFERRED_ERRORS, &~table);
 	if (hr != hrSuccess)
 		return kc_perror("K-2396", hr);
-	hr = table->SetColumns(cols, TBL_BATCH);
+	hr = table->SetColumns(imap_mail_cols, TBL_BATCH);
 	if (hr != hrSuccess)
 		return kc_perror("K-2387", hr);
-	hr = table->SortTable(sortuid, TBL_BATCH);
+	hr = table->SortTable(imap_sort_uid, TBL_BATCH);
 	if (hr != hrSuccess)
 		return kc_perror("K-2388", hr);
     // Remember UIDs if needed
-    if(!bInitialLoad)
-		for (const auto &mail : lstFolderMailEIDs)
-			mapUIDs[mail.ulUid] = n++;
-
-    if(bInitialLoad) {
-        lstFolderMailEIDs.clear();
-		m_ulLastUid = 0;
-    }
+	for (const auto &mail : lstFolderMailEIDs)
+		mapUIDs[mail.ulUid] = n++;
 
-	auto iterMail = lstFolderMailEIDs.cbegin();
     // Scan MAPI for new and existing messages
 	while(1) {
 		rowset_ptr lpRows;
@@ -2817,25 +3178,24 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, unsigne
                 // as recent.
                 sMail.bRecent = sMail.ulUid > ulMaxUID;
                 // Remember flags
-                sMail.strFlags = PropsToFlags(lpRows[ulMailnr].lpProps, lpRows[ulMailnr].cValues, sMail.bRecent, false);
+                sMail.ulFlags = imap_flag_bits(lpRows[ulMailnr].lpProps, lpRows[ulMailnr].cValues);
                 // Put message on the end of our message
 				lstFolderMailEIDs.emplace_back(sMail);
 				m_ulLastUid = std::max(sMail.ulUid, m_ulLastUid);
-                bNewMail = true;
+                *lpbNewMail = true;
 
                 // Remember the first unseen message
-				if (ulUnseen == 0 &&
-				    lpRows[ulMailnr].lpProps[MFLAGS].ulPropTag == PR_MESSAGE_FLAGS &&
-				    (lpRows[ulMailnr].lpProps[MFLAGS].Value.ul & MSGFLAG_READ) == 0)
-                        ulUnseen = lstFolderMailEIDs.size()-1+1; // size()-1 = last offset, mail ID = position + 1
+				if (*lpulUnseen == 0 && !(sMail.ulFlags & IMAP_FL_SEEN))
+                        *lpulUnseen = lstFolderMailEIDs.size()-1+1; // size()-1 = last offset, mail ID = position + 1
 				continue;
             }
             // Check flags
-            std::string strFlags = PropsToFlags(lpRows->aRow[ulMailnr].lpProps, lpRows->aRow[ulMailnr].cValues, lstFolderMailEIDs[iterUID->second].bRecent, false);
-			if (lstFolderMailEIDs[iterUID->second].strFlags != strFlags) {
+			auto ulFlags = imap_flag_bits(lpRows->aRow[ulMailnr].lpProps, lpRows->aRow[ulMailnr].cValues);
+			auto &mail = lstFolderMailEIDs[iterUID->second];
+			if (mail.ulFlags != ulFlags) {
 				// Flags have changed, notify it
-				HrResponse(RESP_UNTAGGED, stringify(iterUID->second+1) + " FETCH (FLAGS (" + strFlags + "))");
-				lstFolderMailEIDs[iterUID->second].strFlags = strFlags;
+				HrResponse(RESP_UNTAGGED, stringify(iterUID->second+1) + " FETCH (FLAGS (" + imap_flag_string(ulFlags, mail.bRecent) + "))");
+				mail.ulFlags = ulFlags;
 			}
 			// We already had this message, remove it from setUIDs
 			mapUIDs.erase(iterUID);
@@ -2843,7 +3203,7 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, unsigne
     }
 
     // All messages left in mapUIDs have been deleted, so loop through the current list so we can
-    // send the correct EXPUNGE calls; At the same time, count RECENT messages.
+    // send the correct EXPUNGE calls.
     ulMailnr = 0;
     while(ulMailnr < lstFolderMailEIDs.size()) {
         if (mapUIDs.find(lstFolderMailEIDs[ulMailnr].ulUid) != mapUIDs.cend()) {
@@ -2851,26 +3211,8 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, unsigne
             lstFolderMailEIDs.erase(lstFolderMailEIDs.begin() + ulMailnr);
             continue;
         }
-        if (lstFolderMailEIDs[ulMailnr].bRecent)
-            ++ulRecent;
-        ++iterMail;
         ++ulMailnr;
     }
-
-    if (bNewMail || bInitialLoad) {
-		HrResponse(RESP_UNTAGGED, stringify(lstFolderMailEIDs.size()) + " EXISTS");
-		HrResponse(RESP_UNTAGGED, stringify(ulRecent) + " RECENT");
-    }
-
-	sort(lstFolderMailEIDs.begin(), lstFolderMailEIDs.end());
-    // Save the max UID so that other session will not see the items as \Recent
-    if(bResetRecent && ulRecent && ulMaxUID != m_ulLastUid) {
-    	sPropMax.ulPropTag = PR_EC_IMAP_MAX_ID;
-    	sPropMax.Value.ul = m_ulLastUid;
-		HrSetOneProp(folder, &sPropMax);
-    }
-	if (lpulUnseen)
-		*lpulUnseen = ulUnseen;
 	return hrSuccess;
 }
 
@@ -3647,7 +3989,9 @@ HRESULT IMAP::HrPropertyFetchRow(LPSPropValue lpProps, ULONG cValues, string &st
  *
  * @return MAPI Error code
  */
-HRESULT IMAP::HrGetMessageFlags(string &strResponse, LPMESSAGE lpMessage, bool bRecent) {
+HRESULT IMAP::HrGetMessageFlags(string &strResponse, LPMESSAGE lpMessage,
+    bool bRecent, unsigned int *lpulFlags)
+{
 	memory_ptr<SPropValue> lpProps;
 	ULONG cValues;
 	static constexpr const SizedSPropTagArray(4, sptaFlagProps) =
@@ -3659,7 +4003,10 @@ HRESULT IMAP::HrGetMessageFlags(string &strResponse, LPMESSAGE lpMessage, bool b
 	HRESULT hr = lpMessage->GetProps(sptaFlagProps, 0, &cValues, &~lpProps);
 	if (FAILED(hr))
 		return hr;
-	strResponse += "FLAGS (" + PropsToFlags(lpProps, cValues, bRecent, false) + ")";
+	auto bits = imap_flag_bits(lpProps, cValues);
+	strResponse += "FLAGS (" + imap_flag_string(bits, bRecent) + ")";
+	if (lpulFlags != nullptr)
+		*lpulFlags = bits;
 	return hrSuccess;
 }
 
@@ -4279,11 +4626,10 @@ HRESULT IMAP::HrStore(const list<ULONG> &lstMails, string strMsgDataItemName, st
 		}
 
 		/* Get the newly updated flags */
-		hr = HrGetMessageFlags(strNewFlags, lpMessage, lstFolderMailEIDs[mail_idx].bRecent);
+		/* and update our internal flag status */
+		hr = HrGetMessageFlags(strNewFlags, lpMessage, lstFolderMailEIDs[mail_idx].bRecent, &lstFolderMailEIDs[mail_idx].ulFlags);
 		if (hr != hrSuccess)
 			return hr;
-		/* Update our internal flag status */
-		lstFolderMailEIDs[mail_idx].strFlags = strNewFlags;
 	} // loop on mails
 
 	if (strMsgDataItemName.size() > 7 &&
@@ -4380,7 +4726,7 @@ HRESULT IMAP::HrSearch(std::vector<std::string> &&lstSearchCriteria,
 			return hrSuccess;
 		} else if (strSearchCriterium.compare("NEW") == 0) {
 			for (unsigned int ulMailnr = 0; ulMailnr < lstFolderMailEIDs.size(); ++ulMailnr)
-			    if(lstFolderMailEIDs[ulMailnr].bRecent && lstFolderMailEIDs[ulMailnr].strFlags.find("Seen") == std::string::npos)
+			    if(lstFolderMailEIDs[ulMailnr].bRecent && !(lstFolderMailEIDs[ulMailnr].ulFlags & IMAP_FL_SEEN))
 					lstMailnr.emplace_back(ulMailnr);
 			return hrSuccess;
 		} else if (strSearchCriterium.compare("OLD") == 0) {
@@ -5,12 +5,15 @@
 #ifndef IMAP_H
 #define IMAP_H
 
+#include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
 #include <list>
 #include <set>
+#include <cstdint>
 #include <cstring>
 #include <kopano/ECChannel.h>
 #include <kopano/memory.hpp>
@@ -122,6 +125,62 @@ public:
 	bool bcheap = false;
 };
 
+/* Per-message IMAP flags; \Recent is per session and not part of these. */
+enum {
+	IMAP_FL_SEEN = 1 << 0,
+	IMAP_FL_FLAGGED = 1 << 1,
+	IMAP_FL_ANSWERED = 1 << 2,
+	IMAP_FL_FORWARDED = 1 << 3,
+	IMAP_FL_DRAFT = 1 << 4,
+	IMAP_FL_DELETED = 1 << 5,
+};
+
+/**
+ * Message list of a folder, shared by all sessions of one user which have
+ * the folder selected. It is loaded once and then kept current from table
+ * notifications. Every change is also appended to a bounded journal, so a
+ * session only needs to look at what happened since its previous refresh.
+ */
+class imap_folder_index final {
+	public:
+	struct mail {
+		BinaryArray eid, ikey;
+		ULONG uid;
+		unsigned int flags; /* IMAP_FL_* */
+	};
+	enum change_type { CH_ADD, CH_MODIFY, CH_DELETE };
+	struct change {
+		change_type type;
+		mail m; /* only m.uid for CH_DELETE */
+	};
+
+	~imap_folder_index();
+	static HRESULT get(const std::wstring &user, ULONG hid, IMAPIFolder *, std::shared_ptr<imap_folder_index> *);
+	bool valid() const;
+	uint64_t position() const;
+	void snapshot(std::vector<mail> &, uint64_t *pos) const;
+	bool changes_since(uint64_t pos, std::vector<change> &, uint64_t *newpos) const;
+
+	private:
+	imap_folder_index() = default;
+	HRESULT load(IMAPIFolder *);
+	void update(const SPropValue *row, ULONG nprops, const SBinary &ikey);
+	void remove(const SBinary &ikey);
+	void record(change_type, const mail &);
+	static LONG notify_cb(void *, ULONG, NOTIFICATION *);
+
+	mutable std::mutex m_lock;
+	std::map<ULONG, mail> m_mails;
+	std::map<std::string, ULONG> m_ikeys;
+	std::deque<change> m_journal;
+	uint64_t m_base = 0; /* position of m_journal.front() */
+	bool m_valid = false;
+	KC::object_ptr<IMAPIFolder> m_folder;
+	KC::object_ptr<IMAPITable> m_table;
+	KC::object_ptr<IMAPIAdviseSink> m_sink;
+	ULONG m_conn = 0;
+};
+
 // FLAGS: \Seen \Answered \Flagged \Deleted \Draft \Recent
 class IMAP final : public ClientProto {
 public:
@@ -209,7 +268,7 @@ private:
         BinaryArray sInstanceKey;	// Instance key of message
 		ULONG ulUid;				// PR_EC_IMAP_UID of message
 		bool bRecent;				// \Recent flag
-		std::string strFlags;		// String of all flags, including \Recent
+		unsigned int ulFlags;		// IMAP_FL_* bits
 
 		bool operator<(const SMail &sMail) const noexcept { return ulUid < sMail.ulUid; }
 		bool operator<(ULONG uid) const noexcept { return ulUid < uid; }
@@ -233,6 +292,12 @@ private:
 
 	// vector of mails in the current folder. The index is used for mail number.
 	std::vector<SMail> lstFolderMailEIDs;
+	/* shared message index of the current folder and our position in its journal */
+	std::shared_ptr<imap_folder_index> m_index;
+	uint64_t m_index_pos = 0;
+	ULONG m_index_hid = 0;
+	/* set after we changed the folder ourselves: its notifications may still be in flight */
+	bool m_index_resync = true;
 	KC::object_ptr<IMsgStore> lpStore, lpPublicStore;
 
 	enum { PR_IPM_FAKEJUNK_ENTRYID = PR_ADDITIONAL_REN_ENTRYIDS };
@@ -279,6 +344,8 @@ private:
 	HRESULT ChangeSubscribeList(bool bSubscribe, ULONG eid_size, const ENTRYID *);
 	HRESULT HrMakeSpecialsList();
 	HRESULT HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, unsigned int *lpulUnseen, ULONG *lpulUIDValidity = NULL);
+	HRESULT HrIndexFolderMails(IMAPIFolder *, ULONG hid, bool initial, ULONG max_uid, unsigned int *unseen, bool *new_mail);
+	HRESULT HrScanFolderMails(IMAPIFolder *, ULONG max_uid, unsigned int *unseen, bool *new_mail);
 	HRESULT HrGetSubTree(std::list<SFolder> &folders, bool public_folders, std::list<SFolder>::const_iterator parent_folder);
 	HRESULT HrGetFolderPath(std::list<SFolder>::const_iterator lpFolder, const std::list<SFolder> &lstFolder, std::wstring &path);
 	HRESULT HrGetDataItems(std::string msgdata_itemnames, std::vector<std::string> &data_items);
@@ -287,7 +354,7 @@ private:
 	HRESULT HrPropertyFetch(std::list<ULONG> &mails, std::vector<std::string> &data_items);
 	HRESULT save_generated_properties(const std::string &text, IMessage *message);
 	HRESULT HrPropertyFetchRow(LPSPropValue props, ULONG nprops, std::string &response, ULONG mail_nr, bool bounce_flags, const std::vector<std::string> &data_items);
-	HRESULT HrGetMessageFlags(std::string &response, LPMESSAGE msg, bool recent);
+	HRESULT HrGetMessageFlags(std::string &response, LPMESSAGE msg, bool recent, unsigned int *flags = nullptr);
 	HRESULT HrGetMessagePart(std::string &message_part, std::string &msg, std::string part_name);
 	ULONG LastOrNumber(const char *szNr, bool bUID);
 	HRESULT HrParseSeqSet(const std::string &seq, std::list<ULONG> &mails);
@@ -3,10 +3,16 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <chrono>
+#include <condition_variable>
 #include <exception>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <iostream>
 #include <string>
+#include <vector>
 #include "ECVMIMEUtils.h"
 #include "MAPISMTPTransport.h"
 #include <kopano/CommonUtil.h>
@@ -55,6 +61,205 @@ public:
 	};
 };
 
+/*
+ * SMTP connections kept open between messages. Each server (host:port) gets
+ * at most m_max connections, busy or idle; senders wait for one to come free.
+ * Idle connections are closed after m_idle_time seconds.
+ */
+class smtp_pool final {
+	public:
+	struct conn {
+		vmime::shared_ptr<vmime::net::transport> transport;
+		std::chrono::steady_clock::time_point last_used;
+	};
+
+	void configure(unsigned int max, unsigned int idle_time);
+	/*
+	 * Wait for a slot for @key and hand out an idle connection, if there
+	 * is one. Returns false when pooling is off.
+	 */
+	bool acquire(const std::string &key, conn &);
+	void release(const std::string &key, conn &&, bool keep);
+	void purge(bool all);
+
+	private:
+	struct host {
+		std::list<conn> idle;
+		unsigned int busy = 0;
+	};
+
+	void expire(host &, bool all, std::vector<conn> &);
+
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::map<std::string, host> m_hosts;
+	unsigned int m_max = 0;
+	std::chrono::seconds m_idle_time{60};
+};
+
+/*
+ * One message's use of a connection: taken from the pool if possible, and
+ * put back when the message went out.
+ */
+class smtp_lease final {
+	public:
+	smtp_lease(const std::string &host, int port);
+	~smtp_lease();
+	vmime::shared_ptr<vmime::net::transport> get() const { return m_conn.transport; }
+	bool reused() const { return m_reused; }
+	/* Replace the connection by a fresh, not yet connected one */
+	void renew();
+	void keep() { m_keep = true; }
+
+	private:
+	std::string m_host, m_key;
+	int m_port;
+	smtp_pool::conn m_conn;
+	bool m_pooled, m_reused = false, m_keep = false;
+};
+
+static smtp_pool g_smtp_pool;
+
+static void smtp_close(smtp_pool::conn &c)
+{
+	if (c.transport == nullptr)
+		return;
+	try {
+		if (c.transport->isConnected())
+			c.transport->disconnect();
+	} catch (const vmime::exception &) {
+	}
+	c.transport.reset();
+}
+
+void smtp_pool::configure(unsigned int max, unsigned int idle_time)
+{
+	std::unique_lock<std::mutex> lk(m_lock);
+	m_max = max;
+	m_idle_time = std::chrono::seconds(idle_time);
+	lk.unlock();
+	m_cond.notify_all();
+	if (max == 0)
+		purge(true);
+}
+
+void smtp_pool::expire(host &h, bool all, std::vector<conn> &out)
+{
+	auto now = std::chrono::steady_clock::now();
+	for (auto i = h.idle.begin(); i != h.idle.end(); ) {
+		if (!all && now - i->last_used < m_idle_time) {
+			++i;
+			continue;
+		}
+		out.emplace_back(std::move(*i));
+		i = h.idle.erase(i);
+	}
+}
+
+bool smtp_pool::acquire(const std::string &key, conn &c)
+{
+	std::vector<conn> stale;
+	std::unique_lock<std::mutex> lk(m_lock);
+	if (m_max == 0)
+		return false;
+	auto &h = m_hosts[key];
+	expire(h, false, stale);
+	m_cond.wait(lk, [&]() { return m_max == 0 || !h.idle.empty() || h.busy < m_max; });
+	if (m_max == 0)
+		return false;
+	if (!h.idle.empty()) {
+		c = std::move(h.idle.front());
+		h.idle.pop_front();
+	}
+	++h.busy;
+	lk.unlock();
+	for (auto &s : stale)
+		smtp_close(s);
+	return true;
+}
+
+void smtp_pool::release(const std::string &key, conn &&c, bool keep)
+{
+	std::unique_lock<std::mutex> lk(m_lock);
+	auto &h = m_hosts[key];
+	--h.busy;
+	if (keep && m_max > 0 && h.busy + h.idle.size() < m_max &&
+	    c.transport != nullptr && c.transport->isConnected()) {
+		c.last_used = std::chrono::steady_clock::now();
+		/* Most recently used first, so that the surplus can expire */
+		h.idle.emplace_front(std::move(c));
+		keep = true;
+	} else {
+		keep = false;
+	}
+	lk.unlock();
+	m_cond.notify_all();
+	if (!keep)
+		smtp_close(c);
+}
+
+void smtp_pool::purge(bool all)
+{
+	std::vector<conn> stale;
+	std::unique_lock<std::mutex> lk(m_lock);
+	for (auto &h : m_hosts)
+		expire(h.second, all, stale);
+	lk.unlock();
+	for (auto &s : stale)
+		smtp_close(s);
+}
+
+smtp_lease::smtp_lease(const std::string &host, int port) :
+	m_host(host), m_key(host + ":" + std::to_string(port)), m_port(port)
+{
+	m_pooled = g_smtp_pool.acquire(m_key, m_conn);
+	if (m_conn.transport != nullptr &&
+	    std::chrono::steady_clock::now() - m_conn.last_used >= std::chrono::seconds(2)) {
+		/* The server may have hung up on a connection that sat idle */
+		try {
+			m_conn.transport->noop();
+		} catch (const vmime::exception &e) {
+			ec_log_debug("SMTP: pooled connection is gone: %s", e.what());
+			smtp_close(m_conn);
+		}
+	}
+	if (m_conn.transport != nullptr)
+		m_reused = true;
+	else
+		renew();
+}
+
+smtp_lease::~smtp_lease()
+{
+	if (m_pooled)
+		g_smtp_pool.release(m_key, std::move(m_conn), m_keep);
+	else
+		smtp_close(m_conn);
+}
+
+void smtp_lease::renew()
+{
+	smtp_close(m_conn);
+	// Session initialization (global properties)
+	auto vmSession = vmime::net::session::create();
+	// set the server address and port, plus type of service by use of url
+	// and get our special mapismtp mailer
+	vmime::utility::url url("mapismtp", m_host, m_port);
+	m_conn.transport = vmSession->getTransport(url);
+	m_conn.transport->setTimeoutHandlerFactory(vmime::make_shared<mapiTimeoutHandlerFactory>());
+	m_reused = false;
+}
+
+void smtp_pool_configure(unsigned int max_per_host, unsigned int idle_time)
+{
+	g_smtp_pool.configure(max_per_host, idle_time);
+}
+
+void smtp_pool_purge(bool all)
+{
+	g_smtp_pool.purge(all);
+}
+
 ECVMIMESender::ECVMIMESender(const std::string &host, int port) :
     ECSender(host, port)
 {
@@ -272,18 +477,6 @@ HRESULT ECVMIMESender::sendMail(LPADRBOOK lpAdrBook, LPMESSAGE lpMessage,
 	error.clear();
 
 	try {
-		// Session initialization (global properties)
-		auto vmSession = vmime::net::session::create();
-
-		// set the server address and port, plus type of service by use of url
-		// and get our special mapismtp mailer
-		vmime::utility::url url("mapismtp", smtphost, smtpport);
-		auto vmTransport = vmSession->getTransport(url);
-		vmTransport->setTimeoutHandlerFactory(vmime::make_shared<mapiTimeoutHandlerFactory>());
-
-		/* cast to access interface extras */
-		auto mapiTransport = vmime::dynamicCast<vmime::net::smtp::MAPISMTPTransport>(vmTransport);
-
 		// get expeditor for 'mail from:' smtp command
 		if (vmMessage->getHeader()->hasField(vmime::fields::FROM))
 			expeditor = *vmime::dynamicCast<vmime::mailbox>(vmMessage->getHeader()->findField(vmime::fields::FROM)->getValue());
@@ -314,10 +507,8 @@ HRESULT ECVMIMESender::sendMail(LPADRBOOK lpAdrBook, LPMESSAGE lpMessage,
 
 		// Delivery report request
 		SPropValuePtr ptrDeliveryReport;
-		if (mapiTransport != nullptr &&
-		    HrGetOneProp(lpMessage, PR_ORIGINATOR_DELIVERY_REPORT_REQUESTED, &~ptrDeliveryReport) == hrSuccess &&
-		    ptrDeliveryReport->Value.b == TRUE)
-			mapiTransport->requestDSN(true, "");
+		bool dsn = HrGetOneProp(lpMessage, PR_ORIGINATOR_DELIVERY_REPORT_REQUESTED, &~ptrDeliveryReport) == hrSuccess &&
+		           ptrDeliveryReport->Value.b == TRUE;
 
 		// Generate the message, "stream" it and delegate the sending
 		// to the generic send() function.
@@ -333,7 +524,15 @@ HRESULT ECVMIMESender::sendMail(LPADRBOOK lpAdrBook, LPMESSAGE lpMessage,
 		
 		// send the email already!
 		bool ok = false;
-		try {
+		smtp_lease lease(smtphost, smtpport);
+		auto vmTransport = lease.get();
+		/* cast to access interface extras */
+		auto mapiTransport = vmime::dynamicCast<vmime::net::smtp::MAPISMTPTransport>(vmTransport);
+		/* A pooled connection still has the setting of its previous message */
+		if (mapiTransport != nullptr)
+			mapiTransport->requestDSN(dsn, "");
+	retry:
+		if (!vmTransport->isConnected()) try {
 			vmTransport->connect();
 		} catch (const vmime::exception &e) {
 			// special error, smtp server not respoding, so try later again
@@ -343,8 +542,8 @@ HRESULT ECVMIMESender::sendMail(LPADRBOOK lpAdrBook, LPMESSAGE lpMessage,
 
 		try {
 			vmTransport->send(expeditor, recipients, isAdapter, str.length(), NULL);
-			vmTransport->disconnect();
 			ok = true;
+			lease.keep();
 		} catch (const vmime::exceptions::command_error &e) {
 			if (mapiTransport != NULL) {
 				mPermanentFailedRecipients = mapiTransport->getPermanentFailedRecipients();
@@ -366,6 +565,22 @@ HRESULT ECVMIMESender::sendMail(LPADRBOOK lpAdrBook, LPMESSAGE lpMessage,
 			// message should be cancelled, unsendable, test by smtp result code.
 			return MAPI_W_CANCEL_MESSAGE;
 		} catch (const vmime::exception &e) {
+			/*
+			 * The server may have dropped a reused connection
+			 * meanwhile. Try once more over a new one.
+			 */
+			if (lease.reused() && mapiTransport != nullptr &&
+			    mapiTransport->getPermanentFailedRecipients().empty() &&
+			    mapiTransport->getTemporaryFailedRecipients().empty()) {
+				ec_log_debug("SMTP: reused connection failed (%s), reconnecting", e.what());
+				lease.renew();
+				vmTransport = lease.get();
+				mapiTransport = vmime::dynamicCast<vmime::net::smtp::MAPISMTPTransport>(vmTransport);
+				if (mapiTransport != nullptr)
+					mapiTransport->requestDSN(dsn, "");
+				isAdapter.reset();
+				goto retry;
+			}
 		}
 
 		if (mapiTransport != NULL) {
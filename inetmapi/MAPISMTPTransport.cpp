@@ -30,7 +30,9 @@
 //
 #include <kopano/platform.h>
 #include <memory>
+#include <string>
 #include <utility>
+#include <vector>
 #include <kopano/tie.hpp>
 #include <kopano/stringutil.h>
 #include "MAPISMTPTransport.h"
@@ -456,6 +458,8 @@ void MAPISMTPTransport::noop()
 
 //                             
 // Only this function is altered, to return per recipient failure.
+// When the server offers PIPELINING (RFC 2920), MAIL, all RCPTs and DATA
+// go out in one write and the replies are read afterwards.
 //                             
 void MAPISMTPTransport::send(const mailbox &expeditor,
     const mailboxList &recipients, utility::inputStream &is, size_t size,
@@ -470,6 +474,9 @@ void MAPISMTPTransport::send(const mailbox &expeditor,
 	else if (expeditor.isEmpty())
 		throw exceptions::no_expeditor();
 
+	mTemporaryFailedRecipients.clear();
+	mPermanentFailedRecipients.clear();
+
 	// Emit the "MAIL" command
 	bool bDSN = m_bDSNRequest;
 	
@@ -478,33 +485,51 @@ void MAPISMTPTransport::send(const mailbox &expeditor,
 		bDSN = false; // Disable DSN because the server does not support this.
 	}
 
+	std::vector<string> cmds;
 	auto strSend = "MAIL FROM: <" + expeditor.getEmail().toString() + ">";
 	if (bDSN) {
 		strSend += " RET=HDRS";
 		if (!m_strDSNTrackid.empty())
 			strSend += " ENVID=" + m_strDSNTrackid;
 	}
-
-	sendRequest(strSend);
-	auto resp = readResponse();
+	cmds.emplace_back(std::move(strSend));
+	for (size_t i = 0 ; i < recipients.getMailboxCount(); ++i) {
+		strSend = "RCPT TO: <" + recipients.getMailboxAt(i)->getEmail().toString() + ">";
+		if (bDSN)
+			 strSend += " NOTIFY=SUCCESS,DELAY";
+		cmds.emplace_back(std::move(strSend));
+	}
+	cmds.emplace_back("DATA");
+
+	bool pipelining = m_extensions.find("PIPELINING") != m_extensions.end();
+	if (pipelining) {
+		string batch;
+		for (const auto &c : cmds) {
+			ec_log_debug("< %s", c.c_str());
+			batch += c + "\r\n";
+		}
+		m_socket->send(batch);
+	}
+	size_t next_cmd = 0;
+	auto reply = [&]() {
+		if (!pipelining)
+			sendRequest(cmds[next_cmd]);
+		++next_cmd;
+		return readResponse();
+	};
+
+	auto resp = reply();
 	if (resp->getCode() / 10 != 25) {
 		internalDisconnect();
 		throw exceptions::command_error("MAIL", resp->getText());
 	}
 
-	// Emit a "RCPT TO" command for each recipient
-	mTemporaryFailedRecipients.clear();
-	mPermanentFailedRecipients.clear();
+	// Collect the "RCPT TO" reply for each recipient
 	for (size_t i = 0 ; i < recipients.getMailboxCount(); ++i) {
 		const mailbox& mbox = *recipients.getMailboxAt(i);
 		unsigned int code;
 
-		strSend = "RCPT TO: <" + mbox.getEmail().toString() + ">";
-		if (bDSN)
-			 strSend += " NOTIFY=SUCCESS,DELAY";
-
-		sendRequest(strSend);
-		resp = readResponse();
+		resp = reply();
 		code = resp->getCode();
 
 		sFailedRecip entry;
@@ -546,10 +571,10 @@ void MAPISMTPTransport::send(const mailbox &expeditor,
 	}
 
 	// Send the message data
-	sendRequest("DATA");
+	next_cmd = cmds.size() - 1;
 
 	// we also stop here if all recipients failed before
-	if ((resp = readResponse())->getCode() != 354)
+	if ((resp = reply())->getCode() != 354)
 	{
 		internalDisconnect();
 		throw exceptions::command_error("DATA", format("%d %s", resp->getCode(), resp->getText().c_str()));
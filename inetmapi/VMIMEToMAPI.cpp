@@ -77,7 +77,9 @@ enum {
 static vmime::charset vtm_upgrade_charset(vmime::charset cset, const char *ascii_upgrade = nullptr);
 static int getCharsetFromHTML(const string &, vmime::charset *);
 static HRESULT postWriteFixups(IMessage *);
-static size_t countBodyLines(const std::string &, size_t, size_t);
+static size_t countBodyLines(vmime::utility::seekableInputStream &, size_t, size_t);
+static size_t findHeaderEnd(vmime::utility::seekableInputStream &, std::string &, bool *);
+static void copyRange(vmime::utility::seekableInputStream &, size_t, size_t, vmime::utility::outputStream &);
 static std::string parameterizedFieldToStructure(vmime::shared_ptr<vmime::parameterizedHeaderField>);
 
 static const char im_charset_unspec[] = "unspecified";
@@ -186,8 +188,10 @@ HRESULT VMIMEToMAPI::createIMAPProperties(const std::string &input, std::string
 {
 	auto vmMessage = vmime::make_shared<vmime::message>();
 	vmMessage->parse(m_parsectx, input);
-	if (lpBody || lpBodyStructure)
-		messagePartToStructure(input, vmMessage, lpBody, lpBodyStructure);
+	if (lpBody || lpBodyStructure) {
+		vmime::utility::inputStreamStringAdapter is(input);
+		messagePartToStructure(is, vmMessage, lpBody, lpBodyStructure);
+	}
 
 	if (lpEnvelope)
 		*lpEnvelope = createIMAPEnvelope(vmMessage);
@@ -209,7 +213,26 @@ HRESULT VMIMEToMAPI::createIMAPProperties(const std::string &input, std::string
  * @return		MAPI error code.
  * @retval		MAPI_E_CALL_FAILED	Caught an exception, which breaks the conversion.
  */
-HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const string &input, IMessage *lpMessage) {
+HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const string &input, IMessage *lpMessage)
+{
+	try {
+		return convertVMIMEToMAPI(vmime::make_shared<vmime::utility::inputStreamStringAdapter>(input), input.size(), lpMessage);
+	} catch (const std::exception &e) {
+		ec_log_err("STD exception: %s", e.what());
+		return MAPI_E_CALL_FAILED;
+	}
+}
+
+/**
+ * Convert the RFC 2822 mail in @input, which is @length bytes long.
+ *
+ * The mail is parsed from the stream: body parts keep referring to their
+ * ranges of @input and are only read while they are converted, so a mail
+ * spooled to a file is never held in memory as a whole.
+ */
+HRESULT VMIMEToMAPI::convertVMIMEToMAPI(vmime::shared_ptr<vmime::utility::seekableInputStream> input,
+    size_t length, IMessage *lpMessage)
+{
 	// signature variables
 	object_ptr<IStream> lpStream;
 	ULONG ulAttNr, nProps = 0;
@@ -222,14 +245,9 @@ HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const string &input, IMessage *lpMessage
 			m_mailState = sMailState();
 
 		// get raw headers
-		auto posHeaderEnd = input.find("\r\n\r\n");
-		if (posHeaderEnd == std::string::npos) {
-			// input was not rfc compliant, try Unix enters
-			posHeaderEnd = input.find("\n\n");
-			bUnix = true;
-		}
+		std::string strHeaders;
+		auto posHeaderEnd = findHeaderEnd(*input, strHeaders, &bUnix);
 		if (posHeaderEnd != std::string::npos) {
-			auto strHeaders = input.substr(0, posHeaderEnd);
 			KPropbuffer<1> prop;
 			// make sure we have US-ASCII headers
 			if (bUnix)
@@ -248,12 +266,12 @@ HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const string &input, IMessage *lpMessage
 		*/
 		SPropValue sMessageSize;
 		sMessageSize.ulPropTag = PR_MESSAGE_SIZE;
-		sMessageSize.Value.ul = input.length();
+		sMessageSize.Value.ul = length;
 		lpMessage->SetProps(1, &sMessageSize, nullptr);
 
 		// turn buffer into a message
 		auto vmMessage = vmime::make_shared<vmime::message>();
-		vmMessage->parse(m_parsectx, input);
+		vmMessage->parse(m_parsectx, input, 0, length);
 		if (m_dopt.header_strict_rfc) {
 			auto vmHeader = vmMessage->getHeader();
 			if (!vmHeader->hasField(vmime::fields::FROM) && !vmHeader->hasField(vmime::fields::DATE))
@@ -262,7 +280,7 @@ HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const string &input, IMessage *lpMessage
 
 		// save imap data first, seems vmMessage may be altered in the rest of the code.
 		if (m_dopt.add_imap_data)
-			createIMAPBody(input, vmMessage, lpMessage);
+			createIMAPBody(*input, length, vmMessage, lpMessage);
 		auto hr = fillMAPIMail(vmMessage, lpMessage);
 		if (hr != hrSuccess)
 			return hr;
@@ -307,7 +325,7 @@ HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const string &input, IMessage *lpMessage
 			// find the original received body
 			// vmime re-generates different headers and spacings, so we can't use this.
 			if (posHeaderEnd != string::npos)
-				os.write(input.c_str() + posHeaderEnd, input.size() - posHeaderEnd);
+				copyRange(*input, posHeaderEnd, length, os);
 			hr = lpStream->Commit(0);
 			if (hr != hrSuccess)
 				return hr;
@@ -3278,27 +3296,38 @@ std::string VMIMEToMAPI::createIMAPEnvelope(vmime::shared_ptr<vmime::message> vm
  * of that property too, for RFC822.SIZE requests.
  * 
  * @param[in] input the received email
+ * @param[in] length size of the received email
+ * @param[in] vmMessage the parsed email
  * @param[in] lpMessage message to store the data in
  * 
  * @return MAPI error code
  */
-HRESULT VMIMEToMAPI::createIMAPBody(const string &input,
-    vmime::shared_ptr<vmime::message> vmMessage, IMessage *lpMessage)
+HRESULT VMIMEToMAPI::createIMAPBody(vmime::utility::seekableInputStream &input,
+    size_t length, vmime::shared_ptr<vmime::message> vmMessage,
+    IMessage *lpMessage)
 {
-	KPropbuffer<4> sProps;
+	KPropbuffer<3> sProps;
 	std::string strBody, strBodyStructure;
+	object_ptr<IStream> lpStream;
 
 	messagePartToStructure(input, vmMessage, &strBody, &strBodyStructure);
 
+	/* Copy the email in blocks rather than as one property value */
+	auto hr = lpMessage->OpenProperty(PR_EC_IMAP_EMAIL, &IID_IStream,
+	          STGM_WRITE | STGM_TRANSACTED, MAPI_CREATE | MAPI_MODIFY, &~lpStream);
+	if (hr != hrSuccess)
+		return hr;
+	outputStreamMAPIAdapter os(lpStream);
+	copyRange(input, 0, length, os);
+	hr = lpStream->Commit(0);
+	if (hr != hrSuccess)
+		return hr;
+
 	sProps[0].ulPropTag = PR_EC_IMAP_EMAIL_SIZE;
-	sProps[0].Value.ul = input.length();
-
-	sProps[1].ulPropTag = PR_EC_IMAP_EMAIL;
-	sProps[1].Value.bin.lpb = (BYTE*)input.c_str();
-	sProps[1].Value.bin.cb = input.length();
-	sProps.set(2, PR_EC_IMAP_BODY, std::move(strBody));
-	sProps.set(3, PR_EC_IMAP_BODYSTRUCTURE, std::move(strBodyStructure));
-	return lpMessage->SetProps(4, sProps.get(), nullptr);
+	sProps[0].Value.ul = length;
+	sProps.set(1, PR_EC_IMAP_BODY, std::move(strBody));
+	sProps.set(2, PR_EC_IMAP_BODYSTRUCTURE, std::move(strBodyStructure));
+	return lpMessage->SetProps(3, sProps.get(), nullptr);
 }
 
 /** 
@@ -3311,7 +3340,7 @@ HRESULT VMIMEToMAPI::createIMAPBody(const string &input,
  * 
  * @return always success
  */
-HRESULT VMIMEToMAPI::messagePartToStructure(const string &input,
+HRESULT VMIMEToMAPI::messagePartToStructure(vmime::utility::seekableInputStream &input,
     vmime::shared_ptr<vmime::bodyPart> vmBodyPart, std::string *lpSimple,
     std::string *lpExtended)
 {
@@ -3390,7 +3419,7 @@ HRESULT VMIMEToMAPI::messagePartToStructure(const string &input,
  * 
  * @return always success
  */
-HRESULT VMIMEToMAPI::bodyPartToStructure(const string &input,
+HRESULT VMIMEToMAPI::bodyPartToStructure(vmime::utility::seekableInputStream &input,
     vmime::shared_ptr<vmime::bodyPart> vmBodyPart, std::string *lpSimple,
     std::string *lpExtended)
 {
@@ -3467,16 +3496,17 @@ HRESULT VMIMEToMAPI::bodyPartToStructure(const string &input,
 		// envelope eerst, dan message, dan lines
 		vmBodyPart->getBody()->getContents()->extractRaw(os); // generate? raw?
 		subMessage->parse(m_parsectx, buffer);
+		vmime::utility::inputStreamStringAdapter subInput(buffer);
 		lBody.emplace_back("(" + createIMAPEnvelope(subMessage) + ")");
 		lBodyStructure.emplace_back("(" + createIMAPEnvelope(subMessage) + ")");
 
 		// recurse message-in-message
-		messagePartToStructure(buffer, subMessage, &strSubSingle, &strSubExtended);
+		messagePartToStructure(subInput, subMessage, &strSubSingle, &strSubExtended);
 		lBody.emplace_back(std::move(strSubSingle));
 		lBodyStructure.emplace_back(std::move(strSubExtended));
 
 		// dus hier nog de line count van vmBodyPart->getBody buffer?
-		lBody.emplace_back(stringify(countBodyLines(buffer, 0, buffer.length())));
+		lBody.emplace_back(stringify(countBodyLines(subInput, 0, buffer.length())));
 	}
 
 nil:
@@ -3569,19 +3599,72 @@ static std::string parameterizedFieldToStructure(vmime::shared_ptr<vmime::parame
  * 
  * @return number of lines
  */
-static size_t countBodyLines(const std::string &input, size_t start, size_t length)
+static size_t countBodyLines(vmime::utility::seekableInputStream &input,
+    size_t start, size_t length)
+{
+	vmime::byte_t buf[16384];
+	size_t lines = 0, left = length + 1;
+
+	input.seek(start);
+	while (left > 0) {
+		auto rd = input.read(buf, std::min(left, sizeof(buf)));
+		if (rd == 0)
+			break;
+		lines += std::count(buf, buf + rd, '\n');
+		left -= rd;
+	}
+	return lines;
+}
+
+/**
+ * Find the blank line that ends the top-level header block of @input.
+ *
+ * @param[in] input the RFC 2822 mail
+ * @param[out] headers the header block, without the blank line
+ * @param[out] unix set when the block ends in "\n\n" instead of "\r\n\r\n"
+ *
+ * @return offset of the blank line, or std::string::npos if there is none
+ */
+static size_t findHeaderEnd(vmime::utility::seekableInputStream &input,
+    std::string &headers, bool *unix)
 {
-	string::size_type lines = 0, pos = start;
+	vmime::byte_t buf[16384];
 
+	headers.clear();
+	input.seek(0);
 	while (true) {
-		pos = input.find_first_of('\n', pos);
-		if (pos == string::npos || pos > start+length)
+		auto rd = input.read(buf, sizeof(buf));
+		if (rd == 0)
 			break;
-		++pos;
-		++lines;
-	} 
+		auto from = headers.size() < 3 ? 0 : headers.size() - 3;
+		headers.append(reinterpret_cast<const char *>(buf), rd);
+		auto crlf = headers.find("\r\n\r\n", from);
+		auto lf = headers.find("\n\n", from);
+		if (crlf == std::string::npos && lf == std::string::npos)
+			continue;
+		// input was not rfc compliant if the Unix enters come first
+		*unix = lf < crlf;
+		headers.resize(*unix ? lf : crlf);
+		return headers.size();
+	}
+	headers.clear();
+	return std::string::npos;
+}
 
-	return lines;
+/* Copy bytes @from up to @to of @input to @os. */
+static void copyRange(vmime::utility::seekableInputStream &input, size_t from,
+    size_t to, vmime::utility::outputStream &os)
+{
+	vmime::byte_t buf[16384];
+
+	input.seek(from);
+	while (from < to) {
+		auto rd = input.read(buf, std::min(to - from, sizeof(buf)));
+		if (rd == 0)
+			break;
+		os.write(buf, rd);
+		from += rd;
+	}
 }
 
 // options.h code
@@ -45,8 +45,9 @@ public:
 	VMIMEToMAPI(IAddrBook *, delivery_options &&);
 
 	HRESULT convertVMIMEToMAPI(const std::string &input, IMessage *lpMessage);
+	HRESULT convertVMIMEToMAPI(vmime::shared_ptr<vmime::utility::seekableInputStream>, size_t length, IMessage *);
 	HRESULT createIMAPProperties(const std::string &input, std::string *envelope, std::string *body, std::string *bodystruct);
-	HRESULT createIMAPBody(const std::string &input, vmime::shared_ptr<vmime::message>, IMessage *);
+	HRESULT createIMAPBody(vmime::utility::seekableInputStream &, size_t length, vmime::shared_ptr<vmime::message>, IMessage *);
 	HRESULT createIMAPEnvelope(vmime::shared_ptr<vmime::message>, IMessage *);
 
 	public:
@@ -78,8 +79,8 @@ public:
 	HRESULT handleMessageToMeProps(IMessage *lpMessage, LPADRLIST lpRecipients);
 	std::wstring getWideFromVmimeText(const vmime::text &vmText);
 	std::string createIMAPEnvelope(vmime::shared_ptr<vmime::message>);
-	HRESULT messagePartToStructure(const std::string &input, vmime::shared_ptr<vmime::bodyPart>, std::string *simple, std::string *extended);
-	HRESULT bodyPartToStructure(const std::string &input, vmime::shared_ptr<vmime::bodyPart>, std::string *simple, std::string *extended);
+	HRESULT messagePartToStructure(vmime::utility::seekableInputStream &, vmime::shared_ptr<vmime::bodyPart>, std::string *simple, std::string *extended);
+	HRESULT bodyPartToStructure(vmime::utility::seekableInputStream &, vmime::shared_ptr<vmime::bodyPart>, std::string *simple, std::string *extended);
 	std::string getStructureExtendedFields(vmime::shared_ptr<vmime::header> part);
 };
 
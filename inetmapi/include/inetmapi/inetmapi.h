@@ -13,6 +13,7 @@
 #include <mapix.h>
 #include <mapidefs.h>
 #include <vector>
+#include <cstdio>
 #include <inetmapi/options.h>
 
 namespace KC {
@@ -50,9 +51,20 @@ public:
 
 /* c wrapper to create object */
 extern _kc_export ECSender *CreateSender(const std::string &smtphost, int port);
+/*
+ * Keep the SMTP connections of senders open after a message, for use by the
+ * next one: at most @max_per_host connections (busy or idle) to each server,
+ * closed after @idle_time seconds without use. When all are busy, senders
+ * wait. With @max_per_host 0 (the default), each message connects anew.
+ */
+extern _kc_export void smtp_pool_configure(unsigned int max_per_host, unsigned int idle_time);
+/* Close idle pooled connections: the expired ones, or all of them with @all */
+extern _kc_export void smtp_pool_purge(bool all);
 
 // Read char Buffer and set properties on open lpMessage object
 extern _kc_export HRESULT IMToMAPI(IMAPISession *, IMsgStore *, IAddrBook *, IMessage *, const std::string &input, delivery_options dopt);
+// Same, reading the mail from a file; a regular file is parsed in place rather than copied into memory
+extern _kc_export HRESULT IMToMAPI(IMAPISession *, IMsgStore *, IAddrBook *, IMessage *, FILE *input, delivery_options dopt);
 
 // Read properties from lpMessage object and fill a buffer with internet rfc822 format message
 // Use this one for retrieving messages not in outgoing que, they already have PR_SENDER_EMAIL/NAME
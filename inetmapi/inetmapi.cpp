@@ -6,11 +6,13 @@
 #include <mutex>
 #include <utility>
 #include <kopano/platform.h>
+#include <kopano/fileutil.hpp>
 #include <kopano/stringutil.h>
 #include <string>
 #include <fstream>
 #include <iostream>
 #include <cstdlib>
+#include <sys/stat.h>
 #include <vmime/vmime.hpp>
 #include <vmime/textPartFactory.hpp>
 #include "mapiTextPart.h"
@@ -27,6 +29,7 @@
 #include "MAPIToVMIME.h"
 #include "ECVMIMEUtils.h"
 #include "ECMapiUtils.h"
+#include "inputStreamMAPIAdapter.h"
 #include <kopano/ECLogger.h>
 #include <kopano/mapi_ptr.h>
 
@@ -116,10 +119,7 @@ static bool vtm_ascii_compatible(const char *s)
 	return mappable && memcmp(in, out, sizeof(in)) == 0;
 }
 
-// parse rfc822 input, and set props in lpMessage
-HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore,
-    IAddrBook *lpAddrBook, IMessage *lpMessage, const string &input,
-    delivery_options dopt)
+static void vtm_prepare(delivery_options &dopt)
 {
 	// Sanitize options
 	if (dopt.ascii_upgrade == nullptr || *dopt.ascii_upgrade == '\0') {
@@ -145,11 +145,42 @@ HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore,
 			ec_log_notice("K-1243: Detected old libvmime that "
 			"is unable to parse multi-address Reply-To (KC-434).");
 	}
+}
 
+// parse rfc822 input, and set props in lpMessage
+HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore,
+    IAddrBook *lpAddrBook, IMessage *lpMessage, const string &input,
+    delivery_options dopt)
+{
+	vtm_prepare(dopt);
 	// fill mapi object from buffer
 	return VMIMEToMAPI(lpAddrBook, std::move(dopt)).convertVMIMEToMAPI(input, lpMessage);
 }
 
+// parse the rfc822 mail in the file, and set props in lpMessage
+HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore,
+    IAddrBook *lpAddrBook, IMessage *lpMessage, FILE *input,
+    delivery_options dopt)
+{
+	struct stat sb;
+	if (fflush(input) != 0 || fstat(fileno(input), &sb) != 0 ||
+	    !S_ISREG(sb.st_mode)) {
+		/* Cannot be read by position (a pipe): work from a copy */
+		std::string buf;
+		auto hr = HrMapFileToString(input, &buf);
+		if (hr != hrSuccess)
+			return hr;
+		return IMToMAPI(lpSession, lpMsgStore, lpAddrBook, lpMessage, buf, std::move(dopt));
+	}
+	vtm_prepare(dopt);
+	try {
+		auto is = vmime::make_shared<inputStreamFileAdapter>(fileno(input), sb.st_size);
+		return VMIMEToMAPI(lpAddrBook, std::move(dopt)).convertVMIMEToMAPI(std::move(is), sb.st_size, lpMessage);
+	} catch (const std::bad_alloc &) {
+		return MAPI_E_NOT_ENOUGH_MEMORY;
+	}
+}
+
 // Read properties from lpMessage object and fill a buffer with internet rfc822 format message
 HRESULT IMToINet(IMAPISession *lpSession, IAddrBook *lpAddrBook,
     IMessage *lpMessage, char **lppbuf, sending_options sopt)
@@ -274,7 +305,8 @@ HRESULT createIMAPBody(const std::string &input, IMessage *lpMessage, bool envel
 	VMIMEToMAPI obj;
 	auto vmMessage = vmime::make_shared<vmime::message>();
 	vmMessage->parse(obj.m_parsectx, input);
-	auto hr = obj.createIMAPBody(input, vmMessage, lpMessage);
+	vmime::utility::inputStreamStringAdapter is(input);
+	auto hr = obj.createIMAPBody(is, input.size(), vmMessage, lpMessage);
 	if (hr != hrSuccess || !envelope)
 		return hr;
 	return obj.createIMAPEnvelope(vmMessage, lpMessage);
@@ -3,6 +3,8 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <cerrno>
+#include <unistd.h>
 #include "inputStreamMAPIAdapter.h"
 
 namespace KC {
@@ -46,6 +48,36 @@ size_t inputStreamMAPIAdapter::skip(size_t count)
 	return ulSize.QuadPart;
 }
 
+inputStreamFileAdapter::inputStreamFileAdapter(int fd, size_t size) :
+	m_fd(fd), m_size(size)
+{}
+
+size_t inputStreamFileAdapter::read(vmime::byte_t *data, size_t count)
+{
+	size_t done = 0;
+	count = std::min(count, m_size - m_pos);
+	while (done < count) {
+		auto ret = pread(m_fd, data + done, count - done, m_pos + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	m_pos += done;
+	if (done < count)
+		/* Read error or truncated file: end the stream here */
+		m_size = m_pos;
+	return done;
+}
+
+size_t inputStreamFileAdapter::skip(size_t count)
+{
+	count = std::min(count, m_size - m_pos);
+	m_pos += count;
+	return count;
+}
+
 outputStreamMAPIAdapter::outputStreamMAPIAdapter(IStream *s) :
 	lpStream(s)
 {}
@@ -7,10 +7,12 @@
 #define INPUT_STREAM_MAPI_ADAPTER_H
 
 #include <mapidefs.h>
+#include <algorithm>
 #include <sys/types.h>
 #include <kopano/memory.hpp>
 #include <vmime/utility/inputStream.hpp>
 #include <vmime/utility/outputStream.hpp>
+#include <vmime/utility/seekableInputStream.hpp>
 
 namespace KC {
 
@@ -27,6 +29,26 @@ private:
 	object_ptr<IStream> lpStream;
 };
 
+/*
+ * Reads a regular file by position, so that vmime can parse a spooled mail
+ * without copying it into memory. Body parts keep referring to ranges of
+ * the file and are only read when they are converted.
+ */
+class inputStreamFileAdapter final : public vmime::utility::seekableInputStream {
+	public:
+	inputStreamFileAdapter(int fd, size_t size);
+	virtual size_t read(vmime::byte_t *, size_t) override;
+	virtual size_t skip(size_t) override;
+	virtual void reset() override { m_pos = 0; }
+	virtual bool eof() const override { return m_pos >= m_size; }
+	virtual size_t getPosition() const override { return m_pos; }
+	virtual void seek(size_t pos) override { m_pos = std::min(pos, m_size); }
+
+	private:
+	int m_fd;
+	size_t m_size, m_pos = 0;
+};
+
 class outputStreamMAPIAdapter final : public vmime::utility::outputStream {
 	public:
 	outputStreamMAPIAdapter(IStream *);
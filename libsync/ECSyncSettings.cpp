@@ -29,6 +29,10 @@ ECSyncSettings::ECSyncSettings(void) :
 	env = getenv("KOPANO_STREAM_BUFFERSIZE");
 	if (env && env[0] != '\0')
 		m_ulStreamBufferSize = strtoul(env, NULL, 10);
+
+	env = getenv("KOPANO_SYNC_PAGESIZE");
+	if (env && env[0] != '\0')
+		m_ulChangesPageSize = strtoul(env, NULL, 10);
 }
 
 ULONG ECSyncSettings::SyncLogLevel() const {
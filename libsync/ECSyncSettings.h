@@ -33,6 +33,9 @@ public:
 	ULONG StreamTimeout() const { return m_ulStreamTimeout; }
 	ULONG StreamBufferSize() const { return m_ulStreamBufferSize; }
 
+	// Number of content changes to get from the server at once (0 is all)
+	ULONG ChangesPageSize() const { return m_ulChangesPageSize; }
+
 	static ECSyncSettings instance;
 
 private:
@@ -41,6 +44,7 @@ private:
 	ULONG m_ulSyncLog = 0, m_ulSyncLogLevel;
 	static const unsigned int m_ulSyncOpts = EC_SYNC_OPT_ALL;
 	unsigned int m_ulStreamTimeout = 30000, m_ulStreamBufferSize = 131072;
+	unsigned int m_ulChangesPageSize = 5000;
 };
 
 } /* namespace */
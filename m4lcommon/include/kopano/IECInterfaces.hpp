@@ -223,6 +223,12 @@ class IECServiceAdmin : public virtual IECSecSvcAdm_base {
 	/* Archive store function(s) */
 	virtual HRESULT GetArchiveStoreEntryID(LPCTSTR lpszUserName, LPCTSTR lpszServerName, ULONG ulFlags, ULONG *lpcbStoreID, LPENTRYID *lppStoreID) = 0;
 	virtual HRESULT ResetFolderCount(ULONG eid_size, const ENTRYID *eid, ULONG *nupdates) = 0;
+	/*
+	 * Copy a message into each folder, removing @delprops from and setting
+	 * @props on each copy; failed copies have an empty entryid. With
+	 * MESSAGE_MOVE, move the message into the one folder instead.
+	 */
+	virtual HRESULT DeliverCopies(ULONG eid_size, const ENTRYID *eid, const ENTRYLIST *folders, ULONG nprops, const SPropValue *props, const SPropTagArray *delprops, ULONG flags, ENTRYLIST **copies) = 0;
 };
 
 class IECSingleInstance : public virtual IUnknown {
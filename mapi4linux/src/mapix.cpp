@@ -3,6 +3,7 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <algorithm>
 #include <exception>
 #include <memory>
 #include <mutex>
@@ -78,9 +79,21 @@ struct alignas(::max_align_t) mapiext_head {
 	alignas(::max_align_t) char data[];
 };
 
+/*
+ * MAPIAllocateMore carves its buffers from slabs hanging off the root
+ * buffer. Slabs grow geometrically from MAPIBUF_SLAB_MIN up to
+ * MAPIBUF_SLAB_MAX; requests bigger than half a slab get a node of their
+ * own. MAPIFreeBuffer releases the whole chain by walking the slab list.
+ */
+static constexpr size_t MAPIBUF_ALIGN = alignof(::max_align_t);
+static constexpr size_t MAPIBUF_SLAB_MIN = 256, MAPIBUF_SLAB_MAX = 64 << 10;
+
 struct alignas(::max_align_t) mapibuf_head {
 	std::mutex mtx;
-	struct mapiext_head *child; /* singly-linked list */
+	struct mapiext_head *child; /* singly-linked list of slabs */
+	char *arena_ptr; /* unused space in the newest slab */
+	size_t arena_left;
+	unsigned int nslabs;
 #if _MAPI_MEM_MORE_DEBUG
 	enum mapibuf_ident ident;
 #endif
@@ -2030,6 +2043,9 @@ SCODE MAPIAllocateBuffer(ULONG cbSize, LPVOID *lppBuffer)
 	try {
 		new(bfr) struct mapibuf_head; /* init mutex */
 		bfr->child = nullptr;
+		bfr->arena_ptr = nullptr;
+		bfr->arena_left = 0;
+		bfr->nslabs = 0;
 	} catch (const std::exception &e) {
 		fprintf(stderr, "MAPIAllocateBuffer: %s\n", e.what());
 		free(bfr);
@@ -2055,22 +2071,36 @@ SCODE MAPIAllocateMore(ULONG cbSize, LPVOID lpObject, LPVOID *lppBuffer)
 		return MAPI_E_INVALID_PARAMETER;
 	if (!lpObject)
 		return MAPIAllocateBuffer(cbSize, lppBuffer);
-	cbSize += sizeof(struct mapiext_head);
-	auto bfr = static_cast<struct mapiext_head *>(malloc(cbSize));
-	if (bfr == nullptr) {
-		ec_log_crit("MAPIAllocateMore(): %s", strerror(errno));
-		return MAKE_MAPI_E(1);
-	}
-
+	/* Keep every carved buffer aligned and distinct, even for size 0 */
+	size_t want = (std::max(cbSize, 1U) + MAPIBUF_ALIGN - 1) & ~(MAPIBUF_ALIGN - 1);
 	auto head = container_of(lpObject, struct mapibuf_head, data);
 #if _MAPI_MEM_MORE_DEBUG
 	if (head->ident != MAPIBUF_BASE)
 		assert("AllocateMore on something that was not allocated with MAPIAllocateBuffer!\n" == nullptr);
 #endif
 	scoped_lock lock(head->mtx);
+	if (want <= head->arena_left) {
+		*lppBuffer = head->arena_ptr;
+		head->arena_ptr += want;
+		head->arena_left -= want;
+		return hrSuccess;
+	}
+	auto slab = std::min(MAPIBUF_SLAB_MIN << std::min(head->nslabs, 16U), MAPIBUF_SLAB_MAX);
+	bool own_node = want > slab / 2;
+	auto bfr = static_cast<struct mapiext_head *>(malloc(sizeof(struct mapiext_head) + (own_node ? want : slab)));
+	if (bfr == nullptr) {
+		ec_log_crit("MAPIAllocateMore(): %s", strerror(errno));
+		return MAKE_MAPI_E(1);
+	}
 	bfr->child = head->child;
 	head->child = bfr;
 	*lppBuffer = bfr->data;
+	if (!own_node) {
+		/* Retire the old slab's remainder; continue in the new one */
+		++head->nslabs;
+		head->arena_ptr = bfr->data + want;
+		head->arena_left = slab - want;
+	}
 #if _MAPI_MEM_DEBUG
 	fprintf(stderr, "Extra buffer: %p on %p\n", *lppBuffer, lpObject);
 #endif
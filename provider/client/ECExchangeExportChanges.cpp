@@ -104,15 +104,10 @@ HRESULT ECExchangeExportChanges::GetLastError(HRESULT hResult, ULONG ulFlags, LP
 
 HRESULT ECExchangeExportChanges::Config(LPSTREAM lpStream, ULONG ulFlags, LPUNKNOWN lpCollector, LPSRestriction lpRestriction, LPSPropTagArray lpIncludeProps, LPSPropTagArray lpExcludeProps, ULONG ulBufferSize){
 	HRESULT hr;
-	unsigned int ulSyncId = 0, ulChangeId = 0, ulStep = 0;
+	unsigned int ulSyncId = 0, ulChangeId = 0;
 	BOOL		bCanStream = FALSE;
 	bool		bForceImplicitStateUpdate = false;
 	auto lpSyncSettings = &ECSyncSettings::instance;
-	typedef std::map<SBinary, ChangeListIter, Util::SBinaryLess>	ChangeMap;
-	typedef ChangeMap::iterator					ChangeMapIter;
-	ChangeMap		mapChanges;
-	ChangeMapIter	iterLastChange;
-	ChangeList		lstChange;
 	std::string	sourcekey;
 
 	if(m_bConfiged){
@@ -204,13 +199,63 @@ HRESULT ECExchangeExportChanges::Config(LPSTREAM lpStream, ULONG ulFlags, LPUNKN
 		bForceImplicitStateUpdate = true;
 	}
 
+	m_ulSyncId = ulSyncId;
+	m_ulChangeId = ulChangeId;
+	if (m_ulSyncType == ICS_SYNC_CONTENTS && lpSyncSettings->ChangesPageSize() > 0) {
+		BOOL bPaged = false;
+		m_lpStore->lpTransport->HrCheckCapabilityFlags(KOPANO_CAP_PAGED_ICS, &bPaged);
+		if (bPaged)
+			m_ulPageSize = lpSyncSettings->ChangesPageSize();
+	}
+	hr = FetchChanges(sourcekey);
+	if (hr != hrSuccess)
+		return hr;
+	m_lpLogger->logf(EC_LOGLEVEL_INFO, "folder=\"%ls\" changes=%u%s syncid=%u changeid=%u", m_strDisplay.c_str(), m_ulChanges, m_ulPageCursor != 0 ? "+" : "", m_ulSyncId, m_ulChangeId);
+	m_ulBufferSize = (ulBufferSize != 0) ? ulBufferSize : 10;
+	m_bConfiged = true;
+
+	if (bForceImplicitStateUpdate) {
+		ZLOG_DEBUG(m_lpLogger, "Forcing state update for folder '%ls'", m_strDisplay.c_str());
+		if (m_ulChangeId == 0)
+			UpdateState(NULL);
+	}
+	return hrSuccess;
+}
+
+/**
+ * Get the changes from the server, or when the server hands them out in
+ * pages, the next page of them, and sort them into the change, flag and
+ * delete lists for Synchronize to export.
+ *
+ * Changes are only merged within one page. Pages come in change order, so
+ * exporting them one after the other still ends in the right state; at
+ * worst an object that changes in two pages is exported twice.
+ */
+HRESULT ECExchangeExportChanges::FetchChanges(const std::string &sourcekey)
+{
+	typedef std::map<SBinary, ChangeListIter, Util::SBinaryLess>	ChangeMap;
+	typedef ChangeMap::iterator					ChangeMapIter;
+	ChangeMap		mapChanges;
+	ChangeMapIter	iterLastChange;
+	ChangeList		lstChange;
+	ULONG ulStep, ulChanges = 0;
+	HRESULT hr;
+
+	m_lstChange.clear();
+	m_lstFlag.clear();
+	m_lstSoftDelete.clear();
+	m_lstHardDelete.clear();
+	m_ptrStreamExporter.reset();
+	m_ulStepBase += m_ulStep;
+	m_ulStep = 0;
 	MAPIFreeBuffer(m_lpChanges);
-	hr = m_lpStore->lpTransport->HrGetChanges(sourcekey, ulSyncId, ulChangeId, m_ulSyncType, ulFlags, m_lpRestrict, &m_ulMaxChangeId, &m_ulChanges, &~m_lpChanges);
+	if (m_ulPageSize > 0)
+		hr = m_lpStore->lpTransport->HrGetChangesPage(sourcekey, m_ulSyncId, m_ulChangeId, m_ulSyncType, m_ulFlags, m_lpRestrict, m_ulPageSize, &m_ulPageCursor, &m_ulMaxChangeId, &ulChanges, &~m_lpChanges);
+	else
+		hr = m_lpStore->lpTransport->HrGetChanges(sourcekey, m_ulSyncId, m_ulChangeId, m_ulSyncType, m_ulFlags, m_lpRestrict, &m_ulMaxChangeId, &ulChanges, &~m_lpChanges);
 	if (hr != hrSuccess)
 		return zlog("Unable to get changes from server", hr);
-	m_ulSyncId = ulSyncId;
-	m_ulChangeId = ulChangeId;
-	m_lpLogger->logf(EC_LOGLEVEL_INFO, "folder=\"%ls\" changes=%u syncid=%u changeid=%u", m_strDisplay.c_str(), m_ulChanges, m_ulSyncId, m_ulChangeId);
+	m_ulChanges += ulChanges;
 	/**
 	 * Filter the changes.
 	 * How this works:
@@ -223,7 +268,7 @@ HRESULT ECExchangeExportChanges::Config(LPSTREAM lpStream, ULONG ulFlags, LPUNKN
 	 * done because m_lstChange is not a list but a vector, which is not well suited for removing
 	 * items in the middle of the data.
 	 */
-	for (ulStep = 0; ulStep < m_ulChanges; ++ulStep) {
+	for (ulStep = 0; ulStep < ulChanges; ++ulStep) {
 		// First check if this change hasn't been processed yet
 		if (m_setProcessedChanges.find({m_lpChanges[ulStep].ulChangeId, std::string(reinterpret_cast<const char *>(m_lpChanges[ulStep].sSourceKey.lpb), m_lpChanges[ulStep].sSourceKey.cb)}) != m_setProcessedChanges.end())
 			continue;
@@ -332,14 +377,6 @@ HRESULT ECExchangeExportChanges::Config(LPSTREAM lpStream, ULONG ulFlags, LPUNKN
 	}
 
 	m_lstChange.assign(lstChange.begin(), lstChange.end());
-	m_ulBufferSize = (ulBufferSize != 0) ? ulBufferSize : 10;
-	m_bConfiged = true;
-
-	if (bForceImplicitStateUpdate) {
-		ZLOG_DEBUG(m_lpLogger, "Forcing state update for folder '%ls'", m_strDisplay.c_str());
-		if (m_ulChangeId == 0)
-			UpdateState(NULL);
-	}
 	return hrSuccess;
 }
 
@@ -373,6 +410,14 @@ HRESULT ECExchangeExportChanges::Synchronize(ULONG *lpulSteps, ULONG *lpulProgre
 		hr = ExportMessageFlags();
 		if(hr != hrSuccess)
 			return hr;
+		if (m_ulPageCursor != 0) {
+			/* This page is done; the state only advances after the last one */
+			hr = FetchChanges(std::string());
+			if (hr != hrSuccess)
+				return hr;
+			hr = SYNC_W_PROGRESS;
+			goto progress;
+		}
 	}else if(m_ulSyncType == ICS_SYNC_HIERARCHY){
 		hr = ExportFolderChanges();
 		if(hr == SYNC_W_PROGRESS)
@@ -431,8 +476,8 @@ progress:
 		}
 	}
 
-	*lpulSteps = m_lstChange.size();
-	*lpulProgress = m_ulStep;
+	*lpulSteps = m_ulStepBase + m_lstChange.size();
+	*lpulProgress = m_ulStepBase + m_ulStep;
 	return hr;
 }
 
@@ -43,6 +43,7 @@ private:
 	HRESULT ExportMessageDeletes();
 	HRESULT ExportFolderChanges();
 	HRESULT ExportFolderDeletes();
+	HRESULT FetchChanges(const std::string &sourcekey);
 	HRESULT UpdateStream(LPSTREAM lpStream);
 	HRESULT ChangesToEntrylist(std::list<ICSCHANGE> * lpLstChanges, LPENTRYLIST * lppEntryList);
 	HRESULT zlog(const char *, HRESULT = 0);
@@ -66,6 +67,8 @@ private:
 
 	PROCESSEDCHANGESSET m_setProcessedChanges;
 	ULONG m_ulChanges = 0, m_ulMaxChangeId = 0;
+	/* Paged retrieval: page size (0 if not paging), next page, steps in earlier pages */
+	ULONG m_ulPageSize = 0, m_ulPageCursor = 0, m_ulStepBase = 0;
 	clock_t m_clkStart = 0;
 	struct tms			m_tmsStart;
 	std::shared_ptr<KC::ECLogger> m_lpLogger;
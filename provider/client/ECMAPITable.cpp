@@ -2,7 +2,10 @@
  * SPDX-License-Identifier: AGPL-3.0-only
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
+#include <algorithm>
 #include <new>
+#include <utility>
+#include <cstdlib>
 #include <kopano/platform.h>
 #include <mapicode.h>
 #include <mapidefs.h>
@@ -13,20 +16,142 @@
 #include "ECMAPITable.h"
 #include <edkguid.h>
 #include <kopano/ECGuid.h>
+#include <kopano/ECLogger.h>
 #include <kopano/Util.h>
 
 using namespace KC;
 
+namespace {
+
+/* Takes the PR_INSTANCE_KEY that SetColumns added off a row again */
+static void strip_instance_key(SRow &row)
+{
+	if (row.cValues > 0 &&
+	    PROP_ID(row.lpProps[row.cValues-1].ulPropTag) == PROP_ID(PR_INSTANCE_KEY))
+		--row.cValues;
+}
+
+/*
+ * Sits between the notification client and the sink of the caller, so that
+ * a change to the table also throws away the rows read ahead.
+ */
+class ECTableAdviseSink final : public ECUnknown, public IMAPIAdviseSink {
+	public:
+	ECTableAdviseSink(IMAPIAdviseSink *sink, std::shared_ptr<std::atomic<bool>> stale,
+	    std::shared_ptr<std::atomic<bool>> extra_key) :
+		ECUnknown("ECTableAdviseSink"), m_sink(sink), m_stale(std::move(stale)),
+		m_extra_key(std::move(extra_key))
+	{}
+
+	virtual HRESULT QueryInterface(const IID &refiid, void **lppInterface) override
+	{
+		REGISTER_INTERFACE2(IMAPIAdviseSink, this);
+		REGISTER_INTERFACE2(IUnknown, this);
+		return MAPI_E_INTERFACE_NOT_SUPPORTED;
+	}
+
+	virtual ULONG OnNotify(ULONG n, NOTIFICATION *notif) override
+	{
+		*m_stale = true;
+		if (*m_extra_key)
+			for (ULONG i = 0; i < n; ++i) {
+				if (notif[i].ulEventType != fnevTableModified)
+					continue;
+				auto &tab = notif[i].info.tab;
+				if (tab.ulTableEvent == TABLE_ROW_ADDED ||
+				    tab.ulTableEvent == TABLE_ROW_MODIFIED)
+					strip_instance_key(tab.row);
+			}
+		return m_sink->OnNotify(n, notif);
+	}
+
+	private:
+	object_ptr<IMAPIAdviseSink> m_sink;
+	std::shared_ptr<std::atomic<bool>> m_stale, m_extra_key;
+};
+
+}
+
+/* Most rows one QueryRows fetches for sequential readers; 0 turns read-ahead off */
+static ULONG readahead_max()
+{
+	auto s = getenv("KC_TABLE_READAHEAD");
+	return s == nullptr ? 1024 : strtoul(s, nullptr, 0);
+}
+
 ECMAPITable::ECMAPITable(const std::string &strName, ECNotifyClient *nc,
     ULONG f) :
-	ECUnknown("IMAPITable"), lpNotifyClient(nc), m_strName(strName)
+	ECUnknown("IMAPITable"), lpNotifyClient(nc), m_strName(strName),
+	m_raMax(readahead_max()),
+	m_raStale(std::make_shared<std::atomic<bool>>(false)),
+	m_bExtraInstanceKey(std::make_shared<std::atomic<bool>>(false))
 {}
 
+/*
+ * Forgets the rows read ahead and moves the server cursor back to where the
+ * client is: the first unread row that is still in the table, found by its
+ * PR_INSTANCE_KEY, so rows added or deleted meanwhile do not shift it. When
+ * none of them is left, the cursor goes back to where it was, past them.
+ */
+HRESULT ECMAPITable::DropReadAhead()
+{
+	m_raSequential = 0;
+	m_raWindow = 0;
+	*m_raStale = false;
+	/* A reopened table starts at the top again, as without read-ahead */
+	bool reloaded = m_raReload.exchange(false);
+	if (m_raRows == nullptr)
+		return hrSuccess;
+	rowset_ptr rows(m_raRows.release());
+	auto pos = m_raPos;
+	m_raPos = 0;
+	if (reloaded)
+		return hrSuccess;
+	/* Older servers may move the cursor on a FindRow that finds nothing */
+	ULONG count = 0, cur = 0;
+	bool saved = false;
+	for (; pos < rows->cRows; ++pos) {
+		auto key = PCpropFindProp(rows->aRow[pos].lpProps, rows->aRow[pos].cValues, PR_INSTANCE_KEY);
+		if (key == nullptr)
+			continue;
+		SPropValue prop = *key;
+		SRestriction res;
+		res.rt = RES_PROPERTY;
+		res.res.resProperty.relop = RELOP_EQ;
+		res.res.resProperty.ulPropTag = PR_INSTANCE_KEY;
+		res.res.resProperty.lpProp = &prop;
+		if (!saved) {
+			auto hr = lpTableOps->HrGetRowCount(&count, &cur);
+			if (hr != hrSuccess)
+				return hr;
+			saved = true;
+		}
+		++m_ulSeeks;
+		auto hr = lpTableOps->HrFindRow(&res, BOOKMARK_BEGINNING, 0);
+		if (hr != MAPI_E_NOT_FOUND)
+			return hr;
+	}
+	if (saved)
+		return lpTableOps->HrSeekRow(BOOKMARK_BEGINNING, cur, nullptr);
+	return hrSuccess;
+}
+
+void ECMAPITable::StripInstanceKey(SRowSet *rows)
+{
+	if (!*m_bExtraInstanceKey || rows == nullptr)
+		return;
+	for (ULONG i = 0; i < rows->cRows; ++i)
+		strip_instance_key(rows->aRow[i]);
+}
+
 HRESULT ECMAPITable::FlushDeferred(LPSRowSet *lppRowSet)
 {
 	auto hr = lpTableOps->HrOpenTable();
 	if(hr != hrSuccess)
 		return hr;
+	hr = DropReadAhead();
+	if (hr != hrSuccess)
+		return hr;
 	// No deferred calls -> nothing to do
 	if (!IsDeferred())
 		return hrSuccess;
@@ -51,6 +176,11 @@ BOOL ECMAPITable::IsDeferred()
 
 ECMAPITable::~ECMAPITable()
 {
+	if (m_ulQueryRows > 0)
+		ec_log_debug("Table %s: %u QueryRows for %u rows, %u from read-ahead; %u server round trips, %u seeks back",
+			m_strName.c_str(), m_ulQueryRows, m_ulRowsRead, m_ulRowsCached, m_ulFetches, m_ulSeeks);
+	/* Nothing to seek back to when closing */
+	m_raRows.reset();
 	// Remove all advises
 	auto iterMapInt = m_ulConnectionList.cbegin();
 	while (iterMapInt != m_ulConnectionList.cend()) {
@@ -97,7 +227,11 @@ HRESULT ECMAPITable::Advise(ULONG ulEventMask, LPMAPIADVISESINK lpAdviseSink, UL
 	// FIXME: if a reconnection happens in another thread during the following call, the ulTableId sent here will be incorrect. The reconnection
 	// code will not yet know about this connection since we don't insert it until later, so you may end up getting an Advise() on completely the wrong
 	// table.
-	hr = lpNotifyClient->Advise(4, (BYTE *)&lpTableOps->ulTableId, ulEventMask, lpAdviseSink, lpulConnection);
+	object_ptr<IMAPIAdviseSink> sink;
+	hr = alloc_wrap<ECTableAdviseSink>(lpAdviseSink, m_raStale, m_bExtraInstanceKey).put(static_cast<IMAPIAdviseSink **>(&~sink));
+	if (hr != hrSuccess)
+		return hr;
+	hr = lpNotifyClient->Advise(4, (BYTE *)&lpTableOps->ulTableId, ulEventMask, sink, lpulConnection);
 	if(hr != hrSuccess)
 		return hr;
 
@@ -138,12 +272,18 @@ HRESULT ECMAPITable::SetColumns(const SPropTagArray *lpPropTagArray,
 		return MAPI_E_INVALID_PARAMETER;
 
 	scoped_rlock lock(m_hLock);
-	HRESULT hr = MAPIAllocateBuffer(CbNewSPropTagArray(lpPropTagArray->cValues), &~m_lpSetColumns);
+	HRESULT hr = MAPIAllocateBuffer(CbNewSPropTagArray(lpPropTagArray->cValues + 1), &~m_lpSetColumns);
 	if (hr != hrSuccess)
 		return hr;
 
     m_lpSetColumns->cValues = lpPropTagArray->cValues;
     memcpy(&m_lpSetColumns->aulPropTag, &lpPropTagArray->aulPropTag, lpPropTagArray->cValues * sizeof(ULONG));
+	/* Read-ahead finds its place again by the instance key of the rows */
+	*m_bExtraInstanceKey = m_raMax > 0 &&
+		std::find(lpPropTagArray->aulPropTag, lpPropTagArray->aulPropTag + lpPropTagArray->cValues,
+		PR_INSTANCE_KEY) == lpPropTagArray->aulPropTag + lpPropTagArray->cValues;
+	if (*m_bExtraInstanceKey)
+		m_lpSetColumns->aulPropTag[m_lpSetColumns->cValues++] = PR_INSTANCE_KEY;
 	if (!(ulFlags & TBL_BATCH))
 		hr = FlushDeferred();
 	return hr;
@@ -158,7 +298,13 @@ HRESULT ECMAPITable::QueryColumns(ULONG ulFlags, LPSPropTagArray *lppPropTagArra
 	// FIXME if the client has done SetColumns, we can handle this
 	// call locally instead of querying the server (unless TBL_ALL_COLUMNS has been
 	// specified)
-	return lpTableOps->HrQueryColumns(ulFlags, lppPropTagArray);
+	hr = lpTableOps->HrQueryColumns(ulFlags, lppPropTagArray);
+	if (hr != hrSuccess || !*m_bExtraInstanceKey || (ulFlags & TBL_ALL_COLUMNS))
+		return hr;
+	auto cols = *lppPropTagArray;
+	if (cols->cValues > 0 && cols->aulPropTag[cols->cValues-1] == PR_INSTANCE_KEY)
+		--cols->cValues;
+	return hrSuccess;
 }
 
 HRESULT ECMAPITable::GetRowCount(ULONG ulFlags, ULONG *lpulCount)
@@ -319,8 +465,11 @@ HRESULT ECMAPITable::ExpandRow(ULONG cbInstanceKey, LPBYTE pbInstanceKey, ULONG
 	HRESULT hr = FlushDeferred();
 	if(hr != hrSuccess)
 		return hr;
-	return lpTableOps->HrExpandRow(cbInstanceKey, pbInstanceKey,
-	       ulRowCount, ulFlags, lppRows, lpulMoreRows);
+	hr = lpTableOps->HrExpandRow(cbInstanceKey, pbInstanceKey,
+	     ulRowCount, ulFlags, lppRows, lpulMoreRows);
+	if (hr == hrSuccess && lppRows != nullptr)
+		StripInstanceKey(*lppRows);
+	return hr;
 }
 
 HRESULT ECMAPITable::CollapseRow(ULONG cbInstanceKey, LPBYTE pbInstanceKey, ULONG ulFlags, ULONG *lpulRowCount)
@@ -380,15 +529,98 @@ HRESULT ECMAPITable::HrSetTableOps(WSTableView *ops, bool fLoad)
 	return hrSuccess;
 }
 
+/*
+ * Callers that page through a table one QueryRows after the other get more
+ * rows from the server than they asked for, so the next calls need no round
+ * trip. The extra rows start at the size of the request and double with
+ * every fetch, up to KC_TABLE_READAHEAD rows. Any other call on the table,
+ * a notification or a QueryRows that is not a plain forward read drops them.
+ */
 HRESULT ECMAPITable::QueryRows(LONG lRowCount, ULONG ulFlags, LPSRowSet *lppRows)
 {
 	scoped_rlock lock(m_hLock);
-	if (!IsDeferred())
+	++m_ulQueryRows;
+	if (IsDeferred()) {
+		m_ulRowCount = lRowCount;
+		m_ulFlags = ulFlags;
+		++m_ulFetches;
+		auto hr = FlushDeferred(lppRows);
+		if (hr != hrSuccess)
+			return hr;
+		StripInstanceKey(*lppRows);
+		m_ulRowsRead += (*lppRows)->cRows;
+		return hrSuccess;
+	}
+	bool forward = ulFlags == 0 && lRowCount > 0 && m_raMax > 0;
+	if (!forward || m_raStale->load() || m_raReload.load()) {
+		auto hr = DropReadAhead();
+		if (hr != hrSuccess)
+			return hr;
+	}
+	if (!forward) {
 		/* Send the request to the TableOps object, which will send the request to the server. */
-		return lpTableOps->HrQueryRows(lRowCount, ulFlags, lppRows);
-	m_ulRowCount = lRowCount;
-	m_ulFlags = ulFlags;
-	return FlushDeferred(lppRows);
+		++m_ulFetches;
+		auto hr = lpTableOps->HrQueryRows(lRowCount, ulFlags, lppRows);
+		if (hr != hrSuccess)
+			return hr;
+		StripInstanceKey(*lppRows);
+		m_ulRowsRead += (*lppRows)->cRows;
+		return hrSuccess;
+	}
+
+	ULONG want = lRowCount;
+	ULONG cached = m_raRows == nullptr ? 0 : std::min(m_raRows->cRows - m_raPos, want);
+	rowset_ptr fetched;
+	if (cached < want) {
+		/*
+		 * The first read gets what was asked for, later ones read
+		 * ahead if the rows have an instance key to come back to.
+		 */
+		ULONG fetch = want - cached;
+		if (m_raSequential > 0 && m_raKeyed && fetch < m_raMax) {
+			m_raWindow = m_raWindow == 0 ? want : std::min(m_raWindow * 2, m_raMax);
+			fetch = std::min(fetch + m_raWindow, m_raMax);
+		}
+		++m_ulFetches;
+		auto hr = lpTableOps->HrQueryRows(fetch, 0, &~fetched);
+		if (hr != hrSuccess)
+			return hr;
+		m_raKeyed = fetched->cRows > 0 &&
+			PCpropFindProp(fetched->aRow[0].lpProps, fetched->aRow[0].cValues, PR_INSTANCE_KEY) != nullptr;
+	}
+	++m_raSequential;
+
+	ULONG served = fetched == nullptr ? 0 : std::min(fetched->cRows, want - cached);
+	rowset_ptr rows;
+	auto hr = MAPIAllocateBuffer(CbNewSRowSet(cached + served), &~rows);
+	if (hr != hrSuccess)
+		return hr;
+	/* The rows move over; their props are allocated each on their own */
+	rows->cRows = 0;
+	for (ULONG i = 0; i < cached; ++i) {
+		rows->aRow[rows->cRows++] = m_raRows->aRow[m_raPos];
+		m_raRows->aRow[m_raPos].cValues = 0;
+		m_raRows->aRow[m_raPos++].lpProps = nullptr;
+	}
+	for (ULONG i = 0; i < served; ++i) {
+		rows->aRow[rows->cRows++] = fetched->aRow[i];
+		fetched->aRow[i].cValues = 0;
+		fetched->aRow[i].lpProps = nullptr;
+	}
+	if (fetched != nullptr) {
+		/* Whatever was cached has been used up */
+		m_raRows = std::move(fetched);
+		m_raPos = served;
+	}
+	if (m_raRows != nullptr && m_raPos == m_raRows->cRows) {
+		m_raRows.reset();
+		m_raPos = 0;
+	}
+	StripInstanceKey(rows.get());
+	m_ulRowsRead += rows->cRows;
+	m_ulRowsCached += cached;
+	*lppRows = rows.release();
+	return hrSuccess;
 }
 
 HRESULT ECMAPITable::Reload(void *lpParam)
@@ -399,6 +631,7 @@ HRESULT ECMAPITable::Reload(void *lpParam)
 	// will be locked. Since normally m_hLock is locked before SOAP, locking m_hLock *after* SOAP here
 	// would be a lock-order violation causing deadlocks.
 
+	lpThis->m_raReload = true;
 	scoped_rlock lock(lpThis->m_hMutexConnectionList);
 
 	// The underlying data has been reloaded, therefore we must re-register the advises. This is called
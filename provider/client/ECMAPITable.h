@@ -5,6 +5,8 @@
 #ifndef ECMAPITABLE_H
 #define ECMAPITABLE_H
 
+#include <atomic>
+#include <memory>
 #include <mutex>
 #include <kopano/ECUnknown.h>
 #include <kopano/Util.h>
@@ -55,6 +57,9 @@ public:
 	static HRESULT Reload(void *lpParam);
 
 private:
+	HRESULT DropReadAhead();
+	void StripInstanceKey(SRowSet *);
+
 	std::recursive_mutex m_hLock;
 	KC::object_ptr<WSTableView> lpTableOps;
 	KC::object_ptr<ECNotifyClient> lpNotifyClient;
@@ -69,6 +74,24 @@ private:
 	ULONG m_ulDeferredFlags = 0, m_ulRowCount = 0;
 	ULONG m_ulFlags = 0; /* Flags from queryrows */
 	std::string			m_strName;
+
+	/*
+	 * Read-ahead: rows the server sent beyond what QueryRows asked for.
+	 * The server cursor is at the end of m_raRows; the client's is at
+	 * m_raPos. m_raStale is set by the advise sinks on table
+	 * notifications, m_raReload when the table was opened again.
+	 * m_bExtraInstanceKey: SetColumns added PR_INSTANCE_KEY, which is
+	 * taken off the rows (also those of notifications) before they are
+	 * returned.
+	 */
+	KC::rowset_ptr m_raRows;
+	ULONG m_raPos = 0, m_raMax = 0, m_raWindow = 0, m_raSequential = 0;
+	bool m_raKeyed = false;
+	std::shared_ptr<std::atomic<bool>> m_raStale, m_bExtraInstanceKey;
+	std::atomic<bool> m_raReload{false};
+	/* QueryRows calls, rows returned, of which from the read-ahead, round trips */
+	unsigned int m_ulQueryRows = 0, m_ulRowsRead = 0, m_ulRowsCached = 0;
+	unsigned int m_ulFetches = 0, m_ulSeeks = 0;
 	ALLOC_WRAP_FRIEND;
 };
 
@@ -2423,6 +2423,18 @@ HRESULT ECMsgStore::ResetFolderCount(ULONG cbEntryId, const ENTRYID *lpEntryId,
 	return lpTransport->HrResetFolderCount(cbEntryId, lpEntryId, lpulUpdates);
 }
 
+HRESULT ECMsgStore::DeliverCopies(ULONG cbEntryId, const ENTRYID *lpEntryId,
+    const ENTRYLIST *lpFolders, ULONG cValues, const SPropValue *lpProps,
+    const SPropTagArray *lpDelProps, ULONG ulFlags, ENTRYLIST **lppCopies)
+{
+	if (lpEntryId == nullptr || lpFolders == nullptr || lppCopies == nullptr ||
+	    (cValues > 0 && lpProps == nullptr) ||
+	    ((ulFlags & MESSAGE_MOVE) && lpFolders->cValues != 1))
+		return MAPI_E_INVALID_PARAMETER;
+	return lpTransport->HrDeliverCopies(cbEntryId, lpEntryId, lpFolders,
+	       cValues, lpProps, lpDelProps, ulFlags, lppCopies);
+}
+
 // This is almost the same as getting a 'normal' outgoing table, except we pass NULL as PEID for the store
 HRESULT ECMsgStore::GetMasterOutgoingTable(ULONG ulFlags, IMAPITable ** lppOutgoingTable)
 {
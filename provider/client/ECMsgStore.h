@@ -126,6 +126,7 @@ public:
 	virtual HRESULT ResolvePseudoUrl(const char *url, char **pathp, bool *ispeer) override;
 	virtual HRESULT GetArchiveStoreEntryID(const TCHAR *user, const TCHAR *server, ULONG flags, ULONG *store_size, ENTRYID **store_eid) override;
 	virtual HRESULT ResetFolderCount(ULONG eid_size, const ENTRYID *eid, ULONG *nupdates) override;
+	virtual HRESULT DeliverCopies(ULONG eid_size, const ENTRYID *eid, const ENTRYLIST *folders, ULONG nprops, const SPropValue *props, const SPropTagArray *delprops, ULONG flags, ENTRYLIST **copies) override;
 	virtual HRESULT UnwrapNoRef(void **obj) override;
 
 	// ECMultiStoreTable
@@ -3534,6 +3534,41 @@ HRESULT WSTransport::HrGetServerDetails(ECSVRNAMELIST *lpServerNameList,
 	return hr;
 }
 
+static HRESULT CopySOAPChangesToICSChanges(const struct icsChangesArray &sChanges,
+    ICSCHANGE **lppChanges)
+{
+	ecmem_ptr<ICSCHANGE> lpChanges;
+	auto hr = ECAllocateBuffer(sChanges.__size * sizeof(ICSCHANGE), &~lpChanges);
+	if (hr != hrSuccess)
+		return hr;
+
+	for (gsoap_size_t i = 0; i < sChanges.__size; ++i) {
+		lpChanges[i].ulChangeId = sChanges.__ptr[i].ulChangeId;
+		lpChanges[i].ulChangeType = sChanges.__ptr[i].ulChangeType;
+		lpChanges[i].ulFlags = sChanges.__ptr[i].ulFlags;
+
+		if(sChanges.__ptr[i].sSourceKey.__size > 0) {
+			hr = ECAllocateMore(sChanges.__ptr[i].sSourceKey.__size,
+			     lpChanges, reinterpret_cast<void **>(&lpChanges[i].sSourceKey.lpb));
+			if (hr != hrSuccess)
+				return hr;
+			lpChanges[i].sSourceKey.cb = sChanges.__ptr[i].sSourceKey.__size;
+			memcpy(lpChanges[i].sSourceKey.lpb, sChanges.__ptr[i].sSourceKey.__ptr, sChanges.__ptr[i].sSourceKey.__size);
+		}
+
+		if(sChanges.__ptr[i].sParentSourceKey.__size > 0) {
+			hr = ECAllocateMore(sChanges.__ptr[i].sParentSourceKey.__size,
+			     lpChanges, reinterpret_cast<void **>(&lpChanges[i].sParentSourceKey.lpb));
+			if (hr != hrSuccess)
+				return hr;
+			lpChanges[i].sParentSourceKey.cb = sChanges.__ptr[i].sParentSourceKey.__size;
+			memcpy(lpChanges[i].sParentSourceKey.lpb, sChanges.__ptr[i].sParentSourceKey.__ptr, sChanges.__ptr[i].sParentSourceKey.__size);
+		}
+	}
+	*lppChanges = lpChanges.release();
+	return hrSuccess;
+}
+
 HRESULT WSTransport::HrGetChanges(const std::string &sourcekey, ULONG ulSyncId,
     ULONG ulChangeId, ULONG ulSyncType, ULONG ulFlags,
     const SRestriction *lpsRestrict, ULONG *lpulMaxChangeId, ULONG *lpcChanges,
@@ -3542,7 +3577,6 @@ HRESULT WSTransport::HrGetChanges(const std::string &sourcekey, ULONG ulSyncId,
 	HRESULT						hr = hrSuccess;
 	ECRESULT					er = erSuccess;
 	struct icsChangeResponse	sResponse;
-	ecmem_ptr<ICSCHANGE> lpChanges;
 	struct xsd__base64Binary	sSourceKey;
 	struct restrictTable		*lpsSoapRestrict = NULL;
 
@@ -3565,41 +3599,66 @@ HRESULT WSTransport::HrGetChanges(const std::string &sourcekey, ULONG ulSyncId,
 	}
 	END_SOAP_CALL
 
-	er = ECAllocateBuffer(sResponse.sChangesArray.__size * sizeof(ICSCHANGE), &~lpChanges);
-	if (er != erSuccess)
+	hr = CopySOAPChangesToICSChanges(sResponse.sChangesArray, lppChanges);
+	if (hr != hrSuccess)
 		goto exitm;
+	*lpulMaxChangeId = sResponse.ulMaxChangeId;
+	*lpcChanges = sResponse.sChangesArray.__size;
+ exitm:
+	spg.unlock();
+	if(lpsSoapRestrict)
+	    FreeRestrictTable(lpsSoapRestrict);
+	return hr;
+}
 
-	for (gsoap_size_t i = 0; i < sResponse.sChangesArray.__size; ++i) {
-		lpChanges[i].ulChangeId = sResponse.sChangesArray.__ptr[i].ulChangeId;
-		lpChanges[i].ulChangeType = sResponse.sChangesArray.__ptr[i].ulChangeType;
-		lpChanges[i].ulFlags = sResponse.sChangesArray.__ptr[i].ulFlags;
+/**
+ * Get one page of at most @page_size changes. Start with @lpulCursor and
+ * @lpulMaxChangeId pointing to 0. On return, they hold the continuation
+ * token for the next page; *@lpulCursor is 0 after the last page.
+ * Requires KOPANO_CAP_PAGED_ICS.
+ */
+HRESULT WSTransport::HrGetChangesPage(const std::string &sourcekey,
+    ULONG ulSyncId, ULONG ulChangeId, ULONG ulSyncType, ULONG ulFlags,
+    const SRestriction *lpsRestrict, ULONG page_size, ULONG *lpulCursor,
+    ULONG *lpulMaxChangeId, ULONG *lpcChanges, ICSCHANGE **lppChanges)
+{
+	HRESULT						hr = hrSuccess;
+	ECRESULT					er = erSuccess;
+	struct icsChangePageResponse sResponse;
+	struct xsd__base64Binary	sSourceKey;
+	struct restrictTable		*lpsSoapRestrict = NULL;
 
-		if(sResponse.sChangesArray.__ptr[i].sSourceKey.__size > 0) {
-			er = ECAllocateMore(sResponse.sChangesArray.__ptr[i].sSourceKey.__size,
-			     lpChanges, reinterpret_cast<void **>(&lpChanges[i].sSourceKey.lpb));
-			if (er != erSuccess)
-				goto exitm;
-			lpChanges[i].sSourceKey.cb = sResponse.sChangesArray.__ptr[i].sSourceKey.__size;
-			memcpy(lpChanges[i].sSourceKey.lpb, sResponse.sChangesArray.__ptr[i].sSourceKey.__ptr, sResponse.sChangesArray.__ptr[i].sSourceKey.__size);
-		}
+	sSourceKey.__ptr = (unsigned char *)sourcekey.c_str();
+	sSourceKey.__size = sourcekey.size();
 
-		if(sResponse.sChangesArray.__ptr[i].sParentSourceKey.__size > 0) {
-			er = ECAllocateMore( sResponse.sChangesArray.__ptr[i].sParentSourceKey.__size,
-			     lpChanges, reinterpret_cast<void **>(&lpChanges[i].sParentSourceKey.lpb));
-			if (er != erSuccess)
-				goto exitm;
-			lpChanges[i].sParentSourceKey.cb = sResponse.sChangesArray.__ptr[i].sParentSourceKey.__size;
-			memcpy(lpChanges[i].sParentSourceKey.lpb, sResponse.sChangesArray.__ptr[i].sParentSourceKey.__ptr, sResponse.sChangesArray.__ptr[i].sParentSourceKey.__size);
-		}
+	soap_lock_guard spg(*this);
+	if(lpsRestrict) {
+		hr = CopyMAPIRestrictionToSOAPRestriction(&lpsSoapRestrict, lpsRestrict);
+		if(hr != hrSuccess)
+			goto exitm;
+	}
+
+	START_SOAP_CALL
+	{
+		if (m_lpCmd->getChangesPage(m_ecSessionId, sSourceKey, ulSyncId,
+		    ulChangeId, ulSyncType, ulFlags, lpsSoapRestrict, *lpulCursor,
+		    *lpulMaxChangeId, page_size, &sResponse) != SOAP_OK)
+			er = KCERR_NETWORK_ERROR;
+		else
+			er = sResponse.er;
 	}
+	END_SOAP_CALL
 
+	hr = CopySOAPChangesToICSChanges(sResponse.sChangesArray, lppChanges);
+	if (hr != hrSuccess)
+		goto exitm;
+	*lpulCursor = sResponse.ulNextCursor;
 	*lpulMaxChangeId = sResponse.ulMaxChangeId;
 	*lpcChanges = sResponse.sChangesArray.__size;
-	*lppChanges = lpChanges.release();
  exitm:
 	spg.unlock();
 	if(lpsSoapRestrict)
-	    FreeRestrictTable(lpsSoapRestrict);
+		FreeRestrictTable(lpsSoapRestrict);
 	return hr;
 }
 
@@ -4018,3 +4077,68 @@ HRESULT WSTransport::HrResetFolderCount(ULONG cbEntryId,
  exitm:
 	return hr;
 }
+
+/**
+ * Have the server copy one message into a number of folders, removing
+ * @lpDelProps from and setting @lpProps on every copy before it becomes
+ * visible. With MESSAGE_MOVE in @ulFlags, the message is moved into the
+ * one folder of @lpFolders instead. Requires KOPANO_CAP_DELIVER_COPIES.
+ *
+ * @lppCopies receives one entry ID per folder, in the order of @lpFolders;
+ * copies that failed have an empty entry ID and the call then returns
+ * MAPI_W_PARTIAL_COMPLETION.
+ */
+HRESULT WSTransport::HrDeliverCopies(ULONG cbEntryId, const ENTRYID *lpEntryId,
+    const ENTRYLIST *lpFolders, ULONG cValues, const SPropValue *lpProps,
+    const SPropTagArray *lpDelProps, ULONG ulFlags, ENTRYLIST **lppCopies)
+{
+	if ((m_ulServerCapabilities & KOPANO_CAP_DELIVER_COPIES) == 0)
+		return MAPI_E_NO_SUPPORT;
+
+	HRESULT hr = hrSuccess;
+	ECRESULT er = erSuccess;
+	entryId eidMessage;
+	struct entryList sFolders;
+	struct propValArray sProps = {nullptr, 0};
+	struct propTagArray sDelProps = {nullptr, 0};
+	SRow sRow = {0, cValues, const_cast<SPropValue *>(lpProps)};
+	deliverCopiesResponse sResponse;
+	soap_lock_guard spg(*this);
+
+	hr = CopyMAPIEntryIdToSOAPEntryId(cbEntryId, lpEntryId, &eidMessage, true);
+	if (hr != hrSuccess)
+		goto exitm;
+	hr = CopyMAPIEntryListToSOAPEntryList(lpFolders, &sFolders);
+	if (hr != hrSuccess)
+		goto exitm;
+	if (cValues > 0) {
+		hr = CopyMAPIRowToSOAPRow(&sRow, &sProps);
+		if (hr != hrSuccess)
+			goto exitm;
+	}
+	if (lpDelProps != nullptr) {
+		sDelProps.__size = lpDelProps->cValues;
+		sDelProps.__ptr = const_cast<unsigned int *>(lpDelProps->aulPropTag);
+	}
+
+	START_SOAP_CALL
+	{
+		if (m_lpCmd->deliverCopies(m_ecSessionId, eidMessage, &sFolders,
+		    &sProps, &sDelProps, ulFlags, &sResponse) != SOAP_OK)
+			er = KCERR_NETWORK_ERROR;
+		else if (sResponse.er == KCWARN_PARTIAL_COMPLETION)
+			/* The list of copies is still valid */
+			er = erSuccess;
+		else
+			er = sResponse.er;
+	}
+	END_SOAP_CALL
+
+	hr = CopySOAPEntryListToMAPIEntryList(&sResponse.sEntryIds, lppCopies);
+	if (hr == hrSuccess && sResponse.er == KCWARN_PARTIAL_COMPLETION)
+		hr = MAPI_W_PARTIAL_COMPLETION;
+ exitm:
+	FreeEntryList(&sFolders, false);
+	FreePropValArray(&sProps, false);
+	return hr;
+}
@@ -205,6 +205,7 @@ public:
 
 	// Incremental Change Synchronization
 	virtual HRESULT HrGetChanges(const std::string &sourcekey, ULONG sync_id, ULONG change_id, ULONG sync_type, ULONG flags, const SRestriction *, ULONG *max_change, ULONG *nchanges, ICSCHANGE **);
+	virtual HRESULT HrGetChangesPage(const std::string &sourcekey, ULONG sync_id, ULONG change_id, ULONG sync_type, ULONG flags, const SRestriction *, ULONG page_size, ULONG *cursor, ULONG *max_change, ULONG *nchanges, ICSCHANGE **);
 	virtual HRESULT HrSetSyncStatus(const std::string& sourcekey, ULONG ulSyncId, ULONG ulChangeId, ULONG ulSyncType, ULONG ulFlags, ULONG* lpulSyncId);
 	virtual HRESULT HrEntryIDFromSourceKey(ULONG seid_size, const ENTRYID *store, ULONG fsk_size, BYTE *folder_sk, ULONG msk_size, BYTE *msg_sk, ULONG *eid_size, ENTRYID **eid);
 	virtual HRESULT HrGetSyncStates(const ECLISTSYNCID &lstSyncId, ECLISTSYNCSTATE *lplstSyncState);
@@ -248,6 +249,7 @@ public:
 	virtual HRESULT HrCancelIO();
 
 	virtual HRESULT HrResetFolderCount(ULONG eid_size, const ENTRYID *eid, ULONG *nupdates);
+	virtual HRESULT HrDeliverCopies(ULONG eid_size, const ENTRYID *eid, const ENTRYLIST *folders, ULONG nprops, const SPropValue *props, const SPropTagArray *delprops, ULONG flags, ENTRYLIST **copies);
 
 	std::string m_server_version;
 
@@ -322,9 +322,13 @@ typedef EID * PEID;
  * returned from the getIDsForNames RPC.
  */
 #define KOPANO_CAP_GIFN32 0x8000
+// Server has the getChangesPage RPC
+#define KOPANO_CAP_PAGED_ICS			0x10000
+// Server has the deliverCopies RPC
+#define KOPANO_CAP_DELIVER_COPIES		0x20000
 
 // Do *not* use this from a client. This is just what the latest server supports.
-#define KOPANO_LATEST_CAPABILITIES (KOPANO_CAP_CRYPT | KOPANO_CAP_LICENSE_SERVER | KOPANO_CAP_LOADPROP_ENTRYID | KOPANO_CAP_EXPORT_PROPTAG | KOPANO_CAP_IMPERSONATION | KOPANO_CAP_GIFN32)
+#define KOPANO_LATEST_CAPABILITIES (KOPANO_CAP_CRYPT | KOPANO_CAP_LICENSE_SERVER | KOPANO_CAP_LOADPROP_ENTRYID | KOPANO_CAP_EXPORT_PROPTAG | KOPANO_CAP_IMPERSONATION | KOPANO_CAP_GIFN32 | KOPANO_CAP_PAGED_ICS | KOPANO_CAP_DELIVER_COPIES)
 
 //
 // Logon flags, sent with ns__logon()
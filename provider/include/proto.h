@@ -808,6 +808,13 @@ struct ns:icsChangeResponse {
 	unsigned int er;
 };
 
+struct ns:icsChangePageResponse {
+	struct icsChangesArray sChangesArray;
+	unsigned int ulMaxChangeId;
+	unsigned int ulNextCursor; /* 0 after the last page */
+	unsigned int er;
+};
+
 struct ns:setSyncStatusResponse {
 	unsigned int ulSyncId;
 	unsigned int er;
@@ -920,6 +927,11 @@ struct ns:resetFolderCountResponse {
 	unsigned int er;
 };
 
+struct ns:deliverCopiesResponse {
+	struct entryList sEntryIds;
+	unsigned int er;
+};
+
 //TableType flags for function ns__tableOpen
 #define TABLETYPE_MS				1	// MessageStore tables
 #define TABLETYPE_AB				2	// Addressbook tables
@@ -1081,6 +1093,8 @@ int ns__setLockState(ULONG64 ulSessionId, entryId sEntryId, bool bLocked, unsign
 
 int ns__resetFolderCount(ULONG64 ulSessionId, entryId sEntryId, struct ns:resetFolderCountResponse *lpsResponse);
 
+int ns__deliverCopies(ULONG64 ulSessionId, entryId sEntryId, struct entryList *lpsFolders, struct propValArray *lpsProps, struct propTagArray *lpsDelProps, unsigned int ulFlags, struct ns:deliverCopiesResponse *lpsResponse);
+
 // Quota
 int ns__GetQuota(ULONG64 ulSessionId, unsigned int ulUserid, entryId sUserId, bool bGetUserDefault, struct ns:quotaResponse* lpsQuota);
 int ns__SetQuota(ULONG64 ulSessionId, unsigned int ulUserid, entryId sUserId, struct quota* lpsQuota, unsigned int *result);
@@ -1091,6 +1105,7 @@ int ns__GetQuotaStatus(ULONG64 ulSessionId, unsigned int ulUserid, entryId sUser
 
 // Incremental Change Synchronization
 int ns__getChanges(ULONG64 ulSessionId, struct xsd__base64Binary sSourceKeyFolder, unsigned int ulSyncId, unsigned int ulChangeId, unsigned int ulChangeType, unsigned int ulFlags, struct restrictTable *lpsRestrict, struct ns:icsChangeResponse* lpsChanges);
+int ns__getChangesPage(ULONG64 ulSessionId, struct xsd__base64Binary sSourceKeyFolder, unsigned int ulSyncId, unsigned int ulChangeId, unsigned int ulChangeType, unsigned int ulFlags, struct restrictTable *lpsRestrict, unsigned int ulCursor, unsigned int ulCursorMaxChangeId, unsigned int ulPageSize, struct ns:icsChangePageResponse *lpsChanges);
 int ns__setSyncStatus(ULONG64 ulSessionId, struct xsd__base64Binary sSourceKeyFolder, unsigned int ulSyncId, unsigned int ulChangeId, unsigned int ulChangeType, unsigned int ulFlags, struct ns:setSyncStatusResponse *lpsResponse);
 
 int ns__getEntryIDFromSourceKey(ULONG64 ulSessionId, entryId sStoreId, struct xsd__base64Binary folderSourceKey, struct xsd__base64Binary messageSourceKey, struct ns:getEntryIDFromSourceKeyResponse *lpsResponse);
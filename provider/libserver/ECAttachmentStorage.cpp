@@ -1281,6 +1281,34 @@ ECRESULT ECFileAttachment::LoadAttachmentInstance(struct soap *soap,
 			ec_log_warn("gzbuffer failed");
 #endif
 
+		/*
+		 * The gzip trailer normally holds the exact uncompressed size;
+		 * decompress straight into the reply buffer then. Only when
+		 * that does not add up, fall back to growing a temporary
+		 * buffer.
+		 */
+		size_t hint = 0;
+		if (GetSizeInstance(ulInstanceId, &hint, nullptr) == erSuccess &&
+		    hint > 0 && hint < attachment_size_safety_limit)
+			lpData = s_alloc_nothrow<unsigned char>(soap, hint);
+		if (lpData != nullptr) {
+			char probe;
+			auto ret = gzread_retry(gzfp, lpData, hint);
+			if (ret >= 0 && static_cast<size_t>(ret) == hint &&
+			    gzread_retry(gzfp, &probe, 1) == 0) {
+				*lpiSize = hint;
+				*lppData = lpData;
+				goto exit;
+			}
+			s_free(soap, lpData);
+			lpData = nullptr;
+			if (gzrewind(gzfp) != 0) {
+				ec_log_err("ECFileAttachment::LoadAttachmentInstance(SOAP): cannot rewind \"%s\"", filename.c_str());
+				er = KCERR_DATABASE_ERROR;
+				goto exit;
+			}
+		}
+
 		size_t memory_block_size = 0;
 
 		for(;;)
@@ -1464,8 +1492,9 @@ ECRESULT ECFileAttachment::LoadAttachmentInstance(const ext_siid &ulInstanceId,
 			if (lReadNow == 0)
 				break;
 
-			lpSink->Write(buffer, 1, lReadNow);
-
+			er = lpSink->Write(buffer, 1, lReadNow);
+			if (er != erSuccess)
+				goto exit;
 			*lpiSize += lReadNow;
 		}
 
@@ -1484,8 +1513,9 @@ ECRESULT ECFileAttachment::LoadAttachmentInstance(const ext_siid &ulInstanceId,
 			if (lReadNow == 0)
 				break;
 
-			lpSink->Write(buffer, 1, lReadNow);
-
+			er = lpSink->Write(buffer, 1, lReadNow);
+			if (er != erSuccess)
+				goto exit;
 			*lpiSize += lReadNow;
 		}
 	}
@@ -2442,7 +2472,11 @@ ECRESULT ECFileAttachment2::LoadAttachmentInstance(const ext_siid &instance,
 		} else if (rd == 0) {
 			break;
 		}
-		sink->Write(buffer, 1, rd);
+		auto er = sink->Write(buffer, 1, rd);
+		if (er != erSuccess) {
+			close(fd);
+			return er;
+		}
 		*dsize += rd;
 	}
 	close(fd);
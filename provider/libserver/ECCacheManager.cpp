@@ -143,21 +143,17 @@ ECRESULT ECCacheManager::PurgeCache(unsigned int ulFlags)
 		m_AclCache.ClearCache();
 	l_cache.unlock();
 
-	ulock_rec l_object(m_hCacheObjectMutex);
 	if (ulFlags & PURGE_CACHE_OBJECTS)
 		m_ObjectsCache.ClearCache();
-	l_object.unlock();
 
 	ulock_rec l_store(m_hCacheStoreMutex);
 	if (ulFlags & PURGE_CACHE_STORES)
 		m_StoresCache.ClearCache();
 	l_store.unlock();
 
-	// Cell cache mutex
-	ulock_rec l_cells(m_hCacheCellsMutex);
+	// Cell cache shards lock themselves
 	if(ulFlags & PURGE_CACHE_CELL)
 		m_CellCache.ClearCache();
-	l_cells.unlock();
 
 	// Indexed properties mutex
 	ulock_rec l_prop(m_hCacheIndPropMutex);
@@ -241,9 +237,10 @@ ECRESULT ECCacheManager::I_GetObject(unsigned int ulObjId,
     unsigned int *ulType)
 {
 	ECsObjects	*sObject;
-	scoped_rlock lock(m_hCacheObjectMutex);
+	auto &shard = m_ObjectsCache.get(ulObjId);
+	scoped_rlock lock(shard.mtx);
 
-	auto er = m_ObjectsCache.GetCacheItem(ulObjId, &sObject);
+	auto er = shard.cache.GetCacheItem(ulObjId, &sObject);
 	if(er != erSuccess)
 		return er;
 	assert(sObject->ulType == MAPI_FOLDER || (sObject->ulFlags & ~(MSGFLAG_ASSOCIATED | MSGFLAG_DELETED)) == 0);
@@ -273,16 +270,18 @@ ECRESULT ECCacheManager::SetObject(unsigned int ulObjId, unsigned int ulParent,
 	sObjects.ulFlags	= ulFlags;
 	sObjects.ulType		= ulType;
 
-	scoped_rlock lock(m_hCacheObjectMutex);
-	auto er = m_ObjectsCache.AddCacheItem(ulObjId, std::move(sObjects));
+	auto &shard = m_ObjectsCache.get(ulObjId);
+	scoped_rlock lock(shard.mtx);
+	auto er = shard.cache.AddCacheItem(ulObjId, std::move(sObjects));
 	LOG_CACHE_DEBUG("Set cache object id %d, parent %d, owner %d, flags %d, type %d", ulObjId, ulParent, ulOwner, ulFlags, ulType);
 	return er;
 }
 
 ECRESULT ECCacheManager::I_DelObject(unsigned int ulObjId)
 {
-	scoped_rlock lock(m_hCacheObjectMutex);
-	return m_ObjectsCache.RemoveCacheItem(ulObjId);
+	auto &shard = m_ObjectsCache.get(ulObjId);
+	scoped_rlock lock(shard.mtx);
+	return shard.cache.RemoveCacheItem(ulObjId);
 }
 
 ECRESULT ECCacheManager::I_GetStore(unsigned int ulObjId, unsigned int *ulStore,
@@ -439,16 +438,15 @@ ECRESULT ECCacheManager::GetObjects(const std::list<sObjectTableKey> &lstObjects
 	if(er != erSuccess)
 		goto exit;
 
-    {
-        // Get everything from the cache that we can
-       scoped_rlock lock(m_hCacheObjectMutex);
-
-	for (const auto &key : lstObjects)
-		if (m_ObjectsCache.GetCacheItem(key.ulObjId, &lpsObject) == erSuccess)
+	// Get everything from the cache that we can
+	for (const auto &key : lstObjects) {
+		auto &shard = m_ObjectsCache.get(key.ulObjId);
+		scoped_rlock lock(shard.mtx);
+		if (shard.cache.GetCacheItem(key.ulObjId, &lpsObject) == erSuccess)
 			mapObjects[key] = *lpsObject;
 		else
 			setUncached.emplace(key);
-    }
+	}
     if(!setUncached.empty()) {
         // Get uncached items from SQL
 		auto strQuery = "SELECT id, parent, owner, flags, type FROM hierarchy WHERE id IN(" +
@@ -1172,13 +1170,8 @@ void ECCacheManager::update_extra_stats(ECStatsCollector &sc)
 	f(m_StoresCache.get_stats());
 	l_store.unlock();
 
-	ulock_rec l_object(m_hCacheObjectMutex);
 	f(m_ObjectsCache.get_stats());
-	l_object.unlock();
-
-	ulock_rec l_cell(m_hCacheCellsMutex);
 	f(m_CellCache.get_stats());
-	l_cell.unlock();
 
 	ulock_rec l_prop(m_hCacheIndPropMutex);
 	f(m_PropToObjectCache.get_stats());
@@ -1197,14 +1190,15 @@ ECRESULT ECCacheManager::GetCell(const sObjectTableKey *lpsRowItem,
 {
     ECRESULT er = erSuccess;
     ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto &shard = m_CellCache.get(lpsRowItem->ulObjId);
+	scoped_rlock lock(shard.mtx);
 
     if (m_bCellCacheDisabled) {
         er = KCERR_NOT_FOUND;
         goto exit;
     }
 	/* ignoring orderId for now */
-	er = m_CellCache.GetCacheItem(lpsRowItem->ulObjId, &sCell);
+	er = shard.cache.GetCacheItem(lpsRowItem->ulObjId, &sCell);
 	if(er != erSuccess)
 	    goto exit;
 
@@ -1213,7 +1207,7 @@ ECRESULT ECCacheManager::GetCell(const sObjectTableKey *lpsRowItem,
             // Object is not complete, and item is not in cache. We simply don't know anything about
             // the item, so return NOT_FOUND. Or, the item is complete but the requested property is computed, and therefore
             // not in the cache.
-			m_CellCache.DecrementValidCount();
+			shard.cache.DecrementValidCount();
             er = KCERR_NOT_FOUND;
         } else {
             // Object is complete and property is not found; we know that the property does not exist
@@ -1237,19 +1231,20 @@ ECRESULT ECCacheManager::SetCell(const sObjectTableKey *lpsRowItem,
     ECRESULT er = erSuccess;
     ECsCells *sCell;
 	/* ignoring orderId for now */
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto &shard = m_CellCache.get(lpsRowItem->ulObjId);
+	scoped_rlock lock(shard.mtx);
 
-	if (m_CellCache.GetCacheItem(lpsRowItem->ulObjId, &sCell) == erSuccess) {
+	if (shard.cache.GetCacheItem(lpsRowItem->ulObjId, &sCell) == erSuccess) {
         long long ulSize = sCell->GetSize();
         sCell->AddPropVal(ulPropTag, lpSrc);
         ulSize -= sCell->GetSize();
         // ulSize is positive if the cache shrank
         //m_ulCellSize -= ulSize;
-		m_CellCache.AddToSize(-ulSize);
+		shard.cache.AddToSize(-ulSize);
     } else {
         ECsCells sNewCell;
         sNewCell.AddPropVal(ulPropTag, lpSrc);
-		er = m_CellCache.AddCacheItem(lpsRowItem->ulObjId, std::move(sNewCell));
+		er = shard.cache.AddCacheItem(lpsRowItem->ulObjId, std::move(sNewCell));
     }
 	if (er != erSuccess)
 		LOG_CELLCACHE_DEBUG("Set cell object %d tag 0x%08X error 0x%08X", lpsRowItem->ulObjId, ulPropTag, er);
@@ -1262,9 +1257,10 @@ ECRESULT ECCacheManager::SetComplete(unsigned int ulObjId)
 {
     ECRESULT er = erSuccess;
     ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto &shard = m_CellCache.get(ulObjId);
+	scoped_rlock lock(shard.mtx);
 
-	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess)
+	if (shard.cache.GetCacheItem(ulObjId, &sCell) == erSuccess)
 		sCell->SetComplete(true);
 	else
 		er = KCERR_NOT_FOUND;
@@ -1279,9 +1275,10 @@ ECRESULT ECCacheManager::GetComplete(unsigned int ulObjId, bool &complete)
 {
 	ECRESULT er = erSuccess;
 	ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto &shard = m_CellCache.get(ulObjId);
+	scoped_rlock lock(shard.mtx);
 
-	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess)
+	if (shard.cache.GetCacheItem(ulObjId, &sCell) == erSuccess)
 		complete = sCell->GetComplete();
 	else
 		er = KCERR_NOT_FOUND;
@@ -1296,9 +1293,10 @@ ECRESULT ECCacheManager::GetPropTags(unsigned int ulObjId, std::vector<unsigned
 {
 	ECRESULT er = erSuccess;
 	ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto &shard = m_CellCache.get(ulObjId);
+	scoped_rlock lock(shard.mtx);
 
-	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess)
+	if (shard.cache.GetCacheItem(ulObjId, &sCell) == erSuccess)
 		proptags = sCell->GetPropTags();
 	else
 		er = KCERR_NOT_FOUND;
@@ -1313,9 +1311,10 @@ ECRESULT ECCacheManager::UpdateCell(unsigned int ulObjId, unsigned int ulPropTag
 {
     ECRESULT er = erSuccess;
     ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto &shard = m_CellCache.get(ulObjId);
+	scoped_rlock lock(shard.mtx);
 
-	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess)
+	if (shard.cache.GetCacheItem(ulObjId, &sCell) == erSuccess)
 		sCell->UpdatePropVal(ulPropTag, lDelta);
 	else
 		er = KCERR_NOT_FOUND;
@@ -1330,9 +1329,10 @@ ECRESULT ECCacheManager::UpdateCell(unsigned int ulObjId, unsigned int ulPropTag
 {
     ECRESULT er = erSuccess;
     ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto &shard = m_CellCache.get(ulObjId);
+	scoped_rlock lock(shard.mtx);
 
-	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess)
+	if (shard.cache.GetCacheItem(ulObjId, &sCell) == erSuccess)
 		sCell->UpdatePropVal(ulPropTag, ulMask, ulValue);
 	else
 		er = KCERR_NOT_FOUND;
@@ -1345,8 +1345,9 @@ ECRESULT ECCacheManager::UpdateCell(unsigned int ulObjId, unsigned int ulPropTag
 
 ECRESULT ECCacheManager::I_DelCell(unsigned int ulObjId)
 {
-	scoped_rlock lock(m_hCacheCellsMutex);
-	return m_CellCache.RemoveCacheItem(ulObjId);
+	auto &shard = m_CellCache.get(ulObjId);
+	scoped_rlock lock(shard.mtx);
+	return shard.cache.RemoveCacheItem(ulObjId);
 }
 
 ECRESULT ECCacheManager::GetServerDetails(const std::string &strServerId, serverdetails_t *lpsDetails)
@@ -339,8 +339,6 @@ private:
 	ECDatabaseFactory*	m_lpDatabaseFactory;
 	std::recursive_mutex m_hCacheMutex; /* User, ACL, server cache */
 	std::recursive_mutex m_hCacheStoreMutex;
-	std::recursive_mutex m_hCacheObjectMutex;
-	std::recursive_mutex m_hCacheCellsMutex; /* Cell cache */
 	std::recursive_mutex m_hCacheIndPropMutex; /* Indexed properties cache */
 	// Quota cache, to reduce the impact of the user plugin
 	// m_mapQuota contains user and company cache, except when it's the company user default quota
@@ -348,8 +346,8 @@ private:
 	// this can't be in the same map, since the id is the same for "company" and "company user default"
 	ECCache<ECMapQuota>			m_QuotaCache;
 	ECCache<ECMapQuota>			m_QuotaUserDefaultCache;
-	// Object cache, (hierarchy table)
-	ECCache<std::unordered_map<unsigned int, ECsObjects>> m_ObjectsCache;
+	// Object cache, (hierarchy table); sharded, each shard has its own lock
+	ECShardedCache<std::unordered_map<unsigned int, ECsObjects>> m_ObjectsCache;
 	// Store cache
 	ECCache<std::unordered_map<unsigned int, ECsStores>> m_StoresCache;
 	// User cache
@@ -358,8 +356,8 @@ private:
 	ECCache<std::unordered_map<unsigned int, ECsUserObjectDetails>>	m_UserObjectDetailsCache; /* userid to user obejct data */
 	// ACL cache
 	ECCache<std::unordered_map<unsigned int, ECsACLs>> m_AclCache;
-	// Cell cache, include the column data of a loaded table
-	ECCache<std::unordered_map<unsigned int, ECsCells>> m_CellCache;
+	// Cell cache, include the column data of a loaded table; sharded like m_ObjectsCache
+	ECShardedCache<std::unordered_map<unsigned int, ECsCells>> m_CellCache;
 	// Server cache
 	ECCache<std::map<std::string, ECsServerDetails>> m_ServerDetailsCache;
 	//Index properties
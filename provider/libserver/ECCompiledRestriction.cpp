@@ -0,0 +1,776 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016, Kopano and its licensors
+ */
+#include <kopano/platform.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <string_view>
+#include <utility>
+#include <mapidefs.h>
+#include <mapitags.h>
+#include <kopano/mapiext.h>
+#include <kopano/stringutil.h>
+#include "ECCompiledRestriction.h"
+#include "ECCacheManager.h"
+#include "SOAPUtils.h"
+
+namespace KC {
+
+enum {
+	OP_CONST, OP_ERROR, OP_AND, OP_OR, OP_NOT, OP_CONTENT, OP_PROPERTY,
+	OP_PROP_LONG, OP_PROP_STRING, OP_PROP_MV, OP_ANR, OP_REGEX,
+	OP_COMPARE, OP_BITMASK, OP_SIZE, OP_EXIST, OP_SUB,
+};
+
+static const unsigned int NO_INDEX = UINT_MAX;
+
+/* Same set as in ECGenericObjectTable.cpp */
+static const ULONG sANRProps[] = {
+	PR_DISPLAY_NAME, PR_SMTP_ADDRESS, PR_ACCOUNT, PR_DEPARTMENT_NAME,
+	PR_OFFICE_TELEPHONE_NUMBER, PR_OFFICE_LOCATION, PR_PRIMARY_FAX_NUMBER,
+	PR_SURNAME
+};
+
+static inline bool relop_match(unsigned int relop, int equality)
+{
+	switch (relop) {
+	case RELOP_GE:
+		return equality >= 0;
+	case RELOP_GT:
+		return equality > 0;
+	case RELOP_LE:
+		return equality <= 0;
+	case RELOP_LT:
+		return equality < 0;
+	case RELOP_NE:
+		return equality != 0;
+	case RELOP_EQ:
+		return equality == 0;
+	default:
+		return false;
+	}
+}
+
+/* Rough chance that a comparison with this relop matches a random row */
+static double relop_prob(unsigned int relop)
+{
+	switch (relop) {
+	case RELOP_EQ:
+		return 0.1;
+	case RELOP_NE:
+		return 0.9;
+	case RELOP_RE:
+		return 0.1;
+	default:
+		return 0.5;
+	}
+}
+
+static inline unsigned int normalize_string_type(unsigned int tag)
+{
+	if ((PROP_TYPE(tag) & PT_MV_STRING8) == PT_STRING8)
+		return CHANGE_PROP_TYPE(tag, PT_TSTRING);
+	if ((PROP_TYPE(tag) & PT_MV_STRING8) == PT_MV_STRING8)
+		return CHANGE_PROP_TYPE(tag, PT_MV_TSTRING);
+	return tag;
+}
+
+static inline bool is_ascii(const char *s, size_t z)
+{
+	for (size_t i = 0; i < z; ++i)
+		if (static_cast<unsigned char>(s[i]) & 0x80)
+			return false;
+	return true;
+}
+
+static inline char ascii_lower(char c)
+{
+	return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+static bool ascii_iequal(const char *a, const char *b, size_t z)
+{
+	for (size_t i = 0; i < z; ++i)
+		if (ascii_lower(a[i]) != ascii_lower(b[i]))
+			return false;
+	return true;
+}
+
+static bool ascii_icontains(const char *h, size_t hz, const std::string &n)
+{
+	return std::search(h, h + hz, n.cbegin(), n.cend(),
+	       [](char a, char b) { return ascii_lower(a) == ascii_lower(b); }) != h + hz ||
+	       n.empty();
+}
+
+ECCompiledRestriction::~ECCompiledRestriction()
+{
+	for (auto &r : m_regex)
+		regfree(r.get());
+}
+
+ECRESULT ECCompiledRestriction::Compile(const struct restrictTable *rt,
+    const ECLocale &locale, const struct propTagArray *cols)
+{
+	if (rt == nullptr)
+		return KCERR_INVALID_PARAMETER;
+	m_locale = locale;
+	m_cols = cols;
+	m_use_slots = true;
+
+	fragment f;
+	unsigned int nsub = 0;
+	auto er = compile(rt, f, &nsub, false);
+	m_cols = nullptr;
+	if (er != erSuccess)
+		return er;
+	m_prog = std::move(f.nodes);
+	return erSuccess;
+}
+
+int ECCompiledRestriction::slot_of(unsigned int tag) const
+{
+	if (m_cols == nullptr || PROP_TYPE(tag) == PT_UNSPECIFIED)
+		return -1;
+	for (gsoap_size_t i = 0; i < m_cols->__size; ++i)
+		if (m_cols->__ptr[i] == tag)
+			return i;
+	return -1;
+}
+
+unsigned int ECCompiledRestriction::add_needle(const char *s, size_t z)
+{
+	needle n;
+	if (s != nullptr)
+		n.raw.assign(s, z);
+	n.ascii = is_ascii(n.raw.c_str(), n.raw.size());
+	n.text = icu::UnicodeString::fromUTF8(n.raw.c_str());
+	n.folded = n.text;
+	n.folded.foldCase();
+	m_needles.emplace_back(std::move(n));
+	return m_needles.size() - 1;
+}
+
+static bool has_list(const struct restrictTable *rt)
+{
+	return rt->ulType == RES_AND ? rt->lpAnd != nullptr : rt->lpOr != nullptr;
+}
+
+/*
+ * Children of an AND/OR, with nested lists of the same kind merged into
+ * the parent. Subrestrictions are numbered in the original order, before
+ * any reordering takes place.
+ */
+
+static void collect(const struct restrictTable *rt,
+    std::vector<const struct restrictTable *> &kids)
+{
+	auto size = rt->ulType == RES_AND ? rt->lpAnd->__size : rt->lpOr->__size;
+	auto ptr = rt->ulType == RES_AND ? rt->lpAnd->__ptr : rt->lpOr->__ptr;
+	for (gsoap_size_t i = 0; i < size; ++i) {
+		auto c = ptr[i];
+		if (c != nullptr && c->ulType == rt->ulType && has_list(c))
+			collect(c, kids);
+		else
+			kids.emplace_back(c);
+	}
+}
+
+ECRESULT ECCompiledRestriction::compile(const struct restrictTable *rt,
+    fragment &f, unsigned int *nsub, bool in_comment)
+{
+	node n;
+	n.rt = rt;
+	n.op = OP_ERROR;
+	n.error = KCERR_INVALID_TYPE;
+	f.nodes.clear();
+	f.cost = 1;
+	f.prob = 0.5;
+	f.pinned = true;
+	if (rt == nullptr) {
+		f.nodes.emplace_back(n);
+		return erSuccess;
+	}
+
+	switch (rt->ulType) {
+	case RES_COMMENT:
+		if (rt->lpComment == nullptr || rt->lpComment->lpResTable == nullptr)
+			break;
+		/* RunSubRestrictions does not look inside comments */
+		return compile(rt->lpComment->lpResTable, f, nsub, true);
+	case RES_AND:
+	case RES_OR: {
+		if (!has_list(rt))
+			break;
+		std::vector<const struct restrictTable *> kids;
+		collect(rt, kids);
+		std::vector<fragment> frags(kids.size());
+		for (size_t i = 0; i < kids.size(); ++i) {
+			auto er = compile(kids[i], frags[i], nsub, in_comment);
+			if (er != erSuccess)
+				return er;
+		}
+		finish_list(rt->ulType == RES_AND ? OP_AND : OP_OR, std::move(frags), f);
+		return erSuccess;
+	}
+	case RES_NOT: {
+		if (rt->lpNot == nullptr)
+			break;
+		auto er = compile(rt->lpNot->lpNot, f, nsub, in_comment);
+		if (er != erSuccess)
+			return er;
+		n.op = OP_NOT;
+		n.error = erSuccess;
+		n.size = 1 + f.nodes.size();
+		f.nodes.insert(f.nodes.begin(), n);
+		f.prob = 1 - f.prob;
+		return erSuccess;
+	}
+	case RES_CONTENT:
+		if (rt->lpContent == nullptr || rt->lpContent->lpProp == nullptr)
+			break;
+		compile_content(rt, f);
+		return erSuccess;
+	case RES_PROPERTY:
+		if (rt->lpProp == nullptr || rt->lpProp->lpProp == nullptr)
+			break;
+		compile_property(rt, f);
+		return erSuccess;
+	case RES_COMPAREPROPS: {
+		if (rt->lpCompare == nullptr)
+			break;
+		auto t1 = normalize_string_type(rt->lpCompare->ulPropTag1);
+		auto t2 = normalize_string_type(rt->lpCompare->ulPropTag2);
+		if (PROP_TYPE(t1) != PROP_TYPE(t2))
+			break;
+		n.op = OP_COMPARE;
+		n.error = erSuccess;
+		n.tag = rt->lpCompare->ulPropTag1;
+		n.tag2 = rt->lpCompare->ulPropTag2;
+		n.slot = slot_of(n.tag);
+		n.slot2 = slot_of(n.tag2);
+		n.relop = rt->lpCompare->ulType;
+		f.cost = 10;
+		f.prob = relop_prob(n.relop);
+		f.pinned = false;
+		break;
+	}
+	case RES_BITMASK:
+		if (rt->lpBitmask == nullptr ||
+		    PROP_TYPE(rt->lpBitmask->ulPropTag) != PT_LONG)
+			break;
+		n.op = OP_BITMASK;
+		n.error = erSuccess;
+		n.tag = rt->lpBitmask->ulPropTag;
+		n.slot = slot_of(n.tag);
+		n.relop = rt->lpBitmask->ulType;
+		n.arg = rt->lpBitmask->ulMask;
+		f.pinned = false;
+		break;
+	case RES_SIZE:
+		if (rt->lpSize == nullptr)
+			break;
+		/* Stays pinned: a missing property is an error */
+		n.op = OP_SIZE;
+		n.error = erSuccess;
+		n.tag = rt->lpSize->ulPropTag;
+		n.slot = slot_of(n.tag);
+		n.relop = rt->lpSize->ulType;
+		n.arg = rt->lpSize->cb;
+		f.cost = 2;
+		f.prob = relop_prob(n.relop);
+		break;
+	case RES_EXIST:
+		if (rt->lpExist == nullptr)
+			break;
+		n.op = OP_EXIST;
+		n.error = erSuccess;
+		n.tag = rt->lpExist->ulPropTag;
+		n.slot = slot_of(n.tag);
+		f.prob = 0.8;
+		f.pinned = false;
+		break;
+	case RES_SUBRESTRICTION:
+		/* Stays pinned: a missing PR_ENTRYID is an error */
+		n.op = OP_SUB;
+		n.error = erSuccess;
+		n.tag = PR_ENTRYID;
+		n.slot = slot_of(n.tag);
+		n.arg = in_comment ? NO_INDEX : (*nsub)++;
+		f.cost = 10;
+		f.prob = 0.1;
+		break;
+	default:
+		break;
+	}
+	f.nodes.emplace_back(n);
+	return erSuccess;
+}
+
+void ECCompiledRestriction::finish_list(unsigned int op,
+    std::vector<fragment> &&kids, fragment &f)
+{
+	bool is_and = op == OP_AND;
+	f.nodes.clear();
+	f.pinned = false;
+	if (kids.empty()) {
+		node n;
+		n.op = OP_CONST;
+		n.relop = is_and;
+		f.nodes.emplace_back(n);
+		f.cost = 1;
+		f.prob = is_and;
+		return;
+	}
+	if (kids.size() == 1) {
+		f = std::move(kids[0]);
+		return;
+	}
+	for (const auto &k : kids)
+		f.pinned |= k.pinned;
+	/*
+	 * Evaluating a child costs c and ends the list with a chance q
+	 * (1-p for AND, p for OR). Running children in increasing c/q gives
+	 * the lowest expected cost. Only done when the order cannot be
+	 * observed, i.e. no child can fail or change the row.
+	 */
+	if (!f.pinned)
+		std::stable_sort(kids.begin(), kids.end(),
+			[=](const fragment &a, const fragment &b) {
+				auto qa = std::max(is_and ? 1 - a.prob : a.prob, 0.01);
+				auto qb = std::max(is_and ? 1 - b.prob : b.prob, 0.01);
+				return a.cost / qa < b.cost / qb;
+			});
+
+	node head;
+	head.op = op;
+	double reach = 1, cost = 0;
+	for (const auto &k : kids) {
+		head.size += k.nodes.size();
+		cost += reach * k.cost;
+		reach *= is_and ? k.prob : 1 - k.prob;
+	}
+	f.cost = cost;
+	f.prob = is_and ? reach : 1 - reach;
+	f.nodes.reserve(head.size);
+	f.nodes.emplace_back(head);
+	for (auto &k : kids)
+		f.nodes.insert(f.nodes.end(), k.nodes.cbegin(), k.nodes.cend());
+}
+
+void ECCompiledRestriction::compile_content(const struct restrictTable *rt,
+    fragment &f)
+{
+	auto c = rt->lpContent;
+	auto tag = normalize_string_type(c->ulPropTag);
+	auto vtag = normalize_string_type(c->lpProp->ulPropTag);
+	node n;
+	n.rt = rt;
+	f.pinned = false;
+
+	if (PROP_TYPE(tag) != PT_TSTRING && PROP_TYPE(tag) != PT_BINARY &&
+	    PROP_TYPE(tag) != PT_MV_TSTRING && PROP_TYPE(tag) != PT_MV_BINARY) {
+		n.op = OP_CONST;
+		n.relop = false;
+		f.prob = 0;
+		f.nodes.emplace_back(n);
+		return;
+	}
+	n.op = OP_CONTENT;
+	n.tag = c->ulPropTag;
+	n.slot = slot_of(n.tag);
+	n.mv = tag & MV_FLAG;
+	n.tag2 = PROP_TYPE(tag) & ~MVI_FLAG;
+	n.relop = c->ulFuzzyLevel;
+	if (PROP_TYPE(vtag) == PT_TSTRING) {
+		auto s = c->lpProp->Value.lpszA;
+		n.arg = add_needle(s, s != nullptr ? strlen(s) : 0);
+	} else if (c->lpProp->Value.bin != nullptr) {
+		n.arg = add_needle(reinterpret_cast<const char *>(c->lpProp->Value.bin->__ptr), c->lpProp->Value.bin->__size);
+	} else {
+		n.arg = add_needle(nullptr, 0);
+	}
+	switch (n.relop & 0xFFFF) {
+	case FL_FULLSTRING:
+		f.prob = 0.1;
+		break;
+	case FL_PREFIX:
+		f.prob = 0.15;
+		break;
+	case FL_SUBSTRING:
+		f.prob = 0.25;
+		break;
+	default:
+		f.prob = 0;
+		break;
+	}
+	f.cost = n.tag2 == PT_TSTRING ? 5 : 3;
+	if (n.mv)
+		f.cost *= 4;
+	f.nodes.emplace_back(n);
+}
+
+void ECCompiledRestriction::compile_property(const struct restrictTable *rt,
+    fragment &f)
+{
+	auto p = rt->lpProp;
+	auto tag = normalize_string_type(p->ulPropTag);
+	auto vtag = p->lpProp->ulPropTag;
+	if (PROP_TYPE(vtag) == PT_STRING8)
+		vtag = CHANGE_PROP_TYPE(vtag, PT_TSTRING);
+	node n;
+	n.rt = rt;
+	n.tag = p->ulPropTag;
+	n.slot = slot_of(n.tag);
+	n.relop = p->ulType;
+	f.prob = relop_prob(n.relop);
+	f.pinned = false;
+
+	if ((PROP_TYPE(tag) & ~MV_FLAG) != PROP_TYPE(vtag)) {
+		/* cannot compare two different types, except mvprop -> prop */
+		n.op = OP_ERROR;
+		n.error = KCERR_INVALID_TYPE;
+		f.pinned = true;
+	} else if (n.relop == RELOP_RE) {
+		n.op = OP_REGEX;
+		n.arg = NO_INDEX;
+		f.cost = 30;
+		if (PROP_TYPE(vtag) != PT_TSTRING || PROP_TYPE(tag) != PT_TSTRING) {
+			/* Only an error when the property is present */
+			n.error = KCERR_INVALID_TYPE;
+			f.pinned = true;
+		} else if (p->lpProp->Value.lpszA != nullptr) {
+			std::unique_ptr<regex_t> re(new regex_t);
+			if (regcomp(re.get(), p->lpProp->Value.lpszA, REG_NOSUB | REG_NEWLINE | REG_ICASE) == 0) {
+				m_regex.emplace_back(std::move(re));
+				n.arg = m_regex.size() - 1;
+			}
+		}
+	} else if (PROP_ID(tag) == PROP_ID(PR_ANR)) {
+		/*
+		 * ANR retags the row's properties while matching, so it
+		 * keeps its place, and column positions can no longer be
+		 * trusted to hold the first instance of a tag.
+		 */
+		n.op = OP_ANR;
+		f.cost = 60;
+		f.pinned = true;
+		m_use_slots = false;
+	} else if (tag & MV_FLAG) {
+		n.op = OP_PROP_MV;
+		f.cost = 20;
+	} else if (PROP_TYPE(n.tag) == PT_LONG &&
+	    p->lpProp->__union == SOAP_UNION_propValData_ul) {
+		n.op = OP_PROP_LONG;
+		n.arg = p->lpProp->Value.ul;
+	} else if ((PROP_TYPE(n.tag) == PT_UNICODE || PROP_TYPE(n.tag) == PT_STRING8) &&
+	    p->lpProp->__union == SOAP_UNION_propValData_lpszA &&
+	    p->lpProp->Value.lpszA != nullptr &&
+	    PROP_ID(p->lpProp->ulPropTag) != PROP_ID(PR_ANR)) {
+		/* CompareProp would use u8_icompare: a collator on folded strings */
+		if (m_collator == nullptr) {
+			UErrorCode st = U_ZERO_ERROR;
+			m_collator.reset(icu::Collator::createInstance(m_locale, st));
+			if (U_FAILURE(st))
+				m_collator.reset();
+		}
+		if (m_collator != nullptr) {
+			n.op = OP_PROP_STRING;
+			n.arg = add_needle(p->lpProp->Value.lpszA, strlen(p->lpProp->Value.lpszA));
+			f.cost = 20;
+		} else {
+			n.op = OP_PROPERTY;
+			f.cost = 40;
+		}
+	} else {
+		n.op = OP_PROPERTY;
+		f.cost = 4;
+	}
+	f.nodes.emplace_back(n);
+}
+
+static inline struct propVal *lookup(struct propValArray *row,
+    unsigned int tag, int slot)
+{
+	if (slot >= 0 && slot < row->__size && row->__ptr[slot].ulPropTag == tag)
+		return &row->__ptr[slot];
+	return FindProp(row, tag);
+}
+
+ECRESULT ECCompiledRestriction::Match(ECCacheManager *cache,
+    struct propValArray *row, const SUBRESTRICTIONRESULTS *subres,
+    bool *match) const
+{
+	if (m_prog.empty())
+		return KCERR_INVALID_PARAMETER;
+	bool m = false;
+	auto er = eval(0, cache, row, subres, &m);
+	if (er == erSuccess)
+		*match = m;
+	return er;
+}
+
+ECRESULT ECCompiledRestriction::eval(size_t i, ECCacheManager *cache,
+    struct propValArray *row, const SUBRESTRICTIONRESULTS *subres,
+    bool *res) const
+{
+	const auto &n = m_prog[i];
+	auto slot = m_use_slots ? n.slot : -1;
+	struct propVal *prop = nullptr;
+
+	switch (n.op) {
+	case OP_CONST:
+		*res = n.relop != 0;
+		return erSuccess;
+	case OP_ERROR:
+		return n.error;
+	case OP_AND:
+	case OP_OR: {
+		/* The value that ends the list early */
+		bool stop = n.op == OP_OR;
+		for (auto j = i + 1; j < i + n.size; j += m_prog[j].size) {
+			bool m = !stop;
+			auto er = eval(j, cache, row, subres, &m);
+			if (er != erSuccess)
+				return er;
+			if (m == stop) {
+				*res = stop;
+				return erSuccess;
+			}
+		}
+		*res = !stop;
+		return erSuccess;
+	}
+	case OP_NOT: {
+		bool m = false;
+		auto er = eval(i + 1, cache, row, subres, &m);
+		if (er != erSuccess)
+			return er;
+		*res = !m;
+		return erSuccess;
+	}
+	case OP_CONTENT:
+		*res = eval_content(n, row);
+		return erSuccess;
+	case OP_REGEX:
+		prop = lookup(row, n.tag, slot);
+		if (prop == nullptr) {
+			*res = false;
+			return erSuccess;
+		}
+		if (n.error != erSuccess)
+			return n.error;
+		*res = n.arg != NO_INDEX && prop->Value.lpszA != nullptr &&
+		       regexec(m_regex[n.arg].get(), prop->Value.lpszA, 0, nullptr, 0) == 0;
+		return erSuccess;
+	case OP_ANR: {
+		auto value = n.rt->lpProp->lpProp;
+		*res = false;
+		for (size_t j = 0; j < ARRAY_SIZE(sANRProps); ++j) {
+			prop = FindProp(row, sANRProps[j]);
+			if (prop == nullptr)
+				continue;
+			/* CompareProp will fail if the types are not the same */
+			prop->ulPropTag = value->ulPropTag;
+			int cmp = 0;
+			CompareProp(prop, value, m_locale, &cmp); /* ignore error */
+			/* cmp is 1 if the prefix was found, 0 if not */
+			*res = relop_match(n.relop, cmp ? 0 : -1);
+			if (*res)
+				break;
+		}
+		return erSuccess;
+	}
+	default:
+		break;
+	}
+
+	prop = lookup(row, n.tag, slot);
+	switch (n.op) {
+	case OP_PROPERTY:
+	case OP_PROP_LONG:
+	case OP_PROP_STRING:
+	case OP_PROP_MV: {
+		if (prop == nullptr) {
+			*res = n.relop == RELOP_NE;
+			return erSuccess;
+		}
+		int cmp = 0;
+		*res = false;
+		if (n.op == OP_PROP_MV) {
+			if (CompareMVPropWithProp(prop, n.rt->lpProp->lpProp, n.relop, m_locale, res) != erSuccess)
+				*res = false;
+			return erSuccess;
+		} else if (n.op == OP_PROP_LONG) {
+			if (prop->__union != SOAP_UNION_propValData_ul)
+				return erSuccess;
+			cmp = prop->Value.ul == n.arg ? 0 : prop->Value.ul < n.arg ? -1 : 1;
+		} else if (n.op == OP_PROP_STRING) {
+			if (prop->__union != SOAP_UNION_propValData_lpszA ||
+			    (PROP_TYPE(prop->ulPropTag) == PT_STRING8 && prop->Value.lpszA == nullptr))
+				return erSuccess;
+			cmp = prop->Value.lpszA == nullptr ? 1 : collate(m_needles[n.arg], prop->Value.lpszA);
+		} else if (CompareProp(prop, n.rt->lpProp->lpProp, m_locale, &cmp) != erSuccess) {
+			return erSuccess;
+		}
+		*res = relop_match(n.relop, cmp);
+		return erSuccess;
+	}
+	case OP_COMPARE: {
+		auto prop2 = lookup(row, n.tag2, m_use_slots ? n.slot2 : -1);
+		int cmp = 0;
+		*res = prop != nullptr && prop2 != nullptr &&
+		       CompareProp(prop, prop2, m_locale, &cmp) == erSuccess &&
+		       relop_match(n.relop, cmp);
+		return erSuccess;
+	}
+	case OP_BITMASK:
+		*res = prop != nullptr && (prop->Value.ul & n.arg) > 0;
+		if (prop != nullptr && n.relop == BMR_EQZ)
+			*res = !*res;
+		return erSuccess;
+	case OP_SIZE: {
+		if (prop == nullptr)
+			return KCERR_INVALID_TYPE;
+		auto z = PropSize(prop);
+		*res = relop_match(n.relop, z == n.arg ? 0 : z < n.arg ? -1 : 1);
+		return erSuccess;
+	}
+	case OP_EXIST:
+		*res = prop != nullptr;
+		return erSuccess;
+	case OP_SUB: {
+		if (prop == nullptr)
+			return KCERR_INVALID_TYPE;
+		*res = false;
+		if (subres == nullptr || n.arg >= subres->size())
+			return erSuccess;
+		entryId eid;
+		eid.__ptr = prop->Value.bin->__ptr;
+		eid.__size = prop->Value.bin->__size;
+		unsigned int id = 0;
+		if (cache->GetObjectFromEntryId(&eid, &id) != erSuccess)
+			return erSuccess;
+		*res = (*subres)[n.arg].find(id) != (*subres)[n.arg].cend();
+		return erSuccess;
+	}
+	default:
+		return KCERR_INVALID_TYPE;
+	}
+}
+
+bool ECCompiledRestriction::eval_content(const node &n,
+    struct propValArray *row) const
+{
+	auto prop = lookup(row, n.tag, m_use_slots ? n.slot : -1);
+	if (prop == nullptr)
+		return false;
+	const auto &ndl = m_needles[n.arg];
+	bool text = n.tag2 == PT_TSTRING;
+	unsigned int count = 1;
+	if (n.mv)
+		count = text ? prop->Value.mvszA.__size : prop->Value.mvbin.__size;
+
+	for (unsigned int pos = 0; pos < count; ++pos) {
+		const char *data = nullptr;
+		size_t z = 0;
+		if (n.mv && text) {
+			data = prop->Value.mvszA.__ptr[pos];
+		} else if (n.mv) {
+			data = reinterpret_cast<const char *>(prop->Value.mvbin.__ptr[pos].__ptr);
+			z = prop->Value.mvbin.__ptr[pos].__size;
+		} else if (text) {
+			data = prop->Value.lpszA;
+		} else if (prop->Value.bin != nullptr) {
+			data = reinterpret_cast<const char *>(prop->Value.bin->__ptr);
+			z = prop->Value.bin->__size;
+		}
+		if (text) {
+			if (data == nullptr)
+				data = "";
+			z = strlen(data);
+			if (match_text(ndl, n.relop, data, z))
+				return true;
+			continue;
+		}
+		auto nz = ndl.raw.size();
+		switch (n.relop & 0xFFFF) {
+		case FL_FULLSTRING:
+			if (z == nz && memcmp(data, ndl.raw.data(), z) == 0)
+				return true;
+			break;
+		case FL_PREFIX:
+			if (z >= nz && memcmp(data, ndl.raw.data(), nz) == 0)
+				return true;
+			break;
+		case FL_SUBSTRING:
+			if (memsubstr(data, z, ndl.raw.data(), nz) == 0)
+				return true;
+			break;
+		}
+	}
+	return false;
+}
+
+/*
+ * The u8_* string compares, with the search string converted up front and
+ * a byte-level shortcut when both sides are plain ASCII (where case
+ * folding is just A-Z to a-z).
+ */
+bool ECCompiledRestriction::match_text(const needle &n, unsigned int fuzzy,
+    const char *s, size_t z) const
+{
+	bool icase = fuzzy & FL_IGNORECASE;
+	auto nz = n.raw.size();
+
+	switch (fuzzy & 0xFFFF) {
+	case FL_FULLSTRING:
+		if (z != nz)
+			return false;
+		if (icase) {
+			if (n.ascii && is_ascii(s, z))
+				return ascii_iequal(s, n.raw.data(), z);
+			return icu::UnicodeString::fromUTF8(icu::StringPiece(s, z)).caseCompare(n.text, 0) == 0;
+		}
+		if (memcmp(s, n.raw.data(), z) == 0)
+			return true;
+		if (n.ascii && is_ascii(s, z))
+			return false;
+		return icu::UnicodeString::fromUTF8(icu::StringPiece(s, z)).compare(n.text) == 0;
+	case FL_PREFIX:
+		if (z < nz)
+			return false;
+		if (n.ascii && is_ascii(s, nz))
+			return icase ? ascii_iequal(s, n.raw.data(), nz) :
+			       memcmp(s, n.raw.data(), nz) == 0;
+		if (icase)
+			return icu::UnicodeString::fromUTF8(icu::StringPiece(s, z)).caseCompare(0, n.text.length(), n.text, 0) == 0;
+		return icu::UnicodeString::fromUTF8(icu::StringPiece(s, z)).compare(0, n.text.length(), n.text) == 0;
+	case FL_SUBSTRING: {
+		if (nz == 0)
+			return true;
+		if (n.ascii && is_ascii(s, z))
+			return icase ? ascii_icontains(s, z, n.raw) :
+			       std::string_view(s, z).find(n.raw) != std::string_view::npos;
+		auto hay = icu::UnicodeString::fromUTF8(icu::StringPiece(s, z));
+		if (!icase)
+			return hay.indexOf(n.text) >= 0;
+		hay.foldCase();
+		return hay.indexOf(n.folded) >= 0;
+	}
+	default:
+		return false;
+	}
+}
+
+int ECCompiledRestriction::collate(const needle &n, const char *s) const
+{
+	auto a = icu::UnicodeString::fromUTF8(s);
+	UErrorCode st = U_ZERO_ERROR;
+	a.foldCase();
+	return m_collator->compare(a, n.folded, st);
+}
+
+} /* namespace */
@@ -0,0 +1,112 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016, Kopano and its licensors
+ */
+#ifndef EC_COMPILED_RESTRICTION_H
+#define EC_COMPILED_RESTRICTION_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <regex.h>
+#include <unicode/coll.h>
+#include <unicode/unistr.h>
+#include <kopano/kcodes.h>
+#include <kopano/ustringutil.h>
+#include "soapH.h"
+#include "ECSubRestriction.h"
+
+namespace KC {
+
+class ECCacheManager;
+
+/**
+ * A restrictTable translated into a flat program that can be run against
+ * many rows.
+ *
+ * ECGenericObjectTable::MatchRowRestrict walks the restriction tree for
+ * every row and redoes the per-node setup each time: tag normalisation,
+ * UTF-8 to UTF-16 conversion of the search string, Collator construction
+ * for every string compare and regcomp for RELOP_RE. Compile() does all
+ * of that once. The nodes are stored in pre-order in one vector, nested
+ * ANDs and ORs are merged, and where no child can change the outcome
+ * other than through its truth value, the children of an AND/OR are
+ * ordered by estimated cost and selectivity so that the cheap,
+ * decisive tests run first.
+ *
+ * Match() yields the same results as MatchRowRestrict, except that
+ * subrestrictions are numbered depth-first like RunSubRestrictions
+ * does, rather than always using the first result set.
+ *
+ * A compiled restriction refers to the restrictTable it was made from
+ * and is used by one thread at a time.
+ */
+class ECCompiledRestriction final {
+	public:
+	ECCompiledRestriction() = default;
+	~ECCompiledRestriction();
+	ECCompiledRestriction(const ECCompiledRestriction &) = delete;
+	ECCompiledRestriction &operator=(const ECCompiledRestriction &) = delete;
+
+	/*
+	 * @cols is the column set the rows will be fetched with; when given,
+	 * property lookups try the matching column position first.
+	 */
+	ECRESULT Compile(const struct restrictTable *, const ECLocale &, const struct propTagArray *cols = nullptr);
+	ECRESULT Match(ECCacheManager *, struct propValArray *, const SUBRESTRICTIONRESULTS *, bool *match) const;
+	size_t size() const { return m_prog.size(); }
+
+	private:
+	/* A search string, in the forms the compares need */
+	struct needle {
+		std::string raw;
+		icu::UnicodeString text, folded;
+		bool ascii = true;
+	};
+
+	struct node {
+		unsigned char op = 0;
+		bool mv = false;
+		/* Number of nodes in this subtree, including this one */
+		unsigned int size = 1;
+		unsigned int tag = 0, tag2 = 0;
+		int slot = -1, slot2 = -1;
+		/* relop, fuzzy level or bitmask type */
+		unsigned int relop = 0;
+		/* bitmask, size, needle, regex or subrestriction index */
+		unsigned int arg = 0;
+		ECRESULT error = erSuccess;
+		const struct restrictTable *rt = nullptr;
+	};
+
+	struct fragment {
+		std::vector<node> nodes;
+		/* Estimated evaluation cost, and chance of a match */
+		double cost = 1, prob = 0.5;
+		/* Whether moving this subtree could change the outcome */
+		bool pinned = false;
+	};
+
+	ECRESULT compile(const struct restrictTable *, fragment &, unsigned int *nsub, bool in_comment);
+	void compile_content(const struct restrictTable *, fragment &);
+	void compile_property(const struct restrictTable *, fragment &);
+	void finish_list(unsigned int op, std::vector<fragment> &&, fragment &);
+	int slot_of(unsigned int tag) const;
+	unsigned int add_needle(const char *, size_t);
+	ECRESULT eval(size_t, ECCacheManager *, struct propValArray *, const SUBRESTRICTIONRESULTS *, bool *) const;
+	bool eval_content(const node &, struct propValArray *) const;
+	bool match_text(const needle &, unsigned int fuzzy, const char *, size_t) const;
+	int collate(const needle &, const char *) const;
+
+	std::vector<node> m_prog;
+	std::vector<needle> m_needles;
+	std::vector<std::unique_ptr<regex_t>> m_regex;
+	std::unique_ptr<icu::Collator> m_collator;
+	ECLocale m_locale;
+	const struct propTagArray *m_cols = nullptr;
+	bool m_use_slots = true;
+};
+
+} /* namespace */
+
+#endif
@@ -20,6 +20,7 @@ namespace KC {
 class ECConvenientDepthObjectTable final : public ECStoreObjectTable {
 protected:
 	ECConvenientDepthObjectTable(ECSession *lpSession, unsigned int ulStoreId, GUID *lpGuid, unsigned int ulFolderId, unsigned int ulObjType, unsigned int ulFlags, const ECLocale &locale);
+	virtual bool GetSnapshotKey(ECTableSnapshotKey *) override { return false; }
 public:
 	static ECRESULT Create(ECSession *, unsigned int store_id, GUID *guid, unsigned int folder_id, unsigned int obj_type, unsigned int flags, const ECLocale &, ECStoreObjectTable **);
     virtual ECRESULT Load();
@@ -8,8 +8,10 @@
 
 #include <kopano/zcdefs.h>
 #include <kopano/database.hpp>
+#include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace KC {
 
@@ -32,6 +34,10 @@ public:
 	virtual ECRESULT DoInsert(const std::string &query, unsigned int *insert_id = nullptr, unsigned int *affected_rows = nullptr) override;
 	virtual ECRESULT DoSequence(const std::string &seqname, unsigned int ulCount, unsigned long long *first_id) override;
 	virtual ECRESULT DoUpdate(const std::string &query, unsigned int *affected_rows = nullptr) override;
+	virtual ECRESULT DoSelect(kd_stmt *, DB_RESULT *) override;
+	virtual ECRESULT DoDelete(kd_stmt *, unsigned int *affected_rows = nullptr) override;
+	virtual ECRESULT DoInsert(kd_stmt *, unsigned int *insert_id = nullptr, unsigned int *affected_rows = nullptr) override;
+	virtual ECRESULT DoUpdate(kd_stmt *, unsigned int *affected_rows = nullptr) override;
 	ECRESULT FinalizeMulti(void);
 	ECRESULT GetNextResult(DB_RESULT *);
 	ECRESULT InitializeDBState(void);
@@ -41,6 +47,8 @@ public:
 	void ThreadInit(void);
 	ECRESULT UpdateDatabase(bool force_update, std::string &report);
 	const std::string &get_dbname() const { return m_dbname; }
+	/* Run @f once the current transaction is committed; outside of one, right away */
+	void on_commit(std::function<void()> &&f);
 
 	private:
 	ECRESULT InitializeDBStateInner(void);
@@ -49,9 +57,11 @@ public:
 	ECRESULT GetFirstUpdate(unsigned int *lpulDatabaseRevision);
 	ECRESULT UpdateDatabaseVersion(unsigned int ulDatabaseRevision);
 	virtual ECRESULT Query(const std::string &q) override;
+	virtual ECRESULT Reconnect() override;
 
 	std::string error, m_dbname;
-	bool m_bForceUpdate = false, m_bFirstResult = false;
+	bool m_bForceUpdate = false, m_bFirstResult = false, m_in_trans = false;
+	std::vector<std::function<void()>> m_on_commit;
 	std::shared_ptr<ECConfig> m_lpConfig;
 	std::shared_ptr<ECStatsCollector> m_stats;
 #ifdef KNOB144
@@ -441,6 +441,14 @@ exit:
 	return er;
 }
 
+ECRESULT ECDatabase::Reconnect()
+{
+	auto er = Close();
+	if (er != erSuccess)
+		return er;
+	return Connect();
+}
+
 /**
  * Perform an SQL query on MySQL
  *
@@ -460,10 +468,7 @@ ECRESULT ECDatabase::Query(const std::string &strQuery)
 
 	if(err && (mysql_errno(&m_lpMySQL) == CR_SERVER_LOST || mysql_errno(&m_lpMySQL) == CR_SERVER_GONE_ERROR)) {
 		ec_log_warn("SQL [%08lu] info: Try to reconnect", m_lpMySQL.thread_id);
-		er = Close();
-		if(er != erSuccess)
-			return er;
-		er = Connect();
+		er = Reconnect();
 		if(er != erSuccess)
 			return er;
 		// Try again
@@ -609,6 +614,51 @@ ECRESULT ECDatabase::DoDelete(const std::string &strQuery,
 	return er;
 }
 
+ECRESULT ECDatabase::DoSelect(kd_stmt *st, DB_RESULT *lppResult)
+{
+	auto er = KDatabase::DoSelect(st, lppResult);
+	m_stats->inc(SCN_DATABASE_SELECTS);
+	if (er != erSuccess) {
+		m_stats->inc(SCN_DATABASE_FAILED_SELECTS);
+		m_stats->SetTime(SCN_DATABASE_LAST_FAILED, time(nullptr));
+	}
+	return er;
+}
+
+ECRESULT ECDatabase::DoUpdate(kd_stmt *st, unsigned int *lpulAffectedRows)
+{
+	auto er = KDatabase::DoUpdate(st, lpulAffectedRows);
+	m_stats->inc(SCN_DATABASE_UPDATES);
+	if (er != erSuccess) {
+		m_stats->inc(SCN_DATABASE_FAILED_UPDATES);
+		m_stats->SetTime(SCN_DATABASE_LAST_FAILED, time(nullptr));
+	}
+	return er;
+}
+
+ECRESULT ECDatabase::DoInsert(kd_stmt *st, unsigned int *lpulInsertId,
+    unsigned int *lpulAffectedRows)
+{
+	auto er = KDatabase::DoInsert(st, lpulInsertId, lpulAffectedRows);
+	m_stats->inc(SCN_DATABASE_INSERTS);
+	if (er != erSuccess) {
+		m_stats->inc(SCN_DATABASE_FAILED_INSERTS);
+		m_stats->SetTime(SCN_DATABASE_LAST_FAILED, time(nullptr));
+	}
+	return er;
+}
+
+ECRESULT ECDatabase::DoDelete(kd_stmt *st, unsigned int *lpulAffectedRows)
+{
+	auto er = KDatabase::DoDelete(st, lpulAffectedRows);
+	m_stats->inc(SCN_DATABASE_DELETES);
+	if (er != erSuccess) {
+		m_stats->inc(SCN_DATABASE_FAILED_DELETES);
+		m_stats->SetTime(SCN_DATABASE_LAST_FAILED, time(nullptr));
+	}
+	return er;
+}
+
 /*
  */
 ECRESULT ECDatabase::DoSequence(const std::string &strSeqName,
@@ -630,6 +680,9 @@ bool ECDatabase::SuppressLockErrorLogging(bool bSuppress)
 kd_trans ECDatabase::Begin(ECRESULT &res)
 {
 	auto dtx = KDatabase::Begin(res);
+	/* Without a transaction, on_commit hooks run right away */
+	m_in_trans = res == erSuccess;
+	m_on_commit.clear();
 #if defined(KNOB144) && DEBUG_TRANSACTION
 	ec_log_debug("%08X: BEGIN", &m_lpMySQL);
 	if(m_ulTransactionState != 0) {
@@ -652,12 +705,20 @@ ECRESULT ECDatabase::Commit(void)
 	}
 	m_ulTransactionState = 0;
 #endif
+	m_in_trans = false;
+	auto hooks = std::move(m_on_commit);
+	m_on_commit.clear();
+	if (er == erSuccess)
+		for (const auto &f : hooks)
+			f();
 	return er;
 }
 
 ECRESULT ECDatabase::Rollback(void)
 {
 	auto er = KDatabase::Rollback();
+	m_in_trans = false;
+	m_on_commit.clear();
 #if defined(KNOB144) && DEBUG_TRANSACTION
 	ec_log_debug("%08X: ROLLBACK", &m_lpMySQL);
 	if(m_ulTransactionState != 1) {
@@ -669,6 +730,14 @@ ECRESULT ECDatabase::Rollback(void)
 	return er;
 }
 
+void ECDatabase::on_commit(std::function<void()> &&f)
+{
+	if (m_in_trans)
+		m_on_commit.emplace_back(std::move(f));
+	else
+		f();
+}
+
 void ECDatabase::ThreadInit(void)
 {
 	mysql_thread_init();
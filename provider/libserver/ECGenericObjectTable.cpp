@@ -47,10 +47,12 @@
 #include <kopano/ECKeyTable.h>
 #include "ECGenProps.h"
 #include "ECGenericObjectTable.h"
+#include "ECCompiledRestriction.h"
 #include "SOAPUtils.h"
 #include <kopano/stringutil.h>
 #include "ECSessionManager.h"
 #include "ECSession.h"
+#include "ECTableSnapshots.h"
 
 namespace KC {
 
@@ -103,9 +105,14 @@ static inline bool match(unsigned int relop, int equality)
  */
 ECGenericObjectTable::ECGenericObjectTable(ECSession *ses,
     unsigned int ulObjType, unsigned int ulFlags, const ECLocale &locale) :
-	lpSession(ses), lpKeyTable(new ECKeyTable),
+	lpSession(ses),
 	m_ulObjType(ulObjType), m_ulFlags(ulFlags), m_locale(locale)
 {
+	auto engine = ses != nullptr ? ses->GetSessionManager()->GetConfig()->GetSetting("table_engine") : nullptr;
+	if (engine != nullptr && strcmp(engine, "btree") == 0)
+		lpKeyTable.reset(new ECBTreeKeyTable);
+	else
+		lpKeyTable.reset(new ECKeyTable);
 	// No columns by default
 	lpsPropTagArray = s_alloc<propTagArray>(nullptr);
 	lpsPropTagArray->__size = 0;
@@ -203,7 +210,11 @@ ECRESULT ECGenericObjectTable::FindRow(struct restrictTable *rt,
 		sRowItem.ulObjId = le32_to_cpu(tmp4);
 		memcpy(&tmp4, rt->lpProp->lpProp->Value.bin->__ptr + sizeof(tmp4), sizeof(tmp4));
 		sRowItem.ulOrderId = le32_to_cpu(tmp4);
-		return lpKeyTable->SeekId(&sRowItem);
+		er = lpKeyTable->SeekId(&sRowItem);
+		/* Like below, the cursor stays put when there is no such row */
+		if (er != erSuccess)
+			lpKeyTable->SeekRow(ECKeyTable::EC_SEEK_SET, ulRow, &ulTraversed);
+		return er;
 	}
 
 	// We can do the same with PR_ENTRYID
@@ -216,10 +227,12 @@ ECRESULT ECGenericObjectTable::FindRow(struct restrictTable *rt,
 		sEntryId.__ptr = rt->lpProp->lpProp->Value.bin->__ptr;
 		sEntryId.__size = rt->lpProp->lpProp->Value.bin->__size;
 		er = cache->GetObjectFromEntryId(&sEntryId, &sRowItem.ulObjId);
-		if(er != erSuccess)
-			return er;
 		sRowItem.ulOrderId = 0; // FIXME: this is incorrect when MV_INSTANCE is specified on a column, but this won't happen often.
-		return lpKeyTable->SeekId(&sRowItem);
+		if (er == erSuccess)
+			er = lpKeyTable->SeekId(&sRowItem);
+		if (er != erSuccess)
+			lpKeyTable->SeekRow(ECKeyTable::EC_SEEK_SET, ulRow, &ulTraversed);
+		return er;
 	}
 
 	// Get the columns we will be needing for this search
@@ -227,6 +240,10 @@ ECRESULT ECGenericObjectTable::FindRow(struct restrictTable *rt,
 	er = GetRestrictPropTags(rt, nullptr, &lpPropTags);
 	if(er != erSuccess)
 		return er;
+	ECCompiledRestriction prog;
+	er = prog.Compile(rt, m_locale, lpPropTags);
+	if (er != erSuccess)
+		return er;
 
 	// Loop through the rows, matching it with the search criteria
 	while(1) {
@@ -252,7 +269,7 @@ ECRESULT ECGenericObjectTable::FindRow(struct restrictTable *rt,
 		assert(lpRowSet->__size == static_cast<gsoap_size_t>(ecRowList.size()));
 		for (gsoap_size_t i = 0; i < lpRowSet->__size; ++i) {
 			// Match the row
-			er = MatchRowRestrict(cache, &lpRowSet->__ptr[i], rt, &sub_results, m_locale, &fMatch);
+			er = prog.Match(cache, &lpRowSet->__ptr[i], &sub_results, &fMatch);
 			if(er != erSuccess)
 				return er;
 			if(fMatch)
@@ -747,6 +764,14 @@ ECRESULT ECGenericObjectTable::AddRowKey(ECObjectTableList* lpRows, unsigned int
 	struct restrictTable *rt = nullptr;
 	sObjectTableKey					sRowItem;
 	ECCategory		*lpCategory = NULL;
+	ECCompiledRestriction prog;
+	ECTableSnapshotKey snap_key;
+	std::shared_ptr<const ECTableSnapshots::rowmap> snap;
+	ECTableSnapshots::rowmap snap_new;
+	ECObjectTableList snap_missing;
+	uint64_t snap_gen = 0;
+	size_t snap_hits = 0;
+	auto snapshots = lpSession->GetSessionManager()->GetTableSnapshots();
 	ulock_rec biglock(m_hLock);
 
 	if (lpRows->empty()) {
@@ -757,6 +782,29 @@ ECRESULT ECGenericObjectTable::AddRowKey(ECObjectTableList* lpRows, unsigned int
 	}
 
 	rt = bOverride ? lpOverrideRestrict : lpsRestrict;
+	/*
+	 * Without a restriction or categories, the sort keys are all that is
+	 * needed of a row. Take those that another session already computed
+	 * for this view, and only query the others.
+	 */
+	if (rt == nullptr && m_ulCategories == 0 && snapshots->enabled() &&
+	    GetSnapshotKey(&snap_key)) {
+		snap = snapshots->get(snap_key, &snap_gen);
+		for (const auto &row : *lpRows) {
+			auto i = snap->find(row);
+			if (i == snap->cend()) {
+				snap_missing.emplace_back(row);
+				continue;
+			}
+			auto keys = i->second;
+			er = AddRow(row, std::move(keys), ulFlags);
+			if (er != erSuccess)
+				goto exit;
+			++ulLoaded;
+			++snap_hits;
+		}
+		lpRows = &snap_missing;
+	}
 	// We want all columns of the sort data, plus all the columns needed for restriction, plus the ID of the row
 	if (lpsSortOrderArray != nullptr)
 		sPropTagArray.__size = lpsSortOrderArray->__size; // sort columns
@@ -797,6 +845,11 @@ ECRESULT ECGenericObjectTable::AddRowKey(ECObjectTableList* lpRows, unsigned int
 	}
 
 	sPropTagArray.__size = n;
+	if (rt != nullptr) {
+		er = prog.Compile(rt, m_locale, &sPropTagArray);
+		if (er != erSuccess)
+			goto exit;
+	}
 
 	for (auto iterRows = lpRows->cbegin(); iterRows != lpRows->cend(); ) {
 		sQueryRows.clear();
@@ -818,10 +871,43 @@ ECRESULT ECGenericObjectTable::AddRowKey(ECObjectTableList* lpRows, unsigned int
 				goto exit;
 		}
 
+		// Collate the string sort columns of all rows at once
+		std::vector<std::vector<std::string>> strkeys;
+		std::vector<const std::string *> rowstrkeys;
+		if (rt == nullptr && m_ulCategories == 0 && lpsSortOrderArray != nullptr) {
+			strkeys.resize(lpsSortOrderArray->__size);
+			rowstrkeys.resize(lpsSortOrderArray->__size);
+			for (gsoap_size_t c = 0; c < lpsSortOrderArray->__size; ++c) {
+				auto type = PROP_TYPE(lpsSortOrderArray->__ptr[c].ulPropTag);
+				if (type != PT_STRING8 && type != PT_UNICODE)
+					continue;
+				std::vector<const char *> column(lpRowSet->__size);
+				for (gsoap_size_t i = 0; i < lpRowSet->__size; ++i) {
+					const auto &row = lpRowSet->__ptr[i];
+					if (row.__size <= static_cast<gsoap_size_t>(ulFirstCol + c))
+						continue;
+					const auto &prop = row.__ptr[ulFirstCol+c];
+					auto ptype = PROP_TYPE(prop.ulPropTag);
+					if (ptype == PT_STRING8 || ptype == PT_UNICODE)
+						column[i] = prop.Value.lpszA;
+				}
+				strkeys[c] = createSortKeyDataFromUTF8(column, 255, m_locale);
+			}
+		}
+
 		// Send all this data to the internal key table
 		auto cache = lpSession->GetSessionManager()->GetCacheManager();
 		for (gsoap_size_t i = 0; i < lpRowSet->__size; ++i) {
 			lpCategory = NULL;
+			for (size_t c = 0; c < rowstrkeys.size(); ++c) {
+				rowstrkeys[c] = nullptr;
+				if (strkeys[c].empty() || lpRowSet->__ptr[i].__size <= static_cast<gsoap_size_t>(ulFirstCol + c))
+					continue;
+				const auto &prop = lpRowSet->__ptr[i].__ptr[ulFirstCol+c];
+				auto ptype = PROP_TYPE(prop.ulPropTag);
+				if ((ptype == PT_STRING8 || ptype == PT_UNICODE) && prop.Value.lpszA != nullptr)
+					rowstrkeys[c] = &strkeys[c][i];
+			}
 
 			if (lpRowSet->__ptr[i].__ptr[0].ulPropTag != PR_INSTANCE_KEY) // Row completely not found
 				continue;
@@ -831,7 +917,7 @@ ECRESULT ECGenericObjectTable::AddRowKey(ECObjectTableList* lpRows, unsigned int
 
 			// Match the row with the restriction, if any
 			if (rt != nullptr) {
-				MatchRowRestrict(cache, &lpRowSet->__ptr[i], rt, &sub_results, m_locale, &fMatch);
+				prog.Match(cache, &lpRowSet->__ptr[i], &sub_results, &fMatch);
 				if (!fMatch) {
 					// this row isn't in the table, as it does not match the restrict criteria. Remove it as if it had
 					// been deleted if it was already in the table.
@@ -851,7 +937,15 @@ ECRESULT ECGenericObjectTable::AddRowKey(ECObjectTableList* lpRows, unsigned int
 			}
 
 			// Put the row into the key table and send notification if required
-			AddRow(sRowItem, lpRowSet->__ptr[i].__ptr+ulFirstCol, lpsSortOrderArray->__size, ulFlags, fHidden, lpCategory);
+			if (snap != nullptr) {
+				std::vector<ECSortCol> keys;
+				AddRow(sRowItem, lpRowSet->__ptr[i].__ptr+ulFirstCol, lpsSortOrderArray->__size, ulFlags, fHidden, lpCategory, &keys,
+				       rowstrkeys.empty() ? nullptr : rowstrkeys.data());
+				snap_new.emplace(sRowItem, std::move(keys));
+			} else {
+				AddRow(sRowItem, lpRowSet->__ptr[i].__ptr+ulFirstCol, lpsSortOrderArray->__size, ulFlags, fHidden, lpCategory,
+				       nullptr, rowstrkeys.empty() ? nullptr : rowstrkeys.data());
+			}
 			// Loaded one row
 			++ulLoaded;
 		}
@@ -860,6 +954,8 @@ ECRESULT ECGenericObjectTable::AddRowKey(ECObjectTableList* lpRows, unsigned int
 		lpRowSet = NULL;
 	}
 
+	if (snap != nullptr)
+		snapshots->put(snap_key, snap_gen, std::move(snap_new), snap_hits);
 	if(lpulLoaded)
 		*lpulLoaded = ulLoaded;
 exit:
@@ -873,19 +969,34 @@ exit:
 }
 
 // Actually add a row to the table
-ECRESULT ECGenericObjectTable::AddRow(sObjectTableKey sRowItem, struct propVal *lpProps, unsigned int cProps, unsigned int ulFlags, bool fHidden, ECCategory *lpCategory)
+ECRESULT ECGenericObjectTable::AddRow(sObjectTableKey sRowItem, struct propVal *lpProps, unsigned int cProps, unsigned int ulFlags, bool fHidden, ECCategory *lpCategory, std::vector<ECSortCol> *lpKeys, const std::string *const *lpStrKeys)
 {
 	ECRESULT er = erSuccess;
     ECKeyTable::UpdateType ulAction;
     sObjectTableKey sPrevRow;
 
-	UpdateKeyTableRow(lpCategory, &sRowItem, lpProps, cProps, fHidden, &sPrevRow, &ulAction);
+	UpdateKeyTableRow(lpCategory, &sRowItem, lpProps, cProps, fHidden, &sPrevRow, &ulAction, lpKeys, lpStrKeys);
     // Send notification if required
 	if (ulAction != 0 && !fHidden && (ulFlags & OBJECTTABLE_NOTIFY))
 		er = AddTableNotif(ulAction, sRowItem, &sPrevRow);
 	return er;
 }
 
+ECRESULT ECGenericObjectTable::AddRow(sObjectTableKey sRowItem,
+    std::vector<ECSortCol> &&keys, unsigned int ulFlags)
+{
+	ECKeyTable::UpdateType ulAction;
+	sObjectTableKey sPrevRow;
+
+	auto er = lpKeyTable->UpdateRow(ECKeyTable::TABLE_ROW_ADD, &sRowItem,
+	          std::move(keys), &sPrevRow, false, &ulAction);
+	if (er != erSuccess)
+		return er;
+	if (ulAction != 0 && (ulFlags & OBJECTTABLE_NOTIFY))
+		er = AddTableNotif(ulAction, sRowItem, &sPrevRow);
+	return er;
+}
+
 // Actually remove a row from the table
 ECRESULT ECGenericObjectTable::DeleteRow(sObjectTableKey sRow, unsigned int ulFlags)
 {
@@ -1509,6 +1620,7 @@ ECRESULT ECGenericObjectTable::GetRestrictPropTags(const struct restrictTable *l
 
 // Simply matches the restriction with the given data. Make sure you pass all the data
 // needed for the restriction in lpPropVals. (missing columns do not match, ever.)
+// To match many rows against the same restriction, use ECCompiledRestriction.
 ECRESULT ECGenericObjectTable::MatchRowRestrict(ECCacheManager *lpCacheManager,
     propValArray *lpPropVals, const struct restrictTable *lpsRestrict,
     const SUBRESTRICTIONRESULTS *lpSubResults, const ECLocale &locale,
@@ -2267,7 +2379,7 @@ ECRESULT ECGenericObjectTable::UpdateCategoryMinMax(sObjectTableKey &sKey,
  * @param lpulAction Action performed
  * @return result
  */
-ECRESULT ECGenericObjectTable::UpdateKeyTableRow(ECCategory *lpCategory, sObjectTableKey *lpsRowKey, struct propVal *lpProps, unsigned int cValues, bool fHidden, sObjectTableKey *lpsPrevRow, ECKeyTable::UpdateType *lpulAction)
+ECRESULT ECGenericObjectTable::UpdateKeyTableRow(ECCategory *lpCategory, sObjectTableKey *lpsRowKey, struct propVal *lpProps, unsigned int cValues, bool fHidden, sObjectTableKey *lpsPrevRow, ECKeyTable::UpdateType *lpulAction, std::vector<ECSortCol> *lpKeys, const std::string *const *lpStrKeys)
 {
 	ECRESULT er = erSuccess;
     struct propVal sProp;
@@ -2294,7 +2406,11 @@ ECRESULT ECGenericObjectTable::UpdateKeyTableRow(ECCategory *lpCategory, sObject
 		cValues = 1;
 		lpProps = &sProp;
 		soa = &sSortSimple;
+		lpStrKeys = nullptr;
     }
+	/* Outside categories, column i of lpProps is sort column i */
+	if (lpCategory != nullptr)
+		lpStrKeys = nullptr;
 
 	auto lpOrderedProps = std::make_unique<propVal[]>(cValues);
 	std::vector<ECSortCol> zort(cValues);
@@ -2324,7 +2440,9 @@ ECRESULT ECGenericObjectTable::UpdateKeyTableRow(ECCategory *lpCategory, sObject
 
     // Build binary sort keys from updated data
     for (int i = 0; i < n; ++i) {
-		if (GetBinarySortKey(&lpOrderedProps[i], zort[i]) != erSuccess)
+		if (lpStrKeys != nullptr && lpStrKeys[i] != nullptr)
+			zort[i].key = *lpStrKeys[i];
+		else if (GetBinarySortKey(&lpOrderedProps[i], zort[i]) != erSuccess)
 			zort[i].isnull = true;
 		if (GetSortFlags(lpOrderedProps[i].ulPropTag, &zort[i].flags) != erSuccess)
 			zort[i].flags = 0;
@@ -2332,6 +2450,8 @@ ECRESULT ECGenericObjectTable::UpdateKeyTableRow(ECCategory *lpCategory, sObject
 			zort[i].flags |= TABLEROW_FLAG_DESC;
     }
 
+	if (lpKeys != nullptr)
+		*lpKeys = zort;
     // Update row
 	er = lpKeyTable->UpdateRow(ECKeyTable::TABLE_ROW_ADD, lpsRowKey,
 	     std::move(zort), lpsPrevRow, fHidden, lpulAction);
@@ -2440,9 +2560,8 @@ ECRESULT ECGenericObjectTable::RemoveCategoryAfterRemoveRow(sObjectTableKey sObj
 			}
 			continue;
 		}
-		// The category row is empty and must be removed
-		ECTableRow *lpRow = NULL; // reference to the row in the keytable
-		er = lpKeyTable->GetRow(&sCatRow, &lpRow);
+		// The category row is empty and must be removed from the keytable
+		er = lpKeyTable->UpdateRow(ECKeyTable::TABLE_ROW_DELETE, &sCatRow, {}, nullptr, false, &ulAction);
 		if (er != erSuccess) {
 			assert(false);
 			goto exit;
@@ -2450,8 +2569,6 @@ ECRESULT ECGenericObjectTable::RemoveCategoryAfterRemoveRow(sObjectTableKey sObj
 
 		// Remove the category from the sorted categories map
 		m_mapSortedCategories.erase(lpCategory->iSortedCategory);
-		// Remove the category from the keytable
-		lpKeyTable->UpdateRow(ECKeyTable::TABLE_ROW_DELETE, &sCatRow, {}, nullptr, false, &ulAction);
 		// Remove the category from the category map
 		assert(m_mapCategories.find(sCatRow) != m_mapCategories.end());
 		m_mapCategories.erase(sCatRow);
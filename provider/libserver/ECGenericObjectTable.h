@@ -37,6 +37,7 @@ typedef std::list<unsigned int>::const_iterator ECListIntIterator;
 
 class ECSession;
 class ECCacheManager;
+struct ECTableSnapshotKey;
 
 typedef std::map<ECTableRow, sObjectTableKey> ECSortedCategoryMap;
 
@@ -157,13 +158,15 @@ public:
 
 protected:
 	// Add an actual row to the table, and send a notification if required. If you add an existing row, the row is modified and the notification is send as a modification
-	ECRESULT AddRow(sObjectTableKey sRowItem, struct propVal *lpProps, unsigned int cProps, unsigned int ulFlags, bool fHidden, ECCategory *lpCategory);
+	ECRESULT AddRow(sObjectTableKey sRowItem, struct propVal *lpProps, unsigned int cProps, unsigned int ulFlags, bool fHidden, ECCategory *lpCategory, std::vector<ECSortCol> *lpKeys = nullptr, const std::string *const *lpStrKeys = nullptr);
+	// Same, with sort keys that were computed before
+	ECRESULT AddRow(sObjectTableKey sRowItem, std::vector<ECSortCol> &&keys, unsigned int ulFlags);
 	// Remove an actual row from the table, and send a notification if required. You may try to delete non-existing rows, in which case nothing happens
 	ECRESULT 	DeleteRow(sObjectTableKey sRow, unsigned int ulFlags);
 	// Send a notification by getting row data and adding the notification
 	ECRESULT 	AddTableNotif(ECKeyTable::UpdateType, sObjectTableKey sRowItem, sObjectTableKey *lpsPrevRow);
 	// Add data to key table
-	ECRESULT 	UpdateKeyTableRow(ECCategory *lpCategory, sObjectTableKey *lpsRowKey, struct propVal *lpProps, unsigned int cValues, bool fHidden, sObjectTableKey *sPrevRow, ECKeyTable::UpdateType *lpulAction);
+	ECRESULT 	UpdateKeyTableRow(ECCategory *lpCategory, sObjectTableKey *lpsRowKey, struct propVal *lpProps, unsigned int cValues, bool fHidden, sObjectTableKey *sPrevRow, ECKeyTable::UpdateType *lpulAction, std::vector<ECSortCol> *lpKeys = nullptr, const std::string *const *lpStrKeys = nullptr);
 	// Update min/max field for category
 	ECRESULT 	UpdateCategoryMinMax(sObjectTableKey& lpKey, ECCategory *lpCategory, size_t i, struct propVal *lpProps, size_t cProps, bool *lpfModified);
 
@@ -174,11 +177,13 @@ protected:
 	virtual ECRESULT ReloadTable(enumReloadType eType);
 	virtual ECRESULT	Load();
 	virtual ECRESULT CheckPermissions(unsigned int objid) { return hrSuccess; } /* normally overridden by subclass */
+	/* The shared view whose sort keys this table may use, if any */
+	virtual bool GetSnapshotKey(ECTableSnapshotKey *) { return false; }
 	const ECLocale &GetLocale() const { return m_locale; }
 
 	// Constants
 	ECSession*					lpSession;
-	std::unique_ptr<ECKeyTable> lpKeyTable;
+	std::unique_ptr<ECKeyTableBase> lpKeyTable;
 	unsigned int m_ulTableId = -1; /* id of the table from ECTableManager */
 	const void *m_lpObjectData = nullptr;
 	std::recursive_mutex m_hLock; /* Lock for locked internals */
@@ -22,6 +22,7 @@
 #include "ECICS.h"
 #include "ECICSHelpers.h"
 #include "ECMAPI.h"
+#include "ECMaintenance.h"
 #include "soapH.h"
 #include "SOAPUtils.h"
 
@@ -46,6 +47,9 @@ inline ABChangeRecord::ABChangeRecord(ULONG _id, const std::string &_strItem, co
 
 typedef std::list<ABChangeRecord> ABChangeRecordList;
 
+/* Upper bound for the number of changes in one page of GetChangesPage */
+static constexpr unsigned int ics_max_page_size = 50000;
+
 static bool isICSChange(unsigned int ulChange)
 {
 	switch(ulChange){
@@ -315,75 +319,103 @@ exit:
 	return er;
 }
 
-void* CleanupSyncsTable(void* lpTmpMain){
-	kcsrv_blocksigs();
-	ECDatabase*		lpDatabase = NULL;
-	ECSession*		lpSession = NULL;
-	unsigned int	ulDeletedSyncs = 0;
-
-	ec_log_info("Start syncs table clean up");
+namespace {
 
-	auto ulSyncLifeTime = atoui(g_lpSessionManager->GetConfig()->GetSetting("sync_lifetime"));
-	if (ulSyncLifeTime == 0) {
-		ec_log_info("syncs table clean up done: removed syncs: 0");
-		return nullptr;
-	}
-	auto er = g_lpSessionManager->CreateSessionInternal(&lpSession);
-	if (er != erSuccess) {
-		kc_perror("syncs table clean up failed", er);
-		return nullptr;
+/* Removes syncs that have not been used for sync_lifetime days */
+class SyncsCleanupTask final : public ECMaintenanceTask {
+	public:
+	SyncsCleanupTask(unsigned int lifetime) :
+		m_cutoff("DATE_SUB(FROM_UNIXTIME(" + stringify(time(nullptr)) + "), INTERVAL " + stringify(lifetime) + " DAY)")
+	{}
+	const char *name() const override { return "syncs"; }
+	ECRESULT chunk(ECSession *, ECDatabase *db, unsigned int batch, unsigned int &pos, unsigned int &done) override
+	{
+		unsigned int end = 0, n = 0;
+		auto er = range_end(db, "syncs", "id", pos, batch, &end);
+		if (er != erSuccess || end == pos)
+			return er;
+		er = db->DoDelete("DELETE FROM syncs WHERE id>" + stringify(pos) +
+		     " AND id<=" + stringify(end) + " AND sync_time<" + m_cutoff, &n);
+		if (er != erSuccess)
+			return er;
+		pos = end;
+		done += n;
+		return erSuccess;
 	}
-	std::unique_lock<ECSession> holder(*lpSession);
-	er = lpSession->GetDatabase(&lpDatabase);
-	if (er != erSuccess) {
-		kc_perror("syncs table clean up failed", er);
-		return nullptr;
+
+	private:
+	std::string m_cutoff;
+};
+
+/* Removes syncedmessages rows of syncs that no longer exist */
+class SyncedMessagesCleanupTask final : public ECMaintenanceTask {
+	public:
+	const char *name() const override { return "syncedmessages"; }
+	ECRESULT chunk(ECSession *, ECDatabase *db, unsigned int batch, unsigned int &pos, unsigned int &done) override
+	{
+		unsigned int end = 0, n = 0;
+		auto er = range_end(db, "syncedmessages", "sync_id", pos, batch, &end);
+		if (er != erSuccess || end == pos)
+			return er;
+		er = db->DoDelete("DELETE syncedmessages.* FROM syncedmessages "
+		     "LEFT JOIN syncs ON syncs.id = syncedmessages.sync_id " /* join with syncs */
+		     "WHERE syncs.id IS NULL " /* with no existing sync, and therefore not being tracked */
+		     "AND syncedmessages.sync_id>" + stringify(pos) +
+		     " AND syncedmessages.sync_id<=" + stringify(end), &n);
+		if (er != erSuccess)
+			return er;
+		pos = end;
+		done += n;
+		return erSuccess;
 	}
-	auto strQuery = "DELETE FROM syncs WHERE sync_time < DATE_SUB(FROM_UNIXTIME(" + stringify(time(nullptr)) + "), INTERVAL " + stringify(ulSyncLifeTime) + " DAY)";
-	er = lpDatabase->DoDelete(strQuery, &ulDeletedSyncs);
-	if(er == erSuccess)
-		ec_log_info("syncs table clean up done: removed syncs: %d", ulDeletedSyncs);
-	else
-		ec_log_err("syncs table clean up failed: %s (%x), removed syncs: %d",
-			GetMAPIErrorMessage(kcerr_to_mapierr(er)), er, ulDeletedSyncs);
-	holder.unlock();
-	g_lpSessionManager->RemoveSessionInternal(lpSession);
-	// ECScheduler does nothing with the returned value
-	return NULL;
+};
+
 }
 
-void *CleanupSyncedMessagesTable(void *lpTmpMain)
+static void cleanup_table(ECMaintenanceTask &task, const bool *exit)
 {
-	kcsrv_blocksigs();
-	ECDatabase*		lpDatabase = NULL;
-	ECSession*		lpSession = NULL;
+	ECSession *lpSession = nullptr;
 	unsigned int ulDeleted = 0;
 
-	ec_log_info("Start syncedmessages table clean up");
+	ec_log_info("Start %s table clean up", task.name());
 	auto er = g_lpSessionManager->CreateSessionInternal(&lpSession);
 	if (er != erSuccess) {
-		kc_perror("syncedmessages table clean up failed", er);
-		return nullptr;
+		ec_log_err("%s table clean up failed: %s (%x)", task.name(),
+			GetMAPIErrorMessage(kcerr_to_mapierr(er)), er);
+		return;
 	}
 	std::unique_lock<ECSession> holder(*lpSession);
-	er = lpSession->GetDatabase(&lpDatabase);
-	if (er != erSuccess) {
-		kc_perror("syncedmessages table clean up failed", er);
-		return nullptr;
-	}
-	auto strQuery = "DELETE syncedmessages.* FROM syncedmessages "
-                 "LEFT JOIN syncs ON syncs.id = syncedmessages.sync_id " 	/* join with syncs */
-                 "WHERE syncs.id IS NULL";									/* with no existing sync, and therefore not being tracked */
-	er = lpDatabase->DoDelete(strQuery, &ulDeleted);
-	if(er == erSuccess)
-		ec_log_info("syncedmessages table clean up done, %d entries removed", ulDeleted);
+	er = ECMaintenance(lpSession, exit, true).run(task, &ulDeleted);
+	if (er == erSuccess)
+		ec_log_info("%s table clean up done: %u entries removed", task.name(), ulDeleted);
+	else if (er == KCERR_BUSY)
+		ec_log_info("%s table clean up already running", task.name());
 	else
-		ec_log_err("syncedmessages table clean up failed: %s (%x), %d entries removed",
+		ec_log_err("%s table clean up failed: %s (%x), %u entries removed", task.name(),
 			GetMAPIErrorMessage(kcerr_to_mapierr(er)), er, ulDeleted);
 	holder.unlock();
 	g_lpSessionManager->RemoveSessionInternal(lpSession);
+}
+
+void *CleanupSyncsTable(void *lpTmpMain)
+{
+	kcsrv_blocksigs();
+	auto ulSyncLifeTime = atoui(g_lpSessionManager->GetConfig()->GetSetting("sync_lifetime"));
+	if (ulSyncLifeTime == 0)
+		return nullptr;
+	SyncsCleanupTask task(ulSyncLifeTime);
+	cleanup_table(task, static_cast<bool *>(lpTmpMain));
 	// ECScheduler does nothing with the returned value
-	return NULL;
+	return nullptr;
+}
+
+void *CleanupSyncedMessagesTable(void *lpTmpMain)
+{
+	kcsrv_blocksigs();
+	SyncedMessagesCleanupTask task;
+	cleanup_table(task, static_cast<bool *>(lpTmpMain));
+	// ECScheduler does nothing with the returned value
+	return nullptr;
 }
 
 static ECRESULT getchanges_nab(ECSession *lpSession, ECDatabase *lpDatabase,
@@ -473,23 +505,18 @@ static ECRESULT getchanges_nab(ECSession *lpSession, ECDatabase *lpDatabase,
 	return KCERR_INVALID_TYPE;
 }
 
-static ECRESULT getchanges_contents(struct soap *soap, ECSession *lpSession, ECDatabase *lpDatabase, const SOURCEKEY &sFolderSourceKey, unsigned int ulSyncId, unsigned int ulChangeId, unsigned int ulFlags, const struct restrictTable *lpsRestrict, unsigned int &ulMaxChange, icsChangesArray *&lpChanges)
+static ECRESULT getchanges_contents(ECGetContentChangesHelper *lpHelper,
+    unsigned int &ulMaxChange, icsChangesArray *&lpChanges)
 {
-	std::unique_ptr<ECGetContentChangesHelper> lpHelper;
-	auto er = ECGetContentChangesHelper::Create(soap, lpSession,
-	          lpDatabase, sFolderSourceKey, ulSyncId, ulChangeId,
-	          ulFlags, lpsRestrict, &unique_tie(lpHelper));
-	if (er != erSuccess)
-		return er;
 	DB_RESULT lpDBResult;
 	DB_ROW lpDBRow;
-	er = lpHelper->QueryDatabase(&lpDBResult);
+	auto er = lpHelper->QueryDatabase(&lpDBResult);
 	if (er != erSuccess)
 		return er;
 
 	std::vector<DB_ROW> db_rows;
 	std::vector<DB_LENGTHS> db_lengths;
-	static constexpr unsigned int ncols = 7;
+	static constexpr unsigned int ncols = 8;
 	unsigned long col_lengths[1000*ncols];
 	unsigned int length_counter = 0;
 
@@ -527,6 +554,64 @@ static ECRESULT getchanges_contents(struct soap *soap, ECSession *lpSession, ECD
 	return lpHelper->Finalize(&ulMaxChange, &lpChanges);
 }
 
+/**
+ * Return one page of at most @page_size content changes.
+ *
+ * The rows are streamed from the database and only the changes of the
+ * page are kept, so the memory needed does not depend on the folder size.
+ * The first page (@cursor 0) updates the sync state like a full
+ * GetChanges would and determines the max change ID; the later pages are
+ * bounded by that ID (@page_max) so that the whole set of pages matches
+ * the state the client ends up with. @next_cursor is set to the
+ * position to continue from, or 0 after the last page.
+ *
+ * Syncs that have a restriction, or had one the previous time, need to
+ * see all rows at once to compute the new set of synced messages. Those
+ * are returned as a single, final page.
+ */
+static ECRESULT getchanges_contents_page(ECGetContentChangesHelper *lpHelper,
+    unsigned int cursor, unsigned int page_max, unsigned int page_size,
+    unsigned int &ulMaxChange, unsigned int &next_cursor,
+    icsChangesArray *&lpChanges)
+{
+	next_cursor = 0;
+	if (!lpHelper->Pageable()) {
+		if (cursor != 0)
+			return KCERR_INVALID_PARAMETER;
+		return getchanges_contents(lpHelper, ulMaxChange, lpChanges);
+	}
+
+	DB_RESULT lpDBResult;
+	DB_ROW lpDBRow;
+	unsigned int nrows = 0, last = 0;
+	auto er = lpHelper->QueryPage(cursor, page_max, page_size, &lpDBResult);
+	if (er != erSuccess)
+		return er;
+	while (lpDBResult && (lpDBRow = lpDBResult.fetch_row()) != nullptr) {
+		auto lpDBLen = lpDBResult.fetch_row_lengths();
+		if (lpDBLen == NULL)
+			continue;
+		if (lpDBRow[icsSourceKey] == NULL || lpDBRow[icsParentSourceKey] == NULL ||
+		    lpDBRow[icsCursor] == NULL) {
+			ec_log_err("K-1206: Received NULL values from SQL");
+			return KCERR_DATABASE_ERROR;
+		}
+		++nrows;
+		last = atoui(lpDBRow[icsCursor]);
+		er = lpHelper->ProcessRow(lpDBRow, lpDBLen);
+		if (er != erSuccess)
+			return er;
+	}
+	/* Finalize needs the connection; release the streamed result first */
+	lpDBResult = DB_RESULT();
+	if (nrows == page_size)
+		next_cursor = last;
+	if (cursor == 0)
+		return lpHelper->Finalize(&ulMaxChange, &lpChanges);
+	ulMaxChange = page_max;
+	return lpHelper->FinalizePage(&lpChanges);
+}
+
 static ECRESULT getchanges_hier1(struct soap *soap, ECDatabase *lpDatabase, const std::list<unsigned int> &lstFolderIds, unsigned int ulFolderId, unsigned int ulFlags, unsigned int &ulMaxChange, struct icsChangesArray *&lpChanges)
 {
 	if (ulFolderId == 0 && (ulFlags & SYNC_CATCHUP) == 0)
@@ -895,12 +980,38 @@ static ECRESULT getchanges_ab(struct soap *soap, ECSession *lpSession,
 }
 
 ECRESULT GetChanges(struct soap *soap, ECSession *lpSession, SOURCEKEY sFolderSourceKey, unsigned int ulSyncId, unsigned int ulChangeId, unsigned int ulChangeType, unsigned int ulFlags, struct restrictTable *lpsRestrict, unsigned int *lpulMaxChangeId, icsChangesArray **lppChanges){
+	unsigned int next_cursor = 0;
+	return GetChangesPage(soap, lpSession, std::move(sFolderSourceKey),
+	       ulSyncId, ulChangeId, ulChangeType, ulFlags, lpsRestrict, 0, 0,
+	       0, lpulMaxChangeId, &next_cursor, lppChanges);
+}
+
+/**
+ * GetChanges, but for content syncs the changes are returned in pages of
+ * at most @page_size entries (0 meaning all at once). Pass @cursor and
+ * @page_max as 0 for the first page; for the following pages, pass the
+ * *@next_cursor and *@lpulMaxChangeId values that the first page
+ * returned, until *@next_cursor is 0.
+ */
+ECRESULT GetChangesPage(struct soap *soap, ECSession *lpSession,
+    SOURCEKEY sFolderSourceKey, unsigned int ulSyncId, unsigned int ulChangeId,
+    unsigned int ulChangeType, unsigned int ulFlags,
+    struct restrictTable *lpsRestrict, unsigned int cursor,
+    unsigned int page_max, unsigned int page_size,
+    unsigned int *lpulMaxChangeId, unsigned int *next_cursor,
+    icsChangesArray **lppChanges)
+{
 	ECDatabase*		lpDatabase = NULL;
 	unsigned int ulMaxChange = 0, ulFolderId = 0;
 	icsChangesArray*lpChanges = NULL;
 	bool			bAcceptABEID = false;
 
-	ec_log(EC_LOGLEVEL_ICS, "K-1200: sourcekey=%s, syncid=%d, changetype=%d, flags=%d", bin2hex(sFolderSourceKey).c_str(), ulSyncId, ulChangeType, ulFlags);
+	*next_cursor = 0;
+	if (page_size > ics_max_page_size)
+		page_size = ics_max_page_size;
+	else if (page_size == 0 && cursor != 0)
+		return KCERR_INVALID_PARAMETER;
+	ec_log(EC_LOGLEVEL_ICS, "K-1200: sourcekey=%s, syncid=%d, changetype=%d, flags=%d, cursor=%u", bin2hex(sFolderSourceKey).c_str(), ulSyncId, ulChangeType, ulFlags, cursor);
 	auto gcache = g_lpSessionManager->GetCacheManager();
     // Get database object
 	auto er = lpSession->GetDatabase(&lpDatabase);
@@ -920,10 +1031,22 @@ ECRESULT GetChanges(struct soap *soap, ECSession *lpSession, SOURCEKEY sFolderSo
 	}
 
 	if(ulChangeType == ICS_SYNC_CONTENTS){
-		er = getchanges_contents(soap, lpSession, lpDatabase, sFolderSourceKey, ulSyncId, ulChangeId, ulFlags, lpsRestrict, ulMaxChange, lpChanges);
+		std::unique_ptr<ECGetContentChangesHelper> lpHelper;
+		er = ECGetContentChangesHelper::Create(soap, lpSession,
+		     lpDatabase, sFolderSourceKey, ulSyncId, ulChangeId,
+		     ulFlags, lpsRestrict, &unique_tie(lpHelper));
 		if (er != erSuccess)
 			return er;
-		// Do stuff with lppChanges etc.
+		if (page_size > 0)
+			er = getchanges_contents_page(lpHelper.get(), cursor,
+			     page_max, page_size, ulMaxChange, *next_cursor, lpChanges);
+		else
+			er = getchanges_contents(lpHelper.get(), ulMaxChange, lpChanges);
+		if (er != erSuccess)
+			return er;
+	} else if (cursor != 0) {
+		/* Hierarchy and addressbook changes always come in one page */
+		return KCERR_INVALID_PARAMETER;
 	}else if(ulChangeType == ICS_SYNC_HIERARCHY){
 		er = getchanges_hier(soap, lpSession, gcache, lpDatabase, ulSyncId, ulChangeId, ulFolderId, ulFlags, ulMaxChange, lpChanges);
 		if (er != erSuccess)
@@ -103,6 +103,7 @@ private:
 ECRESULT AddChange(BTSession *lpecSession, unsigned int ulSyncId, const SOURCEKEY &sSourceKey, const SOURCEKEY &sParentSourceKey, unsigned int ulChange, unsigned int ulFlags = 0, bool fForceNewChangeKey = false, std::string *lpstrChangeKey = NULL, std::string *lpstrChangeList = NULL);
 ECRESULT AddABChange(BTSession *lpecSession, unsigned int ulChange, SOURCEKEY sSourceKey, SOURCEKEY sParentSourceKey);
 ECRESULT GetChanges(struct soap *soap, ECSession *lpSession, SOURCEKEY sSourceKeyFolder, unsigned int ulSyncId, unsigned int ulChangeId, unsigned int ulChangeType, unsigned int ulFlags, struct restrictTable *lpsRestrict, unsigned int *lpulMaxChangeId, icsChangesArray **lppChanges);
+ECRESULT GetChangesPage(struct soap *, ECSession *, SOURCEKEY folder, unsigned int sync_id, unsigned int change_id, unsigned int change_type, unsigned int flags, struct restrictTable *, unsigned int cursor, unsigned int page_max, unsigned int page_size, unsigned int *max_change, unsigned int *next_cursor, icsChangesArray **);
 ECRESULT GetSyncStates(struct soap *soap, ECSession *lpSession, mv_long ulaSyncId, syncStateArray *lpsaSyncState);
 extern _kc_export void *CleanupSyncsTable(void *);
 extern _kc_export void *CleanupSyncedMessagesTable(void *);
@@ -11,6 +11,7 @@
 #include "ics.h"
 #include "ECStoreObjectTable.h"
 #include "ECICSHelpers.h"
+#include "ECCompiledRestriction.h"
 #include "ECSessionManager.h"
 #include "ECMAPI.h"
 #include <mapidefs.h>
@@ -32,6 +33,12 @@ class IDbQueryCreator {
 public:
 	virtual ~IDbQueryCreator(void) = default;
 	virtual std::string CreateQuery() const = 0;
+	/*
+	 * Like CreateQuery, but only returns the first @limit rows after
+	 * position @cursor (0 being the start), and no changes beyond
+	 * @max_change.
+	 */
+	virtual std::string CreatePageQuery(unsigned int cursor, unsigned int max_change, unsigned int limit) const = 0;
 };
 
 /**
@@ -43,10 +50,13 @@ public:
 	CommonQueryCreator(unsigned int ulFlags);
 	// IDbQueryCreator
 	std::string CreateQuery() const override;
+	std::string CreatePageQuery(unsigned int cursor, unsigned int max_change, unsigned int limit) const override;
 
 private:
 	virtual std::string CreateBaseQuery() const = 0;
+	virtual std::string CreateCursorQuery(unsigned int cursor, unsigned int max_change) const = 0;
 	virtual std::string CreateOrderQuery() const = 0;
+	std::string CreateFilterQuery() const;
 
 	unsigned int m_ulFlags;
 };
@@ -61,11 +71,33 @@ std::string CommonQueryCreator::CreateQuery() const
 
 	if (strQuery.empty())
 		return strQuery;
+	strQuery += CreateFilterQuery();
+	strQuery += CreateOrderQuery();
+	return strQuery;
+}
+
+std::string CommonQueryCreator::CreatePageQuery(unsigned int cursor,
+    unsigned int max_change, unsigned int limit) const
+{
+	std::string strQuery = CreateBaseQuery();
+
+	if (strQuery.empty())
+		return strQuery;
+	strQuery += CreateCursorQuery(cursor, max_change);
+	strQuery += CreateFilterQuery();
+	strQuery += CreateOrderQuery();
+	strQuery += " LIMIT " + stringify(limit);
+	return strQuery;
+}
+
+std::string CommonQueryCreator::CreateFilterQuery() const
+{
+	std::string strQuery;
+
 	if ((m_ulFlags & SYNC_ASSOCIATED) == 0)
 		strQuery += " AND (ISNULL(hierarchy.flags) OR hierarchy.flags & " + stringify(MSGFLAG_ASSOCIATED) + " = 0) ";
 	if ((m_ulFlags & SYNC_NORMAL) == 0)
 		strQuery += " AND (ISNULL(hierarchy.flags) OR hierarchy.flags & " + stringify(MSGFLAG_ASSOCIATED) + " = " + stringify(MSGFLAG_ASSOCIATED) + ") ";
-	strQuery += CreateOrderQuery();
 	return strQuery;
 }
 
@@ -80,6 +112,7 @@ public:
 
 private:
 	std::string CreateBaseQuery() const override;
+	std::string CreateCursorQuery(unsigned int cursor, unsigned int max_change) const override;
 	std::string CreateOrderQuery() const override;
 
 	ECDatabase		*m_lpDatabase;
@@ -98,7 +131,7 @@ IncrementalQueryCreator::IncrementalQueryCreator(ECDatabase *lpDatabase, unsigne
 
 std::string IncrementalQueryCreator::CreateBaseQuery() const
 {
-	auto strQuery = "SELECT changes.id, changes.sourcekey, changes.parentsourcekey, changes.change_type, changes.flags, NULL, changes.sourcesync "
+	auto strQuery = "SELECT changes.id, changes.sourcekey, changes.parentsourcekey, changes.change_type, changes.flags, NULL, changes.sourcesync, changes.id "
 				"FROM changes "s;
 	if ((m_ulFlags & (SYNC_ASSOCIATED | SYNC_NORMAL)) != (SYNC_ASSOCIATED | SYNC_NORMAL))
 		strQuery +=	"LEFT JOIN indexedproperties ON indexedproperties.val_binary = changes.sourcekey AND indexedproperties.tag = " + stringify(PROP_ID(PR_SOURCE_KEY)) + " " +
@@ -121,6 +154,18 @@ std::string IncrementalQueryCreator::CreateBaseQuery() const
 	return strQuery;
 }
 
+/* Pages run in change order; the cursor is the last change ID seen. */
+std::string IncrementalQueryCreator::CreateCursorQuery(unsigned int cursor,
+    unsigned int max_change) const
+{
+	std::string strQuery;
+	if (cursor > 0)
+		strQuery += " AND changes.id > " + stringify(cursor);
+	if (max_change > 0)
+		strQuery += " AND changes.id <= " + stringify(max_change);
+	return strQuery;
+}
+
 std::string IncrementalQueryCreator::CreateOrderQuery() const
 {
 	return " ORDER BY changes.id";
@@ -137,6 +182,7 @@ public:
 
 private:
 	std::string CreateBaseQuery() const override;
+	std::string CreateCursorQuery(unsigned int cursor, unsigned int max_change) const override;
 	std::string CreateOrderQuery() const override;
 
 	ECDatabase		*m_lpDatabase;
@@ -154,7 +200,7 @@ FullQueryCreator::FullQueryCreator(ECDatabase *lpDatabase, const SOURCEKEY &sFol
 std::string FullQueryCreator::CreateBaseQuery() const
 {
 	assert(!m_sFolderSourceKey.empty());
-	auto strQuery = "SELECT changes.id as id, sourcekey.val_binary as sourcekey, parentsourcekey.val_binary, " + stringify(ICS_MESSAGE_NEW) + ", NULL, hierarchy.flags, changes.sourcesync "
+	auto strQuery = "SELECT changes.id as id, sourcekey.val_binary as sourcekey, parentsourcekey.val_binary, " + stringify(ICS_MESSAGE_NEW) + ", NULL, hierarchy.flags, changes.sourcesync, hierarchy.id "
 				"FROM hierarchy "
 				"JOIN indexedproperties as sourcekey ON sourcekey.hierarchyid = hierarchy.id AND sourcekey.tag=" + stringify(PROP_ID(PR_SOURCE_KEY)) + " "
 				"JOIN indexedproperties as parentsourcekey ON parentsourcekey.hierarchyid = hierarchy.parent AND parentsourcekey.tag=" + stringify(PROP_ID(PR_SOURCE_KEY)) +
@@ -167,6 +213,19 @@ std::string FullQueryCreator::CreateBaseQuery() const
 	return strQuery;
 }
 
+/*
+ * Pages run over the messages, newest first; the cursor is the last
+ * hierarchy ID seen. Messages created after the first page have a change
+ * beyond its max change ID and are picked up by the next sync.
+ */
+std::string FullQueryCreator::CreateCursorQuery(unsigned int cursor,
+    unsigned int max_change) const
+{
+	if (cursor == 0)
+		return std::string();
+	return " AND hierarchy.id < " + stringify(cursor);
+}
+
 std::string FullQueryCreator::CreateOrderQuery() const
 {
 	return " ORDER BY hierarchy.id DESC";
@@ -183,6 +242,7 @@ public:
 
 private:
 	std::string CreateBaseQuery() const override;
+	std::string CreateCursorQuery(unsigned int, unsigned int) const override { return std::string(); }
 	std::string CreateOrderQuery() const override;
 };
 
@@ -651,6 +711,56 @@ ECRESULT ECGetContentChangesHelper::QueryDatabase(DB_RESULT *lppDBResult)
 	return erSuccess;
 }
 
+/**
+ * Whether the changes can be handed out in pages. That is only the case
+ * when rows do not have to be checked against the previously synced set,
+ * and no new set has to be recorded: without legacy and without a
+ * restriction.
+ */
+bool ECGetContentChangesHelper::Pageable() const
+{
+	return m_lpsRestrict == nullptr && m_setLegacyMessages.empty();
+}
+
+/**
+ * Query one page of at most @limit rows, starting after @cursor. The
+ * result is streamed from the server, so the rows must be passed to
+ * ProcessRow one at a time, and no other query may be run on the database
+ * until the result has been released.
+ *
+ * @max_change:	the max change ID handed out with the first page, or 0
+ *		when this is the first page.
+ */
+ECRESULT ECGetContentChangesHelper::QueryPage(unsigned int cursor,
+    unsigned int max_change, unsigned int limit, DB_RESULT *lppDBResult)
+{
+	DB_RESULT lpDBResult;
+
+	assert(Pageable());
+	assert(m_lpQueryCreator != NULL);
+	auto strQuery = m_lpQueryCreator->CreatePageQuery(cursor,
+	                max_change != 0 ? max_change : m_ulMaxFolderChange, limit);
+	if (!strQuery.empty()) {
+		assert(m_lpDatabase != NULL);
+		auto er = m_lpDatabase->DoSelect(strQuery, &lpDBResult, true);
+		if (er != erSuccess)
+			return er;
+	}
+
+	m_lpChanges = (icsChangesArray*)soap_malloc(m_soap, sizeof *m_lpChanges);
+	m_lpChanges->__ptr = (icsChange*)soap_malloc(m_soap, sizeof *m_lpChanges->__ptr * (lpDBResult ? limit : 0));
+	m_lpChanges->__size = 0;
+	assert(lppDBResult != NULL);
+	*lppDBResult = std::move(lpDBResult);
+	return erSuccess;
+}
+
+ECRESULT ECGetContentChangesHelper::ProcessRow(DB_ROW lpDBRow, DB_LENGTHS lpDBLen)
+{
+	assert(m_lpsRestrict == NULL);
+	return AddRow(lpDBRow, lpDBLen, true);
+}
+
 ECRESULT ECGetContentChangesHelper::ProcessRows(const std::vector<DB_ROW> &db_rows, const std::vector<DB_LENGTHS> &db_lengths)
 {
 	ECRESULT		er = erSuccess;
@@ -663,7 +773,6 @@ ECRESULT ECGetContentChangesHelper::ProcessRows(const std::vector<DB_ROW> &db_ro
 			return er;
 	}
 
-	assert(m_lpMsgProcessor != NULL);
 	for (size_t i = 0; i < db_rows.size(); ++i) {
 		bool fMatch = true;
 		auto lpDBRow = db_rows[i];
@@ -671,36 +780,46 @@ ECRESULT ECGetContentChangesHelper::ProcessRows(const std::vector<DB_ROW> &db_ro
 
 		if (m_lpsRestrict != NULL)
 			fMatch = matches.find(SOURCEKEY(lpDBLen[icsSourceKey], lpDBRow[icsSourceKey])) != matches.end();
-
-		ec_log(EC_LOGLEVEL_ICS, "Processing: %s, match=%d", bin2hex(lpDBLen[icsSourceKey], lpDBRow[icsSourceKey]).c_str(), fMatch);
-		unsigned int ulChangeType = 0, ulFlags = 0;
-		if (fMatch) {
-			er = m_lpMsgProcessor->ProcessAccepted(lpDBRow, lpDBLen, &ulChangeType, &ulFlags);
-			if (m_lpsRestrict != NULL)
-				m_setNewMessages.emplace(SOURCEKEY(lpDBLen[icsSourceKey],
-					lpDBRow[icsSourceKey]), SAuxMessageData(SOURCEKEY(lpDBLen[icsParentSourceKey],
-					lpDBRow[icsParentSourceKey]), ICS_CHANGE_FLAG_NEW, ulFlags));
-		} else {
-			er = m_lpMsgProcessor->ProcessRejected(lpDBRow, lpDBLen, &ulChangeType);
-		}
+		er = AddRow(lpDBRow, lpDBLen, fMatch);
 		if (er != erSuccess)
 			return er;
+	}
+	return erSuccess;
+}
 
-		// If ulChangeType equals 0 we can skip this message
-		if (ulChangeType == 0)
-			continue;
-
-		m_lpChanges->__ptr[m_ulChangeCnt].ulChangeId = lpDBRow[icsID] ? atoui(lpDBRow[icsID]) : 0;
-		m_lpChanges->__ptr[m_ulChangeCnt].sSourceKey.__ptr = (unsigned char *)soap_malloc(m_soap, lpDBLen[icsSourceKey]);
-		m_lpChanges->__ptr[m_ulChangeCnt].sSourceKey.__size = lpDBLen[icsSourceKey];
-		memcpy(m_lpChanges->__ptr[m_ulChangeCnt].sSourceKey.__ptr, lpDBRow[icsSourceKey], lpDBLen[icsSourceKey]);
-		m_lpChanges->__ptr[m_ulChangeCnt].sParentSourceKey.__ptr = (unsigned char *)soap_malloc(m_soap, lpDBLen[icsParentSourceKey]);
-		m_lpChanges->__ptr[m_ulChangeCnt].sParentSourceKey.__size = lpDBLen[icsParentSourceKey];
-		memcpy(m_lpChanges->__ptr[m_ulChangeCnt].sParentSourceKey.__ptr, lpDBRow[icsParentSourceKey], lpDBLen[icsParentSourceKey]);
-		m_lpChanges->__ptr[m_ulChangeCnt].ulChangeType = ulChangeType;
-		m_lpChanges->__ptr[m_ulChangeCnt].ulFlags = ulFlags;
-		++m_ulChangeCnt;
+ECRESULT ECGetContentChangesHelper::AddRow(DB_ROW lpDBRow, DB_LENGTHS lpDBLen, bool fMatch)
+{
+	ECRESULT er;
+
+	assert(m_lpMsgProcessor != NULL);
+	ec_log(EC_LOGLEVEL_ICS, "Processing: %s, match=%d", bin2hex(lpDBLen[icsSourceKey], lpDBRow[icsSourceKey]).c_str(), fMatch);
+	unsigned int ulChangeType = 0, ulFlags = 0;
+	if (fMatch) {
+		er = m_lpMsgProcessor->ProcessAccepted(lpDBRow, lpDBLen, &ulChangeType, &ulFlags);
+		if (m_lpsRestrict != NULL)
+			m_setNewMessages.emplace(SOURCEKEY(lpDBLen[icsSourceKey],
+				lpDBRow[icsSourceKey]), SAuxMessageData(SOURCEKEY(lpDBLen[icsParentSourceKey],
+				lpDBRow[icsParentSourceKey]), ICS_CHANGE_FLAG_NEW, ulFlags));
+	} else {
+		er = m_lpMsgProcessor->ProcessRejected(lpDBRow, lpDBLen, &ulChangeType);
 	}
+	if (er != erSuccess)
+		return er;
+
+	// If ulChangeType equals 0 we can skip this message
+	if (ulChangeType == 0)
+		return erSuccess;
+
+	m_lpChanges->__ptr[m_ulChangeCnt].ulChangeId = lpDBRow[icsID] ? atoui(lpDBRow[icsID]) : 0;
+	m_lpChanges->__ptr[m_ulChangeCnt].sSourceKey.__ptr = (unsigned char *)soap_malloc(m_soap, lpDBLen[icsSourceKey]);
+	m_lpChanges->__ptr[m_ulChangeCnt].sSourceKey.__size = lpDBLen[icsSourceKey];
+	memcpy(m_lpChanges->__ptr[m_ulChangeCnt].sSourceKey.__ptr, lpDBRow[icsSourceKey], lpDBLen[icsSourceKey]);
+	m_lpChanges->__ptr[m_ulChangeCnt].sParentSourceKey.__ptr = (unsigned char *)soap_malloc(m_soap, lpDBLen[icsParentSourceKey]);
+	m_lpChanges->__ptr[m_ulChangeCnt].sParentSourceKey.__size = lpDBLen[icsParentSourceKey];
+	memcpy(m_lpChanges->__ptr[m_ulChangeCnt].sParentSourceKey.__ptr, lpDBRow[icsParentSourceKey], lpDBLen[icsParentSourceKey]);
+	m_lpChanges->__ptr[m_ulChangeCnt].ulChangeType = ulChangeType;
+	m_lpChanges->__ptr[m_ulChangeCnt].ulFlags = ulFlags;
+	++m_ulChangeCnt;
 	return erSuccess;
 }
 
@@ -873,6 +992,19 @@ ECRESULT ECGetContentChangesHelper::Finalize(unsigned int *lpulMaxChange, icsCha
 	return erSuccess;
 }
 
+/**
+ * Hand out a page after the first one. Unlike Finalize, this leaves the
+ * sync state alone; that was already dealt with by the first page.
+ */
+ECRESULT ECGetContentChangesHelper::FinalizePage(icsChangesArray **lppChanges)
+{
+	assert(lppChanges != NULL);
+	assert(Pageable());
+	m_lpChanges->__size = m_ulChangeCnt;
+	*lppChanges = m_lpChanges;
+	return erSuccess;
+}
+
 ECRESULT ECGetContentChangesHelper::MatchRestrictions(const std::vector<DB_ROW> &db_rows,
     const std::vector<DB_LENGTHS> &db_lengths,
     const struct restrictTable *restrict, std::set<SOURCEKEY> *matches_p)
@@ -889,6 +1021,7 @@ ECRESULT ECGetContentChangesHelper::MatchRestrictions(const std::vector<DB_ROW>
 	std::set<SOURCEKEY> matches;
 	std::vector<unsigned int> cbdata, objectids;
 	std::vector<unsigned char *> lpdata;
+	ECCompiledRestriction prog;
 
 	memset(&sODStore, 0, sizeof(sODStore));
 	ec_log(EC_LOGLEVEL_ICS, "MatchRestrictions: matching %zu rows", db_rows.size());
@@ -914,6 +1047,10 @@ ECRESULT ECGetContentChangesHelper::MatchRestrictions(const std::vector<DB_ROW>
 	if (er != erSuccess)
 		goto exit;
 	er = ECGenericObjectTable::GetRestrictPropTags(restrict, NULL, &lpPropTags);
+	if (er != erSuccess)
+		goto exit;
+	// @todo: Get a proper locale for the case insensitive comparisons
+	er = prog.Compile(restrict, createLocaleFromName(""), lpPropTags);
 	if (er != erSuccess)
 		goto exit;
 	sODStore.lpGuid = new GUID;
@@ -934,8 +1071,7 @@ ECRESULT ECGetContentChangesHelper::MatchRestrictions(const std::vector<DB_ROW>
 	}
 
 	for (gsoap_size_t j = 0; j < lpRowSet->__size; ++j) {
-		// @todo: Get a proper locale for the case insensitive comparisons inside MatchRowRestrict
-		er = ECGenericObjectTable::MatchRowRestrict(gcache, &lpRowSet->__ptr[j], restrict, nullptr, createLocaleFromName(""), &fMatch);
+		er = prog.Match(gcache, &lpRowSet->__ptr[j], nullptr, &fMatch);
 		if(er != erSuccess)
 			goto exit;
 		if (fMatch)
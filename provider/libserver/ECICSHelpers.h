@@ -22,7 +22,8 @@ enum {
 	icsChangeType		= 3,
 	icsFlags			= 4,
 	icsMsgFlags			= 5,
-	icsSourceSync		= 6
+	icsSourceSync		= 6,
+	icsCursor			= 7, // Page position of the row
 };
 
 
@@ -48,9 +49,16 @@ public:
 	ECRESULT ProcessResidualMessages();
 	ECRESULT Finalize(unsigned int *lpulMaxChange, icsChangesArray **lppChanges);
 
+	// Paged retrieval, see getchanges_contents_page
+	bool Pageable() const;
+	ECRESULT QueryPage(unsigned int cursor, unsigned int max_change, unsigned int limit, DB_RESULT *);
+	ECRESULT ProcessRow(DB_ROW, DB_LENGTHS);
+	ECRESULT FinalizePage(icsChangesArray **);
+
 private:
 	ECGetContentChangesHelper(struct soap *, ECSession *, ECDatabase *, const SOURCEKEY &folder, unsigned int sync_id, unsigned int change_id, unsigned int flags, const struct restrictTable *);
 	ECRESULT Init();
+	ECRESULT AddRow(DB_ROW, DB_LENGTHS, bool match);
 	ECRESULT MatchRestrictions(const std::vector<DB_ROW> &db_rows, const std::vector<DB_LENGTHS> &db_lengths, const struct restrictTable *lpsRestrict, std::set<SOURCEKEY> *matches);
 	ECRESULT GetSyncedMessages(unsigned int ulSyncId, unsigned int ulChangeId, LPMESSAGESET lpsetMessages);
 	static bool CompareMessageEntry(const MESSAGESET::value_type &lhs, const MESSAGESET::value_type &rhs);
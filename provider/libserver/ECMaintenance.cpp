@@ -0,0 +1,215 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016, Kopano and its licensors
+ */
+#include <kopano/platform.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <kopano/ECConfig.h>
+#include <kopano/ECLogger.h>
+#include <kopano/MAPIErrors.h>
+#include <kopano/scope.hpp>
+#include <kopano/stringutil.h>
+#include <kopano/timeutil.hpp>
+#include "ECDatabase.h"
+#include "ECMaintenance.h"
+#include "ECSession.h"
+#include "ECSessionManager.h"
+#include "StatsClient.h"
+
+using namespace std::chrono_literals;
+
+namespace KC {
+
+namespace {
+
+struct maint_progress {
+	unsigned int pos = 0;
+	uint64_t rows = 0;
+	bool running = false;
+};
+
+}
+
+static std::mutex maint_lock;
+static std::map<std::string, maint_progress> maint_tasks;
+
+ECRESULT ECMaintenanceTask::range_end(ECDatabase *db, const std::string &table,
+    const std::string &column, unsigned int pos, unsigned int batch,
+    unsigned int *end)
+{
+	DB_RESULT result;
+	auto er = db->DoSelect("SELECT MAX(" + column + ") FROM (SELECT " +
+	          column + " FROM " + table + " WHERE " + column + ">" +
+	          stringify(pos) + " ORDER BY " + column + " LIMIT " +
+	          stringify(batch) + ") AS r", &result);
+	if (er != erSuccess)
+		return er;
+	auto row = result.fetch_row();
+	*end = row != nullptr && row[0] != nullptr ? atoui(row[0]) : pos;
+	return erSuccess;
+}
+
+static std::string position_key(const ECMaintenanceTask &task)
+{
+	return std::string("'maint_") + task.name() + "'";
+}
+
+static ECRESULT load_position(ECDatabase *db, const ECMaintenanceTask &task,
+    unsigned int *pos)
+{
+	DB_RESULT result;
+	auto er = db->DoSelect("SELECT `value` FROM settings WHERE `name`=" +
+	          position_key(task) + " LIMIT 1", &result);
+	if (er != erSuccess)
+		return er;
+	auto row = result.fetch_row();
+	*pos = row != nullptr && row[0] != nullptr ? atoui(row[0]) : 0;
+	return erSuccess;
+}
+
+static ECRESULT save_position(ECDatabase *db, const ECMaintenanceTask &task,
+    unsigned int pos)
+{
+	if (pos == 0)
+		return db->DoDelete("DELETE FROM settings WHERE `name`=" + position_key(task));
+	return db->DoInsert("REPLACE INTO settings (`name`, `value`) VALUES (" +
+	       position_key(task) + ",'" + stringify(pos) + "')");
+}
+
+/* Sleep for @d, or until *@exit is set. Returns false on exit. */
+static bool nap(const bool *exit, std::chrono::milliseconds d)
+{
+	auto until = std::chrono::steady_clock::now() + d;
+	while (!*exit) {
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(until - std::chrono::steady_clock::now());
+		if (left <= 0ms)
+			return true;
+		std::this_thread::sleep_for(std::min(left, std::chrono::milliseconds(100)));
+	}
+	return false;
+}
+
+static bool dispatcher_busy(unsigned int max_age)
+{
+	if (max_age == 0)
+		return false;
+	unsigned int qlen = 0, nthr = 0, nidle = 0;
+	time_duration age{};
+	kopano_get_server_stats(&qlen, &age, &nthr, &nidle);
+	return age > std::chrono::milliseconds(max_age);
+}
+
+ECMaintenance::ECMaintenance(ECSession *ses, const bool *exit, bool throttle) :
+	m_session(ses), m_exit(exit), m_throttle(throttle)
+{
+	auto cfg = g_lpSessionManager->GetConfig();
+	m_batch_max = std::max(1U, atoui(cfg->GetSetting("maintenance_batch_size")));
+	m_chunk_time = std::chrono::milliseconds(atoui(cfg->GetSetting("maintenance_chunk_time")));
+	m_load = std::min(100U, atoui(cfg->GetSetting("maintenance_load")));
+	m_queue_age = atoui(cfg->GetSetting("maintenance_max_queue_age"));
+	m_run_time = std::chrono::seconds(atoui(cfg->GetSetting("maintenance_run_time")));
+	m_deadline = std::chrono::steady_clock::now() + m_run_time;
+}
+
+ECRESULT ECMaintenance::run(ECMaintenanceTask &task, unsigned int *done)
+{
+	ECDatabase *db = nullptr;
+	auto er = m_session->GetDatabase(&db);
+	if (er != erSuccess)
+		return er;
+
+	std::unique_lock<std::mutex> lk(maint_lock);
+	auto &prog = maint_tasks[task.name()];
+	if (prog.running)
+		return KCERR_BUSY;
+	prog.running = true;
+	lk.unlock();
+	auto cleanup = make_scope_success([&]() {
+		std::lock_guard<std::mutex> l(maint_lock);
+		prog.running = false;
+	});
+
+	auto &stats = g_lpSessionManager->m_stats;
+	unsigned int pos = 0, batch = m_batch_max;
+	bool paused = false;
+
+	if (m_throttle) {
+		er = load_position(db, task, &pos);
+		if (er != erSuccess)
+			return er;
+		if (pos != 0)
+			ec_log_info("%s clean up: resuming after key %u", task.name(), pos);
+	}
+	while (!*m_exit) {
+		if (m_throttle && m_run_time.count() != 0 &&
+		    std::chrono::steady_clock::now() >= m_deadline) {
+			ec_log_info("%s clean up: out of time at key %u, continuing on the next run", task.name(), pos);
+			return erSuccess;
+		}
+		if (m_throttle && dispatcher_busy(m_queue_age)) {
+			if (!paused)
+				stats->inc(SCN_MAINT_PAUSES);
+			paused = true;
+			nap(m_exit, 1s);
+			continue;
+		}
+		paused = false;
+
+		unsigned int next = pos, n = 0;
+		auto start = std::chrono::steady_clock::now();
+		er = task.chunk(m_session, db, batch, next, n);
+		if (er != erSuccess)
+			return er;
+		auto took = std::chrono::steady_clock::now() - start;
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(took).count();
+		stats->inc(SCN_MAINT_CHUNKS);
+		stats->inc(SCN_MAINT_ROWS, static_cast<LONGLONG>(n));
+		stats->inc(SCN_MAINT_CHUNK_TIME, static_cast<LONGLONG>(us / 1000));
+		stats->hist(SCN_MAINT_CHUNK_TIME, us);
+		*done += n;
+
+		/* A step that did not move on means the pass is complete */
+		auto finished = next == pos;
+		pos = finished ? 0 : next;
+		lk.lock();
+		prog.pos = pos;
+		prog.rows += n;
+		lk.unlock();
+		if (m_throttle) {
+			er = save_position(db, task, pos);
+			if (er != erSuccess)
+				return er;
+		}
+		if (finished)
+			return erSuccess;
+		if (!m_throttle)
+			continue;
+
+		if (m_chunk_time.count() != 0) {
+			if (took > m_chunk_time)
+				batch = std::max(1U, batch / 2);
+			else if (took < m_chunk_time / 2)
+				batch = std::min(m_batch_max, batch * 2);
+		}
+		if (m_load > 0 && m_load < 100)
+			nap(m_exit, std::chrono::duration_cast<std::chrono::milliseconds>(took * (100 - m_load) / m_load));
+	}
+	return KCERR_USER_CANCEL;
+}
+
+void ECMaintenance::update_stats(ECStatsCollector &s)
+{
+	std::lock_guard<std::mutex> lk(maint_lock);
+	for (const auto &t : maint_tasks) {
+		s.setg("maint_" + t.first + "_pos", "Key the " + t.first + " clean up has reached", t.second.pos);
+		s.set("maint_" + t.first + "_rows", "Number of objects removed by the " + t.first + " clean up", t.second.rows);
+		s.setg("maint_" + t.first + "_running", "Whether the " + t.first + " clean up is running", t.second.running);
+	}
+}
+
+} /* namespace */
@@ -0,0 +1,86 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016, Kopano and its licensors
+ */
+#ifndef EC_MAINTENANCE_H
+#define EC_MAINTENANCE_H
+
+#include <chrono>
+#include <string>
+#include <kopano/kcodes.h>
+
+namespace KC {
+
+class ECDatabase;
+class ECSession;
+class ECStatsCollector;
+
+/**
+ * A background cleanup job that walks a table in primary key order and
+ * removes a bounded number of rows per step.
+ */
+class ECMaintenanceTask {
+	public:
+	virtual ~ECMaintenanceTask() = default;
+	/* Short name, used for the saved position, the log and the stats */
+	virtual const char *name() const = 0;
+	/*
+	 * Process up to @batch keys beyond @pos. Advance @pos to the last key
+	 * looked at and add the number of removed objects to @done. When there
+	 * are no keys beyond @pos, leave it unchanged: that ends the pass.
+	 */
+	virtual ECRESULT chunk(ECSession *, ECDatabase *, unsigned int batch, unsigned int &pos, unsigned int &done) = 0;
+
+	protected:
+	/*
+	 * Find the key that closes a range of @batch rows of @table beyond @pos,
+	 * ordered by @column. *@end is set to @pos if there are none.
+	 */
+	static ECRESULT range_end(ECDatabase *, const std::string &table, const std::string &column, unsigned int pos, unsigned int batch, unsigned int *end);
+};
+
+/**
+ * Runs maintenance tasks in small steps so that the deletes do not hold
+ * locks for long or starve user requests.
+ *
+ * In throttled mode (the scheduled runs), the run continues from the
+ * position saved in the settings table by the previous run, and:
+ *
+ *  - the batch size is halved when a step takes longer than
+ *    maintenance_chunk_time and grows back up to maintenance_batch_size;
+ *  - after each step the job sleeps so that it spends no more than
+ *    maintenance_load percent of the wall clock in the database;
+ *  - the job waits while the oldest request in the dispatcher queue is
+ *    older than maintenance_max_queue_age;
+ *  - the run stops after maintenance_run_time and the next one resumes.
+ *
+ * Unthrottled runs (explicit admin requests) use the same steps, starting
+ * at the beginning and without waiting.
+ *
+ * One ECMaintenance object covers one job; the time limit applies to all
+ * tasks it runs together.
+ */
+class ECMaintenance final {
+	public:
+	ECMaintenance(ECSession *, const bool *exit, bool throttle);
+	/*
+	 * Run @task until it has seen the whole table, the time is up, or
+	 * *exit becomes true. The number of removed objects is added to
+	 * *@done.
+	 */
+	ECRESULT run(ECMaintenanceTask &, unsigned int *done);
+	static void update_stats(ECStatsCollector &);
+
+	private:
+	ECSession *m_session;
+	const bool *m_exit;
+	bool m_throttle;
+	unsigned int m_batch_max, m_load, m_queue_age;
+	std::chrono::milliseconds m_chunk_time;
+	std::chrono::seconds m_run_time;
+	std::chrono::steady_clock::time_point m_deadline;
+};
+
+} /* namespace */
+
+#endif
@@ -4,7 +4,16 @@
  */
 #include <kopano/platform.h>
 #include <chrono>
+#include <list>
+#include <string>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
 #include "ECMAPI.h"
 #include "ECNotification.h"
 #include "ECNotificationManager.h"
@@ -12,6 +21,7 @@
 #include "ECSessionManager.h"
 #include "ECStringCompat.h"
 #include "SOAPUtils.h"
+#include "StatsClient.h"
 #include "soapH.h"
 
 using namespace std::chrono_literals;
@@ -105,50 +115,283 @@ static int soapresponse(struct notifyResponse notifications, struct soap *soap)
      || soap_envelope_end_out(soap)
      || soap_end_send(soap))
             return soap->error;
-    return soap_closesock(soap);
+    return SOAP_OK;
+}
+
+/* The reply being serialized by send() on this thread */
+static thread_local std::string *notify_buffer;
+
+static int notify_capture(struct soap *, const char *s, size_t n)
+{
+	notify_buffer->append(s, n);
+	return SOAP_OK;
+}
+
+/*
+ * Writes as much of @data past @done as the socket takes without blocking.
+ * Returns 1 when all of it is written, 0 when the socket must first be
+ * polled for @events, and -1 when the connection failed.
+ */
+static int notify_write(struct soap *soap, const std::string &data,
+    size_t *done, short *events)
+{
+	while (*done < data.size()) {
+		auto ptr = data.data() + *done;
+		auto size = data.size() - *done;
+		ssize_t ret;
+		if (soap->ssl != nullptr) {
+			/* The same data is passed again after SSL_ERROR_WANT_* */
+			ERR_clear_error();
+			ret = SSL_write(soap->ssl, ptr, size);
+			if (ret <= 0) {
+				auto err = SSL_get_error(soap->ssl, ret);
+				if (err == SSL_ERROR_WANT_WRITE)
+					*events = POLLOUT;
+				else if (err == SSL_ERROR_WANT_READ)
+					*events = POLLIN;
+				else
+					return -1;
+				return 0;
+			}
+		} else {
+			ret = ::send(soap->socket, ptr, size, MSG_NOSIGNAL);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					return -1;
+				*events = POLLOUT;
+				return 0;
+			}
+		}
+		*done += ret;
+	}
+	return 1;
 }
 
 void (*kopano_notify_done)(struct soap *) = [](struct soap *) {};
 
-ECNotificationManager::ECNotificationManager(void)
+ECNotificationManager::ECNotificationManager(unsigned int nthreads,
+    std::shared_ptr<ECStatsCollector> stats) :
+	m_stats(std::move(stats))
 {
-	auto ret = pthread_create(&m_thread, nullptr, Thread, this);
-	if (ret != 0) {
-		ec_log_err("Could not create ECNotificationManager thread: %s", strerror(ret));
-		return;
+	if (pipe2(m_wake, O_NONBLOCK | O_CLOEXEC) != 0) {
+		ec_log_err("Could not create ECNotificationManager pipe: %s", strerror(errno));
+		m_wake[0] = m_wake[1] = -1;
+	} else {
+		auto ret = pthread_create(&m_writer, nullptr, WriterThread, this);
+		if (ret != 0) {
+			/* Replies that do not fit in the socket buffer are dropped */
+			ec_log_err("Could not create ECNotificationManager writer thread: %s", strerror(ret));
+		} else {
+			m_writer_active = true;
+			set_thread_name(m_writer, "NotificationWriter");
+		}
+	}
+	if (nthreads == 0)
+		nthreads = 1;
+	for (unsigned int i = 0; i < nthreads; ++i) {
+		m_shards.emplace_back(new shard);
+		auto &sh = *m_shards.back();
+		sh.mgr = this;
+		auto ret = pthread_create(&sh.thread, nullptr, Thread, &sh);
+		if (ret != 0) {
+			ec_log_err("Could not create ECNotificationManager thread: %s", strerror(ret));
+			/* Sessions of this shard are still served by AddRequest */
+			continue;
+		}
+		sh.thread_active = true;
+		set_thread_name(sh.thread, "NotificationManager");
 	}
-	m_thread_active = true;
-    set_thread_name(m_thread, "NotificationManager");
 }
 
 ECNotificationManager::~ECNotificationManager()
 {
-	ulock_normal l_ses(m_mutexSessions);
-	m_bExit = true;
-	m_condSessions.notify_all();
-	l_ses.unlock();
+	for (auto &sh : m_shards) {
+		scoped_lock l_ses(sh->mtx_active);
+		sh->exit = true;
+		sh->cond_active.notify_all();
+	}
 
 	ec_log_info("Shutdown notification manager");
-	if (m_thread_active)
-		pthread_join(m_thread, nullptr);
-
-    // Close and free any pending requests (clients will receive EOF)
-	for (const auto &p : m_mapRequests) {
-		// we can't call kopano_notify_done here, race condition on shutdown in ECSessionManager vs ECDispatcher
-		kopano_end_soap_connection(p.second.soap);
-		soap_destroy(p.second.soap);
-		soap_end(p.second.soap);
-		soap_free(p.second.soap);
-    }
+	for (auto &sh : m_shards) {
+		if (sh->thread_active)
+			pthread_join(sh->thread, nullptr);
+		// Close and free any pending requests (clients will receive EOF)
+		for (const auto &p : sh->requests) {
+			// we can't call kopano_notify_done here, race condition on shutdown in ECSessionManager vs ECDispatcher
+			kopano_end_soap_connection(p.second.soap);
+			soap_destroy(p.second.soap);
+			soap_end(p.second.soap);
+			soap_free(p.second.soap);
+		}
+	}
+
+	/* The shards are gone, so nothing is added to m_writes anymore */
+	m_writer_exit = true;
+	if (m_writer_active) {
+		char c = 0;
+		write(m_wake[1], &c, 1);
+		pthread_join(m_writer, nullptr);
+	}
+	for (auto &r : m_writes) {
+		kopano_end_soap_connection(r.soap);
+		soap_free(r.soap);
+	}
+	if (m_wake[0] >= 0)
+		close(m_wake[0]);
+	if (m_wake[1] >= 0)
+		close(m_wake[1]);
+}
+
+/*
+ * Write the reply for @soap. The caller must already have removed the
+ * request from its shard. The reply is serialized into a buffer and written
+ * to the socket without blocking; if the client does not take all of it
+ * right away, the rest is left to the writer thread.
+ */
+void ECNotificationManager::send(struct soap *soap,
+    const struct notifyResponse &rsp, const time_point &signalled)
+{
+	std::list<reply> l(1);
+	auto &r = l.front();
+	r.soap = soap;
+	r.signalled = signalled;
+	time(&r.started);
+
+	auto fsend = soap->fsend;
+	notify_buffer = &r.data;
+	soap->fsend = notify_capture;
+	if (soapresponse(rsp, soap))
+		// Handle error on the response
+		soap_send_fault(soap);
+	soap->fsend = fsend;
+	notify_buffer = nullptr;
+	// Free allocated SOAP data (in GetNotifyItems())
+	soap_destroy(soap);
+	soap_end(soap);
+
+	r.fl = fcntl(soap->socket, F_GETFL);
+	if (r.fl < 0 || fcntl(soap->socket, F_SETFL, r.fl | O_NONBLOCK) < 0) {
+		ec_log_warn("Could not make notification socket non-blocking: %s", strerror(errno));
+		finish(r, false);
+		return;
+	}
+	auto ret = notify_write(soap, r.data, &r.done, &r.events);
+	if (ret != 0) {
+		finish(r, ret > 0);
+		return;
+	}
+	if (!m_writer_active) {
+		finish(r, false);
+		return;
+	}
+	scoped_lock lk(m_wr_lock);
+	m_writes.splice(m_writes.end(), l);
+	char c = 0;
+	write(m_wake[1], &c, 1);
+}
+
+/*
+ * Pass the socket of a written (@ok) or failed reply back to the
+ * dispatcher, so that the next SOAP call can be handled.
+ */
+void ECNotificationManager::finish(reply &r, bool ok)
+{
+	auto soap = r.soap;
+	if (r.fl >= 0)
+		fcntl(soap->socket, F_SETFL, r.fl);
+	if (!ok)
+		/* Part of a reply may have been sent; the connection is unusable */
+		soap->keep_alive = 0;
+	soap_closesock(soap);
+	if (ok && m_stats != nullptr && r.signalled != time_point()) {
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(decltype(r.signalled)::clock::now() - r.signalled).count();
+		m_stats->inc(SCN_NOTIFY_SENT);
+		m_stats->inc(SCN_NOTIFY_LATENCY, static_cast<LONGLONG>(us / 1000));
+		m_stats->hist(SCN_NOTIFY_LATENCY, us);
+	}
+	kopano_notify_done(soap);
+}
+
+void *ECNotificationManager::WriterThread(void *arg)
+{
+	kcsrv_blocksigs();
+	return static_cast<ECNotificationManager *>(arg)->Write();
+}
+
+/*
+ * Finishes the replies that did not fit in their socket buffer right away,
+ * waiting for all of their sockets at once.
+ */
+void *ECNotificationManager::Write()
+{
+	std::list<reply> pending;
+	std::vector<struct pollfd> pfd;
+
+	while (!m_writer_exit) {
+		std::unique_lock<std::mutex> lk(m_wr_lock);
+		pending.splice(pending.end(), m_writes);
+		lk.unlock();
+
+		pfd.resize(pending.size() + 1);
+		pfd[0].fd = m_wake[0];
+		pfd[0].events = POLLIN;
+		size_t i = 1;
+		for (const auto &r : pending) {
+			pfd[i].fd = r.soap->socket;
+			pfd[i++].events = r.events;
+		}
+		if (poll(&pfd[0], pfd.size(), 1000) < 0 && errno != EINTR) {
+			ec_log_err("ECNotificationManager: poll: %s", strerror(errno));
+			break;
+		}
+		if (pfd[0].revents & POLLIN) {
+			char buf[64];
+			while (read(m_wake[0], buf, sizeof(buf)) > 0)
+				/* drain */;
+		}
+
+		auto now = time(nullptr);
+		i = 1;
+		for (auto iter = pending.begin(); iter != pending.end(); ++i) {
+			auto &r = *iter;
+			int ret = 0;
+			if (pfd[i].revents != 0)
+				ret = notify_write(r.soap, r.data, &r.done, &r.events);
+			if (ret == 0 && now - r.started > m_ulTimeout) {
+				ec_log_warn("Dropping notification reply: client did not read it for %u seconds", m_ulTimeout);
+				ret = -1;
+			}
+			if (ret == 0) {
+				++iter;
+				continue;
+			}
+			finish(r, ret > 0);
+			iter = pending.erase(iter);
+		}
+	}
+
+	/* Left to the destructor */
+	scoped_lock lk(m_wr_lock);
+	m_writes.splice(m_writes.begin(), pending);
+	return nullptr;
+}
+
+void ECNotificationManager::queue_changed(int delta)
+{
+	auto n = m_queued += delta;
+	if (m_stats != nullptr)
+		m_stats->set(SCN_NOTIFY_QUEUE, static_cast<LONGLONG>(n));
 }
 
 // Called by the SOAP handler
 HRESULT ECNotificationManager::AddRequest(ECSESSIONID ecSessionId, struct soap *soap)
 {
-    struct soap *lpItem = NULL;
-	ulock_normal l_req(m_mutexRequests);
-	auto iterRequest = m_mapRequests.find(ecSessionId);
-	if (iterRequest != m_mapRequests.cend()) {
+	auto &sh = get_shard(ecSessionId);
+	ulock_normal l_req(sh.mtx_requests);
+	auto iterRequest = sh.requests.find(ecSessionId);
+	if (iterRequest != sh.requests.cend()) {
         // Hm. There is already a SOAP request waiting for this session id. Apparently a second SOAP connection has now
         // requested notifications. Since this should only happen if the client thinks it has lost its connection and has
         // restarted the request, we will replace the existing request with this one.
@@ -160,20 +403,14 @@ HRESULT ECNotificationManager::AddRequest(ECSESSIONID ecSessionId, struct soap *
         struct notifyResponse notifications;
         soap_default_notifyResponse(iterRequest->second.soap, &notifications);
         notifications.er = KCERR_NOT_FOUND; // Should be something like 'INTERRUPTED' or something
-		if (soapresponse(notifications, iterRequest->second.soap))
-			// Handle error on the response
-			soap_send_fault(iterRequest->second.soap);
-		soap_destroy(iterRequest->second.soap);
-		soap_end(iterRequest->second.soap);
-        lpItem = iterRequest->second.soap;
-        // Pass the socket back to the socket manager (which will probably close it since the client should not be holding two notification sockets)
-        kopano_notify_done(lpItem);
+        // The socket goes back to the socket manager (which will probably close it since the client should not be holding two notification sockets)
+		send(iterRequest->second.soap, notifications, time_point());
     }
 
     NOTIFREQUEST req;
     req.soap = soap;
     time(&req.ulRequestTime);
-    m_mapRequests[ecSessionId] = req;
+    sh.requests[ecSessionId] = req;
 	l_req.unlock();
     // There may already be notifications waiting for this session, so post a change on this session so that the
     // thread will attempt to get notifications on this session
@@ -184,99 +421,97 @@ HRESULT ECNotificationManager::AddRequest(ECSESSIONID ecSessionId, struct soap *
 // Called by a session when it has a notification to send
 HRESULT ECNotificationManager::NotifyChange(ECSESSIONID ecSessionId)
 {
+	auto &sh = get_shard(ecSessionId);
     // Simply mark the session in our set of active sessions
-	scoped_lock l_ses(m_mutexSessions);
-	m_setActiveSessions.emplace(ecSessionId);
-	m_condSessions.notify_all(); /* Wake up thread due to activity */
+	scoped_lock l_ses(sh.mtx_active);
+	if (!sh.active.emplace(ecSessionId, std::chrono::steady_clock::now()).second)
+		return hrSuccess;
+	queue_changed(1);
+	sh.cond_active.notify_one(); /* Wake up thread due to activity */
 	return hrSuccess;
 }
 
 void * ECNotificationManager::Thread(void *lpParam)
 {
 	kcsrv_blocksigs();
-	return static_cast<ECNotificationManager *>(lpParam)->Work();
+	auto sh = static_cast<shard *>(lpParam);
+	return sh->mgr->Work(*sh);
 }
 
-void *ECNotificationManager::Work() {
+void *ECNotificationManager::Work(shard &sh)
+{
     ECSession *lpecSession = NULL;
     struct notifyResponse notifications;
-    std::set<ECSESSIONID> setActiveSessions;
-    struct soap *lpItem;
+	std::map<ECSESSIONID, time_point> setActiveSessions;
     time_t ulNow = 0;
 
     // Keep looping until we should exit
     while(1) {
-		ulock_normal l_ses(m_mutexSessions);
-		if (m_bExit)
+		ulock_normal l_ses(sh.mtx_active);
+		if (sh.exit)
 			break;
-		if (m_setActiveSessions.size() == 0)
-			m_condSessions.wait_for(l_ses, 1s);
+		if (sh.active.size() == 0)
+			sh.cond_active.wait_for(l_ses, 1s);
 
-        // Make a copy of the session list so we can release the lock ASAP
-        setActiveSessions = m_setActiveSessions;
-        m_setActiveSessions.clear();
+        // Take over the session list so we can release the lock ASAP
+		setActiveSessions.clear();
+		std::swap(setActiveSessions, sh.active);
 		l_ses.unlock();
+		if (!setActiveSessions.empty())
+			queue_changed(-static_cast<int>(setActiveSessions.size()));
 
         // Look at all the sessions that have signalled a change
         for (const auto &ses : setActiveSessions) {
-            lpItem = NULL;
-			ulock_normal l_req(m_mutexRequests);
-
-            // Find the request for the session that had something to say
-            auto iterRequest = m_mapRequests.find(ses);
-            if (iterRequest != m_mapRequests.cend()) {
-                // Reset notification response to default values
-                soap_default_notifyResponse(iterRequest->second.soap, &notifications);
-                if (g_lpSessionManager->ValidateSession(iterRequest->second.soap, ses, &lpecSession) == erSuccess) {
-                    // Get the notifications from the session
-					auto er = lpecSession->GetNotifyItems(iterRequest->second.soap, &notifications);
-
-                    if(er == KCERR_NOT_FOUND) {
-                        if(time(NULL) - iterRequest->second.ulRequestTime < m_ulTimeout) {
-                            // No notifications - this means we have to wait. This can happen if the session was marked active since
-                            // the request was just made, and there may have been notifications still waiting for us
-							l_req.unlock();
-							lpecSession->unlock();
-                            continue; // Totally ignore this item == wait
-                        } else {
-                            // No notifications and we're out of time, just respond OK with 0 notifications
-                            er = erSuccess;
-                            notifications.pNotificationArray = (struct notificationArray *)soap_malloc(iterRequest->second.soap, sizeof(notificationArray));
-                            soap_default_notificationArray(iterRequest->second.soap, notifications.pNotificationArray);
-                        }
-                    }
-
-					ULONG ulCapabilities = lpecSession->GetCapabilities();
-					if (er == erSuccess && (ulCapabilities & KOPANO_CAP_UNICODE) == 0) {
-						ECStringCompat stringCompat(false);
-						er = FixNotificationsEncoding(iterRequest->second.soap, stringCompat, notifications.pNotificationArray);
+			ulock_normal l_req(sh.mtx_requests);
+
+			// Find the request for the session that had something to say
+			auto iterRequest = sh.requests.find(ses.first);
+			if (iterRequest == sh.requests.cend())
+				// Nobody was listening to this session, just ignore it
+				continue;
+			auto soap = iterRequest->second.soap;
+			auto signalled = ses.second;
+			// Reset notification response to default values
+			soap_default_notifyResponse(soap, &notifications);
+			if (g_lpSessionManager->ValidateSession(soap, ses.first, &lpecSession) == erSuccess) {
+				// Get the notifications from the session
+				auto er = lpecSession->GetNotifyItems(soap, &notifications);
+
+				if (er == KCERR_NOT_FOUND) {
+					if (time(NULL) - iterRequest->second.ulRequestTime < m_ulTimeout) {
+						// No notifications - this means we have to wait. This can happen if the session was marked active since
+						// the request was just made, and there may have been notifications still waiting for us
+						l_req.unlock();
+						lpecSession->unlock();
+						continue; // Totally ignore this item == wait
 					}
-
-                    notifications.er = er;
-					lpecSession->unlock();
-                } else {
-                    // The session is dead
-                    notifications.er = KCERR_END_OF_SESSION;
-                }
-
-                // Send the SOAP data
-				if (soapresponse(notifications, iterRequest->second.soap))
-					// Handle error on the response
-					soap_send_fault(iterRequest->second.soap);
-				// Free allocated SOAP data (in GetNotifyItems())
-				soap_destroy(iterRequest->second.soap);
-				soap_end(iterRequest->second.soap);
-
-                // Since we have responded, remove the item from our request list and pass it back to the active socket list so
-                // that the next SOAP call can be handled (probably another notification request)
-                lpItem = iterRequest->second.soap;
-                m_mapRequests.erase(iterRequest);
-            } else {
-                // Nobody was listening to this session, just ignore it
-            }
+					// No notifications and we're out of time, just respond OK with 0 notifications
+					er = erSuccess;
+					notifications.pNotificationArray = s_alloc<notificationArray>(soap);
+					soap_default_notificationArray(soap, notifications.pNotificationArray);
+					/* Not a delivery; keep it out of the latency stats */
+					signalled = time_point();
+				}
+
+				ULONG ulCapabilities = lpecSession->GetCapabilities();
+				if (er == erSuccess && (ulCapabilities & KOPANO_CAP_UNICODE) == 0) {
+					ECStringCompat stringCompat(false);
+					er = FixNotificationsEncoding(soap, stringCompat, notifications.pNotificationArray);
+				}
+
+				notifications.er = er;
+				lpecSession->unlock();
+			} else {
+				// The session is dead
+				notifications.er = KCERR_END_OF_SESSION;
+			}
+
+			// Since we have a response, remove the item from our request list. Once the reply is
+			// written, the socket goes back to the active socket list so that the next SOAP call
+			// can be handled (probably another notification request)
+			sh.requests.erase(iterRequest);
 			l_req.unlock();
-            if(lpItem)
-                kopano_notify_done(lpItem);
+			send(soap, notifications, signalled);
         }
 
         /* Find all notification requests which have not received any data for m_ulTimeout seconds. This makes sure
@@ -284,9 +519,9 @@ void *ECNotificationManager::Work() {
          * TCP timeout of 70 seconds, we need to respond well within those 70 seconds. We therefore use a timeout
          * value of 60 seconds here.
          */
-		ulock_normal l_req(m_mutexRequests);
+		ulock_normal l_req(sh.mtx_requests);
         time(&ulNow);
-        for (const auto &req : m_mapRequests)
+		for (const auto &req : sh.requests)
             if (ulNow - req.second.ulRequestTime > m_ulTimeout)
                 // Mark the session as active so it will be processed in the next loop
                 NotifyChange(req.first);
@@ -7,24 +7,41 @@
 #define ECNOTIFICATIONMANAGER_H
 
 #include <kopano/zcdefs.h>
+#include <atomic>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <pthread.h>
 #include "ECSession.h"
 #include <kopano/ECLogger.h>
 #include <kopano/ECConfig.h>
+#include <kopano/timeutil.hpp>
+#include <list>
 #include <map>
-#include <set>
+#include <string>
+#include <vector>
+#include <ctime>
 
 struct soap;
 
 namespace KC {
 
+class ECStatsCollector;
+
 /*
- * The notification manager runs in a single thread, servicing notifications to ALL clients
- * that are waiting for a notification. We simply store all waiting soap connection objects together
- * with their getNextNotify() request, and once we are signalled that something has changed for one
- * of those queues, we send the reply, and requeue the soap connection for the next request.
+ * The notification manager services notifications to ALL clients that are
+ * waiting for a notification. We simply store all waiting soap connection
+ * objects together with their getNextNotify() request, and once we are
+ * signalled that something has changed for one of those queues, we build
+ * the reply, and requeue the soap connection for the next request.
+ *
+ * Sessions are spread over a number of shards by session ID. Every shard
+ * has its own request map, lock and delivery thread, so a session with a
+ * lot of activity only holds up the sessions in its own shard. A delivery
+ * thread writes the reply without blocking; what does not fit in the
+ * socket buffer is finished by a writer thread that waits for all such
+ * sockets with poll(), so a slow client never blocks a delivery thread or
+ * one of the server threads.
  *
  * So, basically we only handle the SOAP-reply part of the soap request.
  */
@@ -36,7 +53,7 @@ struct NOTIFREQUEST {
 
 class ECNotificationManager final {
 public:
-	ECNotificationManager();
+	ECNotificationManager(unsigned int nthreads = 1, std::shared_ptr<ECStatsCollector> = nullptr);
 	~ECNotificationManager();
 
     // Called by the SOAP handler
@@ -45,23 +62,52 @@ public:
     HRESULT NotifyChange(ECSESSIONID ecSessionId);
 
 private:
+	struct shard {
+		ECNotificationManager *mgr;
+		bool thread_active = false, exit = false;
+		pthread_t thread;
+		// All sessions that are waiting for a SOAP response to be sent (an item can be in here for up to 60 seconds)
+		std::map<ECSESSIONID, NOTIFREQUEST> requests;
+		// Sessions that have reported notification activity but are yet to be processed, with the time of the first report
+		std::map<ECSESSIONID, time_point> active;
+		std::mutex mtx_requests, mtx_active;
+		std::condition_variable cond_active;
+	};
+
+	/* A reply serialized by send(), being written to a non-blocking socket */
+	struct reply {
+		struct soap *soap;
+		std::string data;
+		size_t done = 0;
+		short events = 0; /* what the socket must be polled for */
+		int fl = 0; /* file status flags to restore */
+		time_point signalled;
+		time_t started;
+	};
+
+	shard &get_shard(ECSESSIONID id) { return *m_shards[id % m_shards.size()]; }
+	void send(struct soap *, const struct notifyResponse &, const time_point &signalled);
+	void finish(reply &, bool ok);
+	void queue_changed(int delta);
+
     // Just a wrapper to Work()
     static void * Thread(void *lpParam);
-    void * Work();
+	void *Work(shard &);
+	static void *WriterThread(void *);
+	void *Write();
 
-	bool m_thread_active = false, m_bExit = false;
-    pthread_t 	m_thread;
 	unsigned int m_ulTimeout = 60; /* Currently hardcoded at 60s, see comment in Work() */
+	std::vector<std::unique_ptr<shard>> m_shards;
+	std::shared_ptr<ECStatsCollector> m_stats;
+	std::atomic<int> m_queued{0};
 
-    // A map of all sessions that are waiting for a SOAP response to be sent (an item can be in here for up to 60 seconds)
-    std::map<ECSESSIONID, NOTIFREQUEST> 	m_mapRequests;
-    // A set of all sessions that have reported notification activity, but are yet to be processed.
-    // (a session is in here for only very short periods of time, and contains only a few sessions even if the load is high)
-    std::set<ECSESSIONID> 					m_setActiveSessions;
-
-	std::mutex m_mutexRequests;
-	std::mutex m_mutexSessions;
-	std::condition_variable m_condSessions;
+	/* Replies handed to the writer thread; m_wake interrupts its poll() */
+	std::mutex m_wr_lock;
+	std::list<reply> m_writes;
+	int m_wake[2] = {-1, -1};
+	pthread_t m_writer;
+	bool m_writer_active = false;
+	std::atomic<bool> m_writer_exit{false};
 };
 
 extern _kc_export void (*kopano_notify_done)(struct soap *);
@@ -9,10 +9,13 @@
 #include <kopano/platform.h>
 #include <algorithm>
 #include <chrono>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <stdexcept>
+#include <string>
+#include <vector>
 #include <cerrno>
 #include <unistd.h>
 #include <zlib.h>
@@ -37,6 +40,19 @@ namespace KC {
 /* Number of seconds to sleep before trying again */
 #define S3_SLEEP_DELAY 1
 
+/*
+ * Objects larger than this are uploaded with multipart uploads and read
+ * with ranged GETs, S3_PART_SIZE bytes per request and at most
+ * S3_PARALLEL requests in flight. Parts other than the last must be at
+ * least 5 MB.
+ */
+#define S3_PART_SIZE (8 * 1024 * 1024)
+#define S3_MULTIPART_THRESHOLD (2 * S3_PART_SIZE)
+#define S3_PARALLEL 4
+
+/* Maximum number of idle request contexts kept around */
+#define S3_CTX_POOL 16
+
 #define now_positive() (steady_clock::now() + 600s)
 #define now_negative() (steady_clock::now() + 60s)
 
@@ -49,6 +65,7 @@ struct s3_cd {
 	size_t size = 0, processed = 0;
 	int retries = 0;
 	S3Status status = S3StatusOK;
+	std::string etag, upload_id;
 };
 
 /* callback data wrapper */
@@ -59,6 +76,17 @@ struct s3_cdw {
 
 #define S3_NEGATIVE_ENTRY SIZE_MAX
 
+static S3Status s3_abort_prop_cb(const S3ResponseProperties *, void *)
+{
+	return S3StatusOK;
+}
+
+static void s3_abort_complete_cb(S3Status status, const S3ErrorDetails *, void *)
+{
+	if (status != S3StatusOK)
+		ec_log_warn("S3: aborting multipart upload failed with status %d; the parts are left for the bucket lifecycle to clean up", status);
+}
+
 /* This ought to be moved into ECS3Attachment, if and when that becomes a singleton. */
 
 ECRESULT ECS3Config::init(std::shared_ptr<ECConfig> cfg)
@@ -91,6 +119,14 @@ ECRESULT ECS3Config::init(std::shared_ptr<ECConfig> cfg)
 	m_get_conditions.ifNotModifiedSince = -1;
 	m_get_conditions.ifMatchETag = nullptr;
 	m_get_conditions.ifNotMatchETag = nullptr;
+	m_mp_init_handler.responseHandler = m_response_handler;
+	m_mp_init_handler.responseXmlCallback = &ECS3Attachment::mp_init_cb;
+	m_mp_commit_handler.responseHandler = m_response_handler;
+	m_mp_commit_handler.putObjectDataCallback = &ECS3Attachment::put_obj_cb;
+	m_mp_commit_handler.responseXmlCallback = &ECS3Attachment::mp_commit_cb;
+	/* libs3 passes no callback data to the abort handler. */
+	m_mp_abort_handler.responseHandler.propertiesCallback = &s3_abort_prop_cb;
+	m_mp_abort_handler.responseHandler.completeCallback = &s3_abort_complete_cb;
 	/*
 	 * Do a dlopen of libs3.so.4 so that the implicit pull-in of
 	 * libldap-2.4.so.2 symbols does not pollute our namespace of
@@ -118,6 +154,13 @@ ECRESULT ECS3Config::init(std::shared_ptr<ECConfig> cfg)
 	W(head_object);
 	W(delete_object);
 	W(get_object);
+	W(initiate_multipart);
+	W(upload_part);
+	W(complete_multipart_upload);
+	W(abort_multipart_upload);
+	W(create_request_context);
+	W(destroy_request_context);
+	W(runall_request_context);
 #undef W
 	auto status = DY_initialize("Kopano Mail", S3_INIT_ALL,
 	              cfg->GetSetting("attachment_s3_hostname"));
@@ -134,11 +177,50 @@ ECS3Config::~ECS3Config()
 	ec_log_info("S3: deinitializing attachment storage");
 	/* Deinitialize the S3 storage environment */
 	if (m_handle != nullptr) {
+		for (auto ctx : m_ctx_pool)
+			DY_destroy_request_context(ctx);
 		DY_deinitialize();
 		dlclose(m_handle);
 	}
 }
 
+/**
+ * Take an idle request context from the pool, or create a new one.
+ *
+ * @return a request context, or nullptr if none could be created, in which
+ * case requests are executed synchronously.
+ */
+S3RequestContext *ECS3Config::get_ctx()
+{
+	ulock_normal lk(m_ctx_lock);
+	if (!m_ctx_pool.empty()) {
+		auto ctx = m_ctx_pool.back();
+		m_ctx_pool.pop_back();
+		return ctx;
+	}
+	lk.unlock();
+	S3RequestContext *ctx = nullptr;
+	auto status = DY_create_request_context(&ctx);
+	if (status != S3StatusOK) {
+		ec_log_warn("S3: cannot create request context: %s", DY_get_status_name(status));
+		return nullptr;
+	}
+	return ctx;
+}
+
+void ECS3Config::put_ctx(S3RequestContext *ctx)
+{
+	if (ctx == nullptr)
+		return;
+	ulock_normal lk(m_ctx_lock);
+	if (m_ctx_pool.size() < S3_CTX_POOL) {
+		m_ctx_pool.push_back(ctx);
+		return;
+	}
+	lk.unlock();
+	DY_destroy_request_context(ctx);
+}
+
 ECAttachmentStorage *ECS3Config::new_handle(ECDatabase *db)
 {
 	return new(std::nothrow) ECS3Attachment(*this, db);
@@ -203,6 +285,30 @@ int ECS3Attachment::put_obj_cb(int bufferSize, char *buffer, void *cbdata)
 	return data->caller->put_obj(bufferSize, buffer, data->cbdata);
 }
 
+/**
+ * Record the upload id that S3 assigned to a new multipart upload.
+ *
+ * @param upload_id the upload id
+ * @param cbdata contains the callback pointer to the ECS3Attachment instance and its callback data.
+ */
+S3Status ECS3Attachment::mp_init_cb(const char *upload_id, void *cbdata)
+{
+	auto data = static_cast<struct s3_cd *>(static_cast<struct s3_cdw *>(cbdata)->cbdata);
+	if (upload_id != nullptr)
+		data->upload_id = upload_id;
+	return S3StatusOK;
+}
+
+/**
+ * Result of completing a multipart upload. Nothing of it is needed, the
+ * status arrives through the response handler.
+ */
+S3Status ECS3Attachment::mp_commit_cb(const char *location, const char *etag,
+    void *cbdata)
+{
+	return S3StatusOK;
+}
+
 /*
  * Locking requirements of ECAttachmentStorage: In the case of
  * ECAttachmentStorage locking to protect against concurrent access is futile.
@@ -274,6 +380,8 @@ S3Status ECS3Attachment::response_prop(const S3ResponseProperties *properties, v
 	} else {
 		ec_log_debug("S3: received the response properties");
 	}
+	if (properties->eTag != nullptr)
+		data->etag = properties->eTag;
 	/*
 	 * Only allocate memory if we are not able to use a serializer sink, we
 	 * are instructed to alloc data->data and have not allocated it yet.
@@ -438,19 +546,38 @@ ECRESULT ECS3Attachment::LoadAttachmentInstance(struct soap *soap,
 
 	auto filename = make_att_filename(ins_id, false);
 	auto fn = filename.c_str();
+	size_t csize = 0;
+	if (cached_size(ins_id, &csize) && csize > S3_MULTIPART_THRESHOLD) {
+		ec_log_debug("S3: loading %s into buffer (%zu bytes, ranged)", fn, csize);
+		auto buf = s_alloc_nothrow<unsigned char>(soap, csize);
+		if (buf == nullptr)
+			return KCERR_NOT_ENOUGH_MEMORY;
+		ret = range_get(fn, csize, buf, nullptr);
+		if (ret != erSuccess) {
+			if (soap == nullptr)
+				s_free(nullptr, buf);
+			return ret;
+		}
+		*size_p = csize;
+		*data_p = buf;
+		return erSuccess;
+	}
 	ec_log_debug("S3: loading %s into buffer", fn);
 	/*
 	 * Loop at most S3_RETRIES times, to make sure that if the servers of S3
 	 * reply with a redirect, we actually try again and process it.
 	 */
+	auto ctx = m_config.get_ctx();
 	cd.retries = S3_RETRIES;
 	do {
 		m_config.DY_get_object(&m_config.m_bkctx, fn, &m_config.m_get_conditions,
-			0, 0, nullptr, 0, &m_config.m_get_obj_handler, &cwdata);
+			0, 0, ctx, 0, &m_config.m_get_obj_handler, &cwdata);
+		run(ctx);
 		if (m_config.DY_status_is_retryable(cd.status))
 			ec_log_debug("S3: load %s: retryable status: %s",
 				fn, m_config.DY_get_status_name(cd.status));
 	} while (m_config.DY_status_is_retryable(cd.status) && should_retry(cd));
+	m_config.put_ctx(ctx);
 
 	ec_log_debug("S3: load %s: %s", fn, m_config.DY_get_status_name(cd.status));
 	if (cd.size != cd.processed) {
@@ -470,6 +597,8 @@ ECRESULT ECS3Attachment::LoadAttachmentInstance(struct soap *soap,
 		*size_p = cd.size;
 		*data_p = cd.data;
 		ret = erSuccess;
+		scoped_lock locker(m_config.m_cachelock);
+		m_config.m_cache[ins_id.siid] = {now_positive(), cd.size};
 	}
 	if (ret != erSuccess && cd.data != nullptr && soap == nullptr)
 		s_free(nullptr, cd.data);
@@ -503,33 +632,52 @@ ECRESULT ECS3Attachment::LoadAttachmentInstance(const ext_siid &ins_id,
 
 	auto filename = make_att_filename(ins_id, false);
 	auto fn = filename.c_str();
+	size_t csize = 0;
+	if (cached_size(ins_id, &csize) && csize > S3_MULTIPART_THRESHOLD) {
+		/*
+		 * Nothing reaches the sink before the ranges covering it have
+		 * been read, so retries within range_get are safe.
+		 */
+		ec_log_debug("S3: loading %s into serializer (%zu bytes, ranged)", fn, csize);
+		ret = range_get(fn, csize, nullptr, sink);
+		if (ret == erSuccess)
+			*size_p = csize;
+		return ret;
+	}
 	ec_log_debug("S3: loading %s into serializer", fn);
 	/*
 	 * Loop at most S3_RETRIES times, to make sure that if the servers of S3
-	 * reply with a redirect, we actually try again and process it.
+	 * reply with a redirect, we actually try again and process it. Data
+	 * already handed to the sink cannot be taken back, so only requests
+	 * that did not deliver anything yet are retried.
 	 */
+	auto ctx = m_config.get_ctx();
 	cd.retries = S3_RETRIES;
 	do {
 		m_config.DY_get_object(&m_config.m_bkctx, fn, &m_config.m_get_conditions,
-			0, 0, nullptr, 0, &m_config.m_get_obj_handler, &cwdata);
+			0, 0, ctx, 0, &m_config.m_get_obj_handler, &cwdata);
+		run(ctx);
 		if (m_config.DY_status_is_retryable(cd.status))
 			ec_log_debug("S3: load %s: retryable status: %s",
 				fn, m_config.DY_get_status_name(cd.status));
-	} while (m_config.DY_status_is_retryable(cd.status) && should_retry(cd));
+	} while (m_config.DY_status_is_retryable(cd.status) &&
+	         cd.processed == 0 && should_retry(cd));
+	m_config.put_ctx(ctx);
 
 	ec_log_debug("S3: load %s: %s", fn, m_config.DY_get_status_name(cd.status));
-	if (cd.size != cd.processed) {
+	if (cd.status == S3StatusHttpErrorNotFound) {
+		ret = KCERR_NOT_FOUND;
+	} else if (cd.status != S3StatusOK) {
+		ret = KCERR_NETWORK_ERROR;
+	} else if (cd.size != cd.processed) {
 		ec_log_err("S3: load %s: short read %zu/%zu bytes",
 			fn, cd.processed, cd.size);
 		ret = KCERR_DATABASE_ERROR;
-	} else if (cd.data == nullptr) {
-		ret = KCERR_NOT_ENOUGH_MEMORY;
-	} else if (cd.status != S3StatusOK) {
-		ret = erSuccess;
 	} else {
 		scoped_lock locker(m_config.m_cachelock);
 		m_config.m_cache[ins_id.siid] = {now_positive(), cd.size};
 		*size_p = cd.size;
+		ret = erSuccess;
 	}
 	/*
 	 * Make sure we do not write to the sink accidentally, therefore reset
@@ -563,19 +711,33 @@ ECRESULT ECS3Attachment::SaveAttachmentInstance(ext_siid &ins_id,
 
 	auto filename = make_att_filename(ins_id, comp && size != 0);
 	auto fn = filename.c_str();
+	if (size > S3_MULTIPART_THRESHOLD) {
+		ec_log_debug("S3: saving %s (buffer of %zu bytes, multipart)", fn, size);
+		ret = mp_put(fn, size, data, nullptr);
+		if (m_transact)
+			m_new_att.emplace(ins_id);
+		if (ret == erSuccess) {
+			scoped_lock locker(m_config.m_cachelock);
+			m_config.m_cache[ins_id.siid] = {now_positive(), size};
+		}
+		return ret;
+	}
 	ec_log_debug("S3: saving %s (buffer of %zu bytes)", fn, size);
 	/*
 	 * Loop at most S3_RETRIES times, to make sure that if the servers of S3
 	 * reply with a redirect, we actually try again and process it.
 	 */
+	auto ctx = m_config.get_ctx();
 	cd.retries = S3_RETRIES;
 	do {
 		m_config.DY_put_object(&m_config.m_bkctx, fn, size, nullptr,
-			nullptr, 0, &m_config.m_put_obj_handler, &cwdata);
+			ctx, 0, &m_config.m_put_obj_handler, &cwdata);
+		run(ctx);
 		if (m_config.DY_status_is_retryable(cd.status))
 			ec_log_debug("S3: save %s: retryable status: %s",
 				fn, m_config.DY_get_status_name(cd.status));
 	} while (m_config.DY_status_is_retryable(cd.status) && should_retry(cd));
+	m_config.put_ctx(ctx);
 
 	ec_log_debug("S3: save %s: %s", fn, m_config.DY_get_status_name(cd.status));
 	/* set in transaction before disk full check to remove empty file */
@@ -619,19 +781,33 @@ ECRESULT ECS3Attachment::SaveAttachmentInstance(ext_siid &ins_id,
 
 	auto filename = make_att_filename(ins_id, comp && size != 0);
 	auto fn = filename.c_str();
+	if (size > S3_MULTIPART_THRESHOLD) {
+		ec_log_debug("S3: saving %s (serializer with %zu bytes, multipart)", fn, size);
+		ret = mp_put(fn, size, nullptr, source);
+		if (m_transact)
+			m_new_att.emplace(ins_id);
+		if (ret == erSuccess) {
+			scoped_lock locker(m_config.m_cachelock);
+			m_config.m_cache[ins_id.siid] = {now_positive(), size};
+		}
+		return ret;
+	}
 	ec_log_debug("S3: saving %s (serializer with %zu bytes)", fn, size);
 	/*
 	 * Loop at most S3_RETRIES times, to make sure that if the servers of S3
 	 * reply with a redirect, we actually try again and process it.
 	 */
+	auto ctx = m_config.get_ctx();
 	cd.retries = S3_RETRIES;
 	do {
 		m_config.DY_put_object(&m_config.m_bkctx, fn, size, nullptr,
-			nullptr, 0, &m_config.m_put_obj_handler, &cwdata);
+			ctx, 0, &m_config.m_put_obj_handler, &cwdata);
+		run(ctx);
 		if (m_config.DY_status_is_retryable(cd.status))
 			ec_log_debug("S3: save %s: retryable status: %s",
 				fn, m_config.DY_get_status_name(cd.status));
 	} while (m_config.DY_status_is_retryable(cd.status) && should_retry(cd));
+	m_config.put_ctx(ctx);
 
 	ec_log_debug("S3: save %s: %s", fn, m_config.DY_get_status_name(cd.status));
 	/* set in transaction before disk full check to remove empty file */
@@ -692,14 +868,17 @@ ECRESULT ECS3Attachment::del_marked_att(const ext_siid &ins_id)
 	 * Loop at most S3_RETRIES times, to make sure that if the servers of
 	 * S3 reply with a redirect, we actually try again and process it.
 	 */
+	auto ctx = m_config.get_ctx();
 	cd.retries = S3_RETRIES;
 	do {
-		m_config.DY_delete_object(&m_config.m_bkctx, fn, nullptr, 0,
+		m_config.DY_delete_object(&m_config.m_bkctx, fn, ctx, 0,
 			&m_config.m_response_handler, &cwdata);
+		run(ctx);
 		if (m_config.DY_status_is_retryable(cd.status))
 			ec_log_debug("S3: delete %s: retryable status: %s",
 				fn, m_config.DY_get_status_name(cd.status));
 	} while (m_config.DY_status_is_retryable(cd.status) && should_retry(cd));
+	m_config.put_ctx(ctx);
 
 	ec_log_debug("S3: delete %s: %s", fn, m_config.DY_get_status_name(cd.status));
 	if (cd.status == S3StatusOK || cd.status == S3StatusHttpErrorNotFound) {
@@ -761,6 +940,240 @@ bool ECS3Attachment::should_retry(struct s3_cd &cd)
 	return true;
 }
 
+/**
+ * Execute the requests queued on a context. Without a context, requests
+ * have already been executed synchronously.
+ */
+void ECS3Attachment::run(S3RequestContext *ctx)
+{
+	if (ctx == nullptr)
+		return;
+	auto status = m_config.DY_runall_request_context(ctx);
+	if (status != S3StatusOK)
+		ec_log_debug("S3: running request context: %s",
+			m_config.DY_get_status_name(status));
+}
+
+/**
+ * Run a batch of requests concurrently on one context. @submit(i) queues
+ * request @i, which reports into @cd[i]. Requests that fail with a
+ * retryable status are resubmitted, up to S3_RETRIES times.
+ *
+ * @return S3StatusOK, or the status of the first failing request
+ */
+S3Status ECS3Attachment::run_batch(S3RequestContext *ctx, struct s3_cd *cd,
+    size_t n, const std::function<void(size_t)> &submit)
+{
+	std::vector<bool> todo(n, true);
+
+	for (int retries = S3_RETRIES; ; --retries) {
+		for (size_t i = 0; i < n; ++i) {
+			if (!todo[i])
+				continue;
+			cd[i].processed = 0;
+			cd[i].status = S3StatusInternalError;
+			submit(i);
+		}
+		run(ctx);
+		bool again = false;
+		for (size_t i = 0; i < n; ++i) {
+			todo[i] = cd[i].status != S3StatusOK;
+			if (!todo[i])
+				continue;
+			if (retries <= 0 || !m_config.DY_status_is_retryable(cd[i].status))
+				return cd[i].status;
+			again = true;
+		}
+		if (!again)
+			return S3StatusOK;
+		sleep(S3_SLEEP_DELAY);
+	}
+}
+
+/**
+ * Look up the size of an instance in the cache, without asking S3.
+ */
+bool ECS3Attachment::cached_size(const ext_siid &ins_id, size_t *size)
+{
+	scoped_lock locker(m_config.m_cachelock);
+	auto i = m_config.m_cache.find(ins_id.siid);
+	if (i == m_config.m_cache.cend() ||
+	    steady_clock::now() >= i->second.valid_until ||
+	    i->second.size == S3_NEGATIVE_ENTRY)
+		return false;
+	*size = i->second.size;
+	return true;
+}
+
+/**
+ * Upload an object as a multipart upload of S3_PART_SIZE parts, with up to
+ * S3_PARALLEL parts in flight.
+ *
+ * @param[in] fn object key
+ * @param[in] size object size
+ * @param[in] data object data, or nullptr to read from @source
+ * @param[in] source serializer to read from; at most S3_PARALLEL parts of
+ *            it are buffered at any time
+ *
+ * @return Kopano error code
+ */
+ECRESULT ECS3Attachment::mp_put(const char *fn, size_t size,
+    const unsigned char *data, ECSerializer *source)
+{
+	struct s3_cd cd;
+	struct s3_cdw cwdata;
+	cwdata.caller = this;
+	cwdata.cbdata = &cd;
+
+	std::unique_ptr<unsigned char[]> window;
+	if (data == nullptr) {
+		window.reset(new(std::nothrow) unsigned char[S3_PARALLEL * S3_PART_SIZE]);
+		if (window == nullptr)
+			return KCERR_NOT_ENOUGH_MEMORY;
+	}
+	cd.retries = S3_RETRIES;
+	do {
+		m_config.DY_initiate_multipart(&m_config.m_bkctx, fn, nullptr,
+			&m_config.m_mp_init_handler, nullptr, 0, &cwdata);
+	} while (m_config.DY_status_is_retryable(cd.status) && should_retry(cd));
+	if (cd.status != S3StatusOK || cd.upload_id.empty()) {
+		ec_log_err("S3: save %s: cannot start multipart upload: %s",
+			fn, m_config.DY_get_status_name(cd.status));
+		return KCERR_NETWORK_ERROR;
+	}
+
+	ECRESULT ret = erSuccess;
+	size_t nparts = (size + S3_PART_SIZE - 1) / S3_PART_SIZE;
+	std::vector<std::string> etags;
+	auto ctx = m_config.get_ctx();
+	for (size_t first = 0; first < nparts && ret == erSuccess; first += S3_PARALLEL) {
+		struct s3_cd part[S3_PARALLEL];
+		struct s3_cdw pcw[S3_PARALLEL];
+		size_t n = std::min(nparts - first, static_cast<size_t>(S3_PARALLEL));
+
+		for (size_t i = 0; i < n && ret == erSuccess; ++i) {
+			size_t off = (first + i) * S3_PART_SIZE;
+			part[i].size = std::min(size - off, static_cast<size_t>(S3_PART_SIZE));
+			pcw[i].caller = this;
+			pcw[i].cbdata = &part[i];
+			if (data != nullptr) {
+				part[i].data = const_cast<unsigned char *>(data) + off;
+				continue;
+			}
+			part[i].data = window.get() + i * S3_PART_SIZE;
+			ret = source->Read(part[i].data, 1, part[i].size);
+		}
+		if (ret != erSuccess)
+			break;
+		auto status = run_batch(ctx, part, n, [&](size_t i) {
+			m_config.DY_upload_part(&m_config.m_bkctx, fn, nullptr,
+				&m_config.m_put_obj_handler, first + i + 1,
+				cd.upload_id.c_str(), part[i].size, ctx, 0, &pcw[i]);
+		});
+		if (status != S3StatusOK) {
+			ec_log_err("S3: save %s: uploading part failed: %s",
+				fn, m_config.DY_get_status_name(status));
+			ret = KCERR_NETWORK_ERROR;
+			break;
+		}
+		for (size_t i = 0; i < n; ++i)
+			etags.emplace_back(std::move(part[i].etag));
+	}
+	m_config.put_ctx(ctx);
+
+	if (ret == erSuccess) {
+		std::string xml = "<CompleteMultipartUpload>";
+		for (size_t i = 0; i < etags.size(); ++i)
+			xml += "<Part><PartNumber>" + std::to_string(i + 1) +
+			       "</PartNumber><ETag>" + etags[i] + "</ETag></Part>";
+		xml += "</CompleteMultipartUpload>";
+		cd.data = reinterpret_cast<unsigned char *>(&xml[0]);
+		cd.retries = S3_RETRIES;
+		do {
+			cd.size = xml.size();
+			cd.processed = 0;
+			m_config.DY_complete_multipart_upload(&m_config.m_bkctx, fn,
+				&m_config.m_mp_commit_handler, cd.upload_id.c_str(),
+				xml.size(), nullptr, 0, &cwdata);
+		} while (m_config.DY_status_is_retryable(cd.status) && should_retry(cd));
+		cd.data = nullptr;
+		if (cd.status != S3StatusOK) {
+			ec_log_err("S3: save %s: cannot complete multipart upload: %s",
+				fn, m_config.DY_get_status_name(cd.status));
+			ret = KCERR_NETWORK_ERROR;
+		}
+	}
+	if (ret != erSuccess)
+		m_config.DY_abort_multipart_upload(&m_config.m_bkctx, fn,
+			cd.upload_id.c_str(), 0, &m_config.m_mp_abort_handler);
+	return ret;
+}
+
+/**
+ * Read an object of known size with ranged GETs of S3_PART_SIZE, with up
+ * to S3_PARALLEL requests in flight.
+ *
+ * @param[in] fn object key
+ * @param[in] size object size
+ * @param[out] buf buffer of @size bytes to read into, or nullptr to write
+ *             to @sink
+ * @param[in] sink serializer to write to; at most S3_PARALLEL parts are
+ *            buffered at any time
+ *
+ * @return Kopano error code
+ */
+ECRESULT ECS3Attachment::range_get(const char *fn, size_t size,
+    unsigned char *buf, ECSerializer *sink)
+{
+	std::unique_ptr<unsigned char[]> window;
+	if (buf == nullptr) {
+		window.reset(new(std::nothrow) unsigned char[S3_PARALLEL * S3_PART_SIZE]);
+		if (window == nullptr)
+			return KCERR_NOT_ENOUGH_MEMORY;
+	}
+
+	ECRESULT ret = erSuccess;
+	size_t nparts = (size + S3_PART_SIZE - 1) / S3_PART_SIZE;
+	auto ctx = m_config.get_ctx();
+	for (size_t first = 0; first < nparts && ret == erSuccess; first += S3_PARALLEL) {
+		struct s3_cd part[S3_PARALLEL];
+		struct s3_cdw pcw[S3_PARALLEL];
+		size_t len[S3_PARALLEL];
+		size_t n = std::min(nparts - first, static_cast<size_t>(S3_PARALLEL));
+
+		for (size_t i = 0; i < n; ++i) {
+			size_t off = (first + i) * S3_PART_SIZE;
+			len[i] = part[i].size = std::min(size - off, static_cast<size_t>(S3_PART_SIZE));
+			part[i].data = buf != nullptr ? buf + off : window.get() + i * S3_PART_SIZE;
+			pcw[i].caller = this;
+			pcw[i].cbdata = &part[i];
+		}
+		auto status = run_batch(ctx, part, n, [&](size_t i) {
+			part[i].size = len[i];
+			m_config.DY_get_object(&m_config.m_bkctx, fn,
+				&m_config.m_get_conditions, (first + i) * S3_PART_SIZE,
+				len[i], ctx, 0, &m_config.m_get_obj_handler, &pcw[i]);
+		});
+		if (status != S3StatusOK) {
+			ec_log_err("S3: load %s: ranged read failed: %s",
+				fn, m_config.DY_get_status_name(status));
+			ret = status == S3StatusHttpErrorNotFound ? KCERR_NOT_FOUND : KCERR_NETWORK_ERROR;
+			break;
+		}
+		for (size_t i = 0; i < n && ret == erSuccess; ++i) {
+			if (part[i].processed != len[i]) {
+				ec_log_err("S3: load %s: short read %zu/%zu bytes in part %zu",
+					fn, part[i].processed, len[i], first + i + 1);
+				ret = KCERR_DATABASE_ERROR;
+			} else if (sink != nullptr) {
+				ret = sink->Write(part[i].data, 1, len[i]);
+			}
+		}
+	}
+	m_config.put_ctx(ctx);
+	return ret;
+}
+
 /**
  * Return the size of an instance
  *
@@ -800,14 +1213,17 @@ ECRESULT ECS3Attachment::GetSizeInstance(const ext_siid &ins_id,
 	 * Loop at most S3_RETRIES times, to make sure that if the servers of
 	 * S3 reply with a redirect, we actually try again and process it.
 	 */
+	auto ctx = m_config.get_ctx();
 	cd.retries = S3_RETRIES;
 	do {
-		m_config.DY_head_object(&m_config.m_bkctx, fn, nullptr, 0,
+		m_config.DY_head_object(&m_config.m_bkctx, fn, ctx, 0,
 			&m_config.m_response_handler, &cwdata);
+		run(ctx);
 		if (m_config.DY_status_is_retryable(cd.status))
 			ec_log_debug("S3: getsize %s: retryable status: %s",
 				fn, m_config.DY_get_status_name(cd.status));
 	} while (m_config.DY_status_is_retryable(cd.status) && should_retry(cd));
+	m_config.put_ctx(ctx);
 
 	ec_log_debug("S3: getsize %s: %s, %zu bytes",
 		fn, m_config.DY_get_status_name(cd.status), cd.size);
@@ -7,10 +7,12 @@
 #ifdef HAVE_LIBS3_H
 #include <kopano/zcdefs.h>
 #include <kopano/platform.h>
+#include <functional>
 #include <list>
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 #include <libs3.h>
 #include <kopano/timeutil.hpp>
 #include "ECAttachmentStorage.h"
@@ -48,7 +50,16 @@ class ECS3Config final : public ECAttachmentConfig {
 	W(head_object)
 	W(delete_object)
 	W(get_object)
+	W(initiate_multipart)
+	W(upload_part)
+	W(complete_multipart_upload)
+	W(abort_multipart_upload)
+	W(create_request_context)
+	W(destroy_request_context)
+	W(runall_request_context)
 #undef W
+	S3RequestContext *get_ctx();
+	void put_ctx(S3RequestContext *);
 
 	S3BucketContext m_bkctx{};
 	/*
@@ -59,8 +70,17 @@ class ECS3Config final : public ECAttachmentConfig {
 	S3PutObjectHandler m_put_obj_handler{};
 	S3GetObjectHandler m_get_obj_handler{};
 	S3GetConditions m_get_conditions{};
+	S3MultipartInitialHandler m_mp_init_handler{};
+	S3MultipartCommitHandler m_mp_commit_handler{};
+	S3AbortMultipartUploadHandler m_mp_abort_handler{};
 	std::mutex m_cachelock;
 	std::map<ULONG, s3_cache_entry> m_cache;
+	/*
+	 * Idle request contexts. Each one carries a curl multi handle whose
+	 * connection cache keeps connections to S3 alive between requests.
+	 */
+	std::mutex m_ctx_lock;
+	std::vector<S3RequestContext *> m_ctx_pool;
 
 	friend class ECS3Attachment;
 };
@@ -87,6 +107,8 @@ class ECS3Attachment final : public ECAttachmentStorage {
 	static void response_complete_cb(S3Status, const S3ErrorDetails *, void *);
 	static S3Status get_obj_cb(int, const char *, void *);
 	static int put_obj_cb(int, char *, void *);
+	static S3Status mp_init_cb(const char *, void *);
+	static S3Status mp_commit_cb(const char *, const char *, void *);
 
 	S3Status response_prop(const S3ResponseProperties *, void *);
 	void response_complete(S3Status, const S3ErrorDetails *, void *);
@@ -94,6 +116,11 @@ class ECS3Attachment final : public ECAttachmentStorage {
 	int put_obj(int, char *, void *);
 	std::string make_att_filename(const ext_siid &, bool);
 	bool should_retry(struct s3_cd &);
+	void run(S3RequestContext *);
+	S3Status run_batch(S3RequestContext *, struct s3_cd *, size_t, const std::function<void(size_t)> &);
+	bool cached_size(const ext_siid &, size_t *);
+	ECRESULT mp_put(const char *, size_t, const unsigned char *, ECSerializer *);
+	ECRESULT range_get(const char *, size_t, unsigned char *, ECSerializer *);
 	struct s3_cd create_cd(void);
 	ECRESULT del_marked_att(const ext_siid &);
 	virtual ECRESULT Commit() override;
@@ -105,6 +132,7 @@ class ECS3Attachment final : public ECAttachmentStorage {
 	bool m_transact = false;
 
 	friend class ECS3Config;
+	friend class s3_fake_test;
 };
 
 } /* namespace */
@@ -3,6 +3,8 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <algorithm>
+#include <chrono>
 #include <memory>
 #include <utility>
 #include <kopano/memory.hpp>
@@ -16,6 +18,7 @@
 #include <kopano/ECLogger.h>
 #include "ECStoreObjectTable.h"
 #include "ECSubRestriction.h"
+#include "ECCompiledRestriction.h"
 #include "ECSearchFolders.h"
 #include "ECSessionManager.h"
 #include "StatsClient.h"
@@ -25,8 +28,21 @@
 #include <kopano/stringutil.h>
 #include "ECSearchClient.h"
 
+using namespace std::chrono_literals;
+
 namespace KC {
 
+/*
+ * Largest number of events an update thread takes per pass, and how long
+ * it waits for more events to coalesce while its lane holds less than that.
+ */
+static constexpr unsigned int SF_BATCH_MAX = 1000;
+static constexpr auto SF_LINGER = 100ms;
+/* How long UpdateSearchFolders waits for space in a full lane */
+static constexpr auto SF_THROTTLE_MAX = 1s;
+
+static thread_local bool sf_update_thread;
+
 class THREADINFO final : public ECTask {
 	public:
 	virtual void run();
@@ -39,13 +55,22 @@ ECSearchFolders::ECSearchFolders(ECSessionManager *lpSessionManager,
 	m_lpDatabaseFactory(lpFactory), m_lpSessionManager(lpSessionManager),
 	m_pool{atoui(lpSessionManager->GetConfig()->GetSetting("threads"))}
 {
-	auto ret = pthread_create(&m_threadProcess, nullptr, ECSearchFolders::ProcessThread, this);
-	if (ret != 0) {
-		ec_log_err("Could not create ECSearchFolders thread: %s", strerror(ret));
-		return;
+	auto cfg = lpSessionManager->GetConfig();
+	auto nlanes = std::max(1U, atoui(cfg->GetSetting("searchfolder_threads")));
+	m_ulLaneMax = atoui(cfg->GetSetting("searchfolder_queue_max")) / nlanes;
+
+	for (unsigned int i = 0; i < nlanes; ++i) {
+		m_lanes.emplace_back(new event_lane);
+		auto &lane = *m_lanes.back();
+		lane.parent = this;
+		auto ret = pthread_create(&lane.thread, nullptr, ECSearchFolders::ProcessThread, &lane);
+		if (ret != 0) {
+			ec_log_err("Could not create ECSearchFolders thread: %s", strerror(ret));
+			continue;
+		}
+		lane.thread_active = true;
+		set_thread_name(lane.thread, "SearchFolders");
 	}
-	m_thread_active = true;
-    set_thread_name(m_threadProcess, "SearchFolders");
 }
 
 ECSearchFolders::~ECSearchFolders() {
@@ -53,12 +78,15 @@ ECSearchFolders::~ECSearchFolders() {
 	m_mapSearchFolders.clear();
 	l_sf.unlock();
 
-	ulock_rec l_events(m_mutexEvents);
-    m_bExitThread = true;
-	m_condEvents.notify_all();
-	l_events.unlock();
-	if (m_thread_active)
-		pthread_join(m_threadProcess, nullptr);
+	m_bExitThread = true;
+	for (auto &lane : m_lanes) {
+		scoped_lock l_ev(lane->mtx);
+		lane->cond_events.notify_all();
+		lane->cond_space.notify_all();
+	}
+	for (auto &lane : m_lanes)
+		if (lane->thread_active)
+			pthread_join(lane->thread, nullptr);
 }
 
 // Only loads the search criteria for all search folders. Used once at boot time
@@ -246,6 +274,8 @@ ECRESULT ECSearchFolders::CancelSearchFolder(unsigned int ulStoreID, unsigned in
 		return KCERR_NOT_FOUND;
 
 	auto lpFolder = iterFolder->second;
+	/* An update thread may still hold it; it checks this under the folder's row lock */
+	lpFolder->bCancelled = true;
     // Remove the item from the list
     iterStore->second.erase(iterFolder);
 	g_lpSessionManager->m_stats->inc(SCN_SEARCHFOLDER_COUNT, -1);
@@ -286,8 +316,10 @@ ECRESULT ECSearchFolders::RemoveSearchFolder(unsigned int ulStoreID)
 	auto iterStore = m_mapSearchFolders.find(ulStoreID);
 	if (iterStore == m_mapSearchFolders.cend())
 		return KCERR_NOT_FOUND;
-	for (const auto &p : iterStore->second)
+	for (const auto &p : iterStore->second) {
+		p.second->bCancelled = true;
 		listSearchFolders.emplace_back(p.second);
+	}
 	iterStore->second.clear();
 
 	// Remove store from list, items of the store will be delete in 'DestroySearchFolder'
@@ -344,15 +376,30 @@ ECRESULT ECSearchFolders::UpdateSearchFolders(unsigned int ulStoreId, unsigned i
     ev.ulFolderId = ulFolderId;
     ev.ulObjectId = ulObjId;
     ev.ulType = ulType;
+	ev.tQueued = std::chrono::steady_clock::now();
 
-	scoped_rlock l_ev(m_mutexEvents);
+	auto &lane = get_lane(ulStoreId);
+	ulock_normal l_ev(lane.mtx);
+	/*
+	 * Back-pressure: while the lane is full, hold up the committing
+	 * thread for a while so that bulk imports cannot grow the queue
+	 * without bound. Update threads themselves never wait.
+	 */
+	if (m_ulLaneMax > 0 && lane.events.size() >= m_ulLaneMax && !sf_update_thread) {
+		g_lpSessionManager->m_stats->inc(SCN_SEARCHFOLDER_THROTTLED);
+		lane.cond_space.wait_for(l_ev, SF_THROTTLE_MAX, [&]() {
+			return lane.events.size() < m_ulLaneMax || m_bExitThread;
+		});
+	}
     // Add the event to the queue
-	m_lstEvents.emplace_back(std::move(ev));
+	lane.events.emplace_back(std::move(ev));
+	g_lpSessionManager->m_stats->set(SCN_SEARCHFOLDER_QUEUE, static_cast<LONGLONG>(++m_ulQueued));
 	/*
-	 * Signal a change in the queue (actually only needed for the first
-	 * event, but this wastes almost no time and is safer.
+	 * Wake the update thread for the first event, and again once a full
+	 * batch is waiting so that it stops lingering.
 	 */
-	m_condEvents.notify_all();
+	if (lane.events.size() == 1 || lane.events.size() == SF_BATCH_MAX)
+		lane.cond_events.notify_one();
 	return erSuccess;
 }
 
@@ -371,16 +418,23 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 
 	lstPrefix.emplace_back(PR_MESSAGE_FLAGS);
 	ECLocale locale = m_lpSessionManager->GetSortLocale(ulStoreId);
+	FOLDERIDSEARCH folders;
 	ulock_rec l_sf(m_mutexMapSearchFolders);
-
-	auto er = m_lpDatabaseFactory->get_tls_db(&lpDatabase);
-    if(er != erSuccess)
-		return er;
-	STOREFOLDERIDSEARCH::const_iterator iterStore = m_mapSearchFolders.find(ulStoreId);
+	auto iterStore = m_mapSearchFolders.find(ulStoreId);
     if (iterStore == m_mapSearchFolders.cend())
         // There are no search folders in the target store. We will therefore never match any search
         // result and might as well exit now.
 		return erSuccess;
+	/*
+	 * Work on a copy so that other stores can be updated concurrently.
+	 * A folder cancelled meanwhile is skipped by its bCancelled flag.
+	 */
+	folders = iterStore->second;
+	l_sf.unlock();
+
+	auto er = m_lpDatabaseFactory->get_tls_db(&lpDatabase);
+    if(er != erSuccess)
+		return er;
 
     // OPTIMIZATION: if a target folder == root folder of ulStoreId, and a recursive searchfolder, then
     // the following check is always TRUE
@@ -395,7 +449,7 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
     // a target folder if it is a recursive search.
     // Loop through search folders for this store
 	auto cache = m_lpSessionManager->GetCacheManager();
-	for (const auto &folder : iterStore->second) {
+	for (const auto &folder : folders) {
 		ULONG ulAttempts = 4;	// Random number
 
 		do {
@@ -406,6 +460,8 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 			if (folder.second->lpSearchCriteria->lpFolders == NULL ||
 			    folder.second->lpSearchCriteria->lpRestrict == NULL)
 				continue;
+			if (folder.second->bCancelled)
+				break;
 			auto dtx = lpDatabase->Begin(er);
 			if (er != erSuccess)
 				goto exit;
@@ -431,6 +487,14 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 				ec_log_crit("ECSearchFolders::ProcessMessageChange(): unexpected error %d", er);
 				goto exit;
 			}
+			/*
+			 * ResetResults takes the same row lock after the flag is
+			 * set, so results are never added after they were reset.
+			 */
+			if (folder.second->bCancelled) {
+				er = dtx.rollback();
+				break;
+			}
 
 			if(ulType != ECKeyTable::TABLE_ROW_DELETE) {
 				// Loop through all targets for each searchfolder, if one matches, then match the restriction with the objects
@@ -502,6 +566,12 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 						ec_log_crit("ECSearchFolders::ProcessMessageChange(): ECGenericObjectTable::GetRestrictPropTags failed %d", er);
 						goto exit;
 					}
+					ECCompiledRestriction prog;
+					er = prog.Compile(folder.second->lpSearchCriteria->lpRestrict, locale, lpPropTags);
+					if (er != erSuccess) {
+						ec_log_crit("ECSearchFolders::ProcessMessageChange(): ECCompiledRestriction::Compile failed %d", er);
+						goto exit;
+					}
 					// Get necessary row data for the object
 					er = ECStoreObjectTable::QueryRowData(NULL, NULL, lpSession, lstObjectIDs, lpPropTags, &ecOBStore, &lpRowSet, false, false);
 					if(er != erSuccess) {
@@ -521,7 +591,7 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 						bool fMatch;
 
 						// Match the restriction
-						er = ECGenericObjectTable::MatchRowRestrict(cache, &lpRowSet->__ptr[i], folder.second->lpSearchCriteria->lpRestrict, &sub_results, locale, &fMatch);
+						er = prog.Match(cache, &lpRowSet->__ptr[i], &sub_results, &fMatch);
 						if (er != erSuccess)
 							continue;
 						if (fMatch) {
@@ -654,7 +724,6 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 		}
     }
  exit:
-	l_sf.unlock();
     if(lpPropTags)
         FreePropTagArray(lpPropTags);
     if(lpSession) {
@@ -746,14 +815,20 @@ ECRESULT ECSearchFolders::ProcessCandidateRows(ECDatabase *lpDatabase,
 	bool fMatch = false;
 	std::list<unsigned int> lstFlags;
 	SUBRESTRICTIONRESULTS sub_results;
+	ECCompiledRestriction prog;
 
 	assert(lpPropTags->__ptr[0] == PR_MESSAGE_FLAGS);
 	auto iterRows = ecRows.cbegin();
 	auto cache = lpSession->GetSessionManager()->GetCacheManager();
+	auto er = prog.Compile(lpRestrict, locale, lpPropTags);
+	if (er != erSuccess) {
+		ec_log_err("ECSearchFolders::ProcessCandidateRows() ECCompiledRestriction::Compile failed %d", er);
+		return er;
+	}
 
     // Get the row data for the search
 	auto cleanup = make_scope_success([&]() { FreeRowSet(lpRowSet, true); });
-	auto er = ECStoreObjectTable::QueryRowData(nullptr, nullptr, lpSession, &ecRows, lpPropTags, lpODStore, &lpRowSet, false, false);
+	er = ECStoreObjectTable::QueryRowData(nullptr, nullptr, lpSession, &ecRows, lpPropTags, lpODStore, &lpRowSet, false, false);
 	if(er != erSuccess) {
 		ec_log_err("ECSearchFolders::ProcessCandidateRows() ECStoreObjectTable::QueryRowData failed %d", er);
 		return er;
@@ -768,7 +843,7 @@ ECRESULT ECSearchFolders::ProcessCandidateRows(ECDatabase *lpDatabase,
     // Loop through the results data
 	int lCount = 0, lUnreadCount = 0;
     for (gsoap_size_t j = 0; j< lpRowSet->__size && (!lpbCancel || !*lpbCancel); ++j, ++iterRows) {
-		if (ECGenericObjectTable::MatchRowRestrict(cache, &lpRowSet->__ptr[j], lpRestrict, &sub_results, locale, &fMatch) != erSuccess)
+		if (prog.Match(cache, &lpRowSet->__ptr[j], &sub_results, &fMatch) != erSuccess)
             continue;
         if(!fMatch)
             continue;
@@ -1386,77 +1461,97 @@ ECRESULT ECSearchFolders::SaveSearchCriteriaRow(ECDatabase *lpDatabase,
 
 void ECSearchFolders::FlushAndWait()
 {
-	ulock_rec l_ev(m_mutexEvents);
-	m_condEvents.notify_all();
-	l_ev.unlock();
-	// let ProcessThread get this lock, and mark the thread running
-	l_ev.lock();
-	l_ev.unlock();
-	// wait for an inactive search thread
-	while (m_bRunning) Sleep(10);
+	/* Make every lane skip its linger time, then wait until all are idle */
+	for (auto &lane : m_lanes) {
+		scoped_lock l_ev(lane->mtx);
+		lane->flush = true;
+		lane->cond_events.notify_all();
+	}
+	for (auto &lane : m_lanes) {
+		ulock_normal l_ev(lane->mtx);
+		while (lane->running || !lane->events.empty()) {
+			l_ev.unlock();
+			Sleep(10);
+			l_ev.lock();
+		}
+		lane->flush = false;
+	}
 }
 
 /*
- * This is the main processing thread, which processes changes from the queue. After processing it removes them from the queue and waits for
- * new events
+ * This is the main processing thread of a lane, which processes changes from the queue. After processing it removes
+ * them from the queue and waits for new events
  */
-void * ECSearchFolders::ProcessThread(void *lpSearchFolders)
+void * ECSearchFolders::ProcessThread(void *arg)
 {
 	kcsrv_blocksigs();
-	auto lpThis = static_cast<ECSearchFolders *>(lpSearchFolders);
+	auto &lane = *static_cast<event_lane *>(arg);
+	auto lpThis = lane.parent;
+	auto &stats = g_lpSessionManager->m_stats;
+	sf_update_thread = true;
 
     while(1) {
         // Get events to process
-		ulock_rec l_ev(lpThis->m_mutexEvents);
+		ulock_normal l_ev(lane.mtx);
 		if (lpThis->m_bExitThread)
 			break;
-		if (lpThis->m_lstEvents.empty())
+		if (lane.events.empty())
 			/*
 			 * No events, wait until one arrives (the mutex is
-			 * unlocked by pthread_cond_wait so people are able to
-			 * add new events). The condition also occurs when the
+			 * unlocked while waiting so people are able to add
+			 * new events). The condition also occurs when the
 			 * server is exiting.
 			 */
-			lpThis->m_condEvents.wait(l_ev);
+			lane.cond_events.wait(l_ev);
+		/*
+		 * Adaptive batching: with only a few events queued, give
+		 * related changes a moment to arrive so that they are
+		 * processed together; a full batch goes right away.
+		 */
+		if (!lane.events.empty() && !lane.flush && !lpThis->m_bExitThread)
+			lane.cond_events.wait_until(l_ev, lane.events.front().tQueued + SF_LINGER, [&]() {
+				return lane.events.size() >= SF_BATCH_MAX || lane.flush || lpThis->m_bExitThread;
+			});
 
-		lpThis->m_bRunning = true;
 		/*
-		 * The condition ended. Two things can have happened: there is
-		 * now at least one event waiting, or and exit has been
-		 * requested. In both cases, we simply unlock the mutex and
-		 * process any (may be 0) events currently in the queue. This
-		 * means that the caller must make sure that no new events can
-		 * be added after the m_bThreadExit flag is set to TRUE.
+		 * Either there are events waiting now, or an exit has been
+		 * requested. In both cases, we take the batch and process
+		 * any (may be 0) events from it. This means that the caller
+		 * must make sure that no new events can be added after the
+		 * m_bExitThread flag is set to TRUE.
 		 */
+		auto n = std::min(lane.events.size(), static_cast<size_t>(SF_BATCH_MAX));
+		if (n == 0)
+			continue;
+		std::deque<EVENT> batch(std::make_move_iterator(lane.events.begin()),
+			std::make_move_iterator(lane.events.begin() + n));
+		lane.events.erase(lane.events.begin(), lane.events.begin() + n);
+		lane.running = true;
 		l_ev.unlock();
-        lpThis->FlushEvents();
-        Sleep(1000);
-		lpThis->m_bRunning = false;
-        // Check if we need to exit
+		lane.cond_space.notify_all();
+
+		auto age = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - batch.front().tQueued).count();
+		stats->set(SCN_SEARCHFOLDER_QUEUE, static_cast<LONGLONG>(lpThis->m_ulQueued -= static_cast<unsigned int>(n)));
+		stats->inc(SCN_SEARCHFOLDER_EVENTS, static_cast<LONGLONG>(n));
+		stats->inc(SCN_SEARCHFOLDER_QUEUE_AGE, static_cast<LONGLONG>(age / 1000));
+		stats->hist(SCN_SEARCHFOLDER_QUEUE_AGE, age);
+		lpThis->FlushEvents(std::move(batch));
+
+		l_ev.lock();
+		lane.running = false;
     }
     return NULL;
 }
 
-// Process all waiting events in an efficient order
-ECRESULT ECSearchFolders::FlushEvents()
+// Process a batch of events in an efficient order
+ECRESULT ECSearchFolders::FlushEvents(std::deque<EVENT> &&lstEvents)
 {
-    std::list<EVENT> lstEvents;
     ECObjectTableList lstObjectIDs;
     sObjectTableKey sRow;
 
-    // We do a copy-remove-process cycle here to keep the event queue locked for the least time as possible with
-    // 500 events at a time
-	ulock_rec l_ev(m_mutexEvents);
-    for (int i = 0; i < 500; ++i) {
-        // Move the first element of m_lstEvents to the head of our list.
-        if(m_lstEvents.empty())
-            break;
-        lstEvents.splice(lstEvents.end(), m_lstEvents, m_lstEvents.begin());
-    }
-	l_ev.unlock();
     // Sort the items by folder. The order of DELETE and ADDs will remain unchanged. This is important
     // because the order of the incoming ADD or DELETE is obviously important for the final result.
-	lstEvents.sort([](const EVENT &a, const EVENT &b) { return a.ulFolderId < b.ulFolderId; });
+	std::stable_sort(lstEvents.begin(), lstEvents.end(), [](const EVENT &a, const EVENT &b) { return a.ulFolderId < b.ulFolderId; });
 
     // Send the changes grouped by folder (and therefore also by store)
 	unsigned int ulStoreId = 0, ulFolderId = 0;
@@ -1524,9 +1619,7 @@ sSearchFolderStats ECSearchFolders::get_stats()
 	}
 	l_sf.unlock();
 
-	ulock_rec l_ev(m_mutexEvents);
-	sStats.ulEvents = m_lstEvents.size();
-	l_ev.unlock();
+	sStats.ulEvents = m_ulQueued;
 	sStats.ullSize += sStats.ulEvents * sizeof(EVENT);
 	return sStats;
 }
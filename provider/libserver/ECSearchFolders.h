@@ -7,13 +7,17 @@
 #define ECSEARCHFOLDERS_H
 
 #include <kopano/zcdefs.h>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
+#include <vector>
 #include <pthread.h>
 #include "ECDatabaseFactory.h"
 #include <kopano/ECKeyTable.h>
 #include <kopano/ECThreadPool.h>
+#include <kopano/timeutil.hpp>
 #include "ECStoreObjectTable.h"
 #include "soapH.h"
 #include "SOAPUtils.h"
@@ -37,12 +41,15 @@ struct SEARCHFOLDER final {
 	struct searchCriteria *lpSearchCriteria = nullptr;
 	std::mutex mMutexThreadFree;
 	bool bThreadFree = true, bThreadExit = false;
+	/* Set once the folder is cancelled; update threads skip it from then on */
+	std::atomic<bool> bCancelled{false};
 	unsigned int ulStoreId, ulFolderId;
 };
 
 struct EVENT {
 	unsigned int ulStoreId, ulFolderId, ulObjectId;
     ECKeyTable::UpdateType  ulType;
+	time_point tQueued;
 };
 
 typedef std::map<unsigned int, std::shared_ptr<SEARCHFOLDER>> FOLDERIDSEARCH;
@@ -57,9 +64,10 @@ struct sSearchFolderStats {
 /**
  * Searchfolder handler
  *
- * This represents a single manager of all searchfolders on the server; a single thread runs on behalf of this
- * manager to handle all object changes, and another thread can be running for each searchfolder that is rebuilding. Most of
- * the time only the single update thread is running though.
+ * This represents a single manager of all searchfolders on the server; a small set of update threads runs on
+ * behalf of this manager to handle all object changes, and another thread can be running for each searchfolder that
+ * is rebuilding. Changes are partitioned over the update threads by store, so the changes of one store are always
+ * processed in order by the same thread.
  *
  * The searchfolder manager does four things:
  * - Loading all searchfolder definitions (restriction and folderlist) at startup
@@ -181,14 +189,26 @@ public:
 	_kc_hidden virtual void FlushAndWait(void);
 
 private:
+	/* A partition of the change queue, with its own update thread */
+	struct event_lane {
+		ECSearchFolders *parent;
+		std::deque<EVENT> events;
+		std::mutex mtx;
+		std::condition_variable cond_events, cond_space;
+		pthread_t thread;
+		bool thread_active = false, running = false, flush = false;
+	};
+
+	event_lane &get_lane(unsigned int store_id) { return *m_lanes[store_id % m_lanes.size()]; }
+
     /**
-     * Process all events in the queue and remove them from the queue.
+     * Process a batch of events of one lane
      *
      * Events for changed objects are queued internally and only processed after being flushed here. This function
      * groups same-type events together to increase performance because changes in the same folder can be processed
      * more efficiently at on time
      */
-	_kc_hidden virtual ECRESULT FlushEvents(void);
+	_kc_hidden virtual ECRESULT FlushEvents(std::deque<EVENT> &&);
 
     /**
      * Processes a list of message changes in a single folder that should be processed. This in turn
@@ -329,12 +349,13 @@ private:
     /**
      * Main processing thread entrypoint
      *
-     * This thread is running throughout the lifetime of the server and polls the queue periodically to process
-     * message changes many-at-a-time.
+     * These threads run throughout the lifetime of the server. Each one waits for changes on its own lane,
+     * lingers briefly while the lane is short so that changes can be processed many-at-a-time, and processes
+     * a full batch right away under load.
      *
-     * @param[in] lpSearchFolders Pointer to 'this' of search folder manager instance
+     * @param[in] lane Pointer to the event_lane to service
      */
-	_kc_hidden static void *ProcessThread(void *search_folders);
+	_kc_hidden static void *ProcessThread(void *lane);
 
 	/**
 	 * Save search criteria (row) to the database
@@ -383,16 +404,14 @@ private:
     ECSessionManager *m_lpSessionManager;
 	ECThreadPool m_pool;
 
-    // List of change events
-    std::list<EVENT> m_lstEvents;
-	std::recursive_mutex m_mutexEvents;
-	std::condition_variable_any m_condEvents;
-
-    // Change processing thread
-    pthread_t m_threadProcess;
+	// Change events, partitioned by store
+	std::vector<std::unique_ptr<event_lane>> m_lanes;
+	/* Events queued over all lanes, and the per-lane limit before UpdateSearchFolders waits */
+	std::atomic<unsigned int> m_ulQueued{0};
+	unsigned int m_ulLaneMax = 0;
 
-    // Exit request for processing thread
-	bool m_thread_active = false, m_bExitThread = false, m_bRunning = false;
+    // Exit request for processing threads
+	std::atomic<bool> m_bExitThread{false};
 
 	friend class THREADINFO;
 };
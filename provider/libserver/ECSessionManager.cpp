@@ -17,6 +17,7 @@
 #include <kopano/MAPIErrors.h>
 #include <kopano/hl.hpp>
 #include <kopano/memory.hpp>
+#include <kopano/stringutil.h>
 #include <kopano/tie.hpp>
 #include "ECMAPI.h"
 #include "ECDatabase.h"
@@ -24,6 +25,9 @@
 #include "ECSessionManager.h"
 #include "StatsClient.h"
 #include "ECTPropsPurge.h"
+#include "ECTableUpdateQueue.h"
+#include "ECTableSnapshots.h"
+#include "ECMaintenance.h"
 #include "ECDatabaseUtils.h"
 #include "ECSecurity.h"
 #include "SSLUtil.h"
@@ -64,7 +68,9 @@ ECSessionManager::ECSessionManager(std::shared_ptr<ECConfig> cfg,
 	        set_thread_name(m_hSessionCleanerThread, "SessionCleanUp");
 	}
 
-	m_lpNotificationManager.reset(new ECNotificationManager());
+	m_lpNotificationManager.reset(new ECNotificationManager(atoui(m_lpConfig->GetSetting("notification_threads")), m_stats));
+	m_lpTableUpdates.reset(new ECTableUpdateQueue(this, atoui(m_lpConfig->GetSetting("table_update_threads")), m_stats));
+	m_lpTableSnapshots.reset(new ECTableSnapshots(atoll(m_lpConfig->GetSetting("cache_table_snapshot_size")), m_stats));
 }
 
 ECSessionManager::~ECSessionManager()
@@ -73,6 +79,8 @@ ECSessionManager::~ECSessionManager()
 	bExit = TRUE;
 	m_hExitSignal.notify_one();
 	l_exit.unlock();
+	/* Its workers use sessions and database connections */
+	m_lpTableUpdates->stop();
 	m_lpTPropsPurge.reset();
 	m_lpDatabase.reset();
 	m_lpDatabaseFactory.reset();
@@ -700,6 +708,8 @@ ECRESULT ECSessionManager::UpdateTables(ECKeyTable::UpdateType ulType, unsigned
 
 	if(ulObjType != MAPI_MESSAGE && ulObjType != MAPI_FOLDER)
 		return erSuccess;
+	// Sort keys kept for the folder no longer hold for these rows
+	m_lpTableSnapshots->update(ulType, ulObjId, lstChildId);
 	sSubscription.ulType = TABLE_ENTRY::TABLE_TYPE_GENERIC;
 	sSubscription.ulRootObjectId = ulObjId;
 	sSubscription.ulObjectType = ulObjType;
@@ -718,31 +728,51 @@ ECRESULT ECSessionManager::UpdateSubscribedTables(ECKeyTable::UpdateType ulType,
 		setSessions.emplace(sub->second);
 	l_sub.unlock();
 
-    // We now have a set of sessions that are interested in the notification. This list is normally quite small since not that many
-    // sessions have the same table opened at one time.
+	/*
+	 * The tables of these sessions are updated by the table update
+	 * workers, which read the rows on their own database connections: so
+	 * hand the change over once the transaction that made it commits.
+	 */
+	ECDatabase *db = nullptr;
+	if (setSessions.empty() || m_lpDatabaseFactory->get_tls_db(&db) != erSuccess) {
+		m_lpTableUpdates->add(ulType, sSubscription, lstChildId, setSessions);
+		return erSuccess;
+	}
+	db->on_commit([=]() { m_lpTableUpdates->add(ulType, sSubscription, lstChildId, setSessions); });
+	return erSuccess;
+}
 
-    // For each of the sessions that are interested, send the table change
-	for (const auto &ses : setSessions) {
-		// Get session
-		std::shared_lock<KC::shared_mutex> l_cache(m_hCacheRWLock);
-		auto lpBTSession = GetSession(ses, true);
-		l_cache.unlock();
+void ECSessionManager::FlushTableUpdates(ECSESSIONID id)
+{
+	m_lpTableUpdates->flush(id);
+}
 
-	    // Send the change notification
-		if (lpBTSession == nullptr)
-			continue;
-		auto lpSession = dynamic_cast<ECSession *>(lpBTSession);
-		if (lpSession == NULL) {
-			lpBTSession->unlock();
-			continue;
-		}
-		if (sSubscription.ulType == TABLE_ENTRY::TABLE_TYPE_GENERIC)
-			lpSession->GetTableManager()->UpdateTables(ulType, sSubscription.ulObjectFlags, sSubscription.ulRootObjectId, lstChildId, sSubscription.ulObjectType);
-		else if (sSubscription.ulType == TABLE_ENTRY::TABLE_TYPE_OUTGOINGQUEUE)
-			lpSession->GetTableManager()->UpdateOutgoingTables(ulType, sSubscription.ulRootObjectId, lstChildId, sSubscription.ulObjectFlags, sSubscription.ulObjectType);
+void ECSessionManager::ApplyTableUpdates(ECSESSIONID id,
+    const std::list<std::shared_ptr<ECTableUpdate>> &items)
+{
+	// Get session
+	std::shared_lock<KC::shared_mutex> l_cache(m_hCacheRWLock);
+	auto lpBTSession = GetSession(id, true);
+	l_cache.unlock();
+
+	// Send the change notification
+	if (lpBTSession == nullptr)
+		return;
+	auto lpSession = dynamic_cast<ECSession *>(lpBTSession);
+	if (lpSession == NULL) {
 		lpBTSession->unlock();
+		return;
 	}
-	return erSuccess;
+	for (const auto &upd : items) {
+		/* The table manager may change the list */
+		auto lstChildId = upd->rows;
+		const auto &sub = upd->sub;
+		if (sub.ulType == TABLE_ENTRY::TABLE_TYPE_GENERIC)
+			lpSession->GetTableManager()->UpdateTables(upd->type, sub.ulObjectFlags, sub.ulRootObjectId, lstChildId, sub.ulObjectType, upd.get());
+		else if (sub.ulType == TABLE_ENTRY::TABLE_TYPE_OUTGOINGQUEUE)
+			lpSession->GetTableManager()->UpdateOutgoingTables(upd->type, sub.ulRootObjectId, lstChildId, sub.ulObjectFlags, sub.ulObjectType);
+	}
+	lpBTSession->unlock();
 }
 
 // FIXME: ulFolderId should be an entryid, because the parent is already deleted!
@@ -953,6 +983,12 @@ void ECSessionManager::update_extra_stats()
 	auto cm = GetCacheManager();
 	if (cm != nullptr)
 		cm->update_extra_stats(s);
+	ECMaintenance::update_stats(s);
+
+	KDatabase::stmt_stats([&](const std::string &name, uint64_t calls, uint64_t usec) {
+		s.set("sql_" + name + "_calls", "Executions of prepared statement " + name, calls);
+		s.set("sql_" + name + "_usec", "Total time spent in prepared statement " + name + " (usec)", usec);
+	});
 }
 
 /**
@@ -40,6 +40,9 @@ namespace KC {
 class ECConfig;
 class ECLogger;
 class ECTPropsPurge;
+class ECTableUpdate;
+class ECTableUpdateQueue;
+class ECTableSnapshots;
 
 typedef std::unordered_map<ECSESSIONGROUPID, ECSessionGroup *> EC_SESSIONGROUPMAP;
 typedef std::unordered_map<ECSESSIONID, BTSession *> SESSIONMAP;
@@ -165,6 +168,9 @@ public:
 	_kc_hidden ECRESULT UpdateTables(ECKeyTable::UpdateType, unsigned int flags, unsigned int obj_id, unsigned int child_id, unsigned int obj_type);
 	_kc_hidden ECRESULT UpdateTables(ECKeyTable::UpdateType, unsigned int flags, unsigned int obj_id, std::list<unsigned int> &objects, unsigned int obj_type);
 	_kc_hidden ECRESULT UpdateOutgoingTables(ECKeyTable::UpdateType, unsigned int store_id, unsigned int obj_id, unsigned int flags, unsigned int obj_type);
+	/* Apply the table changes still queued for a session to its tables */
+	_kc_hidden void FlushTableUpdates(ECSESSIONID);
+	_kc_hidden void ApplyTableUpdates(ECSESSIONID, const std::list<std::shared_ptr<ECTableUpdate>> &);
 	_kc_hidden ECRESULT NotificationModified(unsigned int obj_type, unsigned int obj_id, unsigned int parent_id = 0);
 	_kc_hidden ECRESULT NotificationCreated(unsigned int obj_type, unsigned int obj_id, unsigned int parent_id);
 	_kc_hidden ECRESULT NotificationMoved(unsigned int obj_type, unsigned int obj_id, unsigned int parent_id, unsigned int old_parent_id, entryId *old_eid = nullptr);
@@ -207,6 +213,7 @@ public:
 	_kc_hidden ECLocale GetSortLocale(ULONG store_id);
 	_kc_hidden ECCacheManager *GetCacheManager() const { return m_lpECCacheManager.get(); }
 	_kc_hidden ECSearchFolders *GetSearchFolders() const { return m_lpSearchFolders.get(); }
+	_kc_hidden ECTableSnapshots *GetTableSnapshots() const { return m_lpTableSnapshots.get(); }
 	_kc_hidden std::shared_ptr<ECConfig> GetConfig() const { return m_lpConfig; }
 	_kc_hidden std::shared_ptr<ECLogger> GetAudit() const { return m_lpAudit; }
 	_kc_hidden ECPluginFactory *GetPluginFactory() const { return m_lpPluginFactory.get(); }
@@ -262,6 +269,8 @@ protected:
 	std::unique_ptr<ECTPropsPurge> m_lpTPropsPurge;
 	ECLockManagerPtr m_ptrLockManager;
 	std::unique_ptr<ECNotificationManager> m_lpNotificationManager;
+	std::unique_ptr<ECTableUpdateQueue> m_lpTableUpdates;
+	std::unique_ptr<ECTableSnapshots> m_lpTableSnapshots;
 	std::unique_ptr<ECDatabase> m_lpDatabase;
 	std::unique_ptr<ECAttachmentConfig> m_atxconfig;
 
@@ -52,6 +52,7 @@
 #include <kopano/charset/convert.h>
 #include "ECSessionManager.h"
 #include "ECSession.h"
+#include "ECTableSnapshots.h"
 #include <map>
 
 namespace KC {
@@ -1057,6 +1058,29 @@ ECRESULT ECStoreObjectTable::CheckPermissions(unsigned int ulObjId)
 	return sec->CheckPermission(ulParent, ecSecurityRead);
 }
 
+/*
+ * The rows of a folder sort the same for every session, unless a sort
+ * column depends on who is looking (e.g. PR_ACCESS).
+ */
+bool ECStoreObjectTable::GetSnapshotKey(ECTableSnapshotKey *key)
+{
+	auto lpODStore = static_cast<const ECODStore *>(m_lpObjectData);
+	if (lpODStore->ulFolderId == 0 || IsMVSet() || lpsSortOrderArray == nullptr)
+		return false;
+	key->folder = lpODStore->ulFolderId;
+	key->obj_type = lpODStore->ulObjType;
+	key->flags = lpODStore->ulFlags & (MSGFLAG_ASSOCIATED | MSGFLAG_DELETED);
+	key->locale = m_locale.getName();
+	key->sort.clear();
+	for (gsoap_size_t i = 0; i < lpsSortOrderArray->__size; ++i) {
+		const auto &s = lpsSortOrderArray->__ptr[i];
+		if (ECGenProps::IsPropComputedUncached(s.ulPropTag, lpODStore->ulObjType) == erSuccess)
+			return false;
+		key->sort += stringify_hex(s.ulPropTag) + ":" + stringify(s.ulOrder) + ",";
+	}
+	return true;
+}
+
 ECRESULT ECStoreObjectTable::AddRowKey(ECObjectTableList* lpRows, unsigned int *lpulLoaded, unsigned int ulFlags, bool bLoad, bool bOverride, struct restrictTable *lpOverride)
 {
 	auto lpODStore = static_cast<const ECODStore *>(m_lpObjectData);
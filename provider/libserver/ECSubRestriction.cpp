@@ -13,6 +13,7 @@
 #include "ECSession.h"
 #include "ECStoreObjectTable.h"
 #include "ECGenericObjectTable.h"
+#include "ECCompiledRestriction.h"
 #include "SOAPUtils.h"
 #include "ECSessionManager.h"
 
@@ -131,6 +132,7 @@ static ECRESULT RunSubRestriction(ECSession *lpSession, const void *lpECODStore,
     bool fMatch = false;
     sObjectTableKey sKey;
     ECDatabase *lpDatabase = NULL;
+	ECCompiledRestriction prog;
 
 	auto cache = lpSession->GetSessionManager()->GetCacheManager();
 	auto er = lpSession->GetDatabase(&lpDatabase);
@@ -156,6 +158,9 @@ static ECRESULT RunSubRestriction(ECSession *lpSession, const void *lpECODStore,
     er = ECGenericObjectTable::GetRestrictPropTags(lpRestrict->lpSubObject, NULL, &lpPropTags);
     if(er != erSuccess)
         goto exit;
+	er = prog.Compile(lpRestrict->lpSubObject, locale, lpPropTags);
+	if (er != erSuccess)
+		goto exit;
 
     // Get the subobject IDs we are querying from the database
 	strQuery = "SELECT hierarchy.parent, hierarchy.id FROM hierarchy WHERE hierarchy.type = " +
@@ -198,7 +203,7 @@ static ECRESULT RunSubRestriction(ECSession *lpSession, const void *lpECODStore,
     iterObject = lstSubObjects.cbegin();
     // Loop through all the rows, see if they match
     for (gsoap_size_t i = 0; i < lpRowSet->__size; ++i) {
-		er = ECGenericObjectTable::MatchRowRestrict(cache, &lpRowSet->__ptr[i], lpRestrict->lpSubObject, nullptr, locale, &fMatch);
+		er = prog.Match(cache, &lpRowSet->__ptr[i], nullptr, &fMatch);
         if(er != erSuccess)
             goto exit;
 
@@ -22,6 +22,7 @@
 #include "ECStatsTables.h"
 #include "ECTableManager.h"
 #include "ECSessionManager.h"
+#include "ECTableUpdateQueue.h"
 #include "ECSession.h"
 #include "ECDatabaseUtils.h"
 #include "ECSecurity.h"
@@ -70,6 +71,8 @@ class ECSearchObjectTable final : public ECStoreObjectTable {
 
 	protected:
 	ECSearchObjectTable(ECSession *, unsigned int store, GUID *guid, unsigned int folder, unsigned int objtype, unsigned int flags, const ECLocale &);
+	/* Rows come from other folders, whose changes reach us later */
+	virtual bool GetSnapshotKey(ECTableSnapshotKey *) override { return false; }
 
 	private:
 	unsigned int m_ulFolderId, m_ulStoreId;
@@ -540,6 +543,8 @@ ECRESULT ECTableManager::OpenABTable(unsigned int ulParent, unsigned int ulParen
 
 ECRESULT ECTableManager::GetTable(unsigned int ulTableId, ECGenericObjectTable **lppTable)
 {
+	// Let the session see its own changes in its tables
+	g_lpSessionManager->FlushTableUpdates(lpSession->GetSessionId());
 	scoped_rlock lock(hListMutex);
 
 	auto iterTables = mapTable.find(ulTableId);
@@ -608,13 +613,14 @@ ECRESULT ECTableManager::UpdateOutgoingTables(ECKeyTable::UpdateType ulType, uns
 	return er;
 }
 
-ECRESULT ECTableManager::UpdateTables(ECKeyTable::UpdateType ulType, unsigned int ulFlags, unsigned int ulObjId, std::list<unsigned int> &lstChildId, unsigned int ulObjType)
+ECRESULT ECTableManager::UpdateTables(ECKeyTable::UpdateType ulType, unsigned int ulFlags, unsigned int ulObjId, std::list<unsigned int> &lstChildId, unsigned int ulObjType, ECTableUpdate *lpShared)
 {
 	ECRESULT er = erSuccess;
 	scoped_rlock lock(hListMutex);
 	bool filter_private = false;
 	std::string strInQuery, strQuery;
 	std::set<unsigned int> setObjIdPrivate;
+	const std::set<unsigned int> *lpObjIdPrivate = &setObjIdPrivate;
 	std::list<unsigned int> lstChildId2;
 	ECDatabase *lpDatabase = NULL;
 	DB_RESULT lpDBResult;
@@ -630,18 +636,25 @@ ECRESULT ECTableManager::UpdateTables(ECKeyTable::UpdateType ulType, unsigned in
 		er = lpSession->GetDatabase(&lpDatabase);
 		if (er != erSuccess)
 			return er;
-		strInQuery = kc_join(lstChildId, ",", stringify);
-		strQuery = "SELECT hierarchyid FROM properties WHERE hierarchyid IN (" + std::move(strInQuery) + ") AND tag = " + stringify(PROP_ID(PR_SENSITIVITY)) + " AND val_ulong >= 2;";
-		er = lpDatabase->DoSelect(strQuery, &lpDBResult);
-		if(er != erSuccess)
-			return er;
-		while ((lpDBRow = lpDBResult.fetch_row()) != nullptr) {
-			if(lpDBRow == NULL || lpDBRow[0] == NULL)
-				continue;
-			setObjIdPrivate.emplace(atoui(lpDBRow[0]));
+		if (lpShared != nullptr) {
+			// Looked up once for all sessions that get this change
+			er = lpShared->private_rows(lpDatabase, &lpObjIdPrivate);
+			if (er != erSuccess)
+				return er;
+		} else {
+			strInQuery = kc_join(lstChildId, ",", stringify);
+			strQuery = "SELECT hierarchyid FROM properties WHERE hierarchyid IN (" + std::move(strInQuery) + ") AND tag = " + stringify(PROP_ID(PR_SENSITIVITY)) + " AND val_ulong >= 2;";
+			er = lpDatabase->DoSelect(strQuery, &lpDBResult);
+			if(er != erSuccess)
+				return er;
+			while ((lpDBRow = lpDBResult.fetch_row()) != nullptr) {
+				if(lpDBRow == NULL || lpDBRow[0] == NULL)
+					continue;
+				setObjIdPrivate.emplace(atoui(lpDBRow[0]));
+			}
 		}
 		for(auto it = lstChildId.begin(); it != lstChildId.end(); ++it)
-			if (setObjIdPrivate.find(*it) == setObjIdPrivate.end())
+			if (lpObjIdPrivate->find(*it) == lpObjIdPrivate->end())
 				lstChildId2.emplace_back(*it);
 		filter_private = true;
 	}
@@ -0,0 +1,133 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016, Kopano and its licensors
+ */
+#include <kopano/platform.h>
+#include <tuple>
+#include <utility>
+#include "ECTableSnapshots.h"
+#include "StatsClient.h"
+
+namespace KC {
+
+bool ECTableSnapshotKey::operator<(const ECTableSnapshotKey &o) const
+{
+	return std::tie(folder, obj_type, flags, sort, locale) <
+	       std::tie(o.folder, o.obj_type, o.flags, o.sort, o.locale);
+}
+
+ECTableSnapshots::ECTableSnapshots(size_t max_size,
+    std::shared_ptr<ECStatsCollector> stats) :
+	m_stats(std::move(stats)), m_max_size(max_size)
+{}
+
+size_t ECTableSnapshots::row_size(const std::vector<ECSortCol> &cols)
+{
+	/* Map node, key and vector */
+	size_t size = 64 + cols.capacity() * sizeof(ECSortCol);
+	for (const auto &c : cols)
+		size += c.key.capacity();
+	return size;
+}
+
+void ECTableSnapshots::update_stats()
+{
+	if (m_stats == nullptr)
+		return;
+	m_stats->set(SCN_TABLESNAP_VIEWS, static_cast<LONGLONG>(m_views.size()));
+	m_stats->set(SCN_TABLESNAP_SIZE, static_cast<LONGLONG>(m_size));
+}
+
+void ECTableSnapshots::drop(viewmap::iterator i)
+{
+	m_size -= i->second.size;
+	m_lru.erase(i->second.lru);
+	m_views.erase(i);
+}
+
+std::shared_ptr<const ECTableSnapshots::rowmap>
+ECTableSnapshots::get(const ECTableSnapshotKey &key, uint64_t *gen)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	auto i = m_views.find(key);
+	if (i == m_views.end()) {
+		i = m_views.emplace(key, view()).first;
+		i->second.rows = std::make_shared<rowmap>();
+		i->second.gen = ++m_gen;
+		m_lru.emplace_front(key);
+		i->second.lru = m_lru.begin();
+		update_stats();
+	} else {
+		m_lru.splice(m_lru.begin(), m_lru, i->second.lru);
+	}
+	*gen = i->second.gen;
+	return i->second.rows;
+}
+
+void ECTableSnapshots::put(const ECTableSnapshotKey &key, uint64_t gen,
+    rowmap &&rows, size_t hits)
+{
+	if (m_stats != nullptr) {
+		m_stats->inc(SCN_TABLESNAP_HITS, static_cast<LONGLONG>(hits));
+		m_stats->inc(SCN_TABLESNAP_MISSES, static_cast<LONGLONG>(rows.size()));
+	}
+	if (rows.empty())
+		return;
+	std::lock_guard<std::mutex> lk(m_lock);
+	auto i = m_views.find(key);
+	if (i == m_views.end() || i->second.gen != gen)
+		return;
+	auto &v = i->second;
+	/* Readers keep the version they got */
+	if (v.rows.use_count() > 1)
+		v.rows = std::make_shared<rowmap>(*v.rows);
+	for (auto &r : rows) {
+		auto size = row_size(r.second);
+		auto res = v.rows->emplace(r.first, std::move(r.second));
+		if (!res.second)
+			continue;
+		v.size += size;
+		m_size += size;
+	}
+	/* Never drop the view that was just filled */
+	while (m_size > m_max_size && m_lru.size() > 1) {
+		auto victim = std::prev(m_lru.end());
+		if (!(*victim < key) && !(key < *victim))
+			--victim;
+		drop(m_views.find(*victim));
+	}
+	update_stats();
+}
+
+void ECTableSnapshots::update(ECKeyTable::UpdateType type,
+    unsigned int folder, const std::list<unsigned int> &objs)
+{
+	ECTableSnapshotKey first;
+	first.folder = folder;
+	std::lock_guard<std::mutex> lk(m_lock);
+	auto i = m_views.lower_bound(first);
+	while (i != m_views.end() && i->first.folder == folder) {
+		if (type == ECKeyTable::TABLE_CHANGE) {
+			drop(i++);
+			continue;
+		}
+		auto &v = i->second;
+		v.gen = ++m_gen;
+		if (v.rows.use_count() > 1)
+			v.rows = std::make_shared<rowmap>(*v.rows);
+		/* Deleted rows go, changed ones are computed again by the next reader */
+		for (auto obj : objs) {
+			for (auto r = v.rows->lower_bound(sObjectTableKey(obj, 0));
+			     r != v.rows->end() && r->first.ulObjId == obj; ) {
+				auto size = row_size(r->second);
+				v.size -= size;
+				m_size -= size;
+				r = v.rows->erase(r);
+			}
+		}
+		++i;
+	}
+	update_stats();
+}
+
+} /* namespace */
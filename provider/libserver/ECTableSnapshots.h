@@ -0,0 +1,79 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016, Kopano and its licensors
+ */
+#ifndef EC_TABLESNAPSHOTS_H
+#define EC_TABLESNAPSHOTS_H
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <kopano/ECKeyTable.h>
+
+namespace KC {
+
+class ECStatsCollector;
+
+/* One sorted view of the rows of a folder */
+struct ECTableSnapshotKey {
+	unsigned int folder = 0, obj_type = 0, flags = 0;
+	std::string sort; /* tags and directions of the sort columns */
+	std::string locale;
+
+	bool operator<(const ECTableSnapshotKey &) const;
+};
+
+/**
+ * Keeps the sort keys of the rows of folder views, so that the sessions
+ * that open the same view do not each query the sort columns of every row
+ * and collate them again. Every session still has its own key table with
+ * its cursor and bookmarks, and only asks for the rows that pass its own
+ * security check; rows that are not known yet are computed by the session
+ * and added for the next one.
+ *
+ * Readers get the rows of a view as a shared, read-only map. A change
+ * copies the map if a reader still holds it. Changes to rows (update())
+ * drop their keys from every view of the folder and bump the generation
+ * of those views, so that keys computed from data read before the change
+ * are not added afterwards.
+ */
+class ECTableSnapshots final {
+	public:
+	typedef std::map<sObjectTableKey, std::vector<ECSortCol>> rowmap;
+
+	ECTableSnapshots(size_t max_size, std::shared_ptr<ECStatsCollector>);
+	bool enabled() const { return m_max_size > 0; }
+	/* Rows known for @key; @gen is to be passed to put() */
+	std::shared_ptr<const rowmap> get(const ECTableSnapshotKey &key, uint64_t *gen);
+	/* Add rows computed since get(), unless the view changed meanwhile */
+	void put(const ECTableSnapshotKey &key, uint64_t gen, rowmap &&rows, size_t hits);
+	void update(ECKeyTable::UpdateType, unsigned int folder, const std::list<unsigned int> &rows);
+
+	private:
+	struct view {
+		std::shared_ptr<rowmap> rows;
+		uint64_t gen = 0;
+		size_t size = 0;
+		std::list<ECTableSnapshotKey>::iterator lru;
+	};
+	typedef std::map<ECTableSnapshotKey, view> viewmap;
+
+	static size_t row_size(const std::vector<ECSortCol> &);
+	void drop(viewmap::iterator);
+	void update_stats();
+
+	std::shared_ptr<ECStatsCollector> m_stats;
+	std::mutex m_lock;
+	viewmap m_views;
+	std::list<ECTableSnapshotKey> m_lru; /* most recently used first */
+	size_t m_max_size, m_size = 0;
+	uint64_t m_gen = 0;
+};
+
+} /* namespace */
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016, Kopano and its licensors
+ */
+#include <kopano/platform.h>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <kopano/ECThreadPool.h>
+#include <kopano/stringutil.h>
+#include <mapitags.h>
+#include "ECDatabase.h"
+#include "ECTableUpdateQueue.h"
+#include "StatsClient.h"
+
+namespace KC {
+
+ECTableUpdate::ECTableUpdate(ECKeyTable::UpdateType t,
+    const TABLESUBSCRIPTION &s, const std::list<unsigned int> &r) :
+	type(t), sub(s), rows(r), queued(decltype(queued)::clock::now()),
+	m_rowset(r.cbegin(), r.cend())
+{}
+
+ECRESULT ECTableUpdate::private_rows(ECDatabase *db,
+    const std::set<unsigned int> **out)
+{
+	std::lock_guard<std::mutex> lk(m_priv_lock);
+	if (!m_priv_done && !rows.empty()) {
+		DB_RESULT result;
+		m_priv_er = db->DoSelect("SELECT hierarchyid FROM properties WHERE hierarchyid IN (" +
+		            kc_join(rows, ",", stringify) + ") AND tag = " +
+		            stringify(PROP_ID(PR_SENSITIVITY)) + " AND val_ulong >= 2", &result);
+		if (m_priv_er == erSuccess) {
+			DB_ROW row;
+			while ((row = result.fetch_row()) != nullptr)
+				if (row[0] != nullptr)
+					m_private.emplace(atoui(row[0]));
+		}
+	}
+	m_priv_done = true;
+	*out = &m_private;
+	return m_priv_er;
+}
+
+class ECTableUpdateQueue::drain_task final : public ECTask {
+	public:
+	drain_task(ECTableUpdateQueue *q, ECSESSIONID id) : m_queue(q), m_id(id) {}
+
+	protected:
+	void run() override { m_queue->drain(m_id); }
+
+	private:
+	ECTableUpdateQueue *m_queue;
+	ECSESSIONID m_id;
+};
+
+ECTableUpdateQueue::ECTableUpdateQueue(ECSessionManager *mgr,
+    unsigned int nthreads, std::shared_ptr<ECStatsCollector> stats) :
+	m_mgr(mgr), m_stats(std::move(stats)), m_async(nthreads > 0)
+{
+	if (m_async)
+		m_pool.reset(new ECThreadPool(nthreads));
+}
+
+ECTableUpdateQueue::~ECTableUpdateQueue()
+{
+	stop();
+}
+
+void ECTableUpdateQueue::stop()
+{
+	std::unique_lock<std::mutex> lk(m_lock);
+	if (m_stopped)
+		return;
+	m_stopped = true;
+	lk.unlock();
+	/* Waits for the workers; changes still queued are dropped */
+	m_pool.reset();
+}
+
+void ECTableUpdateQueue::queue_changed(int delta)
+{
+	m_queued += delta;
+	if (m_stats != nullptr)
+		m_stats->set(SCN_TABLEUPD_QUEUE, static_cast<LONGLONG>(m_queued));
+}
+
+/*
+ * Queue a change of @rows in the tables matching @sub for each of
+ * @sessions. Without worker threads, the change is applied right away.
+ * The caller hands the change over once it is committed, since the workers
+ * read the rows on their own database connections.
+ */
+void ECTableUpdateQueue::add(ECKeyTable::UpdateType type,
+    const TABLESUBSCRIPTION &sub, const std::list<unsigned int> &rows,
+    const std::set<ECSESSIONID> &sessions)
+{
+	if (sessions.empty())
+		return;
+	std::unique_lock<std::mutex> lk(m_lock, std::defer_lock);
+	if (m_async)
+		lk.lock();
+	if (!m_async || m_stopped) {
+		if (lk.owns_lock())
+			lk.unlock();
+		ECTableUpdateList items = {std::make_shared<ECTableUpdate>(type, sub, rows)};
+		for (auto id : sessions)
+			m_mgr->ApplyTableUpdates(id, items);
+		return;
+	}
+
+	auto &open = m_open[sub];
+	std::shared_ptr<ECTableUpdate> upd;
+	if (open != nullptr && open->type == type) {
+		for (auto row : rows)
+			if (open->m_rowset.emplace(row).second)
+				open->rows.emplace_back(row);
+		upd = open;
+		if (m_stats != nullptr)
+			m_stats->inc(SCN_TABLEUPD_COALESCED);
+	} else {
+		upd = open = std::make_shared<ECTableUpdate>(type, sub, rows);
+	}
+
+	for (auto id : sessions) {
+		auto &q = m_sessions[id];
+		if (q.items.empty() || q.items.back() != upd) {
+			q.items.emplace_back(upd);
+			queue_changed(1);
+		}
+		if (q.scheduled || q.busy)
+			continue;
+		q.scheduled = true;
+		if (!(new drain_task(this, id))->queue_on(m_pool.get(), true))
+			q.scheduled = false;
+	}
+}
+
+/*
+ * Take all changes queued for @id and apply them with @lk released. Only
+ * one thread at a time does this for a session, so they stay in order.
+ */
+void ECTableUpdateQueue::run_items(ECSESSIONID id, ses_queue &q,
+    std::unique_lock<std::mutex> &lk)
+{
+	auto items = std::move(q.items);
+	q.items.clear();
+	q.busy = true;
+	for (const auto &upd : items) {
+		upd->m_started = true;
+		auto i = m_open.find(upd->sub);
+		if (i != m_open.cend() && i->second == upd)
+			m_open.erase(i);
+	}
+	queue_changed(-static_cast<int>(items.size()));
+	lk.unlock();
+
+	m_mgr->ApplyTableUpdates(id, items);
+	if (m_stats != nullptr) {
+		auto now = decltype(items.front()->queued)::clock::now();
+		for (const auto &upd : items) {
+			auto us = std::chrono::duration_cast<std::chrono::microseconds>(now - upd->queued).count();
+			m_stats->inc(SCN_TABLEUPD_APPLIED);
+			m_stats->inc(SCN_TABLEUPD_LATENCY, static_cast<LONGLONG>(us / 1000));
+			m_stats->hist(SCN_TABLEUPD_LATENCY, us);
+		}
+	}
+	items.clear();
+
+	lk.lock();
+	q.busy = false;
+	m_done.notify_all();
+}
+
+void ECTableUpdateQueue::drain(ECSESSIONID id)
+{
+	std::unique_lock<std::mutex> lk(m_lock);
+	auto i = m_sessions.find(id);
+	if (i == m_sessions.end())
+		return;
+	auto &q = i->second;
+	q.scheduled = false;
+	while (!q.busy && !q.items.empty())
+		run_items(id, q, lk);
+	if (!q.busy && !q.scheduled && q.items.empty())
+		m_sessions.erase(i);
+}
+
+/* Apply the changes queued for @id before the session looks at a table */
+void ECTableUpdateQueue::flush(ECSESSIONID id)
+{
+	if (!m_async)
+		return;
+	std::unique_lock<std::mutex> lk(m_lock);
+	while (!m_stopped) {
+		auto i = m_sessions.find(id);
+		if (i == m_sessions.end())
+			return;
+		auto &q = i->second;
+		if (q.busy) {
+			m_done.wait(lk);
+			continue;
+		}
+		if (q.items.empty()) {
+			if (!q.scheduled)
+				m_sessions.erase(i);
+			return;
+		}
+		run_items(id, q, lk);
+	}
+}
+
+} /* namespace */
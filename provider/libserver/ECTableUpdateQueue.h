@@ -0,0 +1,104 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016, Kopano and its licensors
+ */
+#ifndef EC_TABLEUPDATEQUEUE_H
+#define EC_TABLEUPDATEQUEUE_H
+
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <kopano/kcodes.h>
+#include <kopano/timeutil.hpp>
+#include <kopano/ECKeyTable.h>
+#include "ECSessionManager.h"
+
+namespace KC {
+
+class ECDatabase;
+class ECStatsCollector;
+class ECThreadPool;
+
+/**
+ * One change to the rows of the tables that match a subscription. The
+ * object is shared by all sessions that watch those tables.
+ */
+class ECTableUpdate final {
+	public:
+	ECTableUpdate(ECKeyTable::UpdateType, const TABLESUBSCRIPTION &, const std::list<unsigned int> &rows);
+	/*
+	 * Rows that are hidden from sessions that do not own the store
+	 * (PR_SENSITIVITY private or confidential). Looked up on the first
+	 * call, the later ones get the same set.
+	 */
+	ECRESULT private_rows(ECDatabase *, const std::set<unsigned int> **);
+
+	ECKeyTable::UpdateType type;
+	TABLESUBSCRIPTION sub;
+	std::list<unsigned int> rows;
+	time_point queued;
+
+	private:
+	friend class ECTableUpdateQueue;
+	std::set<unsigned int> m_rowset;
+	/* Set when the first session starts applying it; no rows are added after that */
+	bool m_started = false;
+	std::mutex m_priv_lock;
+	bool m_priv_done = false;
+	ECRESULT m_priv_er = erSuccess;
+	std::set<unsigned int> m_private;
+};
+
+typedef std::list<std::shared_ptr<ECTableUpdate>> ECTableUpdateList;
+
+/**
+ * Applies table changes to the tables of the subscribed sessions on a
+ * pool of threads, so that the request that made the change does not wait
+ * for every session that has the folder open.
+ *
+ * Changes are queued per session in order. A change of the same kind to
+ * the same tables that has not been started yet takes in the rows of the
+ * next one instead of queueing another, so a burst of modifications in a
+ * folder becomes one update per session. A session sees its own queue
+ * applied before any of its table calls (flush()), so it still finds its
+ * own changes in its tables.
+ */
+class ECTableUpdateQueue final {
+	public:
+	ECTableUpdateQueue(ECSessionManager *, unsigned int nthreads, std::shared_ptr<ECStatsCollector>);
+	~ECTableUpdateQueue();
+	void add(ECKeyTable::UpdateType, const TABLESUBSCRIPTION &, const std::list<unsigned int> &rows, const std::set<ECSESSIONID> &);
+	void flush(ECSESSIONID);
+	/* Stop the workers; later changes are applied by the caller */
+	void stop();
+
+	private:
+	struct ses_queue {
+		ECTableUpdateList items;
+		bool scheduled = false, busy = false;
+	};
+	class drain_task;
+
+	void drain(ECSESSIONID);
+	void run_items(ECSESSIONID, ses_queue &, std::unique_lock<std::mutex> &);
+	void queue_changed(int delta);
+
+	ECSessionManager *m_mgr;
+	std::shared_ptr<ECStatsCollector> m_stats;
+	std::mutex m_lock;
+	std::condition_variable m_done;
+	/* Latest not yet started change per subscription, which can take in more rows */
+	std::map<TABLESUBSCRIPTION, std::shared_ptr<ECTableUpdate>> m_open;
+	std::unordered_map<ECSESSIONID, ses_queue> m_sessions;
+	std::unique_ptr<ECThreadPool> m_pool;
+	size_t m_queued = 0;
+	bool m_async, m_stopped = false;
+};
+
+} /* namespace */
+
+#endif
@@ -4,6 +4,7 @@
  */
 #include <new>
 #include <clocale>
+#include <climits>
 #include <cstdint>
 #include <kopano/platform.h>
 #include <kopano/memory.hpp>
@@ -83,6 +84,30 @@ class ECStreamSerializer final : public ECSerializer {
 	ULONG m_ulRead = 0, m_ulWritten = 0;
 };
 
+/*
+ * Forwards attachment data to the real sink, but never more than the length
+ * that was announced in the stream header. The attachment storage backends
+ * push their data through here in fixed-size chunks, so memory use for a
+ * streamed attachment does not depend on its size.
+ */
+class ECBoundedSerializer final : public ECSerializer {
+	public:
+	ECBoundedSerializer(ECSerializer *sink, size_t limit) : m_sink(sink), m_left(limit) {}
+	virtual ECRESULT SetBuffer(void *) override { return KCERR_NO_SUPPORT; }
+	virtual ECRESULT Write(const void *ptr, size_t size, size_t nmemb) override;
+	virtual ECRESULT Read(void *, size_t, size_t) override { return KCERR_NO_SUPPORT; }
+	virtual ECRESULT Skip(size_t, size_t) override { return KCERR_NO_SUPPORT; }
+	virtual ECRESULT Flush() override { return m_sink->Flush(); }
+	virtual ECRESULT Stat(unsigned int *have_read, unsigned int *have_written) override { return m_sink->Stat(have_read, have_written); }
+	ECRESULT Done() const;
+	size_t left() const { return m_left; }
+	size_t excess() const { return m_excess; }
+
+	private:
+	ECSerializer *m_sink;
+	size_t m_left, m_excess = 0;
+};
+
 const static struct StreamCaps {
 	bool bSupportUnicode;
 } g_StreamCaps[] = {
@@ -259,6 +284,25 @@ ECRESULT ECStreamSerializer::Stat(ULONG *lpcbRead, ULONG *lpcbWrite)
 	return erSuccess;
 }
 
+ECRESULT ECBoundedSerializer::Write(const void *ptr, size_t size, size_t nmemb)
+{
+	if (ptr == nullptr || size != 1)
+		return KCERR_INVALID_PARAMETER;
+	auto len = std::min(nmemb, m_left);
+	m_excess += nmemb - len;
+	m_left -= len;
+	return len == 0 ? erSuccess : m_sink->Write(ptr, 1, len);
+}
+
+/*
+ * The stream is only usable if exactly the announced length was written;
+ * anything else leaves the reader misaligned.
+ */
+ECRESULT ECBoundedSerializer::Done() const
+{
+	return m_left == 0 && m_excess == 0 ? erSuccess : KCERR_DATABASE_ERROR;
+}
+
 NamedPropertyMapper::NamedPropertyMapper(ECDatabase *lpDatabase)
 	: m_lpDatabase(lpDatabase)
 {
@@ -1048,31 +1092,57 @@ ECRESULT SerializeMessage(ECSession *lpecSession, ECDatabase *lpStreamDatabase,
 
 		unsigned int ulLen = 0;
 		unsigned char *data = nullptr;
-		size_t temp = 0;
+		size_t temp = SIZE_MAX;
 		/*
 		 * Handle DB/FS corruption where the db cache says it
 		 * exists but Load says it does not.
 		 */
 		er = lpAttachmentStorage->ExistAttachment(ulSubObjId, PROP_ID(PR_ATTACH_DATA_BIN)) ? erSuccess : KCERR_NOT_FOUND;
-		if (er == erSuccess)
-			er = lpAttachmentStorage->LoadAttachment(NULL, ulSubObjId, PROP_ID(PR_ATTACH_DATA_BIN), &temp, &data);
-		if (er != KCERR_NOT_FOUND) {
+		if (er == erSuccess &&
+		    lpAttachmentStorage->GetSize(ulSubObjId, PROP_ID(PR_ATTACH_DATA_BIN), &temp) == erSuccess &&
+		    temp > 0 && temp <= UINT_MAX) {
+			/*
+			 * The size is known up front, so write the header and
+			 * let the storage push the data through to the sink
+			 * chunk by chunk instead of loading it whole.
+			 */
+			ulLen = temp;
+			er = lpSink->Write(&ulLen, sizeof(ulLen), 1);
 			if (er != erSuccess)
 				goto exit;
-			ulLen = (unsigned int)temp;
-			er = lpSink->Write(&ulLen, sizeof(ulLen), 1);
+			ECBoundedSerializer bsink(lpSink, ulLen);
+			er = lpAttachmentStorage->LoadAttachment(ulSubObjId, PROP_ID(PR_ATTACH_DATA_BIN), &temp, &bsink);
+			if (er != erSuccess && er != KCERR_NOT_FOUND)
+				goto exit;
+			er = bsink.Done();
 			if (er != erSuccess) {
-				s_free(NULL, data);
+				ec_log_err("SerializeObject: attachment data of object %d does not match its size: expected %u bytes, %s %zu",
+					ulSubObjId, ulLen, bsink.left() > 0 ? "missing" : "got",
+					bsink.left() > 0 ? bsink.left() : bsink.excess() + ulLen);
 				goto exit;
 			}
-			er = lpSink->Write(data, 1, ulLen);
-			s_free(NULL, data);
-			if (er != erSuccess)
-				goto exit;
 		} else {
-			er = lpSink->Write(&ulLen, sizeof(ulLen), 1);
-			if (er != erSuccess)
-				goto exit;
+			/* Size unknown (e.g. multi-stream gzip), load in one piece. */
+			if (er == erSuccess)
+				er = lpAttachmentStorage->LoadAttachment(NULL, ulSubObjId, PROP_ID(PR_ATTACH_DATA_BIN), &temp, &data);
+			if (er != KCERR_NOT_FOUND) {
+				if (er != erSuccess)
+					goto exit;
+				ulLen = (unsigned int)temp;
+				er = lpSink->Write(&ulLen, sizeof(ulLen), 1);
+				if (er != erSuccess) {
+					s_free(NULL, data);
+					goto exit;
+				}
+				er = lpSink->Write(data, 1, ulLen);
+				s_free(NULL, data);
+				if (er != erSuccess)
+					goto exit;
+			} else {
+				er = lpSink->Write(&ulLen, sizeof(ulLen), 1);
+				if (er != erSuccess)
+					goto exit;
+			}
 		}
 
 		// start sub objects, can only be 0 or 1
@@ -54,6 +54,7 @@
 #include "ECStringCompat.h"
 #include "ECTableManager.h"
 #include "ECTPropsPurge.h"
+#include "ECMaintenance.h"
 #include "versions.h"
 #include "ECTestProtocol.h"
 #include <kopano/ECDefs.h>
@@ -307,15 +308,49 @@ ECRESULT ECFifoSerializer::SetBuffer(void *lpBuffer)
 	return erSuccess;
 }
 
+/*
+ * Byte-swap @nmemb elements of type T straight into the FIFO's free space,
+ * rather than pushing each element through a separate locked Write.
+ */
+template<typename T, typename F> static ECRESULT
+fifo_write_swapped(ECFifoBuffer *fifo, const void *ptr, size_t nmemb, F &&conv)
+{
+	auto src = static_cast<const unsigned char *>(ptr);
+
+	while (nmemb > 0) {
+		unsigned char *span;
+		ECFifoBuffer::size_type len;
+		T v;
+		auto er = fifo->GetWriteSpan(&span, &len, STR_DEF_TIMEOUT, nmemb * sizeof(T));
+		if (er != erSuccess)
+			return er;
+		size_t n = std::min(len / sizeof(T), nmemb);
+		if (n == 0) {
+			/* Element straddles the end of the ring */
+			memcpy(&v, src, sizeof(v));
+			v = conv(v);
+			er = fifo->Write(&v, sizeof(v), STR_DEF_TIMEOUT, nullptr);
+			if (er != erSuccess)
+				return er;
+			src += sizeof(v);
+			--nmemb;
+			continue;
+		}
+		for (size_t x = 0; x < n; ++x) {
+			memcpy(&v, src + x * sizeof(v), sizeof(v));
+			v = conv(v);
+			memcpy(span + x * sizeof(v), &v, sizeof(v));
+		}
+		fifo->CommitWrite(n * sizeof(T));
+		src += n * sizeof(T);
+		nmemb -= n;
+	}
+	return erSuccess;
+}
+
 ECRESULT ECFifoSerializer::Write(const void *ptr, size_t size, size_t nmemb)
 {
 	ECRESULT er = erSuccess;
-	union {
-		char c[8];
-		short s;
-		int i;
-		long long ll;
-	} tmp;
 
 	if (m_mode != serialize)
 		return KCERR_NO_SUPPORT;
@@ -327,22 +362,16 @@ ECRESULT ECFifoSerializer::Write(const void *ptr, size_t size, size_t nmemb)
 		er = m_lpBuffer->Write(ptr, nmemb, STR_DEF_TIMEOUT, NULL);
 		break;
 	case 2:
-		for (size_t x = 0; x < nmemb && er == erSuccess; ++x) {
-			tmp.s = htons(static_cast<const short *>(ptr)[x]);
-			er = m_lpBuffer->Write(&tmp, size, STR_DEF_TIMEOUT, nullptr);
-		}
+		er = fifo_write_swapped<uint16_t>(m_lpBuffer, ptr, nmemb,
+		     [](uint16_t x) -> uint16_t { return htons(x); });
 		break;
 	case 4:
-		for (size_t x = 0; x < nmemb && er == erSuccess; ++x) {
-			tmp.i = htonl(static_cast<const int *>(ptr)[x]);
-			er = m_lpBuffer->Write(&tmp, size, STR_DEF_TIMEOUT, nullptr);
-		}
+		er = fifo_write_swapped<uint32_t>(m_lpBuffer, ptr, nmemb,
+		     [](uint32_t x) -> uint32_t { return htonl(x); });
 		break;
 	case 8:
-		for (size_t x = 0; x < nmemb && er == erSuccess; ++x) {
-			tmp.ll = cpu_to_be64(static_cast<const uint64_t *>(ptr)[x]);
-			er = m_lpBuffer->Write(&tmp, size, STR_DEF_TIMEOUT, nullptr);
-		}
+		er = fifo_write_swapped<uint64_t>(m_lpBuffer, ptr, nmemb,
+		     [](uint64_t x) -> uint64_t { return cpu_to_be64(x); });
 		break;
 	default:
 		er = KCERR_INVALID_PARAMETER;
@@ -402,27 +431,41 @@ ECRESULT ECFifoSerializer::Read(void *ptr, size_t size, size_t nmemb)
 
 ECRESULT ECFifoSerializer::Skip(size_t size, size_t nmemb)
 {
-	auto buf = make_unique_nt<char[]>(size * nmemb);
-	if (buf == nullptr)
-		return KCERR_NOT_ENOUGH_MEMORY;
-	return Read(buf.get(), size, nmemb);
+	size_t left = size * nmemb;
+
+	if (m_mode != deserialize)
+		return KCERR_NO_SUPPORT;
+	/* Discard in place, no need to copy the data out. */
+	while (left > 0) {
+		const unsigned char *span;
+		ECFifoBuffer::size_type len;
+		auto er = m_lpBuffer->GetReadSpan(&span, &len, STR_DEF_TIMEOUT, left);
+		if (er != erSuccess)
+			return er;
+		if (len == 0)
+			return KCERR_CALL_FAILED;
+		len = std::min(len, left);
+		m_lpBuffer->CommitRead(len);
+		m_ulRead += len;
+		left -= len;
+	}
+	return erSuccess;
 }
 
 ECRESULT ECFifoSerializer::Flush()
 {
-	ECRESULT er;
-	size_t cbRead = 0;
-	char buf[16384];
-
 	while (true) {
-		er = m_lpBuffer->Read(buf, sizeof(buf), STR_DEF_TIMEOUT, &cbRead);
+		const unsigned char *span;
+		ECFifoBuffer::size_type len;
+		auto er = m_lpBuffer->GetReadSpan(&span, &len, STR_DEF_TIMEOUT, SIZE_MAX);
 		if (er != erSuccess)
 			return er;
-		m_ulRead += cbRead;
-		if (cbRead < sizeof(buf))
+		if (len == 0)
 			break;
+		m_lpBuffer->CommitRead(len);
+		m_ulRead += len;
 	}
-	return er;
+	return erSuccess;
 }
 
 ECRESULT ECFifoSerializer::Stat(ULONG *lpcbRead, ULONG *lpcbWrite)
@@ -857,17 +900,92 @@ int KCmdService::fname(ULONG64 ulSessionId, ##__VA_ARGS__) \
 	if (lpDatabase && FAILED(er)) \
 		lpDatabase->Rollback(); \
 
+namespace {
+
+/* Purges soft-deleted objects of one type, deleted before a given time */
+class SoftDeletePurgeTask final : public ECMaintenanceTask {
+	public:
+	SoftDeletePurgeTask(unsigned int type, const FILETIME &ft) : m_type(type), m_ft(ft) {}
+	const char *name() const override
+	{
+		return m_type == MAPI_STORE ? "softdelete_stores" :
+		       m_type == MAPI_FOLDER ? "softdelete_folders" : "softdelete_messages";
+	}
+	ECRESULT chunk(ECSession *, ECDatabase *, unsigned int batch, unsigned int &pos, unsigned int &done) override;
+
+	private:
+	unsigned int m_type;
+	FILETIME m_ft;
+};
+
+}
+
+ECRESULT SoftDeletePurgeTask::chunk(ECSession *lpecSession,
+    ECDatabase *lpDatabase, unsigned int batch, unsigned int &pos,
+    unsigned int &done)
+{
+	DB_RESULT lpDBResult;
+	DB_ROW lpDBRow = nullptr;
+	ECListInt lObjectIds;
+	std::string strQuery;
+
+	// Although it doesn't make sense for the message deleter to include EC_DELETE_FOLDERS, it doesn't hurt either, since they shouldn't be there
+	// and we really want to delete all the softdeleted items anyway.
+	unsigned int ulDeleteFlags = EC_DELETE_CONTAINER | EC_DELETE_FOLDERS | EC_DELETE_MESSAGES | EC_DELETE_RECIPIENTS | EC_DELETE_ATTACHMENTS | EC_DELETE_HARD_DELETE;
+
+	if (m_type == MAPI_STORE)
+		// Select softdeleted stores (ignore softdelete_lifetime setting because a store can't be restored anyway).
+		// Every store is a large delete of its own, so take them one at a time.
+		strQuery = "SELECT id FROM hierarchy WHERE id>" + stringify(pos) + " AND parent IS NULL AND (flags&" + stringify(MSGFLAG_DELETED) + ")=" + stringify(MSGFLAG_DELETED) + " AND type=" + stringify(MAPI_STORE) + " ORDER BY id LIMIT 1";
+	else
+		strQuery = "SELECT h.id FROM hierarchy AS h JOIN properties AS p ON p.hierarchyid=h.id AND p.tag="+stringify(PROP_ID(PR_DELETED_ON))+" AND p.type="+stringify(PROP_TYPE(PR_DELETED_ON))+" WHERE h.id>"+stringify(pos)+" AND (h.flags&"+stringify(MSGFLAG_DELETED)+")="+stringify(MSGFLAG_DELETED)+" AND h.type="+stringify(m_type)+" AND p.val_hi<="+stringify(m_ft.dwHighDateTime)+" ORDER BY h.id LIMIT "+stringify(batch);
+	auto er = lpDatabase->DoSelect(strQuery, &lpDBResult);
+	if (er != erSuccess)
+		return er;
+	while ((lpDBRow = lpDBResult.fetch_row()) != nullptr) {
+		if (lpDBRow[0] == nullptr)
+			continue;
+		lObjectIds.emplace_back(atoui(lpDBRow[0]));
+	}
+	// free before we call DeleteObjects()
+	lpDBResult = DB_RESULT();
+	if (lObjectIds.empty())
+		return erSuccess;
+
+	auto last = lObjectIds.back();
+	auto count = lObjectIds.size();
+	if (m_type == MAPI_STORE) {
+		ec_log_info(" purge store (%d)", last);
+		er = DeleteObjects(lpecSession, lpDatabase, last, ulDeleteFlags | EC_DELETE_STORE, 0, false, false);
+	} else {
+		er = DeleteObjects(lpecSession, lpDatabase, &lObjectIds, ulDeleteFlags, 0, false, false);
+	}
+	if (er != erSuccess) {
+		ec_log_err("Error while removing softdelete %s objects, error code: 0x%x.",
+			m_type == MAPI_STORE ? "store" : m_type == MAPI_FOLDER ? "folder" : "message", er);
+		return er;
+	}
+	pos = last;
+	done += count;
+	return erSuccess;
+}
+
+/**
+ * Purge soft-deleted stores, folders and messages, in that order.
+ *
+ * With @throttle set, the purge runs as scheduled maintenance: it
+ * continues where the previous run stopped and yields to user requests
+ * (see ECMaintenance).
+ */
 static ECRESULT PurgeSoftDelete(ECSession *lpecSession,
     unsigned int ulLifetime, unsigned int *lpulMessages,
-    unsigned int *lpulFolders, unsigned int *lpulStores, bool *lpbExit)
+    unsigned int *lpulFolders, unsigned int *lpulStores, bool *lpbExit,
+    bool throttle)
 {
 	ECRESULT 		er = erSuccess;
-	ECDatabase*		lpDatabase = NULL;
-	DB_RESULT lpDBResult;
-	DB_ROW			lpDBRow = NULL;
 	FILETIME		ft;
-	ECListInt		lObjectIds;
 	bool 			bExitDummy = false;
+	unsigned int ulMessages = 0, ulFolders = 0, ulStores = 0;
 
 	auto laters = make_scope_success([&]() {
 		if (er != KCERR_BUSY)
@@ -875,117 +993,22 @@ static ECRESULT PurgeSoftDelete(ECSession *lpecSession,
 	});
 	if (g_bPurgeSoftDeleteStatus) {
 		ec_log_err("Softdelete already running");
-		return KCERR_BUSY;
+		return er = KCERR_BUSY;
 	}
 	g_bPurgeSoftDeleteStatus = TRUE;
 	if (!lpbExit)
 		lpbExit = &bExitDummy;
-	er = lpecSession->GetDatabase(&lpDatabase);
-	if (er != erSuccess)
-		return er;
 
-	// Although it doesn't make sense for the message deleter to include EC_DELETE_FOLDERS, it doesn't hurt either, since they shouldn't be there
-	// and we really want to delete all the softdeleted items anyway.
-	unsigned int ulDeleteFlags = EC_DELETE_CONTAINER | EC_DELETE_FOLDERS | EC_DELETE_MESSAGES | EC_DELETE_RECIPIENTS | EC_DELETE_ATTACHMENTS | EC_DELETE_HARD_DELETE;
 	GetSystemTimeAsFileTime(&ft);
 	ft = UnixTimeToFileTime(FileTimeToUnixTime(ft) - ulLifetime);
 
-	// Select softdeleted stores (ignore softdelete_lifetime setting because a store can't be restored anyway)
-	auto strQuery = "SELECT id FROM hierarchy WHERE parent IS NULL AND (flags&" + stringify(MSGFLAG_DELETED) + ")=" + stringify(MSGFLAG_DELETED) + " AND type=" + stringify(MAPI_STORE);
-	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
-	if(er != erSuccess)
-		return er;
-
-	auto ulStores = lpDBResult.get_num_rows();
-	if(ulStores > 0)
-	{
-		while ((lpDBRow = lpDBResult.fetch_row()) != nullptr) {
-			if(lpDBRow == NULL || lpDBRow[0] == NULL)
-				continue;
-			lObjectIds.emplace_back(atoui(lpDBRow[0]));
-		}
-		// free before we call DeleteObjects()
-		lpDBResult = DB_RESULT();
-		if (*lpbExit)
-			return KCERR_USER_CANCEL;
-
-		ec_log_info("Start to purge %d stores", (int)lObjectIds.size());
-		for (auto iterObjectId = lObjectIds.cbegin();
-		     iterObjectId != lObjectIds.cend() && !*lpbExit;
-		     ++iterObjectId)
-		{
-			ec_log_info(" purge store (%d)", *iterObjectId);
-
-			er = DeleteObjects(lpecSession, lpDatabase, *iterObjectId, ulDeleteFlags|EC_DELETE_STORE, 0, false, false);
-			if(er != erSuccess) {
-				ec_log_err("Error while removing softdelete store objects, error code: 0x%x.", er);
-				return er;
-			}
-		}
-		ec_log_info("Store purge done");
-	}
-	if (*lpbExit)
-		return KCERR_USER_CANCEL;
-
-	// Select softdeleted folders
-	strQuery = "SELECT h.id FROM hierarchy AS h JOIN properties AS p ON p.hierarchyid=h.id AND p.tag="+stringify(PROP_ID(PR_DELETED_ON))+" AND p.type="+stringify(PROP_TYPE(PR_DELETED_ON))+" WHERE (h.flags&"+stringify(MSGFLAG_DELETED)+")="+stringify(MSGFLAG_DELETED)+" AND p.val_hi<="+stringify(ft.dwHighDateTime)+" AND h.type="+stringify(MAPI_FOLDER);
-	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
-	if(er != erSuccess)
-		return er;
-
-	auto ulFolders = lpDBResult.get_num_rows();
-	if(ulFolders > 0)
-	{
-		// Remove all items
-		lObjectIds.clear();
-		while ((lpDBRow = lpDBResult.fetch_row()) != nullptr) {
-			if(lpDBRow == NULL || lpDBRow[0] == NULL)
-				continue;
-			lObjectIds.emplace_back(atoui(lpDBRow[0]));
-		}
-		// free before we call DeleteObjects()
-		lpDBResult = DB_RESULT();
-		if (*lpbExit)
-			return KCERR_USER_CANCEL;
-		ec_log_info("Start to purge %d folders", (int)lObjectIds.size());
-		er = DeleteObjects(lpecSession, lpDatabase, &lObjectIds, ulDeleteFlags, 0, false, false);
-		if(er != erSuccess) {
-			ec_log_err("Error while removing softdelete folder objects, error code: 0x%x.", er);
-			return er;
-		}
-		ec_log_info("Folder purge done");
-	}
-	if (*lpbExit)
-		return KCERR_USER_CANCEL;
-
-	// Select softdeleted messages
-	strQuery = "SELECT h.id FROM hierarchy AS h JOIN properties AS p ON p.hierarchyid=h.id AND p.tag="+stringify(PROP_ID(PR_DELETED_ON))+" AND p.type="+stringify(PROP_TYPE(PR_DELETED_ON))+" WHERE (h.flags&"+stringify(MSGFLAG_DELETED)+")="+stringify(MSGFLAG_DELETED)+" AND h.type="+stringify(MAPI_MESSAGE)+" AND p.val_hi<="+stringify(ft.dwHighDateTime);
-	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
-	if(er != erSuccess)
-		return er;
-
-	auto ulMessages = lpDBResult.get_num_rows();
-	if(ulMessages > 0)
-	{
-		// Remove all items
-		lObjectIds.clear();
-		while ((lpDBRow = lpDBResult.fetch_row()) != nullptr) {
-			if(lpDBRow == NULL || lpDBRow[0] == NULL)
-				continue;
-			lObjectIds.emplace_back(atoui(lpDBRow[0]));
-		}
-		// free before we call DeleteObjects()
-		lpDBResult = DB_RESULT();
-		if (*lpbExit)
-			return KCERR_USER_CANCEL;
-		ec_log_info("Start to purge %d messages", (int)lObjectIds.size());
-		er = DeleteObjects(lpecSession, lpDatabase, &lObjectIds, ulDeleteFlags, 0, false, false);
-		if(er != erSuccess) {
-			ec_log_err("Error while removing softdelete message objects, error code: 0x%x.", er);
-			return er;
-		}
-		ec_log_info("Message purge done");
-	}
+	SoftDeletePurgeTask stores(MAPI_STORE, ft), folders(MAPI_FOLDER, ft), messages(MAPI_MESSAGE, ft);
+	ECMaintenance maint(lpecSession, lpbExit, throttle);
+	er = maint.run(stores, &ulStores);
+	if (er == erSuccess)
+		er = maint.run(folders, &ulFolders);
+	if (er == erSuccess)
+		er = maint.run(messages, &ulMessages);
 
 	// these stats are only from toplevel objects
 	if(lpulFolders)
@@ -1598,8 +1621,22 @@ static ECRESULT WriteProps(struct soap *soap, ECSession *lpecSession,
 				continue;
 			if(lpPropValArray->__ptr[i].Value.lpszA == NULL)
 				break; // Name property found, but name isn't present. This is broken, so skip this.
-			auto strQuery = "SELECT hierarchy.id FROM hierarchy JOIN properties ON hierarchy.id = properties.hierarchyid WHERE hierarchy.parent=" + stringify(ulParent) + " AND hierarchy.type="+stringify(MAPI_FOLDER)+" AND hierarchy.flags & " + stringify(MSGFLAG_DELETED)+ "=0 AND properties.tag=" + stringify(KOPANO_TAG_DISPLAY_NAME) + " AND properties.val_string = '" + lpDatabase->Escape(lpPropValArray->__ptr[i].Value.lpszA) + "' AND properties.type="+stringify(PT_STRING8)+" AND hierarchy.id!=" + stringify(ulObjId) + " LIMIT 1";
-			er = lpDatabase->DoSelect(strQuery, &lpDBResult);
+			kd_stmt *st = nullptr;
+			er = lpDatabase->Prepare("writeprops_foldername",
+			     "SELECT hierarchy.id FROM hierarchy JOIN properties ON hierarchy.id = properties.hierarchyid "
+			     "WHERE hierarchy.parent=? AND hierarchy.type=? AND hierarchy.flags & ?=0 "
+			     "AND properties.tag=? AND properties.val_string=? AND properties.type=? "
+			     "AND hierarchy.id!=? LIMIT 1", &st);
+			if (er != erSuccess)
+				return ec_perror("WriteProps(): Prepare failed", er);
+			st->bind(0, ulParent);
+			st->bind(1, static_cast<unsigned int>(MAPI_FOLDER));
+			st->bind(2, static_cast<unsigned int>(MSGFLAG_DELETED));
+			st->bind(3, static_cast<unsigned int>(KOPANO_TAG_DISPLAY_NAME));
+			st->bind(4, std::string(lpPropValArray->__ptr[i].Value.lpszA));
+			st->bind(5, static_cast<unsigned int>(PT_STRING8));
+			st->bind(6, ulObjId);
+			er = lpDatabase->DoSelect(st, &lpDBResult);
 			if (er != erSuccess)
 				return ec_perror("WriteProps(): DoSelect failed", er);
 			if (lpDBResult.get_num_rows() > 0) {
@@ -1612,16 +1649,23 @@ static ECRESULT WriteProps(struct soap *soap, ECSession *lpecSession,
 
 	// If we have a recipient, remove the old one. The client does not send a diff of props because ECMemTable cannot do this
 	if (!fNewItem && (ulObjType == MAPI_MAILUSER || ulObjType == MAPI_DISTLIST)) {
-		auto strQuery = "DELETE FROM properties WHERE hierarchyid=" + stringify(ulObjId);
-		er = lpDatabase->DoDelete(strQuery);
+		kd_stmt *st = nullptr;
+		er = lpDatabase->Prepare("writeprops_delprops", "DELETE FROM properties WHERE hierarchyid=?", &st);
+		if (er != erSuccess)
+			return er;
+		st->bind(0, ulObjId);
+		er = lpDatabase->DoDelete(st);
 		if(er != erSuccess)
 			return er;
-		strQuery = "DELETE FROM mvproperties WHERE hierarchyid=" + stringify (ulObjId);
-		er = lpDatabase->DoDelete(strQuery);
+		er = lpDatabase->Prepare("writeprops_delmvprops", "DELETE FROM mvproperties WHERE hierarchyid=?", &st);
+		if (er != erSuccess)
+			return er;
+		st->bind(0, ulObjId);
+		er = lpDatabase->DoDelete(st);
 		if(er != erSuccess)
 			return er;
 		if (ulObjType != lpsSaveObj->ulObjType) {
-			strQuery = "UPDATE hierarchy SET type=" +stringify(lpsSaveObj->ulObjType) +" WHERE id=" + stringify (ulObjId);
+			auto strQuery = "UPDATE hierarchy SET type=" +stringify(lpsSaveObj->ulObjType) +" WHERE id=" + stringify (ulObjId);
 			er = lpDatabase->DoUpdate(strQuery);
 			if(er != erSuccess)
 				return er;
@@ -2724,8 +2768,12 @@ static ECRESULT LoadObject(struct soap *soap, ECSession *lpecSession,
 		}
 
 		// find subobjects
-		strQuery = "SELECT id, type FROM hierarchy WHERE parent="+stringify(ulObjId);
-		er = lpDatabase->DoSelect(strQuery, &lpDBResult);
+		kd_stmt *st = nullptr;
+		er = lpDatabase->Prepare("loadobject_children", "SELECT id, type FROM hierarchy WHERE parent=?", &st);
+		if (er != erSuccess)
+			return er;
+		st->bind(0, ulObjId);
+		er = lpDatabase->DoSelect(st, &lpDBResult);
 		if(er != erSuccess)
 			return er;
 		sSavedObject.__size = lpDBResult.get_num_rows();
@@ -4819,7 +4867,7 @@ SOAP_ENTRY_START(purgeSoftDelete, *result, unsigned int ulDays, unsigned int *re
 		return KCERR_NO_ACCESS;
 
     ec_log_info("Start forced softdelete clean up");
-    er = PurgeSoftDelete(lpecSession, ulDays * 24 * 60 * 60, &ulMessages, &ulFolders, &ulStores, NULL);
+    er = PurgeSoftDelete(lpecSession, ulDays * 24 * 60 * 60, &ulMessages, &ulFolders, &ulStores, nullptr, false);
     if (er == erSuccess)
 		ec_log_info("Softdelete done: removed %d stores, %d folders, and %d messages", ulStores, ulFolders, ulMessages);
     else if (er == KCERR_BUSY)
@@ -6233,9 +6281,11 @@ struct COPYITEM {
 
 // Move one or more messages and/or moved a softdeleted message to a normal message
 // exception: This function does internal Begin + Commit/Rollback
+// An attachment transaction of the caller in atx is committed right before dtx.
 static ECRESULT MoveObjects(ECSession *lpSession, ECDatabase *lpDatabase,
     kd_trans &dtx, ECRESULT &er, ECListInt *lplObjectIds,
-    unsigned int ulDestFolderId, unsigned int ulSyncId)
+    unsigned int ulDestFolderId, unsigned int ulSyncId,
+    kd_trans *atx = nullptr)
 {
 	bool			bPartialCompletion = false;
 	COPYITEM		sItem;
@@ -6564,6 +6614,13 @@ static ECRESULT MoveObjects(ECSession *lpSession, ECDatabase *lpDatabase,
 			cop.sNewEntryId.size(), cop.sNewEntryId, cop.ulId);
 	}
 
+	if (atx != nullptr) {
+		er = atx->commit();
+		if (er != erSuccess) {
+			ec_log_debug("MoveObjects: attachment commit failed: %s (%x)", GetMAPIErrorMessage(er), er);
+			return er;
+		}
+	}
 	er = dtx.commit();
 	if (er != erSuccess) {
 		ec_log_debug("MoveObjects: database commit failed: %s (%x)", GetMAPIErrorMessage(er), er);
@@ -6637,6 +6694,7 @@ static ECRESULT MoveObjects(ECSession *lpSession, ECDatabase *lpDatabase,
  * @param[in] bDoNotification true if you want to send object notifications.
  * @param[in] bDoTableNotification true if you want to send table notifications.
  * @param[in] ulSyncId Client sync identify.
+ * @param[out] lpulNewObjectId Object id of the new copy (optional).
  *
  * @FIXME It is possible to send notifications before a commit, this can give issues with the cache!
  * 			This function should be refactored
@@ -6644,7 +6702,8 @@ static ECRESULT MoveObjects(ECSession *lpSession, ECDatabase *lpDatabase,
 static ECRESULT CopyObject(ECSession *lpecSession,
     ECAttachmentStorage *lpAttachmentStorage, unsigned int ulObjId,
     unsigned int ulDestFolderId, bool bIsRoot, bool bDoNotification,
-    bool bDoTableNotification, unsigned int ulSyncId)
+    bool bDoTableNotification, unsigned int ulSyncId,
+    unsigned int *lpulNewObjectId = nullptr)
 {
 	ECDatabase		*lpDatabase = NULL;
 	DB_RESULT lpDBResult;
@@ -6941,6 +7000,8 @@ static ECRESULT CopyObject(ECSession *lpecSession,
 	}
 
 	g_lpSessionManager->GetCacheManager()->Update(fnevObjectModified, ulDestFolderId);
+	if (lpulNewObjectId != nullptr)
+		*lpulNewObjectId = ulNewObjectId;
 	if (!bDoNotification)
 		return erSuccess;
 	// Update destenation folder
@@ -7259,6 +7320,175 @@ SOAP_ENTRY_START(copyObjects, *result, struct entryList *aMessages,
 }
 SOAP_ENTRY_END()
 
+/**
+ * Remove @lpsDelProps from and write @lpsProps to message @ulObjId, in the
+ * transaction of the caller: the recipient-specific properties of a copy
+ * made by deliverCopies.
+ */
+static ECRESULT DeliverOverrides(struct soap *soap, ECSession *lpecSession,
+    ECDatabase *lpDatabase, ECAttachmentStorage *lpAttachmentStorage,
+    unsigned int ulObjId, struct propValArray *lpsProps,
+    struct propTagArray *lpsDelProps)
+{
+	if (lpsDelProps != nullptr && lpsDelProps->__size > 0) {
+		auto er = DeleteProps(lpecSession, lpDatabase, ulObjId, lpsDelProps, lpAttachmentStorage);
+		if (er != erSuccess)
+			return er;
+	}
+	if (lpsProps == nullptr || lpsProps->__size == 0)
+		return erSuccess;
+
+	struct saveObject sSaveObj{}, sReturnObj{};
+	FILETIME ftCreated = {0}, ftModified = {0};
+	sSaveObj.modProps = *lpsProps;
+	sSaveObj.ulServerId = ulObjId;
+	sSaveObj.ulObjType = MAPI_MESSAGE;
+	return WriteProps(soap, lpecSession, lpDatabase, lpAttachmentStorage,
+	       &sSaveObj, ulObjId, false, 0, &sReturnObj, nullptr, &ftCreated,
+	       &ftModified);
+}
+
+/**
+ * Copy message @ulObjId into folder @sFolderId for deliverCopies, or move
+ * it there with @bMove, and return the entry ID it has in that folder in
+ * @lpsNewEntryId. The properties of @lpsProps and @lpsDelProps are applied
+ * in the same transaction, so the message is never seen without them.
+ */
+static ECRESULT DeliverCopy(struct soap *soap, ECSession *lpecSession,
+    ECDatabase *lpDatabase, const entryId &sEntryId, unsigned int ulObjId,
+    const entryId &sFolderId, struct propValArray *lpsProps,
+    struct propTagArray *lpsDelProps, bool bMove, entryId *lpsNewEntryId)
+{
+	unsigned int ulFolderId = 0, ulNewObjId = 0, ulGrandParent = 0;
+	kd_trans dtx;
+	ECRESULT er = erSuccess;
+
+	/* Rolled back by dtx and atx unless er is erSuccess */
+	er = BeginLockFolders(lpDatabase, std::set<EntryId>{sEntryId, sFolderId}, LOCK_EXCLUSIVE, dtx, er);
+	if (er != erSuccess)
+		return er;
+	std::unique_ptr<ECAttachmentStorage> lpAttachmentStorage(g_lpSessionManager->get_atxconfig()->new_handle(lpDatabase));
+	if (lpAttachmentStorage == nullptr)
+		return er = KCERR_NOT_ENOUGH_MEMORY;
+	auto atx = lpAttachmentStorage->Begin(er);
+	if (er != erSuccess)
+		return er;
+	er = lpecSession->GetObjectFromEntryId(&sFolderId, &ulFolderId);
+	if (er != erSuccess)
+		return er;
+	er = lpecSession->GetSecurity()->CheckPermission(ulFolderId, ecSecurityCreate);
+	if (er != erSuccess)
+		return er;
+
+	auto gcache = g_lpSessionManager->GetCacheManager();
+	if (bMove) {
+		/*
+		 * MoveObjects skips what it may not move and commits the rest,
+		 * which would commit the overrides without the move; so refuse
+		 * up front what it would skip, before anything is written.
+		 */
+		unsigned int ulType = 0, ulSrcStore = 0, ulDstStore = 0;
+		er = gcache->GetObject(ulObjId, nullptr, nullptr, nullptr, &ulType);
+		if (er != erSuccess)
+			return er;
+		if (ulType != MAPI_MESSAGE)
+			return er = KCERR_INVALID_TYPE;
+		er = lpecSession->GetSecurity()->CheckPermission(ulObjId, ecSecurityEdit);
+		if (er != erSuccess)
+			return er;
+		er = lpecSession->GetSecurity()->CheckPermission(ulObjId, ecSecurityDelete);
+		if (er != erSuccess)
+			return er;
+		er = gcache->GetStore(ulObjId, &ulSrcStore, nullptr);
+		if (er != erSuccess)
+			return er;
+		er = gcache->GetStore(ulFolderId, &ulDstStore, nullptr);
+		if (er != erSuccess)
+			return er;
+		if (ulSrcStore != ulDstStore)
+			return er = KCERR_NO_ACCESS;
+
+		er = DeliverOverrides(soap, lpecSession, lpDatabase, lpAttachmentStorage.get(), ulObjId, lpsProps, lpsDelProps);
+		if (er != erSuccess)
+			return er;
+		/* Commits atx and dtx, then updates the tables and sends the notifications */
+		ECListInt lstObjIds = {ulObjId};
+		er = MoveObjects(lpecSession, lpDatabase, dtx, er, &lstObjIds, ulFolderId, 0, &atx);
+		if (er != erSuccess)
+			return er;
+		return gcache->GetEntryIdFromObject(ulObjId, soap, 0, lpsNewEntryId);
+	}
+
+	er = CopyObject(lpecSession, lpAttachmentStorage.get(), ulObjId, ulFolderId, true, false, false, 0, &ulNewObjId);
+	if (er != erSuccess)
+		return er;
+	er = DeliverOverrides(soap, lpecSession, lpDatabase, lpAttachmentStorage.get(), ulNewObjId, lpsProps, lpsDelProps);
+	if (er != erSuccess)
+		return er;
+	er = WriteLocalCommitTimeMax(nullptr, lpDatabase, ulFolderId, nullptr);
+	if (er != erSuccess)
+		return er;
+	er = atx.commit();
+	if (er != erSuccess)
+		return er;
+	er = dtx.commit();
+	if (er != erSuccess)
+		return er;
+
+	g_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_ADD, 0, ulFolderId, ulNewObjId, MAPI_MESSAGE);
+	g_lpSessionManager->NotificationCreated(MAPI_MESSAGE, ulNewObjId, ulFolderId);
+	gcache->GetParent(ulFolderId, &ulGrandParent);
+	g_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_MODIFY, 0, ulGrandParent, ulFolderId, MAPI_FOLDER);
+	gcache->Update(fnevObjectModified, ulFolderId);
+	g_lpSessionManager->NotificationModified(MAPI_FOLDER, ulFolderId);
+	return gcache->GetEntryIdFromObject(ulNewObjId, soap, 0, lpsNewEntryId);
+}
+
+/**
+ * Copy one message into a list of folders, used by the delivery agent to
+ * give every recipient of a mail their own copy without sending the message
+ * again. @lpsDelProps are removed from and @lpsProps written to each copy
+ * before anyone can see it. With MESSAGE_MOVE, the message itself is moved
+ * into the one folder of @lpsFolders instead; the delivery agent uses that
+ * to put a copy it prepared out of sight into place.
+ *
+ * The new entry IDs are returned in the order of @lpsFolders; a copy
+ * that failed has an empty entry ID and makes the call return
+ * KCWARN_PARTIAL_COMPLETION.
+ */
+SOAP_ENTRY_START(deliverCopies, lpsResponse->er, const entryId &sEntryId,
+    struct entryList *lpsFolders, struct propValArray *lpsProps,
+    struct propTagArray *lpsDelProps, unsigned int ulFlags,
+    struct deliverCopiesResponse *lpsResponse)
+{
+	unsigned int ulObjId = 0;
+	bool bPartialCompletion = false, bMove = ulFlags & MESSAGE_MOVE;
+	USE_DATABASE_NORESULT();
+
+	if (lpsFolders == nullptr || (bMove && lpsFolders->__size != 1))
+		return KCERR_INVALID_PARAMETER;
+	er = lpecSession->GetObjectFromEntryId(&sEntryId, &ulObjId);
+	if (er != erSuccess)
+		return er;
+
+	lpsResponse->sEntryIds.__size = lpsFolders->__size;
+	lpsResponse->sEntryIds.__ptr = s_alloc<entryId>(soap, lpsFolders->__size);
+	for (gsoap_size_t i = 0; i < lpsFolders->__size; ++i) {
+		auto &eid = lpsResponse->sEntryIds.__ptr[i];
+		eid.__size = 0;
+		eid.__ptr = nullptr;
+		er = DeliverCopy(soap, lpecSession, lpDatabase, sEntryId, ulObjId,
+		     lpsFolders->__ptr[i], lpsProps, lpsDelProps, bMove, &eid);
+		if (er != erSuccess) {
+			ec_log_err("SOAP::deliverCopies: failed copying object %u to folder %d: %s (%x)", ulObjId, i, GetMAPIErrorMessage(er), er);
+			eid.__size = 0;
+			bPartialCompletion = true;
+		}
+	}
+	er = bPartialCompletion ? KCWARN_PARTIAL_COMPLETION : erSuccess;
+}
+SOAP_ENTRY_END()
+
 SOAP_ENTRY_START(copyFolder, *result, const entryId &sEntryId,
     const entryId &sDestFolderId, const char *lpszNewFolderName,
     unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result)
@@ -7879,7 +8109,7 @@ void *SoftDeleteRemover(void *lpTmpMain)
 
 	std::unique_lock<ECSession> holder(*lpecSession);
 	ec_log_info("Start scheduled softdelete clean up");
-	er = PurgeSoftDelete(lpecSession, ulDeleteTime, &ulMessages, &ulFolders, &ulStores, (bool*)lpTmpMain);
+	er = PurgeSoftDelete(lpecSession, ulDeleteTime, &ulMessages, &ulFolders, &ulStores, static_cast<bool *>(lpTmpMain), true);
 	if (er == erSuccess)
 		ec_log_info("Softdelete done: removed %d stores, %d folders, and %d messages", ulStores, ulFolders, ulMessages);
 	else if (er == KCERR_BUSY)
@@ -8512,6 +8742,29 @@ SOAP_ENTRY_START(getChanges, lpsChangesResponse->er,
 }
 SOAP_ENTRY_END()
 
+SOAP_ENTRY_START(getChangesPage, lpsChangesResponse->er,
+    const struct xsd__base64Binary &sSourceKeyFolder, unsigned int ulSyncId,
+    unsigned int ulChangeId, unsigned int ulChangeType, unsigned int ulFlags,
+    struct restrictTable *lpsRestrict, unsigned int ulCursor,
+    unsigned int ulCursorMaxChangeId, unsigned int ulPageSize,
+    struct icsChangePageResponse *lpsChangesResponse)
+{
+	icsChangesArray *lpChanges = NULL;
+	SOURCEKEY		sSourceKey(sSourceKeyFolder.__size, (char *)sSourceKeyFolder.__ptr);
+
+	if (ulPageSize == 0)
+		return KCERR_INVALID_PARAMETER;
+	er = GetChangesPage(soap, lpecSession, std::move(sSourceKey), ulSyncId,
+	     ulChangeId, ulChangeType, ulFlags, lpsRestrict, ulCursor,
+	     ulCursorMaxChangeId, ulPageSize, &lpsChangesResponse->ulMaxChangeId,
+	     &lpsChangesResponse->ulNextCursor, &lpChanges);
+	if(er != erSuccess)
+		return er;
+	lpsChangesResponse->sChangesArray = *lpChanges;
+	return erSuccess;
+}
+SOAP_ENTRY_END()
+
 SOAP_ENTRY_START(setSyncStatus, lpsResponse->er,
     const struct xsd__base64Binary &sSourceKeyFolder, unsigned int ulSyncId,
     unsigned int ulChangeId, unsigned int ulChangeType, unsigned int ulFlags,
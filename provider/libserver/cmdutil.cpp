@@ -1816,7 +1816,6 @@ ECRESULT PrepareReadProps(struct soap *soap, ECDatabase *lpDatabase, bool fDoQue
 	unsigned int ulSize;
 	struct propVal sPropVal;
 	ECStringCompat stringCompat(fUnicode);
-	std::string strQuery;
 	DB_RESULT lpDBResult;
 	DB_ROW lpDBRow = NULL;
 
@@ -1826,21 +1825,23 @@ ECRESULT PrepareReadProps(struct soap *soap, ECDatabase *lpDatabase, bool fDoQue
     if(fDoQuery) {
 		// although we don't always use the names columns, we need to join anyway to check for existing nameids
 		// we may never stream propids > 0x8500 without the names data
-		if (ulObjId != 0)
-			strQuery = "SELECT " PROPCOLORDER ", hierarchyid, names.nameid, names.namestring, names.guid "
-				"FROM properties ";
-		else
-			strQuery = "SELECT " PROPCOLORDER ", hierarchy.id, names.nameid, names.namestring, names.guid "
+		kd_stmt *st = nullptr;
+		auto er = ulObjId != 0 ?
+			lpDatabase->Prepare("readprops_obj",
+				"SELECT " PROPCOLORDER ", hierarchyid, names.nameid, names.namestring, names.guid "
+				"FROM properties "
+				"LEFT JOIN names ON properties.tag-34049=names.id "
+				"WHERE hierarchyid=? AND (tag <= 34048 OR names.id IS NOT NULL)", &st) :
+			lpDatabase->Prepare("readprops_child",
+				"SELECT " PROPCOLORDER ", hierarchy.id, names.nameid, names.namestring, names.guid "
 				"FROM properties JOIN hierarchy "
-			        "ON properties.hierarchyid=hierarchy.id ";
-
-		strQuery += "LEFT JOIN names ON properties.tag-34049=names.id ";
-		if (ulObjId)
-			strQuery += "WHERE hierarchyid=" + stringify(ulObjId);
-		else
-			strQuery += "WHERE hierarchy.parent=" + stringify(ulParentId);
-		strQuery += " AND (tag <= 34048 OR names.id IS NOT NULL)";
-		auto er = lpDatabase->DoSelect(strQuery, &lpDBResult);
+				"ON properties.hierarchyid=hierarchy.id "
+				"LEFT JOIN names ON properties.tag-34049=names.id "
+				"WHERE hierarchy.parent=? AND (tag <= 34048 OR names.id IS NOT NULL)", &st);
+		if (er != erSuccess)
+			return er;
+		st->bind(0, ulObjId != 0 ? ulObjId : ulParentId);
+		er = lpDatabase->DoSelect(st, &lpDBResult);
         if(er != erSuccess)
 			return er;
     } else {
@@ -1912,26 +1913,26 @@ ECRESULT PrepareReadProps(struct soap *soap, ECDatabase *lpDatabase, bool fDoQue
     }
 
     if(fDoQuery) {
-		if (ulObjId != 0)
-			strQuery = "SELECT " MVPROPCOLORDER ", hierarchyid, names.nameid, names.namestring, names.guid "
-				"FROM mvproperties ";
-		else
-			strQuery = "SELECT " MVPROPCOLORDER ", hierarchy.id, names.nameid, names.namestring, names.guid "
+		kd_stmt *st = nullptr;
+		auto er = ulObjId != 0 ?
+			lpDatabase->Prepare("readmvprops_obj",
+				"SELECT " MVPROPCOLORDER ", hierarchyid, names.nameid, names.namestring, names.guid "
+				"FROM mvproperties "
+				"LEFT JOIN names ON mvproperties.tag-34049=names.id "
+				"WHERE hierarchyid=? AND (tag <= 34048 OR names.id IS NOT NULL) "
+				"GROUP BY hierarchyid, tag", &st) :
+			lpDatabase->Prepare("readmvprops_child",
+				"SELECT " MVPROPCOLORDER ", hierarchy.id, names.nameid, names.namestring, names.guid "
 				"FROM mvproperties "
 				"JOIN hierarchy "
-				    "ON mvproperties.hierarchyid=hierarchy.id ";
-
-		strQuery += "LEFT JOIN names ON mvproperties.tag-34049=names.id ";
-        if (ulObjId != 0)
-            strQuery +=	"WHERE hierarchyid=" + stringify(ulObjId) +
-				" AND (tag <= 34048 OR names.id IS NOT NULL) "
-				" GROUP BY hierarchyid, tag";
-        else
-			strQuery +=	"WHERE hierarchy.parent=" + stringify(ulParentId) +
-				" AND (tag <= 34048 OR names.id IS NOT NULL) "
-				"GROUP BY tag, mvproperties.type";
-
-		auto er = lpDatabase->DoSelect(strQuery, &lpDBResult);
+				    "ON mvproperties.hierarchyid=hierarchy.id "
+				"LEFT JOIN names ON mvproperties.tag-34049=names.id "
+				"WHERE hierarchy.parent=? AND (tag <= 34048 OR names.id IS NOT NULL) "
+				"GROUP BY tag, mvproperties.type", &st);
+		if (er != erSuccess)
+			return er;
+		st->bind(0, ulObjId != 0 ? ulObjId : ulParentId);
+		er = lpDatabase->DoSelect(st, &lpDBResult);
         if(er != erSuccess)
 			return er;
     } else {
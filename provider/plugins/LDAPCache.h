@@ -6,11 +6,15 @@
 #ifndef LDAPCACHE_H
 #define LDAPCACHE_H
 
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <memory>
 #include <list>
 #include <map>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <kopano/ECDefs.h>
 #include <kopano/pcuser.hpp>
 
@@ -28,6 +32,148 @@ class LDAPUserPlugin;
 typedef std::map<objectid_t, std::string> dn_cache_t;
 typedef std::list<std::string> dn_list_t;
 
+/**
+ * Results of LDAP lookups, kept for a limited time.
+ *
+ * A lookup that failed with @NotFound is remembered as well, for its own
+ * (usually shorter) time, and the exception is rethrown to later callers.
+ * While one thread is asking the LDAP server for a key, other threads
+ * that want the same key wait for that answer instead of sending the same
+ * query again. Other errors are passed on to the waiting threads but are
+ * not kept.
+ */
+template<typename T, typename NotFound> class LDAPLookupCache final {
+	public:
+	enum outcome { LC_MISS, LC_HIT, LC_NEGATIVE_HIT, LC_SHARED };
+
+	/**
+	 * @ttl and @negative_ttl are in seconds, 0 disables keeping the
+	 * results (but not the sharing of in-flight lookups). At most
+	 * @max_entries results are kept.
+	 */
+	void configure(unsigned int ttl, unsigned int negative_ttl, size_t max_entries)
+	{
+		std::lock_guard<std::mutex> lk(m_lock);
+		m_ttl = std::chrono::seconds(ttl);
+		m_negative_ttl = std::chrono::seconds(negative_ttl);
+		m_max = max_entries;
+	}
+
+	/**
+	 * Return the result for @key, calling @fetch if there is none.
+	 * *@how reports where the result came from.
+	 */
+	template<typename F> T get(const std::string &key, F &&fetch, outcome *how)
+	{
+		std::unique_lock<std::mutex> lk(m_lock);
+		auto i = m_map.find(key);
+		if (i != m_map.end()) {
+			auto e = i->second;
+			if (e->pending) {
+				m_cond.wait(lk, [&]() { return !e->pending; });
+				*how = LC_SHARED;
+				if (e->error)
+					std::rethrow_exception(e->error);
+				return e->value;
+			}
+			if (std::chrono::steady_clock::now() < e->expiry) {
+				*how = e->error ? LC_NEGATIVE_HIT : LC_HIT;
+				if (e->error)
+					std::rethrow_exception(e->error);
+				return e->value;
+			}
+			m_map.erase(i);
+		}
+		if (m_max > 0 && m_map.size() >= m_max)
+			prune();
+		auto e = std::make_shared<entry>();
+		m_map.emplace(key, e);
+		lk.unlock();
+
+		*how = LC_MISS;
+		try {
+			auto value = fetch();
+			lk.lock();
+			e->value = value;
+			finish(key, e, m_ttl);
+			return value;
+		} catch (const NotFound &) {
+			lk.lock();
+			e->error = std::current_exception();
+			finish(key, e, m_negative_ttl);
+			throw;
+		} catch (...) {
+			lk.lock();
+			e->error = std::current_exception();
+			finish(key, e, std::chrono::seconds(0));
+			throw;
+		}
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> lk(m_lock);
+		for (auto i = m_map.begin(); i != m_map.end(); )
+			if (i->second->pending)
+				++i;
+			else
+				i = m_map.erase(i);
+	}
+
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lk(m_lock);
+		return m_map.size();
+	}
+
+	private:
+	struct entry {
+		std::chrono::steady_clock::time_point expiry;
+		bool pending = true;
+		T value{};
+		std::exception_ptr error;
+	};
+
+	/* Publish the result of a lookup; called with m_lock held. */
+	void finish(const std::string &key, const std::shared_ptr<entry> &e,
+	    std::chrono::seconds ttl)
+	{
+		e->pending = false;
+		e->expiry = std::chrono::steady_clock::now() + ttl;
+		if (ttl.count() == 0) {
+			auto i = m_map.find(key);
+			if (i != m_map.end() && i->second == e)
+				m_map.erase(i);
+		}
+		m_cond.notify_all();
+	}
+
+	/* Make room: drop expired results, or all of them if none expired. */
+	void prune()
+	{
+		auto now = std::chrono::steady_clock::now();
+		auto before = m_map.size();
+		for (auto i = m_map.begin(); i != m_map.end(); )
+			if (!i->second->pending && i->second->expiry <= now)
+				i = m_map.erase(i);
+			else
+				++i;
+		if (m_map.size() < before)
+			return;
+		for (auto i = m_map.begin(); i != m_map.end(); )
+			if (i->second->pending)
+				++i;
+			else
+				i = m_map.erase(i);
+	}
+
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::unordered_map<std::string, std::shared_ptr<entry>> m_map;
+	std::chrono::seconds m_ttl{0}, m_negative_ttl{0};
+	size_t m_max = 0;
+};
+
 /**
  * LDAP Cache which collects DNs with the matching
  * objectid and name.
@@ -224,12 +224,38 @@ static std::string StringEscapeSequence(const std::string &);
 static std::string StringEscapeSequence(const char *, size_t);
 
 std::unique_ptr<LDAPCache> LDAPUserPlugin::m_lpCache(new LDAPCache());
+LDAPLookupCache<objectsignature_t, objectnotfound> LDAPUserPlugin::m_resolveCache;
+LDAPLookupCache<signatures_t, objectnotfound> LDAPUserPlugin::m_parentCache;
 
 template<typename T> static constexpr inline LONGLONG dur2us(const T &t)
 {
 	return std::chrono::duration_cast<std::chrono::microseconds>(t).count();
 }
 
+/* Look @key up in @cache, or run @fetch; counts the outcome in @stats. */
+template<typename C, typename F> static auto cached_lookup(C &cache,
+    ECStatsCollector &stats, const std::string &key, F &&fetch)
+{
+	auto how = C::LC_MISS;
+	auto tstart = std::chrono::steady_clock::now();
+	auto tally = [&]() {
+		auto us = dur2us(decltype(tstart)::clock::now() - tstart);
+		stats.inc(how == C::LC_HIT ? SCN_LDAP_CACHE_HITS :
+		          how == C::LC_NEGATIVE_HIT ? SCN_LDAP_CACHE_NEGATIVE_HITS :
+		          how == C::LC_SHARED ? SCN_LDAP_CACHE_SHARED : SCN_LDAP_CACHE_MISSES);
+		stats.inc(SCN_LDAP_LOOKUP_TIME, us);
+		stats.hist(SCN_LDAP_LOOKUP_TIME, us);
+	};
+	try {
+		auto result = cache.get(key, std::forward<F>(fetch), &how);
+		tally();
+		return result;
+	} catch (...) {
+		tally();
+		throw;
+	}
+}
+
 static std::string rst2flt_or(const restrictOr *q,
     const std::map<unsigned int, std::string> &propmap, bool inot)
 {
@@ -449,6 +475,9 @@ LDAPUserPlugin::LDAPUserPlugin(std::mutex &pluginlock,
 		{ "ldap_object_search_filter", "", CONFIGSETTING_RELOADABLE },
 		{ "ldap_filter_cutoff_elements", "1000", CONFIGSETTING_RELOADABLE },
 		{ "ldap_page_size", "1000", CONFIGSETTING_RELOADABLE }, // MaxPageSize in ADS defaults to 1000
+		{"ldap_cache_ttl", "60", CONFIGSETTING_RELOADABLE},
+		{"ldap_cache_negative_ttl", "10", CONFIGSETTING_RELOADABLE},
+		{"ldap_cache_size", "10000", CONFIGSETTING_RELOADABLE},
 
 		/* Aliases, they should be loaded through the propmap directive */
 		{ "0x6788001E", "", 0, CONFIGGROUP_PROPMAP },								/* PR_EC_EXCHANGE_DN */
@@ -492,6 +521,11 @@ LDAPUserPlugin::LDAPUserPlugin(std::mutex &pluginlock,
 void LDAPUserPlugin::InitPlugin(std::shared_ptr<ECStatsCollector> sc)
 {
 	m_lpStatsCollector = std::move(sc);
+	auto ttl = atoui(m_config->GetSetting("ldap_cache_ttl"));
+	auto negative_ttl = atoui(m_config->GetSetting("ldap_cache_negative_ttl"));
+	auto max_entries = atoui(m_config->GetSetting("ldap_cache_size"));
+	m_resolveCache.configure(ttl, negative_ttl, max_entries);
+	m_parentCache.configure(ttl, negative_ttl, max_entries);
 	const char *ldap_binddn = m_config->GetSetting("ldap_bind_user");
 	const char *ldap_bindpw = m_config->GetSetting("ldap_bind_passwd");
 	auto starttls = parseBool(m_config->GetSetting("ldap_starttls"));
@@ -604,6 +638,7 @@ LDAP *LDAPUserPlugin::ConnectLDAP(const char *bind_dn,
 	auto llelapsedtime = dur2us(decltype(tstart)::clock::now() - tstart);
 	m_lpStatsCollector->inc(SCN_LDAP_CONNECTS);
 	m_lpStatsCollector->inc(SCN_LDAP_CONNECT_TIME, llelapsedtime);
+	m_lpStatsCollector->hist(SCN_LDAP_CONNECT_TIME, llelapsedtime);
 	m_lpStatsCollector->Max(SCN_LDAP_CONNECT_TIME_MAX, llelapsedtime);
 	LOG_PLUGIN_DEBUG("ldaptiming [%08.2f] connected to ldap", llelapsedtime / 1000000.0);
 	return ld;
@@ -685,6 +720,7 @@ void LDAPUserPlugin::my_ldap_search_s(char *base, int scope, char *filter, char
 	*lppres = res.release(); // deref the pointer from object
 	m_lpStatsCollector->inc(SCN_LDAP_SEARCH);
 	m_lpStatsCollector->inc(SCN_LDAP_SEARCH_TIME, llelapsedtime);
+	m_lpStatsCollector->hist(SCN_LDAP_SEARCH_TIME, llelapsedtime);
 	m_lpStatsCollector->Max(SCN_LDAP_SEARCH_TIME_MAX, llelapsedtime);
 
 exit:
@@ -1364,6 +1400,14 @@ LDAPUserPlugin::resolveObjectsFromAttributesType(objectclass_t objclass,
 }
 
 objectsignature_t LDAPUserPlugin::resolveName(objectclass_t objclass, const string &name, const objectid_t &company)
+{
+	return cached_lookup(m_resolveCache, *m_lpStatsCollector,
+	       stringify(objclass) + ";" + company.tostring() + ";" + name,
+	       [&]() { return resolveNameFromLDAP(objclass, name, company); });
+}
+
+objectsignature_t LDAPUserPlugin::resolveNameFromLDAP(objectclass_t objclass,
+    const std::string &name, const objectid_t &company)
 {
 	auto attrs = std::make_unique<attrArray>(6);
 	const char *loginname_attr = m_config->GetSetting("ldap_loginname_attribute", "", NULL);
@@ -1471,6 +1515,7 @@ objectsignature_t LDAPUserPlugin::authenticateUser(const string &username, const
 	auto llelapsedtime = dur2us(decltype(tstart)::clock::now() - tstart);
 	m_lpStatsCollector->inc(SCN_LDAP_AUTH_LOGINS);
 	m_lpStatsCollector->inc(SCN_LDAP_AUTH_TIME, llelapsedtime);
+	m_lpStatsCollector->hist(SCN_LDAP_AUTH_TIME, llelapsedtime);
 	m_lpStatsCollector->Max(SCN_LDAP_AUTH_TIME_MAX, llelapsedtime);
 	m_lpStatsCollector->avg(SCN_LDAP_AUTH_TIME_AVG, llelapsedtime);
 	return id;
@@ -2221,6 +2266,15 @@ void LDAPUserPlugin::modifyObjectId(const objectid_t &oldId, const objectid_t &n
 signatures_t
 LDAPUserPlugin::getParentObjectsForObject(userobject_relation_t relation,
     const objectid_t &childobject)
+{
+	return cached_lookup(m_parentCache, *m_lpStatsCollector,
+	       stringify(relation) + ";" + childobject.tostring(),
+	       [&]() { return getParentObjectsFromLDAP(relation, childobject); });
+}
+
+signatures_t
+LDAPUserPlugin::getParentObjectsFromLDAP(userobject_relation_t relation,
+    const objectid_t &childobject)
 {
 	string				member_data;
 	objectclass_t		parentobjclass = OBJECTCLASS_UNKNOWN;
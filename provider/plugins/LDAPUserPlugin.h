@@ -347,6 +347,9 @@ protected:
 	std::unique_ptr<KC::iconv_context<std::string, std::string>> m_iconv, m_iconvrev;
 
 	static std::unique_ptr<LDAPCache> m_lpCache;
+	/* Shared by all plugin instances (one per server thread) */
+	static LDAPLookupCache<objectsignature_t, objectnotfound> m_resolveCache;
+	static LDAPLookupCache<signatures_t, objectnotfound> m_parentCache;
 	struct timeval m_timeout;
 
 private:
@@ -444,6 +447,17 @@ private:
 	 */
 	objectsignature_t authenticateUserBind(const std::string &username, const std::string &password, const objectid_t &company = objectid_t(CONTAINER_COMPANY));
 
+	/**
+	 * The LDAP queries behind resolveName(), which caches their results
+	 */
+	objectsignature_t resolveNameFromLDAP(objectclass_t, const std::string &name, const objectid_t &company);
+
+	/**
+	 * The LDAP queries behind getParentObjectsForObject(), which caches
+	 * their results
+	 */
+	signatures_t getParentObjectsFromLDAP(userobject_relation_t, const objectid_t &childobject);
+
 	/**
 	 * Authenticate by username and password
 	 *
@@ -108,6 +108,25 @@ server_stats::server_stats(std::shared_ptr<ECConfig> cfg) :
 	AddStat(SCN_SEARCHFOLDER_THREADS, SCT_INTGAUGE, "searchfld_threads", "Current number of running searchfolder threads");
 	AddStat(SCN_SEARCHFOLDER_UPDATE_RETRY, SCT_INTEGER, "searchupd_retry", "The number of times a search folder update was restarted");
 	AddStat(SCN_SEARCHFOLDER_UPDATE_FAIL, SCT_INTEGER, "searchupd_fail", "The number of failed search folder updates after retrying");
+	AddStat(SCN_SEARCHFOLDER_QUEUE, SCT_INTGAUGE, "searchupd_queue", "Number of message changes waiting for search folder processing");
+	AddStat(SCN_SEARCHFOLDER_QUEUE_AGE, SCT_INTEGER, "searchupd_age", "Time the oldest change of each search folder batch spent queued in milliseconds");
+	AddStat(SCN_SEARCHFOLDER_EVENTS, SCT_INTEGER, "searchupd_events", "Number of message changes processed for search folders");
+	AddStat(SCN_SEARCHFOLDER_THROTTLED, SCT_INTEGER, "searchupd_throttle", "Number of times a change waited for space in the search folder queue");
+	AddStat(SCN_NOTIFY_QUEUE, SCT_INTGAUGE, "notify_queue", "Number of sessions with notifications waiting to be processed");
+	AddStat(SCN_NOTIFY_SENT, SCT_INTEGER, "notify_sent", "Number of notification responses sent");
+	AddStat(SCN_NOTIFY_LATENCY, SCT_INTEGER, "notify_latency", "Delay between a change and its notification response in milliseconds");
+	AddStat(SCN_TABLEUPD_QUEUE, SCT_INTGAUGE, "tableupd_queue", "Number of table changes waiting to be applied to session tables");
+	AddStat(SCN_TABLEUPD_COALESCED, SCT_INTEGER, "tableupd_coalesced", "Number of table changes merged into a change that was already queued");
+	AddStat(SCN_TABLEUPD_APPLIED, SCT_INTEGER, "tableupd_applied", "Number of table changes applied to session tables");
+	AddStat(SCN_TABLEUPD_LATENCY, SCT_INTEGER, "tableupd_latency", "Delay between a change and its application to session tables in milliseconds");
+	AddStat(SCN_TABLESNAP_HITS, SCT_INTEGER, "tablesnap_hits", "Number of table rows sorted with keys shared from another session");
+	AddStat(SCN_TABLESNAP_MISSES, SCT_INTEGER, "tablesnap_misses", "Number of table rows whose sort keys had to be computed");
+	AddStat(SCN_TABLESNAP_VIEWS, SCT_INTGAUGE, "tablesnap_views", "Number of folder views with shared sort keys");
+	AddStat(SCN_TABLESNAP_SIZE, SCT_INTGAUGE, "tablesnap_size", "Memory used by shared table sort keys in bytes");
+	AddStat(SCN_MAINT_CHUNKS, SCT_INTEGER, "maint_chunks", "Number of steps taken by background clean up jobs");
+	AddStat(SCN_MAINT_ROWS, SCT_INTEGER, "maint_rows", "Number of objects removed by background clean up jobs");
+	AddStat(SCN_MAINT_CHUNK_TIME, SCT_INTEGER, "maint_chunk_time", "Time spent in background clean up steps in milliseconds");
+	AddStat(SCN_MAINT_PAUSES, SCT_INTEGER, "maint_pauses", "Number of times background clean up waited for the request queue to drain");
 	AddStat(SCN_SOAP_REQUESTS, SCT_INTEGER, "soap_request", "Number of soap requests handled by server");
 	AddStat(SCN_RESPONSE_TIME, SCT_INTEGER, "response_time", "Response time of soap requests handled in milliseconds (includes time in queue)");
 	AddStat(SCN_PROCESSING_TIME, SCT_INTEGER, "processing_time", "Time taken to process soap requests in milliseconds (wallclock time)");
@@ -164,12 +183,30 @@ server_stats::server_stats(std::shared_ptr<ECConfig> cfg) :
 	AddStat(SCN_LDAP_SEARCH_FAILED, SCT_INTEGER, "ldap_search_fail", "Number of failed searches made to LDAP server");
 	AddStat(SCN_LDAP_SEARCH_TIME, SCT_INTEGER, "ldap_search_time", "Total duration (µs) of LDAP searches");
 	AddStat(SCN_LDAP_SEARCH_TIME_MAX, SCT_INTGAUGE, "ldap_max_search", "Longest duration (µs) of LDAP search");
+	AddStat(SCN_LDAP_CACHE_HITS, SCT_INTEGER, "ldap_cache_hit", "Number of LDAP name and membership lookups answered from the cache");
+	AddStat(SCN_LDAP_CACHE_NEGATIVE_HITS, SCT_INTEGER, "ldap_cache_neghit", "Number of LDAP lookups answered by a cached not-found result");
+	AddStat(SCN_LDAP_CACHE_MISSES, SCT_INTEGER, "ldap_cache_miss", "Number of LDAP name and membership lookups sent to the LDAP server");
+	AddStat(SCN_LDAP_CACHE_SHARED, SCT_INTEGER, "ldap_cache_shared", "Number of LDAP lookups that waited for the same lookup of another thread");
+	AddStat(SCN_LDAP_LOOKUP_TIME, SCT_INTEGER, "ldap_lookup_time", "Total duration (µs) of LDAP name and membership lookups, including cache hits");
 
 	AddStat(SCN_INDEXER_SEARCH_ERRORS, SCT_INTEGER, "index_search_errors", "Number of failed indexer queries");
 	AddStat(SCN_INDEXER_SEARCH_MAX, SCT_INTGAUGE, "index_search_max", "Maximum duration of an indexed search query");
 	AddStat(SCN_INDEXER_SEARCH_AVG, SCT_INTGAUGE, "index_search_avg", "Average duration of an indexed search query");
 	AddStat(SCN_INDEXED_SEARCHES, SCT_INTEGER, "search_indexed", "Number of indexed searches performed");
 	AddStat(SCN_DATABASE_SEARCHES, SCT_INTEGER, "search_database", "Number of database searches performed");
+
+	/* Latency distributions (µs), reported as <name>_p50/_p99/_p999 */
+	AddHistogram(SCN_RESPONSE_TIME);
+	AddHistogram(SCN_PROCESSING_TIME);
+	AddHistogram(SCN_NOTIFY_LATENCY);
+	AddHistogram(SCN_TABLEUPD_LATENCY);
+	AddHistogram(SCN_SEARCHFOLDER_QUEUE_AGE);
+	AddHistogram(SCN_MAINT_CHUNK_TIME);
+	AddHistogram(SCN_LDAP_CONNECT_TIME);
+	AddHistogram(SCN_LDAP_AUTH_TIME);
+	AddHistogram(SCN_LDAP_SEARCH_TIME);
+	AddHistogram(SCN_LDAP_LOOKUP_TIME);
+	AddHistogram(SCN_INDEXER_SEARCH_AVG);
 }
 
 // This is the callback function for libserver/* so that it can notify that a delayed soap
@@ -949,6 +986,7 @@ static int running_server(char *szName, const char *szConfig, bool exp_config,
 		{ "cache_store_size",			"1M", CONFIGSETTING_SIZE },		// 1Mb, store table cache (storeid, storeguid), 40 bytes
 		{ "cache_server_size",			"1M", CONFIGSETTING_SIZE },		// 1Mb
 		{ "cache_server_lifetime",		"30" },							// 30 minutes
+		{ "cache_table_snapshot_size", "64M", CONFIGSETTING_SIZE },
 		/* Default no quotas. Note: quota values are in Mb, and thus have no size flag. */
 		{ "quota_warn",				"0", CONFIGSETTING_RELOADABLE },
 		{ "quota_soft",				"0", CONFIGSETTING_RELOADABLE },
@@ -958,6 +996,11 @@ static int running_server(char *szName, const char *szConfig, bool exp_config,
 		{ "companyquota_hard",		"0", CONFIGSETTING_UNUSED },
 		{ "session_timeout",		"300", CONFIGSETTING_RELOADABLE },		// 5 minutes
 		{ "sync_lifetime",			"90", CONFIGSETTING_RELOADABLE },		// 90 days
+		{"maintenance_batch_size", "1000", CONFIGSETTING_RELOADABLE},
+		{"maintenance_chunk_time", "500", CONFIGSETTING_RELOADABLE}, // ms
+		{"maintenance_load", "25", CONFIGSETTING_RELOADABLE}, // percent
+		{"maintenance_max_queue_age", "1000", CONFIGSETTING_RELOADABLE}, // ms
+		{"maintenance_run_time", "600", CONFIGSETTING_RELOADABLE}, // seconds
 		{"sync_log_all_changes", "default", CONFIGSETTING_UNUSED}, // Log All ICS changes
 		{ "auth_method",			"plugin", CONFIGSETTING_RELOADABLE },		// plugin (default), pam, kerberos
 		{ "pam_service",			"passwd", CONFIGSETTING_RELOADABLE },		// pam service, found in /etc/pam.d/
@@ -986,12 +1029,17 @@ static int running_server(char *szName, const char *szConfig, bool exp_config,
 		{ "search_enabled",			"yes", CONFIGSETTING_RELOADABLE },
 		{ "search_socket",			"file:///var/run/kopano/search.sock", CONFIGSETTING_RELOADABLE },
 		{ "search_timeout",			"10", CONFIGSETTING_RELOADABLE },
+		{ "searchfolder_threads", "2" },
+		{ "searchfolder_queue_max", "100000" },
 
 		{ "threads",				"8", CONFIGSETTING_RELOADABLE },
+		{ "notification_threads", "4" },
+		{ "table_update_threads", "2" },
 		{ "watchdog_max_age",		"500", CONFIGSETTING_RELOADABLE },
 		{ "watchdog_frequency",		"1", CONFIGSETTING_RELOADABLE },
 
 		{ "folder_max_items",		"1000000", CONFIGSETTING_RELOADABLE },
+		{ "table_engine", "avl", CONFIGSETTING_RELOADABLE },
 		{ "default_sort_locale_id",		"en_US", CONFIGSETTING_RELOADABLE },
 		{ "sync_gab_realtime",			"yes", CONFIGSETTING_RELOADABLE },
 		{ "max_deferred_records",		"0", CONFIGSETTING_RELOADABLE },
@@ -1339,8 +1387,8 @@ static int running_server(char *szName, const char *szConfig, bool exp_config,
 	ECScheduler sch;
 	// Add a task on the scheduler
 	sch.AddSchedule(SCHEDULE_HOUR, 00, &SoftDeleteRemover, &g_Quit);
-	sch.AddSchedule(SCHEDULE_HOUR, 15, &CleanupSyncsTable);
-	sch.AddSchedule(SCHEDULE_HOUR, 16, &CleanupSyncedMessagesTable);
+	sch.AddSchedule(SCHEDULE_HOUR, 15, &CleanupSyncsTable, &g_Quit);
+	sch.AddSchedule(SCHEDULE_HOUR, 16, &CleanupSyncedMessagesTable, &g_Quit);
 
 	// high loglevel to always see when server is started.
 	ec_log_notice("Startup succeeded on pid %d", getpid() );
@@ -196,9 +196,14 @@ done:
 		// thread is done processing the item, so any time spent in this thread until now can be accounted in that session.
 		g_lpSessionManager->RemoveBusyState(info->ulLastSessionId, thrself);
 		// Track cpu usage server-wide
-		g_lpSessionManager->m_stats->inc(SCN_SOAP_REQUESTS);
-		g_lpSessionManager->m_stats->inc(SCN_PROCESSING_TIME, std::chrono::duration_cast<std::chrono::milliseconds>(dblEnd - dblStart).count());
-		g_lpSessionManager->m_stats->inc(SCN_RESPONSE_TIME, std::chrono::duration_cast<std::chrono::milliseconds>(dblEnd - lpWorkItem->dblReceiveStamp).count());
+		auto &stats = g_lpSessionManager->m_stats;
+		auto proc_us = std::chrono::duration_cast<std::chrono::microseconds>(dblEnd - dblStart).count();
+		auto resp_us = std::chrono::duration_cast<std::chrono::microseconds>(dblEnd - lpWorkItem->dblReceiveStamp).count();
+		stats->inc(SCN_SOAP_REQUESTS);
+		stats->inc(SCN_PROCESSING_TIME, static_cast<LONGLONG>(proc_us / 1000));
+		stats->inc(SCN_RESPONSE_TIME, static_cast<LONGLONG>(resp_us / 1000));
+		stats->hist(SCN_PROCESSING_TIME, proc_us);
+		stats->hist(SCN_RESPONSE_TIME, resp_us);
 	}
 
 	// Clear memory used by soap calls. Note that this does not actually
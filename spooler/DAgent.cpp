@@ -37,6 +37,7 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 #include <climits>
 #include <clocale>
 #include <cstdio>
@@ -976,12 +977,11 @@ static HRESULT HrGetDeliveryStoreAndFolder(IMAPISession *lpSession,
  * Make the message a fallback message.
  *
  * @param[in,out] lpMessage Message to place fallback data in
- * @param[in] msg original rfc2822 received message
+ * @param[in] fp original rfc2822 received message
  *
  * @return MAPI Error code
  */
-static HRESULT FallbackDelivery(StatsClient *sc, IMessage *lpMessage,
-    const std::string &msg)
+static HRESULT FallbackDelivery(StatsClient *sc, IMessage *lpMessage, FILE *fp)
 {
 	std::string newbody;
 	SPropValue pm[8], pa[4];
@@ -1015,9 +1015,16 @@ static HRESULT FallbackDelivery(StatsClient *sc, IMessage *lpMessage,
 	hr = lpAttach->OpenProperty(PR_ATTACH_DATA_BIN, &IID_IStream, STGM_WRITE | STGM_TRANSACTED, MAPI_CREATE | MAPI_MODIFY, &~lpStream);
 	if (hr != hrSuccess)
 		return kc_perrorf("lpAttach->OpenProperty failed", hr);
-	hr = lpStream->Write(msg.c_str(), msg.size(), NULL);
-	if (hr != hrSuccess)
-		return kc_perrorf("lpStream->Write failed", hr);
+	rewind(fp);
+	while (!feof(fp)) {
+		char buf[65536];
+		auto rd = fread(buf, 1, sizeof(buf), fp);
+		if (ferror(fp))
+			return kc_perrorf("fread failed", MAPI_E_CORRUPT_DATA);
+		hr = lpStream->Write(buf, rd, nullptr);
+		if (hr != hrSuccess)
+			return kc_perrorf("lpStream->Write failed", hr);
+	}
 	hr = lpStream->Commit(0);
 	if (hr != hrSuccess)
 		return kc_perrorf("lpStream->Commit failed", hr);
@@ -1362,7 +1369,7 @@ static HRESULT HrCreateMessage(IMAPIFolder *lpFolder,
 /**
  * Convert the received rfc2822 email into a MAPI message
  *
- * @param[in] strMail the received email
+ * @param[in] fpMail the received email
  * @param[in] lpSession a MAPI Session
  * @param[in] lpMsgStore The store of the delivery
  * @param[in] lpAdrBook The Global Addressbook
@@ -1374,7 +1381,7 @@ static HRESULT HrCreateMessage(IMAPIFolder *lpFolder,
  *
  * @return MAPI Error code
  */
-static HRESULT HrStringToMAPIMessage(const string &strMail,
+static HRESULT HrFileToMAPIMessage(FILE *fpMail,
     IMAPISession *lpSession, IMsgStore *lpMsgStore, LPADRBOOK lpAdrBook,
     IMAPIFolder *lpDeliveryFolder, IMessage *lpMessage, ECRecipient *lpRecip,
     DeliveryArgs *lpArgs, IMessage **lppMessage, bool *lpbFallbackDelivery)
@@ -1385,7 +1392,7 @@ static HRESULT HrStringToMAPIMessage(const string &strMail,
 	lpArgs->sDeliveryOpts.add_imap_data = lpRecip->bHasIMAP;
 
 	// Set the properties on the object
-	auto hr = IMToMAPI(lpSession, lpMsgStore, lpAdrBook, lpMessage, strMail, lpArgs->sDeliveryOpts);
+	auto hr = IMToMAPI(lpSession, lpMsgStore, lpAdrBook, lpMessage, fpMail, lpArgs->sDeliveryOpts);
 	if (hr != hrSuccess) {
 		kc_pwarn("E-mail parsing failed; starting fallback delivery.", hr);
 
@@ -1395,7 +1402,7 @@ static HRESULT HrStringToMAPIMessage(const string &strMail,
 			kc_perror("Unable to create fallback message", hr);
 			goto exit;
 		}
-		hr = FallbackDelivery(lpArgs->sc.get(), lpFallbackMessage, strMail);
+		hr = FallbackDelivery(lpArgs->sc.get(), lpFallbackMessage, fpMail);
 		if (hr != hrSuccess) {
 			kc_perror("Unable to deliver fallback message", hr);
 			goto exit;
@@ -1468,18 +1475,20 @@ static HRESULT HrMessageExpired(StatsClient *sc, IMessage *lpMessage, bool *bExp
 }
 
 /**
- * Replace To recipient data in message with new recipient
+ * Get the To recipient data of a message for a recipient
  *
- * @param[in] lpMessage delivery message to set new recipient data in
- * @param[in] lpRecip new recipient to deliver same message for
+ * @param[in] lpMessage message with the recipients of the delivery
+ * @param[in] lpRecip recipient to deliver the message for
+ * @param[out] sPropRecip the four RECIP_ME, TO_ME, CC_ME and BCC_ME properties
  *
  * @return MAPI Error code
  */
-static HRESULT HrOverrideRecipProps(IMessage *lpMessage, ECRecipient *lpRecip)
+static HRESULT HrGetRecipProps(IMessage *lpMessage, ECRecipient *lpRecip,
+    SPropValue *sPropRecip)
 {
 	object_ptr<IMAPITable> lpRecipTable;
 	memory_ptr<SRestriction> lpRestrictRecipient;
-	SPropValue sPropRecip[4], sCmp[2];
+	SPropValue sCmp[2];
 	bool bToMe = false, bCcMe = false, bBccMe = false, bRecipMe = false;
 	static constexpr const SizedSPropTagArray(2, sptaColumns) =
 		{2, {PR_RECIPIENT_TYPE, PR_ENTRYID}};
@@ -1536,6 +1545,24 @@ static HRESULT HrOverrideRecipProps(IMessage *lpMessage, ECRecipient *lpRecip)
 	sPropRecip[2].Value.b = bCcMe;
 	sPropRecip[3].ulPropTag = PR_EC_MESSAGE_BCC_ME;
 	sPropRecip[3].Value.b = bBccMe;
+	return hr;
+}
+
+/**
+ * Replace To recipient data in message with new recipient
+ *
+ * @param[in] lpMessage delivery message to set new recipient data in
+ * @param[in] lpRecip new recipient to deliver same message for
+ *
+ * @return MAPI Error code
+ */
+static HRESULT HrOverrideRecipProps(IMessage *lpMessage, ECRecipient *lpRecip)
+{
+	SPropValue sPropRecip[4];
+
+	auto hr = HrGetRecipProps(lpMessage, lpRecip, sPropRecip);
+	if (hr != hrSuccess)
+		return hr;
 	hr = lpMessage->SetProps(4, sPropRecip, NULL);
 	if (hr != hrSuccess)
 		return kc_perror("SetProps failed", hr);
@@ -1611,6 +1638,21 @@ static HRESULT HrOverrideFallbackProps(IMessage *lpMessage, ECRecipient *r)
 	return hrSuccess;
 }
 
+/* The five RECEIVED_BY properties for @lpRecip; they point into @lpRecip */
+static void HrGetReceivedByProps(ECRecipient *lpRecip, SPropValue *p)
+{
+	p[0].ulPropTag   = PR_RECEIVED_BY_ADDRTYPE_A;
+	p[0].Value.lpszA = const_cast<char *>(lpRecip->strAddrType.c_str());
+	p[1].ulPropTag   = PR_RECEIVED_BY_EMAIL_ADDRESS_W;
+	p[1].Value.lpszW = const_cast<wchar_t *>(lpRecip->wstrUsername.c_str());
+	p[2].ulPropTag   = PR_RECEIVED_BY_ENTRYID;
+	p[2].Value.bin   = lpRecip->sEntryId;
+	p[3].ulPropTag   = PR_RECEIVED_BY_NAME_W;
+	p[3].Value.lpszW = const_cast<wchar_t *>(lpRecip->wstrFullname.c_str());
+	p[4].ulPropTag   = PR_RECEIVED_BY_SEARCH_KEY;
+	p[4].Value.bin   = lpRecip->sSearchKey;
+}
+
 /**
  * Set new To recipient data in message
  *
@@ -1624,22 +1666,51 @@ static HRESULT HrOverrideReceivedByProps(IMessage *lpMessage,
 {
 	SPropValue p[5];
 
-	p[0].ulPropTag   = PR_RECEIVED_BY_ADDRTYPE_A;
-	p[0].Value.lpszA = const_cast<char *>(lpRecip->strAddrType.c_str());
-	p[1].ulPropTag   = PR_RECEIVED_BY_EMAIL_ADDRESS_W;
-	p[1].Value.lpszW = const_cast<wchar_t *>(lpRecip->wstrUsername.c_str());
-	p[2].ulPropTag   = PR_RECEIVED_BY_ENTRYID;
-	p[2].Value.bin   = lpRecip->sEntryId;
-	p[3].ulPropTag   = PR_RECEIVED_BY_NAME_W;
-	p[3].Value.lpszW = const_cast<wchar_t *>(lpRecip->wstrFullname.c_str());
-	p[4].ulPropTag   = PR_RECEIVED_BY_SEARCH_KEY;
-	p[4].Value.bin   = lpRecip->sSearchKey;
+	HrGetReceivedByProps(lpRecip, p);
 	HRESULT hr = lpMessage->SetProps(ARRAY_SIZE(p), p, nullptr);
 	if (hr != hrSuccess)
 		return kc_perror("Unable to set RECEIVED_BY properties", hr);
 	return hrSuccess;
 }
 
+/* Recipient-dependent properties, not taken over by a copy for the next recipient */
+static constexpr const SizedSPropTagArray(13, sptaReceivedBy) = {
+	13, {
+		/* Overriden by HrOverrideRecipProps() */
+		PR_MESSAGE_RECIP_ME,
+		PR_MESSAGE_TO_ME,
+		PR_MESSAGE_CC_ME,
+		/* HrOverrideReceivedByProps() */
+		PR_RECEIVED_BY_ADDRTYPE,
+		PR_RECEIVED_BY_EMAIL_ADDRESS,
+		PR_RECEIVED_BY_ENTRYID,
+		PR_RECEIVED_BY_NAME,
+		PR_RECEIVED_BY_SEARCH_KEY,
+		/* Written by rules */
+		PR_LAST_VERB_EXECUTED,
+		PR_LAST_VERB_EXECUTION_TIME,
+		PR_ICON_INDEX,
+	}
+};
+/* Also removed from a copy of a fallback message */
+static constexpr const SizedSPropTagArray(12, sptaFallback) = {
+	12, {
+		/* Overriden by HrOverrideFallbackProps() */
+		PR_SENDER_ADDRTYPE,
+		PR_SENDER_EMAIL_ADDRESS,
+		PR_SENDER_ENTRYID,
+		PR_SENDER_NAME,
+		PR_SENDER_SEARCH_KEY,
+		PR_SENT_REPRESENTING_ADDRTYPE,
+		PR_SENT_REPRESENTING_EMAIL_ADDRESS,
+		PR_SENT_REPRESENTING_ENTRYID,
+		PR_SENT_REPRESENTING_NAME,
+		PR_SENT_REPRESENTING_SEARCH_KEY,
+		PR_RCVD_REPRESENTING_ADDRTYPE,
+		PR_RCVD_REPRESENTING_EMAIL_ADDRESS,
+	}
+};
+
 /**
  * Copy a delivered message to another recipient
  *
@@ -1661,41 +1732,6 @@ static HRESULT HrCopyMessageForDelivery(IMessage *lpOrigMessage,
 	object_ptr<IMessage> lpMessage;
 	object_ptr<IMAPIFolder> lpFolder;
 	helpers::MAPIPropHelperPtr ptrArchiveHelper;
-	static constexpr const SizedSPropTagArray(13, sptaReceivedBy) = {
-		13, {
-			/* Overriden by HrOverrideRecipProps() */
-			PR_MESSAGE_RECIP_ME,
-			PR_MESSAGE_TO_ME,
-			PR_MESSAGE_CC_ME,
-			/* HrOverrideReceivedByProps() */
-			PR_RECEIVED_BY_ADDRTYPE,
-			PR_RECEIVED_BY_EMAIL_ADDRESS,
-			PR_RECEIVED_BY_ENTRYID,
-			PR_RECEIVED_BY_NAME,
-			PR_RECEIVED_BY_SEARCH_KEY,
-			/* Written by rules */
-			PR_LAST_VERB_EXECUTED,
-			PR_LAST_VERB_EXECUTION_TIME,
-			PR_ICON_INDEX,
-		}
-	};
-	static constexpr const SizedSPropTagArray(12, sptaFallback) = {
-		12, {
-			/* Overriden by HrOverrideFallbackProps() */
-			PR_SENDER_ADDRTYPE,
-			PR_SENDER_EMAIL_ADDRESS,
-			PR_SENDER_ENTRYID,
-			PR_SENDER_NAME,
-			PR_SENDER_SEARCH_KEY,
-			PR_SENT_REPRESENTING_ADDRTYPE,
-			PR_SENT_REPRESENTING_EMAIL_ADDRESS,
-			PR_SENT_REPRESENTING_ENTRYID,
-			PR_SENT_REPRESENTING_NAME,
-			PR_SENT_REPRESENTING_SEARCH_KEY,
-			PR_RCVD_REPRESENTING_ADDRTYPE,
-			PR_RCVD_REPRESENTING_EMAIL_ADDRESS,
-		}
-	};
 
 	auto hr = HrCreateMessage(lpDeliverFolder, lpFallbackFolder, &~lpFolder, &~lpMessage);
 	if (hr != hrSuccess)
@@ -1730,6 +1766,185 @@ static HRESULT HrCopyMessageForDelivery(IMessage *lpOrigMessage,
 	return hrSuccess;
 }
 
+/**
+ * Save a copy of a freshly converted message in the root folder of
+ * @lpStore, for HrStageServerCopy to copy for the other recipients.
+ *
+ * The copy is made before any recipient-specific processing, and only
+ * the delivery agent sees it: unlike the delivered message, it cannot be
+ * marked read, changed, moved or deleted by the recipient or the rules
+ * while the other copies are made. The caller deletes it afterwards.
+ *
+ * @param[in] lpMessage the converted message, not yet saved
+ * @param[in] lpStore store of the first recipient
+ * @param[out] lppSource the saved copy
+ *
+ * @return MAPI Error code
+ */
+static HRESULT HrSaveCopySource(IMessage *lpMessage, IMsgStore *lpStore,
+    IMessage **lppSource)
+{
+	object_ptr<IMAPIFolder> lpRoot;
+	object_ptr<IMessage> lpSource;
+	ULONG type = 0;
+
+	auto hr = lpStore->OpenEntry(0, nullptr, &iid_of(lpRoot), MAPI_MODIFY, &type, &~lpRoot);
+	if (hr != hrSuccess)
+		return kc_perrorf("OpenEntry failed", hr);
+	hr = lpRoot->CreateMessage(nullptr, 0, &~lpSource);
+	if (hr != hrSuccess)
+		return kc_perrorf("CreateMessage failed", hr);
+	hr = lpMessage->CopyTo(0, nullptr, nullptr, 0, nullptr,
+	     &IID_IMessage, lpSource, 0, nullptr);
+	if (hr != hrSuccess)
+		return kc_perrorf("CopyTo failed", hr);
+	hr = lpSource->SaveChanges(KEEP_OPEN_READWRITE);
+	if (hr != hrSuccess)
+		return kc_perrorf("SaveChanges failed", hr);
+	*lppSource = lpSource.release();
+	return hrSuccess;
+}
+
+/**
+ * Have the storage server copy the message from HrSaveCopySource for
+ * @lpRecip, so that the message data is not sent to the server again:
+ * the counterpart of HrCopyMessageForDelivery.
+ *
+ * The copy is made in the root folder of the recipient's store, where no
+ * client shows it, with the recipient-dependent properties of the original
+ * removed and those of @lpRecip set by the server. It stays there until
+ * HrPublishServerCopy moves it into the delivery folder; a copy that is not
+ * delivered must be deleted by the caller.
+ *
+ * @param[in] lpOrigMessage a copy from HrSaveCopySource on the same server
+ * @param[in] lpTargetStore store of the recipient
+ * @param[in] lpRecip recipient data to use
+ * @param[in] bFallbackDelivery the message is a fallback delivery message
+ * @param[out] lppMessage the copy, opened with MAPI_MODIFY
+ *
+ * @return MAPI Error code; MAPI_E_NO_SUPPORT when the server cannot make copies
+ */
+static HRESULT HrStageServerCopy(IMessage *lpOrigMessage,
+    IMsgStore *lpTargetStore, ECRecipient *lpRecip, bool bFallbackDelivery,
+    IMessage **lppMessage)
+{
+	object_ptr<IECServiceAdmin> lpServiceAdmin;
+	object_ptr<IMAPIFolder> lpRoot;
+	object_ptr<IMessage> lpMessage;
+	memory_ptr<SPropValue> lpEntryId, lpRootId;
+	memory_ptr<ENTRYLIST> lpCopies;
+	helpers::MAPIPropHelperPtr ptrArchiveHelper;
+	SPropValue p[9];
+	ULONG n = 4, type = 0;
+
+	auto hr = HrGetOneProp(lpOrigMessage, PR_ENTRYID, &~lpEntryId);
+	if (hr != hrSuccess)
+		return kc_perrorf("HrGetOneProp failed", hr);
+	hr = lpTargetStore->QueryInterface(IID_IECServiceAdmin, &~lpServiceAdmin);
+	if (hr != hrSuccess)
+		return kc_perrorf("QueryInterface failed", hr);
+	hr = lpTargetStore->OpenEntry(0, nullptr, &iid_of(lpRoot), MAPI_MODIFY, &type, &~lpRoot);
+	if (hr != hrSuccess)
+		return kc_perrorf("OpenEntry failed", hr);
+	hr = HrGetOneProp(lpRoot, PR_ENTRYID, &~lpRootId);
+	if (hr != hrSuccess)
+		return kc_perrorf("HrGetOneProp failed", hr);
+
+	/* The recipients of the copy are those of the original */
+	hr = HrGetRecipProps(lpOrigMessage, lpRecip, p);
+	if (hr != hrSuccess)
+		return kc_perrorf("HrGetRecipProps failed", hr);
+	if (!bFallbackDelivery) {
+		HrGetReceivedByProps(lpRecip, &p[n]);
+		n += 5;
+	}
+	ENTRYLIST list = {1, &lpRootId->Value.bin};
+	hr = lpServiceAdmin->DeliverCopies(lpEntryId->Value.bin.cb,
+	     reinterpret_cast<const ENTRYID *>(lpEntryId->Value.bin.lpb), &list,
+	     n, p, sptaReceivedBy, 0, &~lpCopies);
+	if (hr == MAPI_E_NO_SUPPORT)
+		return hr;
+	if (FAILED(hr))
+		return kc_perror("Server-side copy for delivery failed", hr);
+	if (lpCopies->cValues != 1 || lpCopies->lpbin[0].cb == 0)
+		return kc_perror("Server-side copy for delivery failed", MAPI_E_CALL_FAILED);
+	const auto &eid = lpCopies->lpbin[0];
+	hr = lpTargetStore->OpenEntry(eid.cb, reinterpret_cast<const ENTRYID *>(eid.lpb),
+	     &iid_of(lpMessage), MAPI_MODIFY, &type, &~lpMessage);
+	if (hr != hrSuccess) {
+		kc_perror("Unable to open server-side copy", hr);
+		lpRoot->DeleteMessages(lpCopies.get(), 0, nullptr, 0);
+		return hr;
+	}
+	auto cleanup = make_scope_success([&]() {
+		if (hr != hrSuccess)
+			lpRoot->DeleteMessages(lpCopies.get(), 0, nullptr, 0);
+	});
+	if (bFallbackDelivery)
+		lpMessage->DeleteProps(sptaFallback, nullptr);
+	hr = helpers::MAPIPropHelper::Create(MAPIPropPtr(lpMessage, true), &ptrArchiveHelper);
+	if (hr != hrSuccess)
+		return kc_perrorf("helpers::MAPIPropHelper::Create failed", hr);
+	hr = ptrArchiveHelper->DetachFromArchives();
+	if (hr != hrSuccess)
+		return kc_perrorf("DetachFromArchives failed", hr);
+	if (!lpRecip->bHasIMAP) {
+		hr = Util::HrDeleteIMAPData(lpMessage);
+		if (hr != hrSuccess)
+			return kc_perrorf("IMAP handling failed", hr);
+	}
+	*lppMessage = lpMessage.release();
+	return hrSuccess;
+}
+
+/**
+ * Move a copy from HrStageServerCopy, saved after the delivery checks,
+ * into the delivery folder, where the recipient sees it from now on.
+ *
+ * @param[in] lpTargetStore store of the recipient
+ * @param[in] lpTargetFolder delivery folder
+ * @param[in] lpCopy the saved copy
+ * @param[out] lppMessage the delivered message, opened with MAPI_MODIFY
+ *
+ * @return MAPI Error code
+ */
+static HRESULT HrPublishServerCopy(IMsgStore *lpTargetStore,
+    IMAPIFolder *lpTargetFolder, IMessage *lpCopy, IMessage **lppMessage)
+{
+	object_ptr<IECServiceAdmin> lpServiceAdmin;
+	memory_ptr<SPropValue> lpEntryId, lpFolderId;
+	memory_ptr<ENTRYLIST> lpMoved;
+	ULONG type = 0;
+
+	auto hr = HrGetOneProp(lpCopy, PR_ENTRYID, &~lpEntryId);
+	if (hr != hrSuccess)
+		return kc_perrorf("HrGetOneProp failed", hr);
+	hr = HrGetOneProp(lpTargetFolder, PR_ENTRYID, &~lpFolderId);
+	if (hr != hrSuccess)
+		return kc_perrorf("HrGetOneProp failed", hr);
+	hr = lpTargetStore->QueryInterface(IID_IECServiceAdmin, &~lpServiceAdmin);
+	if (hr != hrSuccess)
+		return kc_perrorf("QueryInterface failed", hr);
+	ENTRYLIST list = {1, &lpFolderId->Value.bin};
+	hr = lpServiceAdmin->DeliverCopies(lpEntryId->Value.bin.cb,
+	     reinterpret_cast<const ENTRYID *>(lpEntryId->Value.bin.lpb), &list,
+	     0, nullptr, nullptr, MESSAGE_MOVE, &~lpMoved);
+	if (hr == hrSuccess && (lpMoved->cValues != 1 || lpMoved->lpbin[0].cb == 0))
+		hr = MAPI_E_CALL_FAILED;
+	if (hr != hrSuccess)
+		return kc_perror("Unable to move server-side copy into place", hr);
+	hr = lpTargetStore->OpenEntry(lpMoved->lpbin[0].cb,
+	     reinterpret_cast<const ENTRYID *>(lpMoved->lpbin[0].lpb),
+	     &IID_IMessage, MAPI_MODIFY, &type, reinterpret_cast<IUnknown **>(lppMessage));
+	if (hr != hrSuccess) {
+		kc_perror("Unable to open delivered message", hr);
+		/* The delivery is reported as failed: do not keep it */
+		lpTargetFolder->DeleteMessages(lpMoved.get(), 0, nullptr, 0);
+		return hr;
+	}
+	return hrSuccess;
+}
+
 /**
  * Make a new MAPI session under a specific username
  *
@@ -1862,13 +2077,12 @@ static HRESULT HrPostDeliveryProcessing(pym_plugin_intf *lppyMapiPlugin,
  * Find spam header if needed, and mark delivery as spam delivery if
  * header found.
  *
- * @param[in] strMail rfc2822 email being delivered
+ * @param[in] fp rfc2822 email being delivered
  * @param[in,out] lpArgs delivery options
  *
  * @return MAPI Error code
  */
-static HRESULT FindSpamMarker(const std::string &strMail,
-    DeliveryArgs *lpArgs)
+static HRESULT FindSpamMarker(FILE *fp, DeliveryArgs *lpArgs)
 {
 	HRESULT hr = hrSuccess;
 	const char *szHeader = g_lpConfig->GetSetting("spam_header_name", "", NULL);
@@ -1878,15 +2092,25 @@ static HRESULT FindSpamMarker(const std::string &strMail,
 
 	if (!szHeader || !szValue)
 		return hr;
-	// find end of headers
-	auto end = strMail.find("\r\n\r\n");
+	// read up to the end of headers
+	auto end = string::npos;
+	rewind(fp);
+	while (end == string::npos && !feof(fp)) {
+		char buf[4096];
+		auto rd = fread(buf, 1, sizeof(buf), fp);
+		if (ferror(fp))
+			return hr;
+		auto from = strHeaders.size() < 3 ? 0 : strHeaders.size() - 3;
+		strHeaders.append(buf, rd);
+		end = strHeaders.find("\r\n\r\n", from);
+	}
 	if (end == string::npos)
 		return hr;
 	end += 2;
 
-	// copy headers in upper case, need to resize destination first
+	// headers in upper case
 	strHeaders.resize(end);
-	transform(strMail.begin(), strMail.begin() +end, strHeaders.begin(), ::toupper);
+	transform(strHeaders.begin(), strHeaders.end(), strHeaders.begin(), ::toupper);
 	auto match = strToUpper("\r\n"s + szHeader + ":");
 
 	// find header
@@ -1918,9 +2142,11 @@ static HRESULT FindSpamMarker(const std::string &strMail,
  * @param[in] lpAdrBook Global Addressbook
  * @param[in] lpOrigMessage a previously delivered message, if any
  * @param[in] bFallbackDelivery previously delivered message was a fallback message
- * @param[in] strMail original received rfc2822 email
+ * @param[in] fpMail original received rfc2822 email
  * @param[in] lpRecip recipient to deliver message to
  * @param[in] lpArgs delivery options
+ * @param[in,out] lppCopySource the message for the server to copy, if any; set from the converted message when NULL
+ * @param[in,out] lpbServerCopy have the server copy *lppCopySource; cleared when it cannot
  * @param[out] lppMessage the newly delivered message
  * @param[out] lpbFallbackDelivery newly delivered message is a fallback message
  *
@@ -1929,8 +2155,9 @@ static HRESULT FindSpamMarker(const std::string &strMail,
 static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
     IMAPISession *lpSession, IMsgStore *lpStore, bool bIsAdmin,
     LPADRBOOK lpAdrBook, IMessage *lpOrigMessage, bool bFallbackDelivery,
-    const std::string &strMail, ECRecipient *lpRecip, DeliveryArgs *lpArgs,
-    IMessage **lppMessage, bool *lpbFallbackDelivery)
+    FILE *fpMail, ECRecipient *lpRecip, DeliveryArgs *lpArgs,
+    IMessage **lppCopySource, bool *lpbServerCopy, IMessage **lppMessage,
+    bool *lpbFallbackDelivery)
 {
 	object_ptr<IMsgStore> lpTargetStore;
 	object_ptr<IMAPIFolder> lpTargetFolder, lpFolder, lpInbox;
@@ -1939,8 +2166,14 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 	ULONG ulResult = 0;
 	object_ptr<IECServiceAdmin> lpServiceAdmin;
 	memory_ptr<ECQUOTASTATUS> lpsQuotaStatus;
-	bool over_quota = false;
+	bool over_quota = false, bSaved = false;
+	object_ptr<IMessage> lpServerCopy;
 
+	/* The server-side copy is stored out of sight: remove it if it is not delivered */
+	auto cleanup = make_scope_success([&]() {
+		if (lpServerCopy != nullptr && !bSaved)
+			Util::HrDeleteMessage(lpSession, lpServerCopy);
+	});
 	// single user deliver did not lookup the user
 	if (lpRecip->strSMTP.empty()) {
 		auto hr = OpenResolveAddrFolder(lpAdrBook, &~lpAddrDir);
@@ -1955,6 +2188,13 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 	          lpArgs, &~lpTargetStore, &~lpInbox, &~lpTargetFolder);
 	if (hr != hrSuccess)
 		return kc_perrorf("HrGetDeliveryStoreAndFolder failed", hr);
+	if (lpOrigMessage != nullptr && *lppCopySource != nullptr && *lpbServerCopy) {
+		hr = HrStageServerCopy(*lppCopySource, lpTargetStore, lpRecip,
+		     bFallbackDelivery, &~lpServerCopy);
+		/* Copied the usual way below */
+		if (hr == MAPI_E_NO_SUPPORT)
+			*lpbServerCopy = false;
+	}
 
 	if (!lpOrigMessage) {
 		/* No message was provided, we have to construct it personally */
@@ -1963,9 +2203,9 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 		hr = HrCreateMessage(lpTargetFolder, lpInbox, &~lpFolder, &~lpMessageTmp);
 		if (hr != hrSuccess)
 			return kc_perrorf("HrCreateMessage failed", hr);
-		hr = HrStringToMAPIMessage(strMail, lpSession, lpTargetStore, lpAdrBook, lpFolder, lpMessageTmp, lpRecip, lpArgs, &~lpDeliveryMessage, &bFallbackDelivery);
+		hr = HrFileToMAPIMessage(fpMail, lpSession, lpTargetStore, lpAdrBook, lpFolder, lpMessageTmp, lpRecip, lpArgs, &~lpDeliveryMessage, &bFallbackDelivery);
 		if (hr != hrSuccess)
-			return kc_perrorf("HrStringToMAPIMessage failed", hr);
+			return kc_perrorf("HrFileToMAPIMessage failed", hr);
 
 		/*
 		 * Check if the message has expired.
@@ -1981,6 +2221,15 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 		if (hr != hrSuccess)
 			return kc_perrorf("MessageProcessing failed", hr);
 		// TODO do something with ulResult
+
+		/* Keep it as it is now for the other recipients on this server */
+		if (*lpbServerCopy && *lppCopySource == nullptr &&
+		    HrSaveCopySource(lpDeliveryMessage, lpTargetStore, lppCopySource) != hrSuccess)
+			*lpbServerCopy = false;
+	} else if (lpServerCopy != nullptr) {
+		lpFolder = lpTargetFolder;
+		lpDeliveryMessage = lpServerCopy;
+		lpArgs->sc->inc(SCN_DAGENT_SERVER_COPIES);
 	} else {
 		/* Copy message to prepare for new delivery */
 		hr = HrCopyMessageForDelivery(lpOrigMessage, lpTargetFolder, lpRecip, lpInbox, bFallbackDelivery, &~lpFolder, &~lpDeliveryMessage);
@@ -1988,15 +2237,17 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 			return kc_perrorf("HrCopyMessageForDelivery failed", hr);
 	}
 
-	hr = HrOverrideRecipProps(lpDeliveryMessage, lpRecip);
-	if (hr != hrSuccess)
-		return kc_perrorf("HrOverrideRecipProps failed", hr);
-
+	/* The server set them on its copy */
+	if (lpServerCopy == nullptr) {
+		hr = HrOverrideRecipProps(lpDeliveryMessage, lpRecip);
+		if (hr != hrSuccess)
+			return kc_perrorf("HrOverrideRecipProps failed", hr);
+	}
 	if (bFallbackDelivery) {
 		hr = HrOverrideFallbackProps(lpDeliveryMessage, lpRecip);
 		if (hr != hrSuccess)
 			return kc_perrorf("HrOverrideFallbackProps failed", hr);
-	} else {
+	} else if (lpServerCopy == nullptr) {
 		hr = HrOverrideReceivedByProps(lpDeliveryMessage, lpRecip);
 		if (hr != hrSuccess)
 			return kc_perrorf("HrOverrideReceivedByProps failed", hr);
@@ -2047,6 +2298,12 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 				kc_perror("Unable to commit message", hr);
 			return hr;
 		}
+		if (lpServerCopy != nullptr) {
+			hr = HrPublishServerCopy(lpTargetStore, lpTargetFolder, lpServerCopy, &~lpDeliveryMessage);
+			if (hr != hrSuccess)
+				return hr;
+		}
+		bSaved = true;
 
 		hr = lppyMapiPlugin->MessageProcessing("PostDelivery", lpSession, lpAdrBook, lpTargetStore, lpTargetFolder, lpDeliveryMessage, &ulResult);
 		if (hr != hrSuccess)
@@ -2132,7 +2389,7 @@ static void RespondMessageExpired(recipients_t::const_iterator iter,
  * @param[in] lpUserSession optional session of one user the message is being delivered to (cmdline dagent, NULL on LMTP mode)
  * @param[in] lpMessage an already delivered message
  * @param[in] bFallbackDelivery already delivered message is a fallback message
- * @param[in] strMail the rfc2822 received email
+ * @param[in] fpMail the rfc2822 received email
  * @param[in] strServer uri of the storage server to connect to
  * @param[in] listRecipients list of recipients present on the server connecting to
  * @param[in] lpAdrBook Global addressbook
@@ -2144,15 +2401,18 @@ static void RespondMessageExpired(recipients_t::const_iterator iter,
  */
 static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
     IMAPISession *lpUserSession, IMessage *lpMessage, bool bFallbackDelivery,
-    const std::string &strMail, const std::string &strServer,
+    FILE *fpMail, const std::string &strServer,
     const recipients_t &listRecipients, LPADRBOOK lpAdrBook,
     DeliveryArgs *lpArgs, IMessage **lppMessage, bool *lpbFallbackDelivery)
 {
 	HRESULT hr = hrSuccess;
 	object_ptr<IMAPISession> lpSession;
 	object_ptr<IMsgStore> lpStore;
-	object_ptr<IMessage> lpOrigMessage;
+	object_ptr<IMessage> lpOrigMessage, lpCopySource;
 	bool bFallbackDeliveryTmp = false;
+	/* Only worth it when the server can copy for someone else */
+	bool bServerCopy = parseBool(g_lpConfig->GetSetting("server_side_copy")) &&
+	                   listRecipients.size() > 1;
 	convert_context converter;
 
 	lpArgs->sc->inc(SCN_DAGENT_TO_SERVER);
@@ -2175,6 +2435,10 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 			recip->wstrDeliveryStatus = "450 4.5.0 %s network or permissions error to storage server: " + stringify_hex(hr);
 		return kc_perror("Unable to open default store for system account", hr);
 	}
+	auto cleanup = make_scope_success([&]() {
+		if (lpCopySource != nullptr)
+			Util::HrDeleteMessage(lpSession, lpCopySource);
+	});
 
 	for (auto iter = listRecipients.cbegin(); iter != listRecipients.end(); ++iter) {
 		const auto &recip = *iter;
@@ -2187,8 +2451,8 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 		 */
 		hr = ProcessDeliveryToRecipient(lppyMapiPlugin, lpSession,
 		     lpStore, lpUserSession == NULL, lpAdrBook, lpOrigMessage,
-		     bFallbackDelivery, strMail, recip, lpArgs, &~lpMessageTmp,
-		     &bFallbackDeliveryTmp);
+		     bFallbackDelivery, fpMail, recip, lpArgs, &+lpCopySource,
+		     &bServerCopy, &~lpMessageTmp, &bFallbackDeliveryTmp);
 		if (hr == hrSuccess || hr == MAPI_E_CANCEL) {
 			if (hr == hrSuccess) {
 				memory_ptr<SPropValue> lpMessageId, lpSubject;
@@ -2197,10 +2461,13 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 				if (HrGetOneProp(lpMessageTmp, PR_INTERNET_MESSAGE_ID_W, &~lpMessageId) == hrSuccess)
 					wMessageId = lpMessageId->Value.lpszW;
 				HrGetOneProp(lpMessageTmp, PR_SUBJECT_W, &~lpSubject);
+				struct stat sb;
+				if (fstat(fileno(fpMail), &sb) != 0)
+					sb.st_size = 0;
 				ec_log_info("Delivered message to \"%ls\", Subject: \"%ls\", Message-Id: %ls, size %zu",
 					recip->wstrUsername.c_str(),
 					(lpSubject != NULL) ? lpSubject->Value.lpszW : L"<none>",
-					wMessageId.c_str(), strMail.size());
+					wMessageId.c_str(), static_cast<size_t>(sb.st_size));
 			}
 			// cancel already logged.
 			hr = hrSuccess;
@@ -2234,6 +2501,43 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 	return hr;
 }
 
+/**
+ * The conversion parses the mail in place and the delivery reads it more
+ * than once, so it needs a file it can read by position. Input that is not
+ * a regular file (a pipe) is copied to a temporary file first.
+ *
+ * @param[in] fp the received email
+ * @param[out] spool owns the copy, if one was made
+ * @param[out] lppMail the file to deliver from
+ *
+ * @return MAPI Error code
+ */
+static HRESULT HrSeekableMail(FILE *fp, std::unique_ptr<FILE, file_deleter> &spool,
+    FILE **lppMail)
+{
+	struct stat sb;
+	if (fstat(fileno(fp), &sb) == 0 && S_ISREG(sb.st_mode)) {
+		/* Always start at the beginning of the file */
+		rewind(fp);
+		*lppMail = fp;
+		return hrSuccess;
+	}
+	spool.reset(tmpfile());
+	if (spool == nullptr)
+		return MAPI_E_CALL_FAILED;
+	while (!feof(fp)) {
+		char buf[65536];
+		auto rd = fread(buf, 1, sizeof(buf), fp);
+		if (ferror(fp))
+			return MAPI_E_CORRUPT_DATA;
+		if (fwrite(buf, 1, rd, spool.get()) != rd)
+			return MAPI_E_DISK_ERROR;
+	}
+	rewind(spool.get());
+	*lppMail = spool.get();
+	return hrSuccess;
+}
+
 /**
  * Commandline dagent delivery entrypoint.
  * Deliver an email to one recipient.
@@ -2254,18 +2558,15 @@ static HRESULT ProcessDeliveryToSingleRecipient(pym_plugin_intf *lppyMapiPlugin,
     IMAPISession *lpSession, LPADRBOOK lpAdrBook, FILE *fp,
     recipients_t &lstSingleRecip, DeliveryArgs *lpArgs)
 {
-	std::string strMail;
+	std::unique_ptr<FILE, file_deleter> spool;
 	lpArgs->sc->inc(SCN_DAGENT_TO_SINGLE_RECIP);
 
-	/* Always start at the beginning of the file */
-	rewind(fp);
-	/* Read file into string */
-	HRESULT hr = HrMapFileToString(fp, &strMail);
+	HRESULT hr = HrSeekableMail(fp, spool, &fp);
 	if (hr != hrSuccess)
-		return kc_perror("Unable to map input to memory", hr);
+		return kc_perror("Unable to spool input", hr);
 
-	FindSpamMarker(strMail, lpArgs);
-	hr = ProcessDeliveryToServer(lppyMapiPlugin, lpSession, NULL, false, strMail, lpArgs->strPath, lstSingleRecip, lpAdrBook, lpArgs, NULL, NULL);
+	FindSpamMarker(fp, lpArgs);
+	hr = ProcessDeliveryToServer(lppyMapiPlugin, lpSession, NULL, false, fp, lpArgs->strPath, lstSingleRecip, lpAdrBook, lpArgs, NULL, NULL);
 	if (hr != hrSuccess)
 		return kc_perrorf("ProcessDeliveryToServer failed", hr);
 	return hrSuccess;
@@ -2289,7 +2590,7 @@ static HRESULT ProcessDeliveryToCompany(pym_plugin_intf *lppyMapiPlugin,
 {
 	HRESULT hr = hrSuccess;
 	object_ptr<IMessage> lpMasterMessage;
-	std::string strMail;
+	std::unique_ptr<FILE, file_deleter> spool;
 	serverrecipients_t listServerPathRecips;
 	bool bFallbackDelivery = false, bExpired = false;
 
@@ -2297,14 +2598,11 @@ static HRESULT ProcessDeliveryToCompany(pym_plugin_intf *lppyMapiPlugin,
 	if (lpServerNameRecips == nullptr)
 		return MAPI_E_INVALID_PARAMETER;
 
-	/* Always start at the beginning of the file */
-	rewind(fp);
-	/* Read file into string */
-	hr = HrMapFileToString(fp, &strMail);
+	hr = HrSeekableMail(fp, spool, &fp);
 	if (hr != hrSuccess)
-		return kc_perror("Unable to map input to memory", hr);
+		return kc_perror("Unable to spool input", hr);
 
-	FindSpamMarker(strMail, lpArgs);
+	FindSpamMarker(fp, lpArgs);
 	hr = ResolveServerToPath(lpSession, lpServerNameRecips, lpArgs->strPath, &listServerPathRecips);
 	if (hr != hrSuccess)
 		return kc_perrorf("ResolveServerToPath failed", hr);
@@ -2319,7 +2617,7 @@ static HRESULT ProcessDeliveryToCompany(pym_plugin_intf *lppyMapiPlugin,
 			continue;
 		}
 		hr = ProcessDeliveryToServer(lppyMapiPlugin, NULL,
-		     lpMasterMessage, bFallbackDelivery, strMail,
+		     lpMasterMessage, bFallbackDelivery, fp,
 		     convert_to<std::string>(iter.first), iter.second,
 		     lpAdrBook, lpArgs, &~lpMessageTmp, &bFallbackDeliveryTmp);
 		if (hr == MAPI_W_CANCEL_MESSAGE)
@@ -3190,6 +3488,7 @@ int main(int argc, char **argv) try {
 		{"socketspec", "", CONFIGSETTING_OBSOLETE},
 		{"lmtp_listen", "*:2003"},
 		{ "lmtp_max_threads", "20" },
+		{"server_side_copy", "yes", CONFIGSETTING_RELOADABLE},
 		{"process_model", "fork", CONFIGSETTING_NONEMPTY},
 		{"log_method", "auto", CONFIGSETTING_NONEMPTY},
 		{"log_file", ""},
@@ -3510,6 +3809,7 @@ dagent_stats::dagent_stats(std::shared_ptr<ECConfig> cfg) :
 	AddStat(SCN_DAGENT_NWITHATTACHMENT, SCT_INTEGER, "dagent_nwithattachment", "Messages with attachments");
 	AddStat(SCN_DAGENT_OUTOFOFFICE, SCT_INTEGER, "dagent_outofoffice", "Messages that triggered OOF");
 	AddStat(SCN_DAGENT_RECIPS, SCT_INTEGER, "dagent_recips", "Number of recipients processed");
+	AddStat(SCN_DAGENT_SERVER_COPIES, SCT_INTEGER, "dagent_server_copies", "Messages delivered as a copy made by the storage server");
 	AddStat(SCN_DAGENT_STDIN_RECEIVED, SCT_INTEGER, "dagent_stdin_received", "Number of mails processed from stdin");
 	AddStat(SCN_DAGENT_STRINGTOMAPI, SCT_INTEGER, "dagent_stringtomapi");
 	AddStat(SCN_DAGENT_TO_COMPANY, SCT_INTEGER, "dagent_to_company");
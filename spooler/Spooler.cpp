@@ -16,6 +16,7 @@
  * This advise sink unblocks the main (waiting) thread.
  */
 #include <kopano/platform.h>
+#include <algorithm>
 #include <chrono>
 #include <condition_variable>
 #include <exception>
@@ -24,9 +25,12 @@
 #include <memory>
 #include <mutex>
 #include <new>
+#include <set>
 #include <string>
 #include <utility>
+#include <vector>
 #include "mailer.h"
+#include "PyMapiPlugin.h"
 #include <climits>
 #include <cstdio>
 #include <cstdlib>
@@ -35,6 +39,7 @@
 #include <getopt.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #define USES_IID_IMAPIFolder
 #define USES_IID_IMessage
@@ -54,6 +59,7 @@
 #include <kopano/CommonUtil.h>
 #include <kopano/ECLogger.h>
 #include <kopano/ECConfig.h>
+#include <kopano/ECThreadPool.h>
 #include <kopano/UnixUtil.h>
 #include <kopano/automapi.hpp>
 #include <kopano/memory.hpp>
@@ -102,7 +108,7 @@ static std::unique_ptr<StatsClient> sc;
 #define EXIT_WAIT 2
 #define EXIT_REMOVE 3
 
-static bool bQuit = false, sp_exp_config, g_dump_config, g_use_threads;
+static bool bQuit = false, sp_exp_config, g_dump_config, g_use_threads, g_hook_helper;
 static int nReload = 0, disconnects = 0;
 static const char *szCommand = NULL;
 static const char *szConfig = ECConfig::GetDefaultPath("spooler.cfg");
@@ -131,15 +137,47 @@ struct sp_handlerargs {
 	bool do_sentmail;
 };
 
+/* One message for the sending threads */
+class sp_sendtask final : public ECTask {
+	public:
+	sp_handlerargs m_args;
+
+	protected:
+	void run() override;
+};
+
 static std::map<pid_t, SendData> mapSendData; /* data for subprocesses */
 static std::list<SendData> g_senddata_thr; /* data for subthreads */
+static std::set<std::string> g_sending_thr; /* entryids of messages with a subthread; main thread only */
+static std::unique_ptr<ECThreadPool> g_sendpool;
 static map<pid_t, int> mapFinished;	// exit status of finished processes
 static std::mutex g_senddata_mtx; /* protect g_senddata_thr */
 static std::mutex hMutexFinished; /* mutex for mapFinished */
+static std::condition_variable hCondFinished; /* signalled when mapFinished grows */
 
 static HRESULT running_server(const char *szSMTP, int port, const char *szPath);
 static HRESULT handle_child_exit(IMAPISession *, IECSpooler *, StatsClient *, pid_t, unsigned int, unsigned int, const SendData &);
 
+/* What a mailer process exits with after having tried a message */
+static int mailer_exit_code(HRESULT hr)
+{
+	switch (hr) {
+	case hrSuccess:
+		return EXIT_SUCCESS;
+	case MAPI_E_WAIT:			// Timed message
+	case MAPI_W_NO_SERVICE:	// SMTP server did not react in forked mode, mail should be retried later
+		return EXIT_WAIT;
+	}
+	// forked: failed sending message, but is already removed from the queue
+	return EXIT_FAILURE;
+}
+
+/* Number of messages being sent by subprocesses or subthreads */
+static size_t messages_in_flight()
+{
+	return g_use_threads ? g_sending_thr.size() : mapSendData.size();
+}
+
 /**
  * Print command line options, only for daemon version, not for mailer fork process
  *
@@ -186,49 +224,6 @@ static LONG AdviseCallback(void *lpContext, ULONG cNotif,
 	return 0;
 }
 
-static void *HandlerSP_Thread(void *varg)
-{
-	std::unique_ptr<sp_handlerargs> a(static_cast<sp_handlerargs *>(varg));
-	auto ret = ProcessMessageForked(a->sd.strUsername.c_str(),
-		a->smtp_host.c_str(), a->smtp_port, a->path.c_str(),
-		a->sd.msg_eid.length(), reinterpret_cast<const ENTRYID *>(a->sd.msg_eid.data()),
-		g_lpLogger, a->do_sentmail);
-	a->sd.status = ret;
-	std::unique_lock<std::mutex> lk(g_senddata_mtx);
-	g_senddata_thr.emplace_back(std::move(a->sd));
-	lk.unlock();
-	hCondMessagesWaiting.notify_one();
-	return nullptr;
-}
-
-static HRESULT StartSpoolerThread(SendData &&sd, const char *smtp_host,
-    uint16_t smtp_port, const char *path, unsigned int flags)
-{
-	auto th_arg = make_unique_nt<sp_handlerargs>();
-	if (th_arg == nullptr)
-		return MAPI_E_NOT_ENOUGH_MEMORY;
-	th_arg->sd = std::move(sd);
-	th_arg->smtp_host = smtp_host;
-	th_arg->smtp_port = smtp_port;
-	th_arg->path = path;
-	th_arg->do_sentmail = flags & EC_SUBMIT_DOSENTMAIL;
-
-	pthread_attr_t attr;
-	pthread_t tid;
-	pthread_attr_init(&attr);
-	pthread_attr_setstacksize(&attr, 1 << 20);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	auto err = pthread_create(&tid, &attr, HandlerSP_Thread, th_arg.get());
-	pthread_attr_destroy(&attr);
-	if (err != 0) {
-		ec_log_err("Could not create worker thread: %s", strerror(err));
-		return MAPI_E_CALL_FAILED;
-	}
-	th_arg.release();
-	ec_log_info("Worker thread 0x%lx started", static_cast<unsigned long>(tid));
-	return hrSuccess;
-}
-
 /*
  * starting fork, passes:
  * -c config    for all log settings and smtp server and such
@@ -238,52 +233,22 @@ static HRESULT StartSpoolerThread(SendData &&sd, const char *smtp_host,
  * if (szPath)  kopano host
  * if (szSMTP)  smtp host
  * if (szSMTPPport) smtp port
+ * --run-plugin only run the PreSending plugin hook (@hook_only)
  */
-/**
- * Starts a forked process which sends the actual mail, and removes it
- * from the queue, in normal situations.  On error, the
- * CleanFinishedMessages function will try to remove the failed
- * message if needed, else it will be tried again later (e.g. timestamp
- * on sending, or SMTP not responding).
- *
- * @param[in]	szUsername	The username. This name is in unicode.
- * @param[in]	szSMTP		SMTP server to use
- * @param[in]	ulPort		SMTP port to use
- * @param[in]	szPath		URL to storage server
- * @param[in]	cbStoreEntryId	Length of lpStoreEntryId
- * @param[in]	lpStoreEntryId	Entry ID of store of user containing the message to be sent
- * @param[in]	cbStoreEntryId	Length of lpMsgEntryId
- * @param[in]	lpMsgEntryId	Entry ID of message to be sent
- * @param[in]	ulFlags		PR_EC_OUTGOING_FLAGS of message (EC_SUBMIT_DOSENTMAIL flag)
- * @return		HRESULT
- */
-static HRESULT StartSpoolerFork(const wchar_t *szUsername, const char *szSMTP,
-    int ulSMTPPort, const char *szPath, const SBinary &store_eid,
-    const SBinary &msg_eid, unsigned int ulFlags)
+static pid_t StartMailerProcess(const SendData &sd, const char *szSMTP,
+    int ulSMTPPort, const char *szPath, bool hook_only)
 {
-	SendData sSendData;
-	bool bDoSentMail = ulFlags & EC_SUBMIT_DOSENTMAIL;
-
-	// place pid with entryid copy in map
-	sSendData.store_eid.assign(reinterpret_cast<const char *>(store_eid.lpb), store_eid.cb);
-	sSendData.msg_eid.assign(reinterpret_cast<const char *>(msg_eid.lpb), msg_eid.cb);
-	sSendData.ulFlags = ulFlags;
-	sSendData.strUsername = szUsername;
-
-	if (g_use_threads)
-		return StartSpoolerThread(std::move(sSendData), szSMTP, ulSMTPPort, szPath, ulFlags);
-
 	std::string strPort = stringify(ulSMTPPort);
 	// execute the new spooler process to send the email
-	const char *argv[18];
+	const char *argv[19];
 	int argc = 0;
 	argv[argc++] = szCommand;
 	std::unique_ptr<char[], cstdlib_deleter> bname(strdup(szCommand));
 	argv[argc++] = basename(bname.get());
-	auto eidhex = bin2hex(msg_eid.cb, msg_eid.lpb);
+	auto eidhex = bin2hex(sd.msg_eid);
 	argv[argc++] = "--send-message-entryid";
 	argv[argc++] = eidhex.c_str();
-	auto encuser = convert_to<std::string>("UTF-8", szUsername, rawsize(szUsername), CHARSET_WCHAR);
+	auto encuser = convert_to<std::string>("UTF-8", sd.strUsername.c_str(), rawsize(sd.strUsername.c_str()), CHARSET_WCHAR);
 	argv[argc++] = "--send-username-enc";
 	argv[argc++] = encuser.c_str();
 	auto logfd = stringify(g_lpLogger->GetFileDescriptor());
@@ -299,8 +264,10 @@ static HRESULT StartSpoolerFork(const wchar_t *szUsername, const char *szSMTP,
 	argv[argc++] = szSMTP;
 	argv[argc++] = "--port";
 	argv[argc++] = strPort.c_str();
-	if (bDoSentMail)
+	if (sd.ulFlags & EC_SUBMIT_DOSENTMAIL)
 		argv[argc++] = "--do-sentmail";
+	if (hook_only)
+		argv[argc++] = "--run-plugin";
 	argv[argc] = nullptr;
 	std::vector<std::string> cmd{argv, argv + argc};
 	ec_log_debug("Executing \"%s\"", kc_join(cmd, "\" \"").c_str());
@@ -308,7 +275,7 @@ static HRESULT StartSpoolerFork(const wchar_t *szUsername, const char *szSMTP,
 	auto pid = vfork();
 	if (pid < 0) {
 		ec_log_crit(string("Unable to start new spooler process: ") + strerror(errno));
-		return MAPI_E_CALL_FAILED;
+		return pid;
 	}
 	/*
 	 * We must exec. spooler still has the IMAPISession object alive in the
@@ -323,7 +290,130 @@ static HRESULT StartSpoolerFork(const wchar_t *szUsername, const char *szSMTP,
 		_exit(EXIT_REMOVE);
 #endif
 	}
+	return pid;
+}
+
+/*
+ * Waits for the plugin helper of a sending thread. The SIGCHLD handler may
+ * have reaped it already; it is kept off this thread meanwhile, since it
+ * takes hMutexFinished.
+ */
+static int WaitMailerProcess(pid_t pid)
+{
+	sigset_t mask, old;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	auto restore = make_scope_success([&]() { pthread_sigmask(SIG_SETMASK, &old, nullptr); });
+	std::unique_lock<std::mutex> lk(hMutexFinished);
+	while (true) {
+		int status = 0;
+		if (waitpid(pid, &status, WNOHANG) == pid)
+			return status;
+		auto i = mapFinished.find(pid);
+		if (i != mapFinished.cend()) {
+			status = i->second;
+			mapFinished.erase(i);
+			return status;
+		}
+		hCondFinished.wait_for(lk, 100ms);
+	}
+}
 
+/*
+ * Python cannot run in the sending threads, so a helper process runs the
+ * PreSending hook first. Returns the hook outcome as an MP_* value.
+ */
+static unsigned int RunHookHelper(const sp_handlerargs &a)
+{
+	auto pid = StartMailerProcess(a.sd, a.smtp_host.c_str(), a.smtp_port, a.path.c_str(), true);
+	if (pid < 0)
+		return MP_RETRY_LATER;
+	auto status = WaitMailerProcess(pid);
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+		return MP_CONTINUE;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_WAIT)
+		return MP_RETRY_LATER;
+	ec_log_err("Plugin helper process %d for a message of user %ls failed (status 0x%x)",
+		pid, a.sd.strUsername.c_str(), status);
+	return MP_FAILED;
+}
+
+void sp_sendtask::run()
+{
+	unsigned int hook = MP_CONTINUE;
+	if (g_hook_helper)
+		hook = RunHookHelper(m_args);
+	auto ret = ProcessMessageForked(m_args.sd.strUsername.c_str(),
+		m_args.smtp_host.c_str(), m_args.smtp_port, m_args.path.c_str(),
+		m_args.sd.msg_eid.length(), reinterpret_cast<const ENTRYID *>(m_args.sd.msg_eid.data()),
+		g_lpLogger, m_args.do_sentmail, g_hook_helper ? &hook : nullptr);
+	m_args.sd.status = mailer_exit_code(ret);
+	std::unique_lock<std::mutex> lk(g_senddata_mtx);
+	g_senddata_thr.emplace_back(std::move(m_args.sd));
+	lk.unlock();
+	std::lock_guard<std::mutex> wl(hMutexMessagesWaiting);
+	hCondMessagesWaiting.notify_one();
+}
+
+static HRESULT StartSpoolerThread(SendData &&sd, const char *smtp_host,
+    uint16_t smtp_port, const char *path, unsigned int flags)
+{
+	auto task = make_unique_nt<sp_sendtask>();
+	if (task == nullptr)
+		return MAPI_E_NOT_ENOUGH_MEMORY;
+	auto &a = task->m_args;
+	a.sd = std::move(sd);
+	a.smtp_host = smtp_host;
+	a.smtp_port = smtp_port;
+	a.path = path;
+	a.do_sentmail = flags & EC_SUBMIT_DOSENTMAIL;
+	auto eid = a.sd.msg_eid;
+	if (!task->queue_on(g_sendpool.get(), true)) {
+		ec_log_err("Could not queue message for the sending threads");
+		return MAPI_E_CALL_FAILED;
+	}
+	task.release();
+	g_sending_thr.emplace(std::move(eid));
+	return hrSuccess;
+}
+
+/**
+ * Starts a forked process which sends the actual mail, and removes it
+ * from the queue, in normal situations.  On error, the
+ * CleanFinishedMessages function will try to remove the failed
+ * message if needed, else it will be tried again later (e.g. timestamp
+ * on sending, or SMTP not responding).
+ *
+ * @param[in]	szUsername	The username. This name is in unicode.
+ * @param[in]	szSMTP		SMTP server to use
+ * @param[in]	ulPort		SMTP port to use
+ * @param[in]	szPath		URL to storage server
+ * @param[in]	cbStoreEntryId	Length of lpStoreEntryId
+ * @param[in]	lpStoreEntryId	Entry ID of store of user containing the message to be sent
+ * @param[in]	cbStoreEntryId	Length of lpMsgEntryId
+ * @param[in]	lpMsgEntryId	Entry ID of message to be sent
+ * @param[in]	ulFlags		PR_EC_OUTGOING_FLAGS of message (EC_SUBMIT_DOSENTMAIL flag)
+ * @return		HRESULT
+ */
+static HRESULT StartSpoolerFork(const wchar_t *szUsername, const char *szSMTP,
+    int ulSMTPPort, const char *szPath, const SBinary &store_eid,
+    const SBinary &msg_eid, unsigned int ulFlags)
+{
+	SendData sSendData;
+
+	// place pid with entryid copy in map
+	sSendData.store_eid.assign(reinterpret_cast<const char *>(store_eid.lpb), store_eid.cb);
+	sSendData.msg_eid.assign(reinterpret_cast<const char *>(msg_eid.lpb), msg_eid.cb);
+	sSendData.ulFlags = ulFlags;
+	sSendData.strUsername = szUsername;
+
+	if (g_use_threads)
+		return StartSpoolerThread(std::move(sSendData), szSMTP, ulSMTPPort, szPath, ulFlags);
+
+	auto pid = StartMailerProcess(sSendData, szSMTP, ulSMTPPort, szPath, false);
+	if (pid < 0)
+		return MAPI_E_CALL_FAILED;
 	ec_log_info("Spooler process started on PID %d", pid);
 	// process is started, place in map
 	mapSendData[pid] = std::move(sSendData);
@@ -394,8 +484,10 @@ static void CleanFinishedMessagesThreaded(IMAPISession *ses, IECSpooler *spooler
 	g_senddata_thr.clear();
 	lk.unlock();
 	ec_log_debug("Cleaning %zu subthreads from queue", finished.size());
-	for (const auto &sd : finished)
+	for (const auto &sd : finished) {
 		handle_child_exit(ses, spooler, sc.get(), 0, SPC_EXITED, sd.status, sd);
+		g_sending_thr.erase(sd.msg_eid);
+	}
 }
 
 /**
@@ -543,9 +635,17 @@ static HRESULT ProcessAllEntries2(IMAPISession *lpAdminSession,
 		ulMaxThreads = 1;
 
 	while(!bQuit) {
-		auto ulFreeThreads = ulMaxThreads - mapSendData.size();
-		if (ulFreeThreads == 0) {
-			Sleep(100);
+		if (messages_in_flight() >= static_cast<size_t>(ulMaxThreads)) {
+			if (g_use_threads) {
+				/* Sending threads report back through the condition */
+				std::unique_lock<std::mutex> lk(hMutexMessagesWaiting);
+				hCondMessagesWaiting.wait_for(lk, 100ms, []() {
+					std::lock_guard<std::mutex> l(g_senddata_mtx);
+					return !g_senddata_thr.empty();
+				});
+			} else {
+				Sleep(100);
+			}
 			// remove enties from mapSendData which are finished
 			CleanFinishedMessages(lpAdminSession, lpSpooler);
 			continue;	/* Continue looping until threads become available */
@@ -592,7 +692,8 @@ static HRESULT ProcessAllEntries2(IMAPISession *lpAdminSession,
 
 		std::wstring strUsername = lpsRowSet[0].lpProps[0].Value.lpszW;
 		// Check if there is already an active process for this message
-		bool bMatch = false;
+		const auto &eid = lpsRowSet[0].lpProps[2].Value.bin;
+		bool bMatch = g_sending_thr.count(std::string(reinterpret_cast<const char *>(eid.lpb), eid.cb)) > 0;
 		for (const auto &i : mapSendData)
 			if (i.second.msg_eid.size() == lpsRowSet[0].lpProps[2].Value.bin.cb &&
 			    memcmp(i.second.msg_eid.data(), lpsRowSet[0].lpProps[2].Value.bin.lpb, i.second.msg_eid.size()) == 0) {
@@ -640,6 +741,21 @@ static HRESULT GetAdminSpooler(IMAPISession *lpAdminSession,
 	return hr;
 }
 
+/*
+ * (Re)apply the reloadable settings of the process_model=thread engine:
+ * max_threads sending threads with as many pooled admin sessions, and the
+ * SMTP connection pool.
+ */
+static void apply_thread_settings()
+{
+	auto nthr = std::max(1, atoi(g_lpConfig->GetSetting("max_threads")));
+	g_sendpool->setThreadCount(nthr);
+	SetAdminSessionPool(nthr);
+	smtp_pool_configure(atoui(g_lpConfig->GetSetting("smtp_pool_size")),
+		atoui(g_lpConfig->GetSetting("smtp_pool_idle_timeout")));
+	smtp_pool_purge(false);
+}
+
 /**
  * Opens an admin session and the outgoing queue. If either one
  * produces an error this function will return. If the queue is empty,
@@ -690,6 +806,8 @@ static HRESULT ProcessQueue2(IMAPISession *lpAdminSession,
 
 	while(!bQuit && !nReload) {
 		bMessagesWaiting = false;
+		if (g_use_threads)
+			apply_thread_settings();
 		lpTable->SeekRow(BOOKMARK_BEGINNING, 0, NULL);
 		// also checks not to send a message again which is already sending
 		hr = ProcessAllEntries(lpAdminSession, lpSpooler, lpTable, szSMTP, ulPort, szPath);
@@ -747,7 +865,7 @@ static HRESULT ProcessQueue(const char *smtp, int port, const char *path)
 	if (bQuit) {
 		size_t ulCount = 0;
 		while (ulCount < 60) {
-			size_t ulThreads = mapSendData.size();
+			size_t ulThreads = messages_in_flight();
 			if (ulThreads == 0)
 				break;
 			if ((ulCount % 5) == 0)
@@ -758,7 +876,7 @@ static HRESULT ProcessQueue(const char *smtp, int port, const char *path)
 			++ulCount;
 		}
 		if (ulCount == 60)
-			ec_log_debug("%zu threads did not yet exit, closing anyway.", mapSendData.size());
+			ec_log_debug("%zu threads did not yet exit, closing anyway.", messages_in_flight());
 	}
 	else if (nReload) {
 		ec_log_warn("Table reload requested, breaking server connection");
@@ -801,6 +919,7 @@ static void process_signal(int sig)
 		while ((pid = waitpid (-1, &stat, WNOHANG)) > 0)
 			mapFinished[pid] = stat;
 		finlock.unlock();
+		hCondFinished.notify_all();
 		// Trigger condition so the messages get cleaned from the queue
 		hCondMessagesWaiting.notify_one();
 		break;
@@ -824,7 +943,7 @@ static void process_signal(int sig)
 		break;
 	case SIGUSR2: {
 		ec_log_debug("Spooler stats:");
-		ec_log_debug("Running threads: %zu", mapSendData.size());
+		ec_log_debug("Running threads: %zu", messages_in_flight());
 		std::lock_guard<std::mutex> l(hMutexFinished);
 		ec_log_debug("Finished threads: %zu", mapFinished.size());
 		ec_log_debug("Disconnects: %d", disconnects);
@@ -852,6 +971,13 @@ static HRESULT running_server(const char *szSMTP, int ulPort,
 	HRESULT hr = hrSuccess;
 	ec_log_debug("Using SMTP server: %s, port %d", szSMTP, ulPort);
 	disconnects = 0;
+	if (g_use_threads)
+		g_sendpool.reset(new ECThreadPool(1));
+	auto cleanup = make_scope_success([]() {
+		g_sendpool.reset();
+		smtp_pool_purge(true);
+		FlushAdminSessionPool();
+	});
 
 	while (1) {
 		hr = ProcessQueue(szSMTP, ulPort, szPath);
@@ -860,6 +986,7 @@ static HRESULT running_server(const char *szSMTP, int ulPort,
 		if (disconnects == 0)
 			ec_log_warn("Server connection lost. Reconnecting in 3 seconds...");
 		++disconnects;
+		FlushAdminSessionPool();
 		Sleep(3000);			// wait 3s until retry to connect
 	}
 	bQuit = true;				// make sure the sigchld does not use the lock anymore
@@ -871,7 +998,7 @@ static int main2(int argc, char **argv)
 	HRESULT hr = hrSuccess;
 	const char *szPath = nullptr, *szSMTP = nullptr;
 	int ulPort = 0, daemonize = 1, logfd = -1;
-	bool bForked = false;
+	bool bForked = false, run_plugin = false;
 	std::string strMsgEntryId;
 	std::wstring strUsername;
 	bool bDoSentMail = false, bIgnoreUnknownConfigOptions = false;
@@ -890,6 +1017,7 @@ static int main2(int argc, char **argv)
 		OPT_DO_SENTMAIL,
 		OPT_PORT,
 		OPT_DUMP_CONFIG,
+		OPT_RUN_PLUGIN,
 	};
 	static const struct option long_options[] = {
 		{ "help", 0, NULL, OPT_HELP },		// help text
@@ -902,6 +1030,7 @@ static int main2(int argc, char **argv)
 		{ "log-fd", 1, NULL, OPT_LOGFD },								// fd where to send log messages to
 		{ "do-sentmail", 0, NULL, OPT_DO_SENTMAIL },
 		{ "port", 1, NULL, OPT_PORT },
+		{"run-plugin", 0, nullptr, OPT_RUN_PLUGIN},	// only run the PreSending hook
 		{ "ignore-unknown-config-options", 0, NULL, OPT_IGNORE_UNKNOWN_CONFIG_OPTIONS },
 		{"dump-config", 0, nullptr, OPT_DUMP_CONFIG},
 		{ NULL, 0, NULL, 0 }
@@ -947,6 +1076,8 @@ static int main2(int argc, char **argv)
 		{"log_raw_message_path", "/var/lib/kopano", CONFIGSETTING_RELOADABLE},
 		{"log_raw_message_stage1", "no", CONFIGSETTING_RELOADABLE},
 		{"process_model", "fork", CONFIGSETTING_NONEMPTY},
+		{"smtp_pool_size", "5", CONFIGSETTING_RELOADABLE},
+		{"smtp_pool_idle_timeout", "60", CONFIGSETTING_RELOADABLE},
 		{ NULL, NULL },
 	};
     // SIGSEGV backtrace support
@@ -996,6 +1127,9 @@ static int main2(int argc, char **argv)
 		case OPT_PORT:
 			ulPort = atoi(optarg);
 			break;
+		case OPT_RUN_PLUGIN:
+			run_plugin = true;
+			break;
 		case OPT_IGNORE_UNKNOWN_CONFIG_OPTIONS:
 			bIgnoreUnknownConfigOptions = true;
 			break;
@@ -1058,15 +1192,16 @@ static int main2(int argc, char **argv)
 	if (!TmpPath::instance.OverridePath(g_lpConfig.get()))
 		ec_log_err("Ignoring invalid path setting!");
 	g_main_thread = pthread_self();
-	if (strcmp(g_lpConfig->GetSetting("process_model"), "thread") == 0) {
-		if (parseBool(g_lpConfig->GetSetting("plugin_enabled")))
-			/*
-			 * Though you can create multiple interpreters, they
-			 * cannot run simultaneously, defeating the purpose.
-			 */
-			ec_log_err("Use of Python (plugin_enabled=yes) forces process_model=fork");
-		else
-			g_use_threads = true;
+	if (!bForked && strcmp(g_lpConfig->GetSetting("process_model"), "thread") == 0) {
+		g_use_threads = true;
+		/*
+		 * Though you can create multiple interpreters, they
+		 * cannot run simultaneously, defeating the purpose. The
+		 * hook runs in a helper process instead.
+		 */
+		g_hook_helper = parseBool(g_lpConfig->GetSetting("plugin_enabled"));
+		if (g_hook_helper)
+			ec_log_info("Python plugins (plugin_enabled=yes) run in a helper process for each message");
 	}
 	if (g_use_threads)
 		g_lpLogger->SetLogprefix(LP_TID);
@@ -1132,7 +1267,8 @@ static int main2(int argc, char **argv)
 		ec_log_crit("main(): Failed creating PID file");
 		return MAPI_E_CALL_FAILED;
 	}
-	if (!g_use_threads)
+	/* Plugin helpers, like forked mailers, log through the logger process */
+	if (!g_use_threads || g_hook_helper)
 		g_lpLogger = StartLoggerProcess(g_lpConfig.get(), std::move(g_lpLogger));
 	ec_log_set(g_lpLogger);
 	g_lpLogger->SetLogprefix(LP_PID);
@@ -1145,7 +1281,10 @@ static int main2(int argc, char **argv)
 	}
 
 	sc.reset(new spooler_stats(g_lpConfig));
-	if (bForked)
+	if (bForked && run_plugin)
+		hr = RunSendingHook(strUsername.c_str(), szPath, strMsgEntryId.length(),
+		     reinterpret_cast<const ENTRYID *>(strMsgEntryId.data()));
+	else if (bForked)
 		hr = ProcessMessageForked(strUsername.c_str(), szSMTP, ulPort,
 		     szPath, strMsgEntryId.length(), reinterpret_cast<const ENTRYID *>(strMsgEntryId.data()),
 		     g_lpLogger, bDoSentMail);
@@ -1157,18 +1296,7 @@ static int main2(int argc, char **argv)
 }
 
 int main(int argc, char **argv) try {
-	auto hr = main2(argc, argv);
-	switch(hr) {
-	case hrSuccess:
-		return EXIT_SUCCESS;
-
-	case MAPI_E_WAIT:			// Timed message
-		case MAPI_W_NO_SERVICE:	// SMTP server did not react in forked mode, mail should be retried later
-		return EXIT_WAIT;
-	}
-
-	// forked: failed sending message, but is already removed from the queue
-	return EXIT_FAILURE;
+	return mailer_exit_code(main2(argc, argv));
 } catch (...) {
 	std::terminate();
 }
@@ -4,9 +4,11 @@
  */
 #include <kopano/platform.h>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <utility>
+#include <vector>
 #include "mailer.h"
 #include "archive.h"
 #include <mapitags.h>
@@ -1537,6 +1539,51 @@ static void lograw1(IMAPISession *ses, IAddrBook *ab, IMessage *msg,
 	fputs(os.str().c_str(), fp.get());
 }
 
+/* Admin sessions of finished messages, kept for the next ones */
+static std::mutex g_admin_pool_lock;
+static std::vector<object_ptr<IMAPISession>> g_admin_pool;
+static unsigned int g_admin_pool_max;
+
+void SetAdminSessionPool(unsigned int max)
+{
+	std::lock_guard<std::mutex> lk(g_admin_pool_lock);
+	g_admin_pool_max = max;
+	if (g_admin_pool.size() > max)
+		g_admin_pool.resize(max);
+}
+
+void FlushAdminSessionPool()
+{
+	std::lock_guard<std::mutex> lk(g_admin_pool_lock);
+	g_admin_pool.clear();
+}
+
+static HRESULT admin_session_get(const char *path, IMAPISession **ses)
+{
+	std::unique_lock<std::mutex> lk(g_admin_pool_lock);
+	if (!g_admin_pool.empty()) {
+		*ses = g_admin_pool.back().release();
+		g_admin_pool.pop_back();
+		return hrSuccess;
+	}
+	lk.unlock();
+	return HrOpenECAdminSession(ses, PROJECT_VERSION, "mailer:admin", path,
+	       EC_PROFILE_FLAGS_NO_PUBLIC_STORE,
+	       g_lpConfig->GetSetting("sslkey_file", "", nullptr),
+	       g_lpConfig->GetSetting("sslkey_pass", "", nullptr));
+}
+
+static void admin_session_put(object_ptr<IMAPISession> &&ses, HRESULT result)
+{
+	/* Do not keep a session that may have lost the server */
+	if (ses == nullptr || result == MAPI_E_NETWORK_ERROR ||
+	    result == MAPI_E_END_OF_SESSION)
+		return;
+	std::lock_guard<std::mutex> lk(g_admin_pool_lock);
+	if (g_admin_pool.size() < g_admin_pool_max)
+		g_admin_pool.emplace_back(std::move(ses));
+}
+
 /**
  * Using the given resources, sends the mail to the SMTP server.
  *
@@ -1550,6 +1597,7 @@ static void lograw1(IMAPISession *ses, IAddrBook *ab, IMessage *msg,
  * @param[in]	cbMsgEntryId	Number of bytes in lpMsgEntryId
  * @param[in]	lpMsgEntryId	EntryID of the message to be sent.
  * @param[out]	lppMessage		The message that processed. Always returned if opened.
+ * @param[in]	hook_result	Outcome (MP_*) of the PreSending hook when a helper process already ran it, else nullptr.
  *
  * @note The mail will be removed by the calling process when we return an error, except for the errors/warnings listed below.
  * @retval	hrSuccess	Mail was successful sent moved when when needed.
@@ -1560,7 +1608,8 @@ static HRESULT ProcessMessage(IMAPISession *lpAdminSession,
     IMAPISession *lpUserSession, IECServiceAdmin *lpServiceAdmin,
     IECSecurity *lpSecurity, IMsgStore *lpUserStore, IAddrBook *lpAddrBook,
     ECSender *lpMailer, unsigned int cbMsgEntryId, const ENTRYID *lpMsgEntryId,
-    IMessage **lppMessage, std::shared_ptr<ECLogger> logger, bool &doSentMail)
+    IMessage **lppMessage, std::shared_ptr<ECLogger> logger, bool &doSentMail,
+    const unsigned int *hook_result)
 {
 	object_ptr<IMessage> lpMessage;
 	unsigned int ulObjType = 0, cbOwner = 0, cValuesMoveProps = 0;
@@ -1603,7 +1652,8 @@ static HRESULT ProcessMessage(IMAPISession *lpAdminSession,
 	sopt.always_expand_distr_list = parseBool(g_lpConfig->GetSetting("expand_groups"));
 
 	// Init plugin system
-	auto hr = pyMapiPluginFactory.create_plugin(g_lpConfig.get(), "SpoolerPluginManager", &unique_tie(ptrPyMapiPlugin));
+	auto hr = hook_result != nullptr ? hrSuccess :
+	          pyMapiPluginFactory.create_plugin(g_lpConfig.get(), "SpoolerPluginManager", &unique_tie(ptrPyMapiPlugin));
 	if (hr != hrSuccess) {
 		ec_log_crit("K-1733: Unable to initialize the spooler plugin system: %s (%x).",
 			GetMAPIErrorMessage(hr), hr);
@@ -1884,9 +1934,13 @@ static HRESULT ProcessMessage(IMAPISession *lpAdminSession,
 	}
 	RewriteQuotedRecipients(lpMessage);
 
-	hr = ptrPyMapiPlugin->MessageProcessing("PreSending", lpUserSession, lpAddrBook, lpUserStore, NULL, lpMessage, &ulResult);
-	if (hr != hrSuccess)
-		goto exit;
+	if (hook_result != nullptr) {
+		ulResult = *hook_result;
+	} else {
+		hr = ptrPyMapiPlugin->MessageProcessing("PreSending", lpUserSession, lpAddrBook, lpUserStore, NULL, lpMessage, &ulResult);
+		if (hr != hrSuccess)
+			goto exit;
+	}
 	if (ulResult == MP_RETRY_LATER) {
 		hr = MAPI_E_WAIT;
 		goto exit;
@@ -1963,12 +2017,13 @@ exit:
  * @param[in]	cbMsgEntryId The number of bytes in lpMsgEntryId
  * @param[in]	lpMsgEntryId The EntryID of the message to send
  * @param[in]	bDoSentMail	true if the mail should be moved to the "Sent Items" folder of the user.
+ * @param[in]	hook_result	Outcome (MP_*) of the PreSending hook when a helper process already ran it, else nullptr.
  * @return		HRESULT
  */
 HRESULT ProcessMessageForked(const wchar_t *szUsername, const char *szSMTP,
     int ulPort, const char *szPath, unsigned int cbMsgEntryId,
     const ENTRYID *lpMsgEntryId, std::shared_ptr<ECLogger> logger,
-    bool bDoSentMail)
+    bool bDoSentMail, const unsigned int *hook_result)
 {
 	HRESULT			hr = hrSuccess;
 	object_ptr<IMAPISession> lpAdminSession, lpUserSession;
@@ -1989,10 +2044,7 @@ HRESULT ProcessMessageForked(const wchar_t *szUsername, const char *szSMTP,
 	}
 
 	// The Admin session is used for checking delegates and archiving
-	hr = HrOpenECAdminSession(&~lpAdminSession, PROJECT_VERSION,
-	     "mailer:admin", szPath, EC_PROFILE_FLAGS_NO_PUBLIC_STORE,
-	     g_lpConfig->GetSetting("sslkey_file", "", NULL),
-	     g_lpConfig->GetSetting("sslkey_pass", "", NULL));
+	hr = admin_session_get(szPath, &~lpAdminSession);
 	if (hr != hrSuccess) {
 		kc_perror("Unable to open admin session", hr);
 		goto exit;
@@ -2037,7 +2089,7 @@ HRESULT ProcessMessageForked(const wchar_t *szUsername, const char *szSMTP,
 
 	hr = ProcessMessage(lpAdminSession, lpUserSession, lpServiceAdmin,
 	     lpSecurity, lpUserStore, lpAddrBook, lpMailer.get(), cbMsgEntryId,
-	     lpMsgEntryId, &~lpMessage, logger, bDoSentMail);
+	     lpMsgEntryId, &~lpMessage, logger, bDoSentMail, hook_result);
 	if (hr != hrSuccess && hr != MAPI_E_WAIT && hr != MAPI_W_NO_SERVICE && lpMessage) {
 		// use lpMailer to set body in SendUndeliverable
 		if (!lpMailer->haveError())
@@ -2060,5 +2112,64 @@ exit:
 		if (bDoSentMail && lpUserSession && lpMessage)
 			DoSentMail(NULL, lpUserStore, 0, std::move(lpMessage));
 	}
+	admin_session_put(std::move(lpAdminSession), hr);
 	return hr;
 }
+
+/**
+ * Runs the PreSending plugin hook on a message, in a helper process for a
+ * spooler that sends from threads (Python cannot run in those). What the
+ * hook changes is saved, so that the sending thread sees it.
+ *
+ * @param[in]	szUsername	The owner of the message.
+ * @param[in]	szPath		The URI to the Kopano server.
+ * @param[in]	cbMsgEntryId The number of bytes in lpMsgEntryId
+ * @param[in]	lpMsgEntryId The EntryID of the message to send
+ * @retval	MAPI_E_WAIT	The hook wants the message to be sent later.
+ * @retval	MAPI_E_CANCEL	The hook failed the message.
+ */
+HRESULT RunSendingHook(const wchar_t *szUsername, const char *szPath,
+    unsigned int cbMsgEntryId, const ENTRYID *lpMsgEntryId)
+{
+	object_ptr<IMAPISession> lpUserSession;
+	object_ptr<IAddrBook> lpAddrBook;
+	object_ptr<IMsgStore> lpUserStore;
+	object_ptr<IMessage> lpMessage;
+	PyMapiPluginFactory pyMapiPluginFactory;
+	std::unique_ptr<pym_plugin_intf> ptrPyMapiPlugin;
+	unsigned int ulObjType = 0, ulResult = 0;
+
+	auto hr = pyMapiPluginFactory.create_plugin(g_lpConfig.get(), "SpoolerPluginManager", &unique_tie(ptrPyMapiPlugin));
+	if (hr != hrSuccess) {
+		ec_log_crit("K-1733: Unable to initialize the spooler plugin system: %s (%x).",
+			GetMAPIErrorMessage(hr), hr);
+		return MAPI_E_CALL_FAILED;
+	}
+	hr = HrOpenECSession(&~lpUserSession, PROJECT_VERSION, "mailer:plugin",
+	     szUsername, L"", szPath, EC_PROFILE_FLAGS_NO_PUBLIC_STORE,
+	     g_lpConfig->GetSetting("sslkey_file", "", nullptr),
+	     g_lpConfig->GetSetting("sslkey_pass", "", nullptr));
+	if (hr != hrSuccess)
+		return kc_perror("Unable to open user session", hr);
+	hr = lpUserSession->OpenAddressBook(0, nullptr, AB_NO_DIALOG, &~lpAddrBook);
+	if (hr != hrSuccess)
+		return kc_perror("Unable to open addressbook", hr);
+	hr = HrOpenDefaultStore(lpUserSession, &~lpUserStore);
+	if (hr != hrSuccess)
+		return kc_perror("Unable to open default store of user", hr);
+	hr = lpUserStore->OpenEntry(cbMsgEntryId, lpMsgEntryId, &IID_IMessage,
+	     MAPI_BEST_ACCESS, &ulObjType, &~lpMessage);
+	if (hr != hrSuccess)
+		return kc_perror("Could not open message to send", hr);
+	hr = ptrPyMapiPlugin->MessageProcessing("PreSending", lpUserSession, lpAddrBook, lpUserStore, nullptr, lpMessage, &ulResult);
+	if (hr != hrSuccess)
+		return hr;
+	if (ulResult == MP_RETRY_LATER)
+		return MAPI_E_WAIT;
+	if (ulResult == MP_FAILED)
+		return MAPI_E_CANCEL;
+	hr = lpMessage->SaveChanges(KEEP_OPEN_READONLY);
+	if (hr != hrSuccess)
+		return kc_perror("Unable to save the changes of the PreSending hook", hr);
+	return hrSuccess;
+}
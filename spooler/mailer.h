@@ -13,6 +13,10 @@
 
 namespace KC { class ECLogger; }
 extern HRESULT SendUndeliverable(KC::ECSender *, IMsgStore *, IMessage *);
-extern HRESULT ProcessMessageForked(const wchar_t *user, const char *smtp_host, int smtp_port, const char *path, unsigned int eid_size, const ENTRYID *msg_eid, std::shared_ptr<KC::ECLogger>, bool do_sentmail);
+extern HRESULT ProcessMessageForked(const wchar_t *user, const char *smtp_host, int smtp_port, const char *path, unsigned int eid_size, const ENTRYID *msg_eid, std::shared_ptr<KC::ECLogger>, bool do_sentmail, const unsigned int *hook_result = nullptr);
+extern HRESULT RunSendingHook(const wchar_t *user, const char *path, unsigned int eid_size, const ENTRYID *msg_eid);
+/* Keep up to @max admin sessions of ProcessMessageForked for reuse */
+extern void SetAdminSessionPool(unsigned int max);
+extern void FlushAdminSessionPool();
 
 #endif
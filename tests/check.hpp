@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+/*
+ *	Checks for the self-checking test programs, without MAPI
+ */
+#ifndef CHECK_HPP
+#define CHECK_HPP 1
+
+#include <cstdio>
+
+/* For test functions returning bool: report the failed check and give up */
+#define CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); return false; } } while (false)
+
+#endif /* CHECK_HPP */
@@ -0,0 +1,171 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iconv.h>
+#include <kopano/platform.h>
+#include <kopano/charset/convert.h>
+/*
+ * This program checks the conversions of convert_to that bypass iconv
+ * (UTF-8 to and from wchar_t and UTF-16) against iconv itself, on valid
+ * and broken input, and then times every conversion pair for short ASCII
+ * and non-ASCII strings: with iconv_open per call as convert_to did
+ * before, and with convert_to as it is now.
+ *
+ * Usage: convbench [iterations [seed]]
+ */
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+static std::mt19937 rng;
+
+static unsigned int rnd(unsigned int n)
+{
+	return std::uniform_int_distribution<unsigned int>(0, n - 1)(rng);
+}
+
+/* What doconvert does by default: skip what iconv cannot convert */
+static std::string plain_iconv(const char *tocode, const char *fromcode,
+    const std::string &in)
+{
+	auto cd = iconv_open(tocode, fromcode);
+	if (cd == reinterpret_cast<iconv_t>(-1)) {
+		perror("iconv_open");
+		exit(EXIT_FAILURE);
+	}
+	std::string out;
+	auto src = const_cast<char *>(in.data());
+	size_t srclen = in.size();
+	char buf[4096];
+	while (srclen > 0) {
+		char *dst = buf;
+		size_t dstlen = sizeof(buf);
+		auto ret = iconv(cd, &src, &srclen, &dst, &dstlen);
+		out.append(buf, sizeof(buf) - dstlen);
+		if (ret == static_cast<size_t>(-1) && errno != E2BIG) {
+			++src;
+			--srclen;
+		}
+	}
+	iconv_close(cd);
+	return out;
+}
+
+template<typename T> static std::string bytes(const T &s)
+{
+	return std::string(reinterpret_cast<const char *>(s.data()), s.size() * sizeof(typename T::value_type));
+}
+
+/* Random text with ASCII, 2-4 byte sequences, and with @broken, junk bytes */
+static std::string random_utf8(bool broken)
+{
+	static const char *const pieces[] = {
+		"a", "Hello, world ", "0123456789", "\xc3\xa9", "\xe2\x82\xac",
+		"\xf0\x9f\x98\x80", "\xef\xbb\xbf", "\xe4\xb8\xad\xe6\x96\x87",
+	};
+	static const char *const junk[] = {
+		"\x80", "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xe2\x82",
+		"\xff", "\xc3",
+	};
+	std::string s;
+	for (unsigned int i = rnd(40); i > 0; --i)
+		s += broken && rnd(8) == 0 ? junk[rnd(ARRAY_SIZE(junk))] : pieces[rnd(ARRAY_SIZE(pieces))];
+	return s;
+}
+
+static std::string random_units(size_t unit, bool broken)
+{
+	auto u8 = random_utf8(false);
+	auto s = plain_iconv(unit == 2 ? iconv_charset<std::u16string>::name() : CHARSET_WCHAR, "UTF-8", u8);
+	if (!broken)
+		return s;
+	/* Lone surrogates, code points out of range, a partial unit */
+	char32_t bad32[] = {0xD800, 0x110000};
+	char16_t bad16[] = {0xDC00, 0xD800};
+	auto pos = s.size() / unit / 2 * unit;
+	if (unit == 2)
+		s.insert(pos, reinterpret_cast<const char *>(&bad16[rnd(2)]), 2);
+	else
+		s.insert(pos, reinterpret_cast<const char *>(&bad32[rnd(2)]), 4);
+	if (rnd(2) == 0)
+		s += 'x';
+	return s;
+}
+
+static bool check()
+{
+	auto wname = CHARSET_WCHAR, u16name = iconv_charset<std::u16string>::name();
+	for (unsigned int i = 0; i < 20000; ++i) {
+		bool broken = i % 2 != 0;
+		auto u8 = random_utf8(broken);
+		auto ws = convert_to<std::wstring>(u8, u8.size(), "UTF-8");
+		auto u16 = convert_to<std::u16string>(u8, u8.size(), "UTF-8");
+		auto u32in = random_units(4, broken), u16in = random_units(2, broken);
+		auto from32 = convert_to<std::string>("UTF-8", u32in, u32in.size(), wname);
+		auto from16 = convert_to<std::string>("UTF-8", u16in, u16in.size(), u16name);
+		if (bytes(ws) != plain_iconv(wname, "UTF-8", u8) ||
+		    bytes(u16) != plain_iconv(u16name, "UTF-8", u8) ||
+		    from32 != plain_iconv("UTF-8", wname, u32in) ||
+		    from16 != plain_iconv("UTF-8", u16name, u16in)) {
+			fprintf(stderr, "conversion differs from iconv for input %u\n", i);
+			return false;
+		}
+	}
+	/* Options still apply to what the fast path leaves */
+	try {
+		convert_to<std::string>("UTF-8//NOIGNORE", std::string("ok\xff"), 3, "UTF-8");
+		fprintf(stderr, "NOIGNORE did not throw\n");
+		return false;
+	} catch (const illegal_sequence_exception &) {
+	}
+	return true;
+}
+
+template<typename F> static long long time_ns(unsigned int iters, F &&f)
+{
+	auto start = clk::now();
+	for (unsigned int i = 0; i < iters; ++i)
+		f();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(clk::now() - start).count() / iters;
+}
+
+static void bench(const char *label, const char *tocode, const char *fromcode,
+    const std::string &in, unsigned int iters)
+{
+	size_t sink = 0;
+	auto t_old = time_ns(iters, [&]() { sink += plain_iconv(tocode, fromcode, in).size(); });
+	auto t_new = time_ns(iters, [&]() { sink += convert_to<std::string>(tocode, in, in.size(), fromcode).size(); });
+	printf("%-28s %4zu bytes: iconv_open per call %5lld ns, convert_to %5lld ns (%zu)\n",
+	       label, in.size(), t_old, t_new, sink % 10);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int iters = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 100000;
+	rng.seed(argc >= 3 ? strtoul(argv[2], nullptr, 0) : 1);
+	if (!check())
+		return EXIT_FAILURE;
+
+	auto wname = CHARSET_WCHAR, u16name = iconv_charset<std::u16string>::name();
+	static const char *const texts[][2] = {
+		{"ascii", "Re: Quarterly report for the project meeting"},
+		{"intl", "Re: Überblick über das Projekt – 会议 ✓"},
+	};
+	for (const auto &t : texts) {
+		std::string tag = t[0], text = t[1];
+		auto w = plain_iconv(wname, "UTF-8", text), u16 = plain_iconv(u16name, "UTF-8", text);
+		bench(("utf-8 -> wchar_t, " + tag).c_str(), wname, "UTF-8", text, iters);
+		bench(("wchar_t -> utf-8, " + tag).c_str(), "UTF-8", wname, w, iters);
+		bench(("utf-8 -> utf-16, " + tag).c_str(), u16name, "UTF-8", text, iters);
+		bench(("utf-16 -> utf-8, " + tag).c_str(), "UTF-8", u16name, u16, iters);
+		bench(("utf-8 -> windows-1252, " + tag).c_str(), "WINDOWS-1252//TRANSLIT", "UTF-8", text, iters);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,200 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+#include <chrono>
+#include <exception>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <kopano/platform.h>
+#include <kopano/automapi.hpp>
+#include <kopano/ECGuid.h>
+#include <kopano/IECInterfaces.hpp>
+#include <kopano/MAPIErrors.h>
+#include <kopano/memory.hpp>
+#include <mapitags.h>
+#include <mapiutil.h>
+#include "tbi.hpp"
+/*
+ * This program measures how fast one message can be given to a number of
+ * recipients, the way kopano-dagent does for a multi-recipient LMTP
+ * delivery: once by copying it on the client for every recipient
+ * (CopyTo + SaveChanges), and once by having the server make all copies in
+ * one DeliverCopies call and then only saving the per-recipient properties.
+ *
+ * The recipients are stood in for by folders in a scratch folder of the
+ * store of the logged on user, which is removed afterwards. It needs a
+ * running server; KOPANO_SOCKET selects the server.
+ *
+ * Usage: fanoutbench [max_recipients [attachment_kb [user password]]]
+ */
+
+using namespace KC;
+
+static long long elapsed_ms(const std::chrono::steady_clock::time_point &start)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void check(HRESULT hr, const char *what)
+{
+	if (FAILED(hr)) {
+		fprintf(stderr, "%s: %s (%x)\n", what, GetMAPIErrorMessage(hr), hr);
+		throw KMAPIError(hr);
+	}
+}
+
+static object_ptr<IMAPIFolder> make_folder(IMAPIFolder *parent, const char *name)
+{
+	object_ptr<IMAPIFolder> f;
+	check(parent->CreateFolder(FOLDER_GENERIC, reinterpret_cast<const TCHAR *>(name),
+	      nullptr, &IID_IMAPIFolder, OPEN_IF_EXISTS, &~f), "CreateFolder");
+	return f;
+}
+
+static KMessage make_source(IMAPIFolder *folder, unsigned int att_kb)
+{
+	KMessage msg;
+	check(folder->CreateMessage(&IID_IMessage, 0, &~msg), "CreateMessage");
+	std::string body(4096, 'x');
+	SPropValue p[3];
+	p[0].ulPropTag = PR_SUBJECT_A;
+	p[0].Value.lpszA = const_cast<char *>("fanoutbench");
+	p[1].ulPropTag = PR_BODY_A;
+	p[1].Value.lpszA = const_cast<char *>(body.c_str());
+	p[2].ulPropTag = PR_MESSAGE_CLASS_A;
+	p[2].Value.lpszA = const_cast<char *>("IPM.Note");
+	check(msg->SetProps(3, p, nullptr), "SetProps");
+
+	auto att = msg.create_attach();
+	SPropValue a[2];
+	a[0].ulPropTag = PR_ATTACH_METHOD;
+	a[0].Value.ul = ATTACH_BY_VALUE;
+	a[1].ulPropTag = PR_ATTACH_LONG_FILENAME_A;
+	a[1].Value.lpszA = const_cast<char *>("data.bin");
+	check(att->SetProps(2, a, nullptr), "SetProps");
+	auto stream = att.open_property_stream(PR_ATTACH_DATA_BIN, STGM_WRITE, MAPI_CREATE | MAPI_MODIFY);
+	std::string chunk(1024, 'a');
+	for (unsigned int i = 0; i < att_kb; ++i) {
+		chunk[i % chunk.size()] = 'a' + i % 26;
+		check(stream.write(chunk), "Write");
+	}
+	check(stream.commit(), "Commit");
+	check(att.save_changes(), "SaveChanges");
+	check(msg.save_changes(KEEP_OPEN_READWRITE), "SaveChanges");
+	return msg;
+}
+
+/* What the delivery sets for each recipient after the copy */
+static void personalize(IMessage *msg, unsigned int i)
+{
+	std::string name = "recipient " + std::to_string(i);
+	SPropValue p[2];
+	p[0].ulPropTag = PR_RECEIVED_BY_NAME_A;
+	p[0].Value.lpszA = const_cast<char *>(name.c_str());
+	p[1].ulPropTag = PR_MESSAGE_TO_ME;
+	p[1].Value.b = true;
+	check(msg->SetProps(2, p, nullptr), "SetProps");
+	check(msg->SaveChanges(0), "SaveChanges");
+}
+
+static void client_copies(IMessage *src, const std::vector<object_ptr<IMAPIFolder>> &folders,
+    unsigned int n)
+{
+	for (unsigned int i = 0; i < n; ++i) {
+		object_ptr<IMessage> msg;
+		check(folders[i]->CreateMessage(&IID_IMessage, 0, &~msg), "CreateMessage");
+		check(src->CopyTo(0, nullptr, nullptr, 0, nullptr, &IID_IMessage, msg, 0, nullptr), "CopyTo");
+		personalize(msg, i);
+	}
+}
+
+static void server_copies(IMsgStore *store, const SBinary &src_eid,
+    const std::vector<memory_ptr<SPropValue>> &folder_eids, unsigned int n)
+{
+	object_ptr<IECServiceAdmin> admin;
+	memory_ptr<ENTRYLIST> copies;
+	std::vector<SBinary> eids;
+
+	check(store->QueryInterface(IID_IECServiceAdmin, &~admin), "QueryInterface");
+	for (unsigned int i = 0; i < n; ++i)
+		eids.emplace_back(folder_eids[i]->Value.bin);
+	ENTRYLIST list = {n, eids.data()};
+	auto hr = admin->DeliverCopies(src_eid.cb, reinterpret_cast<const ENTRYID *>(src_eid.lpb),
+	          &list, 0, nullptr, nullptr, 0, &~copies);
+	/* Not even a partial result is expected here */
+	if (hr != hrSuccess) {
+		fprintf(stderr, "DeliverCopies: %s (%x)\n", GetMAPIErrorMessage(hr), hr);
+		throw KMAPIError(hr);
+	}
+	for (unsigned int i = 0; i < copies->cValues; ++i) {
+		object_ptr<IMessage> msg;
+		unsigned int type = 0;
+		check(store->OpenEntry(copies->lpbin[i].cb, reinterpret_cast<const ENTRYID *>(copies->lpbin[i].lpb),
+		      &IID_IMessage, MAPI_MODIFY, &type, &~msg), "OpenEntry");
+		personalize(msg, i);
+	}
+}
+
+int main(int argc, char **argv) try
+{
+	unsigned int max_recips = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 100;
+	unsigned int att_kb = argc >= 3 ? strtoul(argv[2], nullptr, 0) : 1024;
+	std::wstring user = L"SYSTEM", pass;
+	if (argc >= 5) {
+		user = std::wstring(argv[3], argv[3] + strlen(argv[3]));
+		pass = std::wstring(argv[4], argv[4] + strlen(argv[4]));
+	}
+	if (max_recips == 0)
+		max_recips = 1;
+
+	AutoMAPI automapi;
+	auto hr = automapi.Initialize();
+	if (hr != hrSuccess) {
+		fprintf(stderr, "MAPIInitialize: %s\n", GetMAPIErrorMessage(hr));
+		return EXIT_FAILURE;
+	}
+
+	auto store = KSession(user.c_str(), pass.c_str()).open_default_store();
+	auto root = store.open_root(MAPI_MODIFY);
+	auto top = make_folder(root, "fanoutbench");
+	std::vector<object_ptr<IMAPIFolder>> folders;
+	std::vector<memory_ptr<SPropValue>> folder_eids;
+	for (unsigned int i = 0; i < max_recips; ++i) {
+		memory_ptr<SPropValue> eid;
+		folders.emplace_back(make_folder(top, ("r" + std::to_string(i)).c_str()));
+		check(HrGetOneProp(folders.back(), PR_ENTRYID, &~eid), "HrGetOneProp");
+		folder_eids.emplace_back(std::move(eid));
+	}
+	auto src = make_source(top, att_kb);
+	auto src_eid = src.get_prop(PR_ENTRYID);
+
+	printf("message with a %u KiB attachment\n", att_kb);
+	for (unsigned int n : {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000}) {
+		if (n > max_recips)
+			break;
+		auto start = std::chrono::steady_clock::now();
+		client_copies(src, folders, n);
+		auto t_client = elapsed_ms(start);
+		start = std::chrono::steady_clock::now();
+		server_copies(store, src_eid.entry_id(), folder_eids, n);
+		auto t_server = elapsed_ms(start);
+		printf("%5u recipients: client copy %6lld ms (%7.1f/s), server copy %6lld ms (%7.1f/s)\n",
+		       n, t_client, t_client == 0 ? 0.0 : n * 1000.0 / t_client,
+		       t_server, t_server == 0 ? 0.0 : n * 1000.0 / t_server);
+		for (unsigned int i = 0; i < n; ++i)
+			folders[i]->EmptyFolder(0, nullptr, 0);
+	}
+
+	memory_ptr<SPropValue> top_eid;
+	check(HrGetOneProp(top, PR_ENTRYID, &~top_eid), "HrGetOneProp");
+	folders.clear();
+	top.reset();
+	root->DeleteFolder(top_eid->Value.bin.cb, reinterpret_cast<const ENTRYID *>(top_eid->Value.bin.lpb),
+		0, nullptr, DEL_FOLDERS | DEL_MESSAGES);
+	return EXIT_SUCCESS;
+} catch (const KMAPIError &e) {
+	fprintf(stderr, "%s\n", e.what());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright 2016, Kopano and its licensors */
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <kopano/platform.h>
+#include "ECFifoBuffer.h"
+/*
+ * This program pushes data from one producer thread to one consumer thread
+ * and compares ECFifoBuffer's ring against the former std::deque plus
+ * mutex implementation (reimplemented below as "legacy"), for a range of
+ * chunk sizes. The "span" variant moves data through
+ * GetWriteSpan/GetReadSpan without an intermediate buffer.
+ *
+ * Usage: fifobench [total_MB]
+ */
+
+using namespace KC;
+
+namespace legacy {
+
+class fifo {
+	public:
+	typedef std::deque<unsigned char>::size_type size_type;
+
+	fifo(size_type z = 131072) : m_max(z) {}
+
+	ECRESULT Write(const void *buf, size_type z)
+	{
+		auto data = static_cast<const unsigned char *>(buf);
+		size_type done = 0;
+		std::unique_lock<std::mutex> lk(m_mtx);
+		while (done < z) {
+			while (m_storage.size() == m_max) {
+				if (m_rclosed)
+					return KCERR_NETWORK_ERROR;
+				m_notfull.wait(lk);
+			}
+			auto now = std::min(z - done, m_max - m_storage.size());
+			m_storage.insert(m_storage.end(), data + done, data + done + now);
+			m_notempty.notify_one();
+			done += now;
+		}
+		return erSuccess;
+	}
+
+	ECRESULT Read(void *buf, size_type z, size_type *rd)
+	{
+		auto data = static_cast<unsigned char *>(buf);
+		size_type done = 0;
+		std::unique_lock<std::mutex> lk(m_mtx);
+		while (done < z) {
+			while (m_storage.empty()) {
+				if (m_wclosed)
+					goto exit;
+				m_notempty.wait(lk);
+			}
+			auto now = std::min(z - done, m_storage.size());
+			auto end = m_storage.begin() + now;
+			std::copy(m_storage.begin(), end, data + done);
+			m_storage.erase(m_storage.begin(), end);
+			m_notfull.notify_one();
+			done += now;
+		}
+ exit:
+		*rd = done;
+		return erSuccess;
+	}
+
+	void CloseWrite()
+	{
+		std::lock_guard<std::mutex> lk(m_mtx);
+		m_wclosed = true;
+		m_notempty.notify_one();
+	}
+
+	private:
+	std::deque<unsigned char> m_storage;
+	size_type m_max;
+	bool m_rclosed = false, m_wclosed = false;
+	std::mutex m_mtx;
+	std::condition_variable m_notempty, m_notfull;
+};
+
+} /* namespace legacy */
+
+static size_t elapsed_us(const std::chrono::steady_clock::time_point &start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char *name, size_t chunk, size_t total, size_t us)
+{
+	printf("%-8s chunk %6zu: %8zu us (%7.1f MB/s)\n", name, chunk, us,
+	       us == 0 ? 0.0 : static_cast<double>(total) / us);
+}
+
+static bool bench_legacy(size_t chunk, size_t total)
+{
+	legacy::fifo f;
+	size_t got = 0;
+	std::unique_ptr<unsigned char[]> in(new unsigned char[chunk]), out(new unsigned char[chunk]);
+	memset(in.get(), 'x', chunk);
+	auto start = std::chrono::steady_clock::now();
+	std::thread consumer([&]() {
+		size_t rd;
+		do {
+			f.Read(out.get(), chunk, &rd);
+			got += rd;
+		} while (rd == chunk);
+	});
+	for (size_t left = total; left > 0; ) {
+		auto z = std::min(left, chunk);
+		f.Write(in.get(), z);
+		left -= z;
+	}
+	f.CloseWrite();
+	consumer.join();
+	report("legacy", chunk, total, elapsed_us(start));
+	return got == total;
+}
+
+static bool bench_ring(size_t chunk, size_t total)
+{
+	ECFifoBuffer f;
+	size_t got = 0;
+	std::unique_ptr<unsigned char[]> in(new unsigned char[chunk]), out(new unsigned char[chunk]);
+	memset(in.get(), 'x', chunk);
+	auto start = std::chrono::steady_clock::now();
+	std::thread consumer([&]() {
+		ECFifoBuffer::size_type rd;
+		do {
+			if (f.Read(out.get(), chunk, 0, &rd) != erSuccess)
+				return;
+			got += rd;
+		} while (rd == chunk);
+	});
+	for (size_t left = total; left > 0; ) {
+		auto z = std::min(left, chunk);
+		if (f.Write(in.get(), z, 0, nullptr) != erSuccess)
+			break;
+		left -= z;
+	}
+	f.Close(ECFifoBuffer::cfWrite);
+	consumer.join();
+	report("ring", chunk, total, elapsed_us(start));
+	return got == total;
+}
+
+static bool bench_span(size_t chunk, size_t total)
+{
+	ECFifoBuffer f;
+	size_t got = 0;
+	auto start = std::chrono::steady_clock::now();
+	std::thread consumer([&]() {
+		while (true) {
+			const unsigned char *p;
+			ECFifoBuffer::size_type z;
+			if (f.GetReadSpan(&p, &z, 0, chunk) != erSuccess || z == 0)
+				return;
+			z = std::min(z, chunk);
+			got += z;
+			f.CommitRead(z);
+		}
+	});
+	for (size_t left = total; left > 0; ) {
+		unsigned char *p;
+		ECFifoBuffer::size_type z;
+		if (f.GetWriteSpan(&p, &z, 0, std::min(left, chunk)) != erSuccess)
+			break;
+		z = std::min({z, left, chunk});
+		memset(p, 'x', z);
+		f.CommitWrite(z);
+		left -= z;
+	}
+	f.Close(ECFifoBuffer::cfWrite);
+	consumer.join();
+	report("span", chunk, total, elapsed_us(start));
+	return got == total;
+}
+
+int main(int argc, char **argv)
+{
+	size_t total = (argc >= 2 ? strtoul(argv[1], nullptr, 0) : 256) << 20;
+	static const size_t chunks[] = {4, 64, 1024, 16384, 65536};
+	bool ok = true;
+
+	for (auto chunk : chunks) {
+		/* Small chunks are slow enough on the legacy path */
+		auto z = chunk < 1024 ? total / 16 : total;
+		ok &= bench_legacy(chunk, z);
+		ok &= bench_ring(chunk, z);
+		ok &= bench_span(chunk, z);
+	}
+	if (!ok)
+		fprintf(stderr, "byte counts did not match\n");
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -24,6 +24,7 @@
 #include <kopano/CommonUtil.h>
 #include <kopano/automapi.hpp>
 #include <kopano/codepage.h>
+#include <kopano/fileutil.hpp>
 #include <kopano/hl.hpp>
 #include <inetmapi/options.h>
 #include "tbi.hpp"
@@ -113,12 +114,21 @@ static int slurp_file(const char *file, std::string &msg)
  * @analyze:	a function to analyze the MAPI message resulting from
  * 		VMIMEToMAPI conversion
  */
-static int dofile(const char *file, t_base *cls)
+static int dofile(const char *file, t_base *cls, bool from_file)
 {
 	std::string rfcmsg;
-	auto ret = slurp_file(file, rfcmsg);
-	if (ret <= 0)
-		return TEST_FAIL;
+	std::unique_ptr<FILE, file_deleter> fp;
+	if (!from_file) {
+		auto ret = slurp_file(file, rfcmsg);
+		if (ret <= 0)
+			return TEST_FAIL;
+	} else {
+		fp.reset(fopen(file, "rb"));
+		if (fp == nullptr) {
+			fprintf(stderr, "Failed to open %s: %s\n", file, strerror(errno));
+			return TEST_FAIL;
+		}
+	}
 
 	struct ictx ictx;
 	HRESULT hr = hrSuccess;
@@ -131,7 +141,10 @@ static int dofile(const char *file, t_base *cls)
 	cls->setup();
 	ec_log_get()->SetLoglevel(EC_LOGLEVEL_DEBUG);
 	auto imsg = KSession().open_default_store().open_root(MAPI_MODIFY).create_message();
-	hr = IMToMAPI(NULL, NULL, NULL, imsg, rfcmsg, cls->m_dopt);
+	if (from_file)
+		hr = IMToMAPI(NULL, NULL, NULL, imsg, fp.get(), cls->m_dopt);
+	else
+		hr = IMToMAPI(NULL, NULL, NULL, imsg, rfcmsg, cls->m_dopt);
 	if (hr != hrSuccess) {
 		fprintf(stderr, "IMToMAPI: %s\n", GetMAPIErrorMessage(hr));
 		return TEST_FAIL;
@@ -153,7 +166,10 @@ static size_t chkfile(const std::string &fs, int (*analyze)(const struct ictx &)
 	auto file = fs.c_str();
 	t_base cls(analyze);
 	fprintf(stderr, "=== %s ===\n", file);
-	int ret = dofile(file, &cls);
+	/* Once from memory, once parsed in place from the file */
+	int ret = dofile(file, &cls, false);
+	if (ret == TEST_OK)
+		ret = dofile(file, &cls, true);
 	if (ret != TEST_OK) {
 		fprintf(stderr, "FAILED: %s\n\n", file);
 		return ret;
@@ -166,7 +182,9 @@ static size_t chkfile(const std::string &fs, t_base &&cls)
 {
 	auto file = fs.c_str();
 	fprintf(stderr, "=== %s ===\n", file);
-	int ret = dofile(file, &cls);
+	int ret = dofile(file, &cls, false);
+	if (ret == TEST_OK)
+		ret = dofile(file, &cls, true);
 	if (ret != TEST_OK) {
 		fprintf(stderr, "FAILED: %s\n\n", file);
 		return ret;
@@ -0,0 +1,242 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <arpa/inet.h>
+#include <kopano/platform.h>
+#include <kopano/ECKeyTable.h>
+/*
+ * This program replays the same random workload against both key table
+ * engines (the AVL ECKeyTable and ECBTreeKeyTable), checks that they
+ * return the same rows, and reports how long each one took.
+ *
+ * Usage: keytable [rows [seed]]
+ */
+
+using namespace KC;
+
+static std::mt19937 rng;
+
+static unsigned int rnd(unsigned int n)
+{
+	return std::uniform_int_distribution<unsigned int>(0, n - 1)(rng);
+}
+
+/* Columns: a small int (category-like), a string, a double, descending */
+static std::vector<ECSortCol> make_cols(unsigned int depth)
+{
+	std::vector<ECSortCol> cols(depth);
+	for (unsigned int i = 0; i < depth; ++i) {
+		auto &c = cols[i];
+		switch (i % 3) {
+		case 0: {
+			uint32_t v = htonl(rnd(8));
+			c.key.assign(reinterpret_cast<const char *>(&v), sizeof(v));
+			c.isnull = rnd(16) == 0;
+			break;
+		}
+		case 1:
+			for (unsigned int j = rnd(12); j > 0; --j)
+				c.key += static_cast<char>(rnd(4) == 0 ? 0 : 'a' + rnd(4));
+			c.flags = TABLEROW_FLAG_DESC;
+			break;
+		case 2: {
+			double d = static_cast<int>(rnd(200)) - 100.0;
+			c.key.assign(reinterpret_cast<const char *>(&d), sizeof(d));
+			c.flags = TABLEROW_FLAG_FLOAT;
+			break;
+		}
+		}
+	}
+	return cols;
+}
+
+static bool compare(const char *what, const ECObjectTableList &a,
+    const ECObjectTableList &b)
+{
+	if (a == b)
+		return true;
+	fprintf(stderr, "%s: engines disagree (%zu vs %zu rows)\n", what, a.size(), b.size());
+	return false;
+}
+
+static bool check(ECKeyTableBase &x, ECKeyTableBase &y, unsigned int id_max)
+{
+	ECObjectTableList a, b;
+	unsigned int ca = 0, cb = 0, ra, rb;
+	int sa, sb;
+
+	x.GetRowCount(&ca, &ra);
+	y.GetRowCount(&cb, &rb);
+	if (ca != cb) {
+		fprintf(stderr, "row count %u vs %u\n", ca, cb);
+		return false;
+	}
+	x.SeekRow(ECKeyTableBase::EC_SEEK_SET, 0, nullptr);
+	y.SeekRow(ECKeyTableBase::EC_SEEK_SET, 0, nullptr);
+	x.QueryRows(ca + 1, &a, false, 0);
+	y.QueryRows(cb + 1, &b, false, 0);
+	if (!compare("full scan", a, b))
+		return false;
+
+	/* Position, bookmark and rank */
+	auto r = ca == 0 ? 0 : rnd(ca);
+	x.SeekRow(ECKeyTableBase::EC_SEEK_SET, r, &sa);
+	y.SeekRow(ECKeyTableBase::EC_SEEK_SET, r, &sb);
+	x.GetRowCount(&ca, &ra);
+	y.GetRowCount(&cb, &rb);
+	if (sa != sb || ra != rb) {
+		fprintf(stderr, "seek %u: %d/%u vs %d/%u\n", r, sa, ra, sb, rb);
+		return false;
+	}
+	unsigned int bka, bkb;
+	x.CreateBookmark(&bka);
+	y.CreateBookmark(&bkb);
+	x.SeekRow(ECKeyTableBase::EC_SEEK_END, -3, nullptr);
+	y.SeekRow(ECKeyTableBase::EC_SEEK_END, -3, nullptr);
+	a.clear();
+	b.clear();
+	x.SeekRow(bka, 1, &sa);
+	y.SeekRow(bkb, 1, &sb);
+	x.QueryRows(5, &a, false, 0);
+	y.QueryRows(5, &b, false, 0);
+	x.FreeBookmark(bka);
+	y.FreeBookmark(bkb);
+	if (sa != sb || !compare("bookmark", a, b))
+		return false;
+
+	/* Lookups by sort key */
+	auto cols = make_cols(1 + rnd(3));
+	sObjectTableKey ka, kb;
+	auto fa = x.Find(cols, &ka), fb = y.Find(cols, &kb);
+	if (fa != fb || (fa == erSuccess && ka != kb)) {
+		fprintf(stderr, "Find mismatch\n");
+		return false;
+	}
+	x.LowerBound(cols);
+	y.LowerBound(cols);
+	x.GetRowCount(&ca, &ra);
+	y.GetRowCount(&cb, &rb);
+	if (ra != rb) {
+		fprintf(stderr, "LowerBound %u vs %u\n", ra, rb);
+		return false;
+	}
+
+	/* Neighbours and prefixes */
+	sObjectTableKey id(rnd(id_max), 0);
+	fa = x.GetPreviousRow(&id, &ka);
+	fb = y.GetPreviousRow(&id, &kb);
+	if (fa != fb || (fa == erSuccess && ka != kb)) {
+		fprintf(stderr, "GetPreviousRow mismatch\n");
+		return false;
+	}
+	a.clear();
+	b.clear();
+	x.GetRowsBySortPrefix(&id, &a);
+	y.GetRowsBySortPrefix(&id, &b);
+	return compare("GetRowsBySortPrefix", a, b);
+}
+
+/* Collapse and expand a random row as if it were a category header */
+static bool categories(ECKeyTableBase &x, ECKeyTableBase &y, unsigned int id_max)
+{
+	ECObjectTableList a, b;
+	sObjectTableKey id(rnd(id_max), 0);
+	ECRESULT ea, eb;
+
+	if (rnd(2) == 0) {
+		ea = x.HideRows(&id, &a);
+		eb = y.HideRows(&id, &b);
+	} else {
+		ea = x.UnhideRows(&id, &a);
+		eb = y.UnhideRows(&id, &b);
+	}
+	if (ea != eb) {
+		fprintf(stderr, "hide/unhide: %x vs %x\n", ea, eb);
+		return false;
+	}
+	return compare("hide/unhide", a, b);
+}
+
+static bool run(unsigned int nrows)
+{
+	ECKeyTable avl;
+	ECBTreeKeyTable btree;
+	ECKeyTableBase *engines[] = {&avl, &btree};
+	/* Consistency checks scan the whole table; keep that phase small */
+	auto id_max = std::min(nrows, 5000U) * 2;
+
+	for (unsigned int step = 0; step < id_max * 2; ++step) {
+		sObjectTableKey id(rnd(id_max), 0), pa, pb;
+		auto op = rnd(10);
+		auto cols = make_cols(1 + rnd(3));
+		ECKeyTable::UpdateType aa = ECKeyTable::TABLE_CHANGE, ab = aa;
+		ECRESULT ea, eb;
+
+		if (op < 6) {
+			auto copy = cols;
+			ea = avl.UpdateRow(ECKeyTable::TABLE_ROW_MODIFY, &id, std::move(copy), &pa, false, &aa);
+			eb = btree.UpdateRow(ECKeyTable::TABLE_ROW_MODIFY, &id, std::move(cols), &pb, false, &ab);
+		} else if (op < 8) {
+			ea = avl.UpdateRow(ECKeyTable::TABLE_ROW_DELETE, &id, {}, nullptr, false, &aa);
+			eb = btree.UpdateRow(ECKeyTable::TABLE_ROW_DELETE, &id, {}, nullptr, false, &ab);
+			pa = pb;
+		} else if (op < 9) {
+			bool ha = false, hb = false;
+			ea = avl.UpdatePartialSortKey(&id, 0, cols[0], &pa, &ha, &aa);
+			eb = btree.UpdatePartialSortKey(&id, 0, cols[0], &pb, &hb, &ab);
+			if (ha != hb)
+				ea = ~eb;
+		} else {
+			if (!categories(avl, btree, id_max))
+				return false;
+			continue;
+		}
+		if (ea != eb || aa != ab || (ea == erSuccess && pa != pb)) {
+			fprintf(stderr, "step %u op %u: %x/%d vs %x/%d\n", step, op, ea, aa, eb, ab);
+			return false;
+		}
+		if (step % 97 == 0 && !check(avl, btree, id_max))
+			return false;
+	}
+	if (!check(avl, btree, id_max))
+		return false;
+
+	/* Timing: bulk load, then page through the table */
+	for (auto t : engines) {
+		t->Clear();
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned int i = 0; i < nrows; ++i) {
+			sObjectTableKey id(i, 0);
+			t->UpdateRow(ECKeyTable::TABLE_ROW_ADD, &id, make_cols(3), nullptr);
+		}
+		auto load = std::chrono::steady_clock::now() - start;
+		start = std::chrono::steady_clock::now();
+		for (unsigned int i = 0; i < 1000; ++i) {
+			ECObjectTableList l;
+			t->SeekRow(ECKeyTable::EC_SEEK_SET, rnd(nrows), nullptr);
+			t->QueryRows(50, &l, false, 0);
+		}
+		auto query = std::chrono::steady_clock::now() - start;
+		printf("%-6s %u rows: load %lld ms, 1000 seek+query50 %lld us, %zu bytes\n",
+		       t == &avl ? "avl" : "btree", nrows,
+		       static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(load).count()),
+		       static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(query).count()),
+		       t->GetObjectSize());
+	}
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nrows = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 20000;
+	rng.seed(argc >= 3 ? strtoul(argv[2], nullptr, 0) : 1);
+	return run(nrows) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <kopano/platform.h>
+#include "LDAPCache.h"
+#include "check.hpp"
+/*
+ * This program checks the lookup cache used by the LDAP user plugin:
+ * kept and expired results, remembered not-found results, errors that are
+ * not kept, and the sharing of in-flight lookups between threads. It then
+ * replays a login storm (many threads resolving a few hundred names, each
+ * LDAP round trip simulated by a sleep) with and without the cache.
+ *
+ * Usage: ldapcache [threads [lookups_per_thread]]
+ */
+
+using namespace KC;
+using cache_t = LDAPLookupCache<int, std::out_of_range>;
+
+static bool basics()
+{
+	cache_t c;
+	cache_t::outcome how;
+	int calls = 0;
+	auto found = [&]() { ++calls; return 42; };
+	auto missing = [&]() -> int { ++calls; throw std::out_of_range("no such name"); };
+	auto broken = [&]() -> int { ++calls; throw std::runtime_error("server down"); };
+
+	c.configure(1, 1, 100);
+	CHECK(c.get("a", found, &how) == 42 && how == cache_t::LC_MISS);
+	CHECK(c.get("a", found, &how) == 42 && how == cache_t::LC_HIT);
+	CHECK(calls == 1);
+
+	for (auto expect : {cache_t::LC_MISS, cache_t::LC_NEGATIVE_HIT}) {
+		try {
+			c.get("b", missing, &how);
+			CHECK(false);
+		} catch (const std::out_of_range &) {
+			CHECK(how == expect);
+		}
+	}
+	CHECK(calls == 2);
+
+	for (int i = 0; i < 2; ++i) {
+		try {
+			c.get("c", broken, &how);
+			CHECK(false);
+		} catch (const std::runtime_error &) {
+			CHECK(how == cache_t::LC_MISS);
+		}
+	}
+	CHECK(calls == 4);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+	CHECK(c.get("a", found, &how) == 42 && how == cache_t::LC_MISS);
+	CHECK(calls == 5);
+
+	/* Size limit */
+	c.configure(60, 60, 10);
+	for (int i = 0; i < 100; ++i)
+		c.get(std::to_string(i), found, &how);
+	CHECK(c.size() <= 10);
+
+	/* Nothing kept, but still usable */
+	c.configure(0, 0, 10);
+	c.clear();
+	c.get("a", found, &how);
+	CHECK(c.get("a", found, &how) == 42 && how == cache_t::LC_MISS);
+	CHECK(c.size() == 0);
+	return true;
+}
+
+static bool sharing()
+{
+	cache_t c;
+	std::atomic<int> calls{0}, shared{0};
+	std::vector<std::thread> thr;
+
+	c.configure(0, 0, 100);
+	for (int i = 0; i < 16; ++i)
+		thr.emplace_back([&]() {
+			cache_t::outcome how;
+			c.get("x", [&]() {
+				++calls;
+				std::this_thread::sleep_for(std::chrono::milliseconds(200));
+				return 1;
+			}, &how);
+			if (how == cache_t::LC_SHARED)
+				++shared;
+		});
+	for (auto &t : thr)
+		t.join();
+	CHECK(calls + shared == 16);
+	CHECK(calls < 16);
+	return true;
+}
+
+static void storm(unsigned int nthr, unsigned int nlookups, unsigned int ttl)
+{
+	cache_t c;
+	std::atomic<unsigned int> calls{0};
+	std::vector<std::thread> thr;
+
+	c.configure(ttl, ttl, 10000);
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < nthr; ++i)
+		thr.emplace_back([&, i]() {
+			cache_t::outcome how;
+			for (unsigned int j = 0; j < nlookups; ++j) {
+				auto key = "user" + std::to_string((i * 7 + j * 13) % 300);
+				try {
+					c.get(key, [&]() {
+						++calls;
+						std::this_thread::sleep_for(std::chrono::milliseconds(2));
+						if (key.back() == '7')
+							throw std::out_of_range(key);
+						return 1;
+					}, &how);
+				} catch (const std::out_of_range &) {
+				}
+			}
+		});
+	for (auto &t : thr)
+		t.join();
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	printf("ttl %3u: %u threads x %u lookups: %6u LDAP queries, %6lld ms\n",
+	       ttl, nthr, nlookups, calls.load(), static_cast<long long>(ms));
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nthr = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 32;
+	unsigned int nlookups = argc >= 3 ? strtoul(argv[2], nullptr, 0) : 200;
+
+	if (!basics() || !sharing())
+		return EXIT_FAILURE;
+	storm(nthr, nlookups, 0);
+	storm(nthr, nlookups, 60);
+	return EXIT_SUCCESS;
+}
@@ -1,35 +1,118 @@
 /* SPDX-License-Identifier: LGPL-3.0-or-later */
 /* Copyright 2016, Kopano and its licensors */
 #include <chrono>
+#include <mutex>
+#include <new>
+#include <string>
 #include <utility>
+#include <vector>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
-#include <ctime>
+#include <cstring>
 #include <mapix.h>
+#include <mapiutil.h>
+#include <kopano/Util.h>
 /*
- * This program simulates MAPIAllocateMore allocations to measure allocation
- * time. Some preparatory work is needed:
+ * This program measures MAPIAllocateBuffer/MAPIAllocateMore chains, and
+ * compares libmapi's slab allocator against the former scheme of one
+ * malloc (plus a lock round-trip) per MAPIAllocateMore (reimplemented
+ * below as "legacy").
  *
- * == Grab an allocation historgram ==
- * 1. Stick the following line into the MAPIFreeBuffer function:
- * 	fprintf(stderr, "!! %d\n", head->children.size());
- *    This tell us the size of each allocation list at the end of its lifetime.
+ * Workload 1 replays the number of MAPIAllocateMore calls per chain as
+ * observed in a testsuite run. To refresh the histogram:
  *
- * 2. Build KC and run the testsuite, then collect the "!!" lines from stderr
+ * 1. Count the MAPIAllocateMore calls per root buffer in MAPIFreeBuffer
+ *    and print them to stderr.
+ *
+ * 2. Build KC and run the testsuite, then collect those lines from stderr
  *    into a file.
  *
- * 3. Make a histogram {bangbangvalue, #occurrences} of the data, and rewrite
+ * 3. Make a histogram {value, #occurrences} of the data, and rewrite
  *    dist[] accordingly.
  *
- * == Run ==
- * 4. This program then runs as many allocations as they occurred in the TS,
- *    and prints the walltime.
- *
- * 5. Now go, hack on MAPIAllocateMore, and bring down that walltime.
- *
- * The allocation sizes do not matter, so that is fixed.
+ * Workload 2 copies a row of properties the way Util::HrCopyPropertyArray
+ * does (one root for the SPropValue array, one child per string or binary
+ * value), once with the legacy allocator and once through the real
+ * Util::HrCopyPropertyArray.
  */
 
+namespace legacy {
+
+struct alignas(::max_align_t) ext_head {
+	struct ext_head *child;
+	alignas(::max_align_t) char data[];
+};
+
+struct alignas(::max_align_t) buf_head {
+	std::mutex mtx;
+	struct ext_head *child;
+	alignas(::max_align_t) char data[];
+};
+
+static void *allocate_buffer(size_t z)
+{
+	auto h = static_cast<buf_head *>(malloc(sizeof(buf_head) + z));
+	new(h) buf_head;
+	h->child = nullptr;
+	return h->data;
+}
+
+static void *allocate_more(size_t z, void *base)
+{
+	auto h = reinterpret_cast<buf_head *>(static_cast<char *>(base) - offsetof(buf_head, data));
+	auto e = static_cast<ext_head *>(malloc(sizeof(ext_head) + z));
+	std::lock_guard<std::mutex> lock(h->mtx);
+	e->child = h->child;
+	h->child = e;
+	return e->data;
+}
+
+static void free_buffer(void *base)
+{
+	auto h = reinterpret_cast<buf_head *>(static_cast<char *>(base) - offsetof(buf_head, data));
+	for (auto p = h->child; p != nullptr; ) {
+		auto q = p->child;
+		free(p);
+		p = q;
+	}
+	h->~buf_head();
+	free(h);
+}
+
+} /* namespace legacy */
+
+static void *kc_allocate_buffer(size_t z)
+{
+	void *p = nullptr;
+	MAPIAllocateBuffer(z, &p);
+	return p;
+}
+
+static void *kc_allocate_more(size_t z, void *base)
+{
+	void *p = nullptr;
+	MAPIAllocateMore(z, base, &p);
+	return p;
+}
+
+static void kc_free_buffer(void *base)
+{
+	MAPIFreeBuffer(base);
+}
+
+struct allocator {
+	const char *name;
+	void *(*buffer)(size_t);
+	void *(*more)(size_t, void *);
+	void (*free)(void *);
+};
+
+static const allocator allocators[] = {
+	{"legacy", legacy::allocate_buffer, legacy::allocate_more, legacy::free_buffer},
+	{"libmapi", kc_allocate_buffer, kc_allocate_more, kc_free_buffer},
+};
+
 /* MAPIAllocateBuffer size distribution */
 static constexpr std::pair<unsigned int, unsigned int> dist[] = {
 	{0, 590147}, {1, 458653}, {2, 22764}, {3, 13161}, {4, 15343},
@@ -53,37 +136,107 @@ static constexpr std::pair<unsigned int, unsigned int> dist[] = {
 };
 static constexpr size_t alloc_size = 32;
 
-int main(void)
+static size_t elapsed_ns(const std::chrono::steady_clock::time_point &start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void run_histogram(const allocator &a)
 {
-	struct timespec gstart, gstop, start, stop;
-	void *ibuf, *jbuf;
 	size_t cnt_alloc = 0, cnt_more = 0;
-	clock_gettime(CLOCK_MONOTONIC, &gstart);
+	auto start = std::chrono::steady_clock::now();
 
 	for (const auto &p : dist) {
-		decltype(p.first) nchildren = p.first;
-		decltype(p.second) noccr = p.second;
-
-		cnt_alloc += noccr;
-		cnt_more += noccr * nchildren;
-		clock_gettime(CLOCK_MONOTONIC, &start);
-		for (decltype(noccr) i = 0; i < noccr; ++i) {
-			MAPIAllocateBuffer(alloc_size, &ibuf);
-			for (decltype(nchildren) j = 0; j < nchildren; ++j)
-				MAPIAllocateMore(alloc_size, ibuf, &jbuf);
-			MAPIFreeBuffer(ibuf);
+		cnt_alloc += p.second;
+		cnt_more += p.second * p.first;
+		for (unsigned int i = 0; i < p.second; ++i) {
+			auto base = a.buffer(alloc_size);
+			for (unsigned int j = 0; j < p.first; ++j)
+				a.more(alloc_size, base);
+			a.free(base);
 		}
-		clock_gettime(CLOCK_MONOTONIC, &stop);
-		auto delta = std::chrono::seconds(stop.tv_sec) + std::chrono::nanoseconds(stop.tv_nsec) -
-		             (std::chrono::seconds(start.tv_sec) + std::chrono::nanoseconds(start.tv_nsec));
-		printf("O-%u× C-%u: %zu ns\n", noccr, nchildren, static_cast<size_t>(delta.count()));
 	}
-	clock_gettime(CLOCK_MONOTONIC, &gstop);
-	auto delta = std::chrono::seconds(gstop.tv_sec) + std::chrono::nanoseconds(gstop.tv_nsec) -
-	             (std::chrono::seconds(gstart.tv_sec) + std::chrono::nanoseconds(gstart.tv_nsec));
-	printf("all %zu ns\n", static_cast<size_t>(delta.count()));
+	printf("%-8s histogram: %zu ns (%zu buffers, %zu children)\n",
+	       a.name, elapsed_ns(start), cnt_alloc, cnt_more);
+}
+
+/* Synthetic message row: a mix of integer, string and binary properties */
+static std::vector<SPropValue> make_row(std::vector<std::string> &strs)
+{
+	std::vector<SPropValue> row;
+	/* The props point into the strings, which must not move */
+	strs.reserve(strs.size() + 40);
+	for (unsigned int i = 0; i < 40; ++i) {
+		SPropValue v;
+		switch (i % 4) {
+		case 0:
+			v.ulPropTag = PROP_TAG(PT_LONG, 0x6000 + i);
+			v.Value.ul = i;
+			break;
+		case 1:
+		case 2:
+			strs.emplace_back(std::string(8 + i * 3, 'a' + i % 26));
+			v.ulPropTag = PROP_TAG(PT_STRING8, 0x6000 + i);
+			v.Value.lpszA = const_cast<char *>(strs.back().c_str());
+			break;
+		default:
+			strs.emplace_back(std::string(16 + i, 'b'));
+			v.ulPropTag = PROP_TAG(PT_BINARY, 0x6000 + i);
+			v.Value.bin.cb = strs.back().size();
+			v.Value.bin.lpb = reinterpret_cast<BYTE *>(const_cast<char *>(strs.back().data()));
+			break;
+		}
+		row.emplace_back(v);
+	}
+	return row;
+}
 
-	printf("MAPIAllocateBuffer calls: %zu\n", cnt_alloc);
-	printf("MAPIAllocateMore calls: %zu\n", cnt_more);
+static void copy_row(const allocator &a, const std::vector<SPropValue> &row)
+{
+	auto dst = static_cast<SPropValue *>(a.buffer(sizeof(SPropValue) * row.size()));
+	for (size_t i = 0; i < row.size(); ++i) {
+		dst[i] = row[i];
+		switch (PROP_TYPE(row[i].ulPropTag)) {
+		case PT_STRING8: {
+			auto z = strlen(row[i].Value.lpszA) + 1;
+			dst[i].Value.lpszA = static_cast<char *>(a.more(z, dst));
+			memcpy(dst[i].Value.lpszA, row[i].Value.lpszA, z);
+			break;
+		}
+		case PT_BINARY:
+			dst[i].Value.bin.lpb = static_cast<BYTE *>(a.more(row[i].Value.bin.cb, dst));
+			memcpy(dst[i].Value.bin.lpb, row[i].Value.bin.lpb, row[i].Value.bin.cb);
+			break;
+		}
+	}
+	a.free(dst);
+}
+
+int main(void)
+{
+	static constexpr unsigned int nrows = 200000;
+	std::vector<std::string> strs;
+	auto row = make_row(strs);
+
+	for (const auto &a : allocators)
+		run_histogram(a);
+	for (const auto &a : allocators) {
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned int i = 0; i < nrows; ++i)
+			copy_row(a, row);
+		printf("%-8s propcopy:  %zu ns (%u rows)\n", a.name, elapsed_ns(start), nrows);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < nrows; ++i) {
+		SPropValue *dst = nullptr;
+		ULONG n = 0;
+		if (KC::Util::HrCopyPropertyArray(row.data(), row.size(), &dst, &n) != hrSuccess) {
+			fprintf(stderr, "HrCopyPropertyArray failed\n");
+			return EXIT_FAILURE;
+		}
+		MAPIFreeBuffer(dst);
+	}
+	printf("%-8s HrCopyPropertyArray: %zu ns (%u rows)\n", "libmapi", elapsed_ns(start), nrows);
 	return EXIT_SUCCESS;
 }
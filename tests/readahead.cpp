@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <kopano/platform.h>
+#include <kopano/automapi.hpp>
+#include <kopano/MAPIErrors.h>
+#include <kopano/memory.hpp>
+#include <mapitags.h>
+#include <mapiutil.h>
+#include "check.hpp"
+#include "tbi.hpp"
+/*
+ * This program checks the rows read ahead by the contents table of the
+ * client: paging through a folder gives the same rows with and without
+ * read-ahead, and the cursor is where the caller left it for QueryPosition,
+ * TBL_NOADVANCE, SeekRow and rows added or deleted meanwhile. It then times
+ * paging through the folder in batches of a few sizes, once with a round
+ * trip for every QueryRows (KC_TABLE_READAHEAD=0) and once with read-ahead.
+ * The round trips per table are logged at debug level when it is released.
+ *
+ * The rows are messages in a scratch folder of the store of the logged on
+ * user, which is removed afterwards. It needs a running server;
+ * KOPANO_SOCKET selects the server.
+ *
+ * Usage: readahead [messages [user password]]
+ */
+
+using namespace KC;
+
+static void check(HRESULT hr, const char *what)
+{
+	if (FAILED(hr)) {
+		fprintf(stderr, "%s: %s (%x)\n", what, GetMAPIErrorMessage(hr), hr);
+		throw KMAPIError(hr);
+	}
+}
+
+static std::string subject(unsigned int i)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "message %06u", i);
+	return buf;
+}
+
+static std::vector<std::string> eids;
+
+static void add_message(IMAPIFolder *folder, unsigned int i)
+{
+	object_ptr<IMessage> msg;
+	auto s = subject(i);
+	check(folder->CreateMessage(&IID_IMessage, 0, &~msg), "CreateMessage");
+	SPropValue p[2];
+	p[0].ulPropTag = PR_SUBJECT_A;
+	p[0].Value.lpszA = const_cast<char *>(s.c_str());
+	p[1].ulPropTag = PR_MESSAGE_CLASS_A;
+	p[1].Value.lpszA = const_cast<char *>("IPM.Note");
+	check(msg->SetProps(2, p, nullptr), "SetProps");
+	check(msg->SaveChanges(KEEP_OPEN_READONLY), "SaveChanges");
+	memory_ptr<SPropValue> eid;
+	check(HrGetOneProp(msg, PR_ENTRYID, &~eid), "HrGetOneProp");
+	eids.emplace_back(reinterpret_cast<const char *>(eid->Value.bin.lpb), eid->Value.bin.cb);
+}
+
+static void delete_message(IMAPIFolder *folder, unsigned int i)
+{
+	SBinary bin = {static_cast<ULONG>(eids[i].size()), reinterpret_cast<BYTE *>(&eids[i][0])};
+	ENTRYLIST list = {1, &bin};
+	check(folder->DeleteMessages(&list, 0, nullptr, 0), "DeleteMessages");
+}
+
+static KTable open_table(IMAPIFolder *folder, bool readahead)
+{
+	/* Read when the table is made */
+	if (readahead)
+		unsetenv("KC_TABLE_READAHEAD");
+	else
+		setenv("KC_TABLE_READAHEAD", "0", 1);
+	object_ptr<IMAPITable> table;
+	check(folder->GetContentsTable(0, &~table), "GetContentsTable");
+	static constexpr const SizedSSortOrderSet(1, order) = {1, 0, 0, {{PR_SUBJECT_A, TABLE_SORT_ASCEND}}};
+	check(table->SortTable(order, TBL_BATCH), "SortTable");
+	KTable t(std::move(table));
+	t.columns({PR_SUBJECT_A});
+	return t;
+}
+
+static std::vector<std::string> read_all(IMAPITable *table, unsigned int batch)
+{
+	std::vector<std::string> subjects;
+	while (true) {
+		rowset_ptr rows;
+		check(table->QueryRows(batch, 0, &~rows), "QueryRows");
+		if (rows.empty())
+			break;
+		for (unsigned int i = 0; i < rows.size(); ++i)
+			subjects.emplace_back(rows[i].lpProps[0].Value.lpszA);
+	}
+	return subjects;
+}
+
+static bool rows_are(IMAPITable *table, unsigned int count, unsigned int flags, unsigned int first)
+{
+	rowset_ptr rows;
+	check(table->QueryRows(count, flags, &~rows), "QueryRows");
+	CHECK(rows.size() == count);
+	for (unsigned int i = 0; i < count; ++i)
+		CHECK(subject(first + i) == rows[i].lpProps[0].Value.lpszA);
+	return true;
+}
+
+static bool cursor(IMAPIFolder *folder, unsigned int nmsg)
+{
+	auto table = open_table(folder, true);
+	ULONG row = 0, num = 0, denom = 0;
+	CHECK(rows_are(table, 10, 0, 0));
+	CHECK(rows_are(table, 10, 0, 10));
+	CHECK(rows_are(table, 10, 0, 20));
+	check(table->QueryPosition(&row, &num, &denom), "QueryPosition");
+	CHECK(row == 30);
+	CHECK(rows_are(table, 10, 0, 30));
+	CHECK(rows_are(table, 10, 0, 40));
+	CHECK(rows_are(table, 5, TBL_NOADVANCE, 50));
+	CHECK(rows_are(table, 10, 0, 50));
+	CHECK(rows_are(table, 10, 0, 60));
+	check(table->SeekRow(BOOKMARK_CURRENT, -5, nullptr), "SeekRow");
+	CHECK(rows_are(table, 10, 0, 65));
+	CHECK(rows_are(table, 10, 0, 75));
+
+	/* A row added while rows are read ahead is still seen */
+	add_message(folder, nmsg);
+	CHECK(rows_are(table, 10, 0, 85));
+	check(table->GetRowCount(0, &row), "GetRowCount");
+	CHECK(row == nmsg + 1);
+	CHECK(read_all(table, 10).size() == nmsg + 1 - 95);
+	return true;
+}
+
+/* Rows deleted among those read ahead do not move the cursor */
+static bool deleted(IMAPIFolder *folder)
+{
+	auto table = open_table(folder, true);
+	ULONG count = 0;
+	CHECK(rows_are(table, 10, 0, 0));
+	CHECK(rows_are(table, 10, 0, 10));
+	delete_message(folder, 20);
+	delete_message(folder, 21);
+	delete_message(folder, 35);
+	check(table->GetRowCount(0, &count), "GetRowCount");
+	CHECK(rows_are(table, 10, 0, 22));
+	CHECK(rows_are(table, 3, 0, 32));
+	CHECK(rows_are(table, 10, 0, 36));
+	return true;
+}
+
+int main(int argc, char **argv) try
+{
+	unsigned int nmsg = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 5000;
+	std::wstring user = L"SYSTEM", pass;
+	if (argc >= 4) {
+		user = std::wstring(argv[2], argv[2] + strlen(argv[2]));
+		pass = std::wstring(argv[3], argv[3] + strlen(argv[3]));
+	}
+	if (nmsg < 100)
+		nmsg = 100;
+
+	AutoMAPI automapi;
+	auto hr = automapi.Initialize();
+	if (hr != hrSuccess) {
+		fprintf(stderr, "MAPIInitialize: %s\n", GetMAPIErrorMessage(hr));
+		return EXIT_FAILURE;
+	}
+
+	auto store = KSession(user.c_str(), pass.c_str()).open_default_store();
+	auto root = store.open_root(MAPI_MODIFY);
+	object_ptr<IMAPIFolder> folder;
+	check(root->CreateFolder(FOLDER_GENERIC, reinterpret_cast<const TCHAR *>("readahead"),
+	      nullptr, &IID_IMAPIFolder, OPEN_IF_EXISTS, &~folder), "CreateFolder");
+	check(folder->EmptyFolder(0, nullptr, 0), "EmptyFolder");
+	for (unsigned int i = 0; i < nmsg; ++i)
+		add_message(folder, i);
+
+	bool ok = true;
+	for (unsigned int batch : {1, 10, 50, 200}) {
+		auto start = std::chrono::steady_clock::now();
+		auto plain = read_all(open_table(folder, false), batch);
+		long long t_plain = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+		start = std::chrono::steady_clock::now();
+		auto ahead = read_all(open_table(folder, true), batch);
+		long long t_ahead = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+		if (plain.size() != nmsg || plain != ahead) {
+			fprintf(stderr, "batches of %u: %zu rows read, %zu with read-ahead, %u expected\n",
+			        batch, plain.size(), ahead.size(), nmsg);
+			ok = false;
+			break;
+		}
+		printf("%u rows in batches of %3u: round trip per QueryRows %6lld ms, read-ahead %6lld ms\n",
+		       nmsg, batch, t_plain, t_ahead);
+	}
+	ok = ok && cursor(folder, nmsg) && deleted(folder);
+
+	memory_ptr<SPropValue> eid;
+	check(HrGetOneProp(folder, PR_ENTRYID, &~eid), "HrGetOneProp");
+	folder.reset();
+	root->DeleteFolder(eid->Value.bin.cb, reinterpret_cast<const ENTRYID *>(eid->Value.bin.lpb),
+		0, nullptr, DEL_FOLDERS | DEL_MESSAGES);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+} catch (const KMAPIError &e) {
+	fprintf(stderr, "%s\n", e.what());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,264 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <kopano/platform.h>
+#include <mapidefs.h>
+#include <mapitags.h>
+#include "soapH.h"
+#include "ECGenericObjectTable.h"
+#include "ECCompiledRestriction.h"
+/*
+ * This program builds a synthetic folder of message rows and runs a set
+ * of restrictions over it, once through the MatchRowRestrict interpreter
+ * and once through ECCompiledRestriction. It checks that both agree on
+ * every row and reports how long each took.
+ *
+ * Usage: restrictbench [rows [seed]]
+ */
+
+using namespace KC;
+
+static const unsigned int cols[] = {
+	PR_MESSAGE_FLAGS, PR_MESSAGE_SIZE, PR_IMPORTANCE, PR_SUBJECT_W,
+	PR_SENDER_NAME_W, PR_DISPLAY_TO_W,
+};
+
+static const char *const subjects[] = {
+	"Quarterly report", "RE: Quarterly report", "Lunch on friday?",
+	"FW: Build failures", "Grüße aus München", "Meeting notes",
+	"RE: RE: Budget 2017", "Your invoice", "ÜBERSICHT Projekte",
+	"Weekly status report", "Reminder: timesheets", "Ελληνικά θέματα",
+};
+
+static const char *const names[] = {
+	"Alice Example", "Bob Example", "Carol Sample", "Dave Müller",
+	"Eve Ölmann", "alice example", "Mallory", "Trent Tester",
+};
+
+static std::mt19937 rng;
+static std::vector<std::shared_ptr<void>> arena;
+
+template<typename T> static T *make()
+{
+	auto p = std::make_shared<T>();
+	memset(p.get(), 0, sizeof(T));
+	arena.emplace_back(p);
+	return p.get();
+}
+
+static struct propVal *long_val(unsigned int tag, unsigned int v)
+{
+	auto p = make<propVal>();
+	p->ulPropTag = tag;
+	p->__union = SOAP_UNION_propValData_ul;
+	p->Value.ul = v;
+	return p;
+}
+
+static struct propVal *str_val(unsigned int tag, const char *s)
+{
+	auto p = make<propVal>();
+	p->ulPropTag = tag;
+	p->__union = SOAP_UNION_propValData_lpszA;
+	p->Value.lpszA = const_cast<char *>(s);
+	return p;
+}
+
+static struct restrictTable *r_prop(unsigned int relop, struct propVal *v)
+{
+	auto r = make<restrictTable>();
+	r->ulType = RES_PROPERTY;
+	r->lpProp = make<restrictProp>();
+	r->lpProp->ulType = relop;
+	r->lpProp->ulPropTag = v->ulPropTag;
+	r->lpProp->lpProp = v;
+	return r;
+}
+
+static struct restrictTable *r_content(unsigned int fuzzy, unsigned int tag, const char *s)
+{
+	auto r = make<restrictTable>();
+	r->ulType = RES_CONTENT;
+	r->lpContent = make<restrictContent>();
+	r->lpContent->ulFuzzyLevel = fuzzy;
+	r->lpContent->ulPropTag = tag;
+	r->lpContent->lpProp = str_val(tag, s);
+	return r;
+}
+
+static struct restrictTable *r_bitmask(unsigned int type, unsigned int tag, unsigned int mask)
+{
+	auto r = make<restrictTable>();
+	r->ulType = RES_BITMASK;
+	r->lpBitmask = make<restrictBitmask>();
+	r->lpBitmask->ulType = type;
+	r->lpBitmask->ulPropTag = tag;
+	r->lpBitmask->ulMask = mask;
+	return r;
+}
+
+static struct restrictTable *r_exist(unsigned int tag)
+{
+	auto r = make<restrictTable>();
+	r->ulType = RES_EXIST;
+	r->lpExist = make<restrictExist>();
+	r->lpExist->ulPropTag = tag;
+	return r;
+}
+
+static struct restrictTable *r_not(struct restrictTable *c)
+{
+	auto r = make<restrictTable>();
+	r->ulType = RES_NOT;
+	r->lpNot = make<restrictNot>();
+	r->lpNot->lpNot = c;
+	return r;
+}
+
+static struct restrictTable *r_list(unsigned int type,
+    std::initializer_list<struct restrictTable *> l)
+{
+	auto r = make<restrictTable>();
+	auto a = make<restrictAnd>();
+	auto v = std::make_shared<std::vector<restrictTable *>>(l);
+	arena.emplace_back(v);
+	a->__size = v->size();
+	a->__ptr = v->data();
+	r->ulType = type;
+	if (type == RES_AND)
+		r->lpAnd = a;
+	else
+		r->lpOr = reinterpret_cast<restrictOr *>(a);
+	return r;
+}
+
+/* Rows point into the string tables above; some columns are missing. */
+static void make_rows(unsigned int nrows, std::vector<propVal> &vals,
+    std::vector<propValArray> &rows)
+{
+	auto ncols = ARRAY_SIZE(cols);
+	vals.resize(nrows * ncols);
+	rows.resize(nrows);
+	for (unsigned int i = 0; i < nrows; ++i) {
+		auto row = &vals[i * ncols];
+		rows[i].__ptr = row;
+		rows[i].__size = ncols;
+		for (unsigned int c = 0; c < ncols; ++c) {
+			auto &p = row[c];
+			p.ulPropTag = cols[c];
+			if (PROP_TYPE(cols[c]) == PT_LONG) {
+				p.__union = SOAP_UNION_propValData_ul;
+				p.Value.ul = cols[c] == PR_MESSAGE_FLAGS ? rng() % 4 :
+				             cols[c] == PR_IMPORTANCE ? rng() % 3 : rng() % 200000;
+				continue;
+			}
+			if (rng() % 20 == 0) {
+				/* Not found: what QueryRowData returns for a missing column */
+				p.ulPropTag = PROP_TAG(PT_ERROR, PROP_ID(cols[c]));
+				p.__union = SOAP_UNION_propValData_ul;
+				p.Value.ul = KCERR_NOT_FOUND;
+				continue;
+			}
+			p.__union = SOAP_UNION_propValData_lpszA;
+			p.Value.lpszA = const_cast<char *>(cols[c] == PR_SUBJECT_W ?
+			                subjects[rng() % ARRAY_SIZE(subjects)] :
+			                names[rng() % ARRAY_SIZE(names)]);
+		}
+	}
+}
+
+static long long elapsed_ms(const std::chrono::steady_clock::time_point &start)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool bench(const char *name, const struct restrictTable *rt,
+    std::vector<propValArray> &rows, const struct propTagArray *tags,
+    const ECLocale &locale)
+{
+	std::vector<char> ref(rows.size());
+	size_t nref = 0, ncomp = 0;
+	bool ok = true;
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < rows.size(); ++i) {
+		bool m = false;
+		if (ECGenericObjectTable::MatchRowRestrict(nullptr, &rows[i], rt, nullptr, locale, &m) != erSuccess)
+			m = false;
+		ref[i] = m;
+		nref += m;
+	}
+	auto t_interp = elapsed_ms(start);
+
+	start = std::chrono::steady_clock::now();
+	ECCompiledRestriction prog;
+	if (prog.Compile(rt, locale, tags) != erSuccess) {
+		fprintf(stderr, "%s: compile failed\n", name);
+		return false;
+	}
+	for (size_t i = 0; i < rows.size(); ++i) {
+		bool m = false;
+		if (prog.Match(nullptr, &rows[i], nullptr, &m) != erSuccess)
+			m = false;
+		if (m != static_cast<bool>(ref[i]) && ok) {
+			fprintf(stderr, "%s: row %zu: interpreter %d, compiled %d\n", name, i, ref[i], m);
+			ok = false;
+		}
+		ncomp += m;
+	}
+	auto t_comp = elapsed_ms(start);
+
+	printf("%-24s %8zu/%zu rows: interpreter %6lld ms, compiled %6lld ms (%.1fx)\n",
+	       name, ncomp, rows.size(), t_interp, t_comp,
+	       t_comp == 0 ? 0.0 : static_cast<double>(t_interp) / t_comp);
+	return ok && nref == ncomp;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nrows = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 1000000;
+	rng.seed(argc >= 3 ? strtoul(argv[2], nullptr, 0) : 1);
+
+	std::vector<propVal> vals;
+	std::vector<propValArray> rows;
+	make_rows(nrows, vals, rows);
+	struct propTagArray tags;
+	tags.__ptr = const_cast<unsigned int *>(cols);
+	tags.__size = ARRAY_SIZE(cols);
+	auto locale = createLocaleFromName("");
+
+	const struct {
+		const char *name;
+		struct restrictTable *rt;
+	} cases[] = {
+		{"unread+large", r_list(RES_AND, {
+			r_bitmask(BMR_EQZ, PR_MESSAGE_FLAGS, MSGFLAG_READ),
+			r_prop(RELOP_GT, long_val(PR_MESSAGE_SIZE, 150000))})},
+		{"subject~report", r_content(FL_SUBSTRING | FL_IGNORECASE, PR_SUBJECT_W, "REPORT")},
+		{"subject^gruesse", r_content(FL_PREFIX | FL_IGNORECASE, PR_SUBJECT_W, "GRÜßE")},
+		{"sender==alice", r_prop(RELOP_EQ, str_val(PR_SENDER_NAME_W, "Alice Example"))},
+		{"to<m", r_prop(RELOP_LT, str_val(PR_DISPLAY_TO_W, "m"))},
+		{"subject=~^re:", r_prop(RELOP_RE, str_val(PR_SUBJECT_W, "^re:"))},
+		{"mixed", r_list(RES_AND, {
+			r_content(FL_SUBSTRING | FL_IGNORECASE, PR_SUBJECT_W, "status"),
+			r_list(RES_OR, {
+				r_prop(RELOP_EQ, str_val(PR_SENDER_NAME_W, "Mallory")),
+				r_prop(RELOP_EQ, long_val(PR_IMPORTANCE, 2))}),
+			r_not(r_exist(PR_DISPLAY_TO_W)),
+			r_bitmask(BMR_NEZ, PR_MESSAGE_FLAGS, MSGFLAG_READ)})},
+	};
+
+	bool ok = true;
+	for (const auto &c : cases)
+		ok &= bench(c.name, c.rt, rows, &tags, locale);
+	if (!ok)
+		fprintf(stderr, "interpreter and compiled restriction disagree\n");
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,495 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+/*
+ * Runs ECS3Attachment against a minimal in-process S3 stand-in: single and
+ * multipart uploads, plain and ranged reads, deletes. With "-b size count",
+ * reports upload/download throughput instead.
+ *
+ * The stand-in speaks just enough path-style S3 for libs3: PUT/GET/HEAD/
+ * DELETE on objects (GET honours Range), and the multipart upload calls.
+ * Request signatures are not checked.
+ */
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <strings.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef HAVE_LIBS3_H
+#include <kopano/platform.h>
+#include <kopano/ECConfig.h>
+#include <mapitags.h>
+#include <ECSerializer.h>
+#include <SOAPAlloc.h>
+#include "ECAttachmentStorage.h"
+#include "ECS3Attachment.h"
+
+using namespace KC;
+using namespace std::chrono;
+
+class fake_s3 final {
+	public:
+	fake_s3();
+	~fake_s3();
+	unsigned int port() const { return m_port; }
+	std::atomic<unsigned int> m_conns{0}, m_reqs{0}, m_parts{0}, m_ranges{0};
+
+	private:
+	struct request {
+		std::string method, path, query, body;
+		std::map<std::string, std::string> hdr;
+	};
+	struct response {
+		int code = 200;
+		std::string body, extra;
+		size_t clen = SIZE_MAX;
+	};
+	void accept_loop();
+	void serve(int fd);
+	bool read_request(int fd, std::string &buf, request &);
+	void handle(request &, response &);
+	void reply(int fd, const response &);
+	static std::string qparam(const std::string &query, const char *name);
+
+	int m_fd = -1;
+	unsigned int m_port = 0;
+	std::thread m_thr;
+	std::mutex m_lock;
+	std::vector<std::thread> m_workers;
+	std::vector<int> m_conn_fds;
+	std::map<std::string, std::string> m_obj;
+	std::map<std::string, std::map<unsigned int, std::string>> m_uploads;
+	unsigned int m_next_upload = 0;
+};
+
+fake_s3::fake_s3()
+{
+	m_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sa{};
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t sl = sizeof(sa);
+	if (m_fd < 0 || bind(m_fd, reinterpret_cast<struct sockaddr *>(&sa), sl) < 0 ||
+	    listen(m_fd, 64) < 0 ||
+	    getsockname(m_fd, reinterpret_cast<struct sockaddr *>(&sa), &sl) < 0) {
+		perror("fake_s3");
+		exit(EXIT_FAILURE);
+	}
+	m_port = ntohs(sa.sin_port);
+	m_thr = std::thread(&fake_s3::accept_loop, this);
+}
+
+fake_s3::~fake_s3()
+{
+	shutdown(m_fd, SHUT_RDWR);
+	m_thr.join();
+	close(m_fd);
+	{
+		std::lock_guard<std::mutex> lk(m_lock);
+		for (auto fd : m_conn_fds)
+			shutdown(fd, SHUT_RDWR);
+	}
+	for (auto &t : m_workers)
+		t.join();
+}
+
+void fake_s3::accept_loop()
+{
+	while (true) {
+		int fd = accept(m_fd, nullptr, nullptr);
+		if (fd < 0)
+			return;
+		++m_conns;
+		std::lock_guard<std::mutex> lk(m_lock);
+		m_conn_fds.push_back(fd);
+		m_workers.emplace_back(&fake_s3::serve, this, fd);
+	}
+}
+
+void fake_s3::serve(int fd)
+{
+	std::string buf;
+	request rq;
+	while (read_request(fd, buf, rq)) {
+		response rs;
+		++m_reqs;
+		handle(rq, rs);
+		reply(fd, rs);
+	}
+	close(fd);
+}
+
+bool fake_s3::read_request(int fd, std::string &buf, request &rq)
+{
+	char chunk[65536];
+	size_t eoh;
+	while ((eoh = buf.find("\r\n\r\n")) == std::string::npos) {
+		auto ret = read(fd, chunk, sizeof(chunk));
+		if (ret <= 0)
+			return false;
+		buf.append(chunk, ret);
+	}
+	rq = request();
+	auto line_end = buf.find("\r\n");
+	auto rline = buf.substr(0, line_end);
+	auto sp1 = rline.find(' '), sp2 = rline.rfind(' ');
+	rq.method = rline.substr(0, sp1);
+	auto target = rline.substr(sp1 + 1, sp2 - sp1 - 1);
+	auto qm = target.find('?');
+	rq.path = target.substr(0, qm);
+	if (qm != std::string::npos)
+		rq.query = target.substr(qm + 1);
+	for (auto pos = line_end + 2; pos < eoh; ) {
+		auto end = buf.find("\r\n", pos);
+		auto colon = buf.find(':', pos);
+		if (colon < end) {
+			auto name = buf.substr(pos, colon - pos);
+			for (auto &c : name)
+				c = tolower(c);
+			auto v = colon + 1;
+			while (v < end && buf[v] == ' ')
+				++v;
+			rq.hdr[name] = buf.substr(v, end - v);
+		}
+		pos = end + 2;
+	}
+	buf.erase(0, eoh + 4);
+
+	size_t clen = 0;
+	auto i = rq.hdr.find("content-length");
+	if (i != rq.hdr.end())
+		clen = strtoull(i->second.c_str(), nullptr, 10);
+	i = rq.hdr.find("expect");
+	if (clen > 0 && i != rq.hdr.end() && strcasecmp(i->second.c_str(), "100-continue") == 0) {
+		static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+		if (write(fd, cont, strlen(cont)) < 0)
+			return false;
+	}
+	while (buf.size() < clen) {
+		auto ret = read(fd, chunk, sizeof(chunk));
+		if (ret <= 0)
+			return false;
+		buf.append(chunk, ret);
+	}
+	rq.body = buf.substr(0, clen);
+	buf.erase(0, clen);
+	return true;
+}
+
+void fake_s3::reply(int fd, const response &rs)
+{
+	auto code = rs.code;
+	const char *text = code == 200 ? "OK" : code == 204 ? "No Content" :
+	                   code == 206 ? "Partial Content" : code == 404 ? "Not Found" :
+	                   "Bad Request";
+	auto msg = "HTTP/1.1 " + std::to_string(code) + " " + text + "\r\n" +
+	           "Content-Length: " + std::to_string(rs.clen != SIZE_MAX ? rs.clen : rs.body.size()) + "\r\n" +
+	           rs.extra + "\r\n" + rs.body;
+	for (size_t off = 0; off < msg.size(); ) {
+		auto ret = write(fd, msg.data() + off, msg.size() - off);
+		if (ret <= 0)
+			return;
+		off += ret;
+	}
+}
+
+std::string fake_s3::qparam(const std::string &query, const char *name)
+{
+	auto key = std::string(name) + "=";
+	for (size_t pos = 0; pos < query.size(); ) {
+		auto end = query.find('&', pos);
+		if (end == std::string::npos)
+			end = query.size();
+		if (query.compare(pos, key.size(), key) == 0)
+			return query.substr(pos + key.size(), end - pos - key.size());
+		pos = end + 1;
+	}
+	return "";
+}
+
+static std::string xml_value(const std::string &s, size_t &pos, const char *tag)
+{
+	auto open = std::string("<") + tag + ">", close = std::string("</") + tag + ">";
+	auto a = s.find(open, pos);
+	if (a == std::string::npos)
+		return "";
+	a += open.size();
+	auto b = s.find(close, a);
+	pos = b + close.size();
+	return s.substr(a, b - a);
+}
+
+void fake_s3::handle(request &rq, response &rs)
+{
+	auto upload_id = qparam(rq.query, "uploadId");
+	std::lock_guard<std::mutex> lk(m_lock);
+
+	if (rq.method == "POST" && rq.query == "uploads") {
+		auto id = std::to_string(++m_next_upload);
+		m_uploads[id];
+		rs.body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+			"<InitiateMultipartUploadResult><Bucket>b</Bucket><Key>" + rq.path +
+			"</Key><UploadId>" + id + "</UploadId></InitiateMultipartUploadResult>";
+		return;
+	}
+	if (!upload_id.empty()) {
+		auto up = m_uploads.find(upload_id);
+		if (up == m_uploads.end()) {
+			rs.code = 404;
+			return;
+		}
+		if (rq.method == "PUT") {
+			unsigned int num = strtoul(qparam(rq.query, "partNumber").c_str(), nullptr, 10);
+			rs.extra = "ETag: \"" + std::to_string(num) + "-" + std::to_string(rq.body.size()) + "\"\r\n";
+			up->second[num] = std::move(rq.body);
+			++m_parts;
+			return;
+		} else if (rq.method == "DELETE") {
+			m_uploads.erase(up);
+			rs.code = 204;
+			return;
+		}
+		/* POST: complete */
+		std::string data;
+		for (size_t pos = 0; ; ) {
+			auto num = xml_value(rq.body, pos, "PartNumber");
+			if (num.empty())
+				break;
+			auto etag = xml_value(rq.body, pos, "ETag");
+			auto part = up->second.find(strtoul(num.c_str(), nullptr, 10));
+			if (part == up->second.end() ||
+			    etag != "\"" + num + "-" + std::to_string(part->second.size()) + "\"") {
+				rs.code = 400;
+				return;
+			}
+			data += part->second;
+		}
+		m_obj[rq.path] = std::move(data);
+		m_uploads.erase(up);
+		rs.body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+			"<CompleteMultipartUploadResult><Location>" + rq.path +
+			"</Location><Bucket>b</Bucket><Key>" + rq.path +
+			"</Key><ETag>\"mp\"</ETag></CompleteMultipartUploadResult>";
+		return;
+	}
+	if (rq.method == "PUT") {
+		m_obj[rq.path] = std::move(rq.body);
+		rs.extra = "ETag: \"obj\"\r\n";
+		return;
+	} else if (rq.method == "DELETE") {
+		m_obj.erase(rq.path);
+		rs.code = 204;
+		return;
+	}
+	auto obj = m_obj.find(rq.path);
+	if (obj == m_obj.end()) {
+		rs.code = 404;
+		return;
+	}
+	if (rq.method == "HEAD") {
+		rs.clen = obj->second.size();
+		return;
+	}
+	auto range = rq.hdr.find("range");
+	if (range == rq.hdr.end()) {
+		rs.body = obj->second;
+		return;
+	}
+	size_t first = 0, last = 0;
+	if (sscanf(range->second.c_str(), "bytes=%zu-%zu", &first, &last) != 2 ||
+	    first > last || last >= obj->second.size()) {
+		rs.code = 400;
+		return;
+	}
+	++m_ranges;
+	rs.code = 206;
+	rs.body = obj->second.substr(first, last - first + 1);
+	rs.extra = "Content-Range: bytes " + std::to_string(first) + "-" +
+		std::to_string(last) + "/" + std::to_string(obj->second.size()) + "\r\n";
+}
+
+class mem_serializer final : public ECSerializer {
+	public:
+	virtual ECRESULT SetBuffer(void *) override { return KCERR_NO_SUPPORT; }
+	virtual ECRESULT Write(const void *p, size_t z, size_t n) override
+	{
+		m_buf.append(static_cast<const char *>(p), z * n);
+		return erSuccess;
+	}
+	virtual ECRESULT Read(void *p, size_t z, size_t n) override
+	{
+		if (m_rpos + z * n > m_buf.size())
+			return KCERR_CALL_FAILED;
+		memcpy(p, m_buf.data() + m_rpos, z * n);
+		m_rpos += z * n;
+		return erSuccess;
+	}
+	virtual ECRESULT Skip(size_t z, size_t n) override { m_rpos += z * n; return erSuccess; }
+	virtual ECRESULT Flush() override { return erSuccess; }
+	virtual ECRESULT Stat(unsigned int *r, unsigned int *w) override
+	{
+		if (r != nullptr)
+			*r = m_rpos;
+		if (w != nullptr)
+			*w = m_buf.size();
+		return erSuccess;
+	}
+	std::string m_buf;
+	size_t m_rpos = 0;
+};
+
+namespace KC {
+
+class s3_fake_test {
+	public:
+	static int check(ECS3Attachment *, fake_s3 &);
+	static int bench(ECS3Attachment *, size_t size, unsigned int count);
+};
+
+#define T(expr) do { \
+		if (!(expr)) { \
+			fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #expr); \
+			return EXIT_FAILURE; \
+		} \
+	} while (false)
+
+static std::string random_data(size_t size)
+{
+	std::string s(size, '\0');
+	std::mt19937 gen(size);
+	for (auto &c : s)
+		c = gen();
+	return s;
+}
+
+int s3_fake_test::check(ECS3Attachment *att, fake_s3 &srv)
+{
+	static const size_t sizes[] = {0, 1, 100000, 16 << 20, (40 << 20) + 123};
+	unsigned int id = 0;
+
+	for (auto size : sizes) {
+		auto data = random_data(size);
+		auto ptr = reinterpret_cast<unsigned char *>(&data[0]);
+		for (bool from_sink : {false, true}) {
+			ext_siid ins(++id);
+			size_t got_size = 0;
+			if (from_sink) {
+				mem_serializer src;
+				src.m_buf = data;
+				T(att->SaveAttachmentInstance(ins, PROP_ID(PR_ATTACH_DATA_BIN), size, &src) == erSuccess);
+			} else {
+				T(att->SaveAttachmentInstance(ins, PROP_ID(PR_ATTACH_DATA_BIN), size, ptr) == erSuccess);
+			}
+			T(att->GetSizeInstance(ins, &got_size) == erSuccess);
+			T(got_size == size);
+
+			unsigned char *buf = nullptr;
+			T(att->LoadAttachmentInstance(nullptr, ins, &got_size, &buf) == erSuccess);
+			T(got_size == size && memcmp(buf, data.data(), size) == 0);
+			s_free(nullptr, buf);
+
+			mem_serializer sink;
+			T(att->LoadAttachmentInstance(ins, &got_size, &sink) == erSuccess);
+			T(got_size == size && sink.m_buf == data);
+
+			T(att->DeleteAttachmentInstance(ins, false) == erSuccess);
+			T(att->GetSizeInstance(ins, &got_size) == KCERR_NOT_FOUND);
+		}
+	}
+	/* The two large objects went through the multipart and ranged paths */
+	T(srv.m_parts > 0);
+	T(srv.m_ranges > 0);
+	printf("ok: %u requests over %u connections, %u parts, %u ranges\n",
+		srv.m_reqs.load(), srv.m_conns.load(), srv.m_parts.load(),
+		srv.m_ranges.load());
+	return EXIT_SUCCESS;
+}
+
+int s3_fake_test::bench(ECS3Attachment *att, size_t size, unsigned int count)
+{
+	auto data = random_data(size);
+	auto ptr = reinterpret_cast<unsigned char *>(&data[0]);
+
+	auto start = steady_clock::now();
+	for (unsigned int i = 0; i < count; ++i) {
+		ext_siid ins(i + 1);
+		T(att->SaveAttachmentInstance(ins, PROP_ID(PR_ATTACH_DATA_BIN), size, ptr) == erSuccess);
+	}
+	auto put = duration_cast<duration<double>>(steady_clock::now() - start).count();
+	start = steady_clock::now();
+	for (unsigned int i = 0; i < count; ++i) {
+		mem_serializer sink;
+		size_t got_size = 0;
+		T(att->LoadAttachmentInstance(ext_siid(i + 1), &got_size, &sink) == erSuccess);
+		T(got_size == size);
+	}
+	auto get = duration_cast<duration<double>>(steady_clock::now() - start).count();
+	double mb = static_cast<double>(size) * count / 1048576;
+	printf("%u x %zu bytes: put %.1f MB/s, get %.1f MB/s\n",
+		count, size, mb / put, mb / get);
+	return EXIT_SUCCESS;
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+	fake_s3 srv;
+	auto host = "127.0.0.1:" + std::to_string(srv.port());
+	const configsetting_t settings[] = {
+		{"attachment_storage", "s3"},
+		{"attachment_path", "kopano"},
+		{"attachment_compression", "0"},
+		{"attachment_s3_hostname", host.c_str()},
+		{"attachment_s3_protocol", "http"},
+		{"attachment_s3_uristyle", "path"},
+		{"attachment_s3_accesskeyid", "key"},
+		{"attachment_s3_secretaccesskey", "secret"},
+		{"attachment_s3_bucketname", "bucket"},
+		{"attachment_s3_region", ""},
+		{nullptr, nullptr},
+	};
+	std::shared_ptr<ECConfig> cfg(ECConfig::Create(settings));
+
+	ECAttachmentConfig *acfg = nullptr;
+	if (ECAttachmentConfig::create(GUID{}, cfg, &acfg) != erSuccess) {
+		fprintf(stderr, "S3 attachment storage unavailable (libs3.so.4 missing?)\n");
+		return 77;
+	}
+	std::unique_ptr<ECAttachmentConfig> acfg_hold(acfg);
+	std::unique_ptr<ECAttachmentStorage> att(acfg->new_handle(nullptr));
+	auto s3 = static_cast<ECS3Attachment *>(att.get());
+	int ret;
+	if (argc >= 4 && strcmp(argv[1], "-b") == 0)
+		ret = s3_fake_test::bench(s3, strtoull(argv[2], nullptr, 0), strtoul(argv[3], nullptr, 0));
+	else
+		ret = s3_fake_test::check(s3, srv);
+	/* Drop pooled connections before the stand-in goes away */
+	att.reset();
+	acfg_hold.reset();
+	return ret;
+}
+
+#else
+
+int main()
+{
+	fprintf(stderr, "Not built with libs3\n");
+	return 77;
+}
+
+#endif
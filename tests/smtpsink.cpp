@@ -0,0 +1,327 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+/*
+ * A minimal SMTP sink: it accepts everything (EHLO with PIPELINING, MAIL,
+ * RCPT, DATA, RSET, NOOP, QUIT), throws the mail away and counts messages,
+ * connections and pipelined command batches. Every reply can be delayed to
+ * stand in for a distant relay.
+ *
+ * "smtpsink -l port [delay_ms]" runs the sink on its own, e.g. as the
+ * smtp_server of a kopano-spooler throughput test, printing the counters
+ * every ten seconds.
+ *
+ * Without -l, it sends one message through IMToINet to an in-process sink
+ * from a number of threads, with connection reuse off and on (as the
+ * spooler does with process_model=thread), and reports the rates. That
+ * needs a running server; KOPANO_SOCKET selects the server.
+ *
+ * Usage: smtpsink [messages [threads [delay_ms]]]
+ *        smtpsink -l port [delay_ms]
+ */
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <kopano/platform.h>
+#include <kopano/automapi.hpp>
+#include <kopano/MAPIErrors.h>
+#include <kopano/memory.hpp>
+#include <inetmapi/inetmapi.h>
+#include <inetmapi/options.h>
+#include <mapi.h>
+#include <mapidefs.h>
+#include <mapitags.h>
+#include <mapiutil.h>
+#include "tbi.hpp"
+
+using namespace KC;
+
+class smtp_sink final {
+	public:
+	smtp_sink(unsigned int port, unsigned int delay_ms);
+	~smtp_sink();
+	unsigned int port() const { return m_port; }
+	void print(const char *what) const;
+	std::atomic<unsigned int> m_conns{0}, m_msgs{0}, m_batches{0};
+
+	private:
+	void accept_loop();
+	void serve(int fd);
+	bool say(int fd, const char *line);
+
+	int m_fd = -1;
+	unsigned int m_port = 0, m_delay;
+	std::thread m_thr;
+	std::mutex m_lock;
+	std::vector<std::thread> m_workers;
+	std::vector<int> m_conn_fds;
+};
+
+smtp_sink::smtp_sink(unsigned int port, unsigned int delay_ms) :
+	m_delay(delay_ms)
+{
+	m_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sa{};
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(port);
+	socklen_t sl = sizeof(sa);
+	int y = 1;
+	if (m_fd >= 0)
+		setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y));
+	if (m_fd < 0 || bind(m_fd, reinterpret_cast<struct sockaddr *>(&sa), sl) < 0 ||
+	    listen(m_fd, 64) < 0 ||
+	    getsockname(m_fd, reinterpret_cast<struct sockaddr *>(&sa), &sl) < 0) {
+		perror("smtp_sink");
+		exit(EXIT_FAILURE);
+	}
+	m_port = ntohs(sa.sin_port);
+	m_thr = std::thread(&smtp_sink::accept_loop, this);
+}
+
+smtp_sink::~smtp_sink()
+{
+	shutdown(m_fd, SHUT_RDWR);
+	m_thr.join();
+	close(m_fd);
+	{
+		std::lock_guard<std::mutex> lk(m_lock);
+		for (auto fd : m_conn_fds)
+			shutdown(fd, SHUT_RDWR);
+	}
+	for (auto &t : m_workers)
+		t.join();
+}
+
+void smtp_sink::print(const char *what) const
+{
+	printf("%s: %u connections, %u messages, %u pipelined batches\n",
+	       what, m_conns.load(), m_msgs.load(), m_batches.load());
+	fflush(stdout);
+}
+
+void smtp_sink::accept_loop()
+{
+	while (true) {
+		int fd = accept(m_fd, nullptr, nullptr);
+		if (fd < 0)
+			return;
+		++m_conns;
+		std::lock_guard<std::mutex> lk(m_lock);
+		m_conn_fds.push_back(fd);
+		m_workers.emplace_back(&smtp_sink::serve, this, fd);
+	}
+}
+
+bool smtp_sink::say(int fd, const char *line)
+{
+	if (m_delay != 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(m_delay));
+	std::string s = std::string(line) + "\r\n";
+	return send(fd, s.c_str(), s.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(s.size());
+}
+
+void smtp_sink::serve(int fd)
+{
+	std::string buf;
+	bool in_data = false;
+	char chunk[16384];
+
+	if (!say(fd, "220 smtpsink ESMTP"))
+		goto out;
+	while (true) {
+		auto ret = recv(fd, chunk, sizeof(chunk), 0);
+		if (ret <= 0)
+			break;
+		buf.append(chunk, ret);
+		/* More than one command in a single read means the client pipelined */
+		if (!in_data) {
+			auto first = buf.find("\r\n");
+			if (first != std::string::npos && buf.find("\r\n", first + 2) != std::string::npos)
+				++m_batches;
+		}
+		size_t pos;
+		while ((pos = buf.find("\r\n")) != std::string::npos) {
+			auto line = buf.substr(0, pos);
+			buf.erase(0, pos + 2);
+			if (in_data) {
+				if (line != ".")
+					continue;
+				in_data = false;
+				++m_msgs;
+				if (!say(fd, "250 2.0.0 Ok: queued"))
+					goto out;
+				continue;
+			}
+			const char *rs = "250 2.0.0 Ok";
+			if (strncasecmp(line.c_str(), "EHLO", 4) == 0) {
+				if (!say(fd, "250-smtpsink") || !say(fd, "250-PIPELINING") ||
+				    !say(fd, "250 8BITMIME"))
+					goto out;
+				continue;
+			} else if (strncasecmp(line.c_str(), "HELO", 4) == 0) {
+				rs = "250 smtpsink";
+			} else if (strncasecmp(line.c_str(), "DATA", 4) == 0) {
+				in_data = true;
+				rs = "354 End data with <CR><LF>.<CR><LF>";
+			} else if (strncasecmp(line.c_str(), "QUIT", 4) == 0) {
+				say(fd, "221 2.0.0 Bye");
+				goto out;
+			} else if (strncasecmp(line.c_str(), "MAIL", 4) != 0 &&
+			    strncasecmp(line.c_str(), "RCPT", 4) != 0 &&
+			    strncasecmp(line.c_str(), "RSET", 4) != 0 &&
+			    strncasecmp(line.c_str(), "NOOP", 4) != 0) {
+				rs = "502 5.5.2 Command not recognized";
+			}
+			if (!say(fd, rs))
+				goto out;
+		}
+	}
+ out:
+	close(fd);
+}
+
+static void check(HRESULT hr, const char *what)
+{
+	if (FAILED(hr)) {
+		fprintf(stderr, "%s: %s (%x)\n", what, GetMAPIErrorMessage(hr), hr);
+		throw KMAPIError(hr);
+	}
+}
+
+static object_ptr<IMessage> make_message(KStore &store)
+{
+	object_ptr<IMessage> msg;
+	auto root = store.open_root(MAPI_MODIFY);
+	check(root->CreateMessage(&IID_IMessage, 0, &~msg), "CreateMessage");
+	std::string body(4096, 'x');
+	SPropValue p[7];
+	p[0].ulPropTag = PR_SUBJECT_A;
+	p[0].Value.lpszA = const_cast<char *>("smtpsink");
+	p[1].ulPropTag = PR_BODY_A;
+	p[1].Value.lpszA = const_cast<char *>(body.c_str());
+	p[2].ulPropTag = PR_MESSAGE_CLASS_A;
+	p[2].Value.lpszA = const_cast<char *>("IPM.Note");
+	p[3].ulPropTag = PR_SENDER_NAME_A;
+	p[3].Value.lpszA = const_cast<char *>("Sender");
+	p[4].ulPropTag = PR_SENDER_ADDRTYPE_A;
+	p[4].Value.lpszA = const_cast<char *>("SMTP");
+	p[5].ulPropTag = PR_SENDER_EMAIL_ADDRESS_A;
+	p[5].Value.lpszA = const_cast<char *>("sender@example.com");
+	p[6].ulPropTag = PR_SENT_REPRESENTING_EMAIL_ADDRESS_A;
+	p[6].Value.lpszA = const_cast<char *>("sender@example.com");
+	check(msg->SetProps(ARRAY_SIZE(p), p, nullptr), "SetProps");
+
+	adrlist_ptr rcpts;
+	check(MAPIAllocateBuffer(CbNewADRLIST(3), &~rcpts), "MAPIAllocateBuffer");
+	rcpts->cEntries = 0;
+	for (unsigned int i = 0; i < 3; ++i) {
+		auto &e = rcpts->aEntries[i];
+		e.cValues = 4;
+		check(MAPIAllocateBuffer(sizeof(SPropValue) * e.cValues, reinterpret_cast<void **>(&e.rgPropVals)), "MAPIAllocateBuffer");
+		++rcpts->cEntries;
+		auto addr = "rcpt" + std::to_string(i) + "@example.com";
+		e.rgPropVals[0].ulPropTag = PR_RECIPIENT_TYPE;
+		e.rgPropVals[0].Value.ul = MAPI_TO;
+		e.rgPropVals[1].ulPropTag = PR_ADDRTYPE_A;
+		e.rgPropVals[1].Value.lpszA = const_cast<char *>("SMTP");
+		e.rgPropVals[2].ulPropTag = PR_DISPLAY_NAME_A;
+		check(MAPIAllocateMore(addr.size() + 1, e.rgPropVals, reinterpret_cast<void **>(&e.rgPropVals[2].Value.lpszA)), "MAPIAllocateMore");
+		strcpy(e.rgPropVals[2].Value.lpszA, addr.c_str());
+		e.rgPropVals[3].ulPropTag = PR_EMAIL_ADDRESS_A;
+		e.rgPropVals[3].Value.lpszA = e.rgPropVals[2].Value.lpszA;
+	}
+	check(msg->ModifyRecipients(MODRECIP_ADD, rcpts), "ModifyRecipients");
+	return msg;
+}
+
+static bool run(IMAPISession *ses, IAddrBook *ab, IMessage *msg,
+    smtp_sink &sink, unsigned int nmsg, unsigned int nthr, unsigned int pool)
+{
+	std::atomic<unsigned int> next{0}, failed{0};
+	std::vector<std::thread> thr;
+	unsigned int c0 = sink.m_conns, m0 = sink.m_msgs;
+
+	smtp_pool_configure(pool, 60);
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < nthr; ++i)
+		thr.emplace_back([&]() {
+			sending_options sopt;
+			imopt_default_sending_options(&sopt);
+			while (next++ < nmsg) {
+				std::unique_ptr<ECSender> sender(CreateSender("127.0.0.1", sink.port()));
+				if (IMToINet(ses, ab, msg, sender.get(), sopt) != hrSuccess)
+					++failed;
+			}
+		});
+	for (auto &t : thr)
+		t.join();
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	smtp_pool_purge(true);
+	smtp_pool_configure(0, 60);
+
+	printf("pool %2u: %u messages, %u threads: %6lld ms (%7.1f/s), %u connections, %u failed\n",
+	       pool, nmsg, nthr, static_cast<long long>(ms),
+	       ms == 0 ? 0.0 : nmsg * 1000.0 / ms, sink.m_conns - c0, failed.load());
+	return failed == 0 && sink.m_msgs - m0 == nmsg;
+}
+
+static int listen_only(unsigned int port, unsigned int delay)
+{
+	smtp_sink sink(port, delay);
+	printf("listening on 127.0.0.1:%u\n", sink.port());
+	fflush(stdout);
+	while (true) {
+		std::this_thread::sleep_for(std::chrono::seconds(10));
+		sink.print("smtpsink");
+	}
+}
+
+int main(int argc, char **argv) try
+{
+	if (argc >= 3 && strcmp(argv[1], "-l") == 0)
+		return listen_only(strtoul(argv[2], nullptr, 0),
+		       argc >= 4 ? strtoul(argv[3], nullptr, 0) : 0);
+
+	unsigned int nmsg = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 200;
+	unsigned int nthr = argc >= 3 ? strtoul(argv[2], nullptr, 0) : 5;
+	unsigned int delay = argc >= 4 ? strtoul(argv[3], nullptr, 0) : 5;
+	if (nthr == 0)
+		nthr = 1;
+
+	AutoMAPI automapi;
+	auto hr = automapi.Initialize();
+	if (hr != hrSuccess) {
+		fprintf(stderr, "MAPIInitialize: %s\n", GetMAPIErrorMessage(hr));
+		return EXIT_FAILURE;
+	}
+	KSession ses;
+	object_ptr<IAddrBook> ab;
+	check(ses->OpenAddressBook(0, nullptr, AB_NO_DIALOG, &~ab), "OpenAddressBook");
+	auto store = ses.open_default_store();
+	auto msg = make_message(store);
+
+	smtp_sink sink(0, delay);
+	bool ok = run(ses, ab, msg, sink, nmsg, nthr, 0);
+	auto batches = sink.m_batches.load();
+	ok &= run(ses, ab, msg, sink, nmsg, nthr, nthr);
+	/* The sink advertises PIPELINING, so the envelope must have come in batches */
+	if (sink.m_batches == batches) {
+		fprintf(stderr, "no pipelined commands seen\n");
+		ok = false;
+	}
+	sink.print("total");
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+} catch (const KMAPIError &e) {
+	fprintf(stderr, "%s\n", e.what());
+	return EXIT_FAILURE;
+}
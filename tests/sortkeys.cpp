@@ -0,0 +1,199 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <kopano/platform.h>
+#include <kopano/ECKeyTable.h>
+#include <kopano/ustringutil.h>
+#include "check.hpp"
+/*
+ * This program checks the string collation of ustringutil: the ASCII
+ * fast path of u8_icompare against ICU, and the batch sort keys against
+ * the single ones. It then sorts a table by subject like a folder view
+ * sorted on PR_SUBJECT, once with a collator created for every key (as
+ * before the collators were cached), once with one key at a time and
+ * once with the keys of the column made at once.
+ *
+ * Usage: sortkeys [rows [seed]]
+ */
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+static std::mt19937 rng;
+
+static unsigned int rnd(unsigned int n)
+{
+	return std::uniform_int_distribution<unsigned int>(0, n - 1)(rng);
+}
+
+static std::string random_string(bool ascii)
+{
+	static const char *const pieces[] = {
+		"a", "A", "aa", "ch", "Ch", "ll", "z", "Z", "0", "9", "10", " ",
+		"-", "_", "'", "(", ".", "~", "@", "c", "h", "o", "O", "s",
+	};
+	static const char *const nonascii[] = {"\xc3\xa4", "\xc3\x85", "\xc5\x9b", "e\xcc\x81", "\t"};
+	std::string s;
+	for (unsigned int i = rnd(8); i > 0; --i)
+		s += !ascii && rnd(6) == 0 ? nonascii[rnd(ARRAY_SIZE(nonascii))] : pieces[rnd(ARRAY_SIZE(pieces))];
+	return s;
+}
+
+/* u8_icompare as it was, with a collator of its own */
+static int icu_icompare(const char *s1, const char *s2, const ECLocale &loc)
+{
+	UErrorCode status = U_ZERO_ERROR;
+	std::unique_ptr<icu::Collator> coll(icu::Collator::createInstance(loc, status));
+	auto a = icu::UnicodeString::fromUTF8(s1), b = icu::UnicodeString::fromUTF8(s2);
+	a.foldCase();
+	b.foldCase();
+	return coll->compare(a, b, status);
+}
+
+/* createSortKeyDataFromUTF8 as it was */
+static std::string icu_sortkey(const char *s, int ncap, const ECLocale &loc)
+{
+	auto u = icu::UnicodeString::fromUTF8(s);
+	if (ncap > 1)
+		u.truncate(ncap);
+	if (u.startsWith("'") || u.startsWith("("))
+		u.remove(0, 1);
+	UErrorCode status = U_ZERO_ERROR;
+	std::unique_ptr<icu::Collator> coll(icu::Collator::createInstance(loc, status));
+	icu::CollationKey key;
+	coll->getCollationKey(u, key, status);
+	int32_t len = 0;
+	auto data = key.getByteArray(len);
+	return std::string(reinterpret_cast<const char *>(data), len);
+}
+
+static bool collation(const char *name)
+{
+	auto loc = createLocaleFromName(name);
+	std::vector<std::string> strs;
+	std::vector<const char *> column;
+	for (unsigned int i = 0; i < 2000; ++i)
+		strs.emplace_back(random_string(i % 4 != 0));
+	for (const auto &s : strs)
+		column.emplace_back(s.c_str());
+	column.emplace_back(nullptr);
+
+	for (unsigned int i = 0; i < strs.size(); ++i) {
+		auto &a = strs[i], &b = strs[rnd(strs.size())];
+		auto want = icu_icompare(a.c_str(), b.c_str(), loc);
+		auto got = u8_icompare(a.c_str(), b.c_str(), loc);
+		if (got != want)
+			fprintf(stderr, "%s: \"%s\" vs \"%s\": %d, ICU says %d\n",
+			        name, a.c_str(), b.c_str(), got, want);
+		CHECK(got == want);
+	}
+	auto keys = createSortKeyDataFromUTF8(column, 255, loc);
+	CHECK(keys.size() == column.size() && keys.back().empty());
+	for (unsigned int i = 0; i < strs.size(); ++i) {
+		CHECK(keys[i] == createSortKeyDataFromUTF8(column[i], 255, loc));
+		CHECK(keys[i] == icu_sortkey(column[i], 255, loc));
+	}
+	return true;
+}
+
+static long long sort_table(std::vector<std::string> (*make_keys)(const std::vector<const char *> &, const ECLocale &),
+    const std::vector<const char *> &subjects, const ECLocale &loc,
+    std::vector<unsigned int> *order, long long *t_keys)
+{
+	auto start = clk::now();
+	auto keys = make_keys(subjects, loc);
+	*t_keys = std::chrono::duration_cast<std::chrono::milliseconds>(clk::now() - start).count();
+	ECKeyTable table;
+	for (unsigned int i = 0; i < keys.size(); ++i) {
+		sObjectTableKey row(i + 1, 0), prev;
+		std::vector<ECSortCol> cols(1);
+		cols[0].key = std::move(keys[i]);
+		cols[0].flags = TABLEROW_FLAG_STRING;
+		table.UpdateRow(ECKeyTable::TABLE_ROW_ADD, &row, std::move(cols), &prev);
+	}
+	ECObjectTableList rows;
+	table.SeekRow(ECKeyTable::EC_SEEK_SET, 0, nullptr);
+	table.QueryRows(subjects.size(), &rows, false, 0);
+	order->clear();
+	for (const auto &r : rows)
+		order->emplace_back(r.ulObjId);
+	return std::chrono::duration_cast<std::chrono::milliseconds>(clk::now() - start).count();
+}
+
+static std::vector<std::string> keys_uncached(const std::vector<const char *> &s, const ECLocale &loc)
+{
+	std::vector<std::string> keys;
+	for (auto p : s)
+		keys.emplace_back(icu_sortkey(p, 255, loc));
+	return keys;
+}
+
+static std::vector<std::string> keys_single(const std::vector<const char *> &s, const ECLocale &loc)
+{
+	std::vector<std::string> keys;
+	for (auto p : s)
+		keys.emplace_back(createSortKeyDataFromUTF8(p, 255, loc));
+	return keys;
+}
+
+static std::vector<std::string> keys_batch(const std::vector<const char *> &s, const ECLocale &loc)
+{
+	return createSortKeyDataFromUTF8(s, 255, loc);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nrows = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 100000;
+	rng.seed(argc >= 3 ? strtoul(argv[2], nullptr, 0) : 1);
+
+	for (auto name : {"en_US", "de_DE", "da_DK", "cs_CZ", "es_ES", "sv_SE", "fr_FR", "ja_JP", "tr_TR"})
+		if (!collation(name))
+			return EXIT_FAILURE;
+
+	static const char *const words[] = {
+		"Meeting", "agenda", "Quarterly", "report", "lunch", "Project",
+		"status", "invoice", "Überblick", "release", "notes", "Déjà", "vu",
+	};
+	auto loc = createLocaleFromName("en_US");
+	std::vector<std::string> subjects;
+	std::vector<const char *> column;
+	for (unsigned int i = 0; i < nrows; ++i) {
+		std::string s = rnd(3) == 0 ? "RE: " : "";
+		for (unsigned int j = 1 + rnd(5); j > 0; --j)
+			s += std::string(words[rnd(ARRAY_SIZE(words))]) + " ";
+		subjects.emplace_back(s + std::to_string(rnd(nrows)));
+	}
+	for (const auto &s : subjects)
+		column.emplace_back(s.c_str());
+
+	std::vector<unsigned int> o1, o2, o3;
+	long long k_uncached, k_single, k_batch;
+	auto t_uncached = sort_table(keys_uncached, column, loc, &o1, &k_uncached);
+	auto t_single = sort_table(keys_single, column, loc, &o2, &k_single);
+	auto t_batch = sort_table(keys_batch, column, loc, &o3, &k_batch);
+	if (o1 != o2 || o1 != o3 || o1.size() != nrows) {
+		fprintf(stderr, "tables sorted differently\n");
+		return EXIT_FAILURE;
+	}
+
+	auto start = clk::now();
+	for (unsigned int i = 0; i + 1 < nrows; ++i)
+		icu_icompare(column[i], column[i+1], loc);
+	long long t_cmp_uncached = std::chrono::duration_cast<std::chrono::milliseconds>(clk::now() - start).count();
+	start = clk::now();
+	for (unsigned int i = 0; i + 1 < nrows; ++i)
+		u8_icompare(column[i], column[i+1], loc);
+	long long t_cmp = std::chrono::duration_cast<std::chrono::milliseconds>(clk::now() - start).count();
+	printf("%u rows sorted by subject (of which sort keys):\n"
+	       "  collator per key %lld ms (%lld ms), cached collator %lld ms (%lld ms), batch %lld ms (%lld ms)\n",
+	       nrows, t_uncached, k_uncached, t_single, k_single, t_batch, k_batch);
+	printf("%u comparisons: collator per call %lld ms, cached collator %lld ms\n",
+	       nrows - 1, t_cmp_uncached, t_cmp);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <kopano/platform.h>
+#include <kopano/ustringutil.h>
+#include "ECTableSnapshots.h"
+#include "check.hpp"
+/*
+ * This program checks the sort keys shared between the tables of sessions
+ * that show the same folder view: rows added by one reader are seen by the
+ * next, changes drop them, keys computed before a change are not kept,
+ * readers keep their version across a change, and the size limit holds.
+ * It then opens one folder in a number of sessions, each collating the
+ * subjects of all rows, with and without the shared keys.
+ *
+ * Usage: tablesnap [rows [sessions]]
+ */
+
+using namespace KC;
+using rowmap = ECTableSnapshots::rowmap;
+
+static std::vector<ECSortCol> keys_for(unsigned int id)
+{
+	std::vector<ECSortCol> k(1);
+	k[0].key = "row" + std::to_string(id);
+	return k;
+}
+
+static rowmap rows_for(unsigned int first, unsigned int n)
+{
+	rowmap m;
+	for (unsigned int i = first; i < first + n; ++i)
+		m.emplace(sObjectTableKey(i, 0), keys_for(i));
+	return m;
+}
+
+static bool basics()
+{
+	ECTableSnapshots s(1 << 20, nullptr);
+	ECTableSnapshotKey k, k2;
+	uint64_t gen, gen2;
+	k.folder = 10;
+	k.sort = "0x37001F:0,";
+	k2 = k;
+	k2.sort = "0xE060040:1,";
+
+	auto r = s.get(k, &gen);
+	CHECK(r != nullptr && r->empty());
+	s.put(k, gen, rows_for(1, 5), 0);
+	r = s.get(k, &gen);
+	CHECK(r->size() == 5 && r->at(sObjectTableKey(3, 0))[0].key == "row3");
+
+	/* A change drops the rows in every view of the folder */
+	s.get(k2, &gen2);
+	s.put(k2, gen2, rows_for(1, 5), 0);
+	auto held = s.get(k, &gen);
+	s.update(ECKeyTable::TABLE_ROW_MODIFY, 10, {3});
+	CHECK(held->size() == 5);
+	r = s.get(k, &gen2);
+	CHECK(r->size() == 4 && r->find(sObjectTableKey(3, 0)) == r->cend());
+	CHECK(s.get(k2, &gen2)->size() == 4);
+
+	/* Keys read before the change are not taken */
+	s.put(k, gen, rows_for(3, 1), 0);
+	CHECK(s.get(k, &gen)->size() == 4);
+	s.put(k, gen, rows_for(3, 1), 0);
+	CHECK(s.get(k, &gen)->size() == 5);
+
+	/* Other folders are not touched */
+	s.update(ECKeyTable::TABLE_ROW_DELETE, 11, {1, 2});
+	CHECK(s.get(k, &gen)->size() == 5);
+	s.update(ECKeyTable::TABLE_CHANGE, 10, {});
+	CHECK(s.get(k, &gen)->empty());
+
+	/* Size limit; the view just filled stays */
+	ECTableSnapshots small(16384, nullptr);
+	for (unsigned int f = 1; f <= 20; ++f) {
+		k.folder = f;
+		small.get(k, &gen);
+		small.put(k, gen, rows_for(1, 50), 0);
+		CHECK(small.get(k, &gen)->size() == 50);
+	}
+	k.folder = 1;
+	CHECK(small.get(k, &gen)->empty());
+
+	ECTableSnapshots off(0, nullptr);
+	CHECK(!off.enabled());
+	return true;
+}
+
+static long long open_folder(ECTableSnapshots *s, const std::vector<std::string> &subjects,
+    unsigned int sessions, const ECLocale &loc)
+{
+	ECTableSnapshotKey k;
+	k.folder = 1;
+	k.sort = "0x37001F:0,";
+	k.locale = loc.getName();
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int ses = 0; ses < sessions; ++ses) {
+		uint64_t gen = 0;
+		std::shared_ptr<const rowmap> snap;
+		rowmap fresh;
+		if (s != nullptr)
+			snap = s->get(k, &gen);
+		for (unsigned int i = 0; i < subjects.size(); ++i) {
+			sObjectTableKey row(i, 0);
+			std::vector<ECSortCol> keys;
+			auto hit = snap != nullptr ? snap->find(row) : rowmap::const_iterator();
+			if (snap != nullptr && hit != snap->cend()) {
+				keys = hit->second;
+			} else {
+				keys.resize(1);
+				keys[0].key = createSortKeyDataFromUTF8(subjects[i].c_str(), 255, loc);
+				keys[0].flags = TABLEROW_FLAG_STRING;
+				if (s != nullptr)
+					fresh.emplace(row, keys);
+			}
+		}
+		if (s != nullptr)
+			s->put(k, gen, std::move(fresh), 0);
+	}
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nrows = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 20000;
+	unsigned int nses = argc >= 3 ? strtoul(argv[2], nullptr, 0) : 50;
+
+	if (!basics())
+		return EXIT_FAILURE;
+
+	auto loc = createLocaleFromName("en_US");
+	std::vector<std::string> subjects;
+	for (unsigned int i = 0; i < nrows; ++i)
+		subjects.emplace_back("RE: Überblick Projekt " + std::to_string(i * 7919 % nrows));
+	ECTableSnapshots snaps(256 << 20, nullptr);
+	auto t_own = open_folder(nullptr, subjects, nses, loc);
+	auto t_shared = open_folder(&snaps, subjects, nses, loc);
+	printf("%u rows, %u sessions: own keys %lld ms, shared keys %lld ms\n",
+	       nrows, nses, t_own, t_shared);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016, Kopano and its licensors */
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <kopano/platform.h>
+#include <kopano/automapi.hpp>
+#include <kopano/MAPIErrors.h>
+#include <kopano/memory.hpp>
+#include <mapitags.h>
+#include <mapiutil.h>
+#include "check.hpp"
+#include "tbi.hpp"
+/*
+ * This program checks the table changes that the server hands to its table
+ * update workers (table_update_threads > 0): right after one session made a
+ * folder or saved a message, the open tables of another session have the
+ * new row, with the properties it was saved with. The workers read the rows
+ * on their own database connections, so they must not get a change before
+ * its transaction is committed.
+ *
+ * The rows are made in a scratch folder of the store of the logged on user,
+ * which is removed afterwards. It needs a running server; KOPANO_SOCKET
+ * selects the server.
+ *
+ * Usage: tableupd [count [user password]]
+ */
+
+using namespace KC;
+
+static void check(HRESULT hr, const char *what)
+{
+	if (FAILED(hr)) {
+		fprintf(stderr, "%s: %s (%x)\n", what, GetMAPIErrorMessage(hr), hr);
+		throw KMAPIError(hr);
+	}
+}
+
+static std::string name(const char *what, unsigned int i)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%s %06u", what, i);
+	return buf;
+}
+
+static object_ptr<IMAPIFolder> open_folder(IMsgStore *store, const SPropValue *eid)
+{
+	object_ptr<IMAPIFolder> folder;
+	ULONG type = 0;
+	check(store->OpenEntry(eid->Value.bin.cb, reinterpret_cast<const ENTRYID *>(eid->Value.bin.lpb),
+	      &IID_IMAPIFolder, MAPI_MODIFY, &type, &~folder), "OpenEntry");
+	return folder;
+}
+
+/* The rows of @table are exactly @what 0 .. @count-1 */
+static bool rows_are(IMAPITable *table, const char *what, unsigned int count)
+{
+	rowset_ptr rows;
+	check(table->SeekRow(BOOKMARK_BEGINNING, 0, nullptr), "SeekRow");
+	check(table->QueryRows(count + 1, 0, &~rows), "QueryRows");
+	CHECK(rows.size() == count);
+	for (unsigned int i = 0; i < count; ++i) {
+		CHECK(PROP_TYPE(rows[i].lpProps[0].ulPropTag) == PT_STRING8);
+		CHECK(name(what, i) == rows[i].lpProps[0].Value.lpszA);
+	}
+	return true;
+}
+
+static bool folders(IMAPIFolder *mine, IMAPIFolder *theirs, unsigned int count)
+{
+	object_ptr<IMAPITable> table;
+	check(theirs->GetHierarchyTable(0, &~table), "GetHierarchyTable");
+	static constexpr const SizedSSortOrderSet(1, order) = {1, 0, 0, {{PR_DISPLAY_NAME_A, TABLE_SORT_ASCEND}}};
+	check(table->SortTable(order, TBL_BATCH), "SortTable");
+	KTable t(std::move(table));
+	t.columns({PR_DISPLAY_NAME_A});
+	CHECK(rows_are(t, "folder", 0));
+	for (unsigned int i = 0; i < count; ++i) {
+		object_ptr<IMAPIFolder> sub;
+		auto s = name("folder", i);
+		check(mine->CreateFolder(FOLDER_GENERIC, reinterpret_cast<const TCHAR *>(s.c_str()),
+		      nullptr, &IID_IMAPIFolder, 0, &~sub), "CreateFolder");
+		CHECK(rows_are(t, "folder", i + 1));
+	}
+	return true;
+}
+
+static bool messages(IMAPIFolder *mine, IMAPIFolder *theirs, unsigned int count)
+{
+	object_ptr<IMAPITable> table;
+	check(theirs->GetContentsTable(0, &~table), "GetContentsTable");
+	static constexpr const SizedSSortOrderSet(1, order) = {1, 0, 0, {{PR_SUBJECT_A, TABLE_SORT_ASCEND}}};
+	check(table->SortTable(order, TBL_BATCH), "SortTable");
+	KTable t(std::move(table));
+	t.columns({PR_SUBJECT_A});
+	CHECK(rows_are(t, "message", 0));
+	for (unsigned int i = 0; i < count; ++i) {
+		object_ptr<IMessage> msg;
+		auto s = name("message", i);
+		check(mine->CreateMessage(&IID_IMessage, 0, &~msg), "CreateMessage");
+		SPropValue p[2];
+		p[0].ulPropTag = PR_SUBJECT_A;
+		p[0].Value.lpszA = const_cast<char *>(s.c_str());
+		p[1].ulPropTag = PR_MESSAGE_CLASS_A;
+		p[1].Value.lpszA = const_cast<char *>("IPM.Note");
+		check(msg->SetProps(2, p, nullptr), "SetProps");
+		check(msg->SaveChanges(0), "SaveChanges");
+		CHECK(rows_are(t, "message", i + 1));
+	}
+	return true;
+}
+
+int main(int argc, char **argv) try
+{
+	unsigned int count = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 200;
+	std::wstring user = L"SYSTEM", pass;
+	if (argc >= 4) {
+		user = std::wstring(argv[2], argv[2] + strlen(argv[2]));
+		pass = std::wstring(argv[3], argv[3] + strlen(argv[3]));
+	}
+	/* Rows read ahead by the client would hide what the server has */
+	setenv("KC_TABLE_READAHEAD", "0", 1);
+
+	AutoMAPI automapi;
+	auto hr = automapi.Initialize();
+	if (hr != hrSuccess) {
+		fprintf(stderr, "MAPIInitialize: %s\n", GetMAPIErrorMessage(hr));
+		return EXIT_FAILURE;
+	}
+
+	auto store = KSession(user.c_str(), pass.c_str()).open_default_store();
+	auto other = KSession(user.c_str(), pass.c_str()).open_default_store();
+	auto root = store.open_root(MAPI_MODIFY);
+	object_ptr<IMAPIFolder> folder;
+	check(root->CreateFolder(FOLDER_GENERIC, reinterpret_cast<const TCHAR *>("tableupd"),
+	      nullptr, &IID_IMAPIFolder, OPEN_IF_EXISTS, &~folder), "CreateFolder");
+	check(folder->EmptyFolder(0, nullptr, 0), "EmptyFolder");
+	memory_ptr<SPropValue> eid;
+	check(HrGetOneProp(folder, PR_ENTRYID, &~eid), "HrGetOneProp");
+	auto theirs = open_folder(other, eid);
+
+	auto ok = folders(folder, theirs, count) && messages(folder, theirs, count);
+
+	theirs.reset();
+	folder.reset();
+	root->DeleteFolder(eid->Value.bin.cb, reinterpret_cast<const ENTRYID *>(eid->Value.bin.lpb),
+		0, nullptr, DEL_FOLDERS | DEL_MESSAGES);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+} catch (const KMAPIError &e) {
+	fprintf(stderr, "%s\n", e.what());
+	return EXIT_FAILURE;
+}